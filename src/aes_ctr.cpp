@@ -0,0 +1,252 @@
+#include "aes_ctr.h"
+#include <string.h>
+
+void AesCtr::counterAt(uint64_t block, uint8_t *counter) const
+{
+  // iv + block as a 128-bit big-endian number
+  memcpy(counter, iv, AES_BLOCK_BYTES);
+  uint64_t carry = block;
+  for (int i = AES_BLOCK_BYTES - 1; i >= 0 && carry; i--)
+  {
+    uint32_t sum = counter[i] + (uint32_t)(carry & 0xFF);
+    counter[i] = (uint8_t)sum;
+    carry = (carry >> 8) + (sum >> 8);
+  }
+}
+
+#if defined(ESP_PLATFORM)
+
+AesCtr::AesCtr()
+{
+  memset(iv, 0, sizeof(iv));
+  mbedtls_aes_init(&aes);
+}
+
+AesCtr::~AesCtr()
+{
+  mbedtls_aes_free(&aes);
+}
+
+void AesCtr::setKey(const uint8_t *key, const uint8_t *nonce)
+{
+  memcpy(iv, nonce, AES_BLOCK_BYTES);
+  mbedtls_aes_setkey_enc(&aes, key, AES_KEY_BYTES * 8);
+}
+
+void AesCtr::apply(uint64_t offset, const uint8_t *in, uint8_t *out, size_t len)
+{
+  uint8_t counter[AES_BLOCK_BYTES];
+  uint8_t stream[AES_BLOCK_BYTES];
+  size_t used = offset % AES_BLOCK_BYTES;
+  counterAt(offset / AES_BLOCK_BYTES, counter);
+  if (used)
+  {
+    // Starting inside a block: mbedTLS continues from the keystream block
+    // and the counter after it
+    mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, counter, stream);
+    counterAt(offset / AES_BLOCK_BYTES + 1, counter);
+  }
+  mbedtls_aes_crypt_ctr(&aes, len, &used, counter, stream, in, out);
+}
+
+const char *AesCtr::backend()
+{
+  return "mbedtls";
+}
+
+#else
+
+// Portable T-table AES for builds without mbedTLS
+
+static uint8_t sbox[256];
+static uint32_t te[4][256];
+
+static inline uint8_t xtime(uint8_t x)
+{
+  return (uint8_t)((x << 1) ^ (x & 0x80 ? 0x1B : 0));
+}
+
+static inline uint32_t ror32(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+static bool buildTables()
+{
+  // Walk GF(2^8) with generator 3; q is the inverse of p
+  uint8_t p = 1;
+  uint8_t q = 1;
+  do
+  {
+    p = (uint8_t)(p ^ (p << 1) ^ (p & 0x80 ? 0x1B : 0));
+    q ^= (uint8_t)(q << 1);
+    q ^= (uint8_t)(q << 2);
+    q ^= (uint8_t)(q << 4);
+    q ^= q & 0x80 ? 0x09 : 0;
+    uint8_t x = q ^ (uint8_t)((q << 1) | (q >> 7)) ^ (uint8_t)((q << 2) | (q >> 6)) ^
+                (uint8_t)((q << 3) | (q >> 5)) ^ (uint8_t)((q << 4) | (q >> 4));
+    sbox[p] = x ^ 0x63;
+  } while (p != 1);
+  sbox[0] = 0x63;
+
+  for (int i = 0; i < 256; i++)
+  {
+    uint8_t s = sbox[i];
+    uint8_t s2 = xtime(s);
+    uint32_t t = ((uint32_t)s2 << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint8_t)(s2 ^ s);
+    te[0][i] = t;
+    te[1][i] = ror32(t, 8);
+    te[2][i] = ror32(t, 16);
+    te[3][i] = ror32(t, 24);
+  }
+  return true;
+}
+
+static inline uint32_t subWord(uint32_t w)
+{
+  return ((uint32_t)sbox[w >> 24] << 24) | ((uint32_t)sbox[(w >> 16) & 0xFF] << 16) |
+         ((uint32_t)sbox[(w >> 8) & 0xFF] << 8) | sbox[w & 0xFF];
+}
+
+AesCtr::AesCtr()
+{
+  static bool tablesReady = buildTables();
+  (void)tablesReady;
+  memset(iv, 0, sizeof(iv));
+  memset(roundKeys, 0, sizeof(roundKeys));
+}
+
+AesCtr::~AesCtr()
+{
+  memset(roundKeys, 0, sizeof(roundKeys));
+}
+
+void AesCtr::setKey(const uint8_t *key, const uint8_t *nonce)
+{
+  memcpy(iv, nonce, AES_BLOCK_BYTES);
+  for (int i = 0; i < 8; i++)
+  {
+    roundKeys[i] = load32(key + i * 4);
+  }
+  uint8_t rcon = 1;
+  for (int i = 8; i < 60; i++)
+  {
+    uint32_t t = roundKeys[i - 1];
+    if (i % 8 == 0)
+    {
+      t = subWord((t << 8) | (t >> 24)) ^ ((uint32_t)rcon << 24);
+      rcon = xtime(rcon);
+    }
+    else if (i % 8 == 4)
+    {
+      t = subWord(t);
+    }
+    roundKeys[i] = roundKeys[i - 8] ^ t;
+  }
+}
+
+void AesCtr::encryptBlocks(const uint8_t *in, uint8_t *out, size_t blocks) const
+{
+  // The blocks go through each round together so their table lookups
+  // overlap instead of waiting on one another
+  uint32_t s[AES_SOFT_BATCH][4];
+  uint32_t t[AES_SOFT_BATCH][4];
+  const uint32_t *rk = roundKeys;
+  for (size_t b = 0; b < blocks; b++)
+  {
+    for (int c = 0; c < 4; c++)
+    {
+      s[b][c] = load32(in + b * AES_BLOCK_BYTES + c * 4) ^ rk[c];
+    }
+  }
+  for (int round = 1; round < 14; round++)
+  {
+    rk += 4;
+    for (size_t b = 0; b < blocks; b++)
+    {
+      for (int c = 0; c < 4; c++)
+      {
+        t[b][c] = te[0][s[b][c] >> 24] ^ te[1][(s[b][(c + 1) & 3] >> 16) & 0xFF] ^
+                  te[2][(s[b][(c + 2) & 3] >> 8) & 0xFF] ^ te[3][s[b][(c + 3) & 3] & 0xFF] ^ rk[c];
+      }
+    }
+    memcpy(s, t, sizeof(s[0]) * blocks);
+  }
+  rk += 4;
+  for (size_t b = 0; b < blocks; b++)
+  {
+    for (int c = 0; c < 4; c++)
+    {
+      uint32_t v = ((uint32_t)sbox[s[b][c] >> 24] << 24) | ((uint32_t)sbox[(s[b][(c + 1) & 3] >> 16) & 0xFF] << 16) |
+                   ((uint32_t)sbox[(s[b][(c + 2) & 3] >> 8) & 0xFF] << 8) | sbox[s[b][(c + 3) & 3] & 0xFF];
+      store32(out + b * AES_BLOCK_BYTES + c * 4, v ^ rk[c]);
+    }
+  }
+}
+
+void AesCtr::apply(uint64_t offset, const uint8_t *in, uint8_t *out, size_t len)
+{
+  uint8_t counters[AES_SOFT_BATCH * AES_BLOCK_BYTES];
+  uint8_t stream[AES_SOFT_BATCH * AES_BLOCK_BYTES];
+  uint64_t block = offset / AES_BLOCK_BYTES;
+  size_t skip = offset % AES_BLOCK_BYTES;
+  while (len > 0)
+  {
+    size_t blocks = (skip + len + AES_BLOCK_BYTES - 1) / AES_BLOCK_BYTES;
+    if (blocks > AES_SOFT_BATCH)
+    {
+      blocks = AES_SOFT_BATCH;
+    }
+    for (size_t b = 0; b < blocks; b++)
+    {
+      counterAt(block + b, counters + b * AES_BLOCK_BYTES);
+    }
+    encryptBlocks(counters, stream, blocks);
+
+    size_t n = blocks * AES_BLOCK_BYTES - skip;
+    if (n > len)
+    {
+      n = len;
+    }
+    const uint8_t *key = stream + skip;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+      uint64_t a;
+      uint64_t k;
+      memcpy(&a, in + i, 8);
+      memcpy(&k, key + i, 8);
+      a ^= k;
+      memcpy(out + i, &a, 8);
+    }
+    for (; i < n; i++)
+    {
+      out[i] = in[i] ^ key[i];
+    }
+    in += n;
+    out += n;
+    len -= n;
+    block += blocks;
+    skip = 0;
+  }
+}
+
+const char *AesCtr::backend()
+{
+  return "software";
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __AES_CTR_H
+#define __AES_CTR_H
+
+// Portable C++ only: used by at-rest encryption (file_crypt.*) and by the
+// host benchmark (tools/crypt_bench.cpp)
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(ESP_PLATFORM)
+#include "mbedtls/aes.h"
+#endif
+
+#define AES_KEY_BYTES 32
+#define AES_BLOCK_BYTES 16
+// Keystream blocks the software cipher produces per pass
+#define AES_SOFT_BATCH 4
+
+// AES-256 in counter mode. The counter of byte `offset` is iv + offset / 16,
+// so any range of a file can be encrypted or decrypted on its own (Range
+// requests, /read). On the ESP32 mbedTLS drives the AES accelerator, which
+// uses DMA for long buffers; other builds use a table-driven software
+// cipher that works on AES_SOFT_BATCH counter blocks at a time and XORs
+// the keystream 8 bytes at a time.
+class AesCtr
+{
+private:
+    uint8_t iv[AES_BLOCK_BYTES];
+#if defined(ESP_PLATFORM)
+    mbedtls_aes_context aes;
+#else
+    uint32_t roundKeys[60];
+    void encryptBlocks(const uint8_t *in, uint8_t *out, size_t blocks) const;
+#endif
+    void counterAt(uint64_t block, uint8_t *counter) const;
+
+public:
+    AesCtr();
+    ~AesCtr();
+
+    AesCtr(const AesCtr &) = delete;
+    AesCtr &operator=(const AesCtr &) = delete;
+
+    void setKey(const uint8_t *key, const uint8_t *iv);
+
+    // Encrypts or decrypts (the same operation) len bytes that sit at
+    // `offset` of the stream. in and out may be the same buffer.
+    void apply(uint64_t offset, const uint8_t *in, uint8_t *out, size_t len);
+
+    static const char *backend();
+};
+
+#endif
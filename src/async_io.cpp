@@ -0,0 +1,388 @@
+#include "async_io.h"
+#include <algorithm>
+#include <chrono>
+
+struct AsyncIoState
+{
+  std::mutex lock;
+  std::condition_variable done;
+  bool ready;
+  AsyncIoResult result;
+  std::function<void()> continuation; // then()
+};
+
+static uint64_t nowUs()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// ---- Future ----------------------------------------------------------------
+
+bool AsyncIoFuture::ready() const
+{
+  std::lock_guard<std::mutex> l(state->lock);
+  return state->ready;
+}
+
+bool AsyncIoFuture::wait(uint32_t timeoutMs) const
+{
+  std::unique_lock<std::mutex> l(state->lock);
+  if (timeoutMs == UINT32_MAX)
+  {
+    state->done.wait(l, [this]() { return state->ready; });
+    return true;
+  }
+  return state->done.wait_for(l, std::chrono::milliseconds(timeoutMs), [this]() { return state->ready; });
+}
+
+const AsyncIoResult &AsyncIoFuture::result() const
+{
+  return state->result;
+}
+
+bool AsyncIoFuture::then(std::function<void()> fn) const
+{
+  std::lock_guard<std::mutex> l(state->lock);
+  if (state->ready)
+  {
+    return false;
+  }
+  state->continuation = std::move(fn);
+  return true;
+}
+
+// ---- Engine ----------------------------------------------------------------
+
+AsyncIoEngine::AsyncIoEngine(AsyncIoBackend &backend, size_t maxQueue)
+    : backend(backend), maxQueue(maxQueue), stopping(false), stats()
+{
+}
+
+// The callback first, then the waiters: a caller that sees the future ready
+// knows its callback has finished
+void AsyncIoEngine::complete(Op &op, AsyncIoResult &result)
+{
+  result.type = op.type;
+  if (op.callback)
+  {
+    op.callback(result);
+  }
+  std::function<void()> continuation;
+  {
+    std::lock_guard<std::mutex> l(op.state->lock);
+    op.state->result = std::move(result);
+    op.state->ready = true;
+    continuation = std::move(op.state->continuation);
+  }
+  op.state->done.notify_all();
+  if (continuation)
+  {
+    continuation();
+  }
+}
+
+AsyncIoFuture AsyncIoEngine::submit(Op &&op)
+{
+  op.state = std::make_shared<AsyncIoState>();
+  op.state->ready = false;
+  op.priority = std::min(op.priority, (uint8_t)(ASYNC_IO_PRIORITIES - 1));
+  op.submitUs = nowUs();
+  AsyncIoFuture future(op.state);
+
+  int64_t refused = 0;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    if (stopping)
+    {
+      refused = ASYNC_IO_ECANCELED;
+    }
+    else if (queue.size() >= maxQueue)
+    {
+      refused = ASYNC_IO_EBUSY;
+      stats.rejected++;
+    }
+    else
+    {
+      stats.submitted++;
+      queue.push_back(std::move(op));
+      stats.depth = queue.size();
+      stats.maxDepth = std::max(stats.maxDepth, stats.depth);
+    }
+  }
+  if (refused)
+  {
+    AsyncIoResult result = AsyncIoResult();
+    result.value = refused;
+    complete(op, result);
+    return future;
+  }
+  changed.notify_one();
+  return future;
+}
+
+// Most urgent runnable operation, oldest first. An operation on a handle
+// waits while that handle is running and behind every earlier operation on
+// it, whatever their priorities, so one handle's operations never reorder.
+bool AsyncIoEngine::takeNext(Op &op)
+{
+  std::vector<int64_t> seen;
+  size_t best = queue.size();
+  for (size_t i = 0; i < queue.size(); i++)
+  {
+    const Op &candidate = queue[i];
+    if (candidate.handle != 0)
+    {
+      bool blocked = std::find(busy.begin(), busy.end(), candidate.handle) != busy.end() ||
+                     std::find(seen.begin(), seen.end(), candidate.handle) != seen.end();
+      seen.push_back(candidate.handle);
+      if (blocked)
+      {
+        continue;
+      }
+    }
+    if (best == queue.size() || candidate.priority < queue[best].priority)
+    {
+      best = i;
+      if (candidate.priority == 0)
+      {
+        break;
+      }
+    }
+  }
+  if (best == queue.size())
+  {
+    return false;
+  }
+  op = std::move(queue[best]);
+  queue.erase(queue.begin() + best);
+  stats.depth = queue.size();
+  if (op.handle != 0)
+  {
+    busy.push_back(op.handle);
+  }
+  return true;
+}
+
+void AsyncIoEngine::execute(Op &op, AsyncIoResult &result)
+{
+  switch (op.type)
+  {
+  case ASYNC_IO_OPEN:
+    result.value = backend.open(op.path, op.write, op.priority);
+    break;
+  case ASYNC_IO_READ:
+    result.value = backend.read(op.handle, op.offset, op.buffer, op.len, op.priority);
+    break;
+  case ASYNC_IO_WRITE:
+    result.value = backend.write(op.handle, op.offset, op.data, op.len, op.priority);
+    break;
+  case ASYNC_IO_STAT:
+    result.value = backend.stat(op.path, result.stat, op.priority);
+    break;
+  case ASYNC_IO_READDIR:
+    result.value = backend.readdir(op.path, op.start, op.max, result.entries, op.priority);
+    break;
+  case ASYNC_IO_CLOSE:
+    result.value = backend.close(op.handle, op.priority);
+    break;
+  case ASYNC_IO_REMOVE:
+    result.value = backend.remove(op.path, op.write, op.priority);
+    break;
+  case ASYNC_IO_RENAME:
+    result.value = backend.rename(op.path, op.to, op.priority);
+    break;
+  case ASYNC_IO_MKDIR:
+    result.value = backend.mkdir(op.path, op.priority);
+    break;
+  default:
+    result.value = ASYNC_IO_EIO;
+    break;
+  }
+}
+
+void AsyncIoEngine::runWorker()
+{
+  for (;;)
+  {
+    Op op;
+    {
+      std::unique_lock<std::mutex> l(lock);
+      while (!stopping && !takeNext(op))
+      {
+        changed.wait(l);
+      }
+      if (stopping && !op.state)
+      {
+        return;
+      }
+    }
+
+    AsyncIoResult result = AsyncIoResult();
+    uint64_t start = nowUs();
+    execute(op, result);
+    uint64_t end = nowUs();
+    result.queuedUs = (uint32_t)(start - op.submitUs);
+    result.serviceUs = (uint32_t)(end - start);
+    {
+      std::lock_guard<std::mutex> l(lock);
+      stats.completed++;
+      stats.failed += result.value < 0 ? 1 : 0;
+      stats.ops[op.type]++;
+      stats.queuedUs[op.type] += result.queuedUs;
+      stats.serviceUs[op.type] += result.serviceUs;
+      if (result.value > 0 && op.type == ASYNC_IO_READ)
+      {
+        stats.bytesRead += result.value;
+      }
+      if (result.value > 0 && op.type == ASYNC_IO_WRITE)
+      {
+        stats.bytesWritten += result.value;
+      }
+    }
+    int64_t handle = op.handle;
+    complete(op, result);
+
+    // Only now may the handle's next operation start, so completions of one
+    // handle are delivered in order too
+    if (handle != 0)
+    {
+      std::lock_guard<std::mutex> l(lock);
+      busy.erase(std::find(busy.begin(), busy.end(), handle));
+    }
+    changed.notify_all();
+  }
+}
+
+void AsyncIoEngine::stop()
+{
+  std::deque<Op> cancelled;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    stopping = true;
+    cancelled.swap(queue);
+    stats.depth = 0;
+  }
+  changed.notify_all();
+  for (Op &op : cancelled)
+  {
+    AsyncIoResult result = AsyncIoResult();
+    result.value = ASYNC_IO_ECANCELED;
+    complete(op, result);
+  }
+}
+
+AsyncIoStats AsyncIoEngine::getStats()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return stats;
+}
+
+// ---- Submission --------------------------------------------------------------
+
+AsyncIoFuture AsyncIoEngine::open(const std::string &path, bool write, AsyncIoCallback callback, uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_OPEN;
+  op.path = path;
+  op.write = write;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::read(int64_t handle, uint64_t offset, uint8_t *buffer, size_t len,
+                                  AsyncIoCallback callback, uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_READ;
+  op.handle = handle;
+  op.offset = offset;
+  op.buffer = buffer;
+  op.len = len;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::write(int64_t handle, uint64_t offset, const uint8_t *data, size_t len,
+                                   AsyncIoCallback callback, uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_WRITE;
+  op.handle = handle;
+  op.offset = offset;
+  op.data = data;
+  op.len = len;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::stat(const std::string &path, AsyncIoCallback callback, uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_STAT;
+  op.path = path;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::readdir(const std::string &path, uint32_t start, uint32_t max,
+                                     AsyncIoCallback callback, uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_READDIR;
+  op.path = path;
+  op.start = start;
+  op.max = max;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::close(int64_t handle, AsyncIoCallback callback, uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_CLOSE;
+  op.handle = handle;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::remove(const std::string &path, bool directory, AsyncIoCallback callback,
+                                    uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_REMOVE;
+  op.path = path;
+  op.write = directory;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::rename(const std::string &from, const std::string &to, AsyncIoCallback callback,
+                                    uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_RENAME;
+  op.path = from;
+  op.to = to;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
+
+AsyncIoFuture AsyncIoEngine::mkdir(const std::string &path, AsyncIoCallback callback, uint8_t priority)
+{
+  Op op = Op();
+  op.type = ASYNC_IO_MKDIR;
+  op.path = path;
+  op.callback = std::move(callback);
+  op.priority = priority;
+  return submit(std::move(op));
+}
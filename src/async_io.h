@@ -0,0 +1,238 @@
+#ifndef __ASYNC_IO_H
+#define __ASYNC_IO_H
+
+// Portable C++ only: the same engine runs on the device (async_io_service.*,
+// with SD card workers) and on the host (tools/async_io_bench.cpp, with a
+// POSIX backend and std::thread workers).
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+#define ASYNC_IO_MAX_QUEUE 64
+// Priorities 0 (most urgent) .. ASYNC_IO_PRIORITIES - 1; on the device they
+// are the SdIoClass values
+#define ASYNC_IO_PRIORITIES 4
+#define ASYNC_IO_DEFAULT_PRIORITY 2
+// Write offset meaning "at the current position", for sequential writers
+#define ASYNC_IO_APPEND UINT64_MAX
+
+// Negative results
+#define ASYNC_IO_ENOENT -2
+#define ASYNC_IO_EIO -5
+#define ASYNC_IO_EBADF -9
+#define ASYNC_IO_EBUSY -16 // submission queue full
+#define ASYNC_IO_EMFILE -24
+#define ASYNC_IO_ECANCELED -125 // engine stopped before the operation ran
+
+enum AsyncIoOpType
+{
+    ASYNC_IO_OPEN,
+    ASYNC_IO_READ,
+    ASYNC_IO_WRITE,
+    ASYNC_IO_STAT,
+    ASYNC_IO_READDIR,
+    ASYNC_IO_CLOSE,
+    ASYNC_IO_REMOVE,
+    ASYNC_IO_RENAME,
+    ASYNC_IO_MKDIR,
+    ASYNC_IO_OP_TYPES
+};
+
+struct AsyncIoStat
+{
+    bool isDirectory;
+    uint64_t size;
+    uint32_t mtime;
+};
+
+struct AsyncIoDirEntry
+{
+    std::string name;
+    bool isDirectory;
+    uint64_t size;
+    uint32_t mtime;
+};
+
+struct AsyncIoResult
+{
+    AsyncIoOpType type;
+    // Bytes read/written, the handle of an open, entries of a readdir, 0 for
+    // the rest; negative ASYNC_IO_E* on failure (ASYNC_IO_EIO for a remove,
+    // rename or mkdir the file system refused)
+    int64_t value;
+    AsyncIoStat stat;                     // stat
+    std::vector<AsyncIoDirEntry> entries; // readdir
+    uint32_t queuedUs;  // submission to start
+    uint32_t serviceUs; // start to completion
+
+    bool ok() const { return value >= 0; }
+};
+
+typedef std::function<void(const AsyncIoResult &result)> AsyncIoCallback;
+
+// File system operations the engine schedules. Methods run on the worker
+// threads; the engine never runs two operations on the same handle at once.
+// Errors are ASYNC_IO_E* values.
+class AsyncIoBackend
+{
+public:
+    virtual ~AsyncIoBackend() {}
+
+    // Returns a handle > 0
+    virtual int64_t open(const std::string &path, bool write, uint8_t priority) = 0;
+    virtual int64_t read(int64_t handle, uint64_t offset, uint8_t *buffer, size_t len, uint8_t priority) = 0;
+    virtual int64_t write(int64_t handle, uint64_t offset, const uint8_t *data, size_t len, uint8_t priority) = 0;
+    virtual int64_t stat(const std::string &path, AsyncIoStat &stat, uint8_t priority) = 0;
+    // Up to `max` entries from index `start` on
+    virtual int64_t readdir(const std::string &path, uint32_t start, uint32_t max,
+                            std::vector<AsyncIoDirEntry> &entries, uint8_t priority) = 0;
+    virtual int64_t close(int64_t handle, uint8_t priority) = 0;
+    // A directory is only removed if it is empty
+    virtual int64_t remove(const std::string &path, bool directory, uint8_t priority) = 0;
+    virtual int64_t rename(const std::string &from, const std::string &to, uint8_t priority) = 0;
+    virtual int64_t mkdir(const std::string &path, uint8_t priority) = 0;
+};
+
+struct AsyncIoState;
+
+// Completion of one submitted operation, shared between the submitter and
+// the engine
+class AsyncIoFuture
+{
+private:
+    std::shared_ptr<AsyncIoState> state;
+
+public:
+    AsyncIoFuture() {}
+    AsyncIoFuture(std::shared_ptr<AsyncIoState> state) : state(state) {}
+
+    bool valid() const { return state != nullptr; }
+    bool ready() const;
+    // True once complete; false if `timeoutMs` passed first
+    bool wait(uint32_t timeoutMs = UINT32_MAX) const;
+    // Valid once ready()
+    const AsyncIoResult &result() const;
+    // Runs `fn` on the worker when the operation completes. Returns false,
+    // without calling it, if it already has
+    bool then(std::function<void()> fn) const;
+};
+
+struct AsyncIoStats
+{
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t rejected; // queue full
+    uint32_t depth;
+    uint32_t maxDepth;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t ops[ASYNC_IO_OP_TYPES];
+    uint64_t queuedUs[ASYNC_IO_OP_TYPES];
+    uint64_t serviceUs[ASYNC_IO_OP_TYPES];
+};
+
+// Queue of file operations served by worker threads. Submission never
+// blocks: it returns a future at once, or one that already failed with
+// ASYNC_IO_EBUSY if ASYNC_IO_MAX_QUEUE operations are waiting. Workers take
+// the most urgent runnable operation, oldest first; operations on one
+// handle run and complete strictly in submission order, so a write followed
+// by a read or close of the same handle sees the write. Callbacks run on the
+// worker before the future becomes ready; they must not block.
+//
+// Buffers passed to read/write must stay valid until completion.
+class AsyncIoEngine
+{
+private:
+    struct Op
+    {
+        AsyncIoOpType type;
+        uint8_t priority;
+        int64_t handle; // 0 for path operations, which never wait for each other
+        uint64_t offset;
+        uint8_t *buffer;
+        const uint8_t *data;
+        size_t len;
+        std::string path;
+        std::string to; // rename
+        bool write;     // open; remove: the path is a directory
+        uint32_t start;
+        uint32_t max;
+        AsyncIoCallback callback;
+        std::shared_ptr<AsyncIoState> state;
+        uint64_t submitUs;
+    };
+
+    AsyncIoBackend &backend;
+    size_t maxQueue;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Op> queue;
+    std::vector<int64_t> busy; // handles with an operation running
+    bool stopping;
+    AsyncIoStats stats;
+
+    AsyncIoFuture submit(Op &&op);
+    bool takeNext(Op &op);
+    void execute(Op &op, AsyncIoResult &result);
+    static void complete(Op &op, AsyncIoResult &result);
+
+public:
+    AsyncIoEngine(AsyncIoBackend &backend, size_t maxQueue = ASYNC_IO_MAX_QUEUE);
+
+    AsyncIoFuture open(const std::string &path, bool write, AsyncIoCallback callback = nullptr,
+                       uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture read(int64_t handle, uint64_t offset, uint8_t *buffer, size_t len,
+                       AsyncIoCallback callback = nullptr, uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture write(int64_t handle, uint64_t offset, const uint8_t *data, size_t len,
+                        AsyncIoCallback callback = nullptr, uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture stat(const std::string &path, AsyncIoCallback callback = nullptr,
+                       uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture readdir(const std::string &path, uint32_t start, uint32_t max,
+                          AsyncIoCallback callback = nullptr, uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture close(int64_t handle, AsyncIoCallback callback = nullptr,
+                        uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture remove(const std::string &path, bool directory, AsyncIoCallback callback = nullptr,
+                         uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture rename(const std::string &from, const std::string &to, AsyncIoCallback callback = nullptr,
+                         uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+    AsyncIoFuture mkdir(const std::string &path, AsyncIoCallback callback = nullptr,
+                        uint8_t priority = ASYNC_IO_DEFAULT_PRIORITY);
+
+    // Worker loop; each worker thread/task calls it and it returns after stop()
+    void runWorker();
+    // Fails everything still queued with ASYNC_IO_ECANCELED and lets the
+    // workers return once their current operation is done
+    void stop();
+
+    AsyncIoStats getStats();
+};
+
+#if defined(__cpp_impl_coroutine)
+// `AsyncIoResult r = co_await engine.read(...);` inside a coroutine. The
+// coroutine resumes on the worker that completed the operation.
+struct AsyncIoAwaiter
+{
+    AsyncIoFuture future;
+
+    bool await_ready() const { return future.ready(); }
+    bool await_suspend(std::coroutine_handle<> waiting) const
+    {
+        return future.then([waiting]() { waiting.resume(); });
+    }
+    AsyncIoResult await_resume() const { return future.result(); }
+};
+
+inline AsyncIoAwaiter operator co_await(AsyncIoFuture future) { return AsyncIoAwaiter{future}; }
+#endif
+
+#endif
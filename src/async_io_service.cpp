@@ -0,0 +1,769 @@
+#include "async_io_service.h"
+#include "bg_job.h"
+#include "block_cache.h"
+#include "dir_pager.h"
+#include "lz4_store.h"
+#include "meta_cache.h"
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <algorithm>
+#include <mutex>
+
+struct AsyncIoChunk
+{
+  uint8_t *data;
+  uint64_t offset; // read streams: stream offset
+  size_t len;      // bytes requested (read) or buffered (write)
+  AsyncIoFuture future;
+
+  AsyncIoChunk() : offset(0), len(0)
+  {
+    data = (uint8_t *)heap_caps_malloc(ASYNC_IO_CHUNK_SIZE, MALLOC_CAP_SPIRAM);
+    if (data == nullptr)
+    {
+      data = (uint8_t *)malloc(ASYNC_IO_CHUNK_SIZE);
+    }
+  }
+  ~AsyncIoChunk() { free(data); }
+};
+
+// Handles are slot + 1 + ASYNC_IO_MAX_FILES * generation, so a handle that
+// was closed never reaches the file now in its slot. A slot holding a
+// LzbReader reads decompressed content and cannot be written
+class SdBackend : public AsyncIoBackend
+{
+private:
+  struct Slot
+  {
+    File file;
+    LzbReader *reader;
+    bool used;
+    bool attached;
+    uint32_t generation;
+  };
+
+  fs::FS *fs;
+  DirPager *pager;
+  std::mutex lock;
+  Slot slots[ASYNC_IO_MAX_FILES];
+
+  bool lookup(int64_t handle, File &out, LzbReader *&reader)
+  {
+    if (handle <= 0)
+    {
+      return false;
+    }
+    uint32_t slot = (handle - 1) % ASYNC_IO_MAX_FILES;
+    uint32_t generation = (handle - 1) / ASYNC_IO_MAX_FILES;
+    std::lock_guard<std::mutex> l(lock);
+    Slot &s = slots[slot];
+    if (!s.used || s.generation != generation)
+    {
+      return false;
+    }
+    out = s.file;
+    reader = s.reader;
+    return true;
+  }
+
+public:
+  SdBackend() : fs(nullptr), pager(nullptr), slots() {}
+
+  void begin(fs::FS &f, DirPager &p)
+  {
+    fs = &f;
+    pager = &p;
+  }
+  bool running() { return fs != nullptr; }
+
+  int64_t add(File &file, LzbReader *reader, bool attached)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    for (uint32_t i = 0; i < ASYNC_IO_MAX_FILES; i++)
+    {
+      Slot &s = slots[i];
+      if (!s.used)
+      {
+        s.used = true;
+        s.attached = attached;
+        s.file = file;
+        s.reader = reader;
+        s.generation++;
+        return 1 + i + (int64_t)ASYNC_IO_MAX_FILES * s.generation;
+      }
+    }
+    return ASYNC_IO_EMFILE;
+  }
+
+  uint32_t openFiles()
+  {
+    std::lock_guard<std::mutex> l(lock);
+    uint32_t n = 0;
+    for (const Slot &s : slots)
+    {
+      n += s.used ? 1 : 0;
+    }
+    return n;
+  }
+
+  int64_t open(const std::string &path, bool write, uint8_t priority) override
+  {
+    File file;
+    {
+      SdIoScope io((SdIoClass)priority);
+      file = fs->open(path.c_str(), write ? FILE_WRITE : FILE_READ);
+    }
+    if (!file)
+    {
+      return write ? ASYNC_IO_EIO : ASYNC_IO_ENOENT;
+    }
+    int64_t handle = add(file, nullptr, false);
+    if (handle < 0)
+    {
+      file.close();
+    }
+    return handle;
+  }
+
+  int64_t read(int64_t handle, uint64_t offset, uint8_t *buffer, size_t len, uint8_t priority) override
+  {
+    File file;
+    LzbReader *reader;
+    if (!lookup(handle, file, reader))
+    {
+      return ASYNC_IO_EBADF;
+    }
+    BlockCacheRouteScope route("async_io");
+    SdIoScope io((SdIoClass)priority);
+    if (reader != nullptr)
+    {
+      // Operations on one handle run in order, so the reader's block cache
+      // is never shared between workers
+      return reader->read(offset, buffer, len);
+    }
+    if (file.position() != offset && !file.seek(offset))
+    {
+      return ASYNC_IO_EIO;
+    }
+    return file.read(buffer, len);
+  }
+
+  int64_t write(int64_t handle, uint64_t offset, const uint8_t *data, size_t len, uint8_t priority) override
+  {
+    File file;
+    LzbReader *reader;
+    if (!lookup(handle, file, reader) || reader != nullptr)
+    {
+      return ASYNC_IO_EBADF;
+    }
+    BlockCacheRouteScope route("async_io");
+    SdIoScope io((SdIoClass)priority);
+    if (offset != ASYNC_IO_APPEND && file.position() != offset && !file.seek(offset))
+    {
+      return ASYNC_IO_EIO;
+    }
+    return file.write(data, len);
+  }
+
+  int64_t stat(const std::string &path, AsyncIoStat &out, uint8_t priority) override
+  {
+    SdIoScope io((SdIoClass)priority);
+    FsMeta meta;
+    if (!g_metaCache.stat(String(path.c_str()), meta))
+    {
+      return ASYNC_IO_ENOENT;
+    }
+    out.isDirectory = meta.isDirectory;
+    out.size = meta.size;
+    out.mtime = meta.mtime;
+    return 0;
+  }
+
+  // A bounded readdir is a /list page: served from the pager's open session
+  int64_t readdir(const std::string &path, uint32_t start, uint32_t max, std::vector<AsyncIoDirEntry> &entries,
+                  uint8_t priority) override
+  {
+    if (max != UINT32_MAX)
+    {
+      return pager->readPage(path.c_str(), start, max, entries) ? (int64_t)entries.size() : ASYNC_IO_ENOENT;
+    }
+    SdIoScope io((SdIoClass)priority);
+    File dir = fs->open(path.c_str());
+    if (!dir || !dir.isDirectory())
+    {
+      return ASYNC_IO_ENOENT;
+    }
+    uint32_t index = 0;
+    for (File f = dir.openNextFile(); f && entries.size() < max; f = dir.openNextFile())
+    {
+      if (index++ >= start)
+      {
+        entries.push_back({f.name(), f.isDirectory(), f.isDirectory() ? 0 : (uint64_t)f.size(),
+                           (uint32_t)f.getLastWrite()});
+      }
+      f.close();
+    }
+    dir.close();
+    return entries.size();
+  }
+
+  int64_t close(int64_t handle, uint8_t priority) override
+  {
+    File file;
+    bool attached;
+    {
+      std::lock_guard<std::mutex> l(lock);
+      uint32_t slot = (handle - 1) % ASYNC_IO_MAX_FILES;
+      Slot &s = slots[slot];
+      if (handle <= 0 || !s.used || s.generation != (handle - 1) / ASYNC_IO_MAX_FILES)
+      {
+        return ASYNC_IO_EBADF;
+      }
+      file = s.file;
+      attached = s.attached;
+      s.file = File();
+      s.reader = nullptr;
+      s.used = false;
+    }
+    if (!attached)
+    {
+      SdIoScope io((SdIoClass)priority);
+      file.close();
+    }
+    return 0;
+  }
+
+  // Caches are invalidated on both sides of the change, outside the grant
+  int64_t remove(const std::string &path, bool directory, uint8_t priority) override
+  {
+    String p = path.c_str();
+    fsCacheInvalidate(p, directory);
+    bool ok;
+    {
+      SdIoScope io((SdIoClass)priority);
+      ok = directory ? fs->rmdir(p) : fs->remove(p);
+    }
+    fsCacheInvalidate(p, directory);
+    return ok ? 0 : ASYNC_IO_EIO;
+  }
+
+  int64_t rename(const std::string &from, const std::string &to, uint8_t priority) override
+  {
+    String a = from.c_str();
+    String b = to.c_str();
+    fsCacheInvalidate(a, true);
+    fsCacheInvalidate(b, true);
+    bool ok;
+    {
+      SdIoScope io((SdIoClass)priority);
+      ok = fs->rename(a, b);
+    }
+    fsCacheInvalidate(a, true);
+    fsCacheInvalidate(b, true);
+    return ok ? 0 : ASYNC_IO_EIO;
+  }
+
+  int64_t mkdir(const std::string &path, uint8_t priority) override
+  {
+    String p = path.c_str();
+    fsCacheInvalidate(p);
+    bool ok;
+    {
+      SdIoScope io((SdIoClass)priority);
+      ok = fs->mkdir(p);
+    }
+    fsCacheInvalidate(p);
+    return ok ? 0 : ASYNC_IO_EIO;
+  }
+};
+
+static SdBackend backend;
+AsyncIoEngine g_asyncIo(backend);
+
+static void workerEntry(void *arg)
+{
+  g_asyncIo.runWorker();
+  vTaskDelete(NULL);
+}
+
+bool asyncIoBegin(fs::FS &fs, DirPager &pager)
+{
+  backend.begin(fs, pager);
+  for (int i = 0; i < ASYNC_IO_WORKERS; i++)
+  {
+    if (xTaskCreatePinnedToCore(workerEntry, "async_io", ASYNC_IO_WORKER_STACK, NULL, BG_JOB_PRIORITY + 1, NULL,
+                                tskNO_AFFINITY) != pdPASS)
+    {
+      Serial.println("Failed to start async I/O worker");
+      return i > 0;
+    }
+  }
+  Serial.printf("Async I/O: %d workers, %d files\n", ASYNC_IO_WORKERS, ASYNC_IO_MAX_FILES);
+  return true;
+}
+
+int64_t asyncIoAttach(File &file)
+{
+  if (!backend.running() || !file)
+  {
+    return ASYNC_IO_EIO;
+  }
+  return backend.add(file, nullptr, true);
+}
+
+int64_t asyncIoAttach(LzbReader &reader)
+{
+  if (!backend.running())
+  {
+    return ASYNC_IO_EIO;
+  }
+  File none;
+  return backend.add(none, &reader, true);
+}
+
+void asyncIoStatsJson(JsonObject obj)
+{
+  static const char *names[ASYNC_IO_OP_TYPES] = {"open", "read", "write", "stat", "readdir", "close", "remove", "rename", "mkdir"};
+  AsyncIoStats s = g_asyncIo.getStats();
+  obj["workers"] = backend.running() ? ASYNC_IO_WORKERS : 0;
+  obj["openFiles"] = backend.openFiles();
+  obj["submitted"] = s.submitted;
+  obj["completed"] = s.completed;
+  obj["failed"] = s.failed;
+  obj["rejected"] = s.rejected;
+  obj["depth"] = s.depth;
+  obj["maxDepth"] = s.maxDepth;
+  obj["bytesRead"] = s.bytesRead;
+  obj["bytesWritten"] = s.bytesWritten;
+  JsonObject ops = obj["ops"].to<JsonObject>();
+  for (int i = 0; i < ASYNC_IO_OP_TYPES; i++)
+  {
+    if (s.ops[i] == 0)
+    {
+      continue;
+    }
+    JsonObject o = ops[names[i]].to<JsonObject>();
+    o["count"] = s.ops[i];
+    o["avgQueueMs"] = s.queuedUs[i] / 1000.0f / s.ops[i];
+    o["avgServiceMs"] = s.serviceUs[i] / 1000.0f / s.ops[i];
+  }
+}
+
+// A close the engine refused (queue full) is done here instead, once the
+// handle's outstanding operations have finished
+static bool refused(const AsyncIoResult &result)
+{
+  return result.value == ASYNC_IO_EBUSY || result.value == ASYNC_IO_ECANCELED;
+}
+
+bool AsyncIoPending::ready()
+{
+  if (!future.ready())
+  {
+    return false;
+  }
+  if (future.result().value == ASYNC_IO_EBUSY)
+  {
+    future = submit();
+    return false;
+  }
+  return true;
+}
+
+// ---- Read stream -------------------------------------------------------------
+
+AsyncReadStream::~AsyncReadStream()
+{
+  if (handle <= 0)
+  {
+    return;
+  }
+  // Ordered after the reads still in flight, which keep their chunks alive
+  std::vector<std::shared_ptr<AsyncIoChunk>> pending(chunks, chunks + ASYNC_IO_READ_AHEAD);
+  int64_t h = handle;
+  SdIoClass cls = ioClass;
+  std::function<void()> done = onClosed;
+  g_asyncIo.close(
+      handle,
+      [pending, h, cls, done](const AsyncIoResult &result) {
+        if (refused(result))
+        {
+          for (const std::shared_ptr<AsyncIoChunk> &chunk : pending)
+          {
+            if (chunk->future.valid())
+            {
+              chunk->future.wait();
+            }
+          }
+          backend.close(h, cls);
+        }
+        if (done)
+        {
+          done();
+        }
+      },
+      ioClass);
+}
+
+bool AsyncReadStream::allocate()
+{
+  for (std::shared_ptr<AsyncIoChunk> &chunk : chunks)
+  {
+    chunk = std::make_shared<AsyncIoChunk>();
+    if (chunk->data == nullptr)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool AsyncReadStream::begin(File &file, uint64_t offset, uint64_t len, SdIoClass cls, std::function<void()> closed)
+{
+  return allocate() && start(asyncIoAttach(file), offset, len, cls, closed);
+}
+
+bool AsyncReadStream::begin(LzbReader &reader, uint64_t offset, uint64_t len, SdIoClass cls,
+                            std::function<void()> closed)
+{
+  return allocate() && start(asyncIoAttach(reader), offset, len, cls, closed);
+}
+
+bool AsyncReadStream::start(int64_t h, uint64_t offset, uint64_t len, SdIoClass cls, std::function<void()> closed)
+{
+  if (h < 0)
+  {
+    return false;
+  }
+  handle = h;
+  base = offset;
+  length = len;
+  ioClass = cls;
+  onClosed = closed;
+  for (std::shared_ptr<AsyncIoChunk> &chunk : chunks)
+  {
+    submit(chunk);
+  }
+  return true;
+}
+
+void AsyncReadStream::submit(std::shared_ptr<AsyncIoChunk> &chunk)
+{
+  if (next >= length)
+  {
+    chunk->future = AsyncIoFuture();
+    return;
+  }
+  chunk->offset = next;
+  chunk->len = min((uint64_t)ASYNC_IO_CHUNK_SIZE, length - next);
+  next += chunk->len;
+  issue(chunk);
+}
+
+void AsyncReadStream::issue(std::shared_ptr<AsyncIoChunk> &chunk)
+{
+  std::shared_ptr<AsyncIoChunk> keep = chunk;
+  chunk->future = g_asyncIo.read(
+      handle, base + chunk->offset, chunk->data, chunk->len, [keep](const AsyncIoResult &) {}, ioClass);
+}
+
+size_t AsyncReadStream::fill(uint8_t *buffer, size_t maxLen, size_t index)
+{
+  if (error || index >= length)
+  {
+    return 0;
+  }
+  // Fillers read sequentially; one that jumps restarts the read-ahead there
+  if (index < chunks[head]->offset || index >= next)
+  {
+    next = index;
+  }
+  for (int tries = 0; tries <= ASYNC_IO_READ_AHEAD; tries++)
+  {
+    std::shared_ptr<AsyncIoChunk> &chunk = chunks[head];
+    if (!chunk->future.valid())
+    {
+      submit(chunk);
+      if (!chunk->future.valid())
+      {
+        break;
+      }
+    }
+    if (!chunk->future.wait(ASYNC_IO_FILL_WAIT_MS))
+    {
+      return 0;
+    }
+    if (chunk->future.result().value == ASYNC_IO_EBUSY)
+    {
+      // Refused by a full queue, not failed: the same chunk goes in again
+      // and the filler comes back on the next ACK or poll
+      issue(chunk);
+      return 0;
+    }
+    if (chunk->future.result().value != (int64_t)chunk->len)
+    {
+      break;
+    }
+    uint64_t end = chunk->offset + chunk->len;
+    if (index >= chunk->offset && index < end)
+    {
+      size_t n = min((uint64_t)maxLen, end - index);
+      memcpy(buffer, chunk->data + (index - chunk->offset), n);
+      if (index + n == end)
+      {
+        submit(chunk);
+        head = (head + 1) % ASYNC_IO_READ_AHEAD;
+      }
+      return n;
+    }
+    submit(chunk);
+    head = (head + 1) % ASYNC_IO_READ_AHEAD;
+  }
+  error = true;
+  return 0;
+}
+
+// ---- Write stream ------------------------------------------------------------
+
+AsyncWriteStream::~AsyncWriteStream()
+{
+  abandon(nullptr);
+}
+
+bool AsyncWriteStream::begin(File &file, SdIoClass cls, bool waiting)
+{
+  for (int i = 0; i < ASYNC_IO_WRITE_BEHIND; i++)
+  {
+    std::shared_ptr<AsyncIoChunk> chunk = std::make_shared<AsyncIoChunk>();
+    if (chunk->data == nullptr)
+    {
+      return false;
+    }
+    spare.push_back(chunk);
+  }
+  allocated = ASYNC_IO_WRITE_BEHIND;
+  int64_t h = asyncIoAttach(file);
+  if (h < 0)
+  {
+    return false;
+  }
+  handle = h;
+  ioClass = cls;
+  wait = waiting;
+  return true;
+}
+
+// Takes back the chunks whose writes completed, then submits the filled
+// ones the engine does not have yet, in order. Writes complete in order on
+// one handle, so only the oldest is checked
+void AsyncWriteStream::pump()
+{
+  while (submitted > 0 && pending.front()->future.ready())
+  {
+    std::shared_ptr<AsyncIoChunk> chunk = pending.front();
+    error = error || chunk->future.result().value != (int64_t)chunk->len;
+    chunk->future = AsyncIoFuture();
+    chunk->len = 0;
+    pending.pop_front();
+    submitted--;
+    spare.push_back(chunk);
+  }
+  while (!error && submitted < pending.size())
+  {
+    std::shared_ptr<AsyncIoChunk> &chunk = pending[submitted];
+    std::shared_ptr<AsyncIoChunk> keep = chunk;
+    chunk->future = g_asyncIo.write(
+        handle, ASYNC_IO_APPEND, chunk->data, chunk->len, [keep](const AsyncIoResult &) {}, ioClass);
+    // A full queue refuses at once. Nothing behind this chunk was submitted,
+    // so submitting it again later keeps the writes in order
+    if (chunk->future.ready() && chunk->future.result().value == ASYNC_IO_EBUSY)
+    {
+      chunk->future = AsyncIoFuture();
+      break;
+    }
+    submitted++;
+  }
+}
+
+// A free chunk to copy into: a spare one, a new one while under the limit,
+// otherwise (waiting streams only) the next one to complete
+std::shared_ptr<AsyncIoChunk> AsyncWriteStream::take()
+{
+  for (;;)
+  {
+    if (!spare.empty())
+    {
+      std::shared_ptr<AsyncIoChunk> chunk = spare.back();
+      spare.pop_back();
+      return chunk;
+    }
+    if (allocated < ASYNC_IO_WRITE_BEHIND_MAX)
+    {
+      std::shared_ptr<AsyncIoChunk> chunk = std::make_shared<AsyncIoChunk>();
+      if (chunk->data != nullptr)
+      {
+        allocated++;
+        return chunk;
+      }
+    }
+    if (!wait)
+    {
+      overflow = !error;
+      error = true;
+      return nullptr;
+    }
+    if (submitted > 0)
+    {
+      pending.front()->future.wait();
+    }
+    else
+    {
+      vTaskDelay(1);
+    }
+    pump();
+    if (error)
+    {
+      return nullptr;
+    }
+  }
+}
+
+bool AsyncWriteStream::write(const uint8_t *data, size_t len)
+{
+  pump();
+  while (len > 0 && !error && handle > 0 && !closing)
+  {
+    if (!filling && !(filling = take()))
+    {
+      break;
+    }
+    size_t n = min(len, (size_t)ASYNC_IO_CHUNK_SIZE - filling->len);
+    memcpy(filling->data + filling->len, data, n);
+    filling->len += n;
+    data += n;
+    len -= n;
+    if (filling->len == ASYNC_IO_CHUNK_SIZE)
+    {
+      pending.push_back(filling);
+      filling.reset();
+      pump();
+    }
+  }
+  return !error && handle > 0 && !closing;
+}
+
+void AsyncWriteStream::finish()
+{
+  if (handle <= 0 || closing)
+  {
+    return;
+  }
+  if (filling && filling->len > 0 && !error)
+  {
+    pending.push_back(filling);
+  }
+  filling.reset();
+  closing = true;
+  done();
+}
+
+bool AsyncWriteStream::done()
+{
+  if (handle <= 0)
+  {
+    return true;
+  }
+  if (!closing)
+  {
+    return false;
+  }
+  pump();
+  if (!closed.valid())
+  {
+    // Once failed, what was not submitted is dropped
+    if (!error && submitted < pending.size())
+    {
+      return false;
+    }
+    // The close runs after the writes in flight
+    closed = g_asyncIo.close(handle, nullptr, ioClass);
+    if (closed.ready() && closed.result().value == ASYNC_IO_EBUSY)
+    {
+      closed = AsyncIoFuture();
+      return false;
+    }
+  }
+  if (!closed.ready())
+  {
+    return false;
+  }
+  if (refused(closed.result()))
+  {
+    // The engine is stopping: detach here once the writes in flight are done
+    if (submitted > 0 && !pending[submitted - 1]->future.ready())
+    {
+      return false;
+    }
+    backend.close(handle, ioClass);
+  }
+  pump();
+  handle = 0;
+  return true;
+}
+
+bool AsyncWriteStream::finishAndWait()
+{
+  finish();
+  while (!done())
+  {
+    if (closed.valid() && !closed.ready())
+    {
+      closed.wait();
+    }
+    else
+    {
+      vTaskDelay(1);
+    }
+  }
+  return !error;
+}
+
+void AsyncWriteStream::abandon(std::function<void()> onDetached)
+{
+  std::function<void()> notify = onDetached ? onDetached : [] {};
+  if (handle <= 0)
+  {
+    notify();
+    return;
+  }
+  pump();
+  error = true;
+  int64_t h = handle;
+  SdIoClass cls = ioClass;
+  handle = 0;
+  // The close runs after the writes in flight
+  if (!closed.valid())
+  {
+    closed = g_asyncIo.close(h, nullptr, cls);
+  }
+  if (!closed.ready() || !refused(closed.result()))
+  {
+    if (!closed.then(notify))
+    {
+      notify();
+    }
+    return;
+  }
+  // Refused: detach after the last write submitted, which completes after
+  // every other one on this handle
+  std::function<void()> detach = [h, cls, notify]() {
+    backend.close(h, cls);
+    notify();
+  };
+  AsyncIoFuture last = submitted > 0 ? pending[submitted - 1]->future : AsyncIoFuture();
+  if (!last.valid() || !last.then(detach))
+  {
+    detach();
+  }
+}
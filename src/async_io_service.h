@@ -0,0 +1,170 @@
+#ifndef __ASYNC_IO_SERVICE_H
+#define __ASYNC_IO_SERVICE_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include "async_io.h"
+#include "sd_io_sched.h"
+#include <ArduinoJson.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class DirPager;
+class LzbReader;
+
+#define ASYNC_IO_WORKERS 2
+#define ASYNC_IO_WORKER_STACK 4096
+// Files open in (or attached to) the engine at once
+#define ASYNC_IO_MAX_FILES 16
+#define ASYNC_IO_CHUNK_SIZE (16 * 1024) // <= SD_IO_MAX_CHUNK: one grant per operation
+#define ASYNC_IO_READ_AHEAD 2
+#define ASYNC_IO_WRITE_BEHIND 3
+// Chunks a write stream may buffer while the card is slow (16 KB each, taken
+// from PSRAM as needed); past that a writer that must not wait fails as busy
+#define ASYNC_IO_WRITE_BEHIND_MAX 32
+// Longest a response filler waits for a chunk still being read before it
+// answers RESPONSE_TRY_AGAIN instead
+#define ASYNC_IO_FILL_WAIT_MS 10
+
+// Card operations off the web server task. ASYNC_IO_WORKERS tasks serve
+// g_asyncIo; each operation runs under an SdIoScope of its priority, so the
+// engine's priorities are the SdIoClass values and the card scheduler still
+// arbitrates between the workers and every other task.
+extern AsyncIoEngine g_asyncIo;
+
+// Bounded readdirs (start, max < UINT32_MAX) page through `pager`
+bool asyncIoBegin(fs::FS &fs, DirPager &pager);
+// Makes an already open File usable through the engine, e.g. a lease from
+// the HandleCache. Closing the returned handle only detaches it: the File
+// stays open. Negative ASYNC_IO_E* if the engine is not running or full.
+int64_t asyncIoAttach(File &file);
+// Same for an open compressed file: reads return its decompressed content at
+// that offset, so block decoding runs on the workers too. Writes fail
+int64_t asyncIoAttach(LzbReader &reader);
+void asyncIoStatsJson(JsonObject obj);
+
+// One operation a request's answer waits on, e.g. through a
+// DeferredResponse: a submission the full queue refused (ASYNC_IO_EBUSY) is
+// made again whenever ready() is asked, rather than failing the request.
+// Only used from the web server task.
+class AsyncIoPending
+{
+private:
+    std::function<AsyncIoFuture()> submit;
+    AsyncIoFuture future;
+
+public:
+    AsyncIoPending(std::function<AsyncIoFuture()> submit) : submit(submit), future(submit()) {}
+
+    bool ready();
+    // Valid once ready()
+    const AsyncIoResult &result() const { return future.result(); }
+};
+
+struct AsyncIoChunk;
+
+// Sequential reader with ASYNC_IO_READ_AHEAD chunks in flight, for response
+// fillers: the next chunk is read while the current one is sent. Only used
+// from the web server task.
+class AsyncReadStream
+{
+private:
+    int64_t handle;
+    uint64_t base;
+    uint64_t length;
+    SdIoClass ioClass;
+    std::function<void()> onClosed;
+    std::shared_ptr<AsyncIoChunk> chunks[ASYNC_IO_READ_AHEAD];
+    uint8_t head;
+    uint64_t next; // stream offset of the next read to submit
+    bool error;
+
+    bool allocate();
+    bool start(int64_t handle, uint64_t offset, uint64_t length, SdIoClass ioClass, std::function<void()> onClosed);
+    void submit(std::shared_ptr<AsyncIoChunk> &chunk);
+    void issue(std::shared_ptr<AsyncIoChunk> &chunk);
+
+public:
+    AsyncReadStream() : handle(0), base(0), length(0), ioClass(SD_IO_BULK), head(0), next(0), error(false) {}
+    // Closes the handle behind the outstanding reads; onClosed then runs on a
+    // worker (releases the lease, say)
+    ~AsyncReadStream();
+
+    // Streams `length` bytes of `file` from `offset` on and starts reading
+    // ahead. On false nothing was taken over and onClosed is never called
+    bool begin(File &file, uint64_t offset, uint64_t length, SdIoClass ioClass, std::function<void()> onClosed);
+    // Same over the decompressed content of `reader`, which stays the
+    // caller's until onClosed
+    bool begin(LzbReader &reader, uint64_t offset, uint64_t length, SdIoClass ioClass, std::function<void()> onClosed);
+    // Copies up to maxLen bytes from stream offset `index`. 0 if that data is
+    // still being read or its read was refused by a full queue and is
+    // submitted again (return RESPONSE_TRY_AGAIN), or failed() (end the
+    // response)
+    size_t fill(uint8_t *buffer, size_t maxLen, size_t index);
+    bool failed() const { return error; }
+};
+
+// Sequential writer: data is copied into chunks that are written at the
+// file's current position while more arrives. A stream that may not wait
+// (the web server task's) takes more chunks while the card is slow, up to
+// ASYNC_IO_WRITE_BEHIND_MAX, and fails as busy() beyond that; chunks a full
+// queue refused are submitted again on the next call. A waiting stream
+// blocks for room instead. Only used from one task.
+//
+// The file stays attached until every write has completed: finish() and
+// poll done(), or abandon(), and only close or remove the file after that.
+class AsyncWriteStream
+{
+private:
+    int64_t handle;
+    SdIoClass ioClass;
+    bool wait;
+    std::vector<std::shared_ptr<AsyncIoChunk>> spare;
+    // Filled chunks in file order; the first `submitted` are with the engine
+    std::deque<std::shared_ptr<AsyncIoChunk>> pending;
+    size_t submitted;
+    std::shared_ptr<AsyncIoChunk> filling;
+    uint32_t allocated;
+    bool closing;
+    AsyncIoFuture closed;
+    bool error;
+    bool overflow;
+
+    std::shared_ptr<AsyncIoChunk> take();
+    void pump();
+
+public:
+    AsyncWriteStream()
+        : handle(0), ioClass(SD_IO_BULK), wait(false), submitted(0), allocated(0), closing(false), error(false),
+          overflow(false)
+    {
+    }
+    // A stream that is not done() yet is abandoned
+    ~AsyncWriteStream();
+
+    // wait: write() and finishAndWait() may block (background tasks only)
+    bool begin(File &file, SdIoClass ioClass, bool wait = false);
+    // False once any write has come up short or the stream is busy()
+    bool write(const uint8_t *data, size_t len);
+    // Submits what is buffered and the close behind it, without waiting
+    void finish();
+    // After finish(): true once every write has completed and the file is
+    // detached, so the caller may close it. Poll it, e.g. from a
+    // DeferredResponse; it submits again what a full queue refused
+    bool done();
+    // finish() and wait for done(); false if a write failed
+    bool finishAndWait();
+    // Drops what is not written yet. onDetached runs, on a worker or at
+    // once, when the writes in flight have completed: close or remove the
+    // file there
+    void abandon(std::function<void()> onDetached);
+    // Valid once done()
+    bool ok() const { return !error; }
+    // The failure was the card or the queue staying busy, not a short write:
+    // the client may try again
+    bool busy() const { return overflow; }
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "bg_job.h"
+#include "sd_io_sched.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+static const char *stateName(BackgroundJob::State state)
+{
+  switch (state)
+  {
+  case BackgroundJob::RUNNING:
+    return "running";
+  case BackgroundJob::DONE:
+    return "done";
+  case BackgroundJob::FAILED:
+    return "failed";
+  case BackgroundJob::CANCELLED:
+    return "cancelled";
+  default:
+    return "idle";
+  }
+}
+
+BackgroundJob::BackgroundJob(const char *name) : name(name),
+                                                 state(IDLE),
+                                                 cancelRequested(false),
+                                                 done(0),
+                                                 total(0),
+                                                 startTime(0),
+                                                 endTime(0),
+                                                 lock(nullptr)
+{
+}
+
+void BackgroundJob::taskEntry(void *arg)
+{
+  BackgroundJob *job = (BackgroundJob *)arg;
+  Serial.printf("Job %s started\n", job->name);
+
+  bool ok = job->body(*job);
+
+  job->endTime = millis();
+  job->state = job->cancelRequested ? CANCELLED : (ok ? DONE : FAILED);
+  Serial.printf("Job %s finished: %s in %u ms\n", job->name, stateName(job->state),
+                job->endTime - job->startTime);
+  vTaskDelete(NULL);
+}
+
+bool BackgroundJob::start(Body jobBody, uint32_t stackSize)
+{
+  if (state == RUNNING)
+  {
+    return false;
+  }
+  if (lock == nullptr)
+  {
+    lock = xSemaphoreCreateMutex();
+  }
+
+  body = jobBody;
+  cancelRequested = false;
+  done = 0;
+  total = 0;
+  startTime = millis();
+  endTime = 0;
+  setMessage("");
+  state = RUNNING;
+
+  if (xTaskCreatePinnedToCore(taskEntry, name, stackSize, this, BG_JOB_PRIORITY, NULL, tskNO_AFFINITY) != pdPASS)
+  {
+    Serial.printf("Failed to create task for job %s\n", name);
+    state = FAILED;
+    return false;
+  }
+  return true;
+}
+
+void BackgroundJob::setProgress(uint32_t doneCount, uint32_t totalCount)
+{
+  done = doneCount;
+  total = totalCount;
+  // Jobs report progress once per item; let queued foreground card access go first
+  sdIoYield(SD_IO_BACKGROUND);
+}
+
+void BackgroundJob::setMessage(const String &text)
+{
+  xSemaphoreTake((SemaphoreHandle_t)lock, portMAX_DELAY);
+  message = text;
+  xSemaphoreGive((SemaphoreHandle_t)lock);
+}
+
+void BackgroundJob::statusJson(JsonObject obj)
+{
+  obj["job"] = name;
+  obj["state"] = stateName(state);
+  obj["done"] = done;
+  obj["total"] = total;
+  obj["elapsedMs"] = state == RUNNING ? millis() - startTime : endTime - startTime;
+  if (lock != nullptr)
+  {
+    xSemaphoreTake((SemaphoreHandle_t)lock, portMAX_DELAY);
+    obj["message"] = message;
+    xSemaphoreGive((SemaphoreHandle_t)lock);
+  }
+}
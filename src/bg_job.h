@@ -0,0 +1,59 @@
+#ifndef __BG_JOB_H
+#define __BG_JOB_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <functional>
+
+#define BG_JOB_STACK_SIZE 8192
+#define BG_JOB_PRIORITY 1 // Below the network tasks
+
+// A long-running operation executed on its own FreeRTOS task so HTTP
+// handlers only start it and poll its status. Each feature owns one job
+// instance; the job body checks cancelled() regularly and reports progress.
+class BackgroundJob
+{
+public:
+    enum State
+    {
+        IDLE,
+        RUNNING,
+        DONE,
+        FAILED,
+        CANCELLED
+    };
+
+    typedef std::function<bool(BackgroundJob &job)> Body;
+
+private:
+    const char *name;
+    Body body;
+    volatile State state;
+    volatile bool cancelRequested;
+    volatile uint32_t done;
+    volatile uint32_t total;
+    uint32_t startTime;
+    uint32_t endTime;
+    String message;
+    void *lock;
+
+    static void taskEntry(void *arg);
+
+public:
+    BackgroundJob(const char *name);
+
+    // Returns false if the job is already running or the task cannot be created
+    bool start(Body body, uint32_t stackSize = BG_JOB_STACK_SIZE);
+    void cancel() { cancelRequested = true; }
+
+    bool cancelled() const { return cancelRequested; }
+    bool running() const { return state == RUNNING; }
+    State getState() const { return state; }
+
+    void setProgress(uint32_t done, uint32_t total);
+    void setMessage(const String &message);
+
+    void statusJson(JsonObject obj);
+};
+
+#endif
@@ -0,0 +1,720 @@
+#include "block_cache.h"
+#include <esp_heap_caps.h>
+#include "esp_memory_utils.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "diskio_impl.h"
+#include "diskio_sdmmc.h"
+
+#define BLOCK_BYTES (BLOCK_CACHE_SECTOR_SIZE * BLOCK_CACHE_BLOCK_SECTORS)
+
+enum
+{
+  QUEUE_FREE = 0,
+  QUEUE_A1IN = 1,
+  QUEUE_AM = 2
+};
+
+struct CacheSlot
+{
+  uint32_t block;
+  int32_t prev;
+  int32_t next;
+  int32_t hashNext;
+  uint8_t queue;
+};
+
+struct CacheList
+{
+  int32_t head; // most recent
+  int32_t tail; // eviction candidate
+  uint32_t size;
+};
+
+struct RouteStats
+{
+  const char *name;
+  uint32_t hits;
+  uint32_t misses;
+  uint64_t savedUs;
+};
+
+static struct
+{
+  bool enabled;
+  uint8_t pdrv;
+  uint32_t slotCount;
+  uint32_t a1inTarget;
+  CacheSlot *slots;
+  uint8_t *data;
+  uint8_t *bounce; // DMA-capable staging buffer for card reads
+  int32_t *buckets;
+  uint32_t bucketMask;
+  CacheList a1in;
+  CacheList am;
+  int32_t freeList;
+
+  // 2Q ghost queue: block numbers recently evicted from A1in
+  uint32_t *a1out;
+  uint32_t a1outSize;
+  uint32_t a1outCount;
+  uint32_t a1outPos;
+
+  uint32_t lastEndSector;
+  uint32_t sequentialRuns;
+  uint32_t missUsPerBlock; // moving average of card read latency
+
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t prefetched;
+  uint32_t writes;
+  uint32_t bypassed; // sectors read past the cache
+  RouteStats routes[BLOCK_CACHE_MAX_ROUTES];
+  SemaphoreHandle_t lock;
+} bc;
+
+// Route and bypass flag of each task that has one set; card I/O runs on
+// the calling task
+static struct
+{
+  TaskHandle_t task;
+  const char *route;
+  bool bypass;
+} taskRoutes[BLOCK_CACHE_MAX_TASK_ROUTES];
+static portMUX_TYPE taskRoutesMux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t *slotData(int32_t slot)
+{
+  return bc.data + (size_t)slot * BLOCK_BYTES;
+}
+
+// Entry of `task`; with `create`, claims a free one if it has none. -1 if
+// there is none (or the table is full). Call inside taskRoutesMux.
+static int taskEntry(TaskHandle_t task, bool create)
+{
+  int free = -1;
+  for (int i = 0; i < BLOCK_CACHE_MAX_TASK_ROUTES; i++)
+  {
+    if (taskRoutes[i].task == task)
+    {
+      return i;
+    }
+    if (taskRoutes[i].task == nullptr && free < 0)
+    {
+      free = i;
+    }
+  }
+  if (!create || free < 0)
+  {
+    return -1;
+  }
+  taskRoutes[free] = {task, nullptr, false};
+  return free;
+}
+
+static const char *taskRoute(bool *bypass = nullptr)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  const char *route = nullptr;
+  portENTER_CRITICAL(&taskRoutesMux);
+  int i = taskEntry(task, false);
+  if (i >= 0)
+  {
+    route = taskRoutes[i].route;
+  }
+  if (bypass)
+  {
+    *bypass = i >= 0 && taskRoutes[i].bypass;
+  }
+  portEXIT_CRITICAL(&taskRoutesMux);
+  return route;
+}
+
+static RouteStats *currentRoute()
+{
+  const char *route = taskRoute();
+  const char *name = route ? route : "other";
+  for (int i = 0; i < BLOCK_CACHE_MAX_ROUTES; i++)
+  {
+    if (bc.routes[i].name == nullptr)
+    {
+      bc.routes[i].name = name;
+      return &bc.routes[i];
+    }
+    if (strcmp(bc.routes[i].name, name) == 0)
+    {
+      return &bc.routes[i];
+    }
+  }
+  return &bc.routes[BLOCK_CACHE_MAX_ROUTES - 1];
+}
+
+static void listUnlink(CacheList &list, int32_t slot)
+{
+  CacheSlot &s = bc.slots[slot];
+  if (s.prev >= 0)
+    bc.slots[s.prev].next = s.next;
+  else
+    list.head = s.next;
+  if (s.next >= 0)
+    bc.slots[s.next].prev = s.prev;
+  else
+    list.tail = s.prev;
+  s.prev = s.next = -1;
+  list.size--;
+}
+
+static void listPushHead(CacheList &list, int32_t slot)
+{
+  CacheSlot &s = bc.slots[slot];
+  s.prev = -1;
+  s.next = list.head;
+  if (list.head >= 0)
+    bc.slots[list.head].prev = slot;
+  list.head = slot;
+  if (list.tail < 0)
+    list.tail = slot;
+  list.size++;
+}
+
+static CacheList &queueList(uint8_t queue)
+{
+  return queue == QUEUE_AM ? bc.am : bc.a1in;
+}
+
+static int32_t hashLookup(uint32_t block)
+{
+  for (int32_t i = bc.buckets[block & bc.bucketMask]; i >= 0; i = bc.slots[i].hashNext)
+  {
+    if (bc.slots[i].block == block)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void hashInsert(int32_t slot)
+{
+  uint32_t bucket = bc.slots[slot].block & bc.bucketMask;
+  bc.slots[slot].hashNext = bc.buckets[bucket];
+  bc.buckets[bucket] = slot;
+}
+
+static void hashRemove(int32_t slot)
+{
+  int32_t *link = &bc.buckets[bc.slots[slot].block & bc.bucketMask];
+  while (*link >= 0)
+  {
+    if (*link == slot)
+    {
+      *link = bc.slots[slot].hashNext;
+      return;
+    }
+    link = &bc.slots[*link].hashNext;
+  }
+}
+
+static void ghostPush(uint32_t block)
+{
+  bc.a1out[bc.a1outPos] = block;
+  bc.a1outPos = (bc.a1outPos + 1) % bc.a1outSize;
+  if (bc.a1outCount < bc.a1outSize)
+    bc.a1outCount++;
+}
+
+// Returns true (and forgets the block) if it was evicted from A1in recently
+static bool ghostTake(uint32_t block)
+{
+  for (uint32_t i = 0; i < bc.a1outCount; i++)
+  {
+    if (bc.a1out[i] == block)
+    {
+      bc.a1out[i] = UINT32_MAX;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void evict(int32_t slot)
+{
+  CacheSlot &s = bc.slots[slot];
+  listUnlink(queueList(s.queue), slot);
+  hashRemove(slot);
+  if (s.queue == QUEUE_A1IN)
+  {
+    ghostPush(s.block);
+  }
+  s.queue = QUEUE_FREE;
+}
+
+static int32_t allocSlot()
+{
+  if (bc.freeList >= 0)
+  {
+    int32_t slot = bc.freeList;
+    bc.freeList = bc.slots[slot].next;
+    return slot;
+  }
+
+  // 2Q reclaim: shrink the probation FIFO first while it is over its share
+  int32_t victim;
+  if (bc.a1in.size > bc.a1inTarget || bc.am.tail < 0)
+    victim = bc.a1in.tail;
+  else
+    victim = bc.am.tail;
+  evict(victim);
+  return victim;
+}
+
+static void releaseSlot(int32_t slot)
+{
+  bc.slots[slot].queue = QUEUE_FREE;
+  bc.slots[slot].next = bc.freeList;
+  bc.freeList = slot;
+}
+
+// Insert (or refresh) a block whose content is at `src`
+static void insertBlock(uint32_t block, const uint8_t *src)
+{
+  int32_t slot = hashLookup(block);
+  if (slot >= 0)
+  {
+    memcpy(slotData(slot), src, BLOCK_BYTES);
+    return;
+  }
+
+  slot = allocSlot();
+  CacheSlot &s = bc.slots[slot];
+  s.block = block;
+  s.queue = ghostTake(block) ? QUEUE_AM : QUEUE_A1IN;
+  memcpy(slotData(slot), src, BLOCK_BYTES);
+  listPushHead(queueList(s.queue), slot);
+  hashInsert(slot);
+}
+
+static void touch(int32_t slot)
+{
+  // A1in is a FIFO; only blocks in the main queue move on access
+  if (bc.slots[slot].queue == QUEUE_AM)
+  {
+    listUnlink(bc.am, slot);
+    listPushHead(bc.am, slot);
+  }
+}
+
+static DRESULT cardRead(uint8_t pdrv, uint8_t *buff, uint32_t sector, uint32_t count, RouteStats *route)
+{
+  int64_t start = esp_timer_get_time();
+  DRESULT res = ff_sdmmc_read(pdrv, buff, sector, count);
+  uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+
+  uint32_t blocks = max((uint32_t)1, count / BLOCK_CACHE_BLOCK_SECTORS);
+  uint32_t perBlock = elapsed / blocks;
+  bc.missUsPerBlock = bc.missUsPerBlock ? (bc.missUsPerBlock * 7 + perBlock) / 8 : perBlock;
+  if (route)
+  {
+    route->misses += blocks;
+  }
+  bc.misses += blocks;
+  return res;
+}
+
+static void prefetch(uint8_t pdrv, uint32_t fromBlock)
+{
+  // Only fetch the part of the window that is not cached yet
+  uint32_t first = fromBlock;
+  while (first < fromBlock + BLOCK_CACHE_PREFETCH_BLOCKS && hashLookup(first) >= 0)
+  {
+    first++;
+  }
+  uint32_t end = fromBlock + BLOCK_CACHE_PREFETCH_BLOCKS;
+
+  while (first < end)
+  {
+    uint32_t count = min(end - first, (uint32_t)BLOCK_CACHE_BOUNCE_BLOCKS);
+    if (ff_sdmmc_read(pdrv, bc.bounce, first * BLOCK_CACHE_BLOCK_SECTORS,
+                      count * BLOCK_CACHE_BLOCK_SECTORS) != RES_OK)
+    {
+      return; // Past the end of the card or a transient error; not fatal
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (hashLookup(first + i) < 0)
+      {
+        insertBlock(first + i, bc.bounce + (size_t)i * BLOCK_BYTES);
+        bc.prefetched++;
+      }
+    }
+    first += count;
+  }
+}
+
+// Read for a task in bypass mode: cached copies of the range are dropped
+// and the data comes from the card, without being cached
+static DRESULT bypassRead(uint8_t pdrv, uint8_t *buff, uint32_t sector, uint32_t count, RouteStats *route)
+{
+  uint32_t end = sector + count;
+  for (uint32_t b = sector / BLOCK_CACHE_BLOCK_SECTORS; b <= (end - 1) / BLOCK_CACHE_BLOCK_SECTORS; b++)
+  {
+    int32_t slot = hashLookup(b);
+    if (slot >= 0)
+    {
+      listUnlink(queueList(bc.slots[slot].queue), slot);
+      hashRemove(slot);
+      releaseSlot(slot);
+    }
+  }
+  bc.bypassed += count;
+
+  if (esp_ptr_dma_capable(buff) && ((uintptr_t)buff & 3) == 0)
+  {
+    return cardRead(pdrv, buff, sector, count, route);
+  }
+  DRESULT res = RES_OK;
+  const uint32_t bounceSectors = BLOCK_CACHE_BOUNCE_BLOCKS * BLOCK_CACHE_BLOCK_SECTORS;
+  for (uint32_t done = 0; done < count && res == RES_OK; done += bounceSectors)
+  {
+    uint32_t n = min(count - done, bounceSectors);
+    res = cardRead(pdrv, bc.bounce, sector + done, n, route);
+    if (res == RES_OK)
+    {
+      memcpy(buff + (size_t)done * BLOCK_CACHE_SECTOR_SIZE, bc.bounce, (size_t)n * BLOCK_CACHE_SECTOR_SIZE);
+    }
+  }
+  return res;
+}
+
+static DRESULT cachedRead(unsigned char pdrv, unsigned char *buff, uint32_t sector, unsigned count)
+{
+  if (!bc.enabled || pdrv != bc.pdrv)
+  {
+    return ff_sdmmc_read(pdrv, buff, sector, count);
+  }
+
+  bool bypass;
+  taskRoute(&bypass);
+  xSemaphoreTake(bc.lock, portMAX_DELAY);
+  RouteStats *route = currentRoute();
+  if (bypass)
+  {
+    DRESULT res = bypassRead(pdrv, buff, sector, count, route);
+    xSemaphoreGive(bc.lock);
+    return res;
+  }
+  DRESULT res = RES_OK;
+  uint32_t end = sector + count;
+  uint32_t firstBlock = sector / BLOCK_CACHE_BLOCK_SECTORS;
+  uint32_t lastBlock = (end - 1) / BLOCK_CACHE_BLOCK_SECTORS;
+
+  for (uint32_t b = firstBlock; b <= lastBlock && res == RES_OK; b++)
+  {
+    uint32_t blockStart = b * BLOCK_CACHE_BLOCK_SECTORS;
+    uint32_t from = max(sector, blockStart);
+    uint32_t to = min(end, blockStart + BLOCK_CACHE_BLOCK_SECTORS);
+    uint8_t *dst = buff + (size_t)(from - sector) * BLOCK_CACHE_SECTOR_SIZE;
+
+    int32_t slot = hashLookup(b);
+    if (slot >= 0)
+    {
+      memcpy(dst, slotData(slot) + (from - blockStart) * BLOCK_CACHE_SECTOR_SIZE,
+             (to - from) * BLOCK_CACHE_SECTOR_SIZE);
+      touch(slot);
+      bc.hits++;
+      route->hits++;
+      route->savedUs += bc.missUsPerBlock;
+      continue;
+    }
+
+    if (from == blockStart && to == blockStart + BLOCK_CACHE_BLOCK_SECTORS)
+    {
+      // Run of whole missing blocks
+      uint32_t runEnd = b;
+      while (runEnd < lastBlock &&
+             (runEnd + 2) * BLOCK_CACHE_BLOCK_SECTORS <= end &&
+             hashLookup(runEnd + 1) < 0)
+      {
+        runEnd++;
+      }
+      uint32_t blocks = runEnd - b + 1;
+      if (esp_ptr_dma_capable(dst) && ((uintptr_t)dst & 3) == 0)
+      {
+        // Straight into the caller's buffer with one card command, then keep copies
+        res = cardRead(pdrv, dst, blockStart, blocks * BLOCK_CACHE_BLOCK_SECTORS, route);
+        for (uint32_t i = 0; i < blocks && res == RES_OK; i++)
+        {
+          insertBlock(b + i, dst + (size_t)i * BLOCK_BYTES);
+        }
+      }
+      else
+      {
+        // PSRAM (or unaligned) buffer: through the bounce buffer, which still
+        // reads BLOCK_CACHE_BOUNCE_BLOCKS blocks per card command
+        for (uint32_t done = 0; done < blocks && res == RES_OK;)
+        {
+          uint32_t n = min(blocks - done, (uint32_t)BLOCK_CACHE_BOUNCE_BLOCKS);
+          res = cardRead(pdrv, bc.bounce, (b + done) * BLOCK_CACHE_BLOCK_SECTORS, n * BLOCK_CACHE_BLOCK_SECTORS, route);
+          if (res == RES_OK)
+          {
+            memcpy(dst + (size_t)done * BLOCK_BYTES, bc.bounce, (size_t)n * BLOCK_BYTES);
+            for (uint32_t i = 0; i < n; i++)
+            {
+              insertBlock(b + done + i, bc.bounce + (size_t)i * BLOCK_BYTES);
+            }
+          }
+          done += n;
+        }
+      }
+      b = runEnd;
+      continue;
+    }
+
+    // Partial block: fetch the whole block through the bounce buffer, keep a
+    // copy and hand out the part that was asked for
+    if (cardRead(pdrv, bc.bounce, blockStart, BLOCK_CACHE_BLOCK_SECTORS, route) == RES_OK)
+    {
+      insertBlock(b, bc.bounce);
+      memcpy(dst, bc.bounce + (from - blockStart) * BLOCK_CACHE_SECTOR_SIZE,
+             (to - from) * BLOCK_CACHE_SECTOR_SIZE);
+    }
+    else
+    {
+      // The block may run past the end of the card; read exactly what was asked
+      res = ff_sdmmc_read(pdrv, dst, from, to - from);
+    }
+  }
+
+  // Sequential pattern: read ahead so the next requests are hits
+  if (res == RES_OK)
+  {
+    bc.sequentialRuns = (sector == bc.lastEndSector) ? bc.sequentialRuns + 1 : 0;
+    bc.lastEndSector = end;
+    if (bc.sequentialRuns >= 2)
+    {
+      prefetch(pdrv, lastBlock + 1);
+    }
+  }
+
+  xSemaphoreGive(bc.lock);
+  return res;
+}
+
+static DRESULT cachedWrite(unsigned char pdrv, const unsigned char *buff, uint32_t sector, unsigned count)
+{
+  if (!bc.enabled || pdrv != bc.pdrv)
+  {
+    return ff_sdmmc_write(pdrv, buff, sector, count);
+  }
+
+  // Held across the card write, so a concurrent miss cannot read the old
+  // content and cache it after the copies below were updated
+  xSemaphoreTake(bc.lock, portMAX_DELAY);
+  DRESULT res = ff_sdmmc_write(pdrv, buff, sector, count);
+  bc.writes++;
+  uint32_t end = sector + count;
+  for (uint32_t b = sector / BLOCK_CACHE_BLOCK_SECTORS; b <= (end - 1) / BLOCK_CACHE_BLOCK_SECTORS; b++)
+  {
+    int32_t slot = hashLookup(b);
+    if (slot < 0)
+    {
+      continue;
+    }
+
+    if (res != RES_OK)
+    {
+      // Card content is unknown now
+      listUnlink(queueList(bc.slots[slot].queue), slot);
+      hashRemove(slot);
+      releaseSlot(slot);
+      continue;
+    }
+
+    // Write-through: keep the cached copy identical to the card
+    uint32_t blockStart = b * BLOCK_CACHE_BLOCK_SECTORS;
+    uint32_t from = max(sector, blockStart);
+    uint32_t to = min(end, blockStart + BLOCK_CACHE_BLOCK_SECTORS);
+    memcpy(slotData(slot) + (from - blockStart) * BLOCK_CACHE_SECTOR_SIZE,
+           buff + (size_t)(from - sector) * BLOCK_CACHE_SECTOR_SIZE,
+           (to - from) * BLOCK_CACHE_SECTOR_SIZE);
+  }
+  xSemaphoreGive(bc.lock);
+  return res;
+}
+
+static void *allocPreferPSRAM(size_t bytes)
+{
+  void *p = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM);
+  return p ? p : malloc(bytes);
+}
+
+bool blockCacheBegin(uint8_t pdrv, size_t bytes)
+{
+  if (bc.enabled)
+  {
+    return true;
+  }
+
+  bc.slotCount = bytes / BLOCK_BYTES;
+  if (bc.slotCount < 8)
+  {
+    Serial.println("Block cache too small, disabled");
+    return false;
+  }
+  uint32_t buckets = 1;
+  while (buckets < bc.slotCount)
+  {
+    buckets <<= 1;
+  }
+
+  bc.data = (uint8_t *)heap_caps_malloc((size_t)bc.slotCount * BLOCK_BYTES, MALLOC_CAP_SPIRAM);
+  // The SDMMC driver cannot DMA into PSRAM and would fall back to one
+  // transfer per sector, so card reads land in internal RAM first
+  bc.bounce = (uint8_t *)heap_caps_malloc((size_t)BLOCK_CACHE_BOUNCE_BLOCKS * BLOCK_BYTES,
+                                          MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  bc.slots = (CacheSlot *)allocPreferPSRAM(bc.slotCount * sizeof(CacheSlot));
+  bc.buckets = (int32_t *)allocPreferPSRAM(buckets * sizeof(int32_t));
+  bc.a1outSize = bc.slotCount / 2;
+  bc.a1out = (uint32_t *)allocPreferPSRAM(bc.a1outSize * sizeof(uint32_t));
+  if (!bc.data || !bc.bounce || !bc.slots || !bc.buckets || !bc.a1out)
+  {
+    Serial.println("Block cache allocation failed, disabled");
+    free(bc.data);
+    free(bc.bounce);
+    free(bc.slots);
+    free(bc.buckets);
+    free(bc.a1out);
+    memset(&bc, 0, sizeof(bc));
+    return false;
+  }
+
+  bc.bucketMask = buckets - 1;
+  bc.a1inTarget = max((uint32_t)1, bc.slotCount * BLOCK_CACHE_A1IN_PERCENT / 100);
+  bc.pdrv = pdrv;
+  bc.lock = xSemaphoreCreateMutex();
+  blockCacheInvalidateAll();
+
+  // Route the SD volume's disk I/O through the cache
+  static const ff_diskio_impl_t cachedImpl = {
+      .init = &ff_sdmmc_initialize,
+      .status = &ff_sdmmc_status,
+      .read = &cachedRead,
+      .write = &cachedWrite,
+      .ioctl = &ff_sdmmc_ioctl,
+  };
+  ff_diskio_register(pdrv, &cachedImpl);
+  bc.enabled = true;
+
+  Serial.printf("Block cache: %u blocks of %u bytes (%.2f KB) on drive %u\n",
+                bc.slotCount, BLOCK_BYTES, bc.slotCount * BLOCK_BYTES / 1024.0, pdrv);
+  return true;
+}
+
+bool blockCacheReadSectors(uint8_t pdrv, uint8_t *buffer, uint32_t sector, uint32_t count)
+{
+  return cachedRead(pdrv, buffer, sector, count) == RES_OK;
+}
+
+bool blockCacheEnabled()
+{
+  return bc.enabled;
+}
+
+void blockCacheInvalidateAll()
+{
+  if (bc.lock)
+    xSemaphoreTake(bc.lock, portMAX_DELAY);
+
+  for (uint32_t i = 0; i <= bc.bucketMask; i++)
+    bc.buckets[i] = -1;
+  for (uint32_t i = 0; i < bc.slotCount; i++)
+  {
+    bc.slots[i].queue = QUEUE_FREE;
+    bc.slots[i].prev = -1;
+    bc.slots[i].hashNext = -1;
+    bc.slots[i].next = (i + 1 < bc.slotCount) ? (int32_t)(i + 1) : -1;
+  }
+  bc.freeList = 0;
+  bc.a1in = {-1, -1, 0};
+  bc.am = {-1, -1, 0};
+  bc.a1outCount = 0;
+  bc.a1outPos = 0;
+
+  if (bc.lock)
+    xSemaphoreGive(bc.lock);
+}
+
+const char *blockCacheSetRoute(const char *route)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  const char *previous = nullptr;
+  portENTER_CRITICAL(&taskRoutesMux);
+  // With the table full the task's traffic counts as "other"
+  int i = taskEntry(task, route != nullptr);
+  if (i >= 0)
+  {
+    previous = taskRoutes[i].route;
+    taskRoutes[i].route = route;
+    if (route == nullptr && !taskRoutes[i].bypass)
+    {
+      taskRoutes[i].task = nullptr;
+    }
+  }
+  portEXIT_CRITICAL(&taskRoutesMux);
+  return previous;
+}
+
+bool blockCacheSetBypass(bool bypass)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  bool previous = false;
+  portENTER_CRITICAL(&taskRoutesMux);
+  int i = taskEntry(task, bypass);
+  if (i >= 0)
+  {
+    previous = taskRoutes[i].bypass;
+    taskRoutes[i].bypass = bypass;
+    if (!bypass && taskRoutes[i].route == nullptr)
+    {
+      taskRoutes[i].task = nullptr;
+    }
+  }
+  portEXIT_CRITICAL(&taskRoutesMux);
+  if (bypass && i < 0)
+  {
+    // No entry left for the task: nothing it reads may come from a stale
+    // copy, so drop them all
+    blockCacheInvalidateAll();
+  }
+  return previous;
+}
+
+void blockCacheStatsJson(JsonObject obj)
+{
+  uint32_t total = bc.hits + bc.misses;
+  obj["enabled"] = bc.enabled;
+  obj["blocks"] = bc.slotCount;
+  obj["blockSize"] = BLOCK_BYTES;
+  obj["a1in"] = bc.a1in.size;
+  obj["am"] = bc.am.size;
+  obj["hits"] = bc.hits;
+  obj["misses"] = bc.misses;
+  obj["hitRatio"] = total ? (float)bc.hits / total : 0;
+  obj["prefetched"] = bc.prefetched;
+  obj["writes"] = bc.writes;
+  obj["bypassedSectors"] = bc.bypassed;
+  obj["missUsPerBlock"] = bc.missUsPerBlock;
+
+  JsonObject routes = obj["routes"].to<JsonObject>();
+  for (int i = 0; i < BLOCK_CACHE_MAX_ROUTES && bc.routes[i].name; i++)
+  {
+    const RouteStats &r = bc.routes[i];
+    JsonObject route = routes[r.name].to<JsonObject>();
+    uint32_t routeTotal = r.hits + r.misses;
+    route["hits"] = r.hits;
+    route["misses"] = r.misses;
+    route["hitRatio"] = routeTotal ? (float)r.hits / routeTotal : 0;
+    route["savedMs"] = (uint32_t)(r.savedUs / 1000);
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef __BLOCK_CACHE_H
+#define __BLOCK_CACHE_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include "sd_read_write.h"
+
+#define BLOCK_CACHE_PDRV SD_FATFS_PDRV
+#define BLOCK_CACHE_SECTOR_SIZE 512
+#define BLOCK_CACHE_BLOCK_SECTORS 8            // 4 KB cache blocks
+#define BLOCK_CACHE_SIZE (1024 * 1024)         // Total PSRAM used for cached data
+#define BLOCK_CACHE_A1IN_PERCENT 25            // 2Q: share of blocks in the FIFO probation queue
+#define BLOCK_CACHE_PREFETCH_BLOCKS 16         // Read-ahead after a sequential access pattern
+#define BLOCK_CACHE_BOUNCE_BLOCKS 4            // Internal DMA buffer for card reads (16 KB)
+#define BLOCK_CACHE_MAX_ROUTES 8
+#define BLOCK_CACHE_MAX_TASK_ROUTES 8          // Tasks with a route set at the same time
+
+// Shared sector cache between FatFs and the SDMMC driver.
+// It replaces the FatFs disk I/O callbacks of the SD volume with caching
+// wrappers, so file data and FAT/directory sectors of every user of SD_MMC
+// go through it. Eviction uses 2Q: blocks seen once live in a small FIFO,
+// only blocks referenced again get promoted to the LRU main queue, so a big
+// sequential download cannot flush the hot set. Writes go straight to the
+// card and update cached copies.
+bool blockCacheBegin(uint8_t pdrv = BLOCK_CACHE_PDRV, size_t bytes = BLOCK_CACHE_SIZE);
+bool blockCacheEnabled();
+void blockCacheInvalidateAll();
+void blockCacheStatsJson(JsonObject obj);
+
+// Raw sector read through the cache, for tools that walk FAT metadata
+bool blockCacheReadSectors(uint8_t pdrv, uint8_t *buffer, uint32_t sector, uint32_t count);
+
+// Attribute cache traffic of the calling task to a route name (nullptr:
+// none); returns the task's previous route
+const char *blockCacheSetRoute(const char *route);
+
+class BlockCacheRouteScope
+{
+private:
+    const char *previous;
+
+public:
+    BlockCacheRouteScope(const char *route) : previous(blockCacheSetRoute(route)) {}
+    ~BlockCacheRouteScope() { blockCacheSetRoute(previous); }
+};
+
+// Reads of the calling task skip the cache: cached copies of the sectors
+// read are dropped and the data comes from the card, for read-back checks
+// of what was just written. Returns the previous setting.
+bool blockCacheSetBypass(bool bypass);
+
+class BlockCacheBypassScope
+{
+private:
+    bool previous;
+
+public:
+    BlockCacheBypassScope() : previous(blockCacheSetBypass(true)) {}
+    ~BlockCacheBypassScope() { blockCacheSetBypass(previous); }
+};
+
+#endif
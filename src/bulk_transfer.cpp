@@ -0,0 +1,791 @@
+#include "bulk_transfer.h"
+#include "bg_job.h"
+#include "checksum.h"
+#include "checksum_index.h"
+#include "du_tree.h"
+#include "file_crypt.h"
+#include "fs_events.h"
+#include "lz4_store.h"
+#include "meta_cache.h"
+#include "sd_io_sched.h"
+#include "sd_read_write.h"
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+#define OP_GET 'G'
+#define OP_PUT 'P'
+#define OP_LIST 'L'
+
+#define STAGING_SUFFIX ".part"
+// Marks the end of a transfer on the full-slot queue
+#define RING_END 0xFF
+// Directory entries are batched into one send of this size
+#define LIST_BUFFER_SIZE 1460
+
+struct __attribute__((packed)) BulkRequest
+{
+  uint32_t magic;
+  uint8_t op;
+  uint8_t flags;
+  uint16_t pathLen;
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct __attribute__((packed)) BulkResponse
+{
+  uint32_t magic;
+  uint32_t status;
+  uint64_t length;
+  uint32_t crc;
+  uint32_t ms;
+};
+
+struct __attribute__((packed)) BulkEntry
+{
+  uint8_t isDir;
+  uint8_t reserved;
+  uint16_t nameLen;
+  uint32_t mtime;
+  uint64_t size;
+};
+
+static fs::FS *bulkFs = nullptr;
+static SemaphoreHandle_t configLock = nullptr;
+static BulkConfig config = {BULK_DEFAULT_SLOT_SIZE, BULK_DEFAULT_SLOTS, 0, 0, true};
+
+static struct
+{
+  uint32_t connections;
+  uint32_t gets;
+  uint32_t puts;
+  uint32_t lists;
+  uint32_t errors;
+  uint64_t bytesOut;
+  uint64_t bytesIn;
+  float lastGetMBps;
+  float lastPutMBps;
+  float bestGetMBps;
+  float bestPutMBps;
+  int sndBuf;
+  int rcvBuf;
+  volatile uint32_t clientIp; // 0 while idle
+} stats;
+
+static void *psramAlloc(size_t size)
+{
+  void *p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  return p ? p : malloc(size);
+}
+
+// ---- Socket helpers --------------------------------------------------------
+
+static bool sendAll(int sock, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while (len > 0)
+  {
+    int n = send(sock, p, len, 0);
+    if (n <= 0)
+    {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool recvAll(int sock, void *data, size_t len)
+{
+  uint8_t *p = (uint8_t *)data;
+  while (len > 0)
+  {
+    int n = recv(sock, p, len, 0);
+    if (n <= 0)
+    {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool sendResponse(int sock, uint32_t status, uint64_t length, uint32_t crc = 0, uint32_t ms = 0)
+{
+  BulkResponse response = {BULK_RESPONSE_MAGIC, status, length, crc, ms};
+  if (status != 0)
+  {
+    stats.errors++;
+  }
+  return sendAll(sock, &response, sizeof(response));
+}
+
+static float rateMBps(uint64_t bytes, uint32_t ms)
+{
+  return ms ? bytes / 1000.0f / ms : 0;
+}
+
+// ---- Slot ring -------------------------------------------------------------
+
+// PSRAM buffers passed between the socket task and the card task: the
+// producer takes a free slot, fills it and queues it as full; the consumer
+// drains it and hands it back
+class SlotRing
+{
+private:
+  uint8_t *slots[BULK_MAX_SLOTS];
+  size_t lens[BULK_MAX_SLOTS];
+  uint8_t count;
+  QueueHandle_t freeSlots;
+  QueueHandle_t fullSlots;
+
+public:
+  size_t slotSize;
+
+  SlotRing() : count(0), freeSlots(nullptr), fullSlots(nullptr), slotSize(0) {}
+  ~SlotRing() { end(); }
+
+  bool begin(uint8_t n, size_t size)
+  {
+    slotSize = size;
+    bool ok = true;
+    for (count = 0; count < n && ok; count++)
+    {
+      slots[count] = (uint8_t *)psramAlloc(size);
+      ok = slots[count] != nullptr;
+    }
+    freeSlots = xQueueCreate(n, sizeof(uint8_t));
+    fullSlots = xQueueCreate(n + 1, sizeof(uint8_t));
+    return ok && freeSlots && fullSlots;
+  }
+
+  void end()
+  {
+    for (uint8_t i = 0; i < count; i++)
+    {
+      free(slots[i]);
+    }
+    count = 0;
+    if (freeSlots)
+    {
+      vQueueDelete(freeSlots);
+      vQueueDelete(fullSlots);
+      freeSlots = fullSlots = nullptr;
+    }
+  }
+
+  // Empties both queues and marks every slot free, before a transfer
+  void reset()
+  {
+    uint8_t i;
+    while (xQueueReceive(freeSlots, &i, 0) == pdTRUE)
+    {
+    }
+    while (xQueueReceive(fullSlots, &i, 0) == pdTRUE)
+    {
+    }
+    for (i = 0; i < count; i++)
+    {
+      xQueueSend(freeSlots, &i, 0);
+    }
+  }
+
+  uint8_t *data(uint8_t i) { return slots[i]; }
+  size_t &len(uint8_t i) { return lens[i]; }
+
+  uint8_t takeFree()
+  {
+    uint8_t i;
+    xQueueReceive(freeSlots, &i, portMAX_DELAY);
+    return i;
+  }
+  void putFree(uint8_t i) { xQueueSend(freeSlots, &i, portMAX_DELAY); }
+  uint8_t takeFull()
+  {
+    uint8_t i;
+    xQueueReceive(fullSlots, &i, portMAX_DELAY);
+    return i;
+  }
+  void putFull(uint8_t i) { xQueueSend(fullSlots, &i, portMAX_DELAY); }
+};
+
+// The card side of one transfer, run on the core the socket task is not on
+struct CardJob
+{
+  SlotRing *ring;
+  File *file;
+  FileCipher *cipher; // nullptr for plain files
+  LzbReader *reader;  // set for a .lz4b file (get): decompressed into the ring
+  uint64_t offset;    // content offset of the first byte (get)
+  uint64_t remaining; // bytes to read (get)
+  bool write;
+  volatile bool abort;
+  volatile bool failed;
+  SemaphoreHandle_t done;
+};
+
+static void cardTask(void *arg)
+{
+  CardJob &job = *(CardJob *)arg;
+  SlotRing &ring = *job.ring;
+  if (job.write)
+  {
+    uint8_t i;
+    while ((i = ring.takeFull()) != RING_END)
+    {
+      // After a failed write the ring only drains
+      if (!job.failed && sdIoWrite(*job.file, ring.data(i), ring.len(i), SD_IO_BULK) != ring.len(i))
+      {
+        job.failed = true;
+      }
+      ring.putFree(i);
+    }
+  }
+  else
+  {
+    while (job.remaining > 0 && !job.abort)
+    {
+      uint8_t i = ring.takeFree();
+      size_t want = min((uint64_t)ring.slotSize, job.remaining);
+      size_t n;
+      if (job.reader)
+      {
+        SdIoScope io(SD_IO_BULK);
+        n = job.reader->read(job.offset, ring.data(i), want);
+      }
+      else
+      {
+        n = sdIoRead(*job.file, ring.data(i), want, SD_IO_BULK);
+      }
+      if (n == 0)
+      {
+        job.failed = true;
+        ring.putFree(i);
+        break;
+      }
+      if (job.cipher)
+      {
+        job.cipher->apply(job.offset, ring.data(i), ring.data(i), n);
+      }
+      ring.len(i) = n;
+      job.offset += n;
+      job.remaining -= n;
+      ring.putFull(i);
+    }
+    ring.putFull(RING_END);
+  }
+  xSemaphoreGive(job.done);
+  vTaskDelete(NULL);
+}
+
+static bool startCardJob(CardJob &job)
+{
+  job.abort = false;
+  job.failed = false;
+  job.done = xSemaphoreCreateBinary();
+  if (job.done == nullptr)
+  {
+    return false;
+  }
+  BaseType_t otherCore = xPortGetCoreID() == 0 ? 1 : 0;
+  if (xTaskCreatePinnedToCore(cardTask, "bulk_io", BULK_IO_TASK_STACK, &job, BG_JOB_PRIORITY + 1, NULL,
+                              otherCore) != pdPASS)
+  {
+    vSemaphoreDelete(job.done);
+    return false;
+  }
+  return true;
+}
+
+static void finishCardJob(CardJob &job)
+{
+  xSemaphoreTake(job.done, portMAX_DELAY);
+  vSemaphoreDelete(job.done);
+}
+
+// ---- Operations ------------------------------------------------------------
+
+// Returns false if the connection has to be closed
+static bool handleGet(int sock, SlotRing &ring, const String &path, uint64_t offset, uint64_t length)
+{
+  // As with /download, a file stored compressed is also found under its
+  // plain name and is sent decompressed: a get returns what was put
+  String stored = path;
+  FsMeta meta;
+  bool found = g_metaCache.stat(stored, meta) && !meta.isDirectory;
+  if (!found && !lzbIsCompressed(path))
+  {
+    stored = path + LZB_SUFFIX;
+    found = g_metaCache.stat(stored, meta) && !meta.isDirectory;
+  }
+  if (!found)
+  {
+    return sendResponse(sock, 404, 0);
+  }
+
+  File file;
+  FileCipher cipher;
+  LzbReader reader;
+  bool compressed = lzbIsCompressed(stored);
+  CryptState crypt = CRYPT_PLAIN;
+  uint64_t size;
+  size_t skip = 0;
+  if (compressed)
+  {
+    if (!reader.open(*bulkFs, stored))
+    {
+      return sendResponse(sock, 500, 0);
+    }
+    size = reader.size();
+  }
+  else
+  {
+    file = bulkFs->open(stored, FILE_READ);
+    if (!file)
+    {
+      return sendResponse(sock, 500, 0);
+    }
+    crypt = cryptProbe(file, cipher);
+    if (crypt == CRYPT_LOCKED)
+    {
+      file.close();
+      return sendResponse(sock, 403, 0);
+    }
+    skip = crypt == CRYPT_ENCRYPTED ? CRYPT_HEADER_SIZE : 0;
+    size = meta.size - skip;
+  }
+  if (offset > size)
+  {
+    file.close();
+    return sendResponse(sock, 416, 0);
+  }
+  length = length == 0 ? size - offset : min(length, size - offset);
+  if (!compressed && !file.seek(offset + skip))
+  {
+    file.close();
+    return sendResponse(sock, 500, 0);
+  }
+
+  CardJob job = {&ring, &file, crypt == CRYPT_ENCRYPTED ? &cipher : nullptr, compressed ? &reader : nullptr, offset,
+                 length, false, false, false, nullptr};
+  ring.reset();
+  if (!startCardJob(job))
+  {
+    file.close();
+    return sendResponse(sock, 503, 0);
+  }
+  uint32_t start = millis();
+  bool connected = sendResponse(sock, 0, length);
+  uint64_t sent = 0;
+  uint8_t i;
+  while ((i = ring.takeFull()) != RING_END)
+  {
+    if (connected && !job.abort)
+    {
+      connected = sendAll(sock, ring.data(i), ring.len(i));
+      sent += ring.len(i);
+    }
+    if (!connected)
+    {
+      job.abort = true;
+    }
+    ring.putFree(i);
+  }
+  finishCardJob(job);
+  file.close();
+
+  uint32_t ms = millis() - start;
+  stats.gets++;
+  stats.bytesOut += sent;
+  stats.lastGetMBps = rateMBps(sent, ms);
+  stats.bestGetMBps = max(stats.bestGetMBps, stats.lastGetMBps);
+  // A short read leaves the client waiting for bytes that never come
+  return connected && !job.failed;
+}
+
+// Reads and drops `length` bytes of a refused put
+static bool discardBody(int sock, SlotRing &ring, uint64_t length)
+{
+  uint8_t *buffer = ring.data(0);
+  while (length > 0)
+  {
+    size_t n = min((uint64_t)ring.slotSize, length);
+    if (!recvAll(sock, buffer, n))
+    {
+      return false;
+    }
+    length -= n;
+  }
+  return true;
+}
+
+static bool handlePut(int sock, SlotRing &ring, const String &path, uint64_t length)
+{
+  FsMeta meta;
+  String parent = path.substring(0, max(1, path.lastIndexOf('/')));
+  uint32_t status = 0;
+  if (path == "/" || (g_metaCache.stat(path, meta) && meta.isDirectory))
+  {
+    status = 409;
+  }
+  else if (!g_metaCache.stat(parent, meta) || !meta.isDirectory)
+  {
+    status = 404;
+  }
+  else if (length > UINT32_MAX - CRYPT_HEADER_SIZE)
+  {
+    status = 413; // FAT32 file size limit
+  }
+
+  bool encrypt = cryptIsEncryptedPath(path);
+  String stagingPath = path + STAGING_SUFFIX;
+  File file;
+  FileCipher cipher;
+  if (status == 0)
+  {
+    fsCacheInvalidate(stagingPath);
+    file = bulkFs->open(stagingPath, FILE_WRITE);
+    if (file && encrypt)
+    {
+      uint8_t header[CRYPT_HEADER_SIZE];
+      if (!cipher.create(path, header) || file.write(header, sizeof(header)) != sizeof(header))
+      {
+        file.close();
+      }
+    }
+    if (!file)
+    {
+      bulkFs->remove(stagingPath);
+      fsCacheInvalidate(stagingPath);
+      status = 500;
+    }
+  }
+  size_t storedBytes = length + (encrypt ? CRYPT_HEADER_SIZE : 0);
+  bool preallocated = status == 0 && length > 0 && preallocateFile(file, storedBytes);
+
+  CardJob job = {&ring, &file, nullptr, nullptr, 0, 0, true, false, false, nullptr};
+  ring.reset();
+  if (status == 0 && !startCardJob(job))
+  {
+    file.close();
+    bulkFs->remove(stagingPath);
+    fsCacheInvalidate(stagingPath);
+    status = 503;
+  }
+  if (status != 0)
+  {
+    return discardBody(sock, ring, length) && sendResponse(sock, status, 0);
+  }
+
+  uint32_t start = millis();
+  Hasher crc(HASH_CRC32);
+  uint64_t received = 0;
+  bool connected = true;
+  while (received < length)
+  {
+    uint8_t i = ring.takeFree();
+    size_t n = min((uint64_t)ring.slotSize, length - received);
+    if (!recvAll(sock, ring.data(i), n))
+    {
+      connected = false;
+      ring.putFree(i);
+      break;
+    }
+    crc.update(ring.data(i), n);
+    if (encrypt)
+    {
+      cipher.apply(received, ring.data(i), ring.data(i), n);
+    }
+    ring.len(i) = n;
+    ring.putFull(i);
+    received += n;
+    fsEventProgress(path, received, length, false);
+  }
+  ring.putFull(RING_END);
+  finishCardJob(job);
+  file.close();
+  uint32_t ms = millis() - start;
+  fsEventProgress(path, received, received, true);
+  if (preallocated && received + (encrypt ? CRYPT_HEADER_SIZE : 0) < storedBytes)
+  {
+    truncateFile(stagingPath.c_str(), received + (encrypt ? CRYPT_HEADER_SIZE : 0));
+  }
+  fsCacheInvalidate(stagingPath);
+
+  if (!connected || job.failed)
+  {
+    bulkFs->remove(stagingPath);
+    fsCacheInvalidate(stagingPath);
+    Serial.printf("Bulk put failed: %s after %llu bytes\n", path.c_str(), (unsigned long long)received);
+    return connected && sendResponse(sock, 507, 0);
+  }
+
+  FsMeta old;
+  if (g_metaCache.stat(path, old) && !old.isDirectory)
+  {
+    duFileRemoved(path, old.size);
+  }
+  fsCacheInvalidate(path);
+  if (bulkFs->exists(path))
+  {
+    bulkFs->remove(path);
+  }
+  if (!bulkFs->rename(stagingPath, path))
+  {
+    bulkFs->remove(stagingPath);
+    fsCacheInvalidate(stagingPath);
+    return sendResponse(sock, 500, 0);
+  }
+  fsCacheInvalidate(stagingPath);
+  fsCacheInvalidate(path);
+
+  uint8_t digest[4];
+  crc.finish(digest);
+  if (!encrypt && g_metaCache.stat(path, meta))
+  {
+    g_checksumIndex.store(path, meta, HASH_CRC32, digest);
+  }
+  fsEventAdded(path, storedBytes, false);
+  duFileAdded(path, storedBytes);
+  lzbRemoveTwin(*bulkFs, path);
+
+  stats.puts++;
+  stats.bytesIn += length;
+  stats.lastPutMBps = rateMBps(length, ms);
+  stats.bestPutMBps = max(stats.bestPutMBps, stats.lastPutMBps);
+  return sendResponse(sock, 0, 0, crc.crc32(), ms);
+}
+
+static bool handleList(int sock, const String &path)
+{
+  File dir = bulkFs->open(path);
+  if (!dir || !dir.isDirectory())
+  {
+    return sendResponse(sock, 404, 0);
+  }
+  if (!sendResponse(sock, 0, 0))
+  {
+    return false;
+  }
+
+  uint8_t buffer[LIST_BUFFER_SIZE];
+  size_t used = 0;
+  bool connected = true;
+  File entry;
+  while (connected && (entry = dir.openNextFile()))
+  {
+    String name = entry.path();
+    name = name.substring(name.lastIndexOf('/') + 1);
+    BulkEntry e = {(uint8_t)entry.isDirectory(), 0, (uint16_t)min(name.length(), (unsigned)BULK_MAX_PATH),
+                   (uint32_t)entry.getLastWrite(), entry.isDirectory() ? 0 : (uint64_t)entry.size()};
+    entry.close();
+    if (used + sizeof(e) + e.nameLen > sizeof(buffer))
+    {
+      connected = sendAll(sock, buffer, used);
+      used = 0;
+    }
+    memcpy(buffer + used, &e, sizeof(e));
+    memcpy(buffer + used + sizeof(e), name.c_str(), e.nameLen);
+    used += sizeof(e) + e.nameLen;
+  }
+  dir.close();
+  BulkEntry last = {0, 0, 0, 0, 0};
+  memcpy(buffer + used, &last, sizeof(last));
+  used += sizeof(last);
+  stats.lists++;
+  return connected && sendAll(sock, buffer, used);
+}
+
+// ---- Server ----------------------------------------------------------------
+
+static void serveConnection(int sock)
+{
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  BulkConfig cfg = config;
+  xSemaphoreGive(configLock);
+
+  if (cfg.sndBuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &cfg.sndBuf, sizeof(cfg.sndBuf)) != 0)
+  {
+    Serial.println("Bulk: SO_SNDBUF not supported by this lwIP build");
+  }
+  if (cfg.rcvBuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &cfg.rcvBuf, sizeof(cfg.rcvBuf)) != 0)
+  {
+    Serial.println("Bulk: SO_RCVBUF not supported by this lwIP build");
+  }
+  int noDelay = cfg.noDelay;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  struct timeval timeout = {BULK_IDLE_TIMEOUT_MS / 1000, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  socklen_t optLen = sizeof(stats.sndBuf);
+  if (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &stats.sndBuf, &optLen) != 0)
+  {
+    stats.sndBuf = -1;
+  }
+  optLen = sizeof(stats.rcvBuf);
+  if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &stats.rcvBuf, &optLen) != 0)
+  {
+    stats.rcvBuf = -1;
+  }
+
+  SlotRing ring;
+  if (!ring.begin(cfg.slots, cfg.slotSize))
+  {
+    Serial.println("Bulk: not enough memory for the slot ring");
+    sendResponse(sock, 503, 0);
+    return;
+  }
+
+  bool open = true;
+  while (open)
+  {
+    BulkRequest request;
+    char path[BULK_MAX_PATH + 1];
+    if (!recvAll(sock, &request, sizeof(request)) || request.magic != BULK_MAGIC || request.pathLen == 0 ||
+        request.pathLen > BULK_MAX_PATH || !recvAll(sock, path, request.pathLen))
+    {
+      break;
+    }
+    path[request.pathLen] = '\0';
+    String p = path;
+    if (!p.startsWith("/"))
+    {
+      p = "/" + p;
+    }
+    while (p.length() > 1 && p.endsWith("/"))
+    {
+      p.remove(p.length() - 1);
+    }
+
+    switch (request.op)
+    {
+    case OP_GET:
+      open = handleGet(sock, ring, p, request.offset, request.length);
+      break;
+    case OP_PUT:
+      open = handlePut(sock, ring, p, request.length);
+      break;
+    case OP_LIST:
+      open = handleList(sock, p);
+      break;
+    default:
+      sendResponse(sock, 400, 0);
+      open = false;
+      break;
+    }
+  }
+}
+
+static void bulkTask(void *arg)
+{
+  int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(BULK_PORT);
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0)
+  {
+    Serial.printf("Bulk: cannot listen on port %d\n", BULK_PORT);
+    if (listener >= 0)
+    {
+      close(listener);
+    }
+    vTaskDelete(NULL);
+    return;
+  }
+  Serial.printf("Bulk transfer service on port %d\n", BULK_PORT);
+
+  for (;;)
+  {
+    struct sockaddr_in client;
+    socklen_t len = sizeof(client);
+    int sock = accept(listener, (struct sockaddr *)&client, &len);
+    if (sock < 0)
+    {
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+    stats.connections++;
+    stats.clientIp = client.sin_addr.s_addr;
+    serveConnection(sock);
+    stats.clientIp = 0;
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
+  }
+}
+
+bool bulkBegin(fs::FS &fs)
+{
+  if (bulkFs != nullptr)
+  {
+    return true;
+  }
+  bulkFs = &fs;
+  configLock = xSemaphoreCreateMutex();
+  return xTaskCreatePinnedToCore(bulkTask, "bulk", BULK_TASK_STACK, NULL, BG_JOB_PRIORITY + 1, NULL,
+                                 tskNO_AFFINITY) == pdPASS;
+}
+
+BulkConfig bulkGetConfig()
+{
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  BulkConfig copy = config;
+  xSemaphoreGive(configLock);
+  return copy;
+}
+
+bool bulkSetConfig(const BulkConfig &next, String &error)
+{
+  if (next.slotSize < 4096 || next.slotSize > BULK_MAX_SLOT_SIZE)
+  {
+    error = "slotSize must be 4096 .. " + String(BULK_MAX_SLOT_SIZE);
+    return false;
+  }
+  if (next.slots < 2 || next.slots > BULK_MAX_SLOTS)
+  {
+    error = "slots must be 2 .. " + String(BULK_MAX_SLOTS);
+    return false;
+  }
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  config = next;
+  xSemaphoreGive(configLock);
+  return true;
+}
+
+void bulkStatusJson(JsonObject obj)
+{
+  BulkConfig cfg = bulkGetConfig();
+  obj["port"] = BULK_PORT;
+  JsonObject c = obj["config"].to<JsonObject>();
+  c["slotSize"] = cfg.slotSize;
+  c["slots"] = cfg.slots;
+  c["sndBuf"] = cfg.sndBuf;
+  c["rcvBuf"] = cfg.rcvBuf;
+  c["noDelay"] = cfg.noDelay;
+
+  uint32_t ip = stats.clientIp;
+  obj["client"] = ip ? IPAddress(ip).toString() : "";
+  obj["connections"] = stats.connections;
+  obj["gets"] = stats.gets;
+  obj["puts"] = stats.puts;
+  obj["lists"] = stats.lists;
+  obj["errors"] = stats.errors;
+  obj["bytesOut"] = stats.bytesOut;
+  obj["bytesIn"] = stats.bytesIn;
+  obj["lastGetMBps"] = stats.lastGetMBps;
+  obj["lastPutMBps"] = stats.lastPutMBps;
+  obj["bestGetMBps"] = stats.bestGetMBps;
+  obj["bestPutMBps"] = stats.bestPutMBps;
+  // What the last connection's socket actually got (-1: not reported)
+  obj["socketSndBuf"] = stats.sndBuf;
+  obj["socketRcvBuf"] = stats.rcvBuf;
+}
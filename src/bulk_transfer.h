@@ -0,0 +1,65 @@
+#ifndef __BULK_TRANSFER_H
+#define __BULK_TRANSFER_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+
+// Bulk file transfer on a plain TCP port, without HTTP parsing or
+// multipart framing. One client is served at a time; a connection carries
+// any number of requests. All integers are little-endian.
+//
+//   request   "BLK1", u8 op, u8 flags, u16 path length, u64 offset,
+//             u64 length, path
+//   response  "BLKR", u32 status, u64 length, u32 CRC32, u32 device ms
+//
+// op 'G' (get): `length` bytes from `offset` (0 = to the end). The
+//            response is followed by `length` bytes of content. A .lz4b
+//            file (also found under its plain name) is sent decompressed,
+//            offsets counting in the original content, as /download does.
+// op 'P' (put): `length` bytes of content follow the request. The file is
+//            written to a staging file and moved into place once complete;
+//            the response carries the CRC32 of what was received.
+// op 'L' (list): the response is followed by entries
+//            u8 isDir, u8 reserved, u16 name length, u32 mtime, u64 size,
+//            name, and ends with an entry whose name length is 0.
+//
+// status is 0 on success, otherwise an HTTP-like code (404, 409, 500 ...).
+// A refused or failed put still reads its whole body before answering, so
+// the connection stays usable; a malformed request closes it.
+#define BULK_PORT 9000
+#define BULK_MAGIC 0x314B4C42          // "BLK1"
+#define BULK_RESPONSE_MAGIC 0x524B4C42 // "BLKR"
+#define BULK_MAX_PATH 512
+#define BULK_TASK_STACK 6144
+#define BULK_IO_TASK_STACK 4096
+// A connection that sends nothing for this long is dropped
+#define BULK_IDLE_TIMEOUT_MS 30000
+
+// Tunables, applied to the next connection. The card side runs on its own
+// task through a ring of `slots` PSRAM buffers of `slotSize` bytes, so
+// card reads/writes overlap with socket sends/receives.
+struct BulkConfig
+{
+    uint32_t slotSize;
+    uint8_t slots;
+    // 0 keeps the lwIP defaults. lwIP caps both at its configured window
+    // sizes; bulkStatusJson() reports what the socket actually got.
+    uint32_t sndBuf;
+    uint32_t rcvBuf;
+    bool noDelay;
+};
+
+#define BULK_DEFAULT_SLOT_SIZE (32 * 1024)
+#define BULK_DEFAULT_SLOTS 4
+#define BULK_MAX_SLOT_SIZE (256 * 1024)
+#define BULK_MAX_SLOTS 16
+
+// Starts the listener task; call once the network is up
+bool bulkBegin(fs::FS &fs);
+BulkConfig bulkGetConfig();
+// Returns false and fills `error` if a value is out of range
+bool bulkSetConfig(const BulkConfig &config, String &error);
+void bulkStatusJson(JsonObject obj);
+
+#endif
@@ -0,0 +1,66 @@
+#include "checksum.h"
+
+bool parseHashAlgo(const String &name, HashAlgo &algo)
+{
+  if (name.equalsIgnoreCase("crc32"))
+  {
+    algo = HASH_CRC32;
+    return true;
+  }
+  if (name.equalsIgnoreCase("sha256"))
+  {
+    algo = HASH_SHA256;
+    return true;
+  }
+  return false;
+}
+
+const char *hashAlgoName(HashAlgo algo)
+{
+  return algo == HASH_SHA256 ? "sha256" : "crc32";
+}
+
+String hashToHex(const uint8_t *digest, size_t len)
+{
+  static const char digits[] = "0123456789abcdef";
+  String hex;
+  hex.reserve(len * 2);
+  for (size_t i = 0; i < len; i++)
+  {
+    hex += digits[digest[i] >> 4];
+    hex += digits[digest[i] & 0x0F];
+  }
+  return hex;
+}
+
+bool hashFile(fs::FS &fs, const String &path, HashAlgo algo, uint8_t *buffer, size_t bufferSize,
+              uint8_t *digest, volatile bool *cancel, SdIoClass ioClass)
+{
+  File file = fs.open(path, FILE_READ);
+  if (!file || file.isDirectory())
+  {
+    return false;
+  }
+
+  Hasher hasher(algo);
+  size_t remaining = file.size();
+  while (remaining > 0)
+  {
+    if (cancel && *cancel)
+    {
+      file.close();
+      return false;
+    }
+    size_t bytesRead = sdIoRead(file, buffer, min(remaining, bufferSize), ioClass);
+    if (bytesRead == 0)
+    {
+      file.close();
+      return false;
+    }
+    hasher.update(buffer, bytesRead);
+    remaining -= bytesRead;
+  }
+  file.close();
+  hasher.finish(digest);
+  return true;
+}
@@ -0,0 +1,18 @@
+#ifndef __CHECKSUM_H
+#define __CHECKSUM_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include "hash_kernels.h"
+#include "sd_io_sched.h"
+
+bool parseHashAlgo(const String &name, HashAlgo &algo);
+const char *hashAlgoName(HashAlgo algo);
+String hashToHex(const uint8_t *digest, size_t len);
+
+// Hash a whole file through `buffer`. Returns false on read errors or if
+// `cancel` becomes true. Reads are scheduled as `ioClass`.
+bool hashFile(fs::FS &fs, const String &path, HashAlgo algo, uint8_t *buffer, size_t bufferSize,
+              uint8_t *digest, volatile bool *cancel = nullptr, SdIoClass ioClass = SD_IO_BACKGROUND);
+
+#endif
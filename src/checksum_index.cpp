@@ -0,0 +1,657 @@
+#include "checksum_index.h"
+#include "bg_job.h"
+#include "sd_io_sched.h"
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <vector>
+
+ChecksumIndex g_checksumIndex;
+
+#define INDEX_MAGIC 0x31494B43 // "CKI1"
+
+#define RECORD_HAS_CRC32 0x01
+#define RECORD_HAS_SHA256 0x02
+#define RECORD_CORRUPT 0x04
+#define RECORD_SEEN 0x08 // transient, set by the scrub walk
+
+struct IndexHeader
+{
+  uint32_t magic;
+  uint32_t count;
+};
+
+static void lockTake(void *lock)
+{
+  if (lock)
+  {
+    xSemaphoreTake((SemaphoreHandle_t)lock, portMAX_DELAY);
+  }
+}
+
+static void lockGive(void *lock)
+{
+  if (lock)
+  {
+    xSemaphoreGive((SemaphoreHandle_t)lock);
+  }
+}
+
+bool ChecksumIndex::begin(fs::FS &filesystem)
+{
+  fs = &filesystem;
+  if (lock == nullptr)
+  {
+    lock = xSemaphoreCreateMutex();
+    saveLock = xSemaphoreCreateMutex();
+  }
+  if (!load())
+  {
+    count = 0;
+  }
+  Serial.printf("Checksum index: %u records\n", count);
+  return true;
+}
+
+bool ChecksumIndex::load()
+{
+  File file = fs->open(CHECKSUM_INDEX_PATH, FILE_READ);
+  if (!file)
+  {
+    return false;
+  }
+
+  IndexHeader header;
+  if (sdIoRead(file, (uint8_t *)&header, sizeof(header), SD_IO_BACKGROUND) != sizeof(header) || header.magic != INDEX_MAGIC ||
+      file.size() != sizeof(header) + (size_t)header.count * sizeof(Record))
+  {
+    Serial.println("Checksum index is corrupt, starting empty");
+    file.close();
+    return false;
+  }
+
+  size_t bytes = (size_t)max(header.count, (uint32_t)64) * sizeof(Record);
+  Record *loaded = (Record *)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM);
+  if (loaded == nullptr)
+  {
+    loaded = (Record *)malloc(bytes);
+  }
+  if (loaded == nullptr)
+  {
+    file.close();
+    return false;
+  }
+
+  size_t want = (size_t)header.count * sizeof(Record);
+  if (sdIoRead(file, (uint8_t *)loaded, want, SD_IO_BACKGROUND) != want)
+  {
+    free(loaded);
+    file.close();
+    return false;
+  }
+  file.close();
+
+  free(records);
+  records = loaded;
+  count = header.count;
+  capacity = bytes / sizeof(Record);
+  return true;
+}
+
+// Index of the first record whose key is >= `key`
+int32_t ChecksumIndex::find(uint64_t key)
+{
+  int32_t lo = 0, hi = count;
+  while (lo < hi)
+  {
+    int32_t mid = (lo + hi) / 2;
+    if (records[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Record for `path` matching `meta`; a record describing older content is reset.
+// Called with the lock held.
+ChecksumIndex::Record *ChecksumIndex::upsert(const String &path, const FsMeta &meta)
+{
+  uint64_t key = fsPathKey(path);
+  int32_t pos = find(key);
+  if (pos < (int32_t)count && records[pos].key == key)
+  {
+    Record &r = records[pos];
+    if (r.size != meta.size || r.mtime != (uint32_t)meta.mtime)
+    {
+      r.size = meta.size;
+      r.mtime = meta.mtime;
+      r.flags &= RECORD_SEEN;
+    }
+    return &r;
+  }
+
+  if (count == capacity)
+  {
+    uint32_t grown = max(capacity * 2, (uint32_t)64);
+    Record *bigger = (Record *)heap_caps_realloc(records, grown * sizeof(Record), MALLOC_CAP_SPIRAM);
+    if (bigger == nullptr)
+    {
+      bigger = (Record *)realloc(records, grown * sizeof(Record));
+    }
+    if (bigger == nullptr)
+    {
+      return nullptr;
+    }
+    records = bigger;
+    capacity = grown;
+  }
+
+  memmove(&records[pos + 1], &records[pos], (count - pos) * sizeof(Record));
+  count++;
+  Record &r = records[pos];
+  memset(&r, 0, sizeof(r));
+  r.key = key;
+  r.size = meta.size;
+  r.mtime = meta.mtime;
+  return &r;
+}
+
+bool ChecksumIndex::lookup(const String &path, const FsMeta &meta, HashAlgo algo, uint8_t *digest)
+{
+  uint64_t key = fsPathKey(path);
+  bool found = false;
+
+  lockTake(lock);
+  int32_t pos = find(key);
+  if (pos < (int32_t)count && records[pos].key == key)
+  {
+    const Record &r = records[pos];
+    if (r.size == meta.size && r.mtime == (uint32_t)meta.mtime)
+    {
+      if (algo == HASH_CRC32 && (r.flags & RECORD_HAS_CRC32))
+      {
+        digest[0] = r.crc32 >> 24;
+        digest[1] = r.crc32 >> 16;
+        digest[2] = r.crc32 >> 8;
+        digest[3] = r.crc32;
+        found = true;
+      }
+      else if (algo == HASH_SHA256 && (r.flags & RECORD_HAS_SHA256))
+      {
+        memcpy(digest, r.sha256, sizeof(r.sha256));
+        found = true;
+      }
+    }
+  }
+  if (found)
+    hits++;
+  else
+    misses++;
+  lockGive(lock);
+  return found;
+}
+
+void ChecksumIndex::store(const String &path, const FsMeta &meta, HashAlgo algo, const uint8_t *digest)
+{
+  lockTake(lock);
+  Record *r = upsert(path, meta);
+  if (r != nullptr)
+  {
+    if (algo == HASH_CRC32)
+    {
+      r->crc32 = ((uint32_t)digest[0] << 24) | ((uint32_t)digest[1] << 16) | (digest[2] << 8) | digest[3];
+      r->flags |= RECORD_HAS_CRC32;
+    }
+    else
+    {
+      memcpy(r->sha256, digest, sizeof(r->sha256));
+      r->flags |= RECORD_HAS_SHA256;
+    }
+    r->flags |= RECORD_SEEN;
+    if (!dirty)
+    {
+      dirty = true;
+      dirtySince = millis();
+    }
+  }
+  lockGive(lock);
+}
+
+void ChecksumIndex::setCorrupt(const String &path, bool corrupt)
+{
+  uint64_t key = fsPathKey(path);
+  lockTake(lock);
+  int32_t pos = find(key);
+  if (pos < (int32_t)count && records[pos].key == key)
+  {
+    uint8_t flags = corrupt ? (records[pos].flags | RECORD_CORRUPT) : (records[pos].flags & ~RECORD_CORRUPT);
+    if (flags != records[pos].flags)
+    {
+      records[pos].flags = flags;
+      if (!dirty)
+      {
+        dirty = true;
+        dirtySince = millis();
+      }
+    }
+  }
+  lockGive(lock);
+}
+
+bool ChecksumIndex::isCorrupt(const String &path)
+{
+  uint64_t key = fsPathKey(path);
+  lockTake(lock);
+  int32_t pos = find(key);
+  bool corrupt = pos < (int32_t)count && records[pos].key == key && (records[pos].flags & RECORD_CORRUPT);
+  lockGive(lock);
+  return corrupt;
+}
+
+void ChecksumIndex::clearSeen()
+{
+  lockTake(lock);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    records[i].flags &= ~RECORD_SEEN;
+  }
+  lockGive(lock);
+}
+
+void ChecksumIndex::markSeen(const String &path)
+{
+  uint64_t key = fsPathKey(path);
+  lockTake(lock);
+  int32_t pos = find(key);
+  if (pos < (int32_t)count && records[pos].key == key)
+  {
+    records[pos].flags |= RECORD_SEEN;
+  }
+  lockGive(lock);
+}
+
+uint32_t ChecksumIndex::pruneUnseen()
+{
+  lockTake(lock);
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (records[i].flags & RECORD_SEEN)
+    {
+      records[kept++] = records[i];
+    }
+  }
+  uint32_t pruned = count - kept;
+  count = kept;
+  if (pruned && !dirty)
+  {
+    dirty = true;
+    dirtySince = millis();
+  }
+  lockGive(lock);
+  return pruned;
+}
+
+void ChecksumIndex::flush(bool force)
+{
+  if (fs == nullptr || !dirty || (!force && millis() - dirtySince < CHECKSUM_INDEX_FLUSH_MS))
+  {
+    return;
+  }
+
+  // saveLock is held for the whole write so the worker and the scrub job
+  // never write the sidecar at the same time; lock only while the records
+  // are copied, so lookups do not wait on background card grants
+  lockTake(saveLock);
+  lockTake(lock);
+  if (!dirty)
+  {
+    lockGive(lock);
+    lockGive(saveLock);
+    return;
+  }
+  IndexHeader header = {INDEX_MAGIC, count};
+  size_t recordBytes = (size_t)count * sizeof(Record);
+  size_t want = sizeof(header) + recordBytes;
+  uint8_t *image = (uint8_t *)heap_caps_malloc(want, MALLOC_CAP_SPIRAM);
+  if (image == nullptr)
+  {
+    lockGive(lock);
+    lockGive(saveLock);
+    Serial.println("Failed to write checksum index");
+    return;
+  }
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + sizeof(header), records, recordBytes);
+  dirty = false;
+  lockGive(lock);
+
+  String tmpPath = String(CHECKSUM_INDEX_PATH) + ".tmp";
+  File file = fs->open(tmpPath, FILE_WRITE);
+  size_t written = file ? sdIoWrite(file, image, want, SD_IO_BACKGROUND) : 0;
+  file.close();
+  free(image);
+
+  if (written == want)
+  {
+    fs->remove(CHECKSUM_INDEX_PATH);
+    fs->rename(tmpPath, CHECKSUM_INDEX_PATH);
+  }
+  else
+  {
+    Serial.println("Short write on checksum index");
+    fs->remove(tmpPath);
+    lockTake(lock);
+    if (!dirty)
+    {
+      dirty = true;
+      dirtySince = millis();
+    }
+    lockGive(lock);
+  }
+  fsCacheInvalidate(CHECKSUM_INDEX_PATH);
+  fsCacheInvalidate(tmpPath);
+  lockGive(saveLock);
+}
+
+void ChecksumIndex::statsJson(JsonObject obj)
+{
+  uint32_t total = hits + misses;
+  obj["records"] = count;
+  obj["hits"] = hits;
+  obj["misses"] = misses;
+  obj["hitRatio"] = total ? (float)hits / total : 0;
+  obj["dirty"] = dirty;
+}
+
+void checksumResultJson(JsonObject obj, const String &path, const FsMeta &meta, HashAlgo algo,
+                        const uint8_t *digest, bool cached)
+{
+  obj["path"] = path;
+  obj["algo"] = hashAlgoName(algo);
+  obj["size"] = meta.size;
+  obj["mtime"] = (uint32_t)meta.mtime;
+  obj["digest"] = hashToHex(digest, hashDigestSize(algo));
+  obj["cached"] = cached;
+  obj["corrupt"] = g_checksumIndex.isCorrupt(path);
+}
+
+// ---- Hash worker -----------------------------------------------------------
+
+static fs::FS *checksumFs = nullptr;
+static QueueHandle_t hashQueue = nullptr;
+static uint8_t *hashBuffer = nullptr;
+
+static uint8_t *allocBuffer()
+{
+  uint8_t *buffer = (uint8_t *)heap_caps_malloc(CHECKSUM_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
+  return buffer ? buffer : (uint8_t *)malloc(CHECKSUM_BUFFER_SIZE);
+}
+
+static bool sameMeta(const FsMeta &a, const FsMeta &b)
+{
+  return a.exists == b.exists && a.size == b.size && a.mtime == b.mtime;
+}
+
+static void runHashTask(HashTask &task)
+{
+  DynamicJsonDocument doc(512);
+  JsonObject obj = doc.to<JsonObject>();
+  FsMeta meta;
+  uint8_t digest[HASH_MAX_DIGEST];
+
+  if (!g_metaCache.stat(task.path, meta) || meta.isDirectory)
+  {
+    obj["error"] = "File not found";
+  }
+  else if (g_checksumIndex.lookup(task.path, meta, task.algo, digest))
+  {
+    checksumResultJson(obj, task.path, meta, task.algo, digest, true);
+  }
+  else if (hashFile(*checksumFs, task.path, task.algo, hashBuffer, CHECKSUM_BUFFER_SIZE, digest, &task.cancelled))
+  {
+    // Only trust the digest if nobody wrote to the file meanwhile. Asks the
+    // card: a write that has not invalidated the cache yet must not be missed
+    FsMeta after;
+    if (g_metaCache.statUncached(task.path, after) && sameMeta(meta, after))
+    {
+      g_checksumIndex.store(task.path, meta, task.algo, digest);
+    }
+    checksumResultJson(obj, task.path, meta, task.algo, digest, false);
+  }
+  else
+  {
+    obj["error"] = task.cancelled ? "Cancelled" : "Read failed";
+  }
+
+  serializeJson(doc, task.body);
+  task.done = true;
+}
+
+static void hashWorker(void *arg)
+{
+  for (;;)
+  {
+    std::shared_ptr<HashTask> *item;
+    if (xQueueReceive(hashQueue, &item, pdMS_TO_TICKS(CHECKSUM_INDEX_FLUSH_MS)) == pdTRUE)
+    {
+      if (!(*item)->cancelled)
+      {
+        runHashTask(**item);
+      }
+      delete item;
+    }
+    g_checksumIndex.flush();
+  }
+}
+
+bool checksumBegin(fs::FS &fs)
+{
+  if (hashQueue != nullptr)
+  {
+    return true;
+  }
+  checksumFs = &fs;
+  g_checksumIndex.begin(fs);
+
+  hashBuffer = allocBuffer();
+  hashQueue = xQueueCreate(CHECKSUM_QUEUE_DEPTH, sizeof(std::shared_ptr<HashTask> *));
+  if (hashBuffer == nullptr || hashQueue == nullptr ||
+      xTaskCreatePinnedToCore(hashWorker, "hash", CHECKSUM_WORKER_STACK, NULL, BG_JOB_PRIORITY, NULL,
+                              tskNO_AFFINITY) != pdPASS)
+  {
+    Serial.println("Failed to start checksum worker");
+    return false;
+  }
+  return true;
+}
+
+bool checksumQueue(const std::shared_ptr<HashTask> &task)
+{
+  if (hashQueue == nullptr)
+  {
+    return false;
+  }
+  std::shared_ptr<HashTask> *item = new std::shared_ptr<HashTask>(task);
+  if (xQueueSend(hashQueue, &item, 0) != pdTRUE)
+  {
+    delete item;
+    return false;
+  }
+  return true;
+}
+
+// ---- Scrub -----------------------------------------------------------------
+
+static BackgroundJob scrubJob("scrub");
+
+static struct
+{
+  HashAlgo algo;
+  uint32_t files;
+  uint32_t verified;
+  uint32_t added;
+  uint32_t corrupt;
+  uint32_t skipped;
+  uint32_t errors;
+  uint32_t pruned;
+  uint64_t bytes;
+  uint32_t reportCount;
+  String report[CHECKSUM_SCRUB_REPORT];
+} scrub;
+
+static void scrubFile(const String &path, const FsMeta &meta, uint8_t *buffer)
+{
+  uint8_t expected[HASH_MAX_DIGEST];
+  uint8_t digest[HASH_MAX_DIGEST];
+  bool known = g_checksumIndex.lookup(path, meta, scrub.algo, expected);
+  g_checksumIndex.markSeen(path);
+
+  if (!hashFile(*checksumFs, path, scrub.algo, buffer, CHECKSUM_BUFFER_SIZE, digest, nullptr))
+  {
+    scrub.errors++;
+    return;
+  }
+  scrub.bytes += meta.size;
+
+  FsMeta after;
+  if (!g_metaCache.stat(path, after) || !sameMeta(meta, after))
+  {
+    scrub.skipped++; // Written while we read it
+    return;
+  }
+
+  if (!known)
+  {
+    g_checksumIndex.store(path, meta, scrub.algo, digest);
+    scrub.added++;
+  }
+  else if (memcmp(expected, digest, hashDigestSize(scrub.algo)) != 0)
+  {
+    // Same size and mtime but different content: the data changed on the media
+    g_checksumIndex.setCorrupt(path, true);
+    scrub.corrupt++;
+    if (scrub.reportCount < CHECKSUM_SCRUB_REPORT)
+    {
+      scrub.report[scrub.reportCount++] = path;
+    }
+    Serial.printf("Scrub: %s does not match its %s (expected %s, got %s)\n", path.c_str(),
+                  hashAlgoName(scrub.algo), hashToHex(expected, hashDigestSize(scrub.algo)).c_str(),
+                  hashToHex(digest, hashDigestSize(scrub.algo)).c_str());
+  }
+  else
+  {
+    g_checksumIndex.setCorrupt(path, false);
+    scrub.verified++;
+  }
+}
+
+static bool runScrub(BackgroundJob &job)
+{
+  uint8_t *buffer = allocBuffer();
+  if (buffer == nullptr)
+  {
+    job.setMessage("out of memory");
+    return false;
+  }
+
+  g_checksumIndex.clearSeen();
+  std::vector<String> pending;
+  pending.push_back("/");
+  String tmpIndex = String(CHECKSUM_INDEX_PATH) + ".tmp";
+
+  while (!pending.empty() && !job.cancelled())
+  {
+    String dirPath = pending.back();
+    pending.pop_back();
+    File dir = checksumFs->open(dirPath);
+    if (!dir || !dir.isDirectory())
+    {
+      continue;
+    }
+
+    File entry;
+    while (!job.cancelled())
+    {
+      {
+        SdIoScope io(SD_IO_BACKGROUND);
+        entry = dir.openNextFile();
+      }
+      if (!entry)
+      {
+        break;
+      }
+      String path = entry.path();
+      if (entry.isDirectory())
+      {
+        pending.push_back(path);
+        entry.close();
+        continue;
+      }
+      FsMeta meta = {true, false, (uint32_t)entry.size(), entry.getLastWrite(), 0, 0};
+      entry.close();
+      if (path == CHECKSUM_INDEX_PATH || path == tmpIndex)
+      {
+        continue;
+      }
+
+      job.setMessage(path);
+      scrubFile(path, meta, buffer);
+      scrub.files++;
+      job.setProgress(scrub.files, 0);
+    }
+    dir.close();
+  }
+  free(buffer);
+
+  if (!job.cancelled())
+  {
+    scrub.pruned = g_checksumIndex.pruneUnseen();
+  }
+  g_checksumIndex.flush(true);
+  job.setMessage(String(scrub.corrupt) + " corrupt file(s)");
+  return scrub.errors == 0;
+}
+
+bool startChecksumScrub(HashAlgo algo)
+{
+  if (checksumFs == nullptr || scrubJob.running())
+  {
+    return false;
+  }
+  scrub.algo = algo;
+  scrub.files = scrub.verified = scrub.added = scrub.corrupt = 0;
+  scrub.skipped = scrub.errors = scrub.pruned = 0;
+  scrub.bytes = 0;
+  scrub.reportCount = 0;
+  return scrubJob.start(runScrub);
+}
+
+void cancelChecksumScrub()
+{
+  scrubJob.cancel();
+}
+
+void checksumScrubStatusJson(JsonObject obj)
+{
+  scrubJob.statusJson(obj["job"].to<JsonObject>());
+  obj["algo"] = hashAlgoName(scrub.algo);
+  obj["files"] = scrub.files;
+  obj["bytes"] = scrub.bytes;
+  obj["verified"] = scrub.verified;
+  obj["added"] = scrub.added;
+  obj["corrupt"] = scrub.corrupt;
+  obj["skipped"] = scrub.skipped;
+  obj["errors"] = scrub.errors;
+  obj["pruned"] = scrub.pruned;
+
+  JsonArray corrupt = obj["corruptFiles"].to<JsonArray>();
+  for (uint32_t i = 0; i < scrub.reportCount && !scrubJob.running(); i++)
+  {
+    corrupt.add(scrub.report[i]);
+  }
+  g_checksumIndex.statsJson(obj["index"].to<JsonObject>());
+}
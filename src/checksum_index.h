@@ -0,0 +1,106 @@
+#ifndef __CHECKSUM_INDEX_H
+#define __CHECKSUM_INDEX_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+#include <memory>
+#include "checksum.h"
+#include "meta_cache.h"
+
+// Sidecar file holding the index on the card
+#define CHECKSUM_INDEX_PATH "/.checksums"
+// Dirty index is written back at most this often
+#define CHECKSUM_INDEX_FLUSH_MS 10000
+// Read buffer of the hash worker and of the scrub job (PSRAM)
+#define CHECKSUM_BUFFER_SIZE (256 * 1024)
+// Pending /hash requests; more are rejected
+#define CHECKSUM_QUEUE_DEPTH 4
+#define CHECKSUM_WORKER_STACK 6144
+// Corrupt files listed in the scrub report
+#define CHECKSUM_SCRUB_REPORT 32
+
+// Persistent map path -> (size, mtime, CRC32, SHA-256). A digest is only
+// trusted while the file's size and mtime are unchanged, so writers do not
+// need to notify the index. Records are kept sorted by path key in PSRAM.
+class ChecksumIndex
+{
+private:
+    struct Record
+    {
+        uint64_t key;
+        uint32_t size;
+        uint32_t mtime;
+        uint32_t crc32;
+        uint8_t sha256[32];
+        uint8_t flags;
+        uint8_t reserved[3];
+    };
+
+    fs::FS *fs;
+    Record *records;
+    uint32_t count;
+    uint32_t capacity;
+    bool dirty;
+    uint32_t dirtySince;
+    void *lock;
+    void *saveLock; // one sidecar write at a time, without holding lock
+
+    uint32_t hits;
+    uint32_t misses;
+
+    int32_t find(uint64_t key);
+    Record *upsert(const String &path, const FsMeta &meta);
+    bool load();
+
+public:
+    ChecksumIndex() : fs(nullptr), records(nullptr), count(0), capacity(0), dirty(false),
+                      dirtySince(0), lock(nullptr), saveLock(nullptr), hits(0), misses(0) {}
+
+    bool begin(fs::FS &fs);
+
+    // Cached digest of `path` if its size and mtime still match `meta`
+    bool lookup(const String &path, const FsMeta &meta, HashAlgo algo, uint8_t *digest);
+    void store(const String &path, const FsMeta &meta, HashAlgo algo, const uint8_t *digest);
+
+    void setCorrupt(const String &path, bool corrupt);
+    bool isCorrupt(const String &path);
+
+    // Scrub bookkeeping: forget records whose files were not seen by a full walk
+    void clearSeen();
+    void markSeen(const String &path);
+    uint32_t pruneUnseen();
+
+    // Write the index back if it changed (at most every CHECKSUM_INDEX_FLUSH_MS unless forced)
+    void flush(bool force = false);
+
+    void statsJson(JsonObject obj);
+};
+
+extern ChecksumIndex g_checksumIndex;
+
+// One /hash request handed to the hash worker task
+struct HashTask
+{
+    String path;
+    HashAlgo algo;
+    volatile bool cancelled;
+    volatile bool done;
+    String body; // JSON result, valid once done
+};
+
+// Start the worker that computes digests off the network task
+bool checksumBegin(fs::FS &fs);
+
+// Queue a task; false if the worker is busy with too many requests
+bool checksumQueue(const std::shared_ptr<HashTask> &task);
+
+void checksumResultJson(JsonObject obj, const String &path, const FsMeta &meta, HashAlgo algo,
+                        const uint8_t *digest, bool cached);
+
+// Background re-verification of every file against the index
+bool startChecksumScrub(HashAlgo algo);
+void cancelChecksumScrub();
+void checksumScrubStatusJson(JsonObject obj);
+
+#endif
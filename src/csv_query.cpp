@@ -0,0 +1,643 @@
+#include "csv_query.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t csvSplit(const char *line, const char *end, char delim, CsvField *fields, size_t maxFields)
+{
+  size_t count = 0;
+  const char *p = line;
+  while (count < maxFields)
+  {
+    CsvField &f = fields[count++];
+    if (p < end && *p == '"')
+    {
+      // Quoted: up to the closing quote that is not part of a "" pair
+      const char *q = ++p;
+      while (q < end && !(*q == '"' && (q + 1 == end || q[1] != '"')))
+      {
+        q += (*q == '"') ? 2 : 1;
+      }
+      f.p = p;
+      f.len = (q < end ? q : end) - p;
+      p = q < end ? q + 1 : end;
+      const char *next = (const char *)memchr(p, delim, end - p);
+      p = next ? next : end;
+    }
+    else
+    {
+      const char *next = (const char *)memchr(p, delim, end - p);
+      f.p = p;
+      f.len = (next ? next : end) - p;
+      p = next ? next : end;
+    }
+    if (p == end)
+    {
+      break;
+    }
+    p++; // skip the delimiter
+  }
+  return count;
+}
+
+static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                               1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+bool csvParseNumber(const char *p, size_t len, double &out)
+{
+  const char *end = p + len;
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+  {
+    negative = *p == '-';
+    p++;
+  }
+
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+  {
+    if (mantissa < 1000000000000000000ULL)
+      mantissa = mantissa * 10 + (*p - '0');
+    else
+      exponent++;
+  }
+  if (p < end && *p == '.')
+  {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+    {
+      if (mantissa < 1000000000000000000ULL)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+  if (digits == 0)
+  {
+    return false;
+  }
+  if (p < end && (*p == 'e' || *p == 'E'))
+  {
+    p++;
+    bool negExp = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+      negExp = *p == '-';
+      p++;
+    }
+    if (p == end)
+    {
+      return false;
+    }
+    int e = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+      if (e < 10000)
+        e = e * 10 + (*p - '0');
+    }
+    exponent += negExp ? -e : e;
+  }
+  if (p != end)
+  {
+    return false;
+  }
+
+  double value = (double)mantissa;
+  if (exponent >= 0 && exponent <= 22)
+    value *= POW10[exponent];
+  else if (exponent < 0 && exponent >= -22)
+    value /= POW10[-exponent];
+  else
+    value *= pow(10.0, exponent);
+  out = negative ? -value : value;
+  return true;
+}
+
+static std::string trim(const char *p, size_t len)
+{
+  while (len > 0 && (*p == ' ' || *p == '\t'))
+  {
+    p++;
+    len--;
+  }
+  while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+    len--;
+  return std::string(p, len);
+}
+
+// Split `spec` at `sep` outside parentheses
+static std::vector<std::string> splitSpec(const char *spec, char sep)
+{
+  std::vector<std::string> parts;
+  if (spec == nullptr)
+  {
+    return parts;
+  }
+  int depth = 0;
+  const char *start = spec;
+  for (const char *p = spec;; p++)
+  {
+    if (*p == '(')
+      depth++;
+    else if (*p == ')')
+      depth--;
+    if (*p == '\0' || (*p == sep && depth == 0))
+    {
+      std::string part = trim(start, p - start);
+      if (!part.empty())
+        parts.push_back(part);
+      if (*p == '\0')
+        break;
+      start = p + 1;
+    }
+  }
+  return parts;
+}
+
+static uint32_t hashKey(const char *key, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= (uint8_t)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+CsvQuery::CsvQuery()
+    : delim(','), hasHeader(true), headerSeen(false), filterCount(0), aggCount(0), groupIndex(-1),
+      totalBins(0), maxIndex(0), rows(0), matched(0), bytes(0), badValues(0), groupOverflow(false)
+{
+}
+
+bool CsvQuery::parse(const char *filter, const char *group, const char *aggSpec, char delim, bool header)
+{
+  this->delim = delim;
+  hasHeader = header;
+
+  std::vector<std::string> parts = splitSpec(filter, ',');
+  if (parts.size() > CSV_MAX_FILTERS)
+  {
+    error = "Too many filters";
+    return false;
+  }
+  static const struct
+  {
+    const char *text;
+    Op op;
+  } ops[] = {{"<=", OP_LE}, {">=", OP_GE}, {"==", OP_EQ}, {"!=", OP_NE}, {"<", OP_LT}, {">", OP_GT}};
+  for (const std::string &part : parts)
+  {
+    Filter &f = filters[filterCount];
+    size_t at = std::string::npos;
+    size_t opLen = 0;
+    for (const auto &candidate : ops)
+    {
+      size_t pos = part.find(candidate.text);
+      if (pos != std::string::npos && (at == std::string::npos || pos < at))
+      {
+        at = pos;
+        opLen = strlen(candidate.text);
+        f.op = candidate.op;
+      }
+    }
+    if (at == std::string::npos || at == 0)
+    {
+      error = "Bad filter: " + part;
+      return false;
+    }
+    f.column = trim(part.c_str(), at);
+    f.text = trim(part.c_str() + at + opLen, part.size() - at - opLen);
+    f.numeric = csvParseNumber(f.text.c_str(), f.text.size(), f.number);
+    if (!f.numeric && f.op != OP_EQ && f.op != OP_NE)
+    {
+      error = "Filter needs a number: " + part;
+      return false;
+    }
+    filterCount++;
+  }
+
+  groupColumn = group ? trim(group, strlen(group)) : "";
+
+  parts = splitSpec(aggSpec, ',');
+  if (parts.empty())
+  {
+    parts.push_back("count");
+  }
+  if (parts.size() > CSV_MAX_AGGS)
+  {
+    error = "Too many aggregates";
+    return false;
+  }
+  static const struct
+  {
+    const char *name;
+    Agg agg;
+  } names[] = {{"count", AGG_COUNT}, {"sum", AGG_SUM}, {"min", AGG_MIN},
+               {"max", AGG_MAX}, {"mean", AGG_MEAN}, {"hist", AGG_HIST}};
+  for (const std::string &part : parts)
+  {
+    Aggregate &a = aggs[aggCount];
+    a.label = part;
+    size_t open = part.find('(');
+    std::string name = trim(part.c_str(), open == std::string::npos ? part.size() : open);
+    bool known = false;
+    for (const auto &n : names)
+    {
+      if (name == n.name)
+      {
+        a.agg = n.agg;
+        known = true;
+      }
+    }
+    if (!known)
+    {
+      error = "Unknown aggregate: " + part;
+      return false;
+    }
+
+    std::vector<std::string> args;
+    if (open != std::string::npos)
+    {
+      if (part.back() != ')')
+      {
+        error = "Bad aggregate: " + part;
+        return false;
+      }
+      std::string inner = part.substr(open + 1, part.size() - open - 2);
+      args = splitSpec(inner.c_str(), ':');
+    }
+    size_t wanted = a.agg == AGG_COUNT ? 0 : a.agg == AGG_HIST ? 4 : 1;
+    if (args.size() != wanted)
+    {
+      error = "Wrong arguments: " + part;
+      return false;
+    }
+    a.index = -1;
+    a.bins = 0;
+    if (wanted > 0)
+    {
+      a.column = args[0];
+    }
+    if (a.agg == AGG_HIST)
+    {
+      double bins;
+      if (!csvParseNumber(args[1].c_str(), args[1].size(), a.lo) ||
+          !csvParseNumber(args[2].c_str(), args[2].size(), a.hi) ||
+          !csvParseNumber(args[3].c_str(), args[3].size(), bins) || !(a.hi > a.lo) || bins < 1 ||
+          bins > CSV_MAX_BINS)
+      {
+        error = "Bad histogram: " + part;
+        return false;
+      }
+      a.bins = (uint32_t)bins;
+      a.binOffset = totalBins;
+      totalBins += a.bins;
+    }
+    aggCount++;
+  }
+
+  if (groupColumn.empty())
+  {
+    // One implicit group holds the totals
+    groups.resize(1);
+    Group &g = groups[0];
+    g.hash = 0;
+    g.keyLen = 0;
+    g.rows = 0;
+    memset(g.state, 0, sizeof(g.state));
+    g.bins.assign(totalBins, 0);
+  }
+  else
+  {
+    groups.reserve(CSV_MAX_GROUPS);
+  }
+
+  if (!hasHeader)
+  {
+    return applyHeader(nullptr, nullptr);
+  }
+  return true;
+}
+
+bool CsvQuery::resolve(const std::string &column, int &index, const CsvField *fields, size_t count)
+{
+  if (fields == nullptr)
+  {
+    // No header: columns are 0-based indexes
+    char *end;
+    long n = strtol(column.c_str(), &end, 10);
+    if (column.empty() || *end != '\0' || n < 0 || n >= CSV_MAX_COLUMNS)
+    {
+      error = "Bad column index: " + column;
+      return false;
+    }
+    index = (int)n;
+  }
+  else
+  {
+    index = -1;
+    for (size_t i = 0; i < count && index < 0; i++)
+    {
+      if (trim(fields[i].p, fields[i].len) == column)
+        index = (int)i;
+    }
+    if (index < 0)
+    {
+      error = "Unknown column: " + column;
+      return false;
+    }
+  }
+  if (index > maxIndex)
+  {
+    maxIndex = index;
+  }
+  return true;
+}
+
+bool CsvQuery::applyHeader(const char *line, const char *end)
+{
+  CsvField fields[CSV_MAX_COLUMNS];
+  size_t count = line ? csvSplit(line, end, delim, fields, CSV_MAX_COLUMNS) : 0;
+  const CsvField *header = line ? fields : nullptr;
+
+  for (size_t i = 0; i < filterCount; i++)
+  {
+    if (!resolve(filters[i].column, filters[i].index, header, count))
+      return false;
+  }
+  for (size_t i = 0; i < aggCount; i++)
+  {
+    if (aggs[i].agg != AGG_COUNT && !resolve(aggs[i].column, aggs[i].index, header, count))
+      return false;
+  }
+  if (!groupColumn.empty() && !resolve(groupColumn, groupIndex, header, count))
+  {
+    return false;
+  }
+  return true;
+}
+
+CsvQuery::Group *CsvQuery::findGroup(const char *key, size_t len)
+{
+  if (groupIndex < 0)
+  {
+    return &groups[0];
+  }
+
+  len = len < CSV_GROUP_KEY_LEN ? len : CSV_GROUP_KEY_LEN;
+  uint32_t hash = hashKey(key, len);
+  for (Group &g : groups)
+  {
+    if (g.hash == hash && g.keyLen == len && memcmp(g.key, key, len) == 0)
+      return &g;
+  }
+  if (groups.size() == CSV_MAX_GROUPS)
+  {
+    groupOverflow = true;
+    return nullptr;
+  }
+
+  groups.emplace_back();
+  Group &g = groups.back();
+  g.hash = hash;
+  g.keyLen = len;
+  memcpy(g.key, key, len);
+  g.rows = 0;
+  memset(g.state, 0, sizeof(g.state));
+  g.bins.assign(totalBins, 0);
+  return &g;
+}
+
+void CsvQuery::processLine(const char *line, const char *end)
+{
+  rows++;
+  CsvField fields[CSV_MAX_COLUMNS];
+  size_t count = csvSplit(line, end, delim, fields, maxIndex + 1);
+
+  for (size_t i = 0; i < filterCount; i++)
+  {
+    const Filter &f = filters[i];
+    if ((size_t)f.index >= count)
+    {
+      return;
+    }
+    const CsvField &field = fields[f.index];
+    bool pass;
+    if (f.numeric)
+    {
+      double v;
+      if (!csvParseNumber(field.p, field.len, v))
+        return;
+      switch (f.op)
+      {
+      case OP_LT:
+        pass = v < f.number;
+        break;
+      case OP_LE:
+        pass = v <= f.number;
+        break;
+      case OP_GT:
+        pass = v > f.number;
+        break;
+      case OP_GE:
+        pass = v >= f.number;
+        break;
+      case OP_EQ:
+        pass = v == f.number;
+        break;
+      default:
+        pass = v != f.number;
+        break;
+      }
+    }
+    else
+    {
+      bool equal = field.len == f.text.size() && memcmp(field.p, f.text.data(), field.len) == 0;
+      pass = f.op == OP_EQ ? equal : !equal;
+    }
+    if (!pass)
+    {
+      return;
+    }
+  }
+  matched++;
+
+  Group *g = groupIndex < 0 ? &groups[0]
+             : (size_t)groupIndex < count ? findGroup(fields[groupIndex].p, fields[groupIndex].len)
+                                          : findGroup("", 0);
+  if (g == nullptr)
+  {
+    return;
+  }
+  g->rows++;
+
+  for (size_t i = 0; i < aggCount; i++)
+  {
+    const Aggregate &a = aggs[i];
+    if (a.agg == AGG_COUNT)
+    {
+      continue;
+    }
+    double v;
+    if ((size_t)a.index >= count || !csvParseNumber(fields[a.index].p, fields[a.index].len, v))
+    {
+      badValues++;
+      continue;
+    }
+    AggState &s = g->state[i];
+    if (s.n == 0 || v < s.min)
+      s.min = v;
+    if (s.n == 0 || v > s.max)
+      s.max = v;
+    s.n++;
+    s.sum += v;
+    if (a.agg == AGG_HIST)
+    {
+      // Values outside [lo, hi) land in the edge bins
+      double pos = (v - a.lo) / (a.hi - a.lo) * a.bins;
+      uint32_t bin = pos <= 0 ? 0 : pos >= a.bins ? a.bins - 1 : (uint32_t)pos;
+      g->bins[a.binOffset + bin]++;
+    }
+  }
+}
+
+size_t CsvQuery::consume(const char *data, size_t len, bool eof)
+{
+  const char *p = data;
+  const char *end = data + len;
+  while (p < end && ok())
+  {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    if (nl == nullptr && !eof)
+    {
+      break;
+    }
+    const char *lineEnd = nl ? nl : end;
+    const char *textEnd = lineEnd;
+    if (textEnd > p && textEnd[-1] == '\r')
+      textEnd--;
+
+    if (textEnd > p)
+    {
+      if (hasHeader && !headerSeen)
+      {
+        headerSeen = true;
+        applyHeader(p, textEnd);
+      }
+      else
+      {
+        processLine(p, textEnd);
+      }
+    }
+    p = nl ? nl + 1 : end;
+  }
+  bytes += p - data;
+  return p - data;
+}
+
+static void appendEscaped(std::string &out, const char *s, size_t len)
+{
+  out += '"';
+  for (size_t i = 0; i < len; i++)
+  {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+    {
+      out += '\\';
+      out += (char)c;
+    }
+    else if (c < 0x20)
+    {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    }
+    else
+    {
+      out += (char)c;
+    }
+  }
+  out += '"';
+}
+
+static void appendNumber(std::string &out, double v)
+{
+  char num[32];
+  snprintf(num, sizeof(num), "%.10g", v);
+  out += num;
+}
+
+std::string CsvQuery::resultJson() const
+{
+  std::string out = "{\"rows\":";
+  appendNumber(out, (double)rows);
+  out += ",\"matched\":";
+  appendNumber(out, (double)matched);
+  out += ",\"badValues\":";
+  appendNumber(out, (double)badValues);
+  if (groupOverflow)
+  {
+    out += ",\"groupOverflow\":true";
+  }
+  out += ",\"groups\":[";
+
+  for (size_t gi = 0; gi < groups.size(); gi++)
+  {
+    const Group &g = groups[gi];
+    out += gi ? ",{" : "{";
+    if (groupIndex >= 0)
+    {
+      out += "\"key\":";
+      appendEscaped(out, g.key, g.keyLen);
+      out += ',';
+    }
+    out += "\"rows\":";
+    appendNumber(out, g.rows);
+
+    for (size_t i = 0; i < aggCount; i++)
+    {
+      const Aggregate &a = aggs[i];
+      const AggState &s = g.state[i];
+      out += ',';
+      appendEscaped(out, a.label.data(), a.label.size());
+      out += ':';
+      if (a.agg == AGG_COUNT)
+      {
+        appendNumber(out, g.rows);
+      }
+      else if (a.agg == AGG_HIST)
+      {
+        out += '[';
+        for (uint32_t b = 0; b < a.bins; b++)
+        {
+          if (b)
+            out += ',';
+          appendNumber(out, g.bins[a.binOffset + b]);
+        }
+        out += ']';
+      }
+      else if (s.n == 0)
+      {
+        out += "null";
+      }
+      else
+      {
+        double v = a.agg == AGG_SUM ? s.sum : a.agg == AGG_MIN ? s.min : a.agg == AGG_MAX ? s.max : s.sum / s.n;
+        appendNumber(out, v);
+      }
+    }
+    out += '}';
+  }
+  out += "]}";
+  return out;
+}
@@ -0,0 +1,150 @@
+#ifndef __CSV_QUERY_H
+#define __CSV_QUERY_H
+
+// Portable C++ only: the same engine runs on the device (/query) and on the
+// host (tools/csv_bench.cpp)
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define CSV_MAX_COLUMNS 64
+#define CSV_MAX_FILTERS 8
+#define CSV_MAX_AGGS 8
+#define CSV_MAX_GROUPS 64
+#define CSV_GROUP_KEY_LEN 32
+#define CSV_MAX_BINS 32
+
+// A field of the current line; points into the caller's buffer
+struct CsvField
+{
+    const char *p;
+    uint32_t len;
+};
+
+// Split [line, end) at `delim` without copying. A field starting with a
+// double quote runs to the closing quote and is returned without the
+// quotes ("" inside stays doubled). Stops after maxFields; returns the count.
+size_t csvSplit(const char *line, const char *end, char delim, CsvField *fields, size_t maxFields);
+
+// Decimal number with optional sign, fraction and exponent, surrounding
+// blanks allowed; false for empty or non-numeric fields
+bool csvParseNumber(const char *p, size_t len, double &out);
+
+// Streaming filter / group-by / aggregate over CSV lines:
+//   filter  "temp>20,site==north"   (AND of  < <= > >= == !=)
+//   group   "site"                  (at most CSV_MAX_GROUPS keys)
+//   aggs    "count,mean(temp),max(temp),hist(temp:0:50:10)"
+//           count sum min max mean hist(col:lo:hi:bins)
+// Columns are header names, or 0-based indexes when the file has no
+// header. Nothing is allocated per row.
+class CsvQuery
+{
+private:
+    enum Op : uint8_t
+    {
+        OP_LT,
+        OP_LE,
+        OP_GT,
+        OP_GE,
+        OP_EQ,
+        OP_NE
+    };
+
+    enum Agg : uint8_t
+    {
+        AGG_COUNT,
+        AGG_SUM,
+        AGG_MIN,
+        AGG_MAX,
+        AGG_MEAN,
+        AGG_HIST
+    };
+
+    struct Filter
+    {
+        std::string column;
+        int index;
+        Op op;
+        bool numeric;
+        double number;
+        std::string text;
+    };
+
+    struct Aggregate
+    {
+        std::string label;
+        std::string column;
+        int index;
+        Agg agg;
+        double lo;
+        double hi;
+        uint32_t bins;
+        uint32_t binOffset;
+    };
+
+    struct AggState
+    {
+        uint32_t n;
+        double sum;
+        double min;
+        double max;
+    };
+
+    struct Group
+    {
+        uint32_t hash;
+        uint8_t keyLen;
+        char key[CSV_GROUP_KEY_LEN];
+        uint32_t rows;
+        AggState state[CSV_MAX_AGGS];
+        std::vector<uint32_t> bins;
+    };
+
+    char delim;
+    bool hasHeader;
+    bool headerSeen;
+    Filter filters[CSV_MAX_FILTERS];
+    size_t filterCount;
+    Aggregate aggs[CSV_MAX_AGGS];
+    size_t aggCount;
+    std::string groupColumn;
+    int groupIndex;
+    uint32_t totalBins;
+    int maxIndex;
+
+    std::vector<Group> groups;
+    uint64_t rows;
+    uint64_t matched;
+    uint64_t bytes;
+    uint64_t badValues;
+    bool groupOverflow;
+    std::string error;
+
+    bool resolve(const std::string &column, int &index, const CsvField *fields, size_t count);
+    bool applyHeader(const char *line, const char *end);
+    void processLine(const char *line, const char *end);
+    Group *findGroup(const char *key, size_t len);
+
+public:
+    CsvQuery();
+
+    // Returns false with lastError() set on a malformed spec
+    bool parse(const char *filter, const char *group, const char *aggs, char delim, bool header);
+
+    // Process the complete lines of [data, data + len); at eof the last line
+    // may lack its newline. Returns the bytes consumed: the caller keeps the
+    // rest and passes it again in front of the next block.
+    size_t consume(const char *data, size_t len, bool eof);
+
+    // False once the header named a column that does not exist
+    bool ok() const { return error.empty(); }
+    const std::string &lastError() const { return error; }
+
+    uint64_t bytesProcessed() const { return bytes; }
+
+    // {"rows","matched","badValues","groups":[{"key","rows","count",...}]}
+    std::string resultJson() const;
+};
+
+#endif
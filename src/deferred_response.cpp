@@ -0,0 +1,33 @@
+#include "deferred_response.h"
+
+DeferredResponse::~DeferredResponse()
+{
+  delete inner;
+}
+
+void DeferredResponse::start(AsyncWebServerRequest *request)
+{
+  inner = make(request);
+  inner->_respond(request);
+}
+
+void DeferredResponse::_respond(AsyncWebServerRequest *request)
+{
+  if (ready())
+  {
+    start(request);
+  }
+}
+
+size_t DeferredResponse::_ack(AsyncWebServerRequest *request, size_t len, uint32_t time)
+{
+  if (inner)
+  {
+    return inner->_ack(request, len, time);
+  }
+  if (ready())
+  {
+    start(request);
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef __DEFERRED_RESPONSE_H
+#define __DEFERRED_RESPONSE_H
+
+#include "Arduino.h"
+#include <ESPAsyncWebServer.h>
+#include <functional>
+
+// Response for a request whose answer depends on work running on another
+// task. Nothing is sent until ready() returns true; it is asked on every ACK
+// and on the connection poll (~500 ms). make() then builds the real response
+// (status, headers, body), which is sent in its place. The network task is
+// never blocked and the client still gets a proper status code.
+// Both callbacks run on the network task.
+class DeferredResponse : public AsyncWebServerResponse
+{
+public:
+    typedef std::function<bool()> Ready;
+    typedef std::function<AsyncWebServerResponse *(AsyncWebServerRequest *request)> Make;
+
+private:
+    Ready ready;
+    Make make;
+    AsyncWebServerResponse *inner;
+
+    void start(AsyncWebServerRequest *request);
+
+public:
+    DeferredResponse(Ready ready, Make make) : ready(ready), make(make), inner(nullptr) {}
+    ~DeferredResponse() override;
+
+    bool _sourceValid() const override { return true; }
+    void _respond(AsyncWebServerRequest *request) override;
+    size_t _ack(AsyncWebServerRequest *request, size_t len, uint32_t time) override;
+    bool _finished() const override { return inner && inner->_finished(); }
+    bool _failed() const override { return inner && inner->_failed(); }
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include "delta_core.h"
+#include "hash_kernels.h"
+#include <string.h>
+#include <algorithm>
+
+static void putU32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t getU32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t deltaWeakChecksum(const uint8_t *data, size_t len)
+{
+  uint32_t a = 0, b = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    a += data[i];
+    b += (uint32_t)(len - i) * data[i];
+  }
+  return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+}
+
+void deltaSignatureHeader(uint8_t *out, uint32_t blockSize, uint64_t fileSize)
+{
+  memcpy(out, "DSG1", 4);
+  putU32(out + 4, blockSize);
+  putU32(out + 8, (uint32_t)fileSize);
+  putU32(out + 12, (uint32_t)(fileSize >> 32));
+  putU32(out + 16, (uint32_t)((fileSize + blockSize - 1) / blockSize));
+}
+
+size_t deltaSignatureBlocks(const uint8_t *data, size_t len, uint32_t blockSize, uint8_t *out)
+{
+  uint8_t digest[HASH_MAX_DIGEST];
+  Hasher strong(HASH_SHA256);
+  size_t written = 0;
+  for (size_t offset = 0; offset < len; offset += blockSize)
+  {
+    size_t n = std::min((size_t)blockSize, len - offset);
+    strong.reset();
+    strong.update(data + offset, n);
+    strong.finish(digest);
+    putU32(out + written, deltaWeakChecksum(data + offset, n));
+    memcpy(out + written + 4, digest, DELTA_STRONG_BYTES);
+    written += DELTA_SIGNATURE_ENTRY;
+  }
+  return written;
+}
+
+const char *deltaRebuild(const DeltaPatchIo &io, uint64_t oldSize, uint8_t *buffer, size_t bufferSize,
+                            DeltaPatchResult &result)
+{
+  result = {0, 0, 0, 0};
+  uint8_t header[DELTA_PATCH_HEADER];
+  if (!io.readPatch(header, sizeof(header)) || memcmp(header, "DPT1", 4) != 0)
+  {
+    return "bad patch header";
+  }
+  uint32_t blockSize = getU32(header + 4);
+  result.newSize = getU32(header + 8) | ((uint64_t)getU32(header + 12) << 32);
+  result.newCrc = getU32(header + 16);
+  if (blockSize < DELTA_MIN_BLOCK || blockSize > DELTA_MAX_BLOCK)
+  {
+    return "bad block size";
+  }
+  if (io.sized)
+  {
+    io.sized(result.newSize);
+  }
+
+  Hasher crc(HASH_CRC32);
+  uint64_t written = 0;
+  const char *error = nullptr;
+  while (!error)
+  {
+    uint8_t op;
+    if (!io.readPatch(&op, 1))
+    {
+      error = "truncated patch";
+      break;
+    }
+    if (op == 'E')
+    {
+      break;
+    }
+
+    uint8_t args[8];
+    if (op == 'C' && io.readPatch(args, 8))
+    {
+      uint64_t offset = (uint64_t)getU32(args) * blockSize;
+      uint64_t len = (uint64_t)getU32(args + 4) * blockSize;
+      if (offset >= oldSize)
+      {
+        error = "copy outside the device's file";
+        break;
+      }
+      len = std::min(len, oldSize - offset);
+      while (len > 0 && !error)
+      {
+        size_t n = (size_t)std::min((uint64_t)bufferSize, len);
+        if (!io.readOld(offset, buffer, n) || !io.write(buffer, n))
+        {
+          error = "copy failed";
+        }
+        crc.update(buffer, n);
+        offset += n;
+        len -= n;
+        written += n;
+        result.copiedBytes += n;
+      }
+    }
+    else if (op == 'L' && io.readPatch(args, 4))
+    {
+      uint32_t len = getU32(args);
+      while (len > 0 && !error)
+      {
+        size_t n = (size_t)std::min((uint32_t)bufferSize, len);
+        if (!io.readPatch(buffer, n) || !io.write(buffer, n))
+        {
+          error = "literal copy failed";
+        }
+        crc.update(buffer, n);
+        len -= n;
+        written += n;
+        result.literalBytes += n;
+      }
+    }
+    else
+    {
+      error = "bad patch op";
+    }
+
+    if (!error && written > result.newSize)
+    {
+      error = "result larger than announced";
+    }
+    if (!error && io.progress && !io.progress(written, result.newSize))
+    {
+      error = "cancelled";
+    }
+  }
+
+  if (!error && written != result.newSize)
+  {
+    error = "result size mismatch";
+  }
+  if (!error && crc.crc32() != result.newCrc)
+  {
+    error = "result CRC32 mismatch";
+  }
+  return error;
+}
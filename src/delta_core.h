@@ -0,0 +1,72 @@
+#ifndef __DELTA_CORE_H
+#define __DELTA_CORE_H
+
+// Portable C++ only: the signature and patch formats of delta_sync.* build
+// on the host too (tools/delta_test.cpp round-trips them).
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+// rsync-style delta sync.
+//
+// Signature (GET /sync/signature), little-endian:
+//   "DSG1" | u32 blockSize | u64 fileSize | u32 blockCount
+//   then per block: u32 weak | u8 strong[DELTA_STRONG_BYTES]
+// weak is the rsync rolling checksum (a | b << 16, both mod 2^16) over the
+// block, strong the first bytes of its SHA-256. The last block may be short.
+//
+// Patch (POST /sync/patch), little-endian:
+//   "DPT1" | u32 blockSize | u64 newSize | u32 newCrc32
+//   then ops: 'C' u32 firstBlock u32 count   copy blocks of the device's file
+//             'L' u32 length <bytes>         literal data
+//             'E'                            end
+// The result is built in a new file, checked against newSize/newCrc32 and
+// renamed over the original.
+
+#define DELTA_DEFAULT_BLOCK (16 * 1024)
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK (64 * 1024)
+#define DELTA_STRONG_BYTES 16
+#define DELTA_SIGNATURE_HEADER 20
+#define DELTA_SIGNATURE_ENTRY (4 + DELTA_STRONG_BYTES)
+#define DELTA_PATCH_HEADER 20
+
+uint32_t deltaWeakChecksum(const uint8_t *data, size_t len);
+
+// Writes the DELTA_SIGNATURE_HEADER bytes for a file of `fileSize` bytes
+void deltaSignatureHeader(uint8_t *out, uint32_t blockSize, uint64_t fileSize);
+// Writes the entries of the blocks in `data`, which starts on a block
+// boundary; only the last block of the file may be short. Returns the bytes
+// written (DELTA_SIGNATURE_ENTRY per block).
+size_t deltaSignatureBlocks(const uint8_t *data, size_t len, uint32_t blockSize, uint8_t *out);
+
+// Where deltaRebuild() gets and puts its data
+struct DeltaPatchIo
+{
+    // Exactly `len` bytes of the patch, in order
+    std::function<bool(uint8_t *buffer, size_t len)> readPatch;
+    // Exactly `len` bytes of the device's current file from `offset`
+    std::function<bool(uint64_t offset, uint8_t *buffer, size_t len)> readOld;
+    // Appends to the result
+    std::function<bool(const uint8_t *data, size_t len)> write;
+    // Optional: called once the header announced the result size (to
+    // preallocate), and after every op (false cancels)
+    std::function<void(uint64_t newSize)> sized;
+    std::function<bool(uint64_t written, uint64_t newSize)> progress;
+};
+
+struct DeltaPatchResult
+{
+    uint64_t newSize;
+    uint64_t copiedBytes;
+    uint64_t literalBytes;
+    uint32_t newCrc;
+};
+
+// Rebuilds the new file from a patch and the old file of `oldSize` bytes
+// through `buffer`, checking the announced size and CRC32. Returns nullptr
+// or what went wrong. `result` is updated as the patch is applied.
+const char *deltaRebuild(const DeltaPatchIo &io, uint64_t oldSize, uint8_t *buffer, size_t bufferSize,
+                            DeltaPatchResult &result);
+
+#endif
@@ -0,0 +1,433 @@
+#include "delta_sync.h"
+#include "async_io_service.h"
+#include "bg_job.h"
+#include "checksum.h"
+#include "checksum_index.h"
+#include "du_tree.h"
+#include "file_crypt.h"
+#include "fs_events.h"
+#include "lz4_store.h"
+#include "meta_cache.h"
+#include "sd_io_sched.h"
+#include "sd_read_write.h"
+#include <esp_heap_caps.h>
+#include <esp_random.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define SIGNATURE_STACK_SIZE 6144
+
+static volatile bool signatureBusy = false;
+static fs::FS *signatureFs = nullptr;
+
+static struct
+{
+  fs::FS *fs;
+  String path;
+  String patchPath;
+  String stagingPath;
+  File patchFile;
+  AsyncWriteStream *writer; // written by the async I/O workers when set
+  bool receiving;
+  bool writeFailed;
+  uint32_t patchBytes;
+
+  // Results of the last apply
+  DeltaPatchResult result;
+  const char *error;
+} patch;
+
+static BackgroundJob patchJob("sync");
+
+static uint8_t *allocBuffer(size_t size)
+{
+  uint8_t *buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  return buffer ? buffer : (uint8_t *)malloc(size);
+}
+
+// ---- Signature -------------------------------------------------------------
+
+static void signatureTask(void *arg)
+{
+  std::shared_ptr<DeltaSignature> *handle = (std::shared_ptr<DeltaSignature> *)arg;
+  DeltaSignature &sig = **handle;
+
+  // Whole blocks per read, so each block is hashed from one buffer
+  size_t chunk = (DELTA_BUFFER_SIZE / sig.blockSize) * sig.blockSize;
+  uint8_t *buffer = allocBuffer(chunk);
+  File file = signatureFs->open(sig.path, FILE_READ);
+  if (!buffer || !file)
+  {
+    sig.failed = true;
+  }
+
+  uint64_t remaining = sig.fileSize;
+  size_t out = DELTA_SIGNATURE_HEADER;
+  while (!sig.failed && !sig.cancelled && remaining > 0)
+  {
+    size_t want = min((uint64_t)chunk, remaining);
+    // A client is streaming the result: bulk class, like a download
+    if (sdIoRead(file, buffer, want, SD_IO_BULK) != want)
+    {
+      sig.failed = true;
+      break;
+    }
+    out += deltaSignatureBlocks(buffer, want, sig.blockSize, sig.data + out);
+    remaining -= want;
+    sig.produced = out; // published after the entries are written
+  }
+
+  if (file)
+  {
+    file.close();
+  }
+  free(buffer);
+  if (sig.failed)
+  {
+    Serial.printf("Signature of %s failed\n", sig.path.c_str());
+  }
+  delete handle;
+  signatureBusy = false;
+  vTaskDelete(NULL);
+}
+
+std::shared_ptr<DeltaSignature> deltaStartSignature(fs::FS &fs, const String &path, uint32_t blockSize)
+{
+  if (signatureBusy)
+  {
+    return nullptr;
+  }
+  File file = fs.open(path, FILE_READ);
+  if (!file || file.isDirectory())
+  {
+    return nullptr;
+  }
+
+  std::shared_ptr<DeltaSignature> sig = std::make_shared<DeltaSignature>();
+  sig->path = path;
+  sig->blockSize = constrain(blockSize, (uint32_t)DELTA_MIN_BLOCK, (uint32_t)DELTA_MAX_BLOCK);
+  sig->fileSize = file.size();
+  file.close();
+  sig->blockCount = (sig->fileSize + sig->blockSize - 1) / sig->blockSize;
+  sig->length = DELTA_SIGNATURE_HEADER + (size_t)sig->blockCount * DELTA_SIGNATURE_ENTRY;
+  sig->data = allocBuffer(sig->length);
+  if (sig->data == nullptr)
+  {
+    return nullptr;
+  }
+
+  deltaSignatureHeader(sig->data, sig->blockSize, sig->fileSize);
+  sig->produced = DELTA_SIGNATURE_HEADER;
+
+  signatureFs = &fs;
+  signatureBusy = true;
+  std::shared_ptr<DeltaSignature> *handle = new std::shared_ptr<DeltaSignature>(sig);
+  if (xTaskCreatePinnedToCore(signatureTask, "signature", SIGNATURE_STACK_SIZE, handle, BG_JOB_PRIORITY,
+                              NULL, tskNO_AFFINITY) != pdPASS)
+  {
+    delete handle;
+    signatureBusy = false;
+    return nullptr;
+  }
+  return sig;
+}
+
+size_t deltaSignatureRead(DeltaSignature &sig, uint8_t *buffer, size_t maxLen, size_t index)
+{
+  size_t produced = sig.produced;
+  if (sig.failed || index >= produced)
+  {
+    return 0;
+  }
+  size_t len = min(maxLen, produced - index);
+  memcpy(buffer, sig.data + index, len);
+  return len;
+}
+
+// ---- Patch -----------------------------------------------------------------
+
+// "<path>.<random hex><suffix>" that does not exist yet
+static String uniqueSidecar(fs::FS &fs, const String &path, const char *suffix)
+{
+  String name;
+  do
+  {
+    name = path + "." + String(esp_random(), HEX) + suffix;
+  } while (fs.exists(name));
+  return name;
+}
+
+bool deltaIsEncrypted(fs::FS &fs, const String &path)
+{
+  if (cryptIsEncryptedPath(path))
+  {
+    return true;
+  }
+  // Renamed out of an encrypted directory: still has a header
+  FsMeta meta;
+  FileCipher cipher;
+  return g_metaCache.stat(path, meta) && !meta.isDirectory && cryptProbePath(fs, path, cipher) != CRYPT_PLAIN;
+}
+
+DeltaBeginResult deltaBeginPatch(fs::FS &fs, const String &path)
+{
+  if (patch.receiving || patchJob.running())
+  {
+    return DELTA_BEGIN_BUSY;
+  }
+  FsMeta meta;
+  if (g_metaCache.stat(path, meta) && meta.isDirectory)
+  {
+    return DELTA_BEGIN_IS_DIRECTORY;
+  }
+  if (deltaIsEncrypted(fs, path))
+  {
+    return DELTA_BEGIN_ENCRYPTED;
+  }
+  patch.fs = &fs;
+  patch.path = path;
+  patch.patchPath = uniqueSidecar(fs, path, DELTA_PATCH_SUFFIX);
+  fsCacheInvalidate(patch.patchPath);
+  patch.patchFile = fs.open(patch.patchPath, FILE_WRITE);
+  if (!patch.patchFile)
+  {
+    return DELTA_BEGIN_CREATE_FAILED;
+  }
+  // The patch body is copied off the network task like an upload; with the
+  // engine full it is written here instead
+  patch.writer = new AsyncWriteStream();
+  if (!patch.writer->begin(patch.patchFile, SD_IO_BULK))
+  {
+    delete patch.writer;
+    patch.writer = nullptr;
+  }
+  patch.receiving = true;
+  patch.writeFailed = false;
+  patch.patchBytes = 0;
+  return DELTA_BEGIN_OK;
+}
+
+// Waits for the queued writes and closes the patch file; false if any
+// failed. Blocks, so only the patch job calls it
+static bool closePatchFile()
+{
+  bool ok = !patch.writeFailed;
+  if (patch.writer)
+  {
+    ok = patch.writer->finishAndWait() && ok;
+    delete patch.writer;
+    patch.writer = nullptr;
+  }
+  patch.patchFile.close();
+  return ok;
+}
+
+// Drops a patch that will not be applied without waiting: the file is closed
+// and removed once the writes in flight are done, possibly on a worker
+static void discardPatchFile()
+{
+  File file = patch.patchFile;
+  fs::FS *fs = patch.fs;
+  String path = patch.patchPath;
+  patch.patchFile = File();
+  std::function<void()> discard = [file, fs, path]() mutable {
+    {
+      SdIoScope io(SD_IO_BULK);
+      file.close();
+      fs->remove(path);
+    }
+    fsCacheInvalidate(path);
+  };
+  if (patch.writer)
+  {
+    patch.writer->abandon(discard);
+    delete patch.writer;
+    patch.writer = nullptr;
+  }
+  else
+  {
+    discard();
+  }
+}
+
+bool deltaWritePatch(const uint8_t *data, size_t len)
+{
+  if (!patch.receiving || patch.writeFailed)
+  {
+    return false;
+  }
+  patch.writeFailed = patch.writer ? !patch.writer->write(data, len)
+                                    : sdIoWrite(patch.patchFile, data, len, SD_IO_BULK) != len;
+  patch.patchBytes += len;
+  return !patch.writeFailed;
+}
+
+void deltaAbortPatch()
+{
+  if (!patch.receiving)
+  {
+    return;
+  }
+  patch.receiving = false;
+  discardPatchFile();
+}
+
+static const char *applyPatch(BackgroundJob &job, File &patchFile, File &out, uint8_t *buffer)
+{
+  // The device's current copy is the source of 'C' ops; it may not exist
+  File oldFile = patch.fs->open(patch.path, FILE_READ);
+  uint64_t oldSize = (oldFile && !oldFile.isDirectory()) ? oldFile.size() : 0;
+
+  DeltaPatchIo io;
+  io.readPatch = [&patchFile](uint8_t *data, size_t len)
+  { return sdIoRead(patchFile, data, len, SD_IO_BACKGROUND) == len; };
+  io.readOld = [&oldFile](uint64_t offset, uint8_t *data, size_t len)
+  {
+    {
+      SdIoScope io(SD_IO_BACKGROUND);
+      if (oldFile.position() != offset && !oldFile.seek(offset))
+      {
+        return false;
+      }
+    }
+    return sdIoRead(oldFile, data, len, SD_IO_BACKGROUND) == len;
+  };
+  io.write = [&out](const uint8_t *data, size_t len) { return sdIoWrite(out, data, len, SD_IO_BACKGROUND) == len; };
+  io.sized = [&out](uint64_t newSize) { preallocateFile(out, newSize); };
+  io.progress = [&job](uint64_t written, uint64_t newSize)
+  {
+    job.setProgress(written >> 10, newSize >> 10);
+    return !job.cancelled();
+  };
+  const char *error = deltaRebuild(io, oldSize, buffer, DELTA_BUFFER_SIZE, patch.result);
+
+  if (oldFile)
+  {
+    oldFile.close();
+  }
+  return error;
+}
+
+static bool runPatchJob(BackgroundJob &job)
+{
+  fs::FS &fs = *patch.fs;
+  const String &patchPath = patch.patchPath;
+  patch.stagingPath = uniqueSidecar(fs, patch.path, DELTA_STAGING_SUFFIX);
+  const String &stagingPath = patch.stagingPath;
+  patch.result = {0, 0, 0, 0};
+  patch.error = nullptr;
+  job.setMessage(patch.path);
+
+  // The last patch writes are waited for here, off the network task
+  patch.writeFailed = !closePatchFile();
+  if (patch.writeFailed)
+  {
+    fs.remove(patchPath);
+    fsCacheInvalidate(patchPath);
+    patch.error = "failed to store patch";
+    job.setMessage(String(patch.error));
+    return false;
+  }
+
+  uint8_t *buffer = allocBuffer(DELTA_BUFFER_SIZE);
+  File patchFile = fs.open(patchPath, FILE_READ);
+  fsCacheInvalidate(stagingPath);
+  File out = fs.open(stagingPath, FILE_WRITE);
+  if (!buffer || !patchFile || !out)
+  {
+    patch.error = "cannot open files";
+  }
+  else
+  {
+    patch.error = applyPatch(job, patchFile, out, buffer);
+  }
+  free(buffer);
+  if (patchFile)
+  {
+    patchFile.close();
+  }
+  if (out)
+  {
+    out.close();
+  }
+  fs.remove(patchPath);
+  fsCacheInvalidate(patchPath);
+
+  if (!patch.error)
+  {
+    // Swap the rebuilt file in, as an upload would
+    FsMeta old;
+    if (g_metaCache.stat(patch.path, old) && !old.isDirectory)
+    {
+      duFileRemoved(patch.path, old.size);
+    }
+    fsCacheInvalidate(patch.path);
+    if (fs.exists(patch.path))
+    {
+      fs.remove(patch.path);
+    }
+    if (!fs.rename(stagingPath, patch.path))
+    {
+      patch.error = "rename failed";
+    }
+  }
+  if (patch.error)
+  {
+    fs.remove(stagingPath);
+    fsCacheInvalidate(stagingPath);
+    job.setMessage(String(patch.error));
+    Serial.printf("Delta sync of %s failed: %s\n", patch.path.c_str(), patch.error);
+    return false;
+  }
+
+  fsCacheInvalidate(stagingPath);
+  fsCacheInvalidate(patch.path);
+  fsEventAdded(patch.path, patch.result.newSize, false);
+  duFileAdded(patch.path, patch.result.newSize);
+  lzbRemoveTwin(fs, patch.path);
+
+  // The verified CRC32 is as good as one computed by /hash
+  FsMeta meta;
+  if (g_metaCache.stat(patch.path, meta))
+  {
+    uint8_t digest[4] = {(uint8_t)(patch.result.newCrc >> 24), (uint8_t)(patch.result.newCrc >> 16),
+                         (uint8_t)(patch.result.newCrc >> 8), (uint8_t)patch.result.newCrc};
+    g_checksumIndex.store(patch.path, meta, HASH_CRC32, digest);
+  }
+  Serial.printf("Delta sync of %s: %llu bytes reused, %llu bytes received\n", patch.path.c_str(),
+                patch.result.copiedBytes, patch.result.literalBytes);
+  return true;
+}
+
+bool deltaApplyPatch()
+{
+  if (!patch.receiving)
+  {
+    return false;
+  }
+  patch.receiving = false;
+  if (!patch.writeFailed && patch.writer)
+  {
+    patch.writer->finish();
+  }
+  if (patch.writeFailed || !patchJob.start(runPatchJob))
+  {
+    discardPatchFile();
+    return false;
+  }
+  return true;
+}
+
+void deltaStatusJson(JsonObject obj)
+{
+  patchJob.statusJson(obj["job"].to<JsonObject>());
+  obj["path"] = patch.path;
+  obj["patchBytes"] = patch.patchBytes;
+  obj["newSize"] = patch.result.newSize;
+  obj["copiedBytes"] = patch.result.copiedBytes;
+  obj["literalBytes"] = patch.result.literalBytes;
+  if (patch.error)
+  {
+    obj["error"] = patch.error;
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef __DELTA_SYNC_H
+#define __DELTA_SYNC_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include "delta_core.h"
+#include <ArduinoJson.h>
+#include <memory>
+
+// Device side of delta sync; the signature and patch formats are described
+// in delta_core.h.
+
+// Read buffer of the signature task and of the patch job (PSRAM)
+#define DELTA_BUFFER_SIZE (256 * 1024)
+// The received patch and the rebuilt file live next to the target under
+// unique names ("<path>.<random hex>.patch"), so they never replace a file
+// of the user's
+#define DELTA_PATCH_SUFFIX ".patch"
+#define DELTA_STAGING_SUFFIX ".sync"
+
+// Signature being computed by a background task while it is sent
+struct DeltaSignature
+{
+    String path;
+    uint32_t blockSize;
+    uint64_t fileSize;
+    uint32_t blockCount;
+    uint8_t *data;
+    size_t length;
+    volatile size_t produced;
+    volatile bool failed;
+    volatile bool cancelled;
+
+    DeltaSignature() : blockSize(0), fileSize(0), blockCount(0), data(nullptr), length(0),
+                       produced(0), failed(false), cancelled(false) {}
+    ~DeltaSignature() { free(data); }
+};
+
+// nullptr if the file does not exist, memory is short or another signature
+// is being computed
+std::shared_ptr<DeltaSignature> deltaStartSignature(fs::FS &fs, const String &path, uint32_t blockSize);
+
+// Copy signature bytes from `index`; 0 if none are ready yet (or failed)
+size_t deltaSignatureRead(DeltaSignature &sig, uint8_t *buffer, size_t maxLen, size_t index);
+
+enum DeltaBeginResult
+{
+    DELTA_BEGIN_OK,
+    DELTA_BEGIN_BUSY,          // a patch is being received or applied
+    DELTA_BEGIN_IS_DIRECTORY,  // the target is a directory
+    DELTA_BEGIN_CREATE_FAILED, // the patch file cannot be created
+    DELTA_BEGIN_ENCRYPTED      // see deltaIsEncrypted()
+};
+
+// Signatures and patches work on the stored bytes, so encrypted files (or
+// new files in an encrypted directory) are refused rather than synced as
+// ciphertext or written in the clear
+bool deltaIsEncrypted(fs::FS &fs, const String &path);
+
+// Receiving a patch: stored next to the target, then applied by a background job
+DeltaBeginResult deltaBeginPatch(fs::FS &fs, const String &path);
+bool deltaWritePatch(const uint8_t *data, size_t len);
+void deltaAbortPatch();
+bool deltaApplyPatch();
+
+void deltaStatusJson(JsonObject obj);
+
+#endif
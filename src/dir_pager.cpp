@@ -0,0 +1,101 @@
+#include "dir_pager.h"
+#include "sd_io_sched.h"
+
+bool DirPager::seek(const String &dir, uint32_t cursor)
+{
+  // Resume the open session if the client asks for the next page and the
+  // tree has not changed since
+  if (root && dirPath == dir && position == cursor && sessionGeneration == generation)
+  {
+    return true;
+  }
+
+  closeLocked();
+  sessionGeneration = generation;
+  {
+    SdIoScope io(SD_IO_INTERACTIVE);
+    root = fs->open(dir);
+  }
+  if (!root || !root.isDirectory())
+  {
+    closeLocked();
+    return false;
+  }
+  dirPath = dir;
+
+  // Skip already delivered entries by name only, without opening each one
+  while (position < cursor)
+  {
+    String skipped;
+    {
+      SdIoScope io(SD_IO_INTERACTIVE);
+      skipped = root.getNextFileName();
+    }
+    if (skipped.length() == 0)
+    {
+      break;
+    }
+    position++;
+  }
+  return true;
+}
+
+bool DirPager::readPage(const String &dir, uint32_t cursor, uint32_t limit, std::vector<AsyncIoDirEntry> &entries)
+{
+  std::lock_guard<std::mutex> l(lock);
+  if (!seek(dir, cursor))
+  {
+    return false;
+  }
+
+  bool done = false;
+  while (entries.size() < limit)
+  {
+    // One grant per entry, so a long page cannot hold the card
+    File file;
+    {
+      SdIoScope io(SD_IO_INTERACTIVE);
+      file = root.openNextFile();
+    }
+    if (!file)
+    {
+      done = true;
+      break;
+    }
+
+    String name = String(file.name());
+    name = name.substring(name.lastIndexOf('/') + 1);
+    entries.push_back({name.c_str(), file.isDirectory(), file.isDirectory() ? 0 : (uint64_t)file.size(),
+                       (uint32_t)file.getLastWrite()});
+    position++;
+  }
+
+  // A reset() during the page leaves the session stale
+  if (done || sessionGeneration != generation)
+  {
+    closeLocked();
+  }
+  return true;
+}
+
+void DirPager::closeLocked()
+{
+  if (root)
+  {
+    SdIoScope io(SD_IO_INTERACTIVE);
+    root.close();
+  }
+  root = File();
+  dirPath = "";
+  position = 0;
+}
+
+void DirPager::reset()
+{
+  generation++;
+  std::unique_lock<std::mutex> l(lock, std::try_to_lock);
+  if (l.owns_lock())
+  {
+    closeLocked();
+  }
+}
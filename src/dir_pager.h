@@ -0,0 +1,47 @@
+#ifndef __DIR_PAGER_H
+#define __DIR_PAGER_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include "async_io.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Entries returned per /list page when the client does not ask for a limit
+#define DIR_PAGER_DEFAULT_LIMIT 500
+#define DIR_PAGER_MAX_LIMIT 2000
+
+// Cursor-based directory paging for /list.
+// The cursor is the number of entries already returned. The pager keeps the
+// directory handle of the last request open, so a client walking a large
+// folder page by page continues where it stopped instead of rescanning the
+// directory from the start for every page. Pages are read by the async I/O
+// workers (bounded readdirs of g_asyncIo); reset() may be called from any task.
+class DirPager
+{
+private:
+    fs::FS *fs;
+    std::mutex lock;
+    std::atomic<uint32_t> generation; // bumped by reset()
+    uint32_t sessionGeneration;
+    String dirPath;
+    File root;
+    uint32_t position;
+
+    bool seek(const String &dir, uint32_t cursor);
+    void closeLocked();
+
+public:
+    DirPager(fs::FS &fs) : fs(&fs), generation(0), sessionGeneration(0), position(0) {}
+
+    // Append up to `limit` entries starting at `cursor` to `entries`.
+    // Returns false if `dir` is not a directory.
+    bool readPage(const String &dir, uint32_t cursor, uint32_t limit, std::vector<AsyncIoDirEntry> &entries);
+
+    // Drop the cached handle; call after the directory tree was modified.
+    // Never waits: a page being read closes it once it is done
+    void reset();
+};
+
+#endif
@@ -0,0 +1,578 @@
+#include "du_tree.h"
+#include "bg_job.h"
+#include "sd_read_write.h"
+#include "sd_io_sched.h"
+#include "ff.h"
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <vector>
+
+struct DuNode
+{
+  uint32_t nameHash; // FAT names are case-insensitive, hashed lowercased
+  char *name;        // compared on a hash match; nullptr for the root
+  int32_t parent;
+  int32_t firstChild;
+  int32_t nextSibling; // also links the free list
+  uint64_t bytes;      // recursive
+  uint32_t files;      // recursive
+  uint32_t dirs;       // recursive, not counting the node itself
+};
+
+static struct
+{
+  DuNode *nodes;
+  uint32_t capacity;
+  uint32_t used;
+  int32_t freeList;
+  volatile bool ready;
+  volatile bool changed; // a handler reported a change while walking
+  uint32_t buildMs;
+  uint32_t updates;
+  SemaphoreHandle_t lock;
+  // Volume usage, so /du does not call f_getfree (a full FAT scan when
+  // FatFs has no valid free count). Kept current from the change
+  // notifications and refreshed from FatFs every DU_VOLUME_REFRESH_MS.
+  bool volumeKnown;
+  uint64_t clusterBytes;
+  uint32_t totalClusters;
+  int64_t freeClusters;
+  uint32_t volumeAt;
+} du;
+
+static BackgroundJob duJob("du");
+
+// FNV-1a 32-bit of one lowercased path component
+static uint32_t hashName(const char *name, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= (uint8_t)tolower((unsigned char)name[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static char *copyName(const char *name, size_t len)
+{
+  char *copy = (char *)heap_caps_malloc(len + 1, MALLOC_CAP_SPIRAM);
+  if (copy == nullptr)
+  {
+    copy = (char *)malloc(len + 1);
+  }
+  if (copy != nullptr)
+  {
+    memcpy(copy, name, len);
+    copy[len] = 0;
+  }
+  return copy;
+}
+
+static bool sameName(const DuNode &n, const char *name, size_t len)
+{
+  return n.name != nullptr && strncasecmp(n.name, name, len) == 0 && n.name[len] == 0;
+}
+
+static int32_t allocNode(int32_t parent, const char *name, size_t len)
+{
+  char *copy = nullptr;
+  if (parent >= 0 && (copy = copyName(name, len)) == nullptr)
+  {
+    return -1;
+  }
+
+  int32_t node;
+  if (du.freeList >= 0)
+  {
+    node = du.freeList;
+    du.freeList = du.nodes[node].nextSibling;
+  }
+  else
+  {
+    if (du.used == du.capacity)
+    {
+      uint32_t grown = max(du.capacity * 2, (uint32_t)256);
+      DuNode *bigger = (DuNode *)heap_caps_realloc(du.nodes, grown * sizeof(DuNode), MALLOC_CAP_SPIRAM);
+      if (bigger == nullptr)
+      {
+        bigger = (DuNode *)realloc(du.nodes, grown * sizeof(DuNode));
+      }
+      if (bigger == nullptr)
+      {
+        free(copy);
+        return -1;
+      }
+      du.nodes = bigger;
+      du.capacity = grown;
+    }
+    node = du.used++;
+  }
+
+  DuNode &n = du.nodes[node];
+  n.nameHash = parent >= 0 ? hashName(name, len) : 0;
+  n.name = copy;
+  n.parent = parent;
+  n.firstChild = -1;
+  n.bytes = 0;
+  n.files = 0;
+  n.dirs = 0;
+  n.nextSibling = parent >= 0 ? du.nodes[parent].firstChild : -1;
+  if (parent >= 0)
+  {
+    du.nodes[parent].firstChild = node;
+  }
+  return node;
+}
+
+static void detach(int32_t node)
+{
+  int32_t parent = du.nodes[node].parent;
+  int32_t *link = &du.nodes[parent].firstChild;
+  while (*link >= 0 && *link != node)
+  {
+    link = &du.nodes[*link].nextSibling;
+  }
+  if (*link == node)
+  {
+    *link = du.nodes[node].nextSibling;
+  }
+  du.nodes[node].parent = -1;
+  du.nodes[node].nextSibling = -1;
+}
+
+static void attach(int32_t node, int32_t parent)
+{
+  du.nodes[node].parent = parent;
+  du.nodes[node].nextSibling = du.nodes[parent].firstChild;
+  du.nodes[parent].firstChild = node;
+}
+
+static void freeSubtree(int32_t root)
+{
+  std::vector<int32_t> stack;
+  stack.push_back(root);
+  while (!stack.empty())
+  {
+    int32_t node = stack.back();
+    stack.pop_back();
+    for (int32_t c = du.nodes[node].firstChild; c >= 0; c = du.nodes[c].nextSibling)
+    {
+      stack.push_back(c);
+    }
+    free(du.nodes[node].name);
+    du.nodes[node].name = nullptr;
+    du.nodes[node].nextSibling = du.freeList;
+    du.freeList = node;
+  }
+}
+
+// Apply a change to `node` and every ancestor: O(depth)
+static void propagate(int32_t node, int64_t bytes, int32_t files, int32_t dirs)
+{
+  for (; node >= 0; node = du.nodes[node].parent)
+  {
+    DuNode &n = du.nodes[node];
+    n.bytes = (bytes < 0 && (uint64_t)-bytes > n.bytes) ? 0 : n.bytes + bytes;
+    n.files = (files < 0 && (uint32_t)-files > n.files) ? 0 : n.files + files;
+    n.dirs = (dirs < 0 && (uint32_t)-dirs > n.dirs) ? 0 : n.dirs + dirs;
+  }
+}
+
+static int32_t findChild(int32_t parent, const char *name, size_t len)
+{
+  uint32_t h = hashName(name, len);
+  for (int32_t c = du.nodes[parent].firstChild; c >= 0; c = du.nodes[c].nextSibling)
+  {
+    if (du.nodes[c].nameHash == h && sameName(du.nodes[c], name, len))
+    {
+      return c;
+    }
+  }
+  return -1;
+}
+
+// Node of directory `path`, optionally creating missing components
+static int32_t lookupDir(const String &path, bool create)
+{
+  int32_t node = 0;
+  const char *p = path.c_str();
+  while (*p && node >= 0)
+  {
+    while (*p == '/')
+      p++;
+    const char *end = p;
+    while (*end && *end != '/')
+      end++;
+    if (end == p)
+    {
+      break;
+    }
+
+    int32_t child = findChild(node, p, end - p);
+    if (child < 0 && create)
+    {
+      child = allocNode(node, p, end - p);
+      if (child >= 0)
+      {
+        propagate(node, 0, 0, 1);
+      }
+    }
+    node = child;
+    p = end;
+  }
+  return node;
+}
+
+static int64_t clustersOf(uint64_t bytes)
+{
+  return du.clusterBytes ? (int64_t)((bytes + du.clusterBytes - 1) / du.clusterBytes) : 0;
+}
+
+// Called with du.lock held
+static void volumeChange(int64_t clusters)
+{
+  if (du.volumeKnown)
+  {
+    du.freeClusters = constrain(du.freeClusters - clusters, (int64_t)0, (int64_t)du.totalClusters);
+  }
+}
+
+static String parentOf(const String &path)
+{
+  int slash = path.lastIndexOf('/');
+  return slash <= 0 ? String("/") : path.substring(0, slash);
+}
+
+static String baseName(const String &path)
+{
+  return path.substring(path.lastIndexOf('/') + 1);
+}
+
+// True if the tree can take the update; otherwise remember that a running
+// walk has to start over
+static bool beginUpdate()
+{
+  xSemaphoreTake(du.lock, portMAX_DELAY);
+  if (!du.ready)
+  {
+    du.changed = true;
+    xSemaphoreGive(du.lock);
+    return false;
+  }
+  du.updates++;
+  return true;
+}
+
+void duFileAdded(const String &path, uint64_t size)
+{
+  if (du.lock == nullptr || !beginUpdate())
+    return;
+  int32_t parent = lookupDir(parentOf(path), true);
+  if (parent >= 0)
+  {
+    propagate(parent, size, 1, 0);
+  }
+  volumeChange(clustersOf(size));
+  xSemaphoreGive(du.lock);
+}
+
+void duFileRemoved(const String &path, uint64_t size)
+{
+  if (du.lock == nullptr || !beginUpdate())
+    return;
+  int32_t parent = lookupDir(parentOf(path), false);
+  if (parent >= 0)
+  {
+    propagate(parent, -(int64_t)size, -1, 0);
+  }
+  volumeChange(-clustersOf(size));
+  xSemaphoreGive(du.lock);
+}
+
+void duFileGrown(const String &path, uint64_t bytes)
+{
+  if (du.lock == nullptr || !beginUpdate())
+    return;
+  int32_t parent = lookupDir(parentOf(path), false);
+  if (parent >= 0)
+  {
+    propagate(parent, bytes, 0, 0);
+  }
+  // Without the old size this can be a cluster off; the refresh corrects it
+  volumeChange(clustersOf(bytes));
+  xSemaphoreGive(du.lock);
+}
+
+void duDirAdded(const String &path)
+{
+  if (du.lock == nullptr || !beginUpdate())
+    return;
+  lookupDir(path, true);
+  volumeChange(1);
+  xSemaphoreGive(du.lock);
+}
+
+void duDirRemoved(const String &path)
+{
+  if (du.lock == nullptr || !beginUpdate())
+    return;
+  int32_t node = lookupDir(path, false);
+  if (node > 0)
+  {
+    const DuNode &n = du.nodes[node];
+    volumeChange(-clustersOf(n.bytes) - n.dirs - 1);
+    propagate(n.parent, -(int64_t)n.bytes, -(int32_t)n.files, -(int32_t)n.dirs - 1);
+    detach(node);
+    freeSubtree(node);
+  }
+  xSemaphoreGive(du.lock);
+}
+
+void duMoved(const String &from, const String &to, bool isDir, uint64_t size)
+{
+  if (!isDir)
+  {
+    duFileRemoved(from, size);
+    duFileAdded(to, size);
+    return;
+  }
+
+  if (du.lock == nullptr || !beginUpdate())
+    return;
+  int32_t node = lookupDir(from, false);
+  int32_t newParent = lookupDir(parentOf(to), true);
+  if (node > 0 && newParent >= 0)
+  {
+    // Re-hang the whole subtree; nothing below it changes
+    const DuNode &n = du.nodes[node];
+    uint64_t bytes = n.bytes;
+    uint32_t files = n.files;
+    uint32_t dirs = n.dirs + 1;
+    propagate(n.parent, -(int64_t)bytes, -(int32_t)files, -(int32_t)dirs);
+    detach(node);
+    String name = baseName(to);
+    char *copy = copyName(name.c_str(), name.length());
+    if (copy != nullptr)
+    {
+      free(du.nodes[node].name);
+      du.nodes[node].name = copy;
+      du.nodes[node].nameHash = hashName(name.c_str(), name.length());
+    }
+    attach(node, newParent);
+    propagate(newParent, bytes, files, dirs);
+  }
+  xSemaphoreGive(du.lock);
+}
+
+// ---- Background walk -------------------------------------------------------
+
+static bool walk(BackgroundJob &job)
+{
+  xSemaphoreTake(du.lock, portMAX_DELAY);
+  for (uint32_t i = 0; i < du.used; i++)
+  {
+    free(du.nodes[i].name);
+  }
+  du.used = 0;
+  du.freeList = -1;
+  du.changed = false;
+  int32_t root = allocNode(-1, nullptr, 0);
+  xSemaphoreGive(du.lock);
+  if (root < 0)
+  {
+    return false;
+  }
+
+  struct Pending
+  {
+    String path;
+    int32_t node;
+  };
+  std::vector<Pending> pending;
+  pending.push_back({"/", root});
+  FILINFO info;
+  DIR dir;
+  uint32_t entries = 0;
+
+  while (!pending.empty() && !job.cancelled())
+  {
+    Pending current = pending.back();
+    pending.pop_back();
+    FRESULT res;
+    {
+      SdIoScope io(SD_IO_BACKGROUND);
+      res = f_opendir(&dir, sdFatPath(current.path).c_str());
+    }
+    if (res != FR_OK)
+    {
+      continue;
+    }
+
+    while (!job.cancelled())
+    {
+      // Each entry is read under its own grant, and du.lock is only taken
+      // once the grant is given back
+      {
+        SdIoScope io(SD_IO_BACKGROUND);
+        res = f_readdir(&dir, &info);
+      }
+      if (res != FR_OK || !info.fname[0])
+      {
+        break;
+      }
+      xSemaphoreTake(du.lock, portMAX_DELAY);
+      if (info.fattrib & AM_DIR)
+      {
+        int32_t child = allocNode(current.node, info.fname, strlen(info.fname));
+        if (child >= 0)
+        {
+          propagate(current.node, 0, 0, 1);
+          String path = current.path == "/" ? "/" + String(info.fname) : current.path + "/" + info.fname;
+          pending.push_back({path, child});
+        }
+      }
+      else
+      {
+        propagate(current.node, info.fsize, 1, 0);
+      }
+      xSemaphoreGive(du.lock);
+      job.setProgress(++entries, 0);
+    }
+    f_closedir(&dir);
+  }
+  return !job.cancelled();
+}
+
+static void refreshVolume()
+{
+  DWORD freeClusters;
+  FATFS *fatfs;
+  FRESULT res;
+  {
+    SdIoScope io(SD_IO_BACKGROUND);
+    res = f_getfree(sdFatPath("/").c_str(), &freeClusters, &fatfs);
+  }
+  if (res != FR_OK)
+  {
+    return;
+  }
+
+  xSemaphoreTake(du.lock, portMAX_DELAY);
+#if FF_MAX_SS != FF_MIN_SS
+  du.clusterBytes = (uint64_t)fatfs->csize * fatfs->ssize;
+#else
+  du.clusterBytes = (uint64_t)fatfs->csize * FF_MAX_SS;
+#endif
+  du.totalClusters = fatfs->n_fatent - 2;
+  du.freeClusters = freeClusters;
+  du.volumeAt = millis();
+  du.volumeKnown = true;
+  xSemaphoreGive(du.lock);
+}
+
+void duRefreshVolume()
+{
+  if (du.lock != nullptr && du.ready && millis() - du.volumeAt >= DU_VOLUME_REFRESH_MS)
+  {
+    refreshVolume();
+  }
+}
+
+static bool runBuild(BackgroundJob &job)
+{
+  uint32_t start = millis();
+
+  for (int attempt = 1; attempt <= DU_MAX_WALK_ATTEMPTS; attempt++)
+  {
+    job.setMessage("walk " + String(attempt));
+    if (!walk(job))
+    {
+      return false;
+    }
+
+    xSemaphoreTake(du.lock, portMAX_DELAY);
+    if (!du.changed || attempt == DU_MAX_WALK_ATTEMPTS)
+    {
+      du.ready = true;
+      du.buildMs = millis() - start;
+      xSemaphoreGive(du.lock);
+      break;
+    }
+    xSemaphoreGive(du.lock);
+  }
+
+  // The first f_getfree may scan the whole FAT; do it here, off the /du
+  // handler, and keep the result current from then on
+  refreshVolume();
+
+  Serial.printf("Disk usage tree: %u directories, %u files, %llu bytes in %u ms\n",
+                du.nodes[0].dirs + 1, du.nodes[0].files, du.nodes[0].bytes, du.buildMs);
+  return true;
+}
+
+bool duBegin()
+{
+  if (du.lock == nullptr)
+  {
+    du.lock = xSemaphoreCreateMutex();
+  }
+  return duRebuild();
+}
+
+bool duRebuild()
+{
+  if (du.lock == nullptr || duJob.running())
+  {
+    return false;
+  }
+  du.ready = false;
+  return duJob.start(runBuild);
+}
+
+bool duReady()
+{
+  return du.ready;
+}
+
+bool duQuery(const String &dir, JsonObject obj)
+{
+  if (du.lock == nullptr || !du.ready)
+  {
+    return false;
+  }
+
+  xSemaphoreTake(du.lock, portMAX_DELAY);
+  int32_t node = lookupDir(dir, false);
+  if (node >= 0)
+  {
+    const DuNode &n = du.nodes[node];
+    obj["dir"] = dir;
+    obj["bytes"] = n.bytes;
+    obj["files"] = n.files;
+    obj["dirs"] = n.dirs;
+    if (du.volumeKnown)
+    {
+      uint64_t total = (uint64_t)du.totalClusters * du.clusterBytes;
+      uint64_t free = (uint64_t)du.freeClusters * du.clusterBytes;
+      JsonObject volume = obj["volume"].to<JsonObject>();
+      volume["total"] = total;
+      volume["used"] = total - free;
+      volume["free"] = free;
+      volume["ageMs"] = millis() - du.volumeAt;
+    }
+  }
+  xSemaphoreGive(du.lock);
+  return node >= 0;
+}
+
+void duStatusJson(JsonObject obj)
+{
+  duJob.statusJson(obj["job"].to<JsonObject>());
+  obj["ready"] = du.ready;
+  obj["nodes"] = du.used;
+  obj["memory"] = du.capacity * sizeof(DuNode);
+  obj["buildMs"] = du.buildMs;
+  obj["updates"] = du.updates;
+}
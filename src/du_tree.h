@@ -0,0 +1,39 @@
+#ifndef __DU_TREE_H
+#define __DU_TREE_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+
+// Walks restarted because the card changed during the walk before the
+// tree is published anyway
+#define DU_MAX_WALK_ATTEMPTS 3
+// Volume usage is re-read from FatFs this often; in between it follows the
+// change notifications
+#define DU_VOLUME_REFRESH_MS 60000
+
+// Recursive size, file and directory counts of every directory, kept in a
+// PSRAM tree. A background walk builds it once; afterwards the write
+// handlers report their changes and each update only touches the ancestors
+// of the changed path. Only directories are nodes, so memory scales with
+// the number of folders, not files.
+bool duBegin();
+bool duRebuild();
+bool duReady();
+
+// Fill obj with the totals of `dir`; false if the tree is not built yet or
+// the directory is unknown
+bool duQuery(const String &dir, JsonObject obj);
+void duStatusJson(JsonObject obj);
+// Re-reads volume usage once DU_VOLUME_REFRESH_MS has passed; call
+// periodically from a task that may wait on the card
+void duRefreshVolume();
+
+// Change notifications from the handlers
+void duFileAdded(const String &path, uint64_t size);
+void duFileRemoved(const String &path, uint64_t size);
+void duFileGrown(const String &path, uint64_t bytes);
+void duDirAdded(const String &path);
+void duDirRemoved(const String &path);
+void duMoved(const String &from, const String &to, bool isDir, uint64_t size);
+
+#endif
@@ -0,0 +1,364 @@
+#include "egress_shaper.h"
+
+// A throttled flow waits rather than sending less than a segment
+#define MIN_SEND 1460
+#define MIN_RATE 4096
+
+struct Bucket
+{
+  float tokens;
+  uint32_t last; // micros()
+};
+
+struct RateMeter
+{
+  uint64_t bytes;
+  uint32_t windowStart; // millis()
+  uint32_t windowBytes;
+  float rate; // bytes/s over the last complete window
+};
+
+struct Flow
+{
+  bool used;
+  uint32_t id;
+  int8_t client;
+  uint8_t weight;
+  String path;
+  uint32_t started;
+  uint32_t throttled;
+  // Deficit round robin: bytes the flow may still send in round `round`.
+  // Less than MIN_SEND left means its turn is over; that remainder is
+  // carried into its next turn
+  uint32_t deficit;
+  uint32_t round;
+  uint32_t lastAsk; // millis() of the last send opportunity
+  bool rateLimited; // last opportunity refused by a token bucket
+  Bucket share;
+  RateMeter meter;
+};
+
+struct Client
+{
+  uint32_t ip;
+  uint8_t flows; // 0: entry free
+  Bucket bucket;
+  RateMeter meter;
+};
+
+static EgressConfig config = {0, 0, EGRESS_DEFAULT_QUANTUM};
+static Flow flows[EGRESS_MAX_FLOWS];
+static Client clients[EGRESS_MAX_CLIENTS];
+static Bucket global = {0, 0};
+static RateMeter globalMeter = {0, 0, 0, 0};
+static uint32_t activeWeight = 0;
+static uint32_t nextId = 1;
+static uint32_t drrRound = 1;
+
+static struct
+{
+  uint32_t flows;
+  uint32_t refused; // flow or client table full
+  uint32_t throttled;
+  uint32_t rounds;
+} stats;
+
+static float burstOf(uint32_t rate)
+{
+  return max(rate * (EGRESS_BURST_MS / 1000.0f), (float)(2 * MIN_SEND));
+}
+
+static void refill(Bucket &b, uint32_t rate, uint32_t now)
+{
+  b.tokens = min(burstOf(rate), b.tokens + rate * ((now - b.last) / 1000000.0f));
+  b.last = now;
+}
+
+static void startMeter(RateMeter &m)
+{
+  m = {0, (uint32_t)millis(), 0, 0};
+}
+
+static void addToMeter(RateMeter &m, size_t n)
+{
+  m.bytes += n;
+  m.windowBytes += n;
+  uint32_t now = millis();
+  uint32_t elapsed = now - m.windowStart;
+  if (elapsed >= EGRESS_RATE_WINDOW_MS)
+  {
+    m.rate = m.windowBytes * 1000.0f / elapsed;
+    m.windowBytes = 0;
+    m.windowStart = now;
+  }
+}
+
+// A flow that stopped sending reads 0 rather than its last window
+static float currentRate(const RateMeter &m)
+{
+  return millis() - m.windowStart > 2 * EGRESS_RATE_WINDOW_MS ? 0 : m.rate;
+}
+
+static uint32_t shareRate(const Flow &f)
+{
+  return max((uint32_t)((uint64_t)config.globalRate * f.weight / max(activeWeight, (uint32_t)1)), (uint32_t)1);
+}
+
+static int8_t clientFor(uint32_t ip)
+{
+  int8_t free = -1;
+  for (int8_t i = 0; i < EGRESS_MAX_CLIENTS; i++)
+  {
+    if (clients[i].flows > 0 && clients[i].ip == ip)
+    {
+      return i;
+    }
+    if (clients[i].flows == 0 && free < 0)
+    {
+      free = i;
+    }
+  }
+  if (free >= 0)
+  {
+    Client &c = clients[free];
+    c.ip = ip;
+    c.bucket = {burstOf(config.clientRate), (uint32_t)micros()};
+    startMeter(c.meter);
+  }
+  return free;
+}
+
+// True while the flow still has to take its turn in the current round: it
+// has not been served in it yet, or has deficit left, and it is backlogged
+// (asked within EGRESS_TURN_MS and was not held back by a token bucket)
+static bool awaitingTurn(const Flow &f)
+{
+  return f.used && !f.rateLimited && millis() - f.lastAsk < EGRESS_TURN_MS &&
+         (f.round != drrRound || f.deficit >= MIN_SEND);
+}
+
+EgressFlow::EgressFlow(AsyncWebServerRequest *request, const String &path, uint8_t weight) : slot(-1)
+{
+  stats.flows++;
+  int8_t free = -1;
+  for (int8_t i = 0; i < EGRESS_MAX_FLOWS; i++)
+  {
+    if (!flows[i].used)
+    {
+      free = i;
+      break;
+    }
+  }
+  int8_t client = free >= 0 ? clientFor(request->client() ? (uint32_t)request->client()->remoteIP() : 0) : -1;
+  if (client < 0)
+  {
+    stats.refused++;
+    return;
+  }
+
+  slot = free;
+  Flow &f = flows[slot];
+  f.used = true;
+  f.id = nextId++;
+  f.weight = constrain(weight, 1, EGRESS_MAX_WEIGHT);
+  f.path = path;
+  f.started = millis();
+  f.throttled = 0;
+  f.client = client;
+  clients[f.client].flows++;
+  // Joins at the next round: the current one is not held up by it
+  f.deficit = 0;
+  f.round = drrRound - 1;
+  f.lastAsk = millis();
+  f.rateLimited = false;
+  activeWeight += f.weight;
+  // Start with a full share so the first response bytes go out at once
+  f.share = {burstOf(shareRate(f)), (uint32_t)micros()};
+  startMeter(f.meter);
+}
+
+EgressFlow::~EgressFlow()
+{
+  if (slot < 0)
+  {
+    return;
+  }
+  Flow &f = flows[slot];
+  activeWeight -= f.weight;
+  clients[f.client].flows--;
+  f.used = false;
+  f.path = String();
+}
+
+size_t EgressFlow::allow(size_t maxLen)
+{
+  if (slot < 0)
+  {
+    return maxLen;
+  }
+  Flow &f = flows[slot];
+  uint32_t now = micros();
+  size_t allowed = maxLen;
+  f.lastAsk = millis();
+  if (config.quantum)
+  {
+    if (f.round != drrRound || f.deficit < MIN_SEND)
+    {
+      if (f.round == drrRound)
+      {
+        // Turn used up: the round ends once no other flow is still owed its turn
+        for (uint8_t i = 0; i < EGRESS_MAX_FLOWS; i++)
+        {
+          if (i != slot && awaitingTurn(flows[i]))
+          {
+            f.throttled++;
+            stats.throttled++;
+            return 0;
+          }
+        }
+        drrRound++;
+        stats.rounds++;
+      }
+      // A flow that skipped a round or left its turn unfinished was idle:
+      // like an empty DRR queue, its deficit starts over
+      uint32_t carry = f.round + 1 == drrRound && f.deficit < MIN_SEND ? f.deficit : 0;
+      f.deficit = carry + config.quantum * f.weight;
+      f.round = drrRound;
+    }
+    allowed = min(allowed, (size_t)f.deficit);
+  }
+  if (config.globalRate)
+  {
+    refill(global, config.globalRate, now);
+    refill(f.share, shareRate(f), now);
+    // Capacity nobody used has piled up in the global bucket; any flow may take it
+    float tokens = global.tokens >= burstOf(config.globalRate) ? global.tokens : min(f.share.tokens, global.tokens);
+    allowed = min(allowed, (size_t)max(tokens, 0.0f));
+  }
+  if (config.clientRate)
+  {
+    Bucket &b = clients[f.client].bucket;
+    refill(b, config.clientRate, now);
+    allowed = min(allowed, (size_t)max(b.tokens, 0.0f));
+  }
+  // Held back by a rate: the flow does not hold up the round meanwhile
+  f.rateLimited = allowed < maxLen && allowed < MIN_SEND;
+  if (f.rateLimited)
+  {
+    f.throttled++;
+    stats.throttled++;
+    return 0;
+  }
+  return allowed;
+}
+
+void EgressFlow::sent(size_t n)
+{
+  if (slot < 0 || n == 0)
+  {
+    return;
+  }
+  Flow &f = flows[slot];
+  if (config.quantum)
+  {
+    f.deficit -= min((uint32_t)n, f.deficit);
+  }
+  if (config.globalRate)
+  {
+    global.tokens -= n;
+    f.share.tokens -= n;
+  }
+  addToMeter(f.meter, n);
+  addToMeter(globalMeter, n);
+  Client &c = clients[f.client];
+  if (config.clientRate)
+  {
+    c.bucket.tokens -= n;
+  }
+  addToMeter(c.meter, n);
+}
+
+uint8_t egressWeight(AsyncWebServerRequest *request)
+{
+  if (!request->hasParam("weight"))
+  {
+    return 1;
+  }
+  return constrain(request->getParam("weight")->value().toInt(), 1, EGRESS_MAX_WEIGHT);
+}
+
+EgressConfig egressGetConfig()
+{
+  return config;
+}
+
+bool egressSetConfig(const EgressConfig &next, String &error)
+{
+  if ((next.globalRate && next.globalRate < MIN_RATE) || (next.clientRate && next.clientRate < MIN_RATE))
+  {
+    error = "rates must be 0 (unlimited) or at least " + String(MIN_RATE) + " bytes/s";
+    return false;
+  }
+  if (next.quantum && (next.quantum < MIN_SEND || next.quantum > 65535))
+  {
+    error = "quantum must be 0 or " + String(MIN_SEND) + " .. 65535";
+    return false;
+  }
+  config = next;
+  return true;
+}
+
+void egressStatusJson(JsonObject obj)
+{
+  JsonObject c = obj["config"].to<JsonObject>();
+  c["globalRate"] = config.globalRate;
+  c["clientRate"] = config.clientRate;
+  c["quantum"] = config.quantum;
+
+  obj["flows"] = stats.flows;
+  obj["refused"] = stats.refused;
+  obj["throttled"] = stats.throttled;
+  obj["rounds"] = stats.rounds;
+  obj["bytes"] = globalMeter.bytes;
+  obj["rate"] = currentRate(globalMeter);
+
+  JsonArray active = obj["active"].to<JsonArray>();
+  for (const Flow &f : flows)
+  {
+    if (!f.used)
+    {
+      continue;
+    }
+    JsonObject o = active.add<JsonObject>();
+    o["id"] = f.id;
+    o["client"] = IPAddress(clients[f.client].ip).toString();
+    o["path"] = f.path;
+    o["weight"] = f.weight;
+    if (config.quantum)
+    {
+      o["deficit"] = f.round == drrRound ? f.deficit : 0;
+    }
+    if (config.globalRate)
+    {
+      o["shareRate"] = shareRate(f);
+    }
+    o["bytes"] = f.meter.bytes;
+    o["rate"] = currentRate(f.meter);
+    o["throttled"] = f.throttled;
+    o["ageMs"] = millis() - f.started;
+  }
+
+  JsonArray byClient = obj["clients"].to<JsonArray>();
+  for (const Client &cl : clients)
+  {
+    if (cl.flows == 0)
+    {
+      continue;
+    }
+    JsonObject o = byClient.add<JsonObject>();
+    o["client"] = IPAddress(cl.ip).toString();
+    o["flows"] = cl.flows;
+    o["bytes"] = cl.meter.bytes;
+    o["rate"] = currentRate(cl.meter);
+  }
+}
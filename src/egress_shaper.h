@@ -0,0 +1,71 @@
+#ifndef __EGRESS_SHAPER_H
+#define __EGRESS_SHAPER_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+
+#define EGRESS_MAX_FLOWS 16
+#define EGRESS_MAX_CLIENTS 8
+#define EGRESS_MAX_WEIGHT 16
+// Bytes per weight unit per send opportunity: two full TCP segments
+#define EGRESS_DEFAULT_QUANTUM 2920
+// Bucket depth. A throttled response is only resumed by an ACK or by the
+// connection poll, which AsyncTCP runs every 500 ms, so the buckets must
+// hold that much time at their rate or slow flows fall short of it
+#define EGRESS_BURST_MS 500
+// A flow that has not asked to send for this long is not backlogged: the
+// deficit round robin goes on without it
+#define EGRESS_TURN_MS 50
+#define EGRESS_RATE_WINDOW_MS 1000
+
+struct EgressConfig
+{
+    uint32_t globalRate; // bytes/s for all shaped downloads together, 0 = unlimited
+    uint32_t clientRate; // bytes/s per client address, 0 = unlimited
+    uint32_t quantum;    // bytes per weight unit per send opportunity, 0 = no cap
+};
+
+// Send-side shaping of download responses (/download, WebDAV GET).
+// Concurrent transfers are served in deficit round robin order: each round
+// a flow may send quantum x weight bytes plus what it had left under one
+// segment, over as many send opportunities (filler calls, made when the
+// connection has window to spare) as it needs. A flow that has used its
+// turn waits until every other backlogged flow has had its own, so none of
+// them fills the lwIP send queue on its own. With a global rate,
+// each active flow additionally gets a token bucket refilled at its weighted
+// share of that rate; capacity a flow leaves unused accumulates in the
+// global bucket, and once that is full any flow may use it. A per-client
+// bucket caps the sum of one address's flows.
+//
+// Only touched from the web server task.
+class EgressFlow
+{
+private:
+    int8_t slot; // -1 if refused
+
+public:
+    EgressFlow(AsyncWebServerRequest *request, const String &path, uint8_t weight);
+    ~EgressFlow();
+
+    // False if the flow or client table was full: answer 503 rather than
+    // sending unshaped
+    bool admitted() const { return slot >= 0; }
+
+    // Bytes the filler may send now, at most maxLen. 0 means the flow is over
+    // its rate: return RESPONSE_TRY_AGAIN
+    size_t allow(size_t maxLen);
+    // Charges what the filler actually produced
+    void sent(size_t n);
+};
+
+// `weight` request parameter, 1 .. EGRESS_MAX_WEIGHT (default 1)
+uint8_t egressWeight(AsyncWebServerRequest *request);
+
+EgressConfig egressGetConfig();
+// Returns false and fills `error` if a value is out of range
+bool egressSetConfig(const EgressConfig &config, String &error);
+// Config, totals, and live rate of every flow and client
+void egressStatusJson(JsonObject obj);
+
+#endif
@@ -0,0 +1,849 @@
+#include "file_crypt.h"
+#include "async_io_service.h"
+#include "bg_job.h"
+#include "checksum.h"
+#include "du_tree.h"
+#include "fs_events.h"
+#include "lz4_store.h"
+#include "meta_cache.h"
+#include "sd_io_sched.h"
+#include "sd_read_write.h"
+#include <Preferences.h>
+#include <esp_heap_caps.h>
+#include <esp_random.h>
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <functional>
+
+struct CryptHeader
+{
+  char magic[4]; // "SDE1"
+  uint32_t keyId;
+  uint32_t flags;
+  uint32_t reserved;
+  uint8_t iv[AES_BLOCK_BYTES];
+};
+static_assert(sizeof(CryptHeader) == CRYPT_HEADER_SIZE, "header layout");
+
+// One NVS slot per directory: "dir<n>" marks the slot as used and is
+// written last, so a slot is never valid without its key
+struct CryptDir
+{
+  bool used;
+  String dir;
+  uint32_t keyId;
+  uint8_t key[AES_KEY_BYTES];
+};
+
+static CryptDir dirs[CRYPT_MAX_DIRS];
+static size_t dirCount = 0;
+static SemaphoreHandle_t cryptLock = nullptr;
+static uint64_t cipherBytes = 0;
+static uint64_t cipherUs = 0;
+static uint32_t lockedOpens = 0;
+
+static void *psramAlloc(size_t size)
+{
+  void *p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  return p ? p : malloc(size);
+}
+
+static void slotKey(char *name, size_t size, const char *prefix, size_t slot)
+{
+  snprintf(name, size, "%s%u", prefix, (unsigned)slot);
+}
+
+void cryptBegin()
+{
+  cryptLock = xSemaphoreCreateMutex();
+
+  Preferences prefs;
+  if (!prefs.begin(CRYPT_NVS_NAMESPACE, true))
+  {
+    return; // nothing stored yet
+  }
+  char name[16];
+  for (size_t i = 0; i < CRYPT_MAX_DIRS; i++)
+  {
+    CryptDir &d = dirs[i];
+    slotKey(name, sizeof(name), "dir", i);
+    d.dir = prefs.getString(name, "");
+    if (d.dir.isEmpty())
+    {
+      continue;
+    }
+    slotKey(name, sizeof(name), "key", i);
+    if (prefs.getBytes(name, d.key, AES_KEY_BYTES) != AES_KEY_BYTES)
+    {
+      Serial.printf("Encryption key for %s is missing\n", d.dir.c_str());
+      continue;
+    }
+    slotKey(name, sizeof(name), "id", i);
+    d.keyId = prefs.getUInt(name, 0);
+    d.used = true;
+    dirCount++;
+    Serial.printf("Encrypted directory: %s\n", d.dir.c_str());
+  }
+  prefs.end();
+}
+
+// Longest encrypted directory containing `path`; call with cryptLock held
+static int findDir(const String &path)
+{
+  int best = -1;
+  for (size_t i = 0; i < CRYPT_MAX_DIRS; i++)
+  {
+    const CryptDir &d = dirs[i];
+    if (d.used && path.startsWith(d.dir) && (path.length() == d.dir.length() || path[d.dir.length()] == '/') &&
+        (best < 0 || d.dir.length() > dirs[best].dir.length()))
+    {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static String normalizeDir(const String &dir)
+{
+  String d = dir;
+  while (d.length() > 1 && d.endsWith("/"))
+  {
+    d.remove(d.length() - 1);
+  }
+  return d;
+}
+
+bool cryptAddDir(const String &dir, String &error)
+{
+  String d = normalizeDir(dir);
+  if (!d.startsWith("/") || d == "/")
+  {
+    error = "Directory must be an absolute path below /";
+    return false;
+  }
+
+  xSemaphoreTake(cryptLock, portMAX_DELAY);
+  int slot = -1;
+  bool exists = false;
+  for (size_t i = 0; i < CRYPT_MAX_DIRS; i++)
+  {
+    exists = exists || (dirs[i].used && dirs[i].dir == d);
+    if (!dirs[i].used && slot < 0)
+    {
+      slot = i;
+    }
+  }
+  if (exists || slot < 0)
+  {
+    xSemaphoreGive(cryptLock);
+    error = exists ? "Directory is already encrypted" : "Too many encrypted directories";
+    return false;
+  }
+
+  // Key ids tell the keys apart when a directory is removed and added again
+  CryptDir &entry = dirs[slot];
+  esp_fill_random(entry.key, AES_KEY_BYTES);
+  do
+  {
+    entry.keyId = esp_random();
+    for (size_t i = 0; i < CRYPT_MAX_DIRS; i++)
+    {
+      if (dirs[i].used && dirs[i].keyId == entry.keyId)
+      {
+        entry.keyId = 0;
+      }
+    }
+  } while (entry.keyId == 0);
+
+  Preferences prefs;
+  char name[16];
+  bool ok = prefs.begin(CRYPT_NVS_NAMESPACE, false);
+  if (ok)
+  {
+    slotKey(name, sizeof(name), "key", slot);
+    ok = prefs.putBytes(name, entry.key, AES_KEY_BYTES) == AES_KEY_BYTES;
+    slotKey(name, sizeof(name), "id", slot);
+    ok = ok && prefs.putUInt(name, entry.keyId) == 4;
+    slotKey(name, sizeof(name), "dir", slot);
+    ok = ok && prefs.putString(name, d) == d.length();
+    prefs.end();
+  }
+  if (ok)
+  {
+    entry.dir = d;
+    entry.used = true;
+    dirCount++;
+  }
+  else
+  {
+    memset(entry.key, 0, AES_KEY_BYTES);
+    error = "Failed to store the key in NVS";
+  }
+  xSemaphoreGive(cryptLock);
+  return ok;
+}
+
+bool cryptRemoveDir(const String &dir, String &error)
+{
+  String d = normalizeDir(dir);
+  xSemaphoreTake(cryptLock, portMAX_DELAY);
+  int slot = -1;
+  for (size_t i = 0; i < CRYPT_MAX_DIRS; i++)
+  {
+    if (dirs[i].used && dirs[i].dir == d)
+    {
+      slot = i;
+    }
+  }
+  if (slot < 0)
+  {
+    xSemaphoreGive(cryptLock);
+    error = "Directory is not encrypted";
+    return false;
+  }
+
+  Preferences prefs;
+  char name[16];
+  if (prefs.begin(CRYPT_NVS_NAMESPACE, false))
+  {
+    slotKey(name, sizeof(name), "dir", slot);
+    prefs.remove(name);
+    slotKey(name, sizeof(name), "key", slot);
+    prefs.remove(name);
+    slotKey(name, sizeof(name), "id", slot);
+    prefs.remove(name);
+    prefs.end();
+  }
+  CryptDir &entry = dirs[slot];
+  memset(entry.key, 0, AES_KEY_BYTES);
+  entry.used = false;
+  entry.dir = "";
+  dirCount--;
+  xSemaphoreGive(cryptLock);
+  return true;
+}
+
+bool cryptIsEncryptedPath(const String &path)
+{
+  if (dirCount == 0)
+  {
+    return false;
+  }
+  xSemaphoreTake(cryptLock, portMAX_DELAY);
+  bool encrypted = findDir(path) >= 0;
+  xSemaphoreGive(cryptLock);
+  return encrypted;
+}
+
+// ---- Per-file cipher ---------------------------------------------------------
+
+bool FileCipher::create(const String &path, uint8_t *header)
+{
+  if (dirCount == 0)
+  {
+    return false;
+  }
+  CryptHeader h = {{'S', 'D', 'E', '1'}, 0, 0, 0, {0}};
+  uint8_t key[AES_KEY_BYTES];
+  xSemaphoreTake(cryptLock, portMAX_DELAY);
+  int slot = findDir(path);
+  if (slot >= 0)
+  {
+    h.keyId = dirs[slot].keyId;
+    memcpy(key, dirs[slot].key, AES_KEY_BYTES);
+  }
+  xSemaphoreGive(cryptLock);
+  if (slot < 0)
+  {
+    return false;
+  }
+
+  esp_fill_random(h.iv, AES_BLOCK_BYTES);
+  ctr.setKey(key, h.iv);
+  memset(key, 0, AES_KEY_BYTES);
+  memcpy(header, &h, sizeof(h));
+  return true;
+}
+
+CryptState FileCipher::load(const uint8_t *header, size_t len)
+{
+  CryptHeader h;
+  if (len < sizeof(h))
+  {
+    return CRYPT_PLAIN;
+  }
+  memcpy(&h, header, sizeof(h));
+  if (memcmp(h.magic, "SDE1", 4) != 0)
+  {
+    return CRYPT_PLAIN;
+  }
+
+  bool found = false;
+  xSemaphoreTake(cryptLock, portMAX_DELAY);
+  for (size_t i = 0; i < CRYPT_MAX_DIRS && !found; i++)
+  {
+    if (dirs[i].used && dirs[i].keyId == h.keyId)
+    {
+      ctr.setKey(dirs[i].key, h.iv);
+      found = true;
+    }
+  }
+  if (!found)
+  {
+    lockedOpens++;
+  }
+  xSemaphoreGive(cryptLock);
+  return found ? CRYPT_ENCRYPTED : CRYPT_LOCKED;
+}
+
+void FileCipher::apply(uint64_t offset, const uint8_t *in, uint8_t *out, size_t len)
+{
+  int64_t start = esp_timer_get_time();
+  ctr.apply(offset, in, out, len);
+  uint32_t us = esp_timer_get_time() - start;
+  if (cryptLock)
+  {
+    xSemaphoreTake(cryptLock, portMAX_DELAY);
+    cipherBytes += len;
+    cipherUs += us;
+    xSemaphoreGive(cryptLock);
+  }
+}
+
+CryptState cryptProbe(File &file, FileCipher &cipher)
+{
+  uint8_t header[CRYPT_HEADER_SIZE];
+  file.seek(0);
+  size_t n = file.read(header, sizeof(header));
+  CryptState state = cipher.load(header, n);
+  if (state != CRYPT_ENCRYPTED)
+  {
+    file.seek(0);
+  }
+  return state;
+}
+
+CryptState cryptProbePath(fs::FS &fs, const String &path, FileCipher &cipher)
+{
+  File file = fs.open(path);
+  if (!file || file.isDirectory())
+  {
+    return CRYPT_PLAIN;
+  }
+  CryptState state = cryptProbe(file, cipher);
+  file.close();
+  return state;
+}
+
+bool cryptContentCrc32(fs::FS &fs, const String &path, uint32_t &crc)
+{
+  File file = fs.open(path);
+  if (!file || file.isDirectory())
+  {
+    return false;
+  }
+  FileCipher cipher;
+  CryptState state = cryptProbe(file, cipher);
+  if (state == CRYPT_LOCKED)
+  {
+    file.close();
+    return false;
+  }
+
+  Hasher hasher(HASH_CRC32);
+  uint8_t buffer[4096];
+  uint64_t offset = 0;
+  size_t n;
+  while ((n = file.read(buffer, sizeof(buffer))) > 0)
+  {
+    if (state == CRYPT_ENCRYPTED)
+    {
+      cipher.apply(offset, buffer, buffer, n);
+    }
+    hasher.update(buffer, n);
+    offset += n;
+  }
+  file.close();
+  crc = hasher.crc32();
+  return true;
+}
+
+// ---- Pipeline --------------------------------------------------------------
+
+// Chunks alternate between two buffers: while the worker on the other core
+// runs the cipher over one, this task produces the next and consumes the
+// previous, so the cipher hides behind the card I/O
+struct CryptJob
+{
+  FileCipher *decrypt;
+  FileCipher *encrypt;
+  uint8_t *buffer;
+  uint64_t offset;
+  size_t len;
+  volatile bool stop;
+  SemaphoreHandle_t start;
+  SemaphoreHandle_t done;
+
+  void run()
+  {
+    if (decrypt)
+    {
+      decrypt->apply(offset, buffer, buffer, len);
+    }
+    if (encrypt)
+    {
+      encrypt->apply(offset, buffer, buffer, len);
+    }
+  }
+};
+
+static void cryptWorker(void *arg)
+{
+  CryptJob *job = (CryptJob *)arg;
+  while (xSemaphoreTake(job->start, portMAX_DELAY) == pdTRUE && !job->stop)
+  {
+    job->run();
+    xSemaphoreGive(job->done);
+  }
+  xSemaphoreGive(job->done);
+  vTaskDelete(NULL);
+}
+
+typedef std::function<size_t(uint8_t *buffer, size_t len)> CryptProducer;
+typedef std::function<bool(const uint8_t *buffer, size_t len)> CryptConsumer;
+
+static bool runPipeline(FileCipher *decrypt, FileCipher *encrypt, uint64_t total, const CryptProducer &produce,
+                        const CryptConsumer &consume)
+{
+  uint8_t *buffers[2] = {(uint8_t *)psramAlloc(CRYPT_COPY_CHUNK), (uint8_t *)psramAlloc(CRYPT_COPY_CHUNK)};
+  CryptJob job = {decrypt, encrypt, nullptr, 0, 0, false, xSemaphoreCreateBinary(), xSemaphoreCreateBinary()};
+  bool ok = buffers[0] && buffers[1] && job.start && job.done;
+
+  // Without a worker (no cipher, or no memory for the task) the chunks are
+  // handled in line
+  bool threaded = false;
+  if (ok && (decrypt || encrypt))
+  {
+    BaseType_t otherCore = xPortGetCoreID() == 0 ? 1 : 0;
+    threaded = xTaskCreatePinnedToCore(cryptWorker, "crypt", CRYPT_TASK_STACK, &job, BG_JOB_PRIORITY + 1, nullptr,
+                                       otherCore) == pdPASS;
+  }
+
+  uint64_t pos = 0;
+  size_t lens[2] = {0, 0};
+  bool pending = false;
+  int busy = 0;
+  uint32_t lastWdtReset = millis();
+  while (ok)
+  {
+    int next = busy ^ 1;
+    lens[next] = pos < total ? produce(buffers[next], min((uint64_t)CRYPT_COPY_CHUNK, total - pos)) : 0;
+    if (pos < total && lens[next] == 0)
+    {
+      ok = false; // short read
+    }
+    if (pending)
+    {
+      xSemaphoreTake(job.done, portMAX_DELAY);
+      pending = false;
+    }
+    if (ok && lens[next] > 0)
+    {
+      job.buffer = buffers[next];
+      job.offset = pos;
+      job.len = lens[next];
+      if (threaded)
+      {
+        xSemaphoreGive(job.start);
+        pending = true;
+      }
+      else
+      {
+        job.run();
+      }
+      pos += lens[next];
+    }
+    if (ok && lens[busy] > 0)
+    {
+      ok = consume(buffers[busy], lens[busy]);
+    }
+    if (lens[next] == 0)
+    {
+      break;
+    }
+    busy = next;
+
+    uint32_t now = millis();
+    if (now - lastWdtReset > 1000)
+    {
+      esp_task_wdt_reset();
+      lastWdtReset = now;
+    }
+  }
+
+  if (pending)
+  {
+    xSemaphoreTake(job.done, portMAX_DELAY);
+  }
+  if (threaded)
+  {
+    job.stop = true;
+    xSemaphoreGive(job.start);
+    xSemaphoreTake(job.done, portMAX_DELAY);
+  }
+  if (job.start)
+  {
+    vSemaphoreDelete(job.start);
+  }
+  if (job.done)
+  {
+    vSemaphoreDelete(job.done);
+  }
+  free(buffers[0]);
+  free(buffers[1]);
+  return ok && pos == total;
+}
+
+bool cryptCopyFile(fs::FS &fs, const String &from, const String &to, size_t &storedBytes, BackgroundJob *job)
+{
+  File src = fs.open(from);
+  if (!src || src.isDirectory())
+  {
+    Serial.println("Failed to open source file");
+    return false;
+  }
+  FileCipher in;
+  FileCipher out;
+  CryptState state = cryptProbe(src, in);
+  uint8_t header[CRYPT_HEADER_SIZE];
+  bool encrypt = out.create(to, header);
+  if (state == CRYPT_LOCKED)
+  {
+    Serial.printf("No key for %s\n", from.c_str());
+    src.close();
+    return false;
+  }
+  if (state == CRYPT_PLAIN && !encrypt)
+  {
+    storedBytes = src.size();
+    src.close();
+    return copyFile(fs, from.c_str(), to.c_str(), job);
+  }
+
+  Serial.printf("Copying file %s to %s (%s)\n", from.c_str(), to.c_str(),
+                state == CRYPT_ENCRYPTED ? (encrypt ? "re-encrypt" : "decrypt") : "encrypt");
+  size_t contentBytes = src.size() - (state == CRYPT_ENCRYPTED ? CRYPT_HEADER_SIZE : 0);
+  storedBytes = contentBytes + (encrypt ? CRYPT_HEADER_SIZE : 0);
+  // Preallocated, so written under a staging name like copyFile()
+  String stagingPath = to + COPY_STAGING_SUFFIX;
+  fsCacheInvalidate(stagingPath);
+  File dst = fs.open(stagingPath, FILE_WRITE);
+  if (!dst)
+  {
+    Serial.println("Failed to open target file");
+    src.close();
+    return false;
+  }
+  preallocateFile(dst, storedBytes);
+
+  uint32_t start = millis();
+  size_t copied = 0;
+  bool ok = !encrypt || dst.write(header, sizeof(header)) == sizeof(header);
+  ok = ok && runPipeline(
+                 state == CRYPT_ENCRYPTED ? &in : nullptr, encrypt ? &out : nullptr, contentBytes,
+                 [&src](uint8_t *buffer, size_t len) { return sdIoRead(src, buffer, len, SD_IO_BULK); },
+                 [&dst, &copied, contentBytes, job](const uint8_t *buffer, size_t len)
+                 {
+                   if (job && job->cancelled())
+                   {
+                     return false;
+                   }
+                   copied += len;
+                   if (job)
+                   {
+                     job->setProgress(copied, contentBytes);
+                   }
+                   return sdIoWrite(dst, buffer, len, SD_IO_BULK) == len;
+                 });
+  src.close();
+  dst.close();
+  ok = ok && fs.rename(stagingPath.c_str(), to.c_str());
+  if (!ok)
+  {
+    Serial.println("Copy failed");
+    fs.remove(stagingPath.c_str());
+  }
+  fsCacheInvalidate(stagingPath);
+  fsCacheInvalidate(to);
+  if (!ok)
+  {
+    return false;
+  }
+
+  uint32_t elapsed = max((uint32_t)1, (uint32_t)(millis() - start));
+  Serial.printf("Copied %u bytes in %u ms (%.2f KB/s)\n", contentBytes, elapsed, contentBytes / (float)elapsed);
+  return true;
+}
+
+// ---- Copy job --------------------------------------------------------------
+
+static BackgroundJob copyJob("copy");
+
+bool startCopyJob(fs::FS &fs, const String &from, const String &to)
+{
+  if (copyJob.running())
+  {
+    return false;
+  }
+  return copyJob.start([&fs, from, to](BackgroundJob &job)
+                       {
+    size_t storedBytes = 0;
+    if (!cryptCopyFile(fs, from, to, storedBytes, &job))
+    {
+      job.setMessage(job.cancelled() ? "Cancelled" : "Failed to copy " + from);
+      return false;
+    }
+    fsEventAdded(to, storedBytes, false);
+    duFileAdded(to, storedBytes);
+    lzbRemoveTwin(fs, to);
+    job.setMessage("Copied " + from + " to " + to);
+    return true; });
+}
+
+void cancelCopyJob()
+{
+  copyJob.cancel();
+}
+
+void copyStatusJson(JsonObject obj)
+{
+  copyJob.statusJson(obj);
+}
+
+// ---- Benchmark and status --------------------------------------------------
+
+static float overheadPct(uint32_t plainMs, uint32_t cryptMs)
+{
+  return plainMs ? ((float)cryptMs - plainMs) * 100.0f / plainMs : 0;
+}
+
+// Piece sizes of the handlers: a TCP segment per upload callback, a send
+// buffer's worth per download filler call
+#define CRYPT_TEST_UPLOAD_PIECE 1436
+#define CRYPT_TEST_DOWNLOAD_PIECE 5744
+
+// Content byte `pos` of the test file is pattern[pos % CRYPT_COPY_CHUNK]
+static void patternAt(const uint8_t *pattern, size_t pos, uint8_t *out, size_t len)
+{
+  while (len > 0)
+  {
+    size_t at = pos % CRYPT_COPY_CHUNK;
+    size_t n = min(len, (size_t)CRYPT_COPY_CHUNK - at);
+    memcpy(out, pattern + at, n);
+    out += n;
+    pos += n;
+    len -= n;
+  }
+}
+
+static bool matchesPattern(const uint8_t *pattern, size_t pos, const uint8_t *data, size_t len)
+{
+  while (len > 0)
+  {
+    size_t at = pos % CRYPT_COPY_CHUNK;
+    size_t n = min(len, (size_t)CRYPT_COPY_CHUNK - at);
+    if (memcmp(data, pattern + at, n) != 0)
+    {
+      return false;
+    }
+    data += n;
+    pos += n;
+    len -= n;
+  }
+  return true;
+}
+
+// What /upload does: header, preallocation, then network-sized pieces
+// ciphered in place and queued on an AsyncWriteStream, truncated at the end
+static bool timedUpload(fs::FS &fs, const char *path, FileCipher *cipher, const uint8_t *header,
+                        const uint8_t *pattern, size_t bytes, uint32_t &ms)
+{
+  size_t headerBytes = cipher ? CRYPT_HEADER_SIZE : 0;
+  uint8_t piece[CRYPT_TEST_UPLOAD_PIECE];
+  fsCacheInvalidate(path);
+  File file = fs.open(path, FILE_WRITE);
+  uint32_t start = millis();
+  bool ok = file && (!cipher || file.write(header, headerBytes) == headerBytes);
+  if (ok)
+  {
+    preallocateFile(file, bytes + headerBytes);
+  }
+  AsyncWriteStream writer;
+  // A test task may wait for the card, where /upload fails as busy instead
+  bool async = ok && writer.begin(file, SD_IO_BULK, true);
+  for (size_t pos = 0, n; pos < bytes && ok; pos += n)
+  {
+    n = min(sizeof(piece), bytes - pos);
+    patternAt(pattern, pos, piece, n);
+    if (cipher)
+    {
+      cipher->apply(pos, piece, piece, n);
+    }
+    ok = async ? writer.write(piece, n) : file.write(piece, n) == n;
+  }
+  ok = (!async || writer.finishAndWait()) && ok;
+  file.close();
+  ok = ok && truncateFile(path, bytes + headerBytes);
+  fsCacheInvalidate(path);
+  ms = max((uint32_t)1, (uint32_t)(millis() - start));
+  return ok;
+}
+
+// What /download does: an AsyncReadStream past the header, deciphered in
+// place in the send buffer. Also checks the content
+static bool timedDownload(fs::FS &fs, const char *path, FileCipher *cipher, const uint8_t *pattern, size_t bytes,
+                          uint8_t *buffer, uint32_t &ms)
+{
+  size_t skip = cipher ? CRYPT_HEADER_SIZE : 0;
+  File file = fs.open(path);
+  if (!file)
+  {
+    return false;
+  }
+  uint32_t start = millis();
+  std::shared_ptr<volatile bool> closed = std::make_shared<volatile bool>(false);
+  AsyncReadStream *stream = new AsyncReadStream();
+  bool async = stream->begin(file, skip, bytes, SD_IO_BULK, [closed]() { *closed = true; });
+  if (!async)
+  {
+    file.seek(skip);
+  }
+  bool ok = true;
+  for (size_t pos = 0; pos < bytes && ok;)
+  {
+    size_t want = min((size_t)CRYPT_TEST_DOWNLOAD_PIECE, bytes - pos);
+    size_t n = async ? stream->fill(buffer, want, pos) : file.read(buffer, want);
+    if (n == 0)
+    {
+      // Still being read: the filler would answer RESPONSE_TRY_AGAIN
+      ok = async && !stream->failed();
+      vTaskDelay(1);
+      continue;
+    }
+    if (cipher)
+    {
+      cipher->apply(pos, buffer, buffer, n);
+    }
+    ok = matchesPattern(pattern, pos, buffer, n);
+    pos += n;
+  }
+  delete stream;
+  // The file is detached on a worker once the outstanding reads are done
+  for (uint32_t wait = millis(); async && !*closed && millis() - wait < 5000;)
+  {
+    delay(1);
+  }
+  file.close();
+  ms = max((uint32_t)1, (uint32_t)(millis() - start));
+  return ok;
+}
+
+float testCrypt(fs::FS &fs, const char *path, size_t bytes, JsonObject result)
+{
+  Serial.printf("Encryption test: %u bytes at %s\n", bytes, path);
+  uint8_t *pattern = (uint8_t *)psramAlloc(CRYPT_COPY_CHUNK);
+  uint8_t *scratch = (uint8_t *)psramAlloc(CRYPT_COPY_CHUNK);
+  if (pattern == nullptr || scratch == nullptr)
+  {
+    free(pattern);
+    free(scratch);
+    return 0;
+  }
+  for (size_t i = 0; i < CRYPT_COPY_CHUNK; i++)
+  {
+    pattern[i] = (uint8_t)(i * 31 + (i >> 9));
+  }
+  uint8_t key[AES_KEY_BYTES];
+  uint8_t iv[AES_BLOCK_BYTES];
+  esp_fill_random(key, sizeof(key));
+  esp_fill_random(iv, sizeof(iv));
+  FileCipher cipher;
+  cipher.setKey(key, iv);
+  // Stand-in for FileCipher::create(), which needs a registered directory
+  uint8_t header[CRYPT_HEADER_SIZE];
+  esp_fill_random(header, sizeof(header));
+  memcpy(header, "SDE1", 4);
+
+  // Cipher alone, in memory
+  int64_t t = esp_timer_get_time();
+  for (size_t pos = 0; pos < bytes; pos += CRYPT_COPY_CHUNK)
+  {
+    cipher.apply(pos, pattern, scratch, min((size_t)CRYPT_COPY_CHUNK, bytes - pos));
+  }
+  uint32_t us = max((int64_t)1, esp_timer_get_time() - t);
+  result["cipherMBps"] = bytes / (float)us;
+
+  uint32_t ms[2][2]; // [upload, download][plain, encrypted]
+  bool ok[2];
+  bool headerKept = false;
+  for (int encrypted = 0; encrypted < 2; encrypted++)
+  {
+    FileCipher *c = encrypted ? &cipher : nullptr;
+    ok[encrypted] = timedUpload(fs, path, c, header, pattern, bytes, ms[0][encrypted]);
+    esp_task_wdt_reset();
+    if (encrypted)
+    {
+      // Preallocation must not have moved the write position back over it
+      uint8_t stored[CRYPT_HEADER_SIZE];
+      File file = fs.open(path);
+      headerKept = file && file.read(stored, sizeof(stored)) == sizeof(stored) &&
+                   memcmp(stored, header, sizeof(stored)) == 0 && file.size() == bytes + CRYPT_HEADER_SIZE;
+      file.close();
+    }
+    ok[encrypted] = timedDownload(fs, path, c, pattern, bytes, scratch, ms[1][encrypted]) && ok[encrypted];
+    esp_task_wdt_reset();
+  }
+  fs.remove(path);
+  fsCacheInvalidate(path);
+  free(pattern);
+  free(scratch);
+
+  result["bytes"] = bytes;
+  result["plainWriteMBps"] = bytes / 1000.0f / ms[0][0];
+  result["encryptedWriteMBps"] = bytes / 1000.0f / ms[0][1];
+  result["writeOverheadPct"] = overheadPct(ms[0][0], ms[0][1]);
+  result["plainReadMBps"] = bytes / 1000.0f / ms[1][0];
+  result["encryptedReadMBps"] = bytes / 1000.0f / ms[1][1];
+  result["readOverheadPct"] = overheadPct(ms[1][0], ms[1][1]);
+  result["plainOk"] = ok[0];
+  result["encryptedOk"] = ok[1] && headerKept;
+  if (!ok[0] || !ok[1] || !headerKept)
+  {
+    Serial.printf("Encryption test FAILED: plain %s, encrypted %s, header %s\n", ok[0] ? "ok" : "bad",
+                  ok[1] ? "ok" : "bad", headerKept ? "kept" : "overwritten");
+  }
+  return max(overheadPct(ms[0][0], ms[0][1]), overheadPct(ms[1][0], ms[1][1]));
+}
+
+void cryptStatusJson(JsonObject obj)
+{
+  obj["backend"] = AesCtr::backend();
+  JsonArray list = obj["dirs"].to<JsonArray>();
+  xSemaphoreTake(cryptLock, portMAX_DELAY);
+  for (size_t i = 0; i < CRYPT_MAX_DIRS; i++)
+  {
+    if (dirs[i].used)
+    {
+      JsonObject d = list.add<JsonObject>();
+      d["dir"] = dirs[i].dir;
+      d["keyId"] = dirs[i].keyId;
+    }
+  }
+  obj["cipherBytes"] = cipherBytes;
+  obj["cipherMBps"] = cipherUs ? cipherBytes / (double)cipherUs : 0;
+  obj["lockedOpens"] = lockedOpens;
+  xSemaphoreGive(cryptLock);
+}
@@ -0,0 +1,90 @@
+#ifndef __FILE_CRYPT_H
+#define __FILE_CRYPT_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include "aes_ctr.h"
+#include <ArduinoJson.h>
+
+class BackgroundJob;
+
+// At-rest encryption for selected directories. Every file written under an
+// encrypted directory (upload, copy) starts with a 32-byte header
+//
+//   "SDE1", u32 key id, u32 flags, u32 reserved, 16-byte IV
+//
+// followed by the content in AES-256-CTR with a fresh random IV per file.
+// The key of each directory is generated on the device and kept in NVS
+// only, so a card pulled from the device reads as noise. Files are matched
+// to keys by key id, so they stay readable after a rename; files without a
+// header are served as they are. CTR gives confidentiality, not integrity.
+#define CRYPT_HEADER_SIZE 32
+#define CRYPT_MAX_DIRS 8
+#define CRYPT_NVS_NAMESPACE "sdcrypt"
+// Copies cipher one chunk on the other core while this one reads the next
+// and writes the previous
+#define CRYPT_COPY_CHUNK (64 * 1024)
+#define CRYPT_TASK_STACK 4096
+
+void cryptBegin();
+bool cryptAddDir(const String &dir, String &error);
+// Forgets the key: files encrypted with it can no longer be read
+bool cryptRemoveDir(const String &dir, String &error);
+// True if new files at `path` are encrypted
+bool cryptIsEncryptedPath(const String &path);
+
+enum CryptState
+{
+    CRYPT_PLAIN,
+    CRYPT_ENCRYPTED,
+    // Has a header, but its key is not in NVS (removed, or another device)
+    CRYPT_LOCKED
+};
+
+class FileCipher
+{
+private:
+    AesCtr ctr;
+
+public:
+    // Fresh IV for a new file under an encrypted directory; the header has
+    // to be written first. False if `path` is not encrypted.
+    bool create(const String &path, uint8_t *header);
+    CryptState load(const uint8_t *header, size_t len);
+    // Ad-hoc key, for benchmarks
+    void setKey(const uint8_t *key, const uint8_t *iv) { ctr.setKey(key, iv); }
+
+    // `offset` counts content bytes (the header is not included)
+    void apply(uint64_t offset, const uint8_t *in, uint8_t *out, size_t len);
+};
+
+// Reads the header of an open file. Encrypted files are left positioned at
+// the first content byte, all others at 0.
+CryptState cryptProbe(File &file, FileCipher &cipher);
+CryptState cryptProbePath(fs::FS &fs, const String &path, FileCipher &cipher);
+
+// CRC32 of the decrypted content, for upload verification
+bool cryptContentCrc32(fs::FS &fs, const String &path, uint32_t &crc);
+
+// Copy that decrypts the source and/or encrypts the target as needed.
+// `storedBytes` is the size of the new file. Built under a staging name and
+// renamed when complete; with a job, reports progress and can be cancelled.
+bool cryptCopyFile(fs::FS &fs, const String &from, const String &to, size_t &storedBytes,
+                   BackgroundJob *job = nullptr);
+
+// Runs cryptCopyFile() on a background job and announces the new file;
+// false if a copy is already running
+bool startCopyJob(fs::FS &fs, const String &from, const String &to);
+void cancelCopyJob();
+void copyStatusJson(JsonObject obj);
+
+// Times plain and encrypted uploads and downloads of `bytes` bytes at
+// `path` (removed afterwards) the way /upload and /download move them:
+// preallocation, network-sized pieces through the async I/O streams, the
+// cipher applied in place. Checks the content and that the header survives
+// preallocation. Returns the larger overhead in percent.
+float testCrypt(fs::FS &fs, const char *path, size_t bytes, JsonObject result);
+
+void cryptStatusJson(JsonObject obj);
+
+#endif
@@ -0,0 +1,203 @@
+#include "fs_events.h"
+#include <ArduinoJson.h>
+#include <atomic>
+#include <esp_random.h>
+
+static AsyncEventSource g_fsEvents("/events");
+// Published from the web server task, WebDAV, bulk transfer and background
+// jobs alike
+static std::atomic<uint32_t> g_fsEventId(0);
+
+// Recent events, replayed to a client that reconnects with Last-Event-ID
+struct FsEventRecord
+{
+  uint32_t id;
+  const char *event;
+  String message;
+};
+
+static FsEventRecord history[FS_EVENTS_HISTORY];
+static SemaphoreHandle_t historyLock = nullptr;
+
+// Split "/a/b/c" into "/a/b" and "c"; trailing slashes are ignored
+static void splitPath(const String &path, String &dir, String &name)
+{
+  String p = path;
+  while (p.length() > 1 && p.endsWith("/"))
+  {
+    p.remove(p.length() - 1);
+  }
+
+  int slash = p.lastIndexOf('/');
+  if (slash <= 0)
+  {
+    dir = "/";
+    name = p.substring(slash + 1);
+  }
+  else
+  {
+    dir = p.substring(0, slash);
+    name = p.substring(slash + 1);
+  }
+}
+
+static void publish(const char *event, JsonDocument &doc)
+{
+  // Before initFsEvents nobody can be listening or reconnecting
+  if (historyLock == nullptr)
+  {
+    return;
+  }
+
+  // Recorded even while no client is connected: a client that lost its
+  // connection catches up from here
+  String message;
+  serializeJson(doc, message);
+
+  xSemaphoreTake(historyLock, portMAX_DELAY);
+  uint32_t id = ++g_fsEventId;
+  FsEventRecord &record = history[id % FS_EVENTS_HISTORY];
+  record.id = id;
+  record.event = event;
+  record.message = message;
+  xSemaphoreGive(historyLock);
+
+  if (g_fsEvents.count() > 0)
+  {
+    g_fsEvents.send(message.c_str(), event, id);
+  }
+}
+
+// Progress is transient: sent without an id, so it neither advances the
+// client's Last-Event-ID nor takes a slot in the history
+static void publishTransient(const char *event, JsonDocument &doc)
+{
+  if (g_fsEvents.count() == 0)
+  {
+    return;
+  }
+
+  String message;
+  serializeJson(doc, message);
+  g_fsEvents.send(message.c_str(), event, 0);
+}
+
+// Sends the events after lastId if they are all still in the history, then
+// "hello" telling the client whether it is up to date ("resume") or has to
+// reload its list
+static void resumeClient(AsyncEventSourceClient *client)
+{
+  uint32_t lastId = client->lastId();
+  FsEventRecord missed[FS_EVENTS_HISTORY];
+  uint32_t count = 0;
+
+  xSemaphoreTake(historyLock, portMAX_DELAY);
+  uint32_t current = g_fsEventId.load();
+  // Ids start at a random value on every boot, so an id from before a
+  // restart almost never falls into the window
+  uint32_t behind = current - lastId;
+  bool resume = lastId != 0 && behind < FS_EVENTS_HISTORY;
+  if (resume)
+  {
+    for (uint32_t id = lastId + 1; id != current + 1; id++)
+    {
+      missed[count++] = history[id % FS_EVENTS_HISTORY];
+    }
+  }
+  xSemaphoreGive(historyLock);
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    client->send(missed[i].message.c_str(), missed[i].event, missed[i].id);
+  }
+  client->send(resume ? "{\"resume\":true}" : "{\"resume\":false}", "hello", current, 2000);
+}
+
+void initFsEvents(AsyncWebServer &server)
+{
+  g_fsEventId = esp_random() | 1;
+  historyLock = xSemaphoreCreateMutex();
+
+  g_fsEvents.onConnect([](AsyncEventSourceClient *client)
+                       { resumeClient(client); });
+  server.addHandler(&g_fsEvents);
+  Serial.println("File change events available at /events");
+}
+
+size_t fsEventsClientCount()
+{
+  return g_fsEvents.count();
+}
+
+void fsEventAdded(const String &path, size_t size, bool isDirectory)
+{
+  String dir, name;
+  splitPath(path, dir, name);
+
+  DynamicJsonDocument doc(256);
+  doc["dir"] = dir;
+  doc["name"] = name;
+  doc["size"] = size;
+  doc["isDir"] = isDirectory;
+  publish("add", doc);
+}
+
+void fsEventRemoved(const String &path, bool isDirectory)
+{
+  String dir, name;
+  splitPath(path, dir, name);
+
+  DynamicJsonDocument doc(256);
+  doc["dir"] = dir;
+  doc["name"] = name;
+  doc["isDir"] = isDirectory;
+  publish("remove", doc);
+}
+
+void fsEventRenamed(const String &from, const String &to, bool isDirectory)
+{
+  String fromDir, fromName, toDir, toName;
+  splitPath(from, fromDir, fromName);
+  splitPath(to, toDir, toName);
+
+  DynamicJsonDocument doc(384);
+  doc["fromDir"] = fromDir;
+  doc["fromName"] = fromName;
+  doc["dir"] = toDir;
+  doc["name"] = toName;
+  doc["isDir"] = isDirectory;
+  publish("rename", doc);
+}
+
+void fsEventProgress(const String &path, size_t bytes, size_t total, bool final)
+{
+  static String lastPath;
+  static uint32_t lastSent = 0;
+
+  if (historyLock == nullptr)
+  {
+    return;
+  }
+
+  // Throttle per transfer; the first and last update always go out
+  uint32_t now = millis();
+  xSemaphoreTake(historyLock, portMAX_DELAY);
+  bool throttled = !final && path == lastPath && now - lastSent < FS_EVENTS_PROGRESS_INTERVAL_MS;
+  if (!throttled)
+  {
+    lastPath = path;
+    lastSent = now;
+  }
+  xSemaphoreGive(historyLock);
+  if (throttled)
+  {
+    return;
+  }
+
+  DynamicJsonDocument doc(256);
+  doc["path"] = path;
+  doc["bytes"] = bytes;
+  doc["total"] = total;
+  doc["final"] = final;
+  publishTransient("progress", doc);
+}
@@ -0,0 +1,23 @@
+#ifndef __FS_EVENTS_H
+#define __FS_EVENTS_H
+
+#include "Arduino.h"
+#include <ESPAsyncWebServer.h>
+
+// Minimum interval between two progress events of the same transfer
+#define FS_EVENTS_PROGRESS_INTERVAL_MS 250
+// Events kept for clients that reconnect with Last-Event-ID
+#define FS_EVENTS_HISTORY 32
+
+// Push-based change notifications for the web UI (Server-Sent Events on /events).
+// Handlers publish incremental changes so clients can patch their file list
+// instead of reloading the whole directory.
+void initFsEvents(AsyncWebServer &server);
+size_t fsEventsClientCount();
+
+void fsEventAdded(const String &path, size_t size, bool isDirectory);
+void fsEventRemoved(const String &path, bool isDirectory);
+void fsEventRenamed(const String &from, const String &to, bool isDirectory);
+void fsEventProgress(const String &path, size_t bytes, size_t total, bool final);
+
+#endif
@@ -0,0 +1,627 @@
+#include "grep_search.h"
+#include "bg_job.h"
+#include "sd_io_sched.h"
+#include "sd_read_write.h"
+#include "ff.h"
+#include <ESPAsyncWebServer.h>
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <vector>
+
+enum
+{
+  NODE_CHAR,
+  NODE_ANY,
+  NODE_SET
+};
+
+enum
+{
+  QUANT_ONE,
+  QUANT_STAR,
+  QUANT_PLUS,
+  QUANT_QUEST
+};
+
+static BackgroundJob grepJob("grep");
+
+static struct
+{
+  uint32_t files;
+  uint64_t bytes;
+  uint32_t matches;
+  uint32_t elapsedMs;
+} grepStats;
+
+static void setBit(uint8_t *set, uint8_t c)
+{
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+static void setRange(uint8_t *set, uint8_t from, uint8_t to)
+{
+  for (int c = from; c <= to; c++)
+  {
+    setBit(set, c);
+  }
+}
+
+// \d \w \s; false for any other letter
+static bool setClass(uint8_t *set, char name)
+{
+  switch (name)
+  {
+  case 'd':
+    setRange(set, '0', '9');
+    return true;
+  case 'w':
+    setRange(set, '0', '9');
+    setRange(set, 'a', 'z');
+    setRange(set, 'A', 'Z');
+    setBit(set, '_');
+    return true;
+  case 's':
+    setBit(set, ' ');
+    setRange(set, '\t', '\r');
+    return true;
+  }
+  return false;
+}
+
+bool GrepPattern::compile(const String &pattern, bool regex, bool icase, String &error)
+{
+  const uint8_t *p = (const uint8_t *)pattern.c_str();
+  size_t len = pattern.length();
+  nodeCount = 0;
+  anchoredStart = false;
+  anchoredEnd = false;
+  isRegex = regex;
+  this->icase = icase;
+  literalLen = 0;
+
+  if (len == 0 || len > GREP_MAX_PATTERN)
+  {
+    error = "Pattern must be 1 to " + String(GREP_MAX_PATTERN) + " bytes";
+    return false;
+  }
+
+  size_t i = 0;
+  if (regex && p[0] == '^')
+  {
+    anchoredStart = true;
+    i++;
+  }
+  while (i < len)
+  {
+    uint8_t c = p[i++];
+    if (regex && c == '$' && i == len)
+    {
+      anchoredEnd = true;
+      break;
+    }
+
+    Node &n = nodes[nodeCount++];
+    memset(&n, 0, sizeof(n));
+    n.type = NODE_CHAR;
+    n.ch = icase ? tolower(c) : c;
+    if (!regex)
+    {
+      continue;
+    }
+
+    if (c == '.')
+    {
+      n.type = NODE_ANY;
+    }
+    else if (c == '\\')
+    {
+      if (i == len)
+      {
+        error = "Trailing backslash";
+        return false;
+      }
+      c = p[i++];
+      if (setClass(n.set, c))
+      {
+        n.type = NODE_SET;
+      }
+      else
+      {
+        n.ch = icase ? tolower(c) : c;
+      }
+    }
+    else if (c == '[')
+    {
+      n.type = NODE_SET;
+      bool negate = i < len && p[i] == '^';
+      if (negate)
+        i++;
+      bool closed = false;
+      bool first = true;
+      while (i < len)
+      {
+        uint8_t from = p[i++];
+        if (from == ']' && !first)
+        {
+          closed = true;
+          break;
+        }
+        first = false;
+        if (from == '\\' && i < len)
+        {
+          from = p[i++];
+          if (setClass(n.set, from))
+            continue;
+        }
+        if (i + 1 < len && p[i] == '-' && p[i + 1] != ']')
+        {
+          setRange(n.set, from, p[i + 1]);
+          i += 2;
+        }
+        else
+        {
+          setBit(n.set, from);
+        }
+      }
+      if (!closed)
+      {
+        error = "Unterminated [";
+        return false;
+      }
+      if (icase)
+      {
+        for (int ch = 'a'; ch <= 'z'; ch++)
+        {
+          bool either = (n.set[ch >> 3] >> (ch & 7)) & 1 || (n.set[toupper(ch) >> 3] >> (toupper(ch) & 7)) & 1;
+          if (either)
+          {
+            setBit(n.set, ch);
+            setBit(n.set, toupper(ch));
+          }
+        }
+      }
+      if (negate)
+      {
+        for (int b = 0; b < 32; b++)
+          n.set[b] = ~n.set[b];
+      }
+    }
+    else if (c == '*' || c == '+' || c == '?')
+    {
+      error = "Nothing to repeat";
+      return false;
+    }
+
+    if (i < len && (p[i] == '*' || p[i] == '+' || p[i] == '?'))
+    {
+      n.quant = p[i] == '*' ? QUANT_STAR : p[i] == '+' ? QUANT_PLUS : QUANT_QUEST;
+      i++;
+    }
+  }
+
+  // Longest run of characters every match must contain
+  size_t runStart = 0, runLen = 0, bestStart = 0;
+  for (int k = 0; k <= nodeCount; k++)
+  {
+    bool inRun = k < nodeCount && nodes[k].type == NODE_CHAR &&
+                 (nodes[k].quant == QUANT_ONE || nodes[k].quant == QUANT_PLUS);
+    if (inRun)
+    {
+      if (runLen == 0)
+        runStart = k;
+      runLen++;
+    }
+    if (runLen > literalLen)
+    {
+      literalLen = runLen;
+      bestStart = runStart;
+    }
+    // A repeated character is required once, but ends the run
+    if (!inRun || nodes[k].quant == QUANT_PLUS)
+    {
+      runLen = 0;
+    }
+  }
+  for (size_t k = 0; k < literalLen; k++)
+  {
+    literal[k] = nodes[bestStart + k].ch;
+  }
+
+  // Horspool shift table, for both cases when folding
+  memset(shift, literalLen, sizeof(shift));
+  for (size_t k = 0; k + 1 < literalLen; k++)
+  {
+    shift[literal[k]] = literalLen - 1 - k;
+    if (icase)
+    {
+      shift[toupper(literal[k])] = literalLen - 1 - k;
+    }
+  }
+  return true;
+}
+
+const uint8_t *GrepPattern::find(const uint8_t *text, const uint8_t *end) const
+{
+  if (literalLen == 0)
+  {
+    return text < end ? text : nullptr;
+  }
+  if (literalLen == 1 && !icase)
+  {
+    return (const uint8_t *)memchr(text, literal[0], end - text);
+  }
+
+  size_t last = literalLen - 1;
+  while (end - text >= (ptrdiff_t)literalLen)
+  {
+    uint8_t c = text[last];
+    if ((icase ? tolower(c) : c) == literal[last])
+    {
+      size_t k = 0;
+      while (k < last && (icase ? tolower(text[k]) : text[k]) == literal[k])
+        k++;
+      if (k == last)
+        return text;
+    }
+    text += shift[c];
+  }
+  return nullptr;
+}
+
+bool GrepPattern::nodeMatches(const Node &node, uint8_t c) const
+{
+  switch (node.type)
+  {
+  case NODE_ANY:
+    return true;
+  case NODE_SET:
+    return (node.set[c >> 3] >> (c & 7)) & 1;
+  default:
+    return (icase ? tolower(c) : c) == node.ch;
+  }
+}
+
+bool GrepPattern::matchHere(int node, const uint8_t *text, const uint8_t *end) const
+{
+  if (node == nodeCount)
+  {
+    return !anchoredEnd || text == end;
+  }
+
+  const Node &n = nodes[node];
+  switch (n.quant)
+  {
+  case QUANT_ONE:
+    return text < end && nodeMatches(n, *text) && matchHere(node + 1, text + 1, end);
+  case QUANT_QUEST:
+    if (text < end && nodeMatches(n, *text) && matchHere(node + 1, text + 1, end))
+      return true;
+    return matchHere(node + 1, text, end);
+  default:
+  {
+    // Greedy: take as many as possible, then give back one at a time
+    size_t count = 0;
+    while (text + count < end && nodeMatches(n, text[count]))
+      count++;
+    size_t least = n.quant == QUANT_PLUS ? 1 : 0;
+    for (size_t k = count + 1; k-- > least;)
+    {
+      if (matchHere(node + 1, text + k, end))
+        return true;
+    }
+    return false;
+  }
+  }
+}
+
+bool GrepPattern::matchLine(const uint8_t *line, const uint8_t *end) const
+{
+  if (!isRegex)
+  {
+    return find(line, end) != nullptr;
+  }
+  if (anchoredStart)
+  {
+    return matchHere(0, line, end);
+  }
+  for (const uint8_t *s = line; s <= end; s++)
+  {
+    if (matchHere(0, s, end))
+      return true;
+  }
+  return false;
+}
+
+// ---- Output ----------------------------------------------------------------
+
+GrepOutput::GrepOutput() : lock(xSemaphoreCreateMutex()), finished(false), cancelled(false)
+{
+}
+
+GrepOutput::~GrepOutput()
+{
+  vSemaphoreDelete((SemaphoreHandle_t)lock);
+}
+
+size_t GrepOutput::drain(uint8_t *buffer, size_t maxLen)
+{
+  xSemaphoreTake((SemaphoreHandle_t)lock, portMAX_DELAY);
+  size_t n = min(maxLen, (size_t)pending.length());
+  if (n == 0)
+  {
+    xSemaphoreGive((SemaphoreHandle_t)lock);
+    return finished ? 0 : RESPONSE_TRY_AGAIN;
+  }
+  memcpy(buffer, pending.c_str(), n);
+  pending.remove(0, n);
+  xSemaphoreGive((SemaphoreHandle_t)lock);
+  return n;
+}
+
+static bool stopRequested(BackgroundJob &job, GrepOutput &out)
+{
+  return job.cancelled() || out.cancelled;
+}
+
+// Queue one line of output, waiting while the client is behind
+static bool emit(BackgroundJob &job, GrepOutput &out, JsonDocument &doc)
+{
+  String line;
+  serializeJson(doc, line);
+  line += '\n';
+  while (!stopRequested(job, out))
+  {
+    xSemaphoreTake((SemaphoreHandle_t)out.lock, portMAX_DELAY);
+    if (out.pending.length() < GREP_OUTPUT_LIMIT)
+    {
+      out.pending += line;
+      xSemaphoreGive((SemaphoreHandle_t)out.lock);
+      return true;
+    }
+    xSemaphoreGive((SemaphoreHandle_t)out.lock);
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  return false;
+}
+
+// ---- Scan ------------------------------------------------------------------
+
+struct GrepRun
+{
+  std::shared_ptr<GrepPattern> pattern;
+  std::shared_ptr<GrepOutput> output;
+  uint32_t maxMatches;
+  uint8_t *buffer;
+  size_t bufferSize;
+};
+
+static bool reportMatch(BackgroundJob &job, GrepRun &run, const String &path, uint32_t offset,
+                        const uint8_t *line, size_t len, bool binary)
+{
+  DynamicJsonDocument doc(GREP_MAX_LINE * 6 + 512);
+  doc["path"] = path;
+  doc["offset"] = offset;
+  if (binary)
+  {
+    doc["binary"] = true;
+  }
+  else
+  {
+    char text[GREP_MAX_LINE + 1];
+    len = min(len, (size_t)GREP_MAX_LINE);
+    memcpy(text, line, len);
+    text[len] = '\0';
+    doc["text"] = (const char *)text;
+  }
+  grepStats.matches++;
+  return emit(job, *run.output, doc);
+}
+
+// Scan one file line by line; false when the search has to stop
+static bool scanFile(BackgroundJob &job, GrepRun &run, const String &path)
+{
+  FIL file;
+  if (f_open(&file, sdFatPath(path).c_str(), FA_READ) != FR_OK)
+  {
+    return true;
+  }
+
+  const GrepPattern &pattern = *run.pattern;
+  uint8_t *buf = run.buffer;
+  size_t carry = 0;      // incomplete last line kept from the previous read
+  uint32_t bufStart = 0; // file offset of buf[0]
+  bool binary = false;
+  bool first = true;
+  bool keepGoing = true;
+
+  while (keepGoing && !stopRequested(job, *run.output))
+  {
+    // Fill the buffer in bounded reads so foreground requests get the card in between
+    UINT got = 0;
+    FRESULT res = FR_OK;
+    while (carry + got < run.bufferSize)
+    {
+      UINT want = min(run.bufferSize - carry - got, (size_t)SD_IO_MAX_CHUNK);
+      UINT n = 0;
+      {
+        SdIoScope io(SD_IO_BACKGROUND);
+        res = f_read(&file, buf + carry + got, want, &n);
+      }
+      got += n;
+      if (res != FR_OK || n < want)
+      {
+        break;
+      }
+    }
+    if (res != FR_OK)
+    {
+      break;
+    }
+    grepStats.bytes += got;
+    size_t filled = carry + got;
+    bool eof = got < run.bufferSize - carry;
+    if (filled == 0)
+    {
+      break;
+    }
+    if (first)
+    {
+      binary = memchr(buf, 0, min(filled, (size_t)512)) != nullptr;
+      first = false;
+    }
+
+    // Only complete lines are searched; a line longer than the buffer is
+    // searched in buffer-sized pieces
+    size_t complete = filled;
+    if (!eof)
+    {
+      while (complete > 0 && buf[complete - 1] != '\n')
+        complete--;
+      if (complete == 0)
+        complete = filled;
+    }
+
+    const uint8_t *end = buf + complete;
+    const uint8_t *pos = buf;
+    while (pos < end)
+    {
+      const uint8_t *hit = pattern.find(pos, end);
+      if (hit == nullptr)
+      {
+        break;
+      }
+      const uint8_t *lineStart = hit;
+      while (lineStart > pos && lineStart[-1] != '\n')
+        lineStart--;
+      const uint8_t *lineEnd = (const uint8_t *)memchr(hit, '\n', end - hit);
+      if (lineEnd == nullptr)
+        lineEnd = end;
+      const uint8_t *textEnd = lineEnd;
+      if (textEnd > lineStart && textEnd[-1] == '\r')
+        textEnd--;
+
+      if (pattern.literalOnly() || pattern.matchLine(lineStart, textEnd))
+      {
+        keepGoing = reportMatch(job, run, path, bufStart + (lineStart - buf), lineStart, textEnd - lineStart, binary) &&
+                    !binary && grepStats.matches < run.maxMatches;
+        if (!keepGoing)
+        {
+          break;
+        }
+      }
+      pos = lineEnd + 1;
+    }
+
+    if (eof)
+    {
+      break;
+    }
+    carry = filled - complete;
+    memmove(buf, buf + complete, carry);
+    bufStart += complete;
+  }
+  f_close(&file);
+  return !stopRequested(job, *run.output) && grepStats.matches < run.maxMatches;
+}
+
+static bool runGrep(BackgroundJob &job, const String &dir, GrepRun &run)
+{
+  uint32_t start = millis();
+  std::vector<String> pending;
+  pending.push_back(dir);
+  FILINFO info;
+  DIR d;
+  bool more = true;
+
+  while (more && !pending.empty())
+  {
+    String current = pending.back();
+    pending.pop_back();
+    if (f_opendir(&d, sdFatPath(current).c_str()) != FR_OK)
+    {
+      continue;
+    }
+    while (more && f_readdir(&d, &info) == FR_OK && info.fname[0])
+    {
+      String path = current == "/" ? "/" + String(info.fname) : current + "/" + info.fname;
+      if (info.fattrib & AM_DIR)
+      {
+        pending.push_back(path);
+        continue;
+      }
+      grepStats.files++;
+      job.setProgress(grepStats.files, 0);
+      more = scanFile(job, run, path);
+    }
+    f_closedir(&d);
+  }
+
+  grepStats.elapsedMs = millis() - start;
+  DynamicJsonDocument doc(256);
+  doc["done"] = true;
+  doc["files"] = grepStats.files;
+  doc["bytes"] = grepStats.bytes;
+  doc["matches"] = grepStats.matches;
+  doc["ms"] = grepStats.elapsedMs;
+  doc["truncated"] = grepStats.matches >= run.maxMatches;
+  bool stopped = stopRequested(job, *run.output);
+  if (!stopped)
+  {
+    emit(job, *run.output, doc);
+  }
+  Serial.printf("grep %s: %u files, %llu bytes, %u matches in %u ms\n", dir.c_str(), grepStats.files,
+                grepStats.bytes, grepStats.matches, grepStats.elapsedMs);
+  return !stopped;
+}
+
+bool startGrep(const String &dir, std::shared_ptr<GrepPattern> pattern, uint32_t maxMatches,
+               std::shared_ptr<GrepOutput> output)
+{
+  if (grepJob.running())
+  {
+    return false;
+  }
+  memset(&grepStats, 0, sizeof(grepStats));
+
+  return grepJob.start([dir, pattern, maxMatches, output](BackgroundJob &job) {
+    GrepRun run;
+    run.pattern = pattern;
+    run.output = output;
+    run.maxMatches = max(maxMatches, (uint32_t)1);
+    run.bufferSize = GREP_BUFFER_SIZE;
+    run.buffer = (uint8_t *)heap_caps_malloc(run.bufferSize, MALLOC_CAP_SPIRAM);
+    if (run.buffer == nullptr)
+    {
+      run.bufferSize = 32 * 1024;
+      run.buffer = (uint8_t *)malloc(run.bufferSize);
+    }
+
+    bool ok = false;
+    if (run.buffer != nullptr)
+    {
+      ok = runGrep(job, dir, run);
+      free(run.buffer);
+    }
+    else
+    {
+      job.setMessage("out of memory");
+    }
+    output->finished = true;
+    return ok;
+  });
+}
+
+void cancelGrep()
+{
+  grepJob.cancel();
+}
+
+void grepStatusJson(JsonObject obj)
+{
+  grepJob.statusJson(obj["job"].to<JsonObject>());
+  obj["files"] = grepStats.files;
+  obj["bytes"] = grepStats.bytes;
+  obj["matches"] = grepStats.matches;
+}
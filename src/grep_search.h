@@ -0,0 +1,86 @@
+#ifndef __GREP_SEARCH_H
+#define __GREP_SEARCH_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <memory>
+
+// Read size of the scan; large reads keep the card at full speed
+#define GREP_BUFFER_SIZE (256 * 1024)
+// Matched lines are cut to this many bytes in the output
+#define GREP_MAX_LINE 200
+#define GREP_DEFAULT_MATCHES 1000
+// Results not yet sent to the client; the scan waits when it is full
+#define GREP_OUTPUT_LIMIT (16 * 1024)
+#define GREP_MAX_PATTERN 128
+
+// A search pattern: a literal string or a small regex subset
+//   .  [abc]  [a-z]  [^...]  \d \w \s  \. (escaped literal)
+//   * + ?  (greedy, on the preceding element)   ^ $  (line anchors)
+// Lines are tested with a Horspool search for the longest literal run the
+// pattern requires, so only candidate lines reach the regex matcher.
+class GrepPattern
+{
+private:
+    struct Node
+    {
+        uint8_t type;
+        uint8_t quant;
+        uint8_t ch;
+        uint8_t set[32];
+    };
+
+    Node nodes[GREP_MAX_PATTERN];
+    int nodeCount;
+    bool anchoredStart;
+    bool anchoredEnd;
+    bool isRegex;
+    bool icase;
+
+    // Required literal and its Horspool shift table
+    uint8_t literal[GREP_MAX_PATTERN];
+    size_t literalLen;
+    uint8_t shift[256];
+
+    bool nodeMatches(const Node &node, uint8_t c) const;
+    bool matchHere(int node, const uint8_t *text, const uint8_t *end) const;
+
+public:
+    // Returns false with `error` set if the pattern is not supported
+    bool compile(const String &pattern, bool regex, bool icase, String &error);
+
+    // First candidate position of the required literal in [text, end)
+    const uint8_t *find(const uint8_t *text, const uint8_t *end) const;
+
+    // Full test of one line (without its newline)
+    bool matchLine(const uint8_t *line, const uint8_t *end) const;
+
+    // True if find() alone decides a match
+    bool literalOnly() const { return !isRegex; }
+};
+
+// Output of a running search, drained by the chunked /grep response as
+// newline-delimited JSON: one {"path","offset","text"} object per matching
+// line, then a summary object.
+struct GrepOutput
+{
+    void *lock;
+    String pending;
+    volatile bool finished;
+    volatile bool cancelled; // the client went away
+
+    GrepOutput();
+    ~GrepOutput();
+
+    // Move up to maxLen bytes into buffer; RESPONSE_TRY_AGAIN if nothing is
+    // ready yet, 0 at the end
+    size_t drain(uint8_t *buffer, size_t maxLen);
+};
+
+// Start scanning every file below `dir`; false if a search is running
+bool startGrep(const String &dir, std::shared_ptr<GrepPattern> pattern, uint32_t maxMatches,
+               std::shared_ptr<GrepOutput> output);
+void cancelGrep();
+void grepStatusJson(JsonObject obj);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __HASH_KERNELS_H
+#define __HASH_KERNELS_H
+
+// Portable C++ only: the hash kernels behind checksum.* build on the host
+// too (tools/hash_test.cpp checks them against known-answer vectors).
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(ESP_PLATFORM)
+#include "mbedtls/sha256.h"
+#endif
+
+#define HASH_MAX_DIGEST 32
+
+enum HashAlgo
+{
+    HASH_CRC32 = 0,
+    HASH_SHA256 = 1
+};
+
+// Incremental CRC32 (IEEE, same as zlib) or SHA-256. On the ESP32 the ROM
+// CRC routine and mbedTLS (which drives the SHA accelerator) are used; other
+// builds fall back to the portable software kernels in hash_kernels.cpp.
+class Hasher
+{
+private:
+    HashAlgo algo;
+    uint32_t crc;
+#if defined(ESP_PLATFORM)
+    mbedtls_sha256_context sha;
+#else
+    struct
+    {
+        uint32_t state[8];
+        uint64_t length;
+        uint8_t block[64];
+        size_t used;
+    } sha;
+#endif
+
+public:
+    Hasher(HashAlgo algo = HASH_CRC32);
+    ~Hasher();
+
+    Hasher(const Hasher &) = delete;
+    Hasher &operator=(const Hasher &) = delete;
+
+    void reset();
+    void update(const uint8_t *data, size_t len);
+
+    // Writes hashDigestSize() bytes and returns that size
+    size_t finish(uint8_t *digest);
+
+    HashAlgo getAlgo() const { return algo; }
+
+    // CRC32 of the data so far (HASH_CRC32 only)
+    uint32_t crc32() const { return crc; }
+};
+
+size_t hashDigestSize(HashAlgo algo);
+
+#endif
@@ -0,0 +1,1276 @@
+#include "jpeg_codec.h"
+#include <math.h>
+#include <memory>
+#include <string.h>
+
+static const uint8_t zigzag[64] = {0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+                                   12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+                                   35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+                                   58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+static inline uint8_t clamp8(int v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+// ---- Reduced IDCT ------------------------------------------------------------
+
+// Fixed-point bits of the cosine tables
+#define IDCT_BITS 11
+
+// idctTable[s][x * 8 + u] = C(u) cos((2x + 1) u pi / 2N) for N = 8 >> s,
+// with C(0) = 1 / sqrt(2). An N-point IDCT of the N lowest frequencies
+// gives the block averaged down by 8 / N.
+static int32_t idctTable[JPEG_MAX_SCALE_LOG2 + 1][64];
+
+static bool buildIdctTables()
+{
+  for (int s = 0; s <= JPEG_MAX_SCALE_LOG2; s++)
+  {
+    int n = 8 >> s;
+    for (int x = 0; x < n; x++)
+    {
+      for (int u = 0; u < n; u++)
+      {
+        double c = (u == 0 ? 1 / sqrt(2.0) : 1.0) * cos((2 * x + 1) * u * M_PI / (2 * n));
+        idctTable[s][x * 8 + u] = (int32_t)lround(c * (1 << IDCT_BITS));
+      }
+    }
+  }
+  return true;
+}
+
+static void idctBlock(const int32_t *coef, int scaleLog2, uint8_t *out, size_t stride)
+{
+  int n = 8 >> scaleLog2;
+  if (n == 1)
+  {
+    out[0] = clamp8(((coef[0] + 4) >> 3) + 128);
+    return;
+  }
+  const int32_t *t = idctTable[scaleLog2];
+  int32_t tmp[8][8];
+  for (int v = 0; v < n; v++)
+  {
+    const int32_t *row = coef + v * 8;
+    for (int x = 0; x < n; x++)
+    {
+      int32_t sum = 0;
+      for (int u = 0; u < n; u++)
+      {
+        sum += t[x * 8 + u] * row[u];
+      }
+      tmp[v][x] = (sum + (1 << (IDCT_BITS - 1))) >> IDCT_BITS;
+    }
+  }
+  for (int y = 0; y < n; y++)
+  {
+    for (int x = 0; x < n; x++)
+    {
+      int32_t sum = 0;
+      for (int v = 0; v < n; v++)
+      {
+        sum += t[y * 8 + v] * tmp[v][x];
+      }
+      // 1/4 of the 2-D IDCT plus the level shift
+      out[y * stride + x] = clamp8(((sum + (1 << (IDCT_BITS + 1))) >> (IDCT_BITS + 2)) + 128);
+    }
+  }
+}
+
+// ---- Input -----------------------------------------------------------------
+
+JpegDecoder::JpegDecoder()
+    : inPos(0), inLen(0), eof(false), consumed(0), restartInterval(0), hMax(1), vMax(1), bits(0), bitCount(0),
+      marker(-1), lastError("")
+{
+  static bool tablesReady = buildIdctTables();
+  (void)tablesReady;
+  frame.width = 0;
+  frame.height = 0;
+  frame.components = 0;
+  frame.orientation = 1;
+}
+
+bool JpegDecoder::fail(const char *message)
+{
+  lastError = message;
+  return false;
+}
+
+int JpegDecoder::readByte()
+{
+  if (inPos == inLen)
+  {
+    if (eof)
+    {
+      return -1;
+    }
+    inLen = read(input.data(), input.size());
+    inPos = 0;
+    consumed += inLen;
+    if (inLen == 0)
+    {
+      eof = true;
+      return -1;
+    }
+  }
+  return input[inPos++];
+}
+
+bool JpegDecoder::readBytes(uint8_t *out, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    int c = readByte();
+    if (c < 0)
+    {
+      return false;
+    }
+    out[i] = (uint8_t)c;
+  }
+  return true;
+}
+
+bool JpegDecoder::skipBytes(size_t len)
+{
+  while (len > 0)
+  {
+    if (inPos == inLen && readByte() >= 0)
+    {
+      inPos--; // refilled; the byte is skipped below
+    }
+    if (inPos == inLen)
+    {
+      return false;
+    }
+    size_t n = inLen - inPos < len ? inLen - inPos : len;
+    inPos += n;
+    len -= n;
+  }
+  return true;
+}
+
+int JpegDecoder::readWord()
+{
+  int hi = readByte();
+  int lo = readByte();
+  return hi < 0 || lo < 0 ? -1 : (hi << 8) | lo;
+}
+
+// ---- Headers ---------------------------------------------------------------
+
+bool JpegDecoder::begin(const JpegReader &reader)
+{
+  read = reader;
+  input.resize(JPEG_INPUT_CHUNK);
+  inPos = 0;
+  inLen = 0;
+  eof = false;
+  consumed = 0;
+  frame.width = 0;
+  frame.height = 0;
+  frame.components = 0;
+  frame.orientation = 1;
+  frame.exifThumbnail.clear();
+  restartInterval = 0;
+  marker = -1;
+  for (int i = 0; i < 4; i++)
+  {
+    dc[i].present = false;
+    ac[i].present = false;
+  }
+
+  if (readByte() != 0xFF || readByte() != 0xD8)
+  {
+    return fail("Not a JPEG file");
+  }
+  for (;;)
+  {
+    int c = readByte();
+    if (c < 0)
+    {
+      return fail("Truncated header");
+    }
+    if (c != 0xFF)
+    {
+      continue; // junk between segments
+    }
+    do
+    {
+      c = readByte();
+    } while (c == 0xFF);
+    if (c < 0)
+    {
+      return fail("Truncated header");
+    }
+    if (c == 0x01 || c == 0xD8 || (c >= 0xD0 && c <= 0xD7))
+    {
+      continue; // markers without a length
+    }
+    if (c == 0xD9)
+    {
+      return fail("No image data");
+    }
+    int len = readWord();
+    if (len < 2)
+    {
+      return fail("Truncated header");
+    }
+    len -= 2;
+
+    bool ok;
+    switch (c)
+    {
+    case 0xDB:
+      ok = parseQuant(len);
+      break;
+    case 0xC4:
+      ok = parseHuffman(len);
+      break;
+    case 0xC0:
+    case 0xC1:
+      ok = parseFrame(len);
+      break;
+    case 0xDD:
+      restartInterval = readWord();
+      ok = len == 2 && restartInterval >= 0;
+      if (!ok)
+      {
+        fail("Corrupt restart interval");
+      }
+      break;
+    case 0xE1:
+      ok = parseExif(len);
+      break;
+    case 0xDA:
+      if (frame.components == 0)
+      {
+        return fail("Scan before frame header");
+      }
+      return parseScan(len);
+    default:
+      if (c >= 0xC2 && c <= 0xCF && c != 0xC4 && c != 0xC8 && c != 0xCC)
+      {
+        return fail("Progressive, lossless and arithmetic-coded JPEGs are not supported");
+      }
+      ok = skipBytes(len);
+      if (!ok)
+      {
+        fail("Truncated header");
+      }
+    }
+    if (!ok)
+    {
+      return false;
+    }
+  }
+}
+
+bool JpegDecoder::parseQuant(int len)
+{
+  while (len > 0)
+  {
+    int pt = readByte();
+    if (pt < 0 || (pt & 15) > 3)
+    {
+      return fail("Corrupt quantization table");
+    }
+    bool wide = (pt >> 4) != 0;
+    uint16_t *table = quant[pt & 15];
+    for (int k = 0; k < 64; k++)
+    {
+      int v = wide ? readWord() : readByte();
+      if (v < 0)
+      {
+        return fail("Corrupt quantization table");
+      }
+      table[k] = (uint16_t)v;
+    }
+    len -= 1 + (wide ? 128 : 64);
+  }
+  return len == 0 || fail("Corrupt quantization table");
+}
+
+void JpegDecoder::buildHuffman(Huffman &h, const uint8_t *counts, const uint8_t *symbols, int total)
+{
+  memset(h.fast, 0, sizeof(h.fast));
+  int32_t code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++)
+  {
+    h.valueOffset[len] = k - code;
+    for (int i = 0; i < counts[len - 1]; i++)
+    {
+      if (len <= 9)
+      {
+        int shift = 9 - len;
+        for (int fill = 0; fill < (1 << shift); fill++)
+        {
+          h.fast[(code << shift) | fill] = (uint16_t)((len << 8) | symbols[k]);
+        }
+      }
+      code++;
+      k++;
+    }
+    h.maxCode[len] = counts[len - 1] ? code - 1 : -1;
+    code <<= 1;
+  }
+  h.maxCode[17] = INT32_MAX;
+  memcpy(h.values, symbols, total);
+  h.present = true;
+}
+
+bool JpegDecoder::parseHuffman(int len)
+{
+  while (len > 0)
+  {
+    int tc = readByte();
+    uint8_t counts[16];
+    uint8_t symbols[256];
+    if (tc < 0 || (tc >> 4) > 1 || (tc & 15) > 3 || !readBytes(counts, 16))
+    {
+      return fail("Corrupt Huffman table");
+    }
+    // Codes must fit their lengths, or the fast table would overflow
+    int total = 0;
+    int32_t code = 0;
+    for (int i = 0; i < 16; i++)
+    {
+      total += counts[i];
+      code = (code + counts[i]) << 1;
+      if (code > (2 << (i + 1)))
+      {
+        return fail("Corrupt Huffman table");
+      }
+    }
+    if (total > 256 || !readBytes(symbols, total))
+    {
+      return fail("Corrupt Huffman table");
+    }
+    buildHuffman((tc >> 4) ? ac[tc & 15] : dc[tc & 15], counts, symbols, total);
+    len -= 17 + total;
+  }
+  return len == 0 || fail("Corrupt Huffman table");
+}
+
+bool JpegDecoder::parseFrame(int len)
+{
+  int precision = readByte();
+  int height = readWord();
+  int width = readWord();
+  int count = readByte();
+  if (precision != 8)
+  {
+    return fail("Only 8-bit JPEGs are supported");
+  }
+  if (count != 1 && count != 3)
+  {
+    return fail("Only grayscale and YCbCr JPEGs are supported");
+  }
+  if (width <= 0 || height <= 0 || len != 6 + 3 * count)
+  {
+    return fail("Corrupt frame header");
+  }
+  hMax = 1;
+  vMax = 1;
+  for (int i = 0; i < count; i++)
+  {
+    Component &c = comps[i];
+    int id = readByte();
+    int hv = readByte();
+    int tq = readByte();
+    if (tq < 0 || tq > 3 || (hv >> 4) < 1 || (hv >> 4) > 4 || (hv & 15) < 1 || (hv & 15) > 4)
+    {
+      return fail("Corrupt frame header");
+    }
+    c.id = (uint8_t)id;
+    c.h = count == 1 ? 1 : (uint8_t)(hv >> 4);
+    c.v = count == 1 ? 1 : (uint8_t)(hv & 15);
+    c.quant = (uint8_t)tq;
+    hMax = c.h > hMax ? c.h : hMax;
+    vMax = c.v > vMax ? c.v : vMax;
+  }
+  frame.width = width;
+  frame.height = height;
+  frame.components = count;
+  return true;
+}
+
+bool JpegDecoder::parseScan(int len)
+{
+  int count = readByte();
+  if (count != frame.components || len != 4 + 2 * count)
+  {
+    return fail("Non-interleaved scans are not supported");
+  }
+  for (int i = 0; i < count; i++)
+  {
+    int id = readByte();
+    int tables = readByte();
+    Component *c = nullptr;
+    for (int k = 0; k < frame.components; k++)
+    {
+      if (comps[k].id == id)
+      {
+        c = &comps[k];
+      }
+    }
+    if (c == nullptr || tables < 0 || (tables >> 4) > 3 || (tables & 15) > 3 || !dc[tables >> 4].present ||
+        !ac[tables & 15].present)
+    {
+      return fail("Corrupt scan header");
+    }
+    c->dcTable = (uint8_t)(tables >> 4);
+    c->acTable = (uint8_t)(tables & 15);
+  }
+  skipBytes(3); // spectral selection and approximation: fixed for baseline
+  bits = 0;
+  bitCount = 0;
+  marker = -1;
+  return true;
+}
+
+bool JpegDecoder::parseExif(int len)
+{
+  if (len < 14 || !frame.exifThumbnail.empty() || frame.components > 0)
+  {
+    return skipBytes(len) || fail("Truncated header");
+  }
+  std::vector<uint8_t> segment(len);
+  if (!readBytes(segment.data(), len))
+  {
+    return fail("Truncated header");
+  }
+  if (memcmp(segment.data(), "Exif\0\0", 6) != 0)
+  {
+    return true;
+  }
+
+  // TIFF structure: IFD0 holds the orientation, IFD1 the thumbnail
+  const uint8_t *tiff = segment.data() + 6;
+  size_t n = len - 6;
+  bool little = tiff[0] == 'I';
+  auto u16 = [&](size_t o) -> uint32_t {
+    if (o > n || n - o < 2)
+    {
+      return 0;
+    }
+    return little ? tiff[o] | (tiff[o + 1] << 8) : (tiff[o] << 8) | tiff[o + 1];
+  };
+  auto u32 = [&](size_t o) -> uint32_t {
+    if (o > n || n - o < 4)
+    {
+      return 0;
+    }
+    return little ? u16(o) | (u16(o + 2) << 16) : (u16(o) << 16) | u16(o + 2);
+  };
+
+  uint32_t ifd0 = u32(4);
+  uint32_t entries = u16(ifd0);
+  for (uint32_t i = 0; i < entries; i++)
+  {
+    size_t e = ifd0 + 2 + 12 * i;
+    if (u16(e) == 0x0112)
+    {
+      uint32_t o = u16(e + 8);
+      frame.orientation = o >= 1 && o <= 8 ? o : 1;
+    }
+  }
+  uint32_t ifd1 = u32(ifd0 + 2 + 12 * entries);
+  uint32_t offset = 0;
+  uint32_t length = 0;
+  entries = ifd1 ? u16(ifd1) : 0;
+  for (uint32_t i = 0; i < entries; i++)
+  {
+    size_t e = ifd1 + 2 + 12 * i;
+    if (u16(e) == 0x0201)
+    {
+      offset = u32(e + 8);
+    }
+    else if (u16(e) == 0x0202)
+    {
+      length = u32(e + 8);
+    }
+  }
+  if (offset > 0 && length > 0 && offset <= n && length <= n - offset)
+  {
+    frame.exifThumbnail.assign(tiff + offset, tiff + offset + length);
+  }
+  return true;
+}
+
+// ---- Entropy decoding ------------------------------------------------------
+
+void JpegDecoder::fillBits()
+{
+  while (bitCount <= 24)
+  {
+    int b = 0;
+    // After a marker the rest of the segment reads as zeros
+    if (marker < 0)
+    {
+      b = readByte();
+      if (b == 0xFF)
+      {
+        int next;
+        do
+        {
+          next = readByte();
+        } while (next == 0xFF);
+        if (next != 0)
+        {
+          marker = next < 0 ? 0xD9 : next;
+          b = 0;
+        }
+      }
+      else if (b < 0)
+      {
+        marker = 0xD9;
+        b = 0;
+      }
+    }
+    bits |= (uint32_t)b << (24 - bitCount);
+    bitCount += 8;
+  }
+}
+
+int JpegDecoder::decodeHuffman(const Huffman &h)
+{
+  if (bitCount < 16)
+  {
+    fillBits();
+  }
+  uint16_t fast = h.fast[bits >> (32 - 9)];
+  if (fast)
+  {
+    int len = fast >> 8;
+    bits <<= len;
+    bitCount -= len;
+    return fast & 0xFF;
+  }
+  for (int len = 10; len <= 16; len++)
+  {
+    int32_t code = bits >> (32 - len);
+    if (code <= h.maxCode[len])
+    {
+      bits <<= len;
+      bitCount -= len;
+      return h.values[code + h.valueOffset[len]];
+    }
+  }
+  return -1;
+}
+
+int JpegDecoder::receiveExtend(int size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  if (bitCount < size)
+  {
+    fillBits();
+  }
+  int v = bits >> (32 - size);
+  bits <<= size;
+  bitCount -= size;
+  return v < (1 << (size - 1)) ? v - (1 << size) + 1 : v;
+}
+
+bool JpegDecoder::restart()
+{
+  bits = 0;
+  bitCount = 0;
+  while (marker < 0)
+  {
+    int c = readByte();
+    if (c < 0)
+    {
+      return fail("Truncated image data");
+    }
+    if (c != 0xFF)
+    {
+      continue;
+    }
+    do
+    {
+      c = readByte();
+    } while (c == 0xFF);
+    if (c < 0)
+    {
+      return fail("Truncated image data");
+    }
+    if (c != 0)
+    {
+      marker = c;
+    }
+  }
+  if (marker < 0xD0 || marker > 0xD7)
+  {
+    return fail("Missing restart marker");
+  }
+  marker = -1;
+  for (int i = 0; i < frame.components; i++)
+  {
+    comps[i].dcPred = 0;
+  }
+  return true;
+}
+
+bool JpegDecoder::decodeBlock(Component &c, int n, int32_t *coef)
+{
+  const uint16_t *q = quant[c.quant];
+  for (int v = 0; v < n; v++)
+  {
+    for (int u = 0; u < n; u++)
+    {
+      coef[v * 8 + u] = 0;
+    }
+  }
+
+  int t = decodeHuffman(dc[c.dcTable]);
+  if (t < 0 || t > 11)
+  {
+    return fail("Corrupt image data");
+  }
+  c.dcPred += receiveExtend(t);
+  coef[0] = c.dcPred * q[0];
+
+  // Every coefficient has to be decoded to find the next block, but only
+  // the ones inside the N x N corner are kept
+  for (int k = 1; k < 64; k++)
+  {
+    int rs = decodeHuffman(ac[c.acTable]);
+    if (rs < 0)
+    {
+      return fail("Corrupt image data");
+    }
+    int run = rs >> 4;
+    int size = rs & 15;
+    if (size == 0)
+    {
+      if (run != 15)
+      {
+        break; // end of block
+      }
+      k += 15;
+      continue;
+    }
+    k += run;
+    if (k > 63)
+    {
+      return fail("Corrupt image data");
+    }
+    int value = receiveExtend(size);
+    int z = zigzag[k];
+    if ((z >> 3) < n && (z & 7) < n)
+    {
+      coef[z] = value * q[k];
+    }
+  }
+  return true;
+}
+
+bool JpegDecoder::decode(int scaleLog2, const RowSink &sink)
+{
+  if (frame.components == 0)
+  {
+    return fail("No frame");
+  }
+  if (scaleLog2 < 0 || scaleLog2 > JPEG_MAX_SCALE_LOG2)
+  {
+    return fail("Unsupported scale");
+  }
+  int n = 8 >> scaleLog2;
+  int mcusX = (frame.width + hMax * 8 - 1) / (hMax * 8);
+  int mcusY = (frame.height + vMax * 8 - 1) / (vMax * 8);
+  int outW = scaledSize(frame.width, scaleLog2);
+  int outH = scaledSize(frame.height, scaleLog2);
+  for (int i = 0; i < frame.components; i++)
+  {
+    Component &c = comps[i];
+    c.planeStride = mcusX * c.h * n;
+    c.plane.assign(c.planeStride * c.v * n, 0);
+    c.dcPred = 0;
+  }
+  size_t bandStride = mcusX * hMax * n * 3;
+  std::vector<uint8_t> band(bandStride * vMax * n);
+  int32_t coef[64];
+
+  int mcu = 0;
+  for (int my = 0; my < mcusY; my++)
+  {
+    for (int mx = 0; mx < mcusX; mx++)
+    {
+      if (restartInterval > 0 && mcu > 0 && mcu % restartInterval == 0 && !restart())
+      {
+        return false;
+      }
+      for (int i = 0; i < frame.components; i++)
+      {
+        Component &c = comps[i];
+        for (int by = 0; by < c.v; by++)
+        {
+          for (int bx = 0; bx < c.h; bx++)
+          {
+            if (!decodeBlock(c, n, coef))
+            {
+              return false;
+            }
+            idctBlock(coef, scaleLog2, c.plane.data() + by * n * c.planeStride + (mx * c.h + bx) * n, c.planeStride);
+          }
+        }
+      }
+      mcu++;
+    }
+
+    // Colour conversion; subsampled chroma is repeated (the smaller the
+    // scale, the less there is to interpolate)
+    int y0 = my * vMax * n;
+    int rows = outH - y0 < vMax * n ? outH - y0 : vMax * n;
+    for (int y = 0; y < rows; y++)
+    {
+      uint8_t *out = band.data() + y * bandStride;
+      const uint8_t *py = comps[0].plane.data() + (y * comps[0].v / vMax) * comps[0].planeStride;
+      if (frame.components == 1)
+      {
+        for (int x = 0; x < outW; x++)
+        {
+          out[0] = out[1] = out[2] = py[x];
+          out += 3;
+        }
+        continue;
+      }
+      const uint8_t *pcb = comps[1].plane.data() + (y * comps[1].v / vMax) * comps[1].planeStride;
+      const uint8_t *pcr = comps[2].plane.data() + (y * comps[2].v / vMax) * comps[2].planeStride;
+      for (int x = 0; x < outW; x++)
+      {
+        int luma = py[x * comps[0].h / hMax];
+        int cb = pcb[x * comps[1].h / hMax] - 128;
+        int cr = pcr[x * comps[2].h / hMax] - 128;
+        out[0] = clamp8(luma + ((91881 * cr + 32768) >> 16));
+        out[1] = clamp8(luma - ((22554 * cb + 46802 * cr - 32768) >> 16));
+        out[2] = clamp8(luma + ((116130 * cb + 32768) >> 16));
+        out += 3;
+      }
+    }
+    if (rows > 0 && !sink(band.data(), y0, rows, outW, bandStride))
+    {
+      return fail("Cancelled");
+    }
+  }
+  return true;
+}
+
+// ---- Encoder ---------------------------------------------------------------
+
+static const uint8_t lumaQuant[64] = {16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+                                      14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+                                      18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+                                      49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+static const uint8_t chromaQuant[64] = {17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+                                        24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+                                        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+                                        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+static const uint8_t dcLumaCounts[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t dcChromaCounts[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t dcSymbols[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t acLumaCounts[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t acLumaSymbols[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+    0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+static const uint8_t acChromaCounts[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t acChromaSymbols[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+struct HuffmanCode
+{
+  uint16_t code[256];
+  uint8_t size[256];
+
+  HuffmanCode(const uint8_t *counts, const uint8_t *symbols)
+  {
+    memset(size, 0, sizeof(size));
+    uint16_t c = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++)
+    {
+      for (int i = 0; i < counts[len - 1]; i++)
+      {
+        code[symbols[k]] = c++;
+        size[symbols[k++]] = (uint8_t)len;
+      }
+      c <<= 1;
+    }
+  }
+};
+
+class BitWriter
+{
+private:
+  std::vector<uint8_t> &out;
+  uint32_t acc;
+  int count;
+
+public:
+  BitWriter(std::vector<uint8_t> &o) : out(o), acc(0), count(0) {}
+
+  void put(uint32_t value, int len)
+  {
+    acc = (acc << len) | (value & ((1u << len) - 1));
+    count += len;
+    while (count >= 8)
+    {
+      uint8_t b = (uint8_t)(acc >> (count - 8));
+      out.push_back(b);
+      if (b == 0xFF)
+      {
+        out.push_back(0); // byte stuffing
+      }
+      count -= 8;
+    }
+    acc &= (1u << count) - 1;
+  }
+
+  void flush()
+  {
+    if (count > 0)
+    {
+      put(0x7F, 8 - count); // pad with ones
+    }
+  }
+};
+
+static inline int bitLength(int v)
+{
+  int n = 0;
+  for (v = v < 0 ? -v : v; v; v >>= 1)
+  {
+    n++;
+  }
+  return n;
+}
+
+static void putValue(BitWriter &w, int v, int len)
+{
+  w.put(v < 0 ? v - 1 : v, len);
+}
+
+static float fdctTable[64]; // C(u) / 2 * cos((2x + 1) u pi / 16)
+
+static bool buildFdctTable()
+{
+  for (int u = 0; u < 8; u++)
+  {
+    for (int x = 0; x < 8; x++)
+    {
+      fdctTable[u * 8 + x] = (float)((u == 0 ? sqrt(0.125) : 0.5) * cos((2 * x + 1) * u * M_PI / 16));
+    }
+  }
+  return true;
+}
+
+static void encodeBlock(BitWriter &w, const float *samples, const float *quantRecip, int &pred,
+                        const HuffmanCode &dcCode, const HuffmanCode &acCode)
+{
+  float tmp[64];
+  for (int y = 0; y < 8; y++)
+  {
+    for (int u = 0; u < 8; u++)
+    {
+      float s = 0;
+      for (int x = 0; x < 8; x++)
+      {
+        s += fdctTable[u * 8 + x] * samples[y * 8 + x];
+      }
+      tmp[y * 8 + u] = s;
+    }
+  }
+  int zz[64];
+  for (int k = 0; k < 64; k++)
+  {
+    int v = zigzag[k] >> 3;
+    int u = zigzag[k] & 7;
+    float s = 0;
+    for (int y = 0; y < 8; y++)
+    {
+      s += fdctTable[v * 8 + y] * tmp[y * 8 + u];
+    }
+    zz[k] = (int)lroundf(s * quantRecip[k]);
+  }
+
+  int diff = zz[0] - pred;
+  pred = zz[0];
+  int len = bitLength(diff);
+  w.put(dcCode.code[len], dcCode.size[len]);
+  putValue(w, diff, len);
+
+  int run = 0;
+  for (int k = 1; k < 64; k++)
+  {
+    if (zz[k] == 0)
+    {
+      run++;
+      continue;
+    }
+    while (run > 15)
+    {
+      w.put(acCode.code[0xF0], acCode.size[0xF0]);
+      run -= 16;
+    }
+    len = bitLength(zz[k]);
+    int symbol = (run << 4) | len;
+    w.put(acCode.code[symbol], acCode.size[symbol]);
+    putValue(w, zz[k], len);
+    run = 0;
+  }
+  if (run > 0)
+  {
+    w.put(acCode.code[0], acCode.size[0]);
+  }
+}
+
+static void putSegment(std::vector<uint8_t> &out, uint8_t marker, size_t len)
+{
+  out.push_back(0xFF);
+  out.push_back(marker);
+  out.push_back((uint8_t)((len + 2) >> 8));
+  out.push_back((uint8_t)(len + 2));
+}
+
+bool jpegEncode(const uint8_t *rgb, int width, int height, int quality, const std::string &comment,
+                std::vector<uint8_t> &out)
+{
+  if (width <= 0 || height <= 0 || width > 65535 || height > 65535)
+  {
+    return false;
+  }
+  static bool tableReady = buildFdctTable();
+  (void)tableReady;
+  static const HuffmanCode dcLuma(dcLumaCounts, dcSymbols);
+  static const HuffmanCode dcChroma(dcChromaCounts, dcSymbols);
+  static const HuffmanCode acLuma(acLumaCounts, acLumaSymbols);
+  static const HuffmanCode acChroma(acChromaCounts, acChromaSymbols);
+
+  quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+  int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+  uint8_t qt[2][64]; // zigzag order
+  float recip[2][64];
+  for (int k = 0; k < 64; k++)
+  {
+    for (int t = 0; t < 2; t++)
+    {
+      int base = (t == 0 ? lumaQuant : chromaQuant)[zigzag[k]];
+      int q = (base * scale + 50) / 100;
+      qt[t][k] = (uint8_t)(q < 1 ? 1 : q > 255 ? 255 : q);
+      recip[t][k] = 1.0f / qt[t][k];
+    }
+  }
+
+  out.clear();
+  out.reserve(width * height / 2 + 1024);
+  out.push_back(0xFF);
+  out.push_back(0xD8);
+  if (!comment.empty())
+  {
+    size_t len = comment.size() < 65000 ? comment.size() : 65000;
+    putSegment(out, 0xFE, len);
+    out.insert(out.end(), comment.begin(), comment.begin() + len);
+  }
+  putSegment(out, 0xDB, 2 * 65);
+  for (int t = 0; t < 2; t++)
+  {
+    out.push_back((uint8_t)t);
+    out.insert(out.end(), qt[t], qt[t] + 64);
+  }
+  putSegment(out, 0xC0, 15);
+  const uint8_t frameHeader[15] = {8, (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width,
+                                   3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1};
+  out.insert(out.end(), frameHeader, frameHeader + 15);
+  putSegment(out, 0xC4, 4 * 17 + 2 * 12 + 2 * 162);
+  const struct
+  {
+    uint8_t id;
+    const uint8_t *counts;
+    const uint8_t *symbols;
+    int total;
+  } tables[4] = {{0x00, dcLumaCounts, dcSymbols, 12},
+                 {0x10, acLumaCounts, acLumaSymbols, 162},
+                 {0x01, dcChromaCounts, dcSymbols, 12},
+                 {0x11, acChromaCounts, acChromaSymbols, 162}};
+  for (const auto &t : tables)
+  {
+    out.push_back(t.id);
+    out.insert(out.end(), t.counts, t.counts + 16);
+    out.insert(out.end(), t.symbols, t.symbols + t.total);
+  }
+  putSegment(out, 0xDA, 10);
+  const uint8_t scanHeader[10] = {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+  out.insert(out.end(), scanHeader, scanHeader + 10);
+
+  // 16x16 MCUs: four luma blocks and one 2x2-averaged block per chroma
+  // component; edge pixels are repeated
+  BitWriter w(out);
+  int pred[3] = {0, 0, 0};
+  float y[4][64];
+  float cb[64];
+  float cr[64];
+  for (int my = 0; my < height; my += 16)
+  {
+    for (int mx = 0; mx < width; mx += 16)
+    {
+      memset(cb, 0, sizeof(cb));
+      memset(cr, 0, sizeof(cr));
+      for (int py = 0; py < 16; py++)
+      {
+        const uint8_t *row = rgb + (size_t)(my + py < height ? my + py : height - 1) * width * 3;
+        for (int px = 0; px < 16; px++)
+        {
+          const uint8_t *p = row + (mx + px < width ? mx + px : width - 1) * 3;
+          float r = p[0];
+          float g = p[1];
+          float b = p[2];
+          int block = (py >> 3) * 2 + (px >> 3);
+          y[block][(py & 7) * 8 + (px & 7)] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+          int c = (py >> 1) * 8 + (px >> 1);
+          cb[c] += (-0.168736f * r - 0.331264f * g + 0.5f * b) * 0.25f;
+          cr[c] += (0.5f * r - 0.418688f * g - 0.081312f * b) * 0.25f;
+        }
+      }
+      for (int block = 0; block < 4; block++)
+      {
+        encodeBlock(w, y[block], recip[0], pred[0], dcLuma, acLuma);
+      }
+      encodeBlock(w, cb, recip[1], pred[1], dcChroma, acChroma);
+      encodeBlock(w, cr, recip[1], pred[2], dcChroma, acChroma);
+    }
+  }
+  w.flush();
+  out.push_back(0xFF);
+  out.push_back(0xD9);
+  return true;
+}
+
+// ---- Thumbnails ------------------------------------------------------------
+
+// Area-averaging downscale, fed row by row
+class BoxScaler
+{
+private:
+  int inW;
+  int inH;
+  int outW;
+  int outH;
+  uint8_t *out;
+  std::vector<uint16_t> xmap;
+  std::vector<uint16_t> columns;
+  std::vector<uint32_t> sums;
+  int row;
+  int rowsIn;
+
+  void flushRow()
+  {
+    if (rowsIn == 0)
+    {
+      return;
+    }
+    uint8_t *dst = out + (size_t)row * outW * 3;
+    for (int x = 0; x < outW; x++)
+    {
+      uint32_t n = columns[x] * rowsIn;
+      for (int c = 0; c < 3; c++)
+      {
+        dst[x * 3 + c] = (uint8_t)((sums[x * 3 + c] + n / 2) / n);
+        sums[x * 3 + c] = 0;
+      }
+    }
+    rowsIn = 0;
+  }
+
+public:
+  BoxScaler(int iw, int ih, int ow, int oh, uint8_t *o)
+      : inW(iw), inH(ih), outW(ow), outH(oh), out(o), xmap(iw), columns(ow, 0), sums(ow * 3, 0), row(0), rowsIn(0)
+  {
+    for (int x = 0; x < inW; x++)
+    {
+      xmap[x] = (uint16_t)((int64_t)x * outW / inW);
+      columns[xmap[x]]++;
+    }
+  }
+
+  void addRows(const uint8_t *rgb, int y, int rows, size_t stride)
+  {
+    for (int r = 0; r < rows && y + r < inH; r++)
+    {
+      int target = (int)((int64_t)(y + r) * outH / inH);
+      if (target != row)
+      {
+        flushRow();
+        row = target;
+      }
+      const uint8_t *p = rgb + r * stride;
+      for (int x = 0; x < inW; x++, p += 3)
+      {
+        uint32_t *s = &sums[xmap[x] * 3];
+        s[0] += p[0];
+        s[1] += p[1];
+        s[2] += p[2];
+      }
+      rowsIn++;
+    }
+  }
+
+  void finish() { flushRow(); }
+};
+
+// Turns the stored pixels upright according to the EXIF orientation
+static void applyOrientation(std::vector<uint8_t> &pixels, int &w, int &h, int orientation)
+{
+  if (orientation <= 1 || orientation > 8)
+  {
+    return;
+  }
+  bool swap = orientation >= 5;
+  int ow = swap ? h : w;
+  int oh = swap ? w : h;
+  std::vector<uint8_t> rotated(pixels.size());
+  for (int dy = 0; dy < oh; dy++)
+  {
+    for (int dx = 0; dx < ow; dx++)
+    {
+      int sx;
+      int sy;
+      switch (orientation)
+      {
+      case 2:
+        sx = w - 1 - dx, sy = dy;
+        break;
+      case 3:
+        sx = w - 1 - dx, sy = h - 1 - dy;
+        break;
+      case 4:
+        sx = dx, sy = h - 1 - dy;
+        break;
+      case 5:
+        sx = dy, sy = dx;
+        break;
+      case 6:
+        sx = dy, sy = h - 1 - dx;
+        break;
+      case 7:
+        sx = w - 1 - dy, sy = h - 1 - dx;
+        break;
+      default: // 8
+        sx = w - 1 - dy, sy = dx;
+        break;
+      }
+      memcpy(&rotated[((size_t)dy * ow + dx) * 3], &pixels[((size_t)sy * w + sx) * 3], 3);
+    }
+  }
+  pixels.swap(rotated);
+  w = ow;
+  h = oh;
+}
+
+bool jpegThumbnail(const JpegReader &reader, int size, int quality, const std::string &comment,
+                   std::vector<uint8_t> &out, JpegThumbStats &stats, const char **error,
+                   const std::function<uint32_t()> &now)
+{
+  uint32_t start = now();
+  memset(&stats, 0, sizeof(stats));
+  // Each decoder holds about 11 KB of Huffman tables: keep them off the
+  // worker's stack
+  std::unique_ptr<JpegDecoder> photo(new JpegDecoder());
+  std::unique_ptr<JpegDecoder> embedded(new JpegDecoder());
+  if (!photo->begin(reader))
+  {
+    *error = photo->error();
+    return false;
+  }
+  const JpegInfo &info = photo->info();
+  int longSide = info.width > info.height ? info.width : info.height;
+  int target = size < longSide ? size : longSide;
+  int outW = (int)(((int64_t)info.width * target + longSide / 2) / longSide);
+  int outH = (int)(((int64_t)info.height * target + longSide / 2) / longSide);
+  outW = outW < 1 ? 1 : outW;
+  outH = outH < 1 ? 1 : outH;
+
+  // The EXIF thumbnail saves reading the rest of the file, if it is big
+  // enough and not letterboxed
+  JpegDecoder *source = photo.get();
+  size_t pos = 0;
+  if (!info.exifThumbnail.empty())
+  {
+    const std::vector<uint8_t> &data = info.exifThumbnail;
+    JpegReader memory = [&data, &pos](uint8_t *buffer, size_t len) {
+      size_t n = data.size() - pos < len ? data.size() - pos : len;
+      memcpy(buffer, data.data() + pos, n);
+      pos += n;
+      return n;
+    };
+    if (embedded->begin(memory))
+    {
+      const JpegInfo &e = embedded->info();
+      int64_t skew = (int64_t)e.width * info.height - (int64_t)e.height * info.width;
+      if ((e.width > e.height ? e.width : e.height) >= target && (skew < 0 ? -skew : skew) * 50 <= (int64_t)e.height * info.width)
+      {
+        source = embedded.get();
+        stats.fromExif = true;
+      }
+    }
+  }
+
+  // Smallest DCT scale that still covers the target
+  const JpegInfo &src = source->info();
+  int srcLong = src.width > src.height ? src.width : src.height;
+  int scale = 0;
+  while (scale < JPEG_MAX_SCALE_LOG2 && JpegDecoder::scaledSize(srcLong, scale + 1) >= target)
+  {
+    scale++;
+  }
+  stats.scaleLog2 = scale;
+  stats.decodedWidth = JpegDecoder::scaledSize(src.width, scale);
+  stats.decodedHeight = JpegDecoder::scaledSize(src.height, scale);
+
+  std::vector<uint8_t> pixels((size_t)outW * outH * 3);
+  BoxScaler scaler(stats.decodedWidth, stats.decodedHeight, outW, outH, pixels.data());
+  bool ok = source->decode(scale, [&scaler](const uint8_t *rgb, int y, int rows, int, size_t stride) {
+    scaler.addRows(rgb, y, rows, stride);
+    return true;
+  });
+  stats.bytesRead = photo->bytesRead();
+  if (!ok)
+  {
+    *error = source->error();
+    return false;
+  }
+  scaler.finish();
+  stats.decodeMs = now() - start;
+
+  start = now();
+  applyOrientation(pixels, outW, outH, info.orientation);
+  ok = jpegEncode(pixels.data(), outW, outH, quality, comment, out);
+  stats.encodeMs = now() - start;
+  if (!ok)
+  {
+    *error = "Encoding failed";
+  }
+  return ok;
+}
@@ -0,0 +1,149 @@
+#ifndef __JPEG_CODEC_H
+#define __JPEG_CODEC_H
+
+// Portable C++ only: used by the thumbnail cache (thumb_cache.*) and by the
+// host benchmark (tools/thumb_bench.cpp)
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define JPEG_INPUT_CHUNK 4096
+#define JPEG_MAX_COMPONENTS 3
+// Largest scale-down the decoder does in the DCT domain: 1 << 3 = 1/8
+#define JPEG_MAX_SCALE_LOG2 3
+
+// Fills `buffer` with up to `len` bytes; 0 at the end of the input
+typedef std::function<size_t(uint8_t *buffer, size_t len)> JpegReader;
+
+struct JpegInfo
+{
+    int width;
+    int height;
+    int components;
+    // EXIF orientation, 1 (as stored) to 8
+    int orientation;
+    // The JPEG thumbnail embedded in the EXIF block, if any
+    std::vector<uint8_t> exifThumbnail;
+};
+
+// Baseline (sequential Huffman) JPEG decoder for 8-bit grayscale and YCbCr
+// with any chroma subsampling and restart intervals. Progressive and
+// arithmetic-coded files are rejected.
+//
+// At scale 1/2, 1/4 or 1/8 only the top-left 4x4, 2x2 or 1x1 coefficients
+// of each block go through a reduced IDCT, so the image is never
+// reconstructed at full size: a 4000x3000 photo decodes into 500x375
+// pixels and buffers one MCU row of that.
+class JpegDecoder
+{
+public:
+    // RGB888 rows y .. y + rows - 1 of the scaled image, `stride` bytes
+    // apart. Returning false stops decoding.
+    typedef std::function<bool(const uint8_t *rgb, int y, int rows, int width, size_t stride)> RowSink;
+
+    JpegDecoder();
+
+    // Reads the headers up to the start of the first scan
+    bool begin(const JpegReader &reader);
+    const JpegInfo &info() const { return frame; }
+
+    static int scaledSize(int size, int scaleLog2) { return (size + (1 << scaleLog2) - 1) >> scaleLog2; }
+    bool decode(int scaleLog2, const RowSink &sink);
+
+    const char *error() const { return lastError; }
+    uint64_t bytesRead() const { return consumed; }
+
+private:
+    struct Huffman
+    {
+        bool present;
+        uint16_t fast[1 << 9]; // (length << 8) | symbol for codes up to 9 bits
+        int32_t maxCode[18];
+        int32_t valueOffset[18];
+        uint8_t values[256];
+    };
+
+    struct Component
+    {
+        uint8_t id;
+        uint8_t h;
+        uint8_t v;
+        uint8_t quant;
+        uint8_t dcTable;
+        uint8_t acTable;
+        int dcPred;
+        std::vector<uint8_t> plane; // one MCU row at the output scale
+        size_t planeStride;
+    };
+
+    JpegReader read;
+    std::vector<uint8_t> input;
+    size_t inPos;
+    size_t inLen;
+    bool eof;
+    uint64_t consumed;
+
+    JpegInfo frame;
+    Component comps[JPEG_MAX_COMPONENTS];
+    uint16_t quant[4][64]; // zigzag order
+    Huffman dc[4];
+    Huffman ac[4];
+    int restartInterval;
+    int hMax;
+    int vMax;
+
+    uint32_t bits;
+    int bitCount;
+    int marker; // marker met inside entropy-coded data, -1 if none
+
+    const char *lastError;
+
+    int readByte();
+    bool readBytes(uint8_t *out, size_t len);
+    bool skipBytes(size_t len);
+    int readWord();
+    bool fail(const char *message);
+
+    bool parseQuant(int len);
+    bool parseHuffman(int len);
+    bool parseFrame(int len);
+    bool parseScan(int len);
+    bool parseExif(int len);
+
+    void fillBits();
+    int decodeHuffman(const Huffman &h);
+    int receiveExtend(int size);
+    bool restart();
+    bool decodeBlock(Component &c, int n, int32_t *coef);
+    static void buildHuffman(Huffman &h, const uint8_t *counts, const uint8_t *symbols, int total);
+};
+
+// Baseline 4:2:0 encoder with the standard tables. `comment` goes into a
+// COM segment right after SOI.
+bool jpegEncode(const uint8_t *rgb, int width, int height, int quality, const std::string &comment,
+                std::vector<uint8_t> &out);
+
+struct JpegThumbStats
+{
+    bool fromExif;     // the embedded EXIF thumbnail was large enough
+    int scaleLog2;     // DCT scale the source was decoded at
+    int decodedWidth;  // size after the DCT scale
+    int decodedHeight;
+    uint32_t decodeMs;
+    uint32_t encodeMs;
+    uint64_t bytesRead;
+};
+
+// Thumbnail whose long side is `size` (smaller images are not enlarged),
+// rotated upright by the EXIF orientation. The EXIF thumbnail is used when
+// it is at least `size` on its long side and has the photo's aspect ratio;
+// otherwise the photo is decoded at the smallest DCT scale that still
+// covers `size` and box-filtered down from there. `now` returns
+// milliseconds for the timing fields.
+bool jpegThumbnail(const JpegReader &reader, int size, int quality, const std::string &comment,
+                   std::vector<uint8_t> &out, JpegThumbStats &stats, const char **error,
+                   const std::function<uint32_t()> &now);
+
+#endif
@@ -0,0 +1,269 @@
+#include "kv_service.h"
+#include "bg_job.h"
+#include "du_tree.h"
+#include "meta_cache.h"
+#include "sd_read_write.h"
+#include "SD_MMC.h"
+#include <esp_heap_caps.h>
+#include <esp_task_wdt.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <algorithm>
+
+struct KvWorker
+{
+  KvStore *store;
+  TaskHandle_t task;
+  volatile bool stop;
+  volatile bool stopped;
+};
+
+static KvStore store;
+static KvWorker worker;
+
+static void *kvAlloc(size_t size)
+{
+  void *p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  return p ? p : malloc(size);
+}
+
+static void kvFileChange(KvFileEvent event, const std::string &path, uint64_t bytes)
+{
+  String p(path.c_str());
+  fsCacheInvalidate(p);
+  if (event == KV_FILE_CREATED)
+  {
+    duFileAdded(p, bytes);
+  }
+  else if (event == KV_FILE_GREW)
+  {
+    duFileGrown(p, bytes);
+  }
+  else
+  {
+    duFileRemoved(p, bytes);
+  }
+}
+
+// Writes frozen memtables, compacts and syncs the log every KV_SYNC_MS
+static void workerEntry(void *arg)
+{
+  KvWorker *w = (KvWorker *)arg;
+  while (!w->stop)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(KV_SYNC_MS));
+    while (!w->stop && w->store->maintenance())
+    {
+    }
+    w->store->sync();
+  }
+  w->stopped = true;
+  vTaskDelete(NULL);
+}
+
+static bool startWorker(KvWorker &w, KvStore &s, KvOptions &options)
+{
+  w.store = &s;
+  w.task = nullptr;
+  w.stop = false;
+  w.stopped = false;
+  options.alloc = kvAlloc;
+  options.release = free;
+  options.onFileChange = kvFileChange;
+  options.wake = [&w]() {
+    if (w.task)
+    {
+      xTaskNotifyGive(w.task);
+    }
+  };
+  return xTaskCreatePinnedToCore(workerEntry, "kv", KV_WORKER_STACK, &w, BG_JOB_PRIORITY, &w.task, tskNO_AFFINITY) == pdPASS;
+}
+
+static void stopWorker(KvWorker &w)
+{
+  w.stop = true;
+  xTaskNotifyGive(w.task);
+  while (!w.stopped)
+  {
+    delay(10);
+  }
+}
+
+static bool openStore(KvStore &s, KvWorker &w, const char *dir)
+{
+  FsMeta meta;
+  bool existed = g_metaCache.stat(dir, meta);
+  KvOptions options;
+  if (!startWorker(w, s, options))
+  {
+    return false;
+  }
+  // The log and the segments stay open through FatFs while the store is
+  // open: keep defrag out of the whole directory
+  openWriterAdd(dir);
+  if (!s.open(dir, options))
+  {
+    Serial.printf("KV store %s: %s\n", dir, s.lastError().c_str());
+    openWriterRemove(dir);
+    stopWorker(w);
+    return false;
+  }
+  if (!existed)
+  {
+    fsCacheInvalidate(dir, true);
+    duDirAdded(dir);
+  }
+  return true;
+}
+
+bool kvBegin()
+{
+  if (!openStore(store, worker, KV_DIR))
+  {
+    return false;
+  }
+  KvStats stats = store.getStats();
+  Serial.printf("KV store: %u segments, %llu entries\n", stats.segments, stats.segmentEntries);
+  return true;
+}
+
+KvStore &kvStore()
+{
+  return store;
+}
+
+void kvStatusJson(JsonObject obj)
+{
+  KvStats s = store.getStats();
+  obj["open"] = store.isOpen();
+  obj["error"] = store.lastError().c_str();
+  obj["segments"] = s.segments;
+  obj["segmentBytes"] = s.segmentBytes;
+  obj["segmentEntries"] = s.segmentEntries;
+  obj["memtableUsed"] = s.memtableUsed;
+  obj["memtableBytes"] = s.memtableBytes;
+  obj["puts"] = s.puts;
+  obj["deletes"] = s.deletes;
+  obj["gets"] = s.gets;
+  obj["getHits"] = s.getHits;
+  obj["bloomSkips"] = s.bloomSkips;
+  obj["blockReads"] = s.blockReads;
+  obj["cacheHits"] = s.cacheHits;
+  obj["flushes"] = s.flushes;
+  obj["compactions"] = s.compactions;
+  obj["bytesFlushed"] = s.bytesFlushed;
+  obj["bytesCompacted"] = s.bytesCompacted;
+  obj["stallMs"] = s.stallUs / 1000;
+}
+
+static uint32_t percentile(std::vector<uint32_t> &samples, uint32_t pct)
+{
+  if (samples.empty())
+  {
+    return 0;
+  }
+  std::sort(samples.begin(), samples.end());
+  return samples[std::min(samples.size() - 1, samples.size() * pct / 100)];
+}
+
+float testKvStore(const char *dir, uint32_t records, size_t valueBytes, JsonObject result)
+{
+  Serial.printf("KV store test: %u records of %u bytes in %s\n", records, valueBytes, dir);
+  // Left over from an interrupted run: the store must start empty
+  if (SD_MMC.exists(dir))
+  {
+    if (!removeTree(SD_MMC, dir))
+    {
+      Serial.printf("KV store test: cannot remove the old %s\n", dir);
+      return 0;
+    }
+    duDirRemoved(dir);
+  }
+
+  KvStore bench;
+  KvWorker benchWorker;
+  if (!openStore(bench, benchWorker, dir))
+  {
+    return 0;
+  }
+
+  std::vector<uint32_t> latency;
+  latency.reserve(records);
+  std::string value(valueBytes, 'v');
+  char key[32];
+  uint32_t seed = 7;
+
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < records; i++)
+  {
+    snprintf(key, sizeof(key), "asset/%08x", i * 2654435761u);
+    uint32_t t = micros();
+    bench.put(key, value);
+    latency.push_back(micros() - t);
+    if ((i & 255) == 0)
+    {
+      esp_task_wdt_reset();
+    }
+  }
+  uint32_t putUs = max((uint32_t)(micros() - start), (uint32_t)1);
+  result["putsPerSec"] = records * 1e6f / putUs;
+  result["putP50Us"] = percentile(latency, 50);
+  result["putP99Us"] = percentile(latency, 99);
+
+  // Lookups go to the segment written from the memtable; half of them miss,
+  // so the bloom filters show up in the numbers
+  bench.flush();
+  for (int i = 0; i < 500 && bench.getStats().flushes == 0; i++)
+  {
+    delay(10);
+  }
+  latency.clear();
+  std::string out;
+  uint32_t hits = 0;
+  start = micros();
+  for (uint32_t i = 0; i < records; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    snprintf(key, sizeof(key), "asset/%08x", ((seed >> 8) % (records * 2)) * 2654435761u);
+    uint32_t t = micros();
+    hits += bench.get(key, out);
+    latency.push_back(micros() - t);
+    if ((i & 255) == 0)
+    {
+      esp_task_wdt_reset();
+    }
+  }
+  uint32_t getUs = max((uint32_t)(micros() - start), (uint32_t)1);
+  result["getsPerSec"] = records * 1e6f / getUs;
+  result["getP50Us"] = percentile(latency, 50);
+  result["getP99Us"] = percentile(latency, 99);
+  result["getHits"] = hits;
+
+  start = micros();
+  size_t scanned = bench.scan("", "", records, [](const std::string &, const std::string &) { return true; });
+  uint32_t scanUs = max((uint32_t)(micros() - start), (uint32_t)1);
+  result["scanKeysPerSec"] = scanned * 1e6f / scanUs;
+
+  KvStats stats = bench.getStats();
+  result["segments"] = stats.segments;
+  result["flushes"] = stats.flushes;
+  result["compactions"] = stats.compactions;
+  result["stallMs"] = stats.stallUs / 1000;
+
+  stopWorker(benchWorker);
+  bench.close();
+  openWriterRemove(dir);
+  if (removeTree(SD_MMC, dir))
+  {
+    duDirRemoved(dir);
+  }
+  else
+  {
+    Serial.printf("KV store test: could not remove %s\n", dir);
+  }
+
+  float rate = records * 1e6f / putUs;
+  Serial.printf("KV store test: %.0f puts/s, %.0f gets/s, %u hits, %u keys scanned\n", rate,
+                (float)result["getsPerSec"], hits, scanned);
+  return rate;
+}
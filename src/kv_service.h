@@ -0,0 +1,25 @@
+#ifndef __KV_SERVICE_H
+#define __KV_SERVICE_H
+
+#include "Arduino.h"
+#include "kv_store.h"
+#include <ArduinoJson.h>
+
+#define KV_DIR "/kv"
+#define KV_WORKER_STACK 8192
+// The worker flushes the log this often when no write asks for it
+#define KV_SYNC_MS 1000
+#define KV_SCAN_DEFAULT_LIMIT 100
+#define KV_SCAN_MAX_LIMIT 1000
+
+// The device's store in KV_DIR with its maintenance task: memtables in
+// PSRAM, file changes reported to the du tree and the metadata cache
+bool kvBegin();
+KvStore &kvStore();
+void kvStatusJson(JsonObject obj);
+
+// Put/get/scan benchmark in a scratch store under `dir`, which is removed
+// afterwards. Returns puts per second.
+float testKvStore(const char *dir, uint32_t records, size_t valueBytes, JsonObject result);
+
+#endif
@@ -0,0 +1,1661 @@
+#include "kv_store.h"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ESP_PLATFORM)
+#include "esp_rom_crc.h"
+#include "ff.h"
+#include "sd_io_sched.h"
+#include "sd_read_write.h"
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct KvFooter
+{
+  char magic[4]; // "KVS1"
+  uint32_t indexOffset;
+  uint32_t indexSize;
+  uint32_t indexCrc;
+  uint32_t bloomOffset;
+  uint32_t bloomSize;
+  uint32_t bloomCrc;
+  uint32_t blocks;
+  uint32_t entries;
+  uint32_t tombstones;
+  uint32_t reserved;
+  uint32_t crc;
+};
+static_assert(sizeof(KvFooter) == 48, "footer layout");
+
+static const uint8_t KV_LOG_PUT = 1;
+static const uint8_t KV_LOG_DELETE = 2;
+static const uint32_t KV_TOMBSTONE = 0x80000000u;
+
+static uint32_t kvCrc32(const void *data, size_t len)
+{
+#if defined(ESP_PLATFORM)
+  return esp_rom_crc32_le(0, (const uint8_t *)data, len);
+#else
+  static uint32_t table[256];
+  if (table[1] == 0)
+  {
+    for (uint32_t i = 0; i < 256; i++)
+    {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+      {
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+  }
+  uint32_t crc = 0xFFFFFFFFu;
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+#endif
+}
+
+// FNV-1a with a 64-bit finalizer; the halves drive the bloom probes
+static uint64_t kvHash(const char *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++)
+  {
+    h = (h ^ (uint8_t)p[i]) * 0x100000001b3ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+static void putVarint(std::string &out, uint32_t v)
+{
+  while (v >= 0x80)
+  {
+    out += (char)(v | 0x80);
+    v >>= 7;
+  }
+  out += (char)v;
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v)
+{
+  v = 0;
+  for (int shift = 0; shift <= 28 && p < end; shift += 7)
+  {
+    uint8_t b = *p++;
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void putFixed32(std::string &out, uint32_t v)
+{
+  out.append((const char *)&v, 4);
+}
+
+static uint32_t getFixed32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static int compareKeys(const char *a, size_t aLen, const char *b, size_t bLen)
+{
+  int c = memcmp(a, b, std::min(aLen, bLen));
+  if (c != 0)
+  {
+    return c;
+  }
+  return aLen < bLen ? -1 : aLen > bLen ? 1 : 0;
+}
+
+static uint64_t nowUs()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// ---- Files -----------------------------------------------------------------
+
+class KvFile
+{
+private:
+#if defined(ESP_PLATFORM)
+  FIL fil;
+  bool isOpen;
+  SdIoClass ioClass;
+#else
+  FILE *fp;
+#endif
+
+public:
+  // Background files (flush and compaction) give the card to lookups first
+#if defined(ESP_PLATFORM)
+  KvFile(bool background = false) : isOpen(false), ioClass(background ? SD_IO_BACKGROUND : SD_IO_SMALL) {}
+#else
+  KvFile(bool = false) : fp(nullptr) {}
+#endif
+  ~KvFile() { close(); }
+
+  // Read only, or created empty for writing
+  bool open(const std::string &path, bool create)
+  {
+    close();
+#if defined(ESP_PLATFORM)
+    isOpen = f_open(&fil, sdFatPath(String(path.c_str())).c_str(),
+                    create ? FA_WRITE | FA_CREATE_ALWAYS : FA_READ) == FR_OK;
+    return isOpen;
+#else
+    fp = fopen(path.c_str(), create ? "wb" : "rb");
+    return fp != nullptr;
+#endif
+  }
+
+  bool readAt(uint64_t offset, void *buffer, size_t len)
+  {
+#if defined(ESP_PLATFORM)
+    if (!isOpen)
+    {
+      return false;
+    }
+    {
+      SdIoScope io(ioClass);
+      if (f_lseek(&fil, offset) != FR_OK)
+      {
+        return false;
+      }
+    }
+    // In SD_IO_MAX_CHUNK pieces, each under its own grant
+    for (size_t done = 0; done < len;)
+    {
+      UINT want = std::min(len - done, (size_t)SD_IO_MAX_CHUNK);
+      UINT got = 0;
+      FRESULT res;
+      {
+        SdIoScope io(ioClass);
+        res = f_read(&fil, (uint8_t *)buffer + done, want, &got);
+      }
+      if (res != FR_OK || got != want)
+      {
+        return false;
+      }
+      done += got;
+    }
+    return true;
+#else
+    return fp && fseek(fp, (long)offset, SEEK_SET) == 0 && fread(buffer, 1, len, fp) == len;
+#endif
+  }
+
+  bool write(const void *data, size_t len)
+  {
+#if defined(ESP_PLATFORM)
+    if (!isOpen)
+    {
+      return false;
+    }
+    for (size_t done = 0; done < len;)
+    {
+      UINT want = std::min(len - done, (size_t)SD_IO_MAX_CHUNK);
+      UINT put = 0;
+      FRESULT res;
+      {
+        SdIoScope io(ioClass);
+        res = f_write(&fil, (const uint8_t *)data + done, want, &put);
+      }
+      if (res != FR_OK || put != want)
+      {
+        return false;
+      }
+      done += put;
+    }
+    return true;
+#else
+    return fp && fwrite(data, 1, len, fp) == len;
+#endif
+  }
+
+  bool sync()
+  {
+#if defined(ESP_PLATFORM)
+    SdIoScope io(ioClass);
+    return isOpen && f_sync(&fil) == FR_OK;
+#else
+    return fp && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+#endif
+  }
+
+  uint64_t size()
+  {
+#if defined(ESP_PLATFORM)
+    return isOpen ? f_size(&fil) : 0;
+#else
+    if (!fp || fseek(fp, 0, SEEK_END) != 0)
+    {
+      return 0;
+    }
+    return ftell(fp);
+#endif
+  }
+
+  void close()
+  {
+#if defined(ESP_PLATFORM)
+    if (isOpen)
+    {
+      f_close(&fil);
+      isOpen = false;
+    }
+#else
+    if (fp)
+    {
+      fclose(fp);
+      fp = nullptr;
+    }
+#endif
+  }
+};
+
+static bool kvRemove(const std::string &path)
+{
+#if defined(ESP_PLATFORM)
+  return f_unlink(sdFatPath(String(path.c_str())).c_str()) == FR_OK;
+#else
+  return ::remove(path.c_str()) == 0;
+#endif
+}
+
+static bool kvRename(const std::string &from, const std::string &to)
+{
+#if defined(ESP_PLATFORM)
+  return f_rename(sdFatPath(String(from.c_str())).c_str(), sdFatPath(String(to.c_str())).c_str()) == FR_OK;
+#else
+  return ::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static bool kvMakeDir(const std::string &path)
+{
+#if defined(ESP_PLATFORM)
+  FRESULT res = f_mkdir(sdFatPath(String(path.c_str())).c_str());
+  return res == FR_OK || res == FR_EXIST;
+#else
+  struct stat st;
+  return mkdir(path.c_str(), 0755) == 0 || (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+#endif
+}
+
+static bool kvListDir(const std::string &path, std::vector<std::string> &names)
+{
+#if defined(ESP_PLATFORM)
+  DIR dir;
+  FILINFO info;
+  if (f_opendir(&dir, sdFatPath(String(path.c_str())).c_str()) != FR_OK)
+  {
+    return false;
+  }
+  while (f_readdir(&dir, &info) == FR_OK && info.fname[0])
+  {
+    if (!(info.fattrib & AM_DIR))
+    {
+      names.push_back(info.fname);
+    }
+  }
+  f_closedir(&dir);
+  return true;
+#else
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+  {
+    return false;
+  }
+  while (struct dirent *entry = readdir(dir))
+  {
+    if (entry->d_name[0] != '.')
+    {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  return true;
+#endif
+}
+
+// ---- Memtable --------------------------------------------------------------
+
+// Skiplist in a single arena; nodes are never freed, an overwrite inserts a
+// newer node in front of the older ones with the same key. Node layout:
+//   u32 value length | KV_TOMBSTONE, u16 key length, u8 height, u8 pad,
+//   u32 next[height], key, value
+class KvMemtable
+{
+public:
+  static const int MAX_HEIGHT = 12;
+  static const size_t NODE_HEADER = 8;
+
+  static size_t nodeSize(int height, size_t keyLen, size_t valueLen)
+  {
+    return (NODE_HEADER + height * 4 + keyLen + valueLen + 3) & ~(size_t)3;
+  }
+
+private:
+  uint8_t *arena;
+  size_t capacity;
+  size_t used;
+  uint32_t entries;
+  int height;
+  uint32_t rnd;
+  void (*release)(void *);
+
+  uint32_t &nextOf(uint32_t node, int level) { return ((uint32_t *)(arena + node + NODE_HEADER))[level]; }
+  uint8_t heightOf(uint32_t node) const { return arena[node + 6]; }
+
+  int randomHeight()
+  {
+    int h = 1;
+    while (h < MAX_HEIGHT)
+    {
+      rnd = rnd * 1103515245 + 12345;
+      if ((rnd >> 16) & 3)
+      {
+        break;
+      }
+      h++;
+    }
+    return h;
+  }
+
+  int compareNode(uint32_t node, const char *key, size_t len) const
+  {
+    return compareKeys(keyOf(node), keyLength(node), key, len);
+  }
+
+  // First node whose key is >= key; fills prev[] when given
+  uint32_t seek(const char *key, size_t len, uint32_t *prev)
+  {
+    uint32_t x = 0;
+    for (int level = height - 1; level >= 0; level--)
+    {
+      uint32_t n;
+      while ((n = nextOf(x, level)) != 0 && compareNode(n, key, len) < 0)
+      {
+        x = n;
+      }
+      if (prev)
+      {
+        prev[level] = x;
+      }
+    }
+    return nextOf(x, 0);
+  }
+
+public:
+  KvMemtable() : arena(nullptr), capacity(0), used(0), entries(0), height(1), rnd(0x2545F491), release(nullptr) {}
+  ~KvMemtable()
+  {
+    if (arena)
+    {
+      release ? release(arena) : free(arena);
+    }
+  }
+
+  bool init(size_t bytes, void *(*alloc)(size_t), void (*releaseFn)(void *))
+  {
+    arena = (uint8_t *)(alloc ? alloc(bytes) : malloc(bytes));
+    capacity = bytes;
+    release = releaseFn;
+    reset();
+    return arena != nullptr;
+  }
+
+  void reset()
+  {
+    used = nodeSize(MAX_HEIGHT, 0, 0);
+    if (arena)
+    {
+      memset(arena, 0, used);
+      arena[6] = MAX_HEIGHT;
+    }
+    entries = 0;
+    height = 1;
+  }
+
+  bool fits(size_t keyLen, size_t valueLen) const
+  {
+    return used + nodeSize(MAX_HEIGHT, keyLen, valueLen) <= capacity;
+  }
+
+  void add(const char *key, size_t keyLen, const char *value, size_t valueLen, bool tombstone)
+  {
+    uint32_t prev[MAX_HEIGHT];
+    seek(key, keyLen, prev);
+    int h = randomHeight();
+    for (int level = height; level < h; level++)
+    {
+      prev[level] = 0;
+    }
+    height = std::max(height, h);
+
+    uint32_t node = used;
+    used += nodeSize(h, keyLen, valueLen);
+    uint32_t lenField = valueLen | (tombstone ? KV_TOMBSTONE : 0);
+    uint16_t keyField = keyLen;
+    memcpy(arena + node, &lenField, 4);
+    memcpy(arena + node + 4, &keyField, 2);
+    arena[node + 6] = h;
+    memcpy(arena + node + NODE_HEADER + h * 4, key, keyLen);
+    memcpy(arena + node + NODE_HEADER + h * 4 + keyLen, value, valueLen);
+    for (int level = 0; level < h; level++)
+    {
+      nextOf(node, level) = nextOf(prev[level], level);
+      nextOf(prev[level], level) = node;
+    }
+    entries++;
+  }
+
+  // 1 found, -1 deleted, 0 unknown here
+  int get(const std::string &key, std::string &value)
+  {
+    uint32_t node = seek(key.data(), key.size(), nullptr);
+    if (node == 0 || compareNode(node, key.data(), key.size()) != 0)
+    {
+      return 0;
+    }
+    if (isTombstone(node))
+    {
+      return -1;
+    }
+    value.assign(valueOf(node), valueLength(node));
+    return 1;
+  }
+
+  uint32_t first(const std::string &start) { return seek(start.data(), start.size(), nullptr); }
+  // Next node with a different key (skips the older versions)
+  uint32_t next(uint32_t node)
+  {
+    uint32_t n = nextOf(node, 0);
+    while (n != 0 && compareKeys(keyOf(n), keyLength(n), keyOf(node), keyLength(node)) == 0)
+    {
+      n = nextOf(n, 0);
+    }
+    return n;
+  }
+
+  const char *keyOf(uint32_t node) const { return (const char *)arena + node + NODE_HEADER + heightOf(node) * 4; }
+  size_t keyLength(uint32_t node) const
+  {
+    uint16_t len;
+    memcpy(&len, arena + node + 4, 2);
+    return len;
+  }
+  const char *valueOf(uint32_t node) const { return keyOf(node) + keyLength(node); }
+  size_t valueLength(uint32_t node) const { return getFixed32(arena + node) & ~KV_TOMBSTONE; }
+  bool isTombstone(uint32_t node) const { return getFixed32(arena + node) & KV_TOMBSTONE; }
+
+  uint32_t count() const { return entries; }
+  size_t bytesUsed() const { return used; }
+};
+
+// ---- Segments --------------------------------------------------------------
+
+struct KvIndexEntry
+{
+  uint32_t keyOffset; // into KvSegment::indexKeys
+  uint32_t keyLen;    // last key of the block
+  uint32_t offset;
+  uint32_t size;
+  uint32_t crc;
+};
+
+struct KvSegment
+{
+  std::string name;
+  uint32_t lo;
+  uint32_t hi;
+  uint64_t fileSize;
+  uint32_t entries;
+  uint32_t tombstones;
+  KvFile file;
+  std::string indexKeys;
+  std::vector<KvIndexEntry> index;
+  std::vector<uint8_t> bloom; // bits, then the probe count
+
+  int compareLastKey(size_t block, const std::string &key) const
+  {
+    const KvIndexEntry &e = index[block];
+    return compareKeys(indexKeys.data() + e.keyOffset, e.keyLen, key.data(), key.size());
+  }
+
+  // First block whose last key is >= key, or index.size()
+  size_t findBlock(const std::string &key) const
+  {
+    size_t lo = 0;
+    size_t hi = index.size();
+    while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (compareLastKey(mid, key) < 0)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  bool mayContain(const std::string &key) const
+  {
+    if (bloom.size() < 2)
+    {
+      return true;
+    }
+    uint64_t h = kvHash(key.data(), key.size());
+    uint32_t bits = (bloom.size() - 1) * 8;
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for (uint8_t i = 0; i < bloom.back(); i++)
+    {
+      uint32_t bit = (h1 + i * h2) % bits;
+      if (!(bloom[bit / 8] & (1 << (bit % 8))))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+static std::string segmentName(uint32_t lo, uint32_t hi, const char *ext)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%08x-%08x.%s", (unsigned)lo, (unsigned)hi, ext);
+  return name;
+}
+
+static std::string logName(uint32_t number)
+{
+  char name[24];
+  snprintf(name, sizeof(name), "%08x.log", (unsigned)number);
+  return name;
+}
+
+// Walks one decoded block: [varint key len][varint value len << 1 | tombstone][key][value]
+static bool decodeRecord(const uint8_t *&p, const uint8_t *end, const char *&key, uint32_t &keyLen,
+                         const char *&value, uint32_t &valueLen, bool &tombstone)
+{
+  uint32_t lenField;
+  if (!getVarint(p, end, keyLen) || !getVarint(p, end, lenField))
+  {
+    return false;
+  }
+  valueLen = lenField >> 1;
+  tombstone = lenField & 1;
+  if ((size_t)(end - p) < (size_t)keyLen + valueLen)
+  {
+    return false;
+  }
+  key = (const char *)p;
+  value = key + keyLen;
+  p += keyLen + valueLen;
+  return true;
+}
+
+// ---- Iterators -------------------------------------------------------------
+
+class KvIter
+{
+public:
+  virtual ~KvIter() {}
+  virtual bool valid() const = 0;
+  virtual void next() = 0;
+  virtual const std::string &key() const = 0;
+  virtual const std::string &value() const = 0;
+  virtual bool tombstone() const = 0;
+  // False after a read or checksum error
+  virtual bool ok() const { return true; }
+};
+
+class KvMemIter : public KvIter
+{
+private:
+  KvMemtable &mem;
+  uint32_t node;
+  std::string k;
+  std::string v;
+
+  void load()
+  {
+    if (node)
+    {
+      k.assign(mem.keyOf(node), mem.keyLength(node));
+      v.assign(mem.valueOf(node), mem.valueLength(node));
+    }
+  }
+
+public:
+  KvMemIter(KvMemtable &mem, const std::string &start) : mem(mem), node(mem.first(start)) { load(); }
+  bool valid() const override { return node != 0; }
+  void next() override
+  {
+    node = mem.next(node);
+    load();
+  }
+  const std::string &key() const override { return k; }
+  const std::string &value() const override { return v; }
+  bool tombstone() const override { return mem.isTombstone(node); }
+};
+
+class KvSegmentIter : public KvIter
+{
+private:
+  const KvSegment &segment;
+  KvFile &file;
+  size_t block;
+  std::string data;
+  size_t pos;
+  bool good;
+  bool atEnd;
+  std::string k;
+  std::string v;
+  bool dead;
+
+  bool loadBlock()
+  {
+    while (block < segment.index.size())
+    {
+      const KvIndexEntry &e = segment.index[block];
+      data.resize(e.size);
+      if (!file.readAt(e.offset, &data[0], e.size) || kvCrc32(data.data(), e.size) != e.crc)
+      {
+        good = false;
+        return false;
+      }
+      pos = 0;
+      if (e.size > 0)
+      {
+        return true;
+      }
+      block++;
+    }
+    return false;
+  }
+
+  void decode()
+  {
+    while (true)
+    {
+      if (pos >= data.size())
+      {
+        block++;
+        if (!loadBlock())
+        {
+          atEnd = true;
+          return;
+        }
+      }
+      const uint8_t *p = (const uint8_t *)data.data() + pos;
+      const uint8_t *end = (const uint8_t *)data.data() + data.size();
+      const char *key;
+      const char *value;
+      uint32_t keyLen;
+      uint32_t valueLen;
+      if (!decodeRecord(p, end, key, keyLen, value, valueLen, dead))
+      {
+        good = false;
+        atEnd = true;
+        return;
+      }
+      pos = p - (const uint8_t *)data.data();
+      k.assign(key, keyLen);
+      v.assign(value, valueLen);
+      return;
+    }
+  }
+
+public:
+  KvSegmentIter(const KvSegment &segment, KvFile &file, const std::string &start)
+      : segment(segment), file(file), block(segment.findBlock(start)), pos(0), good(true), atEnd(false), dead(false)
+  {
+    if (!loadBlock())
+    {
+      atEnd = true;
+      return;
+    }
+    decode();
+    while (!atEnd && k < start)
+    {
+      decode();
+    }
+  }
+  bool valid() const override { return !atEnd; }
+  void next() override { decode(); }
+  const std::string &key() const override { return k; }
+  const std::string &value() const override { return v; }
+  bool tombstone() const override { return dead; }
+  bool ok() const override { return good; }
+};
+
+// Merges sources given newest first; of equal keys only the newest is seen
+class KvMergeIter : public KvIter
+{
+private:
+  std::vector<KvIter *> sources;
+  KvIter *current;
+
+  void pick()
+  {
+    current = nullptr;
+    for (KvIter *s : sources)
+    {
+      if (s->valid() && (current == nullptr || s->key() < current->key()))
+      {
+        current = s;
+      }
+    }
+  }
+
+public:
+  KvMergeIter(const std::vector<KvIter *> &sources) : sources(sources), current(nullptr) { pick(); }
+  bool valid() const override { return current != nullptr; }
+  void next() override
+  {
+    std::string key = current->key();
+    for (KvIter *s : sources)
+    {
+      if (s->valid() && s->key() == key)
+      {
+        s->next();
+      }
+    }
+    pick();
+  }
+  const std::string &key() const override { return current->key(); }
+  const std::string &value() const override { return current->value(); }
+  bool tombstone() const override { return current->tombstone(); }
+  bool ok() const override
+  {
+    for (KvIter *s : sources)
+    {
+      if (!s->ok())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// ---- Store -----------------------------------------------------------------
+
+KvStore::KvStore()
+    : opened(false), logNumber(0), immutableLog(0), logBytes(0), immutableLogBytes(0), nextNumber(1),
+      flushFailed(false), cacheTick(0)
+{
+  memset(&stats, 0, sizeof(stats));
+  for (CachedBlock &slot : cache)
+  {
+    slot.segment = nullptr;
+    slot.block = 0;
+    slot.lastUse = 0;
+  }
+}
+
+KvStore::~KvStore()
+{
+  close();
+}
+
+std::string KvStore::filePath(const std::string &name) const
+{
+  return dir + "/" + name;
+}
+
+void KvStore::fileChanged(KvFileEvent event, const std::string &name, uint64_t bytes)
+{
+  if (options.onFileChange)
+  {
+    options.onFileChange(event, filePath(name), bytes);
+  }
+}
+
+bool KvStore::openLog()
+{
+  logNumber = nextNumber++;
+  logBytes = 0;
+  log.reset(new KvFile());
+  if (!log->open(filePath(logName(logNumber)), true))
+  {
+    error = "cannot create log";
+    return false;
+  }
+  fileChanged(KV_FILE_CREATED, logName(logNumber), 0);
+  return true;
+}
+
+std::shared_ptr<KvSegment> KvStore::loadSegment(const std::string &name, uint32_t lo, uint32_t hi)
+{
+  std::shared_ptr<KvSegment> segment = std::make_shared<KvSegment>();
+  segment->name = name;
+  segment->lo = lo;
+  segment->hi = hi;
+  KvFooter footer;
+  if (!segment->file.open(filePath(name), false))
+  {
+    return nullptr;
+  }
+  segment->fileSize = segment->file.size();
+  if (segment->fileSize < sizeof(footer) ||
+      !segment->file.readAt(segment->fileSize - sizeof(footer), &footer, sizeof(footer)) ||
+      memcmp(footer.magic, "KVS1", 4) != 0 || kvCrc32(&footer, offsetof(KvFooter, crc)) != footer.crc ||
+      (uint64_t)footer.indexOffset + footer.indexSize > segment->fileSize ||
+      (uint64_t)footer.bloomOffset + footer.bloomSize > segment->fileSize)
+  {
+    return nullptr;
+  }
+
+  std::string raw(footer.indexSize, '\0');
+  segment->bloom.resize(footer.bloomSize);
+  if (!segment->file.readAt(footer.indexOffset, &raw[0], raw.size()) || kvCrc32(raw.data(), raw.size()) != footer.indexCrc ||
+      !segment->file.readAt(footer.bloomOffset, segment->bloom.data(), footer.bloomSize) ||
+      kvCrc32(segment->bloom.data(), footer.bloomSize) != footer.bloomCrc)
+  {
+    return nullptr;
+  }
+
+  const uint8_t *p = (const uint8_t *)raw.data();
+  const uint8_t *end = p + raw.size();
+  segment->index.reserve(footer.blocks);
+  for (uint32_t i = 0; i < footer.blocks; i++)
+  {
+    KvIndexEntry e;
+    if (!getVarint(p, end, e.keyLen) || (size_t)(end - p) < (size_t)e.keyLen + 12)
+    {
+      return nullptr;
+    }
+    e.keyOffset = segment->indexKeys.size();
+    segment->indexKeys.append((const char *)p, e.keyLen);
+    p += e.keyLen;
+    e.offset = getFixed32(p);
+    e.size = getFixed32(p + 4);
+    e.crc = getFixed32(p + 8);
+    p += 12;
+    segment->index.push_back(e);
+  }
+  segment->entries = footer.entries;
+  segment->tombstones = footer.tombstones;
+  return segment;
+}
+
+std::shared_ptr<KvSegment> KvStore::writeSegment(KvIter &source, uint32_t lo, uint32_t hi, uint64_t expectedKeys,
+                                                 bool dropTombstones, uint64_t &bytes)
+{
+  std::shared_ptr<KvSegment> segment = std::make_shared<KvSegment>();
+  segment->name = segmentName(lo, hi, "kvs");
+  segment->lo = lo;
+  segment->hi = hi;
+  segment->entries = 0;
+  segment->tombstones = 0;
+
+  std::string tmpName = segmentName(lo, hi, "tmp");
+  KvFile out(true);
+  if (!out.open(filePath(tmpName), true))
+  {
+    return nullptr;
+  }
+
+  uint32_t bloomBits = std::max<uint64_t>(64, expectedKeys * KV_BLOOM_BITS_PER_KEY);
+  bloomBits = (bloomBits + 7) & ~7u;
+  segment->bloom.assign(bloomBits / 8 + 1, 0);
+  segment->bloom.back() = KV_BLOOM_BITS_PER_KEY * 69 / 100; // k = bits per key * ln 2
+
+  std::string block;
+  std::string indexRaw;
+  block.reserve(KV_BLOCK_SIZE * 2);
+  uint32_t offset = 0;
+  bool ok = true;
+
+  auto finishBlock = [&](const std::string &lastKey) {
+    KvIndexEntry e;
+    e.keyOffset = segment->indexKeys.size();
+    e.keyLen = lastKey.size();
+    e.offset = offset;
+    e.size = block.size();
+    e.crc = kvCrc32(block.data(), block.size());
+    segment->indexKeys += lastKey;
+    segment->index.push_back(e);
+    putVarint(indexRaw, e.keyLen);
+    indexRaw += lastKey;
+    putFixed32(indexRaw, e.offset);
+    putFixed32(indexRaw, e.size);
+    putFixed32(indexRaw, e.crc);
+    ok = ok && out.write(block.data(), block.size());
+    offset += block.size();
+    block.clear();
+  };
+
+  std::string lastKey;
+  for (; source.valid() && ok; source.next())
+  {
+    if (source.tombstone() && dropTombstones)
+    {
+      continue;
+    }
+    const std::string &key = source.key();
+    const std::string &value = source.value();
+    putVarint(block, key.size());
+    putVarint(block, (source.tombstone() ? 0 : value.size() << 1) | (source.tombstone() ? 1 : 0));
+    block += key;
+    if (!source.tombstone())
+    {
+      block += value;
+    }
+    segment->entries++;
+    segment->tombstones += source.tombstone();
+
+    uint64_t h = kvHash(key.data(), key.size());
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for (uint8_t i = 0; i < segment->bloom.back(); i++)
+    {
+      uint32_t bit = (h1 + i * h2) % bloomBits;
+      segment->bloom[bit / 8] |= 1 << (bit % 8);
+    }
+
+    lastKey = key;
+    if (block.size() >= KV_BLOCK_SIZE)
+    {
+      finishBlock(lastKey);
+    }
+  }
+  if (!block.empty())
+  {
+    finishBlock(lastKey);
+  }
+  ok = ok && source.ok();
+
+  KvFooter footer;
+  memset(&footer, 0, sizeof(footer));
+  memcpy(footer.magic, "KVS1", 4);
+  footer.indexOffset = offset;
+  footer.indexSize = indexRaw.size();
+  footer.indexCrc = kvCrc32(indexRaw.data(), indexRaw.size());
+  footer.bloomOffset = offset + indexRaw.size();
+  footer.bloomSize = segment->bloom.size();
+  footer.bloomCrc = kvCrc32(segment->bloom.data(), segment->bloom.size());
+  footer.blocks = segment->index.size();
+  footer.entries = segment->entries;
+  footer.tombstones = segment->tombstones;
+  footer.crc = kvCrc32(&footer, offsetof(KvFooter, crc));
+
+  ok = ok && out.write(indexRaw.data(), indexRaw.size()) &&
+       out.write(segment->bloom.data(), segment->bloom.size()) && out.write(&footer, sizeof(footer)) && out.sync();
+  out.close();
+  segment->fileSize = (uint64_t)footer.bloomOffset + footer.bloomSize + sizeof(footer);
+
+  // A segment only gets its final name once it is complete
+  kvRemove(filePath(segment->name));
+  if (!ok || !kvRename(filePath(tmpName), filePath(segment->name)) || !segment->file.open(filePath(segment->name), false))
+  {
+    kvRemove(filePath(tmpName));
+    return nullptr;
+  }
+  bytes = segment->fileSize;
+  fileChanged(KV_FILE_CREATED, segment->name, segment->fileSize);
+  return segment;
+}
+
+bool KvStore::replayLog(const std::string &name)
+{
+  KvFile in(true);
+  if (!in.open(filePath(name), false))
+  {
+    return false;
+  }
+  std::string raw(in.size(), '\0');
+  if (!raw.empty() && !in.readAt(0, &raw[0], raw.size()))
+  {
+    return false;
+  }
+  in.close();
+
+  // Walk the intact records twice: once to size the memtable, then to fill it
+  auto walk = [&raw](const std::function<void(uint8_t type, const uint8_t *key, uint32_t keyLen, uint32_t valueLen)> &fn) {
+    const uint8_t *p = (const uint8_t *)raw.data();
+    const uint8_t *end = p + raw.size();
+    while (end - p >= 8)
+    {
+      uint32_t crc = getFixed32(p);
+      uint32_t len = getFixed32(p + 4);
+      if ((size_t)(end - p - 8) < len || len < 1 || kvCrc32(p + 8, len) != crc)
+      {
+        break; // torn tail of the last write
+      }
+      const uint8_t *q = p + 9;
+      const uint8_t *recordEnd = p + 8 + len;
+      uint32_t keyLen;
+      uint32_t valueLen;
+      if (!getVarint(q, recordEnd, keyLen) || !getVarint(q, recordEnd, valueLen) ||
+          (size_t)(recordEnd - q) != (size_t)keyLen + valueLen)
+      {
+        break;
+      }
+      fn(p[8], q, keyLen, valueLen);
+      p = recordEnd;
+    }
+  };
+
+  size_t needed = KvMemtable::nodeSize(KvMemtable::MAX_HEIGHT, 0, 0);
+  walk([&needed](uint8_t, const uint8_t *, uint32_t keyLen, uint32_t valueLen) {
+    needed += KvMemtable::nodeSize(KvMemtable::MAX_HEIGHT, keyLen, valueLen);
+  });
+  KvMemtable mem;
+  if (!mem.init(needed, options.alloc, options.release))
+  {
+    error = "out of memory";
+    return false;
+  }
+  walk([&mem](uint8_t type, const uint8_t *key, uint32_t keyLen, uint32_t valueLen) {
+    mem.add((const char *)key, keyLen, (const char *)key + keyLen, valueLen, type == KV_LOG_DELETE);
+  });
+
+  uint32_t number = strtoul(name.c_str(), nullptr, 16);
+  if (mem.count() > 0)
+  {
+    KvMemIter it(mem, std::string());
+    uint64_t bytes = 0;
+    std::shared_ptr<KvSegment> segment = writeSegment(it, number, number, mem.count(), false, bytes);
+    if (!segment)
+    {
+      error = "cannot write segment";
+      return false;
+    }
+    segments.push_back(segment);
+  }
+  kvRemove(filePath(name));
+  fileChanged(KV_FILE_REMOVED, name, raw.size());
+  return true;
+}
+
+bool KvStore::open(const std::string &path, const KvOptions &opts)
+{
+  close();
+  dir = path;
+  options = opts;
+  error.clear();
+  flushFailed = false;
+  memset(&stats, 0, sizeof(stats));
+  if (!kvMakeDir(dir))
+  {
+    error = "cannot create directory";
+    return false;
+  }
+
+  std::vector<std::string> names;
+  if (!kvListDir(dir, names))
+  {
+    error = "cannot list directory";
+    return false;
+  }
+  struct Found
+  {
+    uint32_t lo;
+    uint32_t hi;
+    std::string name;
+  };
+  std::vector<Found> found;
+  std::vector<uint32_t> logs;
+  for (const std::string &name : names)
+  {
+    unsigned lo;
+    unsigned hi;
+    char ext[8];
+    if (sscanf(name.c_str(), "%8x-%8x.%7s", &lo, &hi, ext) == 3 && strcmp(ext, "kvs") == 0)
+    {
+      found.push_back({lo, hi, name});
+    }
+    else if (sscanf(name.c_str(), "%8x.%7s", &lo, ext) == 2 && strcmp(ext, "log") == 0)
+    {
+      logs.push_back(lo);
+      hi = lo;
+    }
+    else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)
+    {
+      kvRemove(filePath(name)); // unfinished segment
+    }
+    else
+    {
+      continue;
+    }
+    nextNumber = std::max<uint32_t>(nextNumber, std::max(lo, hi) + 1);
+  }
+
+  // A compaction that stopped between renaming its output and removing its
+  // inputs leaves segments whose range lies inside another one
+  std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) {
+    return a.hi - a.lo > b.hi - b.lo;
+  });
+  for (size_t i = 0; i < found.size(); i++)
+  {
+    bool covered = false;
+    for (size_t j = 0; j < i && !covered; j++)
+    {
+      covered = found[j].lo <= found[i].lo && found[i].hi <= found[j].hi;
+    }
+    if (covered)
+    {
+      kvRemove(filePath(found[i].name));
+      found.erase(found.begin() + i--);
+    }
+  }
+  std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) { return a.hi < b.hi; });
+  for (const Found &f : found)
+  {
+    std::shared_ptr<KvSegment> segment = loadSegment(f.name, f.lo, f.hi);
+    if (!segment)
+    {
+      error = "corrupt segment " + f.name;
+      segments.clear();
+      return false;
+    }
+    segments.push_back(segment);
+  }
+
+  // Logs whose memtable already made it into a segment are stale
+  std::sort(logs.begin(), logs.end());
+  for (uint32_t number : logs)
+  {
+    bool covered = false;
+    for (const Found &f : found)
+    {
+      covered = covered || (f.lo <= number && number <= f.hi);
+    }
+    if (covered)
+    {
+      kvRemove(filePath(logName(number)));
+    }
+    else if (!replayLog(logName(number)))
+    {
+      if (error.empty())
+      {
+        error = "cannot replay " + logName(number);
+      }
+      segments.clear();
+      return false;
+    }
+  }
+
+  active.reset(new KvMemtable());
+  if (!active->init(options.memtableBytes, options.alloc, options.release))
+  {
+    error = "out of memory";
+    active.reset();
+    segments.clear();
+    return false;
+  }
+  if (!openLog())
+  {
+    segments.clear();
+    return false;
+  }
+  opened = true;
+  return true;
+}
+
+void KvStore::close()
+{
+  std::lock_guard<std::mutex> w(work);
+  std::lock_guard<std::mutex> held(lock);
+  if (log)
+  {
+    log->sync();
+    fileChanged(KV_FILE_GREW, logName(logNumber), logBytes);
+    log.reset();
+  }
+  for (CachedBlock &slot : cache)
+  {
+    slot.segment = nullptr;
+    slot.data.clear();
+  }
+  // The logs of both memtables stay behind and are replayed by open()
+  segments.clear();
+  active.reset();
+  immutable.reset();
+  spare.reset();
+  opened = false;
+  flushed.notify_all();
+}
+
+bool KvStore::freeze(std::unique_lock<std::mutex> &held)
+{
+  uint64_t start = nowUs();
+  while (immutable)
+  {
+    if (flushFailed)
+    {
+      error = "memtable flush failed";
+      return false;
+    }
+    if (options.wake)
+    {
+      options.wake();
+      flushed.wait_for(held, std::chrono::seconds(1));
+    }
+    else
+    {
+      held.unlock();
+      while (maintenance())
+      {
+      }
+      held.lock();
+      flushFailed = flushFailed || immutable != nullptr;
+    }
+    if (!opened)
+    {
+      return false;
+    }
+  }
+  stats.stallUs += nowUs() - start;
+
+  if (!spare)
+  {
+    spare.reset(new KvMemtable());
+    if (!spare->init(options.memtableBytes, options.alloc, options.release))
+    {
+      spare.reset();
+      error = "out of memory";
+      return false;
+    }
+  }
+  spare->reset();
+
+  log->sync();
+  fileChanged(KV_FILE_GREW, logName(logNumber), logBytes);
+  immutable = std::move(active);
+  active = std::move(spare);
+  immutableLog = logNumber;
+  immutableLogBytes = logBytes;
+  if (!openLog())
+  {
+    return false;
+  }
+  if (options.wake)
+  {
+    options.wake();
+  }
+  return true;
+}
+
+bool KvStore::write(const std::string &key, const std::string *value)
+{
+  if (key.empty() || key.size() > KV_MAX_KEY || (value && value->size() > KV_MAX_VALUE))
+  {
+    error = "key or value too large";
+    return false;
+  }
+  size_t valueLen = value ? value->size() : 0;
+
+  // Log record: crc, length, type, key length, value length, key, value
+  std::string record(8, '\0');
+  record += (char)(value ? KV_LOG_PUT : KV_LOG_DELETE);
+  putVarint(record, key.size());
+  putVarint(record, valueLen);
+  record += key;
+  if (value)
+  {
+    record += *value;
+  }
+  uint32_t len = record.size() - 8;
+  uint32_t crc = kvCrc32(record.data() + 8, len);
+  memcpy(&record[0], &crc, 4);
+  memcpy(&record[4], &len, 4);
+
+  std::unique_lock<std::mutex> held(lock);
+  if (!opened)
+  {
+    error = "store not open";
+    return false;
+  }
+  if (!active->fits(key.size(), valueLen) && !freeze(held))
+  {
+    return false;
+  }
+  if (!log->write(record.data(), record.size()) || (options.syncWrites && !log->sync()))
+  {
+    error = "log write failed";
+    return false;
+  }
+  logBytes += record.size();
+  active->add(key.data(), key.size(), value ? value->data() : "", valueLen, value == nullptr);
+  value ? stats.puts++ : stats.deletes++;
+  return true;
+}
+
+bool KvStore::put(const std::string &key, const std::string &value)
+{
+  return write(key, &value);
+}
+
+bool KvStore::remove(const std::string &key)
+{
+  return write(key, nullptr);
+}
+
+const std::string *KvStore::readBlock(KvSegment &segment, uint32_t block)
+{
+  CachedBlock *victim = &cache[0];
+  for (CachedBlock &slot : cache)
+  {
+    if (slot.segment == &segment && slot.block == block)
+    {
+      slot.lastUse = ++cacheTick;
+      stats.cacheHits++;
+      return &slot.data;
+    }
+    if (slot.lastUse < victim->lastUse)
+    {
+      victim = &slot;
+    }
+  }
+
+  const KvIndexEntry &e = segment.index[block];
+  victim->segment = nullptr;
+  victim->data.resize(e.size);
+  stats.blockReads++;
+  if (!segment.file.readAt(e.offset, &victim->data[0], e.size) || kvCrc32(victim->data.data(), e.size) != e.crc)
+  {
+    error = "bad block in " + segment.name;
+    return nullptr;
+  }
+  victim->segment = &segment;
+  victim->block = block;
+  victim->lastUse = ++cacheTick;
+  return &victim->data;
+}
+
+bool KvStore::get(const std::string &key, std::string &value)
+{
+  std::lock_guard<std::mutex> held(lock);
+  if (!opened)
+  {
+    return false;
+  }
+  stats.gets++;
+  int found = active->get(key, value);
+  if (found == 0 && immutable)
+  {
+    found = immutable->get(key, value);
+  }
+  for (size_t i = segments.size(); found == 0 && i-- > 0;)
+  {
+    KvSegment &segment = *segments[i];
+    if (!segment.mayContain(key))
+    {
+      stats.bloomSkips++;
+      continue;
+    }
+    size_t block = segment.findBlock(key);
+    if (block == segment.index.size())
+    {
+      continue;
+    }
+    const std::string *data = readBlock(segment, block);
+    if (data == nullptr)
+    {
+      return false;
+    }
+    const uint8_t *p = (const uint8_t *)data->data();
+    const uint8_t *end = p + data->size();
+    const char *k;
+    const char *v;
+    uint32_t keyLen;
+    uint32_t valueLen;
+    bool tombstone;
+    while (p < end && decodeRecord(p, end, k, keyLen, v, valueLen, tombstone))
+    {
+      int c = compareKeys(k, keyLen, key.data(), key.size());
+      if (c == 0)
+      {
+        found = tombstone ? -1 : 1;
+        value.assign(v, valueLen);
+        break;
+      }
+      if (c > 0)
+      {
+        break;
+      }
+    }
+  }
+  stats.getHits += found == 1;
+  return found == 1;
+}
+
+size_t KvStore::scan(const std::string &start, const std::string &end, size_t limit,
+                     const std::function<bool(const std::string &key, const std::string &value)> &fn)
+{
+  std::lock_guard<std::mutex> held(lock);
+  if (!opened)
+  {
+    return 0;
+  }
+  std::vector<std::unique_ptr<KvIter>> owned;
+  owned.emplace_back(new KvMemIter(*active, start));
+  if (immutable)
+  {
+    owned.emplace_back(new KvMemIter(*immutable, start));
+  }
+  for (size_t i = segments.size(); i-- > 0;)
+  {
+    owned.emplace_back(new KvSegmentIter(*segments[i], segments[i]->file, start));
+  }
+  std::vector<KvIter *> sources;
+  for (auto &it : owned)
+  {
+    sources.push_back(it.get());
+  }
+
+  size_t count = 0;
+  for (KvMergeIter merge(sources); merge.valid() && count < limit; merge.next())
+  {
+    if (!end.empty() && merge.key() >= end)
+    {
+      break;
+    }
+    if (merge.tombstone())
+    {
+      continue;
+    }
+    count++;
+    if (!fn(merge.key(), merge.value()))
+    {
+      break;
+    }
+  }
+  return count;
+}
+
+bool KvStore::sync()
+{
+  std::lock_guard<std::mutex> held(lock);
+  return opened && log->sync();
+}
+
+bool KvStore::flush()
+{
+  std::unique_lock<std::mutex> held(lock);
+  if (!opened)
+  {
+    return false;
+  }
+  return active->count() == 0 || freeze(held);
+}
+
+bool KvStore::flushImmutable()
+{
+  KvMemtable *mem;
+  uint32_t number;
+  {
+    std::lock_guard<std::mutex> held(lock);
+    if (!opened || !immutable)
+    {
+      return false;
+    }
+    mem = immutable.get();
+    number = immutableLog;
+  }
+
+  // The frozen memtable is not modified any more, so it is read unlocked
+  KvMemIter it(*mem, std::string());
+  uint64_t bytes = 0;
+  std::shared_ptr<KvSegment> segment = writeSegment(it, number, number, mem->count(), false, bytes);
+
+  std::lock_guard<std::mutex> held(lock);
+  if (!segment)
+  {
+    error = "cannot write segment";
+    flushFailed = true;
+    flushed.notify_all();
+    return false;
+  }
+  segments.push_back(segment);
+  kvRemove(filePath(logName(number)));
+  fileChanged(KV_FILE_REMOVED, logName(number), immutableLogBytes);
+  spare = std::move(immutable);
+  flushFailed = false;
+  stats.flushes++;
+  stats.bytesFlushed += bytes;
+  flushed.notify_all();
+  return true;
+}
+
+bool KvStore::compact()
+{
+  std::vector<std::shared_ptr<KvSegment>> inputs;
+  bool dropTombstones;
+  uint64_t expected = 0;
+  {
+    std::lock_guard<std::mutex> held(lock);
+    if (!opened || segments.size() <= KV_MAX_SEGMENTS)
+    {
+      return false;
+    }
+    // The adjacent run with the fewest bytes, so large old segments are
+    // rewritten rarely (size-tiered)
+    size_t best = 0;
+    uint64_t bestBytes = UINT64_MAX;
+    for (size_t i = 0; i + KV_COMPACT_WIDTH <= segments.size(); i++)
+    {
+      uint64_t sum = 0;
+      for (size_t j = i; j < i + KV_COMPACT_WIDTH; j++)
+      {
+        sum += segments[j]->fileSize;
+      }
+      if (sum < bestBytes)
+      {
+        best = i;
+        bestBytes = sum;
+      }
+    }
+    inputs.assign(segments.begin() + best, segments.begin() + best + KV_COMPACT_WIDTH);
+    // Tombstones can go once nothing older is left to shadow
+    dropTombstones = best == 0;
+    for (auto &s : inputs)
+    {
+      expected += s->entries;
+    }
+  }
+
+  // Inputs are immutable; they are read through their own handles so lookups
+  // keep using the shared ones
+  std::vector<std::unique_ptr<KvFile>> files;
+  std::vector<std::unique_ptr<KvIter>> owned;
+  std::vector<KvIter *> sources;
+  for (size_t i = inputs.size(); i-- > 0;)
+  {
+    files.emplace_back(new KvFile(true));
+    if (!files.back()->open(filePath(inputs[i]->name), false))
+    {
+      return false;
+    }
+    owned.emplace_back(new KvSegmentIter(*inputs[i], *files.back(), std::string()));
+    sources.push_back(owned.back().get());
+  }
+  KvMergeIter merge(sources);
+  uint64_t bytes = 0;
+  std::shared_ptr<KvSegment> output =
+      writeSegment(merge, inputs.front()->lo, inputs.back()->hi, expected, dropTombstones, bytes);
+  owned.clear();
+  files.clear();
+  if (!output)
+  {
+    std::lock_guard<std::mutex> held(lock);
+    error = "compaction failed";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> held(lock);
+  // Flushes only append, so the inputs are still one run
+  auto first = std::find(segments.begin(), segments.end(), inputs.front());
+  first = segments.erase(first, first + inputs.size());
+  segments.insert(first, output);
+  for (auto &s : inputs)
+  {
+    for (CachedBlock &slot : cache)
+    {
+      if (slot.segment == s.get())
+      {
+        slot.segment = nullptr;
+        slot.lastUse = 0;
+      }
+    }
+    s->file.close();
+    kvRemove(filePath(s->name));
+    fileChanged(KV_FILE_REMOVED, s->name, s->fileSize);
+  }
+  stats.compactions++;
+  stats.bytesCompacted += bytes;
+  return true;
+}
+
+bool KvStore::maintenance()
+{
+  std::lock_guard<std::mutex> w(work);
+  return flushImmutable() || compact();
+}
+
+KvStats KvStore::getStats()
+{
+  std::lock_guard<std::mutex> held(lock);
+  KvStats s = stats;
+  s.segments = segments.size();
+  for (auto &segment : segments)
+  {
+    s.segmentBytes += segment->fileSize;
+    s.segmentEntries += segment->entries;
+  }
+  s.memtableUsed = active ? active->bytesUsed() : 0;
+  s.memtableBytes = options.memtableBytes;
+  return s;
+}
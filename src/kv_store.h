@@ -0,0 +1,174 @@
+#ifndef __KV_STORE_H
+#define __KV_STORE_H
+
+// Portable C++ only: the same engine runs on the device (/kv, through
+// kv_service.*) and on the host (tools/kv_bench.cpp). On the ESP32 files are
+// opened through FatFs directly so open segments do not use up the VFS's
+// five file descriptors.
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Log-structured key/value store in one directory:
+//
+//   <n>.log          write-ahead log of the memtable with number n
+//   <lo>-<hi>.kvs    immutable sorted segment holding the data of the logs
+//                    lo..hi (a flush gives n-n, a compaction merges ranges)
+//
+// Writes go to the log and to a skiplist memtable in one arena (PSRAM on the
+// ESP32). A full memtable is frozen and written as a segment by
+// maintenance(), which also merges runs of adjacent segments once there are
+// more than KV_MAX_SEGMENTS. A segment holds ~4 KB data blocks, a block
+// index (last key, offset, CRC of every block) and a bloom filter; both are
+// kept in memory, so a lookup reads at most one block per segment whose
+// filter matches.
+#define KV_BLOCK_SIZE 4096
+#define KV_MEMTABLE_BYTES (1024 * 1024)
+#define KV_BLOOM_BITS_PER_KEY 10
+#define KV_MAX_SEGMENTS 8
+#define KV_COMPACT_WIDTH 4
+#define KV_BLOCK_CACHE_SLOTS 16
+#define KV_MAX_KEY 1024
+#define KV_MAX_VALUE (64 * 1024)
+
+enum KvFileEvent
+{
+    KV_FILE_CREATED,
+    KV_FILE_GREW,
+    KV_FILE_REMOVED
+};
+
+class KvFile;
+class KvIter;
+class KvMemtable;
+struct KvSegment;
+
+struct KvOptions
+{
+    size_t memtableBytes = KV_MEMTABLE_BYTES;
+    // Sync the log after every write instead of on sync()
+    bool syncWrites = false;
+    // Memtable arenas; malloc/free when not set
+    void *(*alloc)(size_t) = nullptr;
+    void (*release)(void *) = nullptr;
+    // Called when maintenance() has work; without it the writer that fills
+    // the memtable runs maintenance itself
+    std::function<void()> wake;
+    // A file of the store was created with, grew by or was removed with
+    // `bytes`
+    std::function<void(KvFileEvent event, const std::string &path, uint64_t bytes)> onFileChange;
+};
+
+struct KvStats
+{
+    uint64_t puts;
+    uint64_t deletes;
+    uint64_t gets;
+    uint64_t getHits;
+    uint64_t bloomSkips;
+    uint64_t blockReads;
+    uint64_t cacheHits;
+    uint64_t flushes;
+    uint64_t compactions;
+    uint64_t bytesFlushed;
+    uint64_t bytesCompacted;
+    uint64_t stallUs;
+    uint32_t segments;
+    uint64_t segmentBytes;
+    uint64_t segmentEntries;
+    size_t memtableUsed;
+    size_t memtableBytes;
+};
+
+class KvStore
+{
+private:
+    struct CachedBlock
+    {
+        const KvSegment *segment;
+        uint32_t block;
+        uint32_t lastUse;
+        std::string data;
+    };
+
+    std::string dir;
+    KvOptions options;
+    bool opened;
+    std::string error;
+
+    // `lock` guards everything below; `work` serializes maintenance()
+    std::mutex lock;
+    std::mutex work;
+    std::condition_variable flushed;
+
+    std::unique_ptr<KvMemtable> active;
+    std::unique_ptr<KvMemtable> immutable;
+    std::unique_ptr<KvMemtable> spare;
+    std::unique_ptr<KvFile> log;
+    uint32_t logNumber;
+    uint32_t immutableLog;
+    uint64_t logBytes;
+    uint64_t immutableLogBytes;
+    uint32_t nextNumber;
+    bool flushFailed;
+    // Oldest first
+    std::vector<std::shared_ptr<KvSegment>> segments;
+
+    CachedBlock cache[KV_BLOCK_CACHE_SLOTS];
+    uint32_t cacheTick;
+    KvStats stats;
+
+    std::string filePath(const std::string &name) const;
+    bool openLog();
+    bool replayLog(const std::string &name);
+    bool freeze(std::unique_lock<std::mutex> &held);
+    bool write(const std::string &key, const std::string *value);
+    bool flushImmutable();
+    bool compact();
+    std::shared_ptr<KvSegment> writeSegment(KvIter &source, uint32_t lo, uint32_t hi,
+                                            uint64_t expectedKeys, bool dropTombstones, uint64_t &bytes);
+    std::shared_ptr<KvSegment> loadSegment(const std::string &name, uint32_t lo, uint32_t hi);
+    const std::string *readBlock(KvSegment &segment, uint32_t block);
+    void fileChanged(KvFileEvent event, const std::string &name, uint64_t bytes);
+
+public:
+    KvStore();
+    ~KvStore();
+    KvStore(const KvStore &) = delete;
+    KvStore &operator=(const KvStore &) = delete;
+
+    // Creates the directory if needed, drops leftovers of an interrupted
+    // compaction and replays the logs into a segment
+    bool open(const std::string &dir, const KvOptions &options = KvOptions());
+    void close();
+    bool isOpen() const { return opened; }
+    const std::string &lastError() const { return error; }
+
+    bool put(const std::string &key, const std::string &value);
+    bool remove(const std::string &key);
+    // False when the key is missing or deleted
+    bool get(const std::string &key, std::string &value);
+
+    // Keys in [start, end) in order (end empty = no upper bound); stops
+    // after `limit` keys or when fn returns false
+    size_t scan(const std::string &start, const std::string &end, size_t limit,
+                const std::function<bool(const std::string &key, const std::string &value)> &fn);
+
+    // Flush the log to the card
+    bool sync();
+
+    // One step of background work: write the frozen memtable or run a
+    // compaction. Returns true if it did something.
+    bool maintenance();
+    // Freeze the memtable even if it is not full (call maintenance() after)
+    bool flush();
+
+    KvStats getStats();
+};
+
+#endif
@@ -0,0 +1,214 @@
+#include "lz4_block.h"
+#include <string.h>
+
+// The block format requires the last 5 bytes to be literals and no match to
+// start in the last 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t hashOf(uint32_t seq)
+{
+  return (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Length continuation bytes: 255 255 ... rest
+static inline uint8_t *putLength(uint8_t *op, size_t len)
+{
+  while (len >= 255)
+  {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static uint8_t *emitSequence(uint8_t *op, uint8_t *opEnd, const uint8_t *literals, size_t literalLen,
+                             size_t offset, size_t matchLen)
+{
+  // Token, worst-case length bytes, literals, offset
+  if ((size_t)(opEnd - op) < 1 + literalLen / 255 + 1 + literalLen + 2 + matchLen / 255 + 1)
+  {
+    return nullptr;
+  }
+  uint8_t *token = op++;
+  *token = (uint8_t)((literalLen >= 15 ? 15 : literalLen) << 4);
+  if (literalLen >= 15)
+  {
+    op = putLength(op, literalLen - 15);
+  }
+  memcpy(op, literals, literalLen);
+  op += literalLen;
+  if (matchLen == 0)
+  {
+    return op; // last sequence: literals only
+  }
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+  size_t code = matchLen - LZ4_MIN_MATCH;
+  *token |= (uint8_t)(code >= 15 ? 15 : code);
+  if (code >= 15)
+  {
+    op = putLength(op, code - 15);
+  }
+  return op;
+}
+
+size_t lz4Compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstCapacity, void *tableMem)
+{
+  uint32_t *table = (uint32_t *)tableMem;
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + srcLen;
+  uint8_t *op = dst;
+  uint8_t *opEnd = dst + dstCapacity;
+
+  if (srcLen >= LZ4_MF_LIMIT + 1)
+  {
+    const uint8_t *mfLimit = end - LZ4_MF_LIMIT;
+    const uint8_t *matchLimit = end - LZ4_LAST_LITERALS;
+    memset(table, 0, LZ4_TABLE_BYTES);
+    ip++;
+    while (ip < mfLimit)
+    {
+      uint32_t seq = read32(ip);
+      uint32_t h = hashOf(seq);
+      const uint8_t *ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq)
+      {
+        // Incompressible stretches are skipped faster the longer they get
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1])
+      {
+        ip--;
+        ref--;
+      }
+      size_t len = LZ4_MIN_MATCH;
+      while (ip + len < matchLimit && ip[len] == ref[len])
+      {
+        len++;
+      }
+
+      op = emitSequence(op, opEnd, anchor, ip - anchor, ip - ref, len);
+      if (op == nullptr)
+      {
+        return 0;
+      }
+      ip += len;
+      anchor = ip;
+      if (ip < mfLimit)
+      {
+        table[hashOf(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+      }
+    }
+  }
+
+  op = emitSequence(op, opEnd, anchor, end - anchor, 0, 0);
+  return op ? op - dst : 0;
+}
+
+int lz4Decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstCapacity)
+{
+  const uint8_t *ip = src;
+  const uint8_t *ipEnd = src + srcLen;
+  uint8_t *op = dst;
+  uint8_t *opEnd = dst + dstCapacity;
+
+  while (ip < ipEnd)
+  {
+    uint8_t token = *ip++;
+    size_t literalLen = token >> 4;
+    if (literalLen == 15)
+    {
+      uint8_t b;
+      do
+      {
+        if (ip >= ipEnd)
+        {
+          return -1;
+        }
+        b = *ip++;
+        literalLen += b;
+      } while (b == 255);
+    }
+    if ((size_t)(ipEnd - ip) < literalLen || (size_t)(opEnd - op) < literalLen)
+    {
+      return -1;
+    }
+    memcpy(op, ip, literalLen);
+    ip += literalLen;
+    op += literalLen;
+    if (ip == ipEnd)
+    {
+      break; // the last sequence has no match
+    }
+
+    if (ipEnd - ip < 2)
+    {
+      return -1;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t matchLen = token & 15;
+    if (matchLen == 15)
+    {
+      uint8_t b;
+      do
+      {
+        if (ip >= ipEnd)
+        {
+          return -1;
+        }
+        b = *ip++;
+        matchLen += b;
+      } while (b == 255);
+    }
+    matchLen += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(opEnd - op) < matchLen)
+    {
+      return -1;
+    }
+    const uint8_t *match = op - offset;
+    if (offset >= matchLen)
+    {
+      memcpy(op, match, matchLen);
+      op += matchLen;
+    }
+    else if (offset == 1)
+    {
+      memset(op, *match, matchLen);
+      op += matchLen;
+    }
+    else
+    {
+      // Overlapping copy repeats the last `offset` bytes; chunks of at most
+      // `offset` bytes never read what they write
+      size_t step = offset >= 8 ? 8 : 1;
+      while (matchLen >= step)
+      {
+        memcpy(op, match, step);
+        op += step;
+        match += step;
+        matchLen -= step;
+      }
+      while (matchLen--)
+      {
+        *op++ = *match++;
+      }
+    }
+  }
+  return (int)(op - dst);
+}
@@ -0,0 +1,28 @@
+#ifndef __LZ4_BLOCK_H
+#define __LZ4_BLOCK_H
+
+// Portable C++ only: used by the compressed storage tier (lz4_store.*) and
+// by the host benchmark (tools/lz4_bench.cpp)
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash table of the compressor: 1 << LZ4_HASH_LOG 32-bit positions
+#define LZ4_HASH_LOG 12
+#define LZ4_TABLE_BYTES ((1 << LZ4_HASH_LOG) * 4)
+
+// Worst-case output size for n input bytes
+inline size_t lz4CompressBound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+// Compress src into the standard LZ4 block format (greedy, single hash
+// probe, like LZ4's fast mode). `table` must hold LZ4_TABLE_BYTES. Returns
+// the compressed size, or 0 if it does not fit in dstCapacity.
+size_t lz4Compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstCapacity, void *table);
+
+// Decompress an LZ4 block; every read and write is bounds checked. Returns
+// the decompressed size or -1 for corrupt input.
+int lz4Decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstCapacity);
+
+#endif
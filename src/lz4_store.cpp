@@ -0,0 +1,540 @@
+#include "lz4_store.h"
+#include "bg_job.h"
+#include "checksum.h"
+#include "du_tree.h"
+#include "fs_events.h"
+#include "lz4_block.h"
+#include "meta_cache.h"
+#include "sd_io_sched.h"
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct LzbHeader
+{
+  char magic[4]; // "LZB1"
+  uint32_t blockSize;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct LzbTrailer
+{
+  char magic[4]; // "LZBT"
+  uint32_t blockSize;
+  uint64_t originalSize;
+  uint32_t blockCount;
+  uint32_t indexOffset;
+  uint32_t indexCrc;
+  uint32_t crc;
+};
+static_assert(sizeof(LzbHeader) == 16, "header layout");
+static_assert(sizeof(LzbTrailer) == 32, "trailer layout");
+
+static const uint32_t LZB_RAW_BLOCK = 0x80000000u;
+static const uint8_t LZB_FINISH = 0xFF;
+
+static uint32_t crc32Of(const void *data, size_t len)
+{
+  Hasher crc(HASH_CRC32);
+  crc.update((const uint8_t *)data, len);
+  return crc.crc32();
+}
+
+static void *psramAlloc(size_t size)
+{
+  void *p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  return p ? p : malloc(size);
+}
+
+// ---- Writer ----------------------------------------------------------------
+
+LzbWriter::LzbWriter()
+    : table(nullptr), freeSlots(nullptr), fullSlots(nullptr), done(nullptr), current(-1), offset(0),
+      originalBytes(0), storedBytes(0), compressUs(0), failed(false), running(false)
+{
+  for (Slot &slot : slots)
+  {
+    slot.input = nullptr;
+    slot.output = nullptr;
+    slot.len = 0;
+  }
+}
+
+LzbWriter::~LzbWriter()
+{
+  if (running)
+  {
+    finish();
+  }
+  release();
+}
+
+void LzbWriter::release()
+{
+  for (Slot &slot : slots)
+  {
+    free(slot.input);
+    free(slot.output);
+    slot.input = nullptr;
+    slot.output = nullptr;
+  }
+  free(table);
+  table = nullptr;
+  if (freeSlots)
+  {
+    vQueueDelete((QueueHandle_t)freeSlots);
+    vQueueDelete((QueueHandle_t)fullSlots);
+    vSemaphoreDelete((SemaphoreHandle_t)done);
+    freeSlots = fullSlots = done = nullptr;
+  }
+}
+
+bool LzbWriter::begin(File f)
+{
+  file = f;
+  current = -1;
+  index.clear();
+  originalBytes = 0;
+  storedBytes = 0;
+  compressUs = 0;
+  failed = false;
+
+  // The hash table is hit on every input byte, so it goes to internal RAM
+  table = heap_caps_malloc(LZ4_TABLE_BYTES, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (table == nullptr)
+  {
+    table = psramAlloc(LZ4_TABLE_BYTES);
+  }
+  bool ok = table != nullptr;
+  for (Slot &slot : slots)
+  {
+    slot.input = (uint8_t *)psramAlloc(LZB_BLOCK_SIZE);
+    slot.output = (uint8_t *)psramAlloc(lz4CompressBound(LZB_BLOCK_SIZE));
+    ok = ok && slot.input && slot.output;
+  }
+  freeSlots = xQueueCreate(LZB_PIPELINE_SLOTS, sizeof(uint8_t));
+  fullSlots = xQueueCreate(LZB_PIPELINE_SLOTS + 1, sizeof(uint8_t));
+  done = xSemaphoreCreateBinary();
+  ok = ok && freeSlots && fullSlots && done;
+
+  LzbHeader header = {{'L', 'Z', 'B', '1'}, LZB_BLOCK_SIZE, 0, 0};
+  ok = ok && file && file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  if (!ok)
+  {
+    release();
+    return false;
+  }
+  offset = sizeof(header);
+  storedBytes = sizeof(header);
+  for (uint8_t i = 0; i < LZB_PIPELINE_SLOTS; i++)
+  {
+    xQueueSend((QueueHandle_t)freeSlots, &i, 0);
+  }
+
+  BaseType_t otherCore = xPortGetCoreID() == 0 ? 1 : 0;
+  TaskHandle_t handle;
+  if (xTaskCreatePinnedToCore(taskEntry, "lz4", LZB_TASK_STACK, this, BG_JOB_PRIORITY + 1, &handle, otherCore) !=
+      pdPASS)
+  {
+    release();
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+bool LzbWriter::write(const uint8_t *data, size_t len)
+{
+  while (len > 0 && running && !failed)
+  {
+    if (current < 0)
+    {
+      uint8_t i;
+      // Runs on the web server task: a stalled card fails the upload
+      if (xQueueReceive((QueueHandle_t)freeSlots, &i, pdMS_TO_TICKS(LZB_WRITE_WAIT_MS)) != pdTRUE)
+      {
+        Serial.println("Compressed upload: card too slow, giving up");
+        failed = true;
+        break;
+      }
+      current = i;
+      slots[current].len = 0;
+    }
+    Slot &slot = slots[current];
+    size_t n = min(len, (size_t)LZB_BLOCK_SIZE - slot.len);
+    memcpy(slot.input + slot.len, data, n);
+    slot.len += n;
+    data += n;
+    len -= n;
+    if (slot.len == LZB_BLOCK_SIZE)
+    {
+      uint8_t i = current;
+      xQueueSend((QueueHandle_t)fullSlots, &i, portMAX_DELAY);
+      current = -1;
+    }
+  }
+  return running && !failed;
+}
+
+bool LzbWriter::finish()
+{
+  if (!running)
+  {
+    return false;
+  }
+  if (current >= 0 && slots[current].len > 0)
+  {
+    uint8_t i = current;
+    xQueueSend((QueueHandle_t)fullSlots, &i, portMAX_DELAY);
+  }
+  current = -1;
+  xQueueSend((QueueHandle_t)fullSlots, &LZB_FINISH, portMAX_DELAY);
+  xSemaphoreTake((SemaphoreHandle_t)done, portMAX_DELAY);
+  running = false;
+  file.close();
+  release();
+  return !failed;
+}
+
+void LzbWriter::taskEntry(void *arg)
+{
+  ((LzbWriter *)arg)->run();
+  vTaskDelete(NULL);
+}
+
+bool LzbWriter::compressSlot(Slot &slot)
+{
+  int64_t start = esp_timer_get_time();
+  size_t packed = lz4Compress(slot.input, slot.len, slot.output, lz4CompressBound(LZB_BLOCK_SIZE), table);
+  uint32_t crc = crc32Of(slot.input, slot.len);
+  compressUs += esp_timer_get_time() - start;
+
+  // Blocks that do not shrink are stored as they are
+  bool raw = packed == 0 || packed >= slot.len;
+  uint32_t stored = raw ? slot.len : packed;
+  uint32_t header = stored | (raw ? LZB_RAW_BLOCK : 0);
+  SdIoScope io(SD_IO_BULK);
+  if (file.write((const uint8_t *)&header, 4) != 4 || file.write(raw ? slot.input : slot.output, stored) != stored)
+  {
+    return false;
+  }
+  index.push_back(offset);
+  index.push_back(crc);
+  offset += 4 + stored;
+  storedBytes += 4 + stored;
+  originalBytes += slot.len;
+  return true;
+}
+
+void LzbWriter::run()
+{
+  uint8_t i;
+  while (xQueueReceive((QueueHandle_t)fullSlots, &i, portMAX_DELAY) == pdTRUE && i != LZB_FINISH)
+  {
+    // After a failed write the pipeline only drains
+    if (!failed && !compressSlot(slots[i]))
+    {
+      failed = true;
+    }
+    xQueueSend((QueueHandle_t)freeSlots, &i, portMAX_DELAY);
+  }
+
+  if (!failed)
+  {
+    size_t indexBytes = index.size() * 4;
+    LzbTrailer trailer = {{'L', 'Z', 'B', 'T'}, LZB_BLOCK_SIZE, originalBytes, (uint32_t)(index.size() / 2), offset,
+                          crc32Of(index.data(), indexBytes), 0};
+    trailer.crc = crc32Of(&trailer, offsetof(LzbTrailer, crc));
+    failed = file.write((const uint8_t *)index.data(), indexBytes) != indexBytes ||
+             file.write((const uint8_t *)&trailer, sizeof(trailer)) != sizeof(trailer);
+    storedBytes += indexBytes + sizeof(trailer);
+  }
+  xSemaphoreGive((SemaphoreHandle_t)done);
+}
+
+// ---- Reader ----------------------------------------------------------------
+
+LzbReader::LzbReader()
+    : blockSize(0), originalSize(0), indexOffset(0), block(nullptr), packed(nullptr), cachedBlock(-1), cachedLen(0),
+      storedRead(0)
+{
+}
+
+LzbReader::~LzbReader()
+{
+  close();
+}
+
+void LzbReader::close()
+{
+  if (file)
+  {
+    file.close();
+  }
+  free(block);
+  free(packed);
+  block = nullptr;
+  packed = nullptr;
+  index.clear();
+  cachedBlock = -1;
+}
+
+bool LzbReader::open(fs::FS &fs, const String &path)
+{
+  close();
+  file = fs.open(path, FILE_READ);
+  if (!file)
+  {
+    return false;
+  }
+  size_t fileSize = file.size();
+  LzbHeader header;
+  LzbTrailer trailer;
+  if (fileSize < sizeof(header) + sizeof(trailer) || file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, "LZB1", 4) != 0 || !file.seek(fileSize - sizeof(trailer)) ||
+      file.read((uint8_t *)&trailer, sizeof(trailer)) != sizeof(trailer) || memcmp(trailer.magic, "LZBT", 4) != 0 ||
+      crc32Of(&trailer, offsetof(LzbTrailer, crc)) != trailer.crc || trailer.blockSize == 0 ||
+      trailer.blockSize > 1024 * 1024 ||
+      (uint64_t)trailer.indexOffset + trailer.blockCount * 8ull + sizeof(trailer) != fileSize)
+  {
+    close();
+    return false;
+  }
+
+  blockSize = trailer.blockSize;
+  originalSize = trailer.originalSize;
+  indexOffset = trailer.indexOffset;
+  index.resize(trailer.blockCount * 2);
+  size_t indexBytes = index.size() * 4;
+  block = (uint8_t *)psramAlloc(blockSize);
+  packed = (uint8_t *)psramAlloc(lz4CompressBound(blockSize) + 4);
+  if (!block || !packed || !file.seek(indexOffset) ||
+      file.read((uint8_t *)index.data(), indexBytes) != indexBytes || crc32Of(index.data(), indexBytes) != trailer.indexCrc)
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool LzbReader::loadBlock(uint32_t n)
+{
+  if (cachedBlock == (int32_t)n)
+  {
+    return true;
+  }
+  cachedBlock = -1;
+  uint32_t start = index[n * 2];
+  uint32_t end = n + 1 < index.size() / 2 ? index[(n + 1) * 2] : indexOffset;
+  size_t expected = min((uint64_t)blockSize, originalSize - (uint64_t)n * blockSize);
+  if (end <= start + 4 || end - start > lz4CompressBound(blockSize) + 4 || !file.seek(start) ||
+      file.read(packed, end - start) != end - start)
+  {
+    return false;
+  }
+  storedRead += end - start;
+
+  uint32_t header;
+  memcpy(&header, packed, 4);
+  size_t stored = header & ~LZB_RAW_BLOCK;
+  if (stored != end - start - 4)
+  {
+    return false;
+  }
+  if (header & LZB_RAW_BLOCK)
+  {
+    if (stored != expected)
+    {
+      return false;
+    }
+    memcpy(block, packed + 4, stored);
+  }
+  else if (lz4Decompress(packed + 4, stored, block, blockSize) != (int)expected)
+  {
+    return false;
+  }
+  if (crc32Of(block, expected) != index[n * 2 + 1])
+  {
+    return false;
+  }
+  cachedBlock = n;
+  cachedLen = expected;
+  return true;
+}
+
+size_t LzbReader::read(uint64_t offset, uint8_t *buffer, size_t len)
+{
+  size_t done = 0;
+  while (done < len && offset < originalSize)
+  {
+    uint32_t n = offset / blockSize;
+    if (!loadBlock(n))
+    {
+      Serial.printf("LZB: corrupt block %u\n", n);
+      return done;
+    }
+    size_t within = offset - (uint64_t)n * blockSize;
+    size_t chunk = min(len - done, cachedLen - within);
+    memcpy(buffer + done, block + within, chunk);
+    done += chunk;
+    offset += chunk;
+  }
+  return done;
+}
+
+// ---- Helpers ---------------------------------------------------------------
+
+bool lzbIsCompressed(const String &path)
+{
+  return path.endsWith(LZB_SUFFIX);
+}
+
+String lzbLogicalPath(const String &path)
+{
+  return lzbIsCompressed(path) ? path.substring(0, path.length() - strlen(LZB_SUFFIX)) : path;
+}
+
+String lzbTwinPath(const String &path)
+{
+  return lzbIsCompressed(path) ? lzbLogicalPath(path) : path + LZB_SUFFIX;
+}
+
+bool lzbRemoveTwin(fs::FS &fs, const String &path)
+{
+  String twin = lzbTwinPath(path);
+  FsMeta meta;
+  if (!g_metaCache.stat(twin, meta) || meta.isDirectory)
+  {
+    return false;
+  }
+  fsCacheInvalidate(twin);
+  if (!fs.remove(twin))
+  {
+    return false;
+  }
+  fsCacheInvalidate(twin);
+  duFileRemoved(twin, meta.size);
+  fsEventRemoved(twin, false);
+  return true;
+}
+
+bool lzbContentCrc32(fs::FS &fs, const String &path, uint32_t &crc)
+{
+  LzbReader reader;
+  if (!reader.open(fs, path))
+  {
+    return false;
+  }
+  Hasher hasher(HASH_CRC32);
+  uint8_t buffer[4096];
+  uint64_t offset = 0;
+  while (offset < reader.size())
+  {
+    size_t n = reader.read(offset, buffer, sizeof(buffer));
+    if (n == 0)
+    {
+      return false;
+    }
+    hasher.update(buffer, n);
+    offset += n;
+  }
+  crc = hasher.crc32();
+  return true;
+}
+
+// ---- Per-type throughput ---------------------------------------------------
+
+struct LzbCounter
+{
+  uint32_t files;
+  uint64_t originalBytes;
+  uint64_t storedBytes;
+  uint64_t ms;
+};
+
+struct LzbTypeStats
+{
+  char type[8];
+  LzbCounter plain[2];
+  LzbCounter compressed[2];
+};
+
+// Updated and read from the web server task only
+static LzbTypeStats typeStats[LZB_MAX_TYPES];
+static size_t typeCount = 0;
+
+static LzbTypeStats &statsFor(const String &path)
+{
+  String logical = lzbLogicalPath(path);
+  int dot = logical.lastIndexOf('.');
+  String type = dot > logical.lastIndexOf('/') ? logical.substring(dot + 1) : String("");
+  type.toLowerCase();
+  if (type.length() >= sizeof(typeStats[0].type))
+  {
+    type = type.substring(0, sizeof(typeStats[0].type) - 1);
+  }
+  for (size_t i = 0; i < typeCount; i++)
+  {
+    if (type == typeStats[i].type)
+    {
+      return typeStats[i];
+    }
+  }
+  // The last entry collects the types that do not fit
+  if (typeCount == LZB_MAX_TYPES)
+  {
+    return typeStats[LZB_MAX_TYPES - 1];
+  }
+  LzbTypeStats &entry = typeStats[typeCount++];
+  memset(&entry, 0, sizeof(entry));
+  snprintf(entry.type, sizeof(entry.type), "%s", typeCount == LZB_MAX_TYPES ? "other" : type.c_str());
+  return entry;
+}
+
+void lzbRecordTransfer(LzbDirection direction, const String &path, bool compressed, uint64_t originalBytes,
+                       uint64_t storedBytes, uint32_t ms)
+{
+  LzbCounter &c = compressed ? statsFor(path).compressed[direction] : statsFor(path).plain[direction];
+  c.files++;
+  c.originalBytes += originalBytes;
+  c.storedBytes += storedBytes;
+  c.ms += max(ms, (uint32_t)1);
+}
+
+static void directionJson(JsonObject obj, const LzbTypeStats &s, int direction)
+{
+  const LzbCounter &plain = s.plain[direction];
+  const LzbCounter &packed = s.compressed[direction];
+  // MB/s of the original data; the gain compares against plain transfers
+  // of the same type
+  double plainMBps = plain.ms ? plain.originalBytes / 1000.0 / plain.ms : 0;
+  double packedMBps = packed.ms ? packed.originalBytes / 1000.0 / packed.ms : 0;
+  obj["plainFiles"] = plain.files;
+  obj["plainMBps"] = plainMBps;
+  obj["compressedFiles"] = packed.files;
+  obj["compressedMBps"] = packedMBps;
+  obj["cardMBps"] = packed.ms ? packed.storedBytes / 1000.0 / packed.ms : 0;
+  obj["gain"] = plainMBps > 0 && packedMBps > 0 ? packedMBps / plainMBps : 0;
+}
+
+void lzbStatsJson(JsonObject obj)
+{
+  obj["blockSize"] = LZB_BLOCK_SIZE;
+  JsonArray types = obj["types"].to<JsonArray>();
+  for (size_t i = 0; i < typeCount; i++)
+  {
+    const LzbTypeStats &s = typeStats[i];
+    JsonObject t = types.add<JsonObject>();
+    t["type"] = s.type[0] ? s.type : "(none)";
+    const LzbCounter &up = s.compressed[LZB_UPLOAD];
+    t["originalBytes"] = up.originalBytes;
+    t["storedBytes"] = up.storedBytes;
+    t["ratio"] = up.storedBytes ? (double)up.originalBytes / up.storedBytes : 0;
+    directionJson(t["upload"].to<JsonObject>(), s, LZB_UPLOAD);
+    directionJson(t["download"].to<JsonObject>(), s, LZB_DOWNLOAD);
+  }
+}
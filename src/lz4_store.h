@@ -0,0 +1,136 @@
+#ifndef __LZ4_STORE_H
+#define __LZ4_STORE_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+#include <vector>
+
+// Opt-in compressed storage: a file uploaded with compress=1 is stored as
+// <name>.lz4b and decompressed again on download, so the 1-bit card bus
+// moves fewer bytes for text, logs and CSV.
+//
+//   header    "LZB1", u32 block size, u32 flags, u32 reserved
+//   blocks    u32 stored length (bit 31: stored raw), LZ4 block data; each
+//             holds LZB_BLOCK_SIZE bytes of the original except the last
+//   index     per block: u32 file offset, u32 CRC32 of the original bytes
+//   trailer   "LZBT", u32 block size, u64 original size, u32 block count,
+//             u32 index offset, u32 index CRC32, u32 trailer CRC32
+//
+// The index makes any byte offset one seek and one block decode away, so
+// Range requests and /read work on compressed files.
+#define LZB_SUFFIX ".lz4b"
+#define LZB_BLOCK_SIZE (64 * 1024)
+// Blocks in flight between the web server task and the compressor
+#define LZB_PIPELINE_SLOTS 3
+#define LZB_TASK_STACK 4096
+// Longest write() waits for a free slot before it fails the upload
+#define LZB_WRITE_WAIT_MS 1000
+// File types with their own entry in lzbStatsJson()
+#define LZB_MAX_TYPES 12
+
+// Compresses on a task pinned to the core the caller is not running on
+// (the web server runs on one core, the other one is mostly idle). write()
+// only copies into a PSRAM slot; when all slots are still in flight for
+// LZB_WRITE_WAIT_MS it fails instead of stalling the caller.
+class LzbWriter
+{
+private:
+    struct Slot
+    {
+        uint8_t *input;
+        uint8_t *output;
+        size_t len;
+    };
+
+    File file;
+    Slot slots[LZB_PIPELINE_SLOTS];
+    void *table;
+    void *freeSlots; // queue of slot indexes
+    void *fullSlots;
+    void *done;
+    int current;
+    uint32_t offset;
+    std::vector<uint32_t> index; // offset, CRC pairs
+    uint64_t originalBytes;
+    uint64_t storedBytes;
+    uint32_t compressUs;
+    volatile bool failed;
+    bool running;
+
+    static void taskEntry(void *arg);
+    void run();
+    bool compressSlot(Slot &slot);
+    void release();
+
+public:
+    LzbWriter();
+    ~LzbWriter();
+
+    // Takes over a file opened for writing
+    bool begin(File file);
+    bool write(const uint8_t *data, size_t len);
+    // Drains the pipeline, writes index and trailer and closes the file.
+    // False if any write failed.
+    bool finish();
+
+    uint64_t getOriginalBytes() const { return originalBytes; }
+    uint64_t getStoredBytes() const { return storedBytes; }
+    uint32_t getCompressMs() const { return compressUs / 1000; }
+};
+
+// Random-access reads of a .lz4b file; one decoded block is cached
+class LzbReader
+{
+private:
+    File file;
+    uint32_t blockSize;
+    uint64_t originalSize;
+    uint32_t indexOffset;
+    std::vector<uint32_t> index;
+    uint8_t *block;
+    uint8_t *packed;
+    int32_t cachedBlock;
+    size_t cachedLen;
+    uint64_t storedRead;
+
+    bool loadBlock(uint32_t n);
+
+public:
+    LzbReader();
+    ~LzbReader();
+
+    bool open(fs::FS &fs, const String &path);
+    void close();
+
+    uint64_t size() const { return originalSize; }
+    uint64_t getStoredBytesRead() const { return storedRead; }
+    // Bytes of the original file at `offset`; 0 at the end or on a
+    // corrupt block
+    size_t read(uint64_t offset, uint8_t *buffer, size_t len);
+};
+
+bool lzbIsCompressed(const String &path);
+// The name a compressed file is downloaded as (suffix removed)
+String lzbLogicalPath(const String &path);
+// CRC32 of the original content, for upload verification
+bool lzbContentCrc32(fs::FS &fs, const String &path, uint32_t &crc);
+// A file is stored either plain or compressed: after writing `path`, call
+// this to drop the other form (path + LZB_SUFFIX, or the plain name for a
+// .lz4b path), which downloads would otherwise serve or shadow.
+// True if one was removed
+bool lzbRemoveTwin(fs::FS &fs, const String &path);
+// The other name of `path`: its .lz4b file, or the plain name of a .lz4b
+String lzbTwinPath(const String &path);
+
+// Throughput per file type, plain and compressed, for uploads and downloads
+enum LzbDirection
+{
+    LZB_UPLOAD,
+    LZB_DOWNLOAD
+};
+void lzbRecordTransfer(LzbDirection direction, const String &path, bool compressed, uint64_t originalBytes,
+                       uint64_t storedBytes, uint32_t ms);
+void lzbStatsJson(JsonObject obj);
+
+#endif
@@ -8,6 +8,30 @@
 #include "SD_MMC.h"
 #include "psram_buffer.h"
 #include "esp_task_wdt.h"
+#include "fs_events.h"
+#include "dir_pager.h"
+#include "meta_cache.h"
+#include "block_cache.h"
+#include "sd_defrag.h"
+#include "checksum_index.h"
+#include "delta_sync.h"
+#include "du_tree.h"
+#include "tail_follow.h"
+#include "grep_search.h"
+#include "query_job.h"
+#include "time_series.h"
+#include "kv_service.h"
+#include "lz4_store.h"
+#include "file_crypt.h"
+#include "thumb_cache.h"
+#include "media_index.h"
+#include "webdav.h"
+#include "bulk_transfer.h"
+#include "sd_io_sched.h"
+#include "egress_shaper.h"
+#include "async_io_service.h"
+#include "bg_job.h"
+#include "deferred_response.h"
 
 // Reference to the global PSRAM buffer defined in sd_read_write.cpp
 extern PSRAMBuffer g_psramBuffer;
@@ -38,9 +62,19 @@ extern PSRAMBuffer g_psramBuffer;
 
 #define STATUS_LED 2  // Built-in LED on most ESP32 boards
 
+#define UPLOAD_PREALLOCATE_MIN (256 * 1024) // 小文件不值得预分配
+#define UPLOAD_STAGING_SUFFIX ".part"        // 上传先写入临时文件，校验通过后再改名
+#define UPLOAD_CRC_HEADER "X-Content-CRC32"   // 客户端提供的整个文件的 CRC32 (十六进制)
+
 // 创建Web服务器，端口80
 AsyncWebServer server(80);
 
+// 分页列目录的会话 (保持目录句柄以便连续翻页)
+DirPager dirPager(SD_MMC);
+AsyncWebServerRequest *syncPatchRequest = nullptr; // 正在接收补丁的请求
+AsyncWebServerRequest *syncRefusedRequest = nullptr; // 补丁未能开始接收的请求及原因
+DeltaBeginResult syncRefusedResult = DELTA_BEGIN_OK;
+
 // HTML页面
 const char index_html[] PROGMEM = R"rawliteral(
 <!DOCTYPE HTML>
@@ -181,6 +215,67 @@ const char index_html[] PROGMEM = R"rawliteral(
       background-color: #e9ecef;
     }
 
+    /* 虚拟列表: 固定高度的滚动区域，行绝对定位 */
+    .file-viewport {
+      height: 60vh;
+      overflow-y: auto;
+      position: relative;
+      contain: strict;
+    }
+
+    #fileSpacer {
+      position: relative;
+    }
+
+    .vrow {
+      position: absolute;
+      top: 0;
+      left: 0;
+      right: 0;
+      height: 56px;
+      margin: 4px 0;
+      padding: 0 15px;
+      overflow: hidden;
+      white-space: nowrap;
+      will-change: transform;
+      transition: background-color 0.3s ease;
+    }
+
+    .vrow .file-content {
+      overflow: hidden;
+      text-overflow: ellipsis;
+    }
+
+    .list-toolbar {
+      display: flex;
+      gap: 10px;
+      align-items: center;
+      flex-wrap: wrap;
+    }
+
+    .list-toolbar select {
+      padding: 10px;
+      border: 1px solid #ddd;
+      border-radius: var(--border-radius);
+    }
+
+    /* 缩略图网格: 图片按需加载 */
+    .gallery {
+      display: none;
+      grid-template-columns: repeat(auto-fill, minmax(160px, 1fr));
+      gap: 8px;
+      max-height: 60vh;
+      overflow-y: auto;
+    }
+
+    .gallery img {
+      width: 100%;
+      aspect-ratio: 4 / 3;
+      object-fit: contain;
+      background-color: #e9ecef;
+      border-radius: var(--border-radius);
+    }
+
     .file-content {
       flex-grow: 1;
     }
@@ -268,11 +363,15 @@ const char index_html[] PROGMEM = R"rawliteral(
 
     /* 响应式设计 */
     @media (max-width: 768px) {
-      .file {
+      .file:not(.vrow) {
         flex-direction: column;
         align-items: flex-start;
       }
 
+      .vrow .button {
+        padding: 6px 10px;
+      }
+
       .file-actions {
         margin-top: 10px;
         width: 100%;
@@ -325,7 +424,22 @@ const char index_html[] PROGMEM = R"rawliteral(
   </div>
 
   <div id="currentPath" class="container"></div>
-  <div id="fileList" class="container"></div>
+  <div class="container list-toolbar">
+    <input type="text" id="filterInput" placeholder="筛选文件名" oninput="onFilterChange()">
+    <select id="sortSelect" onchange="onSortChange()">
+      <option value="default">默认顺序</option>
+      <option value="name">按名称</option>
+      <option value="size">按大小</option>
+    </select>
+    <label><input type="checkbox" id="thumbToggle" onchange="renderGallery()"> 缩略图</label>
+    <span id="listCount"></span>
+  </div>
+  <div id="fileList" class="container file-viewport">
+    <p id="listMessage"></p>
+    <div id="fileSpacer"></div>
+  </div>
+  <div id="gallery" class="container gallery"></div>
+  <div id="transferStatus"></div>
 
   <div class="upload-form container">
     <h3>上传文件</h3>
@@ -359,11 +473,33 @@ const char index_html[] PROGMEM = R"rawliteral(
 
   <script>
     let currentPath = "/";
+    let events = null;         // 文件变更事件通道 (SSE)
+    let eventsConnected = false;
+
+    // 虚拟列表: 数据保存在紧凑的类型化数组中，只为可见行创建 DOM 节点
+    const ROW_HEIGHT = 64;     // 每行固定高度 (px)，与 .vrow 样式一致
+    const OVERSCAN = 8;        // 可视区域上下额外渲染的行数
+    const PAGE_SIZE = 500;     // 每次向 /list 请求的条目数
+    const model = {
+      names: [], lower: [],
+      sizes: new Float64Array(256), dirs: new Uint8Array(256), alive: new Uint8Array(256),
+      count: 0, index: new Map(),
+      order: new Uint32Array(0), orderCount: 0,
+      cursor: 0, done: false, loading: false, generation: 0
+    };
+    let pool = [];             // 复用的行节点
+    let renderPending = false;
 
     // 页面加载时获取文件列表和服务器IP
     window.onload = function() {
+      const viewport = document.getElementById('fileList');
+      viewport.addEventListener('scroll', scheduleRender, {passive: true});
+      viewport.addEventListener('click', onListClick);
+      window.addEventListener('resize', scheduleRender);
+
       loadFileList(currentPath);
       fetchServerIP();
+      connectEvents();
     };
 
     // 获取服务器IP
@@ -381,6 +517,69 @@ const char index_html[] PROGMEM = R"rawliteral(
         });
     }
 
+    // 订阅服务器推送的文件变更事件，增量更新列表
+    function connectEvents() {
+      if (!window.EventSource) return;
+
+      // 浏览器重连时自动带上 Last-Event-ID，服务器补发错过的事件；
+      // 错过的太多 (或设备已重启) 时 hello 中 resume 为 false，重新加载列表
+      let helloSeen = false;
+      events = new EventSource('/events');
+      events.addEventListener('open', () => {
+        eventsConnected = true;
+      });
+      events.addEventListener('hello', e => {
+        const ev = JSON.parse(e.data);
+        if (helloSeen && !ev.resume && model.count > 0) {
+          loadFileList(currentPath);
+        }
+        helloSeen = true;
+      });
+      events.addEventListener('error', () => {
+        eventsConnected = false;
+      });
+      events.addEventListener('add', e => {
+        const ev = JSON.parse(e.data);
+        if (ev.dir === currentPath) putEntry(ev.name, ev.size, ev.isDir);
+      });
+      events.addEventListener('remove', e => {
+        const ev = JSON.parse(e.data);
+        if (ev.dir === currentPath) removeEntry(ev.name);
+      });
+      events.addEventListener('rename', e => {
+        const ev = JSON.parse(e.data);
+        if (ev.fromDir === currentPath) {
+          const old = model.index.get(ev.fromName);
+          const size = old === undefined ? 0 : model.sizes[old];
+          removeEntry(ev.fromName);
+          if (ev.dir === currentPath) putEntry(ev.name, size, ev.isDir);
+        } else if (ev.dir === currentPath) {
+          loadFileList(currentPath); // 从其他目录移入，大小未知
+        }
+      });
+      events.addEventListener('progress', e => {
+        const ev = JSON.parse(e.data);
+        const status = document.getElementById('transferStatus');
+        if (ev.final) {
+          status.textContent = '';
+        } else {
+          const percent = ev.total ? Math.min(100, Math.round(ev.bytes * 100 / ev.total)) : 0;
+          status.textContent = `正在传输 ${ev.path}: ${formatBytes(ev.bytes)} (${percent}%)`;
+        }
+      });
+    }
+
+    // 事件通道不可用时退回到整表刷新
+    function refreshIfNoEvents() {
+      if (!eventsConnected) {
+        loadFileList(currentPath);
+      }
+    }
+
+    function joinPath(dir, name) {
+      return dir == '/' ? dir + name : dir + '/' + name;
+    }
+
     // 加载指定路径下的文件列表
     function loadFileList(path) {
       currentPath = path;
@@ -391,50 +590,286 @@ const char index_html[] PROGMEM = R"rawliteral(
           '<button onclick="loadFileList(\'' + getParentDirectory(currentPath) + '\')" class="button">返回上级目录</button>';
       }
 
-      fetch('/list?dir=' + encodeURIComponent(path))
-        .then(response => response.json())
-        .then(data => {
-          let html = '';
-
-          // 添加目录
-          data.directories.forEach(dir => {
-            html += '<div class="file dir">';
-            html += '<div class="file-content">';
-            html += '<a href="#" onclick="loadFileList(\'' + (currentPath == '/' ? currentPath + dir : currentPath + '/' + dir) + '\')">';
-            html += '<strong>📁 ' + dir + '</strong>';
-            html += '</a>';
-            html += '</div>';
-            html += '<div class="file-actions">';
-            html += '<button onclick="deleteItem(\'' + (currentPath == '/' ? currentPath + dir : currentPath + '/' + dir) + '\', true)" class="button button-danger">删除</button>';
-            html += '</div>';
-            html += '</div>';
-          });
-
-          // 添加文件
-          data.files.forEach(file => {
-            html += '<div class="file">';
-            html += '<div class="file-content">';
-            html += '<strong>📄 ' + file.name + '</strong> (' + formatBytes(file.size) + ')';
-            html += '</div>';
-            html += '<div class="file-actions">';
-            html += '<a href="/download?path=' + encodeURIComponent((currentPath == '/' ? currentPath + file.name : currentPath + '/' + file.name)) + '" class="button button-download">下载</a> ';
-            html += '<button onclick="deleteItem(\'' + (currentPath == '/' ? currentPath + file.name : currentPath + '/' + file.name) + '\', false)" class="button button-danger">删除</button>';
-            html += '</div>';
-            html += '</div>';
-          });
-
-          if (html === '') {
-            html = '<p>此文件夹为空</p>';
-          }
+      resetModel();
+      galleryImages.clear();
+      document.getElementById('fileList').scrollTop = 0;
+      setListMessage('正在加载...');
+      loadNextPage();
+    }
+
+    function resetModel() {
+      model.names = [];
+      model.lower = [];
+      model.count = 0;
+      model.index = new Map();
+      model.alive.fill(0);
+      model.orderCount = 0;
+      model.cursor = 0;
+      model.done = false;
+      model.loading = false;
+      model.generation++;
+      scheduleRender();
+    }
 
-          document.getElementById('fileList').innerHTML = html;
+    // 按游标取下一页；排序或筛选需要完整数据时会连续加载
+    function loadNextPage() {
+      if (model.loading || model.done) return;
+      model.loading = true;
+      const generation = model.generation;
+      const path = currentPath;
+
+      fetch('/list?dir=' + encodeURIComponent(path) + '&cursor=' + model.cursor + '&limit=' + PAGE_SIZE)
+        .then(response => {
+          if (!response.ok) throw new Error(response.status);
+          return response.json();
+        })
+        .then(data => {
+          if (generation !== model.generation) return; // 用户已切换到其他目录
+          model.loading = false;
+          data.entries.forEach(e => putEntryRaw(e[0], e[1], e[2] === 1));
+          model.cursor = data.next;
+          model.done = data.done;
+          rebuildOrder();
+          if (!model.done && needsAllEntries()) loadNextPage();
         })
         .catch(error => {
+          if (generation !== model.generation) return;
+          model.loading = false;
+          model.done = true;
           console.error('Error loading file list:', error);
-          document.getElementById('fileList').innerHTML = '<p>无法加载文件列表</p>';
+          setListMessage('无法加载文件列表');
         });
     }
 
+    function needsAllEntries() {
+      return document.getElementById('sortSelect').value !== 'default' ||
+             document.getElementById('filterInput').value !== '';
+    }
+
+    function ensureCapacity(n) {
+      if (n <= model.sizes.length) return;
+      let cap = model.sizes.length;
+      while (cap < n) cap *= 2;
+      const grow = (Type, old) => { const a = new Type(cap); a.set(old); return a; };
+      model.sizes = grow(Float64Array, model.sizes);
+      model.dirs = grow(Uint8Array, model.dirs);
+      model.alive = grow(Uint8Array, model.alive);
+    }
+
+    // 写入或更新一个条目，不重建排序
+    function putEntryRaw(name, size, isDir) {
+      let i = model.index.get(name);
+      if (i === undefined) {
+        i = model.count++;
+        ensureCapacity(model.count);
+        model.names[i] = name;
+        model.lower[i] = name.toLowerCase();
+        model.index.set(name, i);
+      }
+      model.sizes[i] = size;
+      model.dirs[i] = isDir ? 1 : 0;
+      model.alive[i] = 1;
+    }
+
+    // 事件驱动的增量更新
+    function putEntry(name, size, isDir) {
+      putEntryRaw(name, size, isDir);
+      rebuildOrder();
+    }
+
+    function removeEntry(name) {
+      const i = model.index.get(name);
+      if (i === undefined) return;
+      model.alive[i] = 0;
+      model.index.delete(name);
+      rebuildOrder();
+    }
+
+    // 按筛选和排序条件生成显示顺序 (目录始终在前)
+    function rebuildOrder() {
+      const filter = document.getElementById('filterInput').value.toLowerCase();
+      const sort = document.getElementById('sortSelect').value;
+      if (model.order.length < model.count) model.order = new Uint32Array(model.sizes.length);
+
+      let n = 0;
+      for (let i = 0; i < model.count; i++) {
+        if (model.alive[i] && (!filter || model.lower[i].includes(filter))) model.order[n++] = i;
+      }
+      const view = model.order.subarray(0, n);
+      const dirs = model.dirs, sizes = model.sizes, lower = model.lower;
+      view.sort((a, b) => {
+        if (dirs[a] !== dirs[b]) return dirs[b] - dirs[a];
+        if (sort === 'name') return lower[a] < lower[b] ? -1 : lower[a] > lower[b] ? 1 : 0;
+        if (sort === 'size') return sizes[b] - sizes[a] || a - b;
+        return a - b;
+      });
+      model.orderCount = n;
+
+      document.getElementById('listCount').textContent =
+        n + ' 项' + (model.done ? '' : ' (加载中...)');
+      if (n > 0) {
+        setListMessage('');
+      } else {
+        setListMessage(model.done ? (filter ? '没有匹配的文件' : '此文件夹为空') : '正在加载...');
+      }
+      scheduleRender();
+      renderGallery();
+    }
+
+    // 当前顺序中的 JPEG 显示为缩略图；已创建的图片元素复用，不会重复请求
+    const galleryImages = new Map();
+    let galleryKey = '';
+
+    function renderGallery() {
+      const gallery = document.getElementById('gallery');
+      const on = document.getElementById('thumbToggle').checked;
+      gallery.style.display = on ? 'grid' : 'none';
+      document.getElementById('fileList').style.display = on ? 'none' : '';
+      if (!on) return;
+
+      const names = [];
+      for (let pos = 0; pos < model.orderCount; pos++) {
+        const i = model.order[pos];
+        if (!model.dirs[i] && /\.jpe?g(\.lz4b)?$/i.test(model.names[i])) names.push(model.names[i]);
+      }
+      const key = currentPath + '\n' + names.join('\n');
+      if (key === galleryKey) return;
+      galleryKey = key;
+
+      const fragment = document.createDocumentFragment();
+      names.forEach(name => {
+        const fullPath = joinPath(currentPath, name);
+        let link = galleryImages.get(fullPath);
+        if (!link) {
+          link = document.createElement('a');
+          link.href = '/download?path=' + encodeURIComponent(fullPath);
+          link.title = name;
+          const img = document.createElement('img');
+          img.loading = 'lazy';
+          img.alt = name;
+          img.src = '/thumb?path=' + encodeURIComponent(fullPath) + '&size=160';
+          link.appendChild(img);
+          galleryImages.set(fullPath, link);
+        }
+        fragment.appendChild(link);
+      });
+      gallery.replaceChildren(fragment);
+    }
+
+    function onFilterChange() {
+      rebuildOrder();
+      if (!model.done && needsAllEntries()) loadNextPage();
+    }
+
+    function onSortChange() {
+      onFilterChange();
+    }
+
+    function setListMessage(text) {
+      const message = document.getElementById('listMessage');
+      message.textContent = text;
+      message.style.display = text ? 'block' : 'none';
+    }
+
+    function scheduleRender() {
+      if (renderPending) return;
+      renderPending = true;
+      requestAnimationFrame(renderWindow);
+    }
+
+    // 只渲染可视窗口内的行
+    function renderWindow() {
+      renderPending = false;
+      const viewport = document.getElementById('fileList');
+      const spacer = document.getElementById('fileSpacer');
+      spacer.style.height = (model.orderCount * ROW_HEIGHT) + 'px';
+
+      const first = Math.max(0, Math.floor(viewport.scrollTop / ROW_HEIGHT) - OVERSCAN);
+      const visible = Math.ceil(viewport.clientHeight / ROW_HEIGHT) + 2 * OVERSCAN;
+      const last = Math.min(model.orderCount, first + visible);
+
+      while (pool.length < visible) {
+        const row = createPoolRow();
+        pool.push(row);
+        spacer.appendChild(row);
+      }
+
+      for (let k = 0; k < pool.length; k++) {
+        const row = pool[k];
+        const pos = first + k;
+        if (pos >= last) {
+          row.style.display = 'none';
+          continue;
+        }
+        bindRow(row, model.order[pos], pos);
+      }
+
+      // 接近已加载数据末尾时取下一页
+      if (!model.done && last + OVERSCAN >= model.orderCount) loadNextPage();
+    }
+
+    function createPoolRow() {
+      const row = document.createElement('div');
+      row.className = 'file vrow';
+      row.innerHTML =
+        '<div class="file-content"><a href="#" data-action="open"><strong></strong></a><strong></strong><span></span></div>' +
+        '<div class="file-actions">' +
+        '<a class="button button-download" data-action="download">下载</a>' +
+        '<button class="button button-orange" data-action="rename">重命名</button>' +
+        '<button class="button button-danger" data-action="delete">删除</button>' +
+        '</div>';
+      return row;
+    }
+
+    function bindRow(row, i, pos) {
+      const isDir = model.dirs[i] === 1;
+      const name = model.names[i];
+      row.style.display = '';
+      row.style.transform = 'translateY(' + (pos * ROW_HEIGHT) + 'px)';
+      row.dataset.idx = i;
+      row.classList.toggle('dir', isDir);
+
+      const content = row.firstChild;
+      const link = content.children[0], fileLabel = content.children[1], size = content.children[2];
+      link.style.display = isDir ? '' : 'none';
+      fileLabel.style.display = isDir ? 'none' : '';
+      if (isDir) {
+        link.firstChild.textContent = '📁 ' + name;
+        size.textContent = '';
+      } else {
+        fileLabel.textContent = '📄 ' + name;
+        size.textContent = ' (' + formatBytes(model.sizes[i]) + ')';
+      }
+
+      const download = row.lastChild.children[0];
+      download.style.display = isDir ? 'none' : '';
+      if (!isDir) download.href = '/download?path=' + encodeURIComponent(joinPath(currentPath, name));
+    }
+
+    // 行内按钮使用事件委托，避免每行绑定处理函数
+    function onListClick(e) {
+      const target = e.target.closest('[data-action]');
+      const row = e.target.closest('.vrow');
+      if (!target || !row) return;
+
+      const i = Number(row.dataset.idx);
+      const name = model.names[i];
+      const fullPath = joinPath(currentPath, name);
+      const isDir = model.dirs[i] === 1;
+      switch (target.dataset.action) {
+        case 'open':
+          e.preventDefault();
+          loadFileList(fullPath);
+          break;
+        case 'rename':
+          renameItem(fullPath, name);
+          break;
+        case 'delete':
+          deleteItem(fullPath, isDir);
+          break;
+      }
+    }
+
     // 获取上级目录路径
     function getParentDirectory(path) {
       if (path === '/' || !path.includes('/')) return '/';
@@ -443,8 +878,31 @@ const char index_html[] PROGMEM = R"rawliteral(
       return parentDir === '' ? '/' : parentDir;
     }
 
+    // CRC32 (与服务器端一致)，分块读取文件以免占用大量内存
+    const CRC_TABLE = (() => {
+      const table = new Uint32Array(256);
+      for (let i = 0; i < 256; i++) {
+        let c = i;
+        for (let k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >>> 1) : c >>> 1;
+        table[i] = c >>> 0;
+      }
+      return table;
+    })();
+
+    async function crc32OfFile(file) {
+      const CHUNK = 4 * 1024 * 1024;
+      let crc = 0xFFFFFFFF;
+      for (let offset = 0; offset < file.size; offset += CHUNK) {
+        const bytes = new Uint8Array(await file.slice(offset, offset + CHUNK).arrayBuffer());
+        for (let i = 0; i < bytes.length; i++) {
+          crc = CRC_TABLE[(crc ^ bytes[i]) & 0xFF] ^ (crc >>> 8);
+        }
+      }
+      return ((crc ^ 0xFFFFFFFF) >>> 0).toString(16).padStart(8, '0');
+    }
+
     // 上传文件
-    function uploadFile() {
+    async function uploadFile() {
       const fileInput = document.getElementById('file');
       const file = fileInput.files[0];
       if (!file) {
@@ -460,6 +918,8 @@ const char index_html[] PROGMEM = R"rawliteral(
       formData.append('file', file);
       formData.append('path', uploadPath); // 明确添加当前路径参数
 
+      document.getElementById('uploadStatus').textContent = '正在计算校验值...';
+      const crc = await crc32OfFile(file);
       document.getElementById('uploadStatus').textContent = `准备上传到 ${uploadPath}...`;
 
       // 显示进度条
@@ -486,11 +946,9 @@ const char index_html[] PROGMEM = R"rawliteral(
         if (xhr.status === 200) {
           document.getElementById('uploadStatus').textContent = '上传成功!';
           console.log(`File uploaded to: ${uploadPath}`);
-          setTimeout(() => {
-            loadFileList(currentPath); // 刷新文件列表
-          }, 1000);
+          refreshIfNoEvents(); // 列表通过 add 事件更新
         } else {
-          document.getElementById('uploadStatus').textContent = '上传失败: ' + xhr.statusText;
+          document.getElementById('uploadStatus').textContent = '上传失败: ' + (xhr.responseText || xhr.statusText);
         }
       });
 
@@ -504,6 +962,7 @@ const char index_html[] PROGMEM = R"rawliteral(
 
       // 添加调试信息到URL
       xhr.open('POST', '/upload?path=' + encodeURIComponent(uploadPath));
+      xhr.setRequestHeader('X-Content-CRC32', crc);
       xhr.send(formData);
     }
 
@@ -520,7 +979,7 @@ const char index_html[] PROGMEM = R"rawliteral(
         .then(response => response.text())
         .then(result => {
           alert(result);
-          loadFileList(currentPath); // 刷新文件列表
+          refreshIfNoEvents();
         })
         .catch(error => {
           alert('删除失败: ' + error);
@@ -528,6 +987,28 @@ const char index_html[] PROGMEM = R"rawliteral(
       }
     }
 
+    // 重命名文件或目录
+    function renameItem(path, oldName) {
+      const newName = prompt('新名称:', oldName);
+      if (!newName || newName === oldName) return;
+
+      fetch('/rename', {
+        method: 'POST',
+        headers: {
+          'Content-Type': 'application/x-www-form-urlencoded',
+        },
+        body: 'path=' + encodeURIComponent(path) + '&to=' + encodeURIComponent(joinPath(currentPath, newName))
+      })
+      .then(response => response.text())
+      .then(result => {
+        alert(result);
+        refreshIfNoEvents();
+      })
+      .catch(error => {
+        alert('重命名失败: ' + error);
+      });
+    }
+
     // 创建目录
     function createDirectory() {
       const dirName = document.getElementById('dirName').value;
@@ -547,7 +1028,7 @@ const char index_html[] PROGMEM = R"rawliteral(
       .then(result => {
         alert(result);
         document.getElementById('dirName').value = '';
-        loadFileList(currentPath); // 刷新文件列表
+        refreshIfNoEvents();
       })
       .catch(error => {
         alert('创建文件夹失败: ' + error);
@@ -575,15 +1056,442 @@ const char index_html[] PROGMEM = R"rawliteral(
 )rawliteral";
 
 // 初始化SD卡
+// 上传结束后的提交：(可选) 从卡上读回校验，然后把临时文件改名为目标文件
+struct UploadCommit {
+    String uploadPath;
+    String storedPath;   // 压缩时为 .lz4b 路径
+    String stagingPath;
+    bool encrypted = false;
+    bool verifyOnMedia = false;
+    uint8_t digest[4];   // 上传时计算的 CRC32 (原始内容)
+    uint32_t crc = 0;
+    size_t totalBytes = 0;
+    size_t storedBytes = 0;
+    uint32_t elapsedMs = 0;
+    int status = 200;
+    String message;
+
+    // 写入排空前由 closeUpload 使用
+    File file;                                // 临时文件
+    std::shared_ptr<AsyncWriteStream> writer; // 仍在写卡时非空
+    size_t reservedBytes = 0;
+    uint32_t startTime = 0;
+    bool writeFailed = false;
+    bool expectCrc = false;
+    uint32_t expectedCrc = 0;
+    bool verifying = false;                   // 读回校验在 uploadVerifyJob 中进行
+
+    // 连接在写入排空前断开：排空后再关闭并删除临时文件
+    ~UploadCommit() {
+        if (!writer) {
+            return;
+        }
+        File f = file;
+        String staging = stagingPath;
+        writer->abandon([f, staging]() mutable {
+            {
+                SdIoScope io(SD_IO_BULK);
+                f.close();
+                SD_MMC.remove(staging);
+            }
+            fsCacheInvalidate(staging);
+        });
+    }
+};
+
+// verify=1 的读回校验在此后台任务中运行
+static BackgroundJob uploadVerifyJob("upload-verify");
+
+// 上传结果在文件数据回调中确定，由请求回调发送：请求回调在最后一块数据之后运行，
+// 之前发送的回应会被它替换 (与 /sync/patch 相同)
+static AsyncWebServerRequest *uploadDoneRequest = nullptr;
+static std::shared_ptr<UploadCommit> uploadDone;
+
+static void commitUpload(UploadCommit &c) {
+    if (c.verifyOnMedia) {
+        // 绕过块缓存，读到的是卡上的数据而不是刚写入时缓存的副本
+        BlockCacheBypassScope bypass;
+        uint32_t mediaCrc = 0;
+        bool read;
+        if (c.storedPath != c.uploadPath) {
+            read = lzbContentCrc32(SD_MMC, c.stagingPath, mediaCrc);
+        } else if (c.encrypted) {
+            read = cryptContentCrc32(SD_MMC, c.stagingPath, mediaCrc);
+        } else {
+            read = readBackCrc32(SD_MMC, c.stagingPath.c_str(), mediaCrc);
+        }
+        if (!read || mediaCrc != c.crc) {
+            c.status = 500;
+            c.message = "Read-back verification failed";
+        }
+    }
+
+    if (c.status == 200) {
+        // 校验通过后替换目标文件
+        FsMeta old;
+        if (g_metaCache.stat(c.storedPath, old) && !old.isDirectory) {
+            duFileRemoved(c.storedPath, old.size);
+        }
+        fsCacheInvalidate(c.storedPath);
+        if (SD_MMC.exists(c.storedPath)) {
+            SD_MMC.remove(c.storedPath);
+        }
+        if (!SD_MMC.rename(c.stagingPath, c.storedPath)) {
+            c.status = 500;
+            c.message = "Failed to move upload into place";
+        }
+    }
+
+    if (c.status != 200) {
+        SD_MMC.remove(c.stagingPath);
+        fsCacheInvalidate(c.stagingPath);
+        Serial.printf("Upload rejected: %s - %s\n", c.uploadPath.c_str(), c.message.c_str());
+        return;
+    }
+
+    fsCacheInvalidate(c.stagingPath);
+    fsCacheInvalidate(c.storedPath);
+
+    // 上传时计算的 CRC32 直接写入校验和索引 (压缩文件的 CRC32 是原始内容的，不写入)
+    FsMeta meta;
+    if (c.storedPath == c.uploadPath && !c.encrypted && g_metaCache.stat(c.uploadPath, meta)) {
+        g_checksumIndex.store(c.uploadPath, meta, HASH_CRC32, c.digest);
+    }
+    lzbRecordTransfer(LZB_UPLOAD, c.uploadPath, c.storedPath != c.uploadPath, c.totalBytes, c.storedBytes,
+                      c.elapsedMs);
+
+    float speed = c.totalBytes / (float)max((uint32_t)1, c.elapsedMs); // KB/s
+    Serial.printf("Upload Complete: %s - %u bytes in %u ms (%.2f KB/s), CRC32 %s%s\n",
+                  c.uploadPath.c_str(), c.totalBytes, c.elapsedMs, speed,
+                  hashToHex(c.digest, sizeof(c.digest)).c_str(), c.verifyOnMedia ? " (verified on media)" : "");
+    fsEventAdded(c.storedPath, c.storedBytes, false);
+    duFileAdded(c.storedPath, c.storedBytes);
+    // 同一文件只保留一种形式 (明文或 .lz4b)
+    lzbRemoveTwin(SD_MMC, c.storedPath);
+    c.message = "File uploaded successfully to " + c.storedPath + " - " + String(c.totalBytes) + " bytes at " +
+                String(speed, 2) + " KB/s";
+}
+
+// 改名后留下的另一种形式 (压缩/未压缩) 交给异步 I/O 任务删除；队列满时直接删除
+static void removeTwinAsync(const String &path)
+{
+    String twin = lzbTwinPath(path);
+    FsMeta meta;
+    if (!g_metaCache.stat(twin, meta) || meta.isDirectory) {
+        return;
+    }
+    g_asyncIo.remove(twin.c_str(), false, [path, twin, meta](const AsyncIoResult &result) {
+        if (result.value == ASYNC_IO_EBUSY) {
+            lzbRemoveTwin(SD_MMC, path);
+        } else if (result.ok()) {
+            duFileRemoved(twin, meta.size);
+            fsEventRemoved(twin, false);
+        }
+    }, SD_IO_INTERACTIVE);
+}
+
+// 在网络任务上调用
+static AsyncWebServerResponse *uploadResponse(AsyncWebServerRequest *request, const UploadCommit &c) {
+    AsyncWebServerResponse *response = request->beginResponse(c.status, "text/plain", c.message);
+    if (c.status == 200) {
+        dirPager.reset();
+        response->addHeader(UPLOAD_CRC_HEADER, hashToHex(c.digest, sizeof(c.digest)));
+    }
+    return response;
+}
+
+// 写入全部完成后在网络任务上调用：关闭临时文件，检查写入是否完整、是否与客户端一致，
+// 然后提交；verify=1 时把卡上读回校验交给 uploadVerifyJob
+static void closeUpload(const std::shared_ptr<UploadCommit> &commit) {
+    UploadCommit &c = *commit;
+    bool writeBusy = false;
+    if (c.writer) {
+        c.writeFailed = !c.writer->ok() || c.writeFailed;
+        writeBusy = c.writer->busy();
+        c.writer.reset();
+    }
+    c.elapsedMs = millis() - c.startTime;
+    c.file.close();
+    if (c.reservedBytes > c.storedBytes) {
+        truncateFile(c.stagingPath.c_str(), c.storedBytes);
+    }
+    fsCacheInvalidate(c.stagingPath);
+
+    if (c.writeFailed && writeBusy) {
+        // 卡或异步 I/O 队列持续繁忙，缓冲块用尽，并非写入不完整，客户端可重试
+        c.status = 503;
+        c.message = "SD card busy, try again";
+    } else if (c.writeFailed) {
+        c.status = 500;
+        c.message = "Short write on SD card";
+    } else if (c.expectCrc && c.crc != c.expectedCrc) {
+        char expectedHex[9];
+        snprintf(expectedHex, sizeof(expectedHex), "%08x", (unsigned)c.expectedCrc);
+        c.status = 422;
+        c.message = "CRC32 mismatch: received " + hashToHex(c.digest, sizeof(c.digest)) + ", expected " + expectedHex;
+    }
+    if (c.status != 200) {
+        SD_MMC.remove(c.stagingPath);
+        fsCacheInvalidate(c.stagingPath);
+        Serial.printf("Upload rejected: %s - %s\n", c.uploadPath.c_str(), c.message.c_str());
+        return;
+    }
+
+    if (!c.verifyOnMedia) {
+        commitUpload(c);
+        return;
+    }
+
+    // 读回整个文件较慢，放到后台任务中进行，由请求回调等待其完成
+    if (!uploadVerifyJob.start([commit](BackgroundJob &job) {
+            commitUpload(*commit);
+            return commit->status == 200;
+        })) {
+        SD_MMC.remove(c.stagingPath);
+        fsCacheInvalidate(c.stagingPath);
+        c.status = 503;
+        c.message = "Another upload is still being verified";
+        return;
+    }
+    c.verifying = true;
+}
+
+// 请求回调的延迟响应等待写入排空 (随后关闭并提交) 和读回校验；只轮询，不阻塞网络任务
+static bool uploadSettled(const std::shared_ptr<UploadCommit> &commit) {
+    if (commit->writer) {
+        if (!commit->writer->done()) {
+            return false;
+        }
+        closeUpload(commit);
+    }
+    return !commit->verifying || !uploadVerifyJob.running();
+}
+
+// 性能测试在后台任务中运行 (整套测试需要数十秒)，/test-performance 轮询状态并显示结果
+#define PERF_TEST_STEPS 6
+#define PERF_TEST_STACK 12288 // KV 存储测试在栈上打开一个完整的存储
+static BackgroundJob perfTestJob("perf-test");
+static String perfTestReport; // 最近一次完成的测试结果页，只在任务未运行时读取
+
+static bool runPerformanceTest(BackgroundJob &job) {
+    // 创建测试文件路径
+    const char* testFilePath = "/speedtest.bin";
+    const char* testMessage = "This is a test file for measuring SD card performance with and without PSRAM.";
+
+    // 先写入测试文件
+    job.setProgress(0, PERF_TEST_STEPS);
+    job.setMessage("Standard file I/O");
+    writeFile(SD_MMC, testFilePath, testMessage);
+
+    // 尝试调整缓冲区大小以获得最佳性能
+    if (psramFound())
+    {
+      // 尝试使用较大的缓冲区进行测试，但不要太大以避免超时
+      size_t testBufferSize = PSRAM_BUFFER_SIZE_LARGE; // 使用中等大小的缓冲区
+      if (g_psramBuffer.getSize() < testBufferSize)
+      {
+        Serial.printf("Resizing buffer for performance test from %u to %u bytes\n",
+                      g_psramBuffer.getSize(), testBufferSize);
+        g_psramBuffer.resize(testBufferSize);
+        Serial.printf("New buffer size: %u bytes (%.2f KB)\n",
+                      g_psramBuffer.getSize(), g_psramBuffer.getSize() / 1024.0);
+      }
+    }
+
+    // 执行标准测试
+    Serial.println("\n=== Standard File I/O Test ===");
+    uint32_t startStd = millis();
+    testFileIO(SD_MMC, testFilePath);
+    uint32_t endStd = millis();
+
+    if (job.cancelled()) {
+        return false;
+    }
+    // 执行PSRAM增强测试
+    job.setProgress(1, PERF_TEST_STEPS);
+    job.setMessage("PSRAM file I/O");
+    Serial.println("\n=== PSRAM Enhanced File I/O Test ===");
+    uint32_t startPSRAM = millis();
+    testFileIO_PSRAM(SD_MMC, testFilePath);
+    uint32_t endPSRAM = millis();
+
+    if (job.cancelled()) {
+        return false;
+    }
+    // 日志追加流：两个生产者任务以共 10000 条/秒的速率持续写入 3 秒，64 字节记录
+    job.setProgress(2, PERF_TEST_STEPS);
+    job.setMessage("Append stream");
+    Serial.println("\n=== AppendStream Test ===");
+    DynamicJsonDocument appendDoc(1024);
+    JsonObject appendStats = appendDoc.to<JsonObject>();
+    float appendRate = testAppendStream(SD_MMC, "/appendtest.log", APPEND_TEST_RATE, APPEND_TEST_MS, 64, appendStats);
+
+    if (job.cancelled()) {
+        return false;
+    }
+    // 键值存储：5000 条 100 字节记录的写入/查找/扫描
+    job.setProgress(3, PERF_TEST_STEPS);
+    job.setMessage("KV store");
+    Serial.println("\n=== KV Store Test ===");
+    DynamicJsonDocument kvDoc(1024);
+    JsonObject kvStats = kvDoc.to<JsonObject>();
+    float kvRate = testKvStore("/kvbench", 5000, 100, kvStats);
+
+    if (job.cancelled()) {
+        return false;
+    }
+    // 加密开销：明文与加密读写对比
+    job.setProgress(4, PERF_TEST_STEPS);
+    job.setMessage("Encryption");
+    Serial.println("\n=== Encryption Test ===");
+    DynamicJsonDocument cryptDoc(512);
+    JsonObject cryptStats = cryptDoc.to<JsonObject>();
+    float cryptOverhead = testCrypt(SD_MMC, "/cryptbench.bin", 4 * 1024 * 1024, cryptStats);
+
+    if (job.cancelled()) {
+        return false;
+    }
+    // /tail 跟随：通过 appendFile 追加，检查跟随者能看到每一行
+    job.setProgress(5, PERF_TEST_STEPS);
+    job.setMessage("Tail follow");
+    Serial.println("\n=== Tail Follow Test ===");
+    DynamicJsonDocument tailDoc(512);
+    JsonObject tailStats = tailDoc.to<JsonObject>();
+    float tailLatency = testTailFollow(SD_MMC, "/tailtest.log", 50, tailStats);
+
+    // 构建响应
+    String response = "<html><head><title>SD Card Performance Test</title>";
+    response += "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">";
+    response += "<style>body{font-family:Arial,sans-serif;margin:20px;line-height:1.6;max-width:800px;margin:0 auto;padding:20px}";
+    response += "h1{color:#4a89dc}table{border-collapse:collapse;width:100%;margin:20px 0}";
+    response += "th,td{border:1px solid #ddd;padding:8px;text-align:left}";
+    response += "th{background-color:#f2f2f2}tr:nth-child(even){background-color:#f9f9f9}";
+    response += "tr:hover{background-color:#f1f1f1}.improvement{font-weight:bold;color:#5cb85c}</style></head>";
+    response += "<body><h1>SD Card Performance Test Results</h1>";
+    response += "<p>This test compares standard SD card operations with PSRAM-enhanced operations.</p>";
+
+    // 添加PSRAM信息
+    response += "<h2>PSRAM Status</h2>";
+    if (psramFound()) {
+        size_t psramSize = ESP.getPsramSize();
+        size_t freePsram = ESP.getFreePsram();
+        size_t usedPsram = psramSize - freePsram;
+        float usagePercent = usedPsram * 100.0 / psramSize;
+
+        response += "<p>PSRAM is available: " + String(psramSize / 1024) + " KB total, " +
+                    String(freePsram / 1024) + " KB free (" +
+                    String(usagePercent, 1) + "% used)</p>";
+
+        // 添加更多详细信息
+        response += "<p>Used PSRAM: " + String(usedPsram / 1024) + " KB</p>";
+        response += "<p>Largest free block: " +
+                    String(heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 1024) + " KB</p>";
+
+        // 缓冲区信息
+        response += "<h3>Buffer Information</h3>";
+        response += "<p>Current buffer size: " + String(g_psramBuffer.getSize() / 1024) + " KB</p>";
+        response += "<p>Buffer is in " + String(g_psramBuffer.isPSRAM() ? "PSRAM" : "regular memory") + "</p>";
+
+        // 添加推荐缓冲区大小
+        response += "<h3>Recommended Buffer Sizes</h3>";
+        size_t maxAllowedSize = freePsram * PSRAM_USAGE_PERCENT;
+        response += "<p>Maximum recommended: " + String(maxAllowedSize / 1024) + " KB</p>";
+
+        // 计算不同场景的最佳缓冲区大小
+        size_t optimalDefault = min(maxAllowedSize, (size_t)PSRAM_BUFFER_SIZE_DEFAULT);
+        size_t optimalLarge = min(maxAllowedSize, (size_t)PSRAM_BUFFER_SIZE_LARGE);
+        size_t optimalMax = min(maxAllowedSize, (size_t)PSRAM_BUFFER_SIZE_MAX);
+
+        response += "<p>Default: " + String(optimalDefault / 1024) + " KB | " + "Large: " + String(optimalLarge / 1024) + " KB | " + "Maximum: " + String(optimalMax / 1024) + " KB</p>";
+    } else {
+        response += "<p>PSRAM is not available on this device.</p>";
+    }
+
+    // 添加测试结果表格
+    response += "<h2>Performance Comparison</h2>";
+    response += "<table><tr><th>Test Type</th><th>Standard I/O</th><th>PSRAM Enhanced</th><th>Improvement</th></tr>";
+
+    // 计算性能提升
+    float improvement = ((endStd - startStd) > 0) ?
+                       (float)(endStd - startStd - (endPSRAM - startPSRAM)) / (endStd - startStd) * 100.0 : 0;
+
+    response += "<tr><td>Total Test Time</td>";
+    response += "<td>" + String(endStd - startStd) + " ms</td>";
+    response += "<td>" + String(endPSRAM - startPSRAM) + " ms</td>";
+    response += "<td class=\"improvement\">" + String(improvement, 1) + "% faster</td></tr>";
+
+    response += "</table>";
+
+    response += "<h2>Append Stream (" + String(APPEND_TEST_RATE) + " records/s x " + String(APPEND_TEST_MS / 1000) +
+                " s, 64 B, " + String(APPEND_TEST_PRODUCERS) + " producers)</h2>";
+    response += "<table><tr><th>Metric</th><th>Value</th></tr>";
+    response += "<tr><td>Result</td><td>" + String((bool)appendStats["passed"] ? "passed" : "FAILED") + "</td></tr>";
+    response += "<tr><td>Records per second (target / sustained)</td><td>" + String(APPEND_TEST_RATE) + " / " +
+                String(appendRate, 0) + "</td></tr>";
+    response += "<tr><td>Records per second to file (through final flush)</td><td>" +
+                String((float)appendStats["toFileRecordsPerSec"], 0) + "</td></tr>";
+    response += "<tr><td>Dropped records</td><td>" + String((uint32_t)appendStats["droppedRecords"]) + "</td></tr>";
+    response += "<tr><td>Card writes / syncs</td><td>" + String((uint32_t)appendStats["writes"]) + " / " +
+                String((uint32_t)appendStats["syncs"]) + "</td></tr>";
+    response += "<tr><td>Latency to file (avg / max)</td><td>" + String((uint32_t)appendStats["avgLatencyUs"]) +
+                " us / " + String((uint32_t)appendStats["maxLatencyUs"]) + " us</td></tr>";
+    response += "</table>";
+
+    response += "<h2>KV Store (5000 x 100 B records)</h2>";
+    response += "<table><tr><th>Metric</th><th>Value</th></tr>";
+    response += "<tr><td>Puts per second</td><td>" + String(kvRate, 0) + "</td></tr>";
+    response += "<tr><td>Put latency (p50 / p99)</td><td>" + String((uint32_t)kvStats["putP50Us"]) + " us / " +
+                String((uint32_t)kvStats["putP99Us"]) + " us</td></tr>";
+    response += "<tr><td>Gets per second (half misses)</td><td>" + String((float)kvStats["getsPerSec"], 0) + "</td></tr>";
+    response += "<tr><td>Get latency (p50 / p99)</td><td>" + String((uint32_t)kvStats["getP50Us"]) + " us / " +
+                String((uint32_t)kvStats["getP99Us"]) + " us</td></tr>";
+    response += "<tr><td>Scanned keys per second</td><td>" + String((float)kvStats["scanKeysPerSec"], 0) + "</td></tr>";
+    response += "<tr><td>Segments / flushes / compactions</td><td>" + String((uint32_t)kvStats["segments"]) + " / " +
+                String((uint32_t)kvStats["flushes"]) + " / " + String((uint32_t)kvStats["compactions"]) + "</td></tr>";
+    response += "</table>";
+
+    response += "<h2>Encryption (4 MB, AES-256-CTR, " + String(AesCtr::backend()) + ")</h2>";
+    response += "<table><tr><th>Metric</th><th>Plain</th><th>Encrypted</th><th>Overhead</th></tr>";
+    response += "<tr><td>Upload path</td><td>" + String((float)cryptStats["plainWriteMBps"], 2) + " MB/s</td><td>" +
+                String((float)cryptStats["encryptedWriteMBps"], 2) + " MB/s</td><td>" +
+                String((float)cryptStats["writeOverheadPct"], 1) + "%</td></tr>";
+    response += "<tr><td>Download path</td><td>" + String((float)cryptStats["plainReadMBps"], 2) + " MB/s</td><td>" +
+                String((float)cryptStats["encryptedReadMBps"], 2) + " MB/s</td><td>" +
+                String((float)cryptStats["readOverheadPct"], 1) + "%</td></tr>";
+    response += "<tr><td>Cipher alone</td><td colspan=\"3\">" + String((float)cryptStats["cipherMBps"], 1) + " MB/s</td></tr>";
+    response += "<tr><td>Content and header check</td><td colspan=\"3\">" +
+                String((bool)cryptStats["plainOk"] && (bool)cryptStats["encryptedOk"] ? "passed" : "FAILED") + "</td></tr>";
+    response += "</table>";
+    if (cryptOverhead > 10) {
+        response += "<p>Encrypted uploads or downloads are more than 10% slower than plain ones on this card.</p>";
+    }
+
+    response += "<h2>Tail Follow (50 appends)</h2>";
+    response += "<table><tr><th>Metric</th><th>Value</th></tr>";
+    response += "<tr><td>Result</td><td>" + String((bool)tailStats["passed"] ? "passed" : "FAILED") + "</td></tr>";
+    response += "<tr><td>Missed appends</td><td>" + String((uint32_t)tailStats["missedAppends"]) + "</td></tr>";
+    response += "<tr><td>Append to visible (avg / max)</td><td>" + String(tailLatency, 1) + " ms / " +
+                String((uint32_t)tailStats["maxLatencyMs"]) + " ms</td></tr>";
+    response += "<tr><td>Followed after rotation</td><td>" + String((bool)tailStats["rotationOk"] ? "yes" : "no") + "</td></tr>";
+    response += "</table>";
+    response += "<p><a href=\"/test-performance?run=1\">Run again</a> | <a href=\"/\">&laquo; Back to File Browser</a></p>";
+    response += "</body></html>";
+
+    perfTestReport = response;
+    job.setProgress(PERF_TEST_STEPS, PERF_TEST_STEPS);
+    job.setMessage("Done");
+    return true;
+}
+
 bool initSDCard() {
   Serial.println("  - Begin SD_MMC mounting...");
 
   // Try to initialize with minimal settings first
-  if (!SD_MMC.begin("/sdcard", true)) {  // 1-bit mode
+  if (!SD_MMC.begin(SD_MOUNT_POINT, true)) {  // 1-bit mode
     Serial.println("  - Basic mount failed, trying with detailed parameters...");
 
     // More detailed initialization with all parameters
-    if (!SD_MMC.begin("/sdcard", true, true, SDMMC_FREQ_DEFAULT, 5)) {
+    if (!SD_MMC.begin(SD_MOUNT_POINT, true, true, SDMMC_FREQ_DEFAULT, 5)) {
       Serial.println("  - Detailed mount also failed");
       return false;
     }
@@ -742,6 +1650,38 @@ void setup() {
         // Continue with WiFi setup anyway
     }
 
+    // SD卡扇区缓存 (位于FAT层与SDMMC驱动之间)
+    if (sdInitialized) {
+        blockCacheBegin();
+    }
+
+    // SD卡访问调度：目录列表等交互请求优先于大文件传输和后台任务
+    sdIoBegin();
+    // 异步文件 I/O 任务：下载预读和上传写卡不再占用网络任务
+    if (sdInitialized) {
+        asyncIoBegin(SD_MMC, dirPager);
+    }
+
+    // 元数据缓存和只读句柄缓存，减少重复的FAT路径查找
+    g_metaCache.begin(SD_MMC);
+    g_handleCache.begin(SD_MMC);
+
+    // 加密目录及其密钥 (保存在 NVS 中)
+    cryptBegin();
+
+    // 校验和索引及计算任务
+    if (sdInitialized) {
+        checksumBegin(SD_MMC);
+        // 目录用量树在后台遍历构建
+        duBegin();
+        // 键值存储 (重放未写入段文件的日志)
+        kvBegin();
+        // 缩略图生成任务
+        thumbBegin(SD_MMC);
+        // 媒体元数据索引 (加载后在后台补齐新增和修改过的文件)
+        mediaIndexBegin(SD_MMC);
+    }
+
     // 设置WiFi接入点模式
     Serial.println("Setting up WiFi access point...");
     // WiFi.softAP(ssid, password);
@@ -791,46 +1731,86 @@ void setup() {
     });
 
     // 列出目录内容
+    // 带 cursor/limit 参数时分页返回 {"entries":[[name,size,isDir],...],"next":N,"done":bool}
     server.on("/list", HTTP_GET, [](AsyncWebServerRequest *request){
         String dirPath = "/";
         if (request->hasParam("dir")) {
             dirPath = request->getParam("dir")->value();
         }
+        if (request->hasParam("cursor") || request->hasParam("limit")) {
+            uint32_t cursor = 0;
+            uint32_t limit = DIR_PAGER_DEFAULT_LIMIT;
+            if (request->hasParam("cursor")) {
+                cursor = request->getParam("cursor")->value().toInt();
+            }
+            if (request->hasParam("limit")) {
+                limit = constrain(request->getParam("limit")->value().toInt(), 1, DIR_PAGER_MAX_LIMIT);
+            }
 
-        File root = SD_MMC.open(dirPath);
-        if (!root) {
-            request->send(404, "text/plain", "Directory not found");
-            return;
-        }
-
-        if (!root.isDirectory()) {
-            request->send(400, "text/plain", "Not a directory");
+            // 页面同样由异步 I/O 任务读取，dirPager 在任务中保存打开的目录会话
+            std::shared_ptr<AsyncIoPending> page = std::make_shared<AsyncIoPending>([dirPath, cursor, limit]() {
+                return g_asyncIo.readdir(dirPath.c_str(), cursor, limit, nullptr, SD_IO_INTERACTIVE);
+            });
+            request->send(new DeferredResponse(
+                [page]() { return page->ready(); },
+                [page, cursor, limit](AsyncWebServerRequest *request) -> AsyncWebServerResponse * {
+                    const AsyncIoResult &result = page->result();
+                    if (!result.ok()) {
+                        return request->beginResponse(404, "text/plain", "Directory not found");
+                    }
+                    DynamicJsonDocument doc(limit * 64 + 256);
+                    JsonArray entries = doc["entries"].to<JsonArray>();
+                    for (const AsyncIoDirEntry &entry : result.entries) {
+                        JsonArray e = entries.add<JsonArray>();
+                        e.add(entry.name.c_str());
+                        e.add((uint32_t)entry.size);
+                        e.add(entry.isDirectory ? 1 : 0);
+                    }
+                    doc["next"] = cursor + result.entries.size();
+                    doc["done"] = result.entries.size() < limit;
+
+                    String response;
+                    serializeJson(doc, response);
+                    return request->beginResponse(200, "application/json", response);
+                }));
             return;
         }
 
-        DynamicJsonDocument doc(8192);
-        JsonArray directories = doc["directories"].to<JsonArray>();
-        JsonArray files = doc["files"].to<JsonArray>();
+        // 整个目录由异步 I/O 任务读取，读完前网络任务不被阻塞
+        std::shared_ptr<AsyncIoPending> listing = std::make_shared<AsyncIoPending>([dirPath]() {
+            return g_asyncIo.readdir(dirPath.c_str(), 0, UINT32_MAX, nullptr, SD_IO_INTERACTIVE);
+        });
+        request->send(new DeferredResponse(
+            [listing]() { return listing->ready(); },
+            [listing, dirPath](AsyncWebServerRequest *request) -> AsyncWebServerResponse * {
+                const AsyncIoResult &result = listing->result();
+                if (!result.ok()) {
+                    FsMeta meta;
+                    if (g_metaCache.stat(dirPath, meta) && !meta.isDirectory) {
+                        return request->beginResponse(400, "text/plain", "Not a directory");
+                    }
+                    return request->beginResponse(404, "text/plain", "Directory not found");
+                }
 
-        File file = root.openNextFile();
-        while (file) {
-            if (file.isDirectory()) {
-                String dirName = String(file.name());
-                dirName = dirName.substring(dirName.lastIndexOf('/') + 1);
-                directories.add(dirName);
-            } else {
-              JsonObject fileObj = files.add<JsonObject>();
-              String fileName = String(file.name());
-              fileName = fileName.substring(fileName.lastIndexOf('/') + 1);
-              fileObj["name"] = fileName;
-              fileObj["size"] = file.size();
-            }
-            file = root.openNextFile();
-        }
+                DynamicJsonDocument doc(8192);
+                JsonArray directories = doc["directories"].to<JsonArray>();
+                JsonArray files = doc["files"].to<JsonArray>();
+                for (const AsyncIoDirEntry &entry : result.entries) {
+                    String name = entry.name.c_str();
+                    name = name.substring(name.lastIndexOf('/') + 1);
+                    if (entry.isDirectory) {
+                        directories.add(name);
+                    } else {
+                        JsonObject fileObj = files.add<JsonObject>();
+                        fileObj["name"] = name;
+                        fileObj["size"] = entry.size;
+                    }
+                }
 
-        String response;
-        serializeJson(doc, response);
-        request->send(200, "application/json", response);
+                String response;
+                serializeJson(doc, response);
+                return request->beginResponse(200, "application/json", response);
+            }));
     });
 
     // 下载文件 - 使用PSRAM缓冲区加速
@@ -841,55 +1821,396 @@ void setup() {
         }
 
         String path = request->getParam("path")->value();
-        if (!SD_MMC.exists(path)) {
+
+        // 元数据缓存命中时无需再遍历FAT目录
+        FsMeta meta;
+        bool found = g_metaCache.stat(path, meta) && !meta.isDirectory;
+        bool raw = request->hasParam("raw") && request->getParam("raw")->value() == "1";
+        if (!found && !lzbIsCompressed(path)) {
+            // 压缩存储的文件也可以用原始文件名下载
+            String stored = path + LZB_SUFFIX;
+            if (g_metaCache.stat(stored, meta) && !meta.isDirectory) {
+                path = stored;
+                found = true;
+            }
+        }
+        if (!found) {
             request->send(404, "text/plain", "File not found");
             return;
         }
 
-        File file = SD_MMC.open(path);
-        if (!file) {
+        // .lz4b 文件解压后发送，raw=1 时按原样下载
+        if (lzbIsCompressed(path) && !raw) {
+            LzbReader *reader = new LzbReader();
+            if (!reader->open(SD_MMC, path)) {
+                delete reader;
+                request->send(500, "text/plain", "Corrupt compressed file");
+                return;
+            }
+
+            // 块索引使任意偏移只需解压一个块，因此支持 Range: bytes=a-b / bytes=-n
+            uint64_t total = reader->size();
+            uint64_t first = 0;
+            uint64_t last = total ? total - 1 : 0;
+            bool partial = false;
+            if (request->hasHeader("Range")) {
+                String range = request->header("Range");
+                int dash = range.indexOf('-');
+                if (!range.startsWith("bytes=") || dash < 0 || range.indexOf(',') >= 0) {
+                    delete reader;
+                    request->send(416, "text/plain", "Unsupported range");
+                    return;
+                }
+                String from = range.substring(6, dash);
+                String to = range.substring(dash + 1);
+                if (from.length() == 0) {
+                    uint64_t n = strtoull(to.c_str(), nullptr, 10);
+                    first = total - min(n, total);
+                } else {
+                    first = strtoull(from.c_str(), nullptr, 10);
+                    if (to.length() > 0) {
+                        last = min((uint64_t)strtoull(to.c_str(), nullptr, 10), last);
+                    }
+                }
+                if (total == 0 || first > last) {
+                    delete reader;
+                    AsyncWebServerResponse *response = request->beginResponse(416, "text/plain", "Range not satisfiable");
+                    response->addHeader("Content-Range", "bytes */" + String((unsigned long)total));
+                    request->send(response);
+                    return;
+                }
+                partial = true;
+            }
+
+            String logical = lzbLogicalPath(path);
+            String fileName = logical.substring(logical.lastIndexOf('/') + 1);
+            uint32_t startTime = millis();
+            size_t length = total ? last - first + 1 : 0;
+            SdIoClass ioClass = sdIoReadClass(length);
+            // 解压也由异步 I/O 任务完成并预读；reader 在最后一次读取完成后才释放
+            std::shared_ptr<AsyncReadStream> stream = std::make_shared<AsyncReadStream>();
+            if (!stream->begin(*reader, first, length, ioClass, [reader]() { delete reader; })) {
+                delete reader;
+                request->send(503, "text/plain", "Too many open transfers");
+                return;
+            }
+            std::shared_ptr<EgressFlow> egress = std::make_shared<EgressFlow>(request, logical, egressWeight(request));
+            if (!egress->admitted()) {
+                AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Too many downloads");
+                response->addHeader("Retry-After", "1");
+                request->send(response);
+                return;
+            }
+            AsyncWebServerResponse *response = request->beginResponse(getContentType(fileName), length,
+                [stream, reader, logical, length, startTime, egress](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                    size_t allowed = egress->allow(min(maxLen, (size_t)ASYNC_IO_CHUNK_SIZE));
+                    if (allowed == 0) {
+                        return RESPONSE_TRY_AGAIN;
+                    }
+                    size_t n = stream->fill(buffer, allowed, index);
+                    if (n == 0) {
+                        return stream->failed() ? 0 : RESPONSE_TRY_AGAIN;
+                    }
+                    egress->sent(n);
+                    if (index + n >= length) {
+                        // 最后一块已读完，存储字节数不再变化
+                        lzbRecordTransfer(LZB_DOWNLOAD, logical, true, length, reader->getStoredBytesRead(),
+                                          millis() - startTime);
+                    }
+                    return n;
+                });
+            if (partial) {
+                response->setCode(206);
+                response->addHeader("Content-Range", "bytes " + String((unsigned long)first) + "-" +
+                                    String((unsigned long)last) + "/" + String((unsigned long)total));
+            }
+            response->addHeader("Accept-Ranges", "bytes");
+            response->addHeader("Content-Disposition", "attachment; filename=" + fileName);
+            response->addHeader("X-Stored-Size", String(meta.size));
+            Serial.printf("Downloading compressed file: %s, %u -> %u bytes\n", path.c_str(), meta.size, length);
+            request->send(response);
+            return;
+        }
+
+        // 只打开一次文件；最近下载过的文件直接复用已打开的句柄
+        FileLease *lease = new FileLease(g_handleCache.acquire(path));
+        if (!lease->file) {
+            delete lease;
             request->send(500, "text/plain", "Failed to open file for reading");
             return;
         }
 
+        // 加密文件跳过文件头，读出后在发送缓冲区中原地解密
+        std::shared_ptr<FileCipher> cipher = std::make_shared<FileCipher>();
+        CryptState crypt = cryptProbe(lease->file, *cipher);
+        if (crypt == CRYPT_LOCKED) {
+            g_handleCache.release(*lease);
+            delete lease;
+            request->send(403, "text/plain", "File is encrypted with a key this device does not have");
+            return;
+        }
+        if (crypt == CRYPT_PLAIN) {
+            cipher.reset();
+        }
+        size_t skip = cipher ? CRYPT_HEADER_SIZE : 0;
+
         String fileName = path;
         if (path.lastIndexOf('/') >= 0) {
             fileName = path.substring(path.lastIndexOf('/') + 1);
         }
 
-        // 使用标准响应方式，内部会使用我们的PSRAM缓冲区
-        // 因为SD_MMC库会使用全局缓冲区
-        AsyncWebServerResponse *response = request->beginResponse(SD_MMC, path, getContentType(fileName));
+        size_t fileSize = meta.size - skip;
+        uint32_t startTime = millis();
+        // 小文件按“小读取”调度，大文件按批量传输调度
+        SdIoClass ioClass = sdIoReadClass(fileSize);
+        // 由异步 I/O 任务预读，发送当前块时下一块已在读取；句柄在最后一次读取完成后才归还
+        std::shared_ptr<AsyncReadStream> stream = std::make_shared<AsyncReadStream>();
+        if (!stream->begin(lease->file, skip, fileSize, ioClass, [lease]() {
+                g_handleCache.release(*lease);
+                delete lease;
+            })) {
+            g_handleCache.release(*lease);
+            delete lease;
+            request->send(503, "text/plain", "Too many open transfers");
+            return;
+        }
+        // 按客户端限速并在并发下载之间按权重 (weight=1~16) 公平分配带宽
+        std::shared_ptr<EgressFlow> egress = std::make_shared<EgressFlow>(request, path, egressWeight(request));
+        if (!egress->admitted()) {
+            // 下载表已满时不再不限速发送；stream 析构时归还句柄
+            AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Too many downloads");
+            response->addHeader("Retry-After", "1");
+            request->send(response);
+            return;
+        }
+        AsyncWebServerResponse *response = request->beginResponse(getContentType(fileName), fileSize,
+            [stream, cipher, path, fileSize, startTime, egress](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                size_t allowed = egress->allow(min(maxLen, (size_t)ASYNC_IO_CHUNK_SIZE));
+                if (allowed == 0) {
+                    return RESPONSE_TRY_AGAIN;
+                }
+                // 数据还在读取时稍后重试，不阻塞网络任务
+                size_t n = stream->fill(buffer, allowed, index);
+                if (n == 0) {
+                    return stream->failed() ? 0 : RESPONSE_TRY_AGAIN;
+                }
+                egress->sent(n);
+                if (cipher) {
+                    cipher->apply(index, buffer, buffer, n);
+                }
+                if (index + n >= fileSize) {
+                    // 未压缩下载的吞吐作为 /compress/stats 的对比基准
+                    lzbRecordTransfer(LZB_DOWNLOAD, path, false, fileSize, fileSize, millis() - startTime);
+                }
+                return n;
+            });
         response->addHeader("Content-Disposition", "attachment; filename=" + fileName);
 
         // 添加缓存控制头，优化浏览器缓存
         response->addHeader("Cache-Control", "public, max-age=86400");
 
-        // 添加文件大小信息
-        response->addHeader("Content-Length", String(file.size()));
-
-        // 添加文件修改时间（如果有）
-        // 注意：SD卡库可能不支持获取文件时间
-
         // 记录下载信息
-        Serial.printf("Downloading file: %s, size: %u bytes\n", path.c_str(), file.size());
+        Serial.printf("Downloading file: %s, size: %u bytes\n", path.c_str(), fileSize);
 
         request->send(response);
     });
 
-    // 上传文件 - 使用PSRAM缓冲区加速
-    server.on("/upload", HTTP_POST, [](AsyncWebServerRequest *request){
-        request->send(200);
-    }, [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
-        static File uploadFile;
-        static String uploadPath;
-        static uint32_t startTime;
-        static size_t totalBytes = 0;
-        static bool usePSRAM = false;
+    // 按偏移读取文件的一段 (十六进制/文本查看器)，只需一次 seek
+    server.on("/read", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+
+        String path = request->getParam("path")->value();
+        FsMeta meta;
+        if (!g_metaCache.stat(path, meta) || meta.isDirectory) {
+            request->send(404, "text/plain", "File not found");
+            return;
+        }
+
+        // .lz4b 文件按原始内容的偏移读取 (raw=1 读存储的字节)
+        std::shared_ptr<LzbReader> reader;
+        if (lzbIsCompressed(path) && !(request->hasParam("raw") && request->getParam("raw")->value() == "1")) {
+            reader = std::make_shared<LzbReader>();
+            if (!reader->open(SD_MMC, path)) {
+                request->send(500, "text/plain", "Corrupt compressed file");
+                return;
+            }
+            meta.size = reader->size();
+        }
+
+        // 由异步 I/O 任务预读：加密文件按明文偏移读取，.lz4b 在任务中按块解压
+        FileLease *lease = nullptr;
+        std::shared_ptr<FileCipher> cipher;
+        if (!reader) {
+            lease = new FileLease(g_handleCache.acquire(path));
+            if (!lease->file) {
+                delete lease;
+                request->send(500, "text/plain", "Failed to open file for reading");
+                return;
+            }
+            cipher = std::make_shared<FileCipher>();
+            CryptState crypt = cryptProbe(lease->file, *cipher);
+            if (crypt == CRYPT_LOCKED) {
+                g_handleCache.release(*lease);
+                delete lease;
+                request->send(403, "text/plain", "File is encrypted with a key this device does not have");
+                return;
+            }
+            if (crypt == CRYPT_ENCRYPTED) {
+                meta.size -= CRYPT_HEADER_SIZE;
+            } else {
+                cipher.reset();
+            }
+        }
+
+        uint64_t offset = 0;
+        uint64_t len = meta.size;
+        if (request->hasParam("offset")) {
+            offset = strtoull(request->getParam("offset")->value().c_str(), nullptr, 10);
+        }
+        if (request->hasParam("len")) {
+            len = strtoull(request->getParam("len")->value().c_str(), nullptr, 10);
+        }
+        if (offset > meta.size) {
+            if (lease) {
+                g_handleCache.release(*lease);
+                delete lease;
+            }
+            request->send(416, "text/plain", "Offset beyond end of file");
+            return;
+        }
+        len = min(len, (uint64_t)meta.size - offset);
+
+        std::shared_ptr<AsyncReadStream> stream = std::make_shared<AsyncReadStream>();
+        if (lease) {
+            size_t skip = cipher ? CRYPT_HEADER_SIZE : 0;
+            if (!stream->begin(lease->file, skip + offset, len, SD_IO_SMALL, [lease]() {
+                    g_handleCache.release(*lease);
+                    delete lease;
+                })) {
+                g_handleCache.release(*lease);
+                delete lease;
+                request->send(503, "text/plain", "Too many open transfers");
+                return;
+            }
+        } else if (!stream->begin(*reader, offset, len, SD_IO_SMALL, [reader]() {
+                       // 持有 reader 直到最后一次读取完成
+                   })) {
+            request->send(503, "text/plain", "Too many open transfers");
+            return;
+        }
+
+        uint32_t start = offset;
+        AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", len,
+            [start, cipher, stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                // 数据还在读取时稍后重试，不阻塞网络任务
+                size_t n = stream->fill(buffer, maxLen, index);
+                if (n == 0) {
+                    return stream->failed() ? 0 : RESPONSE_TRY_AGAIN;
+                }
+                if (cipher) {
+                    cipher->apply(start + index, buffer, buffer, n);
+                }
+                return n;
+            });
+        response->addHeader("X-File-Size", String(meta.size));
+        response->addHeader("Cache-Control", "no-cache");
+        request->send(response);
+    });
+
+    // 文件末尾 bytes 字节；follow=1 时保持连接，以分块编码持续推送新追加的内容
+    server.on("/tail", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+
+        String path = request->getParam("path")->value();
+        FsMeta meta;
+        if (!g_metaCache.stat(path, meta) || meta.isDirectory) {
+            request->send(404, "text/plain", "File not found");
+            return;
+        }
+
+        uint32_t bytes = TAIL_DEFAULT_BYTES;
+        if (request->hasParam("bytes")) {
+            bytes = strtoul(request->getParam("bytes")->value().c_str(), nullptr, 10);
+        }
+        uint32_t start = meta.size - min(bytes, meta.size);
+        bool follow = request->hasParam("follow") && request->getParam("follow")->value() == "1";
+
+        if (!follow) {
+            AsyncWebServerResponse *response = request->beginResponse("text/plain", meta.size - start,
+                [path, start](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                    BlockCacheRouteScope route("/tail");
+                    return readFileRange(path, start + index, buffer, maxLen);
+                });
+            response->addHeader("X-File-Size", String(meta.size));
+            request->send(response);
+            return;
+        }
+
+        std::shared_ptr<TailFollower> follower = std::make_shared<TailFollower>(path, start);
+        if (!follower->admit()) {
+            request->send(503, "text/plain", "Too many followers");
+            return;
+        }
+        AsyncWebServerResponse *response = request->beginChunkedResponse("text/plain",
+            [follower](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                return follower->fill(buffer, maxLen);
+            });
+        response->addHeader("Cache-Control", "no-cache");
+        response->addHeader("X-Content-Type-Options", "nosniff");
+        request->send(response);
+    });
+
+    // 上传文件 - 使用PSRAM缓冲区加速
+    server.on("/upload", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (uploadDoneRequest != request || !uploadDone) {
+            request->send(400, "text/plain", "No file in request");
+            return;
+        }
+        std::shared_ptr<UploadCommit> commit = uploadDone;
+        uploadDoneRequest = nullptr;
+        uploadDone.reset();
+
+        if (!uploadSettled(commit)) {
+            // 写入排空、读回校验完成前不发送任何内容，网络任务不被阻塞
+            request->send(new DeferredResponse(
+                [commit]() { return uploadSettled(commit); },
+                [commit](AsyncWebServerRequest *request) { return uploadResponse(request, *commit); }));
+            return;
+        }
+        request->send(uploadResponse(request, *commit));
+    }, [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
+        BlockCacheRouteScope route("/upload");
+        static File uploadFile;
+        static AsyncWebServerRequest *uploadRequest = nullptr;
+        static size_t reservedBytes = 0;
+        static String uploadPath;
+        static uint32_t startTime;
+        static size_t totalBytes = 0;
+        static bool usePSRAM = false;
         static uint8_t *psramBuffer = nullptr;
         static size_t bufferSize = 0;
+        static String stagingPath;
+        static Hasher uploadCrc(HASH_CRC32);
+        static bool writeFailed = false;
+        static bool expectCrc = false;
+        static uint32_t expectedCrc = 0;
+        static bool verifyOnMedia = false;
+        static LzbWriter *compressor = nullptr;
+        static AsyncWriteStream *uploadWriter = nullptr;
+        static String storedPath;
+        static FileCipher uploadCipher;
+        static bool encryptUpload = false;
 
         if (!index) {
+            uploadDoneRequest = nullptr;
+            uploadDone.reset();
+
             // 获取上传路径参数，两个地方都尝试获取
             String path = "/";
 
@@ -919,10 +2240,13 @@ void setup() {
             Serial.print("Upload Start: ");
             Serial.println(uploadPath);
 
-            // 确保目录存在
-            if (path != "/" && !SD_MMC.exists(path)) {
+            // 确保目录存在 (目录存在性由元数据缓存回答)
+            fsCacheInvalidate(uploadPath);
+            if (path != "/" && !g_metaCache.exists(path)) {
                 if (createDir(SD_MMC, path.c_str())) {
                     Serial.println("Created directory: " + path);
+                    fsEventAdded(path, 0, true);
+                    duDirAdded(path);
                 } else {
                     Serial.println("Failed to create directory: " + path);
                 }
@@ -973,53 +2297,220 @@ void setup() {
               bufferSize = 0;
             }
 
-            // 打开文件进行写入
-            uploadFile = SD_MMC.open(uploadPath, FILE_WRITE);
+            // 客户端提供的校验值；verify=1 时写完后从卡上读回再校验一次
+            expectCrc = request->hasHeader(UPLOAD_CRC_HEADER);
+            if (expectCrc) {
+                expectedCrc = strtoul(request->getHeader(UPLOAD_CRC_HEADER)->value().c_str(), nullptr, 16);
+            }
+            verifyOnMedia = request->hasParam("verify") && request->getParam("verify")->value() == "1";
+
+            // compress=1: 以 .lz4b 格式存储，由另一个核心压缩
+            bool compress = (request->hasParam("compress") && request->getParam("compress")->value() == "1") ||
+                            (request->hasParam("compress", true) && request->getParam("compress", true)->value() == "1");
+            // 加密目录中的文件不压缩，写入前逐块加密
+            encryptUpload = cryptIsEncryptedPath(uploadPath);
+            compress = compress && !encryptUpload;
+            storedPath = compress ? uploadPath + LZB_SUFFIX : uploadPath;
+
+            // 打开临时文件进行写入
+            stagingPath = storedPath + UPLOAD_STAGING_SUFFIX;
+            fsCacheInvalidate(stagingPath);
+            uploadFile = SD_MMC.open(stagingPath, FILE_WRITE);
+            delete compressor;
+            compressor = nullptr;
+            if (uploadFile && compress) {
+                compressor = new LzbWriter();
+                if (!compressor->begin(uploadFile)) {
+                    Serial.println("Compression pipeline unavailable, storing uncompressed");
+                    delete compressor;
+                    compressor = nullptr;
+                    uploadFile.close();
+                    SD_MMC.remove(stagingPath);
+                    fsCacheInvalidate(stagingPath);
+                    storedPath = uploadPath;
+                    stagingPath = storedPath + UPLOAD_STAGING_SUFFIX;
+                    fsCacheInvalidate(stagingPath);
+                    uploadFile = SD_MMC.open(stagingPath, FILE_WRITE);
+                }
+            }
+
+            if (uploadFile && encryptUpload) {
+                uint8_t header[CRYPT_HEADER_SIZE];
+                if (!uploadCipher.create(uploadPath, header) || uploadFile.write(header, sizeof(header)) != sizeof(header)) {
+                    uploadFile.close();
+                    SD_MMC.remove(stagingPath);
+                    fsCacheInvalidate(stagingPath);
+                }
+            }
 
             if (!uploadFile) {
-                Serial.println("Failed to open file for writing: " + uploadPath);
+                Serial.println("Failed to open file for writing: " + stagingPath);
             }
             else
             {
               startTime = millis();
               totalBytes = 0;
+              writeFailed = false;
+              uploadCrc.reset();
+              uploadRequest = request;
+
+              // 已知大小时一次性预分配簇链，避免逐次写入时零散扩展
+              // Content-Length 包含少量 multipart 开销，结束时截断到实际大小
+              reservedBytes = 0;
+              size_t expected = request->contentLength();
+              if (encryptUpload) {
+                  expected += CRYPT_HEADER_SIZE;
+              }
+              if (!compressor && expected >= UPLOAD_PREALLOCATE_MIN && preallocateFile(uploadFile, expected)) {
+                  reservedBytes = expected;
+                  Serial.printf("Preallocated %u bytes for upload\n", reservedBytes);
+              }
+
+              // 未压缩的上传由异步 I/O 任务写卡，接收回调只把数据复制到缓冲块
+              delete uploadWriter;
+              uploadWriter = nullptr;
+              if (!compressor) {
+                  uploadWriter = new AsyncWriteStream();
+                  if (!uploadWriter->begin(uploadFile, SD_IO_BULK)) {
+                      delete uploadWriter;
+                      uploadWriter = nullptr;
+                  }
+              }
+
+              // 连接中断时关闭并删除临时文件
+              request->onDisconnect([request]() {
+                  if (uploadDoneRequest == request) {
+                      // 结果已确定但来不及发送
+                      uploadDoneRequest = nullptr;
+                      uploadDone.reset();
+                  }
+                  if (uploadRequest != request || !uploadFile) {
+                      return;
+                  }
+                  if (compressor) {
+                      compressor->finish();
+                      delete compressor;
+                      compressor = nullptr;
+                  }
+                  // 排队中的写入完成后再关闭并删除临时文件 (可能在异步 I/O 任务中)
+                  File file = uploadFile;
+                  String staging = stagingPath;
+                  uploadFile = File();
+                  std::function<void()> discard = [file, staging]() mutable {
+                      {
+                          SdIoScope io(SD_IO_BULK);
+                          file.close();
+                          SD_MMC.remove(staging);
+                      }
+                      fsCacheInvalidate(staging);
+                  };
+                  if (uploadWriter) {
+                      uploadWriter->abandon(discard);
+                      delete uploadWriter;
+                      uploadWriter = nullptr;
+                  } else {
+                      discard();
+                  }
+                  fsEventProgress(uploadPath, totalBytes, totalBytes, true);
+                  uploadRequest = nullptr;
+                  Serial.printf("Upload aborted: %s after %u bytes\n", uploadPath.c_str(), totalBytes);
+              });
             }
         }
 
-        if (uploadFile) {
-          if (usePSRAM && psramBuffer != nullptr)
+        if (uploadFile && !writeFailed) {
+          // 边写边计算 CRC32，无需再读一遍
+          uploadCrc.update(data, len);
+          if (encryptUpload)
+          {
+            // CTR 按偏移独立加密，直接在接收缓冲区中原地进行
+            uploadCipher.apply(totalBytes, data, data, len);
+          }
+          if (compressor)
+          {
+            // 只复制到流水线的 PSRAM 槽位，压缩和写卡在另一个核心上进行
+            writeFailed = !compressor->write(data, len);
+          }
+          else if (uploadWriter)
           {
+            // 从不等待：卡较慢时多用几个缓冲块，用尽时上传以 503 结束
+            writeFailed = !uploadWriter->write(data, len);
+          }
+          else if (usePSRAM && psramBuffer != nullptr)
+          {
+            SdIoScope io(SD_IO_BULK);
             // 使用PSRAM缓冲区写入
             // 如果数据大于缓冲区，分批写入
             size_t bytesWritten = 0;
-            while (bytesWritten < len)
+            while (bytesWritten < len && !writeFailed)
             {
               size_t bytesToWrite = min(len - bytesWritten, bufferSize);
               memcpy(psramBuffer, data + bytesWritten, bytesToWrite);
-              uploadFile.write(psramBuffer, bytesToWrite);
+              writeFailed = uploadFile.write(psramBuffer, bytesToWrite) != bytesToWrite;
               bytesWritten += bytesToWrite;
             }
           }
           else
           {
             // 直接写入
-            uploadFile.write(data, len);
+            SdIoScope io(SD_IO_BULK);
+            writeFailed = uploadFile.write(data, len) != len;
+          }
+          if (writeFailed) {
+              Serial.printf("Short write on %s at offset %u\n", stagingPath.c_str(), index);
           }
           totalBytes += len;
+          fsEventProgress(uploadPath, totalBytes, request->contentLength(), false);
         }
 
         if (final) {
             if (uploadFile) {
-              uint32_t endTime = millis();
-              uploadFile.close();
-              float speed = totalBytes / (float)(endTime - startTime); // KB/s
-              Serial.printf("Upload Complete: %s - %u bytes in %u ms (%.2f KB/s)\n",
-                            uploadPath.c_str(), totalBytes, endTime - startTime, speed);
-              String speedInfo = String(" - ") + String(totalBytes) + " bytes at " +
-                                 String(speed, 2) + " KB/s";
-              request->send(200, "text/plain", "File uploaded successfully to " + uploadPath + speedInfo);
+              size_t storedBytes = totalBytes + (encryptUpload ? CRYPT_HEADER_SIZE : 0);
+              if (compressor) {
+                  writeFailed = !compressor->finish() || writeFailed;
+                  storedBytes = compressor->getStoredBytes();
+                  Serial.printf("Compressed %u -> %u bytes (%u ms on core %d)\n", totalBytes, storedBytes,
+                                compressor->getCompressMs(), xPortGetCoreID() == 0 ? 1 : 0);
+                  delete compressor;
+                  compressor = nullptr;
+              }
+              uploadRequest = nullptr;
+              fsEventProgress(uploadPath, totalBytes, totalBytes, true);
+
+              std::shared_ptr<UploadCommit> commit = std::make_shared<UploadCommit>();
+              commit->uploadPath = uploadPath;
+              commit->storedPath = storedPath;
+              commit->stagingPath = stagingPath;
+              commit->encrypted = encryptUpload;
+              commit->verifyOnMedia = verifyOnMedia;
+              commit->totalBytes = totalBytes;
+              commit->storedBytes = storedBytes;
+              uploadCrc.finish(commit->digest);
+              commit->crc = ((uint32_t)commit->digest[0] << 24) | ((uint32_t)commit->digest[1] << 16) |
+                            (commit->digest[2] << 8) | commit->digest[3];
+              commit->file = uploadFile;
+              uploadFile = File();
+              commit->reservedBytes = reservedBytes;
+              commit->startTime = startTime;
+              commit->writeFailed = writeFailed;
+              commit->expectCrc = expectCrc;
+              commit->expectedCrc = expectedCrc;
+              uploadDoneRequest = request;
+              uploadDone = commit;
+
+              // 仍在排队的写入完成后才关闭临时文件：由请求回调轮询 (uploadSettled)，这里不等待
+              if (uploadWriter) {
+                  uploadWriter->finish();
+                  commit->writer.reset(uploadWriter);
+                  uploadWriter = nullptr;
+                  return;
+              }
+              closeUpload(commit);
             } else {
-                request->send(500, "text/plain", "Could not create file on SD card");
+                uploadDoneRequest = request;
+                uploadDone = std::make_shared<UploadCommit>();
+                uploadDone->status = 500;
+                uploadDone->message = "Could not create file on SD card";
                 Serial.println("Upload Failed");
             }
         }
@@ -1039,18 +2530,28 @@ void setup() {
             isDirectory = request->getParam("isDirectory", true)->value() == "true";
         }
 
-        bool success = false;
-        if (isDirectory) {
-            success = removeDir(SD_MMC, path.c_str());
-        } else {
-            success = SD_MMC.remove(path.c_str());
-        }
+        FsMeta meta;
+        bool known = g_metaCache.stat(path, meta);
 
-        if (success) {
-            request->send(200, "text/plain", "Deleted successfully");
-        } else {
-            request->send(500, "text/plain", "Failed to delete");
-        }
+        // 删除由异步 I/O 任务执行 (释放大文件的簇链可能较慢)，完成后再回应
+        std::shared_ptr<AsyncIoPending> removal = std::make_shared<AsyncIoPending>([path, isDirectory]() {
+            return g_asyncIo.remove(path.c_str(), isDirectory, nullptr, SD_IO_INTERACTIVE);
+        });
+        request->send(new DeferredResponse(
+            [removal]() { return removal->ready(); },
+            [removal, path, isDirectory, known, meta](AsyncWebServerRequest *request) -> AsyncWebServerResponse * {
+                if (!removal->result().ok()) {
+                    return request->beginResponse(500, "text/plain", "Failed to delete");
+                }
+                dirPager.reset();
+                fsEventRemoved(path, isDirectory);
+                if (isDirectory) {
+                    duDirRemoved(path);
+                } else if (known) {
+                    duFileRemoved(path, meta.size);
+                }
+                return request->beginResponse(200, "text/plain", "Deleted successfully");
+            }));
     });
 
     // 创建目录
@@ -1066,133 +2567,1040 @@ void setup() {
         if (path != "/" && !path.endsWith("/")) path += "/";
         String fullPath = path + dirname;
 
-        if (createDir(SD_MMC, fullPath.c_str())) {
-            request->send(200, "text/plain", "Directory created");
-        } else {
-            request->send(500, "text/plain", "Failed to create directory");
+        std::shared_ptr<AsyncIoPending> creation = std::make_shared<AsyncIoPending>([fullPath]() {
+            return g_asyncIo.mkdir(fullPath.c_str(), nullptr, SD_IO_INTERACTIVE);
+        });
+        request->send(new DeferredResponse(
+            [creation]() { return creation->ready(); },
+            [creation, fullPath](AsyncWebServerRequest *request) -> AsyncWebServerResponse * {
+                if (!creation->result().ok()) {
+                    return request->beginResponse(500, "text/plain", "Failed to create directory");
+                }
+                fsEventAdded(fullPath, 0, true);
+                duDirAdded(fullPath);
+                return request->beginResponse(200, "text/plain", "Directory created");
+            }));
+    });
+
+    // 重命名文件或目录
+    server.on("/rename", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path", true) || !request->hasParam("to", true)) {
+            request->send(400, "text/plain", "Missing path or new name");
+            return;
+        }
+
+        String path = request->getParam("path", true)->value();
+        String to = request->getParam("to", true)->value();
+
+        FsMeta meta;
+        if (!g_metaCache.stat(path, meta)) {
+            request->send(404, "text/plain", "File not found");
+            return;
         }
+        bool isDirectory = meta.isDirectory;
+
+        if (g_metaCache.exists(to)) {
+            request->send(409, "text/plain", "Target already exists");
+            return;
+        }
+
+        std::shared_ptr<AsyncIoPending> move = std::make_shared<AsyncIoPending>([path, to]() {
+            return g_asyncIo.rename(path.c_str(), to.c_str(), nullptr, SD_IO_INTERACTIVE);
+        });
+        request->send(new DeferredResponse(
+            [move]() { return move->ready(); },
+            [move, path, to, isDirectory, meta](AsyncWebServerRequest *request) -> AsyncWebServerResponse * {
+                if (!move->result().ok()) {
+                    return request->beginResponse(500, "text/plain", "Failed to rename");
+                }
+                dirPager.reset();
+                fsEventRenamed(path, to, isDirectory);
+                duMoved(path, to, isDirectory, meta.size);
+                if (!isDirectory) {
+                    removeTwinAsync(to);
+                }
+                return request->beginResponse(200, "text/plain", "Renamed successfully");
+            }));
     });
 
-    // 添加性能测试端点
-    server.on("/test-performance", HTTP_GET, [](AsyncWebServerRequest *request)
-              {
-        // 创建测试文件路径
-        const char* testFilePath = "/speedtest.bin";
-        const char* testMessage = "This is a test file for measuring SD card performance with and without PSRAM.";
+    // 复制文件 (后台任务，先写入临时文件并预先分配空间，完成后改名)，GET 查询进度
+    server.on("/copy", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(512);
+        copyStatusJson(doc.to<JsonObject>());
 
-        // 先写入测试文件
-        writeFile(SD_MMC, testFilePath, testMessage);
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
 
-        // 重置看门狗计时器
-        esp_task_wdt_reset();
+    server.on("/copy", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (request->hasParam("cancel", true)) {
+            cancelCopyJob();
+            request->send(200, "text/plain", "Cancel requested");
+            return;
+        }
+        if (!request->hasParam("path", true) || !request->hasParam("to", true)) {
+            request->send(400, "text/plain", "Missing path or target");
+            return;
+        }
 
-        // 尝试调整缓冲区大小以获得最佳性能
-        if (psramFound())
-        {
-          // 尝试使用较大的缓冲区进行测试，但不要太大以避免超时
-          size_t testBufferSize = PSRAM_BUFFER_SIZE_LARGE; // 使用中等大小的缓冲区
-          if (g_psramBuffer.getSize() < testBufferSize)
-          {
-            Serial.printf("Resizing buffer for performance test from %u to %u bytes\n",
-                          g_psramBuffer.getSize(), testBufferSize);
-            g_psramBuffer.resize(testBufferSize);
-            Serial.printf("New buffer size: %u bytes (%.2f KB)\n",
-                          g_psramBuffer.getSize(), g_psramBuffer.getSize() / 1024.0);
-          }
+        String path = request->getParam("path", true)->value();
+        String to = request->getParam("to", true)->value();
+
+        FsMeta meta;
+        if (!g_metaCache.stat(path, meta) || meta.isDirectory) {
+            request->send(404, "text/plain", "File not found");
+            return;
+        }
+        if (g_metaCache.exists(to)) {
+            request->send(409, "text/plain", "Target already exists");
+            return;
         }
 
-        // 重置看门狗计时器
-        esp_task_wdt_reset();
+        // 加密目录之间复制时解密/加密，密码运算在另一个核心上与读写重叠
+        if (startCopyJob(SD_MMC, path, to)) {
+            request->send(202, "text/plain", "Started");
+        } else {
+            request->send(409, "text/plain", "A copy is already running");
+        }
+    });
 
-        // 执行标准测试
-        Serial.println("\n=== Standard File I/O Test ===");
-        uint32_t startStd = millis();
-        testFileIO(SD_MMC, testFilePath);
-        uint32_t endStd = millis();
+    // 性能测试 (后台任务)：GET 显示进度或最近一次的结果，run=1 重新运行，POST cancel 取消
+    // (/test-performance/status 须先注册，否则会被 /test-performance 的前缀匹配接管)
+    server.on("/test-performance/status", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(512);
+        perfTestJob.statusJson(doc.to<JsonObject>());
 
-        // 重置看门狗计时器
-        esp_task_wdt_reset();
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
 
-        // 执行PSRAM增强测试
-        Serial.println("\n=== PSRAM Enhanced File I/O Test ===");
-        uint32_t startPSRAM = millis();
-        testFileIO_PSRAM(SD_MMC, testFilePath);
-        uint32_t endPSRAM = millis();
+    server.on("/test-performance", HTTP_GET, [](AsyncWebServerRequest *request){
+        bool rerun = request->hasParam("run") && request->getParam("run")->value() == "1";
+        if (!perfTestJob.running() && (rerun || perfTestReport.length() == 0)) {
+            perfTestReport = "";
+            if (!perfTestJob.start(runPerformanceTest, PERF_TEST_STACK)) {
+                request->send(503, "text/plain", "Cannot start the performance test");
+                return;
+            }
+        }
 
-        // 重置看门狗计时器
-        esp_task_wdt_reset();
+        if (!perfTestJob.running() && perfTestReport.length() > 0) {
+            request->send(200, "text/html", perfTestReport);
+            return;
+        }
 
-        // 构建响应
+        // 运行中 (或已失败/取消)：显示进度，每两秒刷新一次
+        DynamicJsonDocument doc(512);
+        JsonObject status = doc.to<JsonObject>();
+        perfTestJob.statusJson(status);
         String response = "<html><head><title>SD Card Performance Test</title>";
         response += "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">";
-        response += "<style>body{font-family:Arial,sans-serif;margin:20px;line-height:1.6;max-width:800px;margin:0 auto;padding:20px}";
-        response += "h1{color:#4a89dc}table{border-collapse:collapse;width:100%;margin:20px 0}";
-        response += "th,td{border:1px solid #ddd;padding:8px;text-align:left}";
-        response += "th{background-color:#f2f2f2}tr:nth-child(even){background-color:#f9f9f9}";
-        response += "tr:hover{background-color:#f1f1f1}.improvement{font-weight:bold;color:#5cb85c}</style></head>";
-        response += "<body><h1>SD Card Performance Test Results</h1>";
-        response += "<p>This test compares standard SD card operations with PSRAM-enhanced operations.</p>";
-
-        // 添加PSRAM信息
-        response += "<h2>PSRAM Status</h2>";
-        if (psramFound()) {
-            size_t psramSize = ESP.getPsramSize();
-            size_t freePsram = ESP.getFreePsram();
-            size_t usedPsram = psramSize - freePsram;
-            float usagePercent = usedPsram * 100.0 / psramSize;
-
-            response += "<p>PSRAM is available: " + String(psramSize / 1024) + " KB total, " +
-                        String(freePsram / 1024) + " KB free (" +
-                        String(usagePercent, 1) + "% used)</p>";
-
-            // 添加更多详细信息
-            response += "<p>Used PSRAM: " + String(usedPsram / 1024) + " KB</p>";
-            response += "<p>Largest free block: " +
-                        String(heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 1024) + " KB</p>";
-
-            // 缓冲区信息
-            response += "<h3>Buffer Information</h3>";
-            response += "<p>Current buffer size: " + String(g_psramBuffer.getSize() / 1024) + " KB</p>";
-            response += "<p>Buffer is in " + String(g_psramBuffer.isPSRAM() ? "PSRAM" : "regular memory") + "</p>";
-
-            // 添加推荐缓冲区大小
-            response += "<h3>Recommended Buffer Sizes</h3>";
-            size_t maxAllowedSize = freePsram * PSRAM_USAGE_PERCENT;
-            response += "<p>Maximum recommended: " + String(maxAllowedSize / 1024) + " KB</p>";
-
-            // 计算不同场景的最佳缓冲区大小
-            size_t optimalDefault = min(maxAllowedSize, (size_t)PSRAM_BUFFER_SIZE_DEFAULT);
-            size_t optimalLarge = min(maxAllowedSize, (size_t)PSRAM_BUFFER_SIZE_LARGE);
-            size_t optimalMax = min(maxAllowedSize, (size_t)PSRAM_BUFFER_SIZE_MAX);
-
-            response += "<p>Default: " + String(optimalDefault / 1024) + " KB | " + "Large: " + String(optimalLarge / 1024) + " KB | " + "Maximum: " + String(optimalMax / 1024) + " KB</p>";
+        if (perfTestJob.running()) {
+            response += "<meta http-equiv=\"refresh\" content=\"2\">";
+        }
+        response += "<style>body{font-family:Arial,sans-serif;line-height:1.6;max-width:800px;margin:0 auto;padding:20px}";
+        response += "h1{color:#4a89dc}</style></head><body><h1>SD Card Performance Test</h1>";
+        response += "<p>" + String((const char *)status["state"]) + ": step " + String((uint32_t)status["done"] + 1) +
+                    " of " + String((uint32_t)status["total"]) + " (" + String((const char *)status["message"]) + "), " +
+                    String((uint32_t)status["elapsedMs"] / 1000) + " s</p>";
+        if (!perfTestJob.running()) {
+            response += "<p><a href=\"/test-performance?run=1\">Run again</a></p>";
+        }
+        response += "<p><a href=\"/\">&laquo; Back to File Browser</a></p></body></html>";
+        request->send(200, "text/html", response);
+    });
+
+    server.on("/test-performance", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("cancel", true)) {
+            request->send(400, "text/plain", "Unknown action");
+            return;
+        }
+        perfTestJob.cancel();
+        request->send(200, "text/plain", "Cancel requested");
+    });
+
+    // 运行统计 (缓存命中率等)
+    server.on("/stats", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(5120);
+        g_metaCache.statsJson(doc["metaCache"].to<JsonObject>());
+        g_handleCache.statsJson(doc["handleCache"].to<JsonObject>());
+        blockCacheStatsJson(doc["blockCache"].to<JsonObject>());
+        g_checksumIndex.statsJson(doc["checksumIndex"].to<JsonObject>());
+        thumbStatsJson(doc["thumbnails"].to<JsonObject>());
+        webdavStatsJson(doc["webdav"].to<JsonObject>());
+        sdIoStatsJson(doc["io"].to<JsonObject>());
+        asyncIoStatsJson(doc["asyncIo"].to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    // 文件校验和 (crc32 / sha256)；索引命中时立即返回，否则由后台任务计算
+    server.on("/hash", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+
+        String path = request->getParam("path")->value();
+        HashAlgo algo = HASH_CRC32;
+        if (request->hasParam("algo") && !parseHashAlgo(request->getParam("algo")->value(), algo)) {
+            request->send(400, "text/plain", "Unsupported algorithm");
+            return;
+        }
+
+        FsMeta meta;
+        if (!g_metaCache.stat(path, meta) || meta.isDirectory) {
+            request->send(404, "text/plain", "File not found");
+            return;
+        }
+
+        uint8_t digest[HASH_MAX_DIGEST];
+        if (g_checksumIndex.lookup(path, meta, algo, digest)) {
+            DynamicJsonDocument doc(512);
+            checksumResultJson(doc.to<JsonObject>(), path, meta, algo, digest, true);
+            String response;
+            serializeJson(doc, response);
+            request->send(200, "application/json", response);
+            return;
+        }
+
+        std::shared_ptr<HashTask> task = std::make_shared<HashTask>();
+        task->path = path;
+        task->algo = algo;
+        task->cancelled = false;
+        task->done = false;
+        if (!checksumQueue(task)) {
+            request->send(503, "text/plain", "Checksum worker busy");
+            return;
+        }
+
+        // 计算完成前返回 RESPONSE_TRY_AGAIN，网络任务不会被阻塞
+        AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+            [task](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                if (!task->done) {
+                    return RESPONSE_TRY_AGAIN;
+                }
+                if (index >= task->body.length()) {
+                    return 0;
+                }
+                size_t len = min(maxLen, task->body.length() - index);
+                memcpy(buffer, task->body.c_str() + index, len);
+                return len;
+            });
+        request->onDisconnect([task]() {
+            task->cancelled = true;
+        });
+        request->send(response);
+    });
+
+    // JPEG 缩略图 (DCT 域缩小后编码)；缓存命中时直接发送缓存文件，否则由后台任务生成
+    server.on("/thumb/clear", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!thumbClear()) {
+            request->send(503, "text/plain", "Thumbnail worker busy");
+            return;
+        }
+        request->send(202, "text/plain", "Clearing thumbnail cache");
+    });
+
+    server.on("/thumb", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+
+        String path = request->getParam("path")->value();
+        int size = THUMB_DEFAULT_SIZE;
+        if (request->hasParam("size")) {
+            size = request->getParam("size")->value().toInt();
+            if (size < THUMB_MIN_SIZE || size > THUMB_MAX_SIZE) {
+                request->send(400, "text/plain", "Size must be between " + String(THUMB_MIN_SIZE) + " and " +
+                              String(THUMB_MAX_SIZE));
+                return;
+            }
+        }
+        if (!thumbIsImage(path)) {
+            request->send(415, "text/plain", "Only JPEG images have thumbnails");
+            return;
+        }
+
+        FsMeta meta;
+        bool found = g_metaCache.stat(path, meta) && !meta.isDirectory;
+        if (!found && !lzbIsCompressed(path)) {
+            found = g_metaCache.stat(path + LZB_SUFFIX, meta) && !meta.isDirectory;
+        }
+        if (!found) {
+            request->send(404, "text/plain", "File not found");
+            return;
+        }
+
+        // 缩略图只随原图的修改时间变化
+        String etag = "\"" + String((unsigned long)meta.mtime, HEX) + "-" + String(size) + "\"";
+        if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == etag) {
+            request->send(304);
+            return;
+        }
+
+        String cachePath;
+        if (thumbLookup(path, size, meta, cachePath)) {
+            AsyncWebServerResponse *response = request->beginResponse(SD_MMC, cachePath, "image/jpeg");
+            response->addHeader("ETag", etag);
+            response->addHeader("Cache-Control", "private, max-age=86400");
+            request->send(response);
+            return;
+        }
+
+        std::shared_ptr<ThumbTask> task = std::make_shared<ThumbTask>();
+        task->path = path;
+        task->size = size;
+        task->cancelled = false;
+        task->done = false;
+        if (!thumbQueue(task)) {
+            request->send(503, "text/plain", "Thumbnail worker busy");
+            return;
+        }
+
+        // 生成完成前返回 RESPONSE_TRY_AGAIN；失败时响应体为空 (图片显示为损坏)
+        AsyncWebServerResponse *response = request->beginChunkedResponse("image/jpeg",
+            [task](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                if (!task->done) {
+                    return RESPONSE_TRY_AGAIN;
+                }
+                if (index >= task->jpeg.size()) {
+                    return 0;
+                }
+                size_t len = min(maxLen, task->jpeg.size() - index);
+                memcpy(buffer, task->jpeg.data() + index, len);
+                return len;
+            });
+        request->onDisconnect([task]() {
+            task->cancelled = true;
+        });
+        // 状态码已随响应头发出，生成结果不确定时不让浏览器缓存
+        response->addHeader("Cache-Control", "no-cache");
+        request->send(response);
+    });
+
+    // 媒体元数据索引 (拍摄时间、尺寸、时长)；后台只读取文件头建立索引
+    server.on("/media/status", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(1024);
+        mediaIndexStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/media", HTTP_POST, [](AsyncWebServerRequest *request){
+        String action = request->hasParam("action", true) ? request->getParam("action", true)->value() : "rescan";
+        if (action == "cancel") {
+            cancelMediaIndex();
+            request->send(200, "text/plain", "Cancel requested");
+            return;
+        }
+        if (action != "rescan") {
+            request->send(400, "text/plain", "Unknown action");
+            return;
+        }
+        if (startMediaIndex()) {
+            request->send(202, "text/plain", "Started");
         } else {
-            response += "<p>PSRAM is not available on this device.</p>";
+            request->send(409, "text/plain", "The media index is already being built");
+        }
+    });
+
+    // 查询索引：sort=date|-date|name|size|duration|pixels...，filter=type=mp4,duration>600
+    server.on("/media", HTTP_GET, [](AsyncWebServerRequest *request){
+        String sort = request->hasParam("sort") ? request->getParam("sort")->value() : "";
+        String filter = request->hasParam("filter") ? request->getParam("filter")->value() : "";
+        MediaQuery query;
+        String error;
+        if (!mediaParseQuery(sort, filter, query, error)) {
+            request->send(400, "text/plain", error);
+            return;
+        }
+        query.dir = request->hasParam("dir") ? request->getParam("dir")->value() : "/";
+        if (query.dir.length() > 1 && query.dir.endsWith("/")) {
+            query.dir.remove(query.dir.length() - 1);
+        }
+        query.offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+        query.limit = MEDIA_QUERY_DEFAULT_LIMIT;
+        if (request->hasParam("limit")) {
+            query.limit = constrain(request->getParam("limit")->value().toInt(), 1, MEDIA_QUERY_MAX_LIMIT);
         }
 
-        // 添加测试结果表格
-        response += "<h2>Performance Comparison</h2>";
-        response += "<table><tr><th>Test Type</th><th>Standard I/O</th><th>PSRAM Enhanced</th><th>Improvement</th></tr>";
+        String response = "{\"files\":[";
+        uint32_t count = 0;
+        uint32_t total = mediaQuery(query, [&response, &count](const MediaEntry &entry) {
+            if (count++ > 0) {
+                response += ',';
+            }
+            DynamicJsonDocument item(entry.path.length() + 256);
+            mediaEntryJson(item.to<JsonObject>(), entry);
+            serializeJson(item, response);
+        });
+        response += "],\"count\":" + String(count) + ",\"total\":" + String(total) +
+                    ",\"offset\":" + String(query.offset) +
+                    ",\"indexing\":" + (mediaIndexRunning() ? "true" : "false") + "}";
+        request->send(200, "application/json", response);
+    });
 
-        // 计算性能提升
-        float improvement = ((endStd - startStd) > 0) ?
-                           (float)(endStd - startStd - (endPSRAM - startPSRAM)) / (endStd - startStd) * 100.0 : 0;
+    // 校验和巡检 (后台重新计算并与索引比对，发现静默损坏)
+    server.on("/scrub", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(4096);
+        checksumScrubStatusJson(doc.to<JsonObject>());
 
-        response += "<tr><td>Total Test Time</td>";
-        response += "<td>" + String(endStd - startStd) + " ms</td>";
-        response += "<td>" + String(endPSRAM - startPSRAM) + " ms</td>";
-        response += "<td class=\"improvement\">" + String(improvement, 1) + "% faster</td></tr>";
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
 
-        response += "</table>";
-        response += "<p><a href=\"/\">&laquo; Back to File Browser</a></p>";
-        response += "</body></html>";
+    server.on("/scrub", HTTP_POST, [](AsyncWebServerRequest *request){
+        String action = request->hasParam("action", true) ? request->getParam("action", true)->value() : "start";
+        if (action == "cancel") {
+            cancelChecksumScrub();
+            request->send(200, "text/plain", "Cancel requested");
+            return;
+        }
 
-        request->send(200, "text/html", response); });
+        HashAlgo algo = HASH_CRC32;
+        if (request->hasParam("algo", true) && !parseHashAlgo(request->getParam("algo", true)->value(), algo)) {
+            request->send(400, "text/plain", "Unsupported algorithm");
+            return;
+        }
+        if (startChecksumScrub(algo)) {
+            request->send(202, "text/plain", "Started");
+        } else {
+            request->send(409, "text/plain", "A scrub is already running");
+        }
+    });
 
-    // 开始Web服务器
-    Serial.println("Starting web server...");
-    server.begin();
-    Serial.println("HTTP server started successfully");
+    // 增量同步：客户端先获取设备端文件的分块签名，再只上传变化部分组成的补丁
+    server.on("/sync/signature", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+
+        String path = request->getParam("path")->value();
+        uint32_t blockSize = DELTA_DEFAULT_BLOCK;
+        if (request->hasParam("block")) {
+            blockSize = request->getParam("block")->value().toInt();
+        }
+        if (!g_metaCache.exists(path)) {
+            request->send(404, "text/plain", "File not found");
+            return;
+        }
+        // 签名基于卡上的字节，加密文件的密文签名没有意义
+        if (deltaIsEncrypted(SD_MMC, path)) {
+            request->send(403, "text/plain", "Delta sync is not available for encrypted files");
+            return;
+        }
+
+        std::shared_ptr<DeltaSignature> sig = deltaStartSignature(SD_MMC, path, blockSize);
+        if (!sig) {
+            request->send(503, "text/plain", "Signature busy or out of memory");
+            return;
+        }
+
+        // 签名由后台任务边读边生成，尚未生成的部分稍后再发送
+        AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", sig->length,
+            [sig](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                if (sig->failed) {
+                    return 0;
+                }
+                size_t len = deltaSignatureRead(*sig, buffer, maxLen, index);
+                return len ? len : RESPONSE_TRY_AGAIN;
+            });
+        request->onDisconnect([sig]() {
+            sig->cancelled = true;
+        });
+        request->send(response);
+    });
+
+    server.on("/sync/patch", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+        if (syncPatchRequest != request) {
+            // 没有开始接收补丁：按 deltaBeginPatch 的结果分别回应
+            DeltaBeginResult result = syncRefusedRequest == request ? syncRefusedResult : DELTA_BEGIN_OK;
+            syncRefusedRequest = nullptr;
+            if (result == DELTA_BEGIN_BUSY) {
+                request->send(409, "text/plain", "A sync is already in progress");
+            } else if (result == DELTA_BEGIN_IS_DIRECTORY) {
+                request->send(400, "text/plain", "Target is a directory");
+            } else if (result == DELTA_BEGIN_CREATE_FAILED) {
+                request->send(500, "text/plain", "Cannot create patch file");
+            } else if (result == DELTA_BEGIN_ENCRYPTED) {
+                request->send(403, "text/plain", "Delta sync is not available for encrypted files");
+            } else {
+                request->send(400, "text/plain", "Empty patch");
+            }
+            return;
+        }
+        syncPatchRequest = nullptr;
+        if (deltaApplyPatch()) {
+            request->send(202, "text/plain", "Patch received, applying");
+        } else {
+            request->send(500, "text/plain", "Failed to store patch");
+        }
+    }, nullptr, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+        if (!index) {
+            if (!request->hasParam("path")) {
+                return;
+            }
+            DeltaBeginResult result = deltaBeginPatch(SD_MMC, request->getParam("path")->value());
+            if (result != DELTA_BEGIN_OK) {
+                syncRefusedRequest = request;
+                syncRefusedResult = result;
+                return;
+            }
+            syncPatchRequest = request;
+            request->onDisconnect([request]() {
+                if (syncPatchRequest == request) {
+                    deltaAbortPatch();
+                    syncPatchRequest = nullptr;
+                }
+            });
+        }
+
+        if (syncPatchRequest == request) {
+            deltaWritePatch(data, len);
+        }
+    });
+
+    server.on("/sync/status", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(512);
+        deltaStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    // 碎片分析与整理 (后台任务)，GET 查询状态和报告
+    server.on("/defrag", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(12288);
+        defragStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/defrag", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("action", true)) {
+            request->send(400, "text/plain", "Missing action");
+            return;
+        }
+
+        String action = request->getParam("action", true)->value();
+        bool started;
+        if (action == "analyze") {
+            started = startFragmentationAnalysis();
+        } else if (action == "defrag") {
+            uint32_t limit = DEFRAG_DEFAULT_FILES;
+            if (request->hasParam("limit", true)) {
+                limit = request->getParam("limit", true)->value().toInt();
+            }
+            started = startDefragmentation(limit);
+        } else if (action == "cancel") {
+            cancelDefragJob();
+            request->send(200, "text/plain", "Cancel requested");
+            return;
+        } else {
+            request->send(400, "text/plain", "Unknown action");
+            return;
+        }
+
+        if (started) {
+            request->send(202, "text/plain", "Started");
+        } else {
+            request->send(409, "text/plain", "A defrag job is already running");
+        }
+    });
+
+    // 在文件内容中搜索，匹配行以 NDJSON 流式返回 (后台任务扫描，断开连接即取消)
+    // (/grep/status 须先注册，否则会被 /grep 的前缀匹配接管)
+    server.on("/grep/status", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(512);
+        grepStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/grep", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("pattern")) {
+            request->send(400, "text/plain", "Missing pattern");
+            return;
+        }
+
+        String dir = request->hasParam("dir") ? request->getParam("dir")->value() : "/";
+        FsMeta meta;
+        if (dir != "/" && (!g_metaCache.stat(dir, meta) || !meta.isDirectory)) {
+            request->send(404, "text/plain", "Directory not found");
+            return;
+        }
+
+        bool regex = request->hasParam("regex") && request->getParam("regex")->value() == "1";
+        bool icase = request->hasParam("icase") && request->getParam("icase")->value() == "1";
+        uint32_t maxMatches = GREP_DEFAULT_MATCHES;
+        if (request->hasParam("max")) {
+            maxMatches = request->getParam("max")->value().toInt();
+        }
+
+        std::shared_ptr<GrepPattern> pattern = std::make_shared<GrepPattern>();
+        String error;
+        if (!pattern->compile(request->getParam("pattern")->value(), regex, icase, error)) {
+            request->send(400, "text/plain", error);
+            return;
+        }
+
+        std::shared_ptr<GrepOutput> output = std::make_shared<GrepOutput>();
+        if (!startGrep(dir, pattern, maxMatches, output)) {
+            request->send(409, "text/plain", "A search is already running");
+            return;
+        }
+
+        AsyncWebServerResponse *response = request->beginChunkedResponse("application/x-ndjson",
+            [output](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                return output->drain(buffer, maxLen);
+            });
+        request->onDisconnect([output]() {
+            output->cancelled = true;
+        });
+        request->send(response);
+    });
+
+    server.on("/grep", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("action", true) || request->getParam("action", true)->value() != "cancel") {
+            request->send(400, "text/plain", "Unknown action");
+            return;
+        }
+        cancelGrep();
+        request->send(200, "text/plain", "Cancel requested");
+    });
+
+    // CSV 聚合查询：在设备端过滤/分组/聚合，只返回结果
+    // (/query/status 须先注册，否则会被 /query 的前缀匹配接管)
+    server.on("/query/status", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(512);
+        queryStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/query", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+
+        String path = request->getParam("path")->value();
+        FsMeta meta;
+        if (!g_metaCache.stat(path, meta) || meta.isDirectory) {
+            request->send(404, "text/plain", "File not found");
+            return;
+        }
+
+        String filter = request->hasParam("filter") ? request->getParam("filter")->value() : "";
+        String group = request->hasParam("group") ? request->getParam("group")->value() : "";
+        String aggs = request->hasParam("agg") ? request->getParam("agg")->value() : "count";
+        char delim = ',';
+        if (request->hasParam("delim")) {
+            String d = request->getParam("delim")->value();
+            delim = d == "tab" ? '\t' : d.length() ? d[0] : ',';
+        }
+        bool header = !request->hasParam("header") || request->getParam("header")->value() != "0";
+
+        std::shared_ptr<QueryTask> task = std::make_shared<QueryTask>();
+        task->path = path;
+        task->cancelled = false;
+        task->done = false;
+        if (!task->query.parse(filter.c_str(), group.c_str(), aggs.c_str(), delim, header)) {
+            request->send(400, "text/plain", task->query.lastError().c_str());
+            return;
+        }
+        if (!startQuery(task)) {
+            request->send(409, "text/plain", "A query is already running");
+            return;
+        }
+
+        // 扫描完成前返回 RESPONSE_TRY_AGAIN，网络任务不会被阻塞
+        AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+            [task](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                if (!task->done) {
+                    return RESPONSE_TRY_AGAIN;
+                }
+                if (index >= task->body.length()) {
+                    return 0;
+                }
+                size_t len = min(maxLen, task->body.length() - index);
+                memcpy(buffer, task->body.c_str() + index, len);
+                return len;
+            });
+        request->onDisconnect([task]() {
+            task->cancelled = true;
+        });
+        request->send(response);
+    });
+
+    // 键值存储：状态、范围扫描、单键读写
+    server.on("/kv/status", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(1024);
+        kvStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/kv/scan", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!kvStore().isOpen()) {
+            request->send(503, "text/plain", "KV store not available");
+            return;
+        }
+        String start = request->hasParam("start") ? request->getParam("start")->value() : "";
+        String end = request->hasParam("end") ? request->getParam("end")->value() : "";
+        int limit = KV_SCAN_DEFAULT_LIMIT;
+        if (request->hasParam("limit")) {
+            limit = constrain(request->getParam("limit")->value().toInt(), 1, KV_SCAN_MAX_LIMIT);
+        }
+
+        String response = "{\"items\":[";
+        bool first = true;
+        size_t count = kvStore().scan(start.c_str(), end.c_str(), limit,
+            [&response, &first](const std::string &key, const std::string &value) {
+                if (!first) {
+                    response += ',';
+                }
+                first = false;
+                DynamicJsonDocument item(key.size() + value.size() + 128);
+                item["key"] = key.c_str();
+                item["value"] = value.c_str();
+                serializeJson(item, response);
+                return true;
+            });
+        response += "],\"count\":" + String(count) + "}";
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/kv", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("key")) {
+            request->send(400, "text/plain", "Missing key");
+            return;
+        }
+        std::string value;
+        if (!kvStore().get(request->getParam("key")->value().c_str(), value)) {
+            request->send(404, "text/plain", "Key not found");
+            return;
+        }
+        AsyncResponseStream *response = request->beginResponseStream("application/octet-stream");
+        response->write((const uint8_t *)value.data(), value.size());
+        request->send(response);
+    });
+
+    // 写入 (key, value)；action=delete 删除 key，action=flush 把内存表写成段文件
+    server.on("/kv", HTTP_POST, [](AsyncWebServerRequest *request){
+        String action = request->hasParam("action", true) ? request->getParam("action", true)->value() : "put";
+        if (action == "flush") {
+            if (kvStore().flush()) {
+                request->send(200, "text/plain", "Flushed");
+            } else {
+                request->send(500, "text/plain", kvStore().lastError().c_str());
+            }
+            return;
+        }
+        if (!request->hasParam("key", true)) {
+            request->send(400, "text/plain", "Missing key");
+            return;
+        }
+        std::string key = request->getParam("key", true)->value().c_str();
+        bool ok;
+        if (action == "delete") {
+            ok = kvStore().remove(key);
+        } else if (request->hasParam("value", true)) {
+            String value = request->getParam("value", true)->value();
+            ok = kvStore().put(key, std::string(value.c_str(), value.length()));
+        } else {
+            request->send(400, "text/plain", "Missing value");
+            return;
+        }
+        if (ok) {
+            request->send(200, "text/plain", "OK");
+        } else {
+            request->send(500, "text/plain", kvStore().lastError().c_str());
+        }
+    });
+
+    // 目录加密：状态、添加/移除加密目录
+    server.on("/crypt/status", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(1024);
+        cryptStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/crypt", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("dir", true)) {
+            request->send(400, "text/plain", "Missing directory");
+            return;
+        }
+
+        String dir = request->getParam("dir", true)->value();
+        String action = request->hasParam("action", true) ? request->getParam("action", true)->value() : "add";
+        String error;
+        bool ok;
+        if (action == "add") {
+            ok = cryptAddDir(dir, error);
+        } else if (action == "remove") {
+            ok = cryptRemoveDir(dir, error);
+        } else {
+            request->send(400, "text/plain", "Unknown action");
+            return;
+        }
+        if (ok) {
+            request->send(200, "text/plain", "OK");
+        } else {
+            request->send(409, "text/plain", error);
+        }
+    });
+
+    // 压缩存储：按文件类型统计压缩/未压缩传输的吞吐与压缩比
+    server.on("/compress/stats", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(4096);
+        lzbStatsJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    // 时序数据：按时间范围查询，只读取与范围重叠的数据块，结果以 CSV 流式返回
+    server.on("/ts", HTTP_GET, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("path")) {
+            request->send(400, "text/plain", "Missing file path");
+            return;
+        }
+
+        String path = request->getParam("path")->value();
+        int64_t from = INT64_MIN;
+        int64_t to = INT64_MAX;
+        uint32_t limit = TS_DEFAULT_LIMIT;
+        if (request->hasParam("from")) {
+            from = strtoll(request->getParam("from")->value().c_str(), nullptr, 10);
+        }
+        if (request->hasParam("to")) {
+            to = strtoll(request->getParam("to")->value().c_str(), nullptr, 10);
+        }
+        if (request->hasParam("limit")) {
+            limit = request->getParam("limit")->value().toInt();
+        }
+
+        std::shared_ptr<TsCursor> cursor = std::make_shared<TsCursor>();
+        BlockCacheRouteScope route("/ts");
+        if (!cursor->open(SD_MMC, path, from, to)) {
+            request->send(404, "text/plain", "Not a time series file");
+            return;
+        }
+
+        std::shared_ptr<uint32_t> sent = std::make_shared<uint32_t>(0);
+        AsyncWebServerResponse *response = request->beginChunkedResponse("text/csv",
+            [cursor, sent, limit](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                BlockCacheRouteScope route("/ts");
+                size_t len = 0;
+                TsPoint p;
+                while (maxLen - len >= 48 && *sent < limit && cursor->next(p)) {
+                    len += snprintf((char *)buffer + len, maxLen - len, "%lld,%.10g\n", (long long)p.ts, p.value);
+                    (*sent)++;
+                }
+                if (len == 0) {
+                    Serial.printf("Time series query: %u points, %u blocks read\n", *sent, cursor->getBlocksRead());
+                    cursor->close();
+                }
+                return len;
+            });
+        response->addHeader("X-TS-Segments", String(cursor->getSegmentCount()));
+        request->send(response);
+    });
+
+    // 写入时序数据点 (path, ts, value)；action=flush 时把内存表写入卡中
+    server.on("/ts", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (request->hasParam("action", true) && request->getParam("action", true)->value() == "flush") {
+            tsFlushAll();
+            request->send(202, "text/plain", "Flush requested");
+            return;
+        }
+        if (!request->hasParam("path", true) || !request->hasParam("ts", true) || !request->hasParam("value", true)) {
+            request->send(400, "text/plain", "Missing path, ts or value");
+            return;
+        }
+
+        int64_t ts = strtoll(request->getParam("ts", true)->value().c_str(), nullptr, 10);
+        double value = strtod(request->getParam("value", true)->value().c_str(), nullptr);
+        // 从不在此等待写卡：内存表正在写入或写入器已满时返回 503，稍后重试
+        switch (tsAdd(SD_MMC, request->getParam("path", true)->value(), ts, value)) {
+        case TS_ADD_OK:
+            request->send(200, "text/plain", "OK");
+            break;
+        case TS_ADD_BUSY: {
+            AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Time series busy, retry");
+            response->addHeader("Retry-After", "1");
+            request->send(response);
+            break;
+        }
+        default:
+            request->send(500, "text/plain", "Cannot open time series");
+            break;
+        }
+    });
+
+    // 目录占用空间 (递归大小/文件数/目录数)，由内存中的用量树直接回答
+    server.on("/du", HTTP_GET, [](AsyncWebServerRequest *request){
+        String dir = "/";
+        if (request->hasParam("dir")) {
+            dir = request->getParam("dir")->value();
+        }
+
+        DynamicJsonDocument doc(1024);
+        int status = 200;
+        if (!duReady()) {
+            status = 503;
+            doc["state"] = "building";
+            duStatusJson(doc["progress"].to<JsonObject>());
+        } else if (!duQuery(dir, doc.to<JsonObject>())) {
+            request->send(404, "text/plain", "Directory not found");
+            return;
+        }
+
+        String response;
+        serializeJson(doc, response);
+        request->send(status, "application/json", response);
+    });
+
+    server.on("/du", HTTP_POST, [](AsyncWebServerRequest *request){
+        if (!request->hasParam("action", true) || request->getParam("action", true)->value() != "rebuild") {
+            request->send(400, "text/plain", "Unknown action");
+            return;
+        }
+
+        if (duRebuild()) {
+            request->send(202, "text/plain", "Started");
+        } else {
+            request->send(409, "text/plain", "The disk usage tree is already being built");
+        }
+    });
+
+    // 原始 TCP 批量传输服务 (端口 9000) 的状态与参数
+    server.on("/bulk", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(1024);
+        bulkStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    // 修改后对下一个连接生效：slotSize、slots、sndbuf、rcvbuf、nodelay
+    server.on("/bulk", HTTP_POST, [](AsyncWebServerRequest *request){
+        BulkConfig config = bulkGetConfig();
+        if (request->hasParam("slotSize", true)) {
+            config.slotSize = request->getParam("slotSize", true)->value().toInt();
+        }
+        if (request->hasParam("slots", true)) {
+            config.slots = constrain(request->getParam("slots", true)->value().toInt(), 0, 255);
+        }
+        if (request->hasParam("sndbuf", true)) {
+            config.sndBuf = request->getParam("sndbuf", true)->value().toInt();
+        }
+        if (request->hasParam("rcvbuf", true)) {
+            config.rcvBuf = request->getParam("rcvbuf", true)->value().toInt();
+        }
+        if (request->hasParam("nodelay", true)) {
+            config.noDelay = request->getParam("nodelay", true)->value() == "1";
+        }
+        String error;
+        if (!bulkSetConfig(config, error)) {
+            request->send(400, "text/plain", error);
+            return;
+        }
+        request->send(200, "text/plain", "Applies to the next connection");
+    });
+
+    // 下载限速与公平分配：全局/每客户端速率 (字节/秒，0 为不限)、每次发送的量子
+    server.on("/egress", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(4096);
+        egressStatusJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/egress", HTTP_POST, [](AsyncWebServerRequest *request){
+        EgressConfig config = egressGetConfig();
+        if (request->hasParam("globalRate", true)) {
+            config.globalRate = request->getParam("globalRate", true)->value().toInt();
+        }
+        if (request->hasParam("clientRate", true)) {
+            config.clientRate = request->getParam("clientRate", true)->value().toInt();
+        }
+        if (request->hasParam("quantum", true)) {
+            config.quantum = request->getParam("quantum", true)->value().toInt();
+        }
+        String error;
+        if (!egressSetConfig(config, error)) {
+            request->send(400, "text/plain", error);
+            return;
+        }
+        request->send(200, "text/plain", "Egress limits updated");
+    });
+
+    // SD卡访问调度：各优先级的队列深度、等待时间 (平均/p99/最大) 和占用时间
+    server.on("/io", HTTP_GET, [](AsyncWebServerRequest *request){
+        DynamicJsonDocument doc(2048);
+        sdIoStatsJson(doc.to<JsonObject>());
+
+        String response;
+        serializeJson(doc, response);
+        request->send(200, "application/json", response);
+    });
+
+    server.on("/io", HTTP_POST, [](AsyncWebServerRequest *request){
+        String action = request->hasParam("action", true) ? request->getParam("action", true)->value() : "";
+        if (action != "reset") {
+            request->send(400, "text/plain", "Unknown action");
+            return;
+        }
+        sdIoResetStats();
+        request->send(200, "text/plain", "Statistics reset");
+    });
+
+    // 文件变更事件推送 (SSE)
+    initFsEvents(server);
+
+    // WebDAV 共享 (/dav/)，可在资源管理器、Finder 或 davfs2 中挂载为网络驱动器
+    initWebDav(server, dirPager);
+
+    // 开始Web服务器
+    Serial.println("Starting web server...");
+    server.begin();
+    Serial.println("HTTP server started successfully");
+    // 原始 TCP 批量传输服务 (GET/PUT/LIST，端口 9000)，绕过 HTTP 解析
+    if (sdInitialized) {
+        bulkBegin(SD_MMC);
+    }
     Serial.println("System is now running!");
 }
 
@@ -1210,5 +3618,7 @@ void loop() {
         lastMsg = millis();
         Serial.print(".");  // Minimalist heartbeat indicator
     }
+    // 定期从 FatFs 重新读取卷的可用空间 (/du 平时用缓存值)
+    duRefreshVolume();
     delay(100); // Small delay to prevent watchdog issues
 }
\ No newline at end of file
@@ -0,0 +1,830 @@
+#include "media_index.h"
+#include "bg_job.h"
+#include "file_crypt.h"
+#include "meta_cache.h"
+#include "sd_io_sched.h"
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <algorithm>
+
+#define INDEX_MAGIC 0x3158444D // "MDX1"
+
+#define RECORD_ORIENTATION 0x0F
+#define RECORD_FAILED 0x40 // headers did not parse; kept so the file is not probed again
+#define RECORD_SEEN 0x80   // transient, set by the walk
+
+enum Field
+{
+  FIELD_TYPE,
+  FIELD_DATE,
+  FIELD_DURATION,
+  FIELD_WIDTH,
+  FIELD_HEIGHT,
+  FIELD_PIXELS,
+  FIELD_SIZE,
+  FIELD_ORIENTATION,
+  FIELD_NAME,
+  FIELD_MTIME
+};
+
+enum Op
+{
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE
+};
+
+static const char *fieldNames[] = {"type",   "date", "duration",    "width", "height",
+                                   "pixels", "size", "orientation", "name",  "mtime"};
+
+// 40 bytes per file; paths live in a separate pool
+struct Record
+{
+  uint64_t key;
+  uint32_t size;
+  uint32_t mtime;
+  uint32_t captureTime;
+  uint32_t width;
+  uint32_t height;
+  uint32_t durationMs;
+  uint32_t pathOffset;
+  uint16_t pathLen;
+  uint8_t type;
+  uint8_t flags;
+};
+
+struct IndexHeader
+{
+  uint32_t magic;
+  uint32_t count;
+  uint32_t poolBytes;
+};
+
+static fs::FS *mediaFs = nullptr;
+static SemaphoreHandle_t lock = nullptr;
+// Sorted by key, in PSRAM
+static Record *records = nullptr;
+static uint32_t count = 0;
+static uint32_t capacity = 0;
+static char *pool = nullptr;
+static uint32_t poolUsed = 0;
+static uint32_t poolCapacity = 0;
+static bool dirty = false;
+
+static BackgroundJob indexJob("media");
+
+static struct
+{
+  uint32_t scanned;
+  uint32_t probed;
+  uint32_t unchanged;
+  uint32_t failed;
+  uint32_t locked;
+  uint32_t pruned;
+  uint32_t reads;
+  uint64_t bytesRead;
+  uint32_t startMs;
+  uint32_t elapsedMs;
+} walk;
+
+static void *psramRealloc(void *p, size_t bytes)
+{
+  void *grown = heap_caps_realloc(p, bytes, MALLOC_CAP_SPIRAM);
+  return grown ? grown : realloc(p, bytes);
+}
+
+// Index of the first record whose key is >= `key`
+static int32_t find(uint64_t key)
+{
+  int32_t lo = 0, hi = count;
+  while (lo < hi)
+  {
+    int32_t mid = (lo + hi) / 2;
+    if (records[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static String recordPath(const Record &r)
+{
+  String path;
+  path.concat(pool + r.pathOffset, r.pathLen);
+  return path;
+}
+
+// Called with the lock held
+static Record *upsert(const String &path, const FsMeta &meta)
+{
+  uint64_t key = fsPathKey(path);
+  int32_t pos = find(key);
+  if (pos < (int32_t)count && records[pos].key == key)
+  {
+    return &records[pos];
+  }
+
+  if (count == capacity)
+  {
+    uint32_t grown = max(capacity * 2, (uint32_t)256);
+    Record *bigger = (Record *)psramRealloc(records, grown * sizeof(Record));
+    if (bigger == nullptr)
+    {
+      return nullptr;
+    }
+    records = bigger;
+    capacity = grown;
+  }
+  uint32_t len = min(path.length(), (unsigned)UINT16_MAX);
+  if (poolUsed + len > poolCapacity)
+  {
+    uint32_t grown = max(max(poolCapacity * 2, poolUsed + len), (uint32_t)16384);
+    char *bigger = (char *)psramRealloc(pool, grown);
+    if (bigger == nullptr)
+    {
+      return nullptr;
+    }
+    pool = bigger;
+    poolCapacity = grown;
+  }
+
+  memmove(&records[pos + 1], &records[pos], (count - pos) * sizeof(Record));
+  count++;
+  Record &r = records[pos];
+  memset(&r, 0, sizeof(r));
+  r.key = key;
+  r.pathOffset = poolUsed;
+  r.pathLen = len;
+  memcpy(pool + poolUsed, path.c_str(), len);
+  poolUsed += len;
+  return &r;
+}
+
+static bool load()
+{
+  File file = mediaFs->open(MEDIA_INDEX_PATH, FILE_READ);
+  if (!file)
+  {
+    return false;
+  }
+  IndexHeader header;
+  if (sdIoRead(file, (uint8_t *)&header, sizeof(header), SD_IO_BACKGROUND) != sizeof(header) || header.magic != INDEX_MAGIC ||
+      file.size() != sizeof(header) + (size_t)header.count * sizeof(Record) + header.poolBytes)
+  {
+    Serial.println("Media index is corrupt, starting empty");
+    file.close();
+    return false;
+  }
+
+  Record *loaded = (Record *)psramRealloc(nullptr, max(header.count, (uint32_t)256) * sizeof(Record));
+  char *paths = (char *)psramRealloc(nullptr, max(header.poolBytes, (uint32_t)16384));
+  size_t want = (size_t)header.count * sizeof(Record);
+  if (loaded == nullptr || paths == nullptr || sdIoRead(file, (uint8_t *)loaded, want, SD_IO_BACKGROUND) != want ||
+      sdIoRead(file, (uint8_t *)paths, header.poolBytes, SD_IO_BACKGROUND) != header.poolBytes)
+  {
+    free(loaded);
+    free(paths);
+    file.close();
+    return false;
+  }
+  file.close();
+
+  records = loaded;
+  count = header.count;
+  capacity = max(header.count, (uint32_t)256);
+  pool = paths;
+  poolUsed = header.poolBytes;
+  poolCapacity = max(header.poolBytes, (uint32_t)16384);
+  return true;
+}
+
+// Writes the index back, dropping the paths of removed records from the pool
+static void save()
+{
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (!dirty)
+  {
+    xSemaphoreGive(lock);
+    return;
+  }
+
+  uint32_t packedBytes = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    packedBytes += records[i].pathLen;
+  }
+  if (packedBytes < poolUsed)
+  {
+    char *packed = (char *)psramRealloc(nullptr, max(packedBytes, (uint32_t)16384));
+    if (packed != nullptr)
+    {
+      uint32_t used = 0;
+      for (uint32_t i = 0; i < count; i++)
+      {
+        memcpy(packed + used, pool + records[i].pathOffset, records[i].pathLen);
+        records[i].pathOffset = used;
+        used += records[i].pathLen;
+      }
+      free(pool);
+      pool = packed;
+      poolUsed = used;
+      poolCapacity = max(packedBytes, (uint32_t)16384);
+    }
+  }
+
+  // Written from a snapshot: the card is shared by SD_IO_BACKGROUND grants,
+  // and queries must not wait on the lock meanwhile
+  IndexHeader header = {INDEX_MAGIC, count, poolUsed};
+  size_t recordBytes = (size_t)count * sizeof(Record);
+  size_t want = sizeof(header) + recordBytes + poolUsed;
+  uint8_t *image = (uint8_t *)psramRealloc(nullptr, want);
+  if (image == nullptr)
+  {
+    xSemaphoreGive(lock);
+    Serial.println("Failed to write media index");
+    return;
+  }
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + sizeof(header), records, recordBytes);
+  memcpy(image + sizeof(header) + recordBytes, pool, poolUsed);
+  dirty = false;
+  xSemaphoreGive(lock);
+
+  String tmpPath = String(MEDIA_INDEX_PATH) + ".tmp";
+  File file = mediaFs->open(tmpPath, FILE_WRITE);
+  size_t written = file ? sdIoWrite(file, image, want, SD_IO_BACKGROUND) : 0;
+  file.close();
+  free(image);
+
+  if (written == want)
+  {
+    mediaFs->remove(MEDIA_INDEX_PATH);
+    mediaFs->rename(tmpPath, MEDIA_INDEX_PATH);
+  }
+  else
+  {
+    Serial.println("Short write on media index");
+    mediaFs->remove(tmpPath);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    dirty = true;
+    xSemaphoreGive(lock);
+  }
+  fsCacheInvalidate(MEDIA_INDEX_PATH);
+  fsCacheInvalidate(tmpPath);
+}
+
+// ---- Walk ------------------------------------------------------------------
+
+// True if the record still describes the file; marks it seen
+static bool unchanged(const String &path, const FsMeta &meta)
+{
+  uint64_t key = fsPathKey(path);
+  xSemaphoreTake(lock, portMAX_DELAY);
+  int32_t pos = find(key);
+  bool same = pos < (int32_t)count && records[pos].key == key && records[pos].size == meta.size &&
+              records[pos].mtime == (uint32_t)meta.mtime;
+  if (same)
+  {
+    records[pos].flags |= RECORD_SEEN;
+  }
+  xSemaphoreGive(lock);
+  return same;
+}
+
+static void probeFile(const String &path, const FsMeta &meta, MediaType type)
+{
+  File file = mediaFs->open(path);
+  if (!file)
+  {
+    walk.failed++;
+    return;
+  }
+  // Encrypted files are probed through the cipher, header skipped
+  FileCipher cipher;
+  CryptState crypt = cryptProbe(file, cipher);
+  if (crypt == CRYPT_LOCKED)
+  {
+    file.close();
+    walk.locked++;
+    return;
+  }
+  size_t skip = crypt == CRYPT_ENCRYPTED ? CRYPT_HEADER_SIZE : 0;
+  // Probe reads are small and scattered: one grant each, seek included
+  MediaReader reader = [&](uint64_t offset, uint8_t *buffer, size_t len) -> size_t {
+    {
+      SdIoScope io(SD_IO_BACKGROUND);
+      if (file.position() != offset + skip && !file.seek(offset + skip))
+      {
+        return 0;
+      }
+    }
+    size_t n = sdIoRead(file, buffer, len, SD_IO_BACKGROUND);
+    if (skip)
+    {
+      cipher.apply(offset, buffer, buffer, n);
+    }
+    return n;
+  };
+
+  MediaInfo info;
+  MediaProbeStats stats;
+  bool ok = mediaProbe(type, meta.size - skip, reader, info, &stats);
+  file.close();
+  walk.reads += stats.reads;
+  walk.bytesRead += stats.bytes;
+  walk.probed++;
+  if (!ok)
+  {
+    walk.failed++;
+  }
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  Record *r = upsert(path, meta);
+  if (r != nullptr)
+  {
+    r->size = meta.size;
+    r->mtime = meta.mtime;
+    r->type = type;
+    r->captureTime = info.captureTime > 0 && info.captureTime <= (int64_t)UINT32_MAX ? info.captureTime : 0;
+    r->width = info.width;
+    r->height = info.height;
+    r->durationMs = info.durationMs;
+    r->flags = (info.orientation & RECORD_ORIENTATION) | RECORD_SEEN | (ok ? 0 : RECORD_FAILED);
+    dirty = true;
+  }
+  xSemaphoreGive(lock);
+}
+
+static uint32_t pruneUnseen()
+{
+  xSemaphoreTake(lock, portMAX_DELAY);
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (records[i].flags & RECORD_SEEN)
+    {
+      records[kept++] = records[i];
+    }
+  }
+  uint32_t pruned = count - kept;
+  count = kept;
+  dirty = dirty || pruned > 0;
+  xSemaphoreGive(lock);
+  return pruned;
+}
+
+static bool runIndex(BackgroundJob &job)
+{
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    records[i].flags &= ~RECORD_SEEN;
+  }
+  xSemaphoreGive(lock);
+
+  std::vector<String> pending;
+  pending.push_back("/");
+  uint32_t sinceSave = 0;
+  while (!pending.empty() && !job.cancelled())
+  {
+    String dirPath = pending.back();
+    pending.pop_back();
+    File dir = mediaFs->open(dirPath);
+    if (!dir || !dir.isDirectory())
+    {
+      continue;
+    }
+
+    File entry;
+    while (!job.cancelled())
+    {
+      {
+        SdIoScope io(SD_IO_BACKGROUND);
+        entry = dir.openNextFile();
+      }
+      if (!entry)
+      {
+        break;
+      }
+      String path = entry.path();
+      String name = path.substring(path.lastIndexOf('/') + 1);
+      // Hidden entries hold indexes and caches (/.thumbs, /.media_index)
+      if (name.startsWith("."))
+      {
+        entry.close();
+        continue;
+      }
+      if (entry.isDirectory())
+      {
+        pending.push_back(path);
+        entry.close();
+        continue;
+      }
+      FsMeta meta = {true, false, (uint32_t)entry.size(), entry.getLastWrite(), 0, 0};
+      entry.close();
+      MediaType type = mediaTypeFromName(name.c_str());
+      if (type == MEDIA_UNKNOWN)
+      {
+        continue;
+      }
+
+      walk.scanned++;
+      if (unchanged(path, meta))
+      {
+        walk.unchanged++;
+      }
+      else
+      {
+        job.setMessage(path);
+        probeFile(path, meta, type);
+        if (++sinceSave >= MEDIA_INDEX_SAVE_EVERY)
+        {
+          save();
+          sinceSave = 0;
+        }
+      }
+      walk.elapsedMs = millis() - walk.startMs;
+      job.setProgress(walk.scanned, 0);
+    }
+    dir.close();
+  }
+
+  if (!job.cancelled())
+  {
+    walk.pruned = pruneUnseen();
+  }
+  save();
+  walk.elapsedMs = millis() - walk.startMs;
+  job.setMessage(String(walk.probed) + " probed, " + String(walk.unchanged) + " unchanged");
+  return true;
+}
+
+bool startMediaIndex()
+{
+  if (mediaFs == nullptr || indexJob.running())
+  {
+    return false;
+  }
+  memset(&walk, 0, sizeof(walk));
+  walk.startMs = millis();
+  return indexJob.start(runIndex);
+}
+
+void cancelMediaIndex()
+{
+  indexJob.cancel();
+}
+
+bool mediaIndexRunning()
+{
+  return indexJob.running();
+}
+
+bool mediaIndexBegin(fs::FS &fs)
+{
+  if (mediaFs != nullptr)
+  {
+    return true;
+  }
+  mediaFs = &fs;
+  lock = xSemaphoreCreateMutex();
+  if (!load())
+  {
+    count = 0;
+  }
+  Serial.printf("Media index: %u files\n", count);
+  return startMediaIndex();
+}
+
+// ---- Queries ---------------------------------------------------------------
+
+static int64_t fieldValue(const Record &r, uint8_t field)
+{
+  switch (field)
+  {
+  case FIELD_TYPE:
+    return r.type;
+  case FIELD_DATE:
+    return r.captureTime;
+  case FIELD_DURATION:
+    return r.durationMs;
+  case FIELD_WIDTH:
+    return r.width;
+  case FIELD_HEIGHT:
+    return r.height;
+  case FIELD_PIXELS:
+    return (int64_t)r.width * r.height;
+  case FIELD_SIZE:
+    return r.size;
+  case FIELD_ORIENTATION:
+    return r.flags & RECORD_ORIENTATION;
+  case FIELD_MTIME:
+    return r.mtime;
+  default:
+    return 0;
+  }
+}
+
+static bool matches(const Record &r, const MediaQuery &query)
+{
+  if (r.flags & RECORD_FAILED)
+  {
+    return false;
+  }
+  if (query.dir.length() > 1)
+  {
+    uint32_t len = query.dir.length();
+    if (r.pathLen <= len || memcmp(pool + r.pathOffset, query.dir.c_str(), len) != 0 ||
+        pool[r.pathOffset + len] != '/')
+    {
+      return false;
+    }
+  }
+  for (const auto &c : query.conditions)
+  {
+    if (c.field == FIELD_DATE && r.captureTime == 0)
+    {
+      return false;
+    }
+    int64_t v = fieldValue(r, c.field);
+    bool ok;
+    switch (c.op)
+    {
+    case OP_EQ:
+      ok = v == c.value;
+      break;
+    case OP_NE:
+      ok = v != c.value;
+      break;
+    case OP_LT:
+      ok = v < c.value;
+      break;
+    case OP_LE:
+      ok = v <= c.value;
+      break;
+    case OP_GT:
+      ok = v > c.value;
+      break;
+    default:
+      ok = v >= c.value;
+      break;
+    }
+    if (!ok)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int comparePaths(const Record &a, const Record &b)
+{
+  int c = memcmp(pool + a.pathOffset, pool + b.pathOffset, min(a.pathLen, b.pathLen));
+  return c ? c : (int)a.pathLen - (int)b.pathLen;
+}
+
+uint32_t mediaQuery(const MediaQuery &query, const std::function<void(const MediaEntry &entry)> &visit)
+{
+  xSemaphoreTake(lock, portMAX_DELAY);
+  std::vector<uint32_t> rows;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (matches(records[i], query))
+    {
+      rows.push_back(i);
+    }
+  }
+
+  // Files without a date go last either way; ties are ordered by path
+  uint8_t field = query.sortField;
+  bool descending = query.descending;
+  std::sort(rows.begin(), rows.end(), [field, descending](uint32_t x, uint32_t y) {
+    const Record &a = records[x];
+    const Record &b = records[y];
+    if (field == FIELD_DATE && (a.captureTime == 0) != (b.captureTime == 0))
+    {
+      return b.captureTime == 0;
+    }
+    int c;
+    if (field == FIELD_NAME)
+    {
+      c = comparePaths(a, b);
+    }
+    else
+    {
+      int64_t va = fieldValue(a, field);
+      int64_t vb = fieldValue(b, field);
+      c = va < vb ? -1 : va > vb ? 1 : 0;
+    }
+    if (c == 0)
+    {
+      return comparePaths(a, b) < 0;
+    }
+    return descending ? c > 0 : c < 0;
+  });
+
+  for (uint32_t k = query.offset; k < rows.size() && k - query.offset < query.limit; k++)
+  {
+    const Record &r = records[rows[k]];
+    MediaEntry entry;
+    entry.path = recordPath(r);
+    entry.size = r.size;
+    entry.mtime = r.mtime;
+    entry.info.type = (MediaType)r.type;
+    entry.info.orientation = r.flags & RECORD_ORIENTATION;
+    entry.info.width = r.width;
+    entry.info.height = r.height;
+    entry.info.durationMs = r.durationMs;
+    entry.info.captureTime = r.captureTime;
+    visit(entry);
+  }
+  xSemaphoreGive(lock);
+  return rows.size();
+}
+
+static int findField(const String &name)
+{
+  for (int f = 0; f < (int)(sizeof(fieldNames) / sizeof(fieldNames[0])); f++)
+  {
+    if (name == fieldNames[f])
+    {
+      return f;
+    }
+  }
+  return -1;
+}
+
+bool mediaParseQuery(const String &sort, const String &filter, MediaQuery &query, String &error)
+{
+  // Newest first unless asked otherwise
+  String key = sort.length() ? sort : "-date";
+  query.descending = key.startsWith("-");
+  int field = findField(query.descending ? key.substring(1) : key);
+  if (field < 0 || field == FIELD_TYPE)
+  {
+    error = "Unknown sort key: " + key;
+    return false;
+  }
+  query.sortField = field;
+
+  query.conditions.clear();
+  int start = 0;
+  while (start < (int)filter.length())
+  {
+    int end = filter.indexOf(',', start);
+    if (end < 0)
+    {
+      end = filter.length();
+    }
+    String term = filter.substring(start, end);
+    start = end + 1;
+    term.trim();
+    if (term.length() == 0)
+    {
+      continue;
+    }
+
+    int at = -1;
+    int opLen = 1;
+    Op op = OP_EQ;
+    for (int i = 0; i < (int)term.length() && at < 0; i++)
+    {
+      char c = term[i];
+      char next = i + 1 < (int)term.length() ? term[i + 1] : 0;
+      if (c == '!' && next == '=')
+        at = i, op = OP_NE, opLen = 2;
+      else if (c == '<')
+        at = i, op = next == '=' ? OP_LE : OP_LT, opLen = next == '=' ? 2 : 1;
+      else if (c == '>')
+        at = i, op = next == '=' ? OP_GE : OP_GT, opLen = next == '=' ? 2 : 1;
+      else if (c == '=')
+        at = i, op = OP_EQ;
+    }
+    int f = at > 0 ? findField(term.substring(0, at)) : -1;
+    if (f < 0 || f == FIELD_NAME || f == FIELD_MTIME)
+    {
+      error = "Bad condition: " + term;
+      return false;
+    }
+    String value = term.substring(at + opLen);
+
+    MediaQuery::Condition c;
+    c.field = f;
+    c.op = op;
+    if (f == FIELD_TYPE)
+    {
+      c.value = mediaTypeFromString(value.c_str());
+      if (c.value == MEDIA_UNKNOWN || (op != OP_EQ && op != OP_NE))
+      {
+        error = "Bad type condition: " + term;
+        return false;
+      }
+    }
+    else if (f == FIELD_DATE)
+    {
+      bool number = value.length() > 0;
+      for (unsigned i = 0; i < value.length(); i++)
+      {
+        number = number && value[i] >= '0' && value[i] <= '9';
+      }
+      c.value = number ? strtoll(value.c_str(), nullptr, 10) : mediaParseDate(value.c_str());
+      if (c.value < 0)
+      {
+        error = "Bad date: " + value;
+        return false;
+      }
+    }
+    else if (f == FIELD_DURATION)
+    {
+      c.value = (int64_t)(value.toFloat() * 1000); // seconds
+    }
+    else
+    {
+      c.value = strtoll(value.c_str(), nullptr, 10);
+    }
+    if (query.conditions.size() >= MEDIA_QUERY_MAX_CONDITIONS)
+    {
+      error = "Too many conditions";
+      return false;
+    }
+    query.conditions.push_back(c);
+  }
+  return true;
+}
+
+void mediaEntryJson(JsonObject obj, const MediaEntry &entry)
+{
+  obj["path"] = entry.path;
+  obj["type"] = mediaTypeName(entry.info.type);
+  obj["size"] = entry.size;
+  if (entry.info.width)
+  {
+    obj["width"] = entry.info.width;
+    obj["height"] = entry.info.height;
+  }
+  if (entry.info.type == MEDIA_JPEG || entry.info.type == MEDIA_PNG)
+  {
+    obj["orientation"] = entry.info.orientation;
+  }
+  if (entry.info.durationMs)
+  {
+    obj["durationMs"] = entry.info.durationMs;
+  }
+  if (entry.info.captureTime)
+  {
+    char date[24];
+    mediaFormatDate(entry.info.captureTime, date, sizeof(date));
+    obj["date"] = date;
+  }
+}
+
+void mediaIndexStatusJson(JsonObject obj)
+{
+  indexJob.statusJson(obj["job"].to<JsonObject>());
+
+  uint32_t byType[MEDIA_WAV + 1] = {0};
+  uint32_t failed = 0;
+  uint32_t files;
+  uint32_t poolBytes;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  files = count;
+  poolBytes = poolUsed;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (records[i].flags & RECORD_FAILED)
+      failed++;
+    else if (records[i].type <= MEDIA_WAV)
+      byType[records[i].type]++;
+  }
+  xSemaphoreGive(lock);
+
+  obj["files"] = files;
+  obj["memoryBytes"] = files * sizeof(Record) + poolBytes;
+  JsonObject types = obj["types"].to<JsonObject>();
+  for (int t = MEDIA_JPEG; t <= MEDIA_WAV; t++)
+  {
+    types[mediaTypeName((MediaType)t)] = byType[t];
+  }
+  obj["unreadable"] = failed;
+
+  JsonObject w = obj["walk"].to<JsonObject>();
+  w["scanned"] = walk.scanned;
+  w["probed"] = walk.probed;
+  w["unchanged"] = walk.unchanged;
+  w["failed"] = walk.failed;
+  w["locked"] = walk.locked;
+  w["pruned"] = walk.pruned;
+  w["reads"] = walk.reads;
+  w["bytesRead"] = walk.bytesRead;
+  w["elapsedMs"] = walk.elapsedMs;
+  // Probed files per second is the indexing rate; unchanged files only
+  // cost a directory entry
+  w["filesPerSec"] = walk.elapsedMs ? walk.probed * 1000.0f / walk.elapsedMs : 0;
+  w["scannedPerSec"] = walk.elapsedMs ? walk.scanned * 1000.0f / walk.elapsedMs : 0;
+  w["bytesPerFile"] = walk.probed ? (uint32_t)(walk.bytesRead / walk.probed) : 0;
+}
@@ -0,0 +1,69 @@
+#ifndef __MEDIA_INDEX_H
+#define __MEDIA_INDEX_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+#include <functional>
+#include <vector>
+#include "media_probe.h"
+
+// Sidecar file holding the index on the card
+#define MEDIA_INDEX_PATH "/.media_index"
+// The walk saves the index after this many probed files, so a reboot
+// halfway through a large card does not start over
+#define MEDIA_INDEX_SAVE_EVERY 256
+#define MEDIA_QUERY_DEFAULT_LIMIT 100
+#define MEDIA_QUERY_MAX_LIMIT 1000
+#define MEDIA_QUERY_MAX_CONDITIONS 8
+
+// One row of a /media result
+struct MediaEntry
+{
+    String path;
+    uint32_t size;
+    uint32_t mtime;
+    MediaInfo info;
+};
+
+// Parsed /media?sort=&filter=&dir= request. Filter conditions are comma
+// separated `field op value` with fields type (=, !=), date (seconds or
+// YYYY-MM-DD[ HH:MM[:SS]]), duration (seconds), width, height, pixels,
+// size and orientation, e.g. `type=mp4,duration>600` or
+// `date>=2024-01-01,width>=1920`. Files without a date never match a date
+// condition.
+struct MediaQuery
+{
+    struct Condition
+    {
+        uint8_t field;
+        uint8_t op;
+        int64_t value;
+    };
+
+    String dir;
+    std::vector<Condition> conditions;
+    uint8_t sortField;
+    bool descending;
+    uint32_t offset;
+    uint32_t limit;
+};
+
+bool mediaParseQuery(const String &sort, const String &filter, MediaQuery &query, String &error);
+
+// Loads the index and starts a walk that probes new and changed files
+bool mediaIndexBegin(fs::FS &fs);
+// Walks the card again: unchanged files (same size and mtime) are skipped,
+// records of deleted files dropped
+bool startMediaIndex();
+void cancelMediaIndex();
+bool mediaIndexRunning();
+
+// Calls `visit` for the matching rows in order, from query.offset up to
+// query.limit rows; returns the number of matches
+uint32_t mediaQuery(const MediaQuery &query, const std::function<void(const MediaEntry &entry)> &visit);
+
+void mediaEntryJson(JsonObject obj, const MediaEntry &entry);
+void mediaIndexStatusJson(JsonObject obj);
+
+#endif
@@ -0,0 +1,540 @@
+#include "media_probe.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Seconds from 1904-01-01 (the MP4 epoch) to 1970-01-01
+#define MP4_EPOCH_OFFSET 2082844800LL
+
+namespace
+{
+
+// Exact reads within the probe's budget
+class Probe
+{
+public:
+  Probe(uint64_t fileSize, const MediaReader &r) : size(fileSize), reader(r), reads(0), bytes(0) {}
+
+  bool read(uint64_t offset, uint8_t *out, size_t len)
+  {
+    if (offset > size || size - offset < len || reads >= MEDIA_PROBE_MAX_READS ||
+        bytes + len > MEDIA_PROBE_MAX_BYTES)
+    {
+      return false;
+    }
+    reads++;
+    bytes += len;
+    return reader(offset, out, len) == len;
+  }
+
+  uint64_t size;
+  const MediaReader &reader;
+  uint32_t reads;
+  uint32_t bytes;
+};
+
+} // namespace
+
+static inline uint32_t be16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+static inline uint32_t be32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static inline uint64_t be64(const uint8_t *p) { return ((uint64_t)be32(p) << 32) | be32(p + 4); }
+static inline uint32_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static inline uint32_t le32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+// ---- Dates -----------------------------------------------------------------
+
+static int64_t daysFromCivil(int y, int m, int d)
+{
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (int64_t)era * 146097 + doe - 719468;
+}
+
+static bool digits(const char *p, int n, int &out)
+{
+  out = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (p[i] < '0' || p[i] > '9')
+    {
+      return false;
+    }
+    out = out * 10 + (p[i] - '0');
+  }
+  return true;
+}
+
+int64_t mediaParseDate(const char *text)
+{
+  int y, mo, d, h = 0, mi = 0, s = 0;
+  size_t len = strlen(text);
+  if (len < 10 || !digits(text, 4, y) || (text[4] != ':' && text[4] != '-') || !digits(text + 5, 2, mo) ||
+      text[7] != text[4] || !digits(text + 8, 2, d))
+  {
+    return -1;
+  }
+  if (len >= 16 && (text[10] == ' ' || text[10] == 'T'))
+  {
+    if (!digits(text + 11, 2, h) || text[13] != ':' || !digits(text + 14, 2, mi))
+    {
+      return -1;
+    }
+    if (len >= 19 && text[16] == ':' && !digits(text + 17, 2, s))
+    {
+      return -1;
+    }
+  }
+  // Cameras without a clock write zeros
+  if (y < 1970 || mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || s > 60)
+  {
+    return -1;
+  }
+  return daysFromCivil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s;
+}
+
+void mediaFormatDate(int64_t t, char *out, size_t len)
+{
+  int64_t days = t >= 0 ? t / 86400 : (t - 86399) / 86400;
+  int64_t secs = t - days * 86400;
+  // Inverse of daysFromCivil
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t doe = days - era * 146097;
+  int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int64_t mp = (5 * doy + 2) / 153;
+  int d = (int)(doy - (153 * mp + 2) / 5 + 1);
+  int m = (int)(mp < 10 ? mp + 3 : mp - 9);
+  int y = (int)(yoe + era * 400 + (m <= 2));
+  snprintf(out, len, "%04d-%02d-%02dT%02d:%02d:%02d", y, m, d, (int)(secs / 3600), (int)(secs / 60 % 60),
+           (int)(secs % 60));
+}
+
+// ---- Types -----------------------------------------------------------------
+
+static const struct
+{
+  const char *ext;
+  MediaType type;
+} extensions[] = {{".jpg", MEDIA_JPEG}, {".jpeg", MEDIA_JPEG}, {".png", MEDIA_PNG}, {".mp4", MEDIA_MP4},
+                  {".m4v", MEDIA_MP4},  {".mov", MEDIA_MP4},   {".m4a", MEDIA_MP4}, {".wav", MEDIA_WAV}};
+
+static const char *typeNames[] = {"unknown", "jpeg", "png", "mp4", "wav"};
+
+MediaType mediaTypeFromName(const char *name)
+{
+  const char *dot = strrchr(name, '.');
+  if (dot == nullptr || strlen(dot) > 5)
+  {
+    return MEDIA_UNKNOWN;
+  }
+  char ext[6];
+  size_t i = 0;
+  for (; dot[i]; i++)
+  {
+    ext[i] = dot[i] >= 'A' && dot[i] <= 'Z' ? dot[i] + 32 : dot[i];
+  }
+  ext[i] = 0;
+  for (const auto &e : extensions)
+  {
+    if (strcmp(ext, e.ext) == 0)
+    {
+      return e.type;
+    }
+  }
+  return MEDIA_UNKNOWN;
+}
+
+const char *mediaTypeName(MediaType type)
+{
+  return type <= MEDIA_WAV ? typeNames[type] : typeNames[0];
+}
+
+MediaType mediaTypeFromString(const char *name)
+{
+  for (int t = MEDIA_JPEG; t <= MEDIA_WAV; t++)
+  {
+    if (strcmp(name, typeNames[t]) == 0)
+    {
+      return (MediaType)t;
+    }
+  }
+  return MEDIA_UNKNOWN;
+}
+
+// ---- EXIF (TIFF) -----------------------------------------------------------
+
+static void parseTiff(const uint8_t *t, size_t n, MediaInfo &info)
+{
+  if (n < 8 || !((t[0] == 'I' && t[1] == 'I') || (t[0] == 'M' && t[1] == 'M')))
+  {
+    return;
+  }
+  bool little = t[0] == 'I';
+  auto u16 = [&](size_t o) -> uint32_t {
+    if (o > n || n - o < 2)
+    {
+      return 0;
+    }
+    return little ? le16(t + o) : be16(t + o);
+  };
+  auto u32 = [&](size_t o) -> uint32_t {
+    if (o > n || n - o < 4)
+    {
+      return 0;
+    }
+    return little ? le32(t + o) : be32(t + o);
+  };
+  // ASCII values longer than 4 bytes live at an offset
+  auto date = [&](size_t e) -> int64_t {
+    uint32_t count = u32(e + 4);
+    size_t at = count <= 4 ? e + 8 : u32(e + 8);
+    char text[24];
+    if (u16(e + 2) != 2 || count < 11 || at > n || n - at < count)
+    {
+      return -1;
+    }
+    size_t len = count < sizeof(text) ? count : sizeof(text) - 1;
+    memcpy(text, t + at, len);
+    text[len] = 0;
+    return mediaParseDate(text);
+  };
+  int64_t modified = -1;
+  int64_t original = -1;
+  int64_t digitized = -1;
+  uint32_t exifIfd = 0;
+  uint32_t ifd = u32(4);
+  uint32_t entries = u16(ifd);
+  for (uint32_t i = 0; i < entries && i < 512; i++)
+  {
+    size_t e = ifd + 2 + 12 * i;
+    switch (u16(e))
+    {
+    case 0x0112:
+      info.orientation = u16(e + 8) >= 1 && u16(e + 8) <= 8 ? u16(e + 8) : 1;
+      break;
+    case 0x0132:
+      modified = date(e);
+      break;
+    case 0x8769:
+      exifIfd = u32(e + 8);
+      break;
+    }
+  }
+  entries = exifIfd ? u16(exifIfd) : 0;
+  for (uint32_t i = 0; i < entries && i < 512; i++)
+  {
+    size_t e = exifIfd + 2 + 12 * i;
+    switch (u16(e))
+    {
+    case 0x9003:
+      original = date(e);
+      break;
+    case 0x9004:
+      digitized = date(e);
+      break;
+    }
+  }
+  int64_t when = original > 0 ? original : digitized > 0 ? digitized : modified;
+  info.captureTime = when > 0 ? when : 0;
+}
+
+// ---- Formats ---------------------------------------------------------------
+
+static bool probeJpeg(Probe &p, MediaInfo &info)
+{
+  uint8_t h[6];
+  if (!p.read(0, h, 2) || h[0] != 0xFF || h[1] != 0xD8)
+  {
+    return false;
+  }
+  uint64_t pos = 2;
+  bool exif = false;
+  for (;;)
+  {
+    if (!p.read(pos, h, 4) || h[0] != 0xFF)
+    {
+      return false;
+    }
+    uint8_t marker = h[1];
+    if (marker == 0xFF)
+    {
+      pos++; // fill byte
+      continue;
+    }
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+    {
+      pos += 2;
+      continue;
+    }
+    if (marker == 0xD9 || marker == 0xDA)
+    {
+      return false; // image data before a frame header
+    }
+    uint32_t len = be16(h + 2);
+    if (len < 2)
+    {
+      return false;
+    }
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+    {
+      // The frame header follows APP1
+      uint8_t f[5];
+      if (!p.read(pos + 4, f, 5))
+      {
+        return false;
+      }
+      info.height = be16(f + 1);
+      info.width = be16(f + 3);
+      return true;
+    }
+    if (marker == 0xE1 && !exif && len > 2 + 6 + 8 && p.read(pos + 4, h, 6) && memcmp(h, "Exif\0\0", 6) == 0)
+    {
+      // Skips XMP, which is also APP1
+      std::vector<uint8_t> tiff(len - 2 - 6);
+      if (p.read(pos + 10, tiff.data(), tiff.size()))
+      {
+        parseTiff(tiff.data(), tiff.size(), info);
+        exif = true;
+      }
+    }
+    pos += 2 + len;
+  }
+}
+
+static bool probePng(Probe &p, MediaInfo &info)
+{
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  uint8_t h[8];
+  if (!p.read(0, h, 8) || memcmp(h, signature, 8) != 0)
+  {
+    return false;
+  }
+  uint64_t pos = 8;
+  while (p.read(pos, h, 8))
+  {
+    uint32_t len = be32(h);
+    if (memcmp(h + 4, "IHDR", 4) == 0)
+    {
+      uint8_t d[8];
+      if (len < 8 || !p.read(pos + 8, d, 8))
+      {
+        return false;
+      }
+      info.width = be32(d);
+      info.height = be32(d + 4);
+    }
+    else if (memcmp(h + 4, "eXIf", 4) == 0 && len < MEDIA_PROBE_MAX_BYTES / 2)
+    {
+      std::vector<uint8_t> tiff(len);
+      if (p.read(pos + 8, tiff.data(), len))
+      {
+        parseTiff(tiff.data(), len, info);
+      }
+    }
+    else if (memcmp(h + 4, "tIME", 4) == 0 && info.captureTime == 0)
+    {
+      // Last modification, as close as PNG gets to a capture date
+      uint8_t d[7];
+      if (len == 7 && p.read(pos + 8, d, 7))
+      {
+        char text[32];
+        snprintf(text, sizeof(text), "%04u-%02u-%02u %02u:%02u:%02u", be16(d), d[2], d[3], d[4], d[5], d[6]);
+        int64_t when = mediaParseDate(text);
+        info.captureTime = when > 0 ? when : 0;
+      }
+    }
+    else if (memcmp(h + 4, "IDAT", 4) == 0 || memcmp(h + 4, "IEND", 4) == 0)
+    {
+      break;
+    }
+    pos += 12 + (uint64_t)len;
+  }
+  return info.width > 0;
+}
+
+// Walks the boxes in [start, end); descends into the containers that lead
+// to mvhd and tkhd and skips everything else (mdat) by its size
+static bool walkBoxes(Probe &p, uint64_t start, uint64_t end, int depth, MediaInfo &info, bool &movieHeader)
+{
+  uint64_t pos = start;
+  while (end - pos >= 8)
+  {
+    uint8_t h[16];
+    if (!p.read(pos, h, 8))
+    {
+      return false;
+    }
+    uint64_t size = be32(h);
+    uint64_t header = 8;
+    if (size == 1)
+    {
+      if (!p.read(pos + 8, h + 8, 8))
+      {
+        return false;
+      }
+      size = be64(h + 8);
+      header = 16;
+    }
+    else if (size == 0)
+    {
+      size = end - pos; // to the end of the file
+    }
+    if (size < header || size > end - pos)
+    {
+      return false;
+    }
+    if (depth == 0 && pos == start && memcmp(h + 4, "ftyp", 4) != 0 && memcmp(h + 4, "moov", 4) != 0 &&
+        memcmp(h + 4, "mdat", 4) != 0 && memcmp(h + 4, "wide", 4) != 0 && memcmp(h + 4, "free", 4) != 0)
+    {
+      return false; // not an ISO media file
+    }
+
+    const uint8_t *type = h + 4;
+    uint64_t body = pos + header;
+    size_t bodyLen = size - header > 96 ? 96 : (size_t)(size - header);
+    if ((memcmp(type, "moov", 4) == 0 && depth == 0) || (memcmp(type, "trak", 4) == 0 && depth == 1))
+    {
+      if (!walkBoxes(p, body, pos + size, depth + 1, info, movieHeader))
+      {
+        return false;
+      }
+      if (depth == 0)
+      {
+        return movieHeader; // everything needed is in moov
+      }
+    }
+    else if (memcmp(type, "mvhd", 4) == 0 && depth == 1)
+    {
+      uint8_t b[32];
+      if (bodyLen < 20 || !p.read(body, b, bodyLen < 32 ? bodyLen : 32))
+      {
+        return false;
+      }
+      uint64_t created;
+      uint32_t timescale;
+      uint64_t duration;
+      if (b[0] == 1 && bodyLen >= 32)
+      {
+        created = be64(b + 4);
+        timescale = be32(b + 20);
+        duration = be64(b + 24);
+      }
+      else
+      {
+        created = be32(b + 4);
+        timescale = be32(b + 12);
+        duration = be32(b + 16);
+      }
+      if (timescale > 0)
+      {
+        uint64_t ms = duration * 1000 / timescale;
+        info.durationMs = ms > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)ms;
+      }
+      // Many cameras leave the creation time at 0 (1904)
+      if ((int64_t)created > MP4_EPOCH_OFFSET)
+      {
+        info.captureTime = (int64_t)created - MP4_EPOCH_OFFSET;
+      }
+      movieHeader = true;
+    }
+    else if (memcmp(type, "tkhd", 4) == 0 && depth == 2)
+    {
+      // Width and height (16.16 fixed point) end the box; audio tracks
+      // have zeros
+      uint8_t b[96];
+      if (bodyLen >= 84 && p.read(body, b, bodyLen))
+      {
+        size_t at = b[0] == 1 ? 88 : 76;
+        if (bodyLen >= at + 8 && (be32(b + at) >> 16) > info.width)
+        {
+          info.width = be32(b + at) >> 16;
+          info.height = be32(b + at + 4) >> 16;
+        }
+      }
+    }
+    pos += size;
+  }
+  return movieHeader;
+}
+
+static bool probeMp4(Probe &p, MediaInfo &info)
+{
+  bool movieHeader = false;
+  return walkBoxes(p, 0, p.size, 0, info, movieHeader) || movieHeader;
+}
+
+static bool probeWav(Probe &p, MediaInfo &info)
+{
+  uint8_t h[16];
+  if (!p.read(0, h, 12) || memcmp(h, "RIFF", 4) != 0 || memcmp(h + 8, "WAVE", 4) != 0)
+  {
+    return false;
+  }
+  uint32_t byteRate = 0;
+  uint64_t dataBytes = 0;
+  bool data = false;
+  uint64_t pos = 12;
+  while (!(byteRate && data) && p.read(pos, h, 8))
+  {
+    uint64_t len = le32(h + 4);
+    if (memcmp(h, "fmt ", 4) == 0)
+    {
+      if (len < 16 || !p.read(pos + 8, h, 16))
+      {
+        return false;
+      }
+      byteRate = le32(h + 8);
+    }
+    else if (memcmp(h, "data", 4) == 0)
+    {
+      // Streamed recordings may leave the size unset
+      uint64_t rest = p.size - pos - 8;
+      dataBytes = len == 0 || len == 0xFFFFFFFF || len > rest ? rest : len;
+      data = true;
+    }
+    pos += 8 + len + (len & 1);
+  }
+  if (!byteRate || !data)
+  {
+    return false;
+  }
+  uint64_t ms = dataBytes * 1000 / byteRate;
+  info.durationMs = ms > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)ms;
+  return true;
+}
+
+bool mediaProbe(MediaType type, uint64_t size, const MediaReader &read, MediaInfo &info, MediaProbeStats *stats)
+{
+  memset(&info, 0, sizeof(info));
+  info.type = type;
+  info.orientation = 1;
+  Probe p(size, read);
+  bool ok = false;
+  switch (type)
+  {
+  case MEDIA_JPEG:
+    ok = probeJpeg(p, info);
+    break;
+  case MEDIA_PNG:
+    ok = probePng(p, info);
+    break;
+  case MEDIA_MP4:
+    ok = probeMp4(p, info);
+    break;
+  case MEDIA_WAV:
+    ok = probeWav(p, info);
+    break;
+  default:
+    break;
+  }
+  if (stats)
+  {
+    stats->reads = p.reads;
+    stats->bytes = p.bytes;
+  }
+  return ok;
+}
@@ -0,0 +1,61 @@
+#ifndef __MEDIA_PROBE_H
+#define __MEDIA_PROBE_H
+
+// Portable C++ only: used by the media index (media_index.*) and by the
+// host benchmark (tools/media_bench.cpp)
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// Budget of one probe. Only headers are read: box/chunk/segment headers
+// are followed by seeking, so a 4 GB video costs as little as a photo.
+#define MEDIA_PROBE_MAX_READS 48
+#define MEDIA_PROBE_MAX_BYTES (96 * 1024)
+
+enum MediaType : uint8_t
+{
+    MEDIA_UNKNOWN,
+    MEDIA_JPEG,
+    MEDIA_PNG,
+    MEDIA_MP4, // also .mov / .m4a (ISO base media boxes)
+    MEDIA_WAV
+};
+
+struct MediaInfo
+{
+    MediaType type;
+    uint8_t orientation; // EXIF 1 .. 8; 1 if unknown
+    uint32_t width;
+    uint32_t height;
+    uint32_t durationMs;
+    // Seconds since 1970 of the recorded capture/creation time, 0 if
+    // unknown. EXIF dates carry no time zone and are taken as UTC.
+    int64_t captureTime;
+};
+
+struct MediaProbeStats
+{
+    uint32_t reads;
+    uint32_t bytes;
+};
+
+// Reads `len` bytes at `offset`; fewer at the end of the file
+typedef std::function<size_t(uint64_t offset, uint8_t *buffer, size_t len)> MediaReader;
+
+// By file extension
+MediaType mediaTypeFromName(const char *name);
+const char *mediaTypeName(MediaType type);
+MediaType mediaTypeFromString(const char *name);
+
+// Fills `info` from the headers of a `size`-byte file. False if the file is
+// not of the given type or its headers are cut short; fields that could be
+// read before the budget ran out are kept.
+bool mediaProbe(MediaType type, uint64_t size, const MediaReader &read, MediaInfo &info,
+                MediaProbeStats *stats = nullptr);
+
+// "YYYY:MM:DD HH:MM:SS" (EXIF) or "YYYY-MM-DD[ HH:MM[:SS]]"; -1 if invalid
+int64_t mediaParseDate(const char *text);
+// "YYYY-MM-DDTHH:MM:SS"
+void mediaFormatDate(int64_t t, char *out, size_t len);
+
+#endif
@@ -0,0 +1,563 @@
+#include "meta_cache.h"
+#include "sd_read_write.h"
+#include <esp_heap_caps.h>
+#include <time.h>
+#include "ff.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+MetaCache g_metaCache;
+HandleCache g_handleCache;
+
+#define META_FLAG_VALID 0x01
+#define META_FLAG_EXISTS 0x02
+#define META_FLAG_DIR 0x04
+
+// "/a/b/" and "/a/b" are the same FAT object
+static String normalizePath(const String &path)
+{
+  String p = path.length() ? path : String("/");
+  while (p.length() > 1 && p.endsWith("/"))
+  {
+    p.remove(p.length() - 1);
+  }
+  return p;
+}
+
+#define FNV_OFFSET 1469598103934665603ULL
+#define FNV_PRIME 1099511628211ULL
+
+// FNV-1a 64-bit
+static uint64_t hashPath(const String &path)
+{
+  uint64_t h = FNV_OFFSET;
+  const char *s = path.c_str();
+  while (*s)
+  {
+    h ^= (uint8_t)*s++;
+    h *= FNV_PRIME;
+  }
+  return h ? h : 1; // 0 marks an empty entry
+}
+
+// FAT timestamps are local time, as in the VFS stat()
+static time_t fatTime(WORD fdate, WORD ftime)
+{
+  struct tm tm = {};
+  tm.tm_year = (fdate >> 9) + 80;
+  tm.tm_mon = ((fdate >> 5) & 0x0F) - 1;
+  tm.tm_mday = fdate & 0x1F;
+  tm.tm_hour = ftime >> 11;
+  tm.tm_min = (ftime >> 5) & 0x3F;
+  tm.tm_sec = (ftime & 0x1F) * 2;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+static void lockTake(void *lock)
+{
+  if (lock)
+  {
+    xSemaphoreTake((SemaphoreHandle_t)lock, portMAX_DELAY);
+  }
+}
+
+static void lockGive(void *lock)
+{
+  if (lock)
+  {
+    xSemaphoreGive((SemaphoreHandle_t)lock);
+  }
+}
+
+bool MetaCache::begin(fs::FS &filesystem, size_t capacity)
+{
+  fs = &filesystem;
+  if (entries != nullptr)
+  {
+    return true;
+  }
+
+  setCount = max((size_t)1, capacity / META_CACHE_WAYS);
+  size_t bytes = setCount * META_CACHE_WAYS * sizeof(Entry);
+  entries = (Entry *)heap_caps_calloc(1, bytes, MALLOC_CAP_SPIRAM);
+  if (entries == nullptr)
+  {
+    entries = (Entry *)calloc(1, bytes);
+  }
+  if (entries == nullptr)
+  {
+    Serial.println("Metadata cache allocation failed, lookups will not be cached");
+    return false;
+  }
+
+  lock = xSemaphoreCreateMutex();
+  Serial.printf("Metadata cache: %u entries (%.2f KB)\n",
+                setCount * META_CACHE_WAYS, bytes / 1024.0);
+  return true;
+}
+
+MetaCache::Entry *MetaCache::find(uint64_t key)
+{
+  Entry *set = &entries[(key % setCount) * META_CACHE_WAYS];
+  for (int i = 0; i < META_CACHE_WAYS; i++)
+  {
+    if (set[i].key == key && (set[i].flags & META_FLAG_VALID))
+    {
+      return &set[i];
+    }
+  }
+  return nullptr;
+}
+
+MetaCache::Entry *MetaCache::victim(uint64_t key)
+{
+  Entry *set = &entries[(key % setCount) * META_CACHE_WAYS];
+  Entry *oldest = &set[0];
+  for (int i = 0; i < META_CACHE_WAYS; i++)
+  {
+    if (!(set[i].flags & META_FLAG_VALID))
+    {
+      return &set[i];
+    }
+    if (set[i].lastUse < oldest->lastUse)
+    {
+      oldest = &set[i];
+    }
+  }
+  return oldest;
+}
+
+// True if a directory above `path` was invalidated after the entry was
+// filled. FNV-1a is computed front to back, so the hash of every ancestor
+// falls out of one pass over the path.
+bool MetaCache::invalidatedBelow(const String &path, uint32_t filled)
+{
+  if (dirCount == 0)
+  {
+    return false;
+  }
+
+  uint64_t h = FNV_OFFSET;
+  const char *s = path.c_str();
+  for (size_t i = 0; s[i]; i++)
+  {
+    if (s[i] == '/' && i > 0)
+    {
+      uint64_t ancestor = h ? h : 1;
+      for (size_t d = 0; d < dirCount; d++)
+      {
+        if (dirs[d].key == ancestor && dirs[d].tick > filled)
+        {
+          return true;
+        }
+      }
+    }
+    h ^= (uint8_t)s[i];
+    h *= FNV_PRIME;
+  }
+  return false;
+}
+
+// f_stat for size, attributes and mtime, then the object is opened for its
+// first cluster; that second walk finds the directory sectors in the block
+// cache the first one just filled
+bool MetaCache::statUncached(const String &path, FsMeta &out)
+{
+  out.exists = false;
+  out.isDirectory = false;
+  out.size = 0;
+  out.mtime = 0;
+  out.attrs = 0;
+  out.firstCluster = 0;
+  if (fs == nullptr)
+  {
+    return false;
+  }
+
+  String p = normalizePath(path);
+  if (p == "/")
+  {
+    // f_stat() rejects the root, which has no directory entry
+    out.exists = true;
+    out.isDirectory = true;
+    out.attrs = AM_DIR;
+    return true;
+  }
+
+  String fatPath = sdFatPath(p);
+  FILINFO info;
+  if (f_stat(fatPath.c_str(), &info) != FR_OK)
+  {
+    return false;
+  }
+  out.exists = true;
+  out.isDirectory = info.fattrib & AM_DIR;
+  out.size = out.isDirectory ? 0 : info.fsize;
+  out.mtime = fatTime(info.fdate, info.ftime);
+  out.attrs = info.fattrib;
+
+  if (out.isDirectory)
+  {
+    DIR dir;
+    if (f_opendir(&dir, fatPath.c_str()) == FR_OK)
+    {
+      out.firstCluster = dir.obj.sclust;
+      f_closedir(&dir);
+    }
+  }
+  else
+  {
+    // FIL carries a sector buffer, keep it off the caller's stack
+    FIL *file = (FIL *)malloc(sizeof(FIL));
+    if (file != nullptr && f_open(file, fatPath.c_str(), FA_READ) == FR_OK)
+    {
+      out.firstCluster = file->obj.sclust;
+      f_close(file);
+    }
+    free(file);
+  }
+  return out.exists;
+}
+
+bool MetaCache::stat(const String &path, FsMeta &out)
+{
+  String p = normalizePath(path);
+  uint64_t key = hashPath(p);
+
+  if (entries != nullptr)
+  {
+    lockTake(lock);
+    Entry *e = find(key);
+    if (e != nullptr && invalidatedBelow(p, e->filled))
+    {
+      e->flags = 0;
+      e = nullptr;
+    }
+    if (e != nullptr)
+    {
+      e->lastUse = ++tick;
+      out.exists = e->flags & META_FLAG_EXISTS;
+      out.isDirectory = e->flags & META_FLAG_DIR;
+      out.size = e->size;
+      out.mtime = e->mtime;
+      out.attrs = e->attrs;
+      out.firstCluster = e->firstCluster;
+      hits++;
+      lockGive(lock);
+      return out.exists;
+    }
+    misses++;
+    lockGive(lock);
+  }
+
+  // Miss: one real lookup (a single FAT directory walk), then remember the
+  // answer (including "not found")
+  uint32_t seen = generation;
+  statUncached(p, out);
+
+  if (entries != nullptr)
+  {
+    lockTake(lock);
+    // Something was invalidated during the lookup, which may have raced
+    // with it: answer, but do not cache
+    if (generation != seen)
+    {
+      lockGive(lock);
+      return out.exists;
+    }
+    Entry *e = find(key);
+    if (e == nullptr)
+    {
+      e = victim(key);
+    }
+    e->key = key;
+    e->size = out.size;
+    e->mtime = out.mtime;
+    e->firstCluster = out.firstCluster;
+    e->attrs = out.attrs;
+    e->lastUse = ++tick;
+    e->filled = e->lastUse;
+    e->flags = META_FLAG_VALID | (out.exists ? META_FLAG_EXISTS : 0) | (out.isDirectory ? META_FLAG_DIR : 0);
+    lockGive(lock);
+  }
+  return out.exists;
+}
+
+bool MetaCache::exists(const String &path)
+{
+  FsMeta meta;
+  return stat(path, meta);
+}
+
+void MetaCache::invalidate(const String &path)
+{
+  if (entries == nullptr)
+  {
+    return;
+  }
+
+  lockTake(lock);
+  generation++;
+  Entry *e = find(hashPath(normalizePath(path)));
+  if (e != nullptr)
+  {
+    e->flags = 0;
+    invalidations++;
+  }
+  lockGive(lock);
+}
+
+void MetaCache::invalidateBelow(const String &path)
+{
+  if (entries == nullptr)
+  {
+    return;
+  }
+
+  String p = normalizePath(path);
+  lockTake(lock);
+  if (p == "/")
+  {
+    clearLocked();
+    lockGive(lock);
+    return;
+  }
+
+  uint64_t key = hashPath(p);
+  generation++;
+  invalidations++;
+  size_t d = 0;
+  while (d < dirCount && dirs[d].key != key)
+  {
+    d++;
+  }
+  if (d == dirCount)
+  {
+    if (dirCount == META_CACHE_DIR_INVALIDATIONS)
+    {
+      // Every lookup walks this list; start over instead of growing it
+      clearLocked();
+      lockGive(lock);
+      return;
+    }
+    dirCount++;
+  }
+  dirs[d].key = key;
+  dirs[d].tick = ++tick;
+  lockGive(lock);
+}
+
+void MetaCache::clearLocked()
+{
+  memset(entries, 0, setCount * META_CACHE_WAYS * sizeof(Entry));
+  dirCount = 0;
+  generation++;
+  invalidations++;
+}
+
+void MetaCache::clear()
+{
+  if (entries == nullptr)
+  {
+    return;
+  }
+
+  lockTake(lock);
+  clearLocked();
+  lockGive(lock);
+}
+
+void MetaCache::statsJson(JsonObject obj)
+{
+  uint32_t total = hits + misses;
+  obj["entries"] = setCount * META_CACHE_WAYS;
+  obj["hits"] = hits;
+  obj["misses"] = misses;
+  obj["hitRatio"] = total ? (float)hits / total : 0;
+  obj["lookupsSaved"] = hits;
+  obj["invalidations"] = invalidations;
+}
+
+void HandleCache::begin(fs::FS &filesystem)
+{
+  fs = &filesystem;
+  if (lock == nullptr)
+  {
+    lock = xSemaphoreCreateMutex();
+  }
+}
+
+FileLease HandleCache::acquire(const String &path)
+{
+  FileLease lease;
+  lease.slot = -1;
+  String p = normalizePath(path);
+
+  lockTake(lock);
+  for (int i = 0; i < HANDLE_CACHE_SLOTS; i++)
+  {
+    Slot &s = slots[i];
+    if (s.file && !s.leased && !s.stale && s.path == p)
+    {
+      s.leased = true;
+      s.lastUse = ++tick;
+      s.file.seek(0);
+      hits++;
+      lease.file = s.file;
+      lease.slot = i;
+      lockGive(lock);
+      return lease;
+    }
+  }
+  misses++;
+  lockGive(lock);
+
+  if (fs == nullptr)
+  {
+    return lease;
+  }
+  lease.file = fs->open(p, FILE_READ);
+  if (!lease.file || lease.file.isDirectory())
+  {
+    lease.file = File();
+    return lease;
+  }
+
+  // Park the new handle in a free slot, or replace the least recently used idle one
+  lockTake(lock);
+  int target = -1;
+  for (int i = 0; i < HANDLE_CACHE_SLOTS; i++)
+  {
+    Slot &s = slots[i];
+    if (!s.file)
+    {
+      target = i;
+      break;
+    }
+    if (!s.leased && (target < 0 || s.lastUse < slots[target].lastUse))
+    {
+      target = i;
+    }
+  }
+  if (target >= 0)
+  {
+    Slot &s = slots[target];
+    if (s.file)
+    {
+      s.file.close();
+    }
+    s.path = p;
+    s.file = lease.file;
+    s.leased = true;
+    s.stale = false;
+    s.lastUse = ++tick;
+    lease.slot = target;
+  }
+  lockGive(lock);
+  return lease;
+}
+
+void HandleCache::release(FileLease &lease)
+{
+  if (lease.slot < 0)
+  {
+    // Not cached (all slots were busy), just close it
+    if (lease.file)
+    {
+      lease.file.close();
+    }
+    lease.file = File();
+    return;
+  }
+
+  lockTake(lock);
+  Slot &s = slots[lease.slot];
+  s.leased = false;
+  if (s.stale)
+  {
+    s.file.close();
+    s.file = File();
+    s.path = "";
+    s.stale = false;
+  }
+  lockGive(lock);
+
+  lease.file = File();
+  lease.slot = -1;
+}
+
+void HandleCache::invalidate(const String &path, bool isDirectory)
+{
+  String p = normalizePath(path);
+  String prefix = p == "/" ? p : p + "/";
+
+  lockTake(lock);
+  for (int i = 0; i < HANDLE_CACHE_SLOTS; i++)
+  {
+    Slot &s = slots[i];
+    if (!s.file)
+    {
+      continue;
+    }
+    if (s.path == p || (isDirectory && s.path.startsWith(prefix)))
+    {
+      if (s.leased)
+      {
+        s.stale = true; // closed when the reader returns it
+      }
+      else
+      {
+        s.file.close();
+        s.file = File();
+        s.path = "";
+      }
+    }
+  }
+  lockGive(lock);
+}
+
+bool HandleCache::isLeased(const String &path)
+{
+  String p = normalizePath(path);
+  bool leased = false;
+
+  lockTake(lock);
+  for (int i = 0; i < HANDLE_CACHE_SLOTS; i++)
+  {
+    if (slots[i].leased && slots[i].path == p)
+    {
+      leased = true;
+      break;
+    }
+  }
+  lockGive(lock);
+  return leased;
+}
+
+void HandleCache::statsJson(JsonObject obj)
+{
+  uint32_t total = hits + misses;
+  obj["slots"] = HANDLE_CACHE_SLOTS;
+  obj["hits"] = hits;
+  obj["misses"] = misses;
+  obj["hitRatio"] = total ? (float)hits / total : 0;
+  obj["opensSaved"] = hits;
+}
+
+uint64_t fsPathKey(const String &path)
+{
+  return hashPath(normalizePath(path));
+}
+
+void fsCacheInvalidate(const String &path, bool isDirectory)
+{
+  if (isDirectory)
+  {
+    g_metaCache.invalidateBelow(path);
+  }
+  g_metaCache.invalidate(path);
+  // The parent directory may have gone from "missing" to "present"
+  g_metaCache.invalidate(path.substring(0, max(1, path.lastIndexOf('/'))));
+  g_handleCache.invalidate(path, isDirectory);
+}
@@ -0,0 +1,153 @@
+#ifndef __META_CACHE_H
+#define __META_CACHE_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+#include <time.h>
+
+// Number of cached stat entries (32 bytes each, allocated in PSRAM)
+#define META_CACHE_ENTRIES 4096
+#define META_CACHE_WAYS 4
+// Directories invalidated since the last clear(); one more clears the cache
+#define META_CACHE_DIR_INVALIDATIONS 32
+// Idle read-only handles kept open; SD_MMC allows only a few open files
+#define HANDLE_CACHE_SLOTS 2
+
+struct FsMeta
+{
+    bool exists;
+    bool isDirectory;
+    uint32_t size;
+    time_t mtime;
+    uint8_t attrs;         // FatFs AM_* attribute bits
+    uint32_t firstCluster; // 0 for an empty file or the root directory
+};
+
+// Bounded stat cache (path -> size, attributes, first cluster, mtime) in PSRAM.
+// Every FAT path lookup walks the directory clusters of each path component,
+// so repeated exists()/open() calls on the same path are served from here.
+// Entries are keyed by a 64-bit hash of the normalized path; a set-associative
+// layout with per-set LRU keeps lookups O(1) and memory fixed.
+// Writers must call fsCacheInvalidate() so the cache stays write-through.
+// Hashed keys cannot be matched by prefix, so invalidating a directory
+// records its key and tick instead: an entry filled before that tick under
+// the directory counts as a miss.
+class MetaCache
+{
+private:
+    struct Entry
+    {
+        uint64_t key;
+        uint32_t size;
+        uint32_t mtime;
+        uint32_t firstCluster;
+        uint32_t lastUse;
+        uint32_t filled; // tick at which the lookup was cached
+        uint8_t attrs;
+        uint8_t flags;
+    };
+
+    struct DirInvalidation
+    {
+        uint64_t key;
+        uint32_t tick;
+    };
+
+    fs::FS *fs;
+    Entry *entries;
+    size_t setCount;
+    uint32_t tick;
+    void *lock;
+    // Bumped by every invalidate(); a miss only caches its lookup if no
+    // invalidation happened while it ran
+    volatile uint32_t generation;
+    DirInvalidation dirs[META_CACHE_DIR_INVALIDATIONS];
+    size_t dirCount;
+
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t invalidations;
+
+    Entry *find(uint64_t key);
+    Entry *victim(uint64_t key);
+    bool invalidatedBelow(const String &path, uint32_t filled);
+    void clearLocked();
+
+public:
+    MetaCache() : fs(nullptr), entries(nullptr), setCount(0), tick(0), lock(nullptr), generation(0),
+                  dirCount(0), hits(0), misses(0), invalidations(0) {}
+
+    bool begin(fs::FS &fs, size_t capacity = META_CACHE_ENTRIES);
+
+    // Fill `out` for `path`; returns out.exists
+    bool stat(const String &path, FsMeta &out);
+    bool exists(const String &path);
+    // Ask the card, bypassing (and not filling) the cache
+    bool statUncached(const String &path, FsMeta &out);
+
+    void invalidate(const String &path);
+    // Drops every entry below `path` (not the directory itself)
+    void invalidateBelow(const String &path);
+    void clear();
+
+    void statsJson(JsonObject obj);
+};
+
+// A read-only file handle borrowed from the HandleCache
+struct FileLease
+{
+    File file;
+    int slot;
+};
+
+// Keeps recently used read-only handles open so that repeated downloads of
+// the same file skip the path lookup and open. A handle is leased to one
+// reader at a time and returned with release().
+class HandleCache
+{
+private:
+    struct Slot
+    {
+        String path;
+        File file;
+        bool leased;
+        bool stale;
+        uint32_t lastUse;
+    };
+
+    fs::FS *fs;
+    Slot slots[HANDLE_CACHE_SLOTS];
+    uint32_t tick;
+    void *lock;
+
+    uint32_t hits;
+    uint32_t misses;
+
+public:
+    HandleCache() : fs(nullptr), tick(0), lock(nullptr), hits(0), misses(0) {}
+
+    void begin(fs::FS &fs);
+
+    FileLease acquire(const String &path);
+    void release(FileLease &lease);
+
+    // Close cached handles of `path` (or everything below it if isDirectory)
+    void invalidate(const String &path, bool isDirectory);
+
+    // True while a reader holds a lease on `path`
+    bool isLeased(const String &path);
+
+    void statsJson(JsonObject obj);
+};
+
+extern MetaCache g_metaCache;
+extern HandleCache g_handleCache;
+
+// Stable 64-bit key of a path, for indexes that must not store path strings
+uint64_t fsPathKey(const String &path);
+
+// Write-through invalidation for every path a handler modifies
+void fsCacheInvalidate(const String &path, bool isDirectory = false);
+
+#endif
@@ -0,0 +1,116 @@
+#include "query_job.h"
+#include "bg_job.h"
+#include "sd_read_write.h"
+#include "sd_io_sched.h"
+#include "ff.h"
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+static BackgroundJob queryJob("query");
+
+static bool runQuery(BackgroundJob &job, QueryTask &task)
+{
+  size_t size = QUERY_BUFFER_SIZE;
+  char *buffer = (char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  if (buffer == nullptr)
+  {
+    size = 32 * 1024;
+    buffer = (char *)malloc(size);
+  }
+  FIL file;
+  if (buffer == nullptr || f_open(&file, sdFatPath(task.path).c_str(), FA_READ) != FR_OK)
+  {
+    free(buffer);
+    task.body = "{\"error\":\"cannot open file\"}";
+    return false;
+  }
+
+  uint32_t fileSize = f_size(&file);
+  int64_t start = esp_timer_get_time();
+  int64_t parseUs = 0;
+  size_t carry = 0;
+  bool ok = true;
+  while (!job.cancelled() && !task.cancelled)
+  {
+    // Fill the buffer in bounded reads so foreground requests get the card in between
+    UINT got = 0;
+    FRESULT res = FR_OK;
+    while (carry + got < size)
+    {
+      UINT want = min(size - carry - got, (size_t)SD_IO_MAX_CHUNK);
+      UINT n = 0;
+      {
+        SdIoScope io(SD_IO_BACKGROUND);
+        res = f_read(&file, buffer + carry + got, want, &n);
+      }
+      got += n;
+      if (res != FR_OK || n < want)
+      {
+        break;
+      }
+    }
+    if (res != FR_OK)
+    {
+      ok = false;
+      break;
+    }
+    size_t filled = carry + got;
+    bool eof = got < size - carry;
+
+    int64_t t = esp_timer_get_time();
+    size_t used = task.query.consume(buffer, filled, eof);
+    if (used == 0 && filled == size)
+    {
+      // A line longer than the buffer is cut into buffer-sized lines
+      used = task.query.consume(buffer, filled, true);
+    }
+    parseUs += esp_timer_get_time() - t;
+
+    job.setProgress(task.query.bytesProcessed() / 1024, fileSize / 1024);
+    if (eof || !task.query.ok())
+    {
+      break;
+    }
+    carry = filled - used;
+    memmove(buffer, buffer + used, carry);
+  }
+  f_close(&file);
+  free(buffer);
+
+  int64_t totalUs = esp_timer_get_time() - start;
+  if (!task.query.ok())
+  {
+    DynamicJsonDocument doc(256);
+    doc["error"] = task.query.lastError().c_str();
+    serializeJson(doc, task.body);
+    return false;
+  }
+
+  // The engine's result plus where the time went: card reads vs parsing
+  std::string result = task.query.resultJson();
+  result.pop_back();
+  uint64_t bytes = task.query.bytesProcessed();
+  char timing[160];
+  snprintf(timing, sizeof(timing), ",\"bytes\":%llu,\"ms\":%lld,\"mbps\":%.2f,\"parseMBps\":%.2f,\"complete\":%s}",
+           bytes, totalUs / 1000, totalUs ? bytes / (double)totalUs : 0.0,
+           parseUs ? bytes / (double)parseUs : 0.0, ok && !job.cancelled() && !task.cancelled ? "true" : "false");
+  task.body = result.c_str();
+  task.body += timing;
+  Serial.printf("Query %s: %llu bytes in %lld ms (parse %.1f MB/s)\n", task.path.c_str(), bytes,
+                totalUs / 1000, parseUs ? bytes / (double)parseUs : 0.0);
+  return ok;
+}
+
+bool startQuery(const std::shared_ptr<QueryTask> &task)
+{
+  return queryJob.start([task](BackgroundJob &job) {
+    bool ok = runQuery(job, *task);
+    task->done = true;
+    return ok;
+  });
+}
+
+void queryStatusJson(JsonObject obj)
+{
+  queryJob.statusJson(obj["job"].to<JsonObject>());
+}
@@ -0,0 +1,25 @@
+#ifndef __QUERY_JOB_H
+#define __QUERY_JOB_H
+
+#include "Arduino.h"
+#include "csv_query.h"
+#include <ArduinoJson.h>
+#include <memory>
+
+#define QUERY_BUFFER_SIZE (256 * 1024)
+
+// One /query request, run by the "query" background job
+struct QueryTask
+{
+    String path;
+    CsvQuery query;
+    volatile bool cancelled;
+    volatile bool done;
+    String body; // JSON result, valid once done
+};
+
+// Stream the CSV at task->path through the query; false if one is running
+bool startQuery(const std::shared_ptr<QueryTask> &task);
+void queryStatusJson(JsonObject obj);
+
+#endif
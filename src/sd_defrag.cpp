@@ -0,0 +1,625 @@
+#include "sd_defrag.h"
+#include "bg_job.h"
+#include "block_cache.h"
+#include "meta_cache.h"
+#include "sd_io_sched.h"
+#include "sd_read_write.h"
+#include "ff.h"
+#include <esp_heap_caps.h>
+#include "esp_timer.h"
+#include <vector>
+
+struct DefragFile
+{
+  String path;
+  uint32_t size;
+  uint32_t clusters;
+  uint32_t fragments;
+};
+
+struct DefragResult
+{
+  String path;
+  uint32_t fragmentsBefore;
+  uint32_t fragmentsAfter;
+  float readKBpsBefore;
+  float readKBpsAfter;
+  const char *error; // nullptr on success
+};
+
+// Everything needed to walk cluster chains: the mounted volume, a FIL for
+// opening files and a one-sector window over the FAT
+struct FatReader
+{
+  FATFS *fs;
+  FIL *file;
+  uint8_t *sector;
+  uint32_t loaded;
+};
+
+static BackgroundJob defragJob("defrag");
+
+static struct
+{
+  bool valid;
+  bool defragRun;
+  uint32_t files;
+  uint32_t dirs;
+  uint32_t clusters;
+  uint32_t fragments;
+  uint32_t fragmentedFiles;
+  uint32_t extraFragments; // sum of (fragments - 1)
+  uint32_t extraPossible;  // sum of (clusters - 1), the worst case
+  uint32_t totalClusters;
+  uint32_t freeClusters;
+  uint32_t clusterSize;
+  uint32_t worstCount;
+  DefragFile worst[DEFRAG_REPORT_FILES];
+  uint32_t resultCount;
+  DefragResult results[DEFRAG_REPORT_FILES];
+} report;
+
+static uint32_t sectorSize(FATFS *fs)
+{
+#if FF_MAX_SS != FF_MIN_SS
+  return fs->ssize;
+#else
+  return FF_MAX_SS;
+#endif
+}
+
+static bool readerBegin(FatReader &r)
+{
+  DWORD freeClusters;
+  r.fs = nullptr;
+  r.loaded = UINT32_MAX;
+  r.file = nullptr;
+  r.sector = nullptr;
+
+  if (f_getfree(sdFatPath("").c_str(), &freeClusters, &r.fs) != FR_OK || r.fs == nullptr)
+  {
+    Serial.println("Defrag: SD volume not mounted");
+    return false;
+  }
+  if (r.fs->fs_type == FS_FAT12 || sectorSize(r.fs) != BLOCK_CACHE_SECTOR_SIZE)
+  {
+    Serial.println("Defrag: unsupported volume layout");
+    return false;
+  }
+
+  r.file = (FIL *)malloc(sizeof(FIL));
+  r.sector = (uint8_t *)heap_caps_malloc(BLOCK_CACHE_SECTOR_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  if (!r.file || !r.sector)
+  {
+    free(r.file);
+    free(r.sector);
+    r.file = nullptr;
+    r.sector = nullptr;
+    return false;
+  }
+  return true;
+}
+
+static void readerEnd(FatReader &r)
+{
+  free(r.file);
+  free(r.sector);
+  r.file = nullptr;
+  r.sector = nullptr;
+}
+
+// The FatFs volume lock. FatFs keeps one FAT sector in its window and may
+// not have written it back yet, so FAT sectors are only read while holding
+// it, from the window when it holds the one wanted.
+static bool volumeLock(FATFS *fs)
+{
+#if FF_FS_REENTRANT && FF_DEFINED >= 80286 && FF_DEFINED < 86000
+  return ff_mutex_take(fs->ldrv); // R0.15: per-volume mutexes
+#elif FF_FS_REENTRANT
+  return ff_req_grant(fs->sobj);
+#else
+  return true;
+#endif
+}
+
+static void volumeUnlock(FATFS *fs)
+{
+#if FF_FS_REENTRANT && FF_DEFINED >= 80286 && FF_DEFINED < 86000
+  ff_mutex_give(fs->ldrv);
+#elif FF_FS_REENTRANT
+  ff_rel_grant(fs->sobj);
+#endif
+}
+
+// Next cluster of the chain, read from the FAT through the block cache
+static bool nextCluster(FatReader &r, uint32_t cluster, uint32_t &next)
+{
+  uint32_t entrySize = r.fs->fs_type == FS_FAT16 ? 2 : 4;
+  uint32_t offset = cluster * entrySize;
+  uint32_t sector = r.fs->fatbase + offset / BLOCK_CACHE_SECTOR_SIZE;
+  if (sector != r.loaded)
+  {
+    if (!volumeLock(r.fs))
+    {
+      r.loaded = UINT32_MAX;
+      return false;
+    }
+    bool ok = true;
+    if (r.fs->winsect == sector)
+    {
+      memcpy(r.sector, r.fs->win, BLOCK_CACHE_SECTOR_SIZE);
+    }
+    else
+    {
+      ok = blockCacheReadSectors(SD_FATFS_PDRV, r.sector, sector, 1);
+    }
+    volumeUnlock(r.fs);
+    if (!ok)
+    {
+      r.loaded = UINT32_MAX;
+      return false;
+    }
+    r.loaded = sector;
+  }
+
+  const uint8_t *p = r.sector + offset % BLOCK_CACHE_SECTOR_SIZE;
+  if (entrySize == 2)
+  {
+    next = p[0] | (p[1] << 8);
+  }
+  else
+  {
+    next = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    if (r.fs->fs_type == FS_FAT32)
+    {
+      next &= 0x0FFFFFFF;
+    }
+  }
+  return true;
+}
+
+static bool chainExtents(FatReader &r, const String &path, uint32_t &clusters, uint32_t &fragments)
+{
+  clusters = 0;
+  fragments = 0;
+  if (f_open(r.file, sdFatPath(path).c_str(), FA_READ) != FR_OK)
+  {
+    return false;
+  }
+  uint32_t start = r.file->obj.sclust;
+  FSIZE_t size = f_size(r.file);
+  uint8_t stat = r.file->obj.stat;
+  f_close(r.file);
+
+  if (start < 2)
+  {
+    return true; // Empty file, no clusters
+  }
+  r.loaded = UINT32_MAX; // the FAT may have changed since the last walk
+
+#if FF_FS_EXFAT
+  if (r.fs->fs_type == FS_EXFAT && (stat & 2))
+  {
+    // exFAT "no FAT chain" flag: the file is one contiguous run
+    uint32_t bytesPerCluster = (uint32_t)r.fs->csize * BLOCK_CACHE_SECTOR_SIZE;
+    clusters = (size + bytesPerCluster - 1) / bytesPerCluster;
+    fragments = 1;
+    return true;
+  }
+#else
+  (void)size;
+  (void)stat;
+#endif
+
+  // Anything outside [2, n_fatent) ends the chain: EOC marks, bad or free entries
+  uint32_t prev = 0;
+  uint32_t cluster = start;
+  while (cluster >= 2 && cluster < r.fs->n_fatent && clusters < r.fs->n_fatent)
+  {
+    clusters++;
+    if (cluster != prev + 1)
+    {
+      fragments++;
+    }
+    prev = cluster;
+    if (!nextCluster(r, cluster, cluster))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool fatFileExtents(const char *path, uint32_t &clusters, uint32_t &fragments)
+{
+  FatReader r;
+  if (!readerBegin(r))
+  {
+    return false;
+  }
+  bool ok = chainExtents(r, path, clusters, fragments);
+  readerEnd(r);
+  return ok;
+}
+
+// Keep the report sorted by fragment count, worst first
+static void rememberFile(const String &path, uint32_t size, uint32_t clusters, uint32_t fragments)
+{
+  if (fragments < 2)
+  {
+    return;
+  }
+  uint32_t pos = report.worstCount;
+  if (pos == DEFRAG_REPORT_FILES)
+  {
+    if (fragments <= report.worst[pos - 1].fragments)
+    {
+      return;
+    }
+    pos--;
+  }
+  else
+  {
+    report.worstCount++;
+  }
+  while (pos > 0 && report.worst[pos - 1].fragments < fragments)
+  {
+    report.worst[pos] = report.worst[pos - 1];
+    pos--;
+  }
+  report.worst[pos] = {path, size, clusters, fragments};
+}
+
+static bool analyze(BackgroundJob &job, FatReader &r)
+{
+  report.valid = false;
+  report.files = report.dirs = 0;
+  report.clusters = report.fragments = report.fragmentedFiles = 0;
+  report.extraFragments = report.extraPossible = 0;
+  report.worstCount = 0;
+  report.totalClusters = r.fs->n_fatent - 2;
+  report.freeClusters = r.fs->free_clst;
+  report.clusterSize = (uint32_t)r.fs->csize * BLOCK_CACHE_SECTOR_SIZE;
+  job.setMessage("analyzing");
+
+  std::vector<String> pending;
+  pending.push_back("/");
+  FILINFO info;
+  DIR dir;
+
+  while (!pending.empty() && !job.cancelled())
+  {
+    String dirPath = pending.back();
+    pending.pop_back();
+    if (f_opendir(&dir, sdFatPath(dirPath).c_str()) != FR_OK)
+    {
+      continue;
+    }
+    report.dirs++;
+
+    while (!job.cancelled() && f_readdir(&dir, &info) == FR_OK && info.fname[0])
+    {
+      if (info.fattrib & AM_SYS)
+      {
+        continue; // "System Volume Information" and similar
+      }
+      String path = dirPath == "/" ? "/" + String(info.fname) : dirPath + "/" + info.fname;
+      if (info.fattrib & AM_DIR)
+      {
+        pending.push_back(path);
+        continue;
+      }
+
+      uint32_t clusters, fragments;
+      if (!chainExtents(r, path, clusters, fragments))
+      {
+        continue;
+      }
+      report.files++;
+      report.clusters += clusters;
+      report.fragments += fragments;
+      if (clusters > 1)
+      {
+        report.extraFragments += fragments - 1;
+        report.extraPossible += clusters - 1;
+      }
+      if (fragments > 1)
+      {
+        report.fragmentedFiles++;
+      }
+      rememberFile(path, (uint32_t)info.fsize, clusters, fragments);
+      job.setProgress(report.files, 0);
+    }
+    f_closedir(&dir);
+  }
+
+  report.valid = !job.cancelled();
+  Serial.printf("Defrag analysis: %u files, %u fragmented, %u extra fragments\n",
+                report.files, report.fragmentedFiles, report.extraFragments);
+  return report.valid;
+}
+
+static float readKBps(const String &path, FIL *file, uint8_t *buffer)
+{
+  if (f_open(file, sdFatPath(path).c_str(), FA_READ) != FR_OK)
+  {
+    return 0;
+  }
+  uint32_t total = 0;
+  UINT bytesRead;
+  int64_t start = esp_timer_get_time();
+  while (total < DEFRAG_MEASURE_BYTES &&
+         f_read(file, buffer, DEFRAG_STAGING_SIZE, &bytesRead) == FR_OK && bytesRead > 0)
+  {
+    total += bytesRead;
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  f_close(file);
+  return elapsed > 0 ? (total / 1024.0f) / (elapsed / 1000000.0f) : 0;
+}
+
+// Copy `path` into a new file whose clusters are allocated in one run, then
+// swap it into place. Returns an error string or nullptr.
+static const char *rewriteFile(BackgroundJob &job, FatReader &r, const String &path,
+                               FIL *dst, uint8_t *staging, DefragResult &result)
+{
+  // Files held open by a writer would keep writing to the old clusters
+  if (g_handleCache.isLeased(path) || openWriterActive(path))
+  {
+    return "in use";
+  }
+
+  FILINFO before;
+  if (f_stat(sdFatPath(path).c_str(), &before) != FR_OK)
+  {
+    return "not found";
+  }
+  result.readKBpsBefore = readKBps(path, r.file, staging);
+
+  String tmpPath = path + ".defrag";
+  if (f_open(r.file, sdFatPath(path).c_str(), FA_READ) != FR_OK)
+  {
+    return "open failed";
+  }
+  if (f_open(dst, sdFatPath(tmpPath).c_str(), FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+  {
+    f_close(r.file);
+    return "create failed";
+  }
+
+  const char *error = nullptr;
+#if FF_USE_EXPAND
+  // Allocate the whole chain contiguously up front; fails if no free run is
+  // large enough, in which case rewriting would not help
+  if (before.fsize > 0 && f_expand(dst, before.fsize, 1) != FR_OK)
+  {
+    error = "no contiguous free space";
+  }
+#else
+  // Without f_expand, extending the file still asks FatFs for the clusters in
+  // one go, which usually yields a single run on a defragmented free space
+  if (before.fsize > 0 && (f_lseek(dst, before.fsize) != FR_OK || f_lseek(dst, 0) != FR_OK))
+  {
+    error = "allocation failed";
+  }
+#endif
+
+  UINT bytesRead, bytesWritten;
+  FSIZE_t copied = 0;
+  while (!error && copied < before.fsize)
+  {
+    if (job.cancelled())
+    {
+      error = "cancelled";
+      break;
+    }
+    SdIoScope io(SD_IO_BACKGROUND);
+    if (f_read(r.file, staging, DEFRAG_STAGING_SIZE, &bytesRead) != FR_OK || bytesRead == 0)
+    {
+      error = "read failed";
+      break;
+    }
+    if (f_write(dst, staging, bytesRead, &bytesWritten) != FR_OK || bytesWritten != bytesRead)
+    {
+      error = "write failed";
+      break;
+    }
+    copied += bytesRead;
+  }
+  f_close(r.file);
+  f_close(dst);
+
+  uint32_t clusters;
+  if (!error && (!chainExtents(r, tmpPath, clusters, result.fragmentsAfter) ||
+                 result.fragmentsAfter >= result.fragmentsBefore))
+  {
+    error = "no improvement";
+  }
+
+#if FF_USE_CHMOD
+  if (!error)
+  {
+    f_utime(sdFatPath(tmpPath).c_str(), &before);
+  }
+#endif
+
+  {
+    // Re-check right before the swap, holding the writer registry so nobody
+    // can open the file between the check and the renames
+    OpenWriterLock writers;
+    FILINFO after;
+    if (!error && (openWriterActive(path) || g_handleCache.isLeased(path)))
+    {
+      error = "in use";
+    }
+    if (!error && (f_stat(sdFatPath(path).c_str(), &after) != FR_OK ||
+                   after.fsize != before.fsize || after.fdate != before.fdate ||
+                   after.ftime != before.ftime))
+    {
+      error = "modified during copy";
+    }
+    if (error)
+    {
+      f_unlink(sdFatPath(tmpPath).c_str());
+      return error;
+    }
+
+    // Swap: the original is only removed once the copy is in place
+    String oldPath = path + ".defrag-old";
+    fsCacheInvalidate(path);
+    if (f_rename(sdFatPath(path).c_str(), sdFatPath(oldPath).c_str()) != FR_OK)
+    {
+      f_unlink(sdFatPath(tmpPath).c_str());
+      return "rename failed";
+    }
+    if (f_rename(sdFatPath(tmpPath).c_str(), sdFatPath(path).c_str()) != FR_OK)
+    {
+      f_rename(sdFatPath(oldPath).c_str(), sdFatPath(path).c_str());
+      f_unlink(sdFatPath(tmpPath).c_str());
+      return "rename failed";
+    }
+    f_unlink(sdFatPath(oldPath).c_str());
+    fsCacheInvalidate(path);
+  }
+
+  result.readKBpsAfter = readKBps(path, r.file, staging);
+  return nullptr;
+}
+
+static bool defragment(BackgroundJob &job, FatReader &r, uint32_t maxFiles)
+{
+  uint8_t *staging = (uint8_t *)heap_caps_malloc(DEFRAG_STAGING_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  if (!staging)
+  {
+    staging = (uint8_t *)heap_caps_malloc(DEFRAG_STAGING_SIZE, MALLOC_CAP_SPIRAM);
+  }
+  FIL *dst = (FIL *)malloc(sizeof(FIL));
+  if (!staging || !dst)
+  {
+    free(staging);
+    free(dst);
+    job.setMessage("out of memory");
+    return false;
+  }
+
+  uint32_t count = min(maxFiles, report.worstCount);
+  report.defragRun = true;
+  for (uint32_t i = 0; i < count && !job.cancelled(); i++)
+  {
+    const DefragFile &file = report.worst[i];
+    DefragResult &result = report.results[report.resultCount];
+    result = {file.path, file.fragments, file.fragments, 0, 0, nullptr};
+    job.setMessage("rewriting " + file.path);
+    job.setProgress(i, count);
+
+    result.error = rewriteFile(job, r, file.path, dst, staging, result);
+    report.resultCount++;
+    if (result.error)
+    {
+      Serial.printf("Defrag %s: %s\n", file.path.c_str(), result.error);
+    }
+    else
+    {
+      Serial.printf("Defrag %s: %u -> %u fragments, %.2f -> %.2f KB/s\n", file.path.c_str(),
+                    result.fragmentsBefore, result.fragmentsAfter,
+                    result.readKBpsBefore, result.readKBpsAfter);
+    }
+    job.setProgress(i + 1, count);
+  }
+
+  free(staging);
+  free(dst);
+  return true;
+}
+
+static bool startJob(bool rewrite, uint32_t maxFiles)
+{
+  if (defragJob.running())
+  {
+    return false;
+  }
+  report.defragRun = false;
+  report.resultCount = 0;
+  maxFiles = constrain(maxFiles, (uint32_t)1, (uint32_t)DEFRAG_REPORT_FILES);
+
+  return defragJob.start([rewrite, maxFiles](BackgroundJob &job)
+                         {
+    FatReader r;
+    if (!readerBegin(r))
+    {
+      job.setMessage("SD volume not available");
+      return false;
+    }
+    bool ok = analyze(job, r);
+    if (ok && rewrite)
+    {
+      ok = defragment(job, r, maxFiles);
+    }
+    readerEnd(r);
+    return ok; });
+}
+
+bool startFragmentationAnalysis()
+{
+  return startJob(false, 0);
+}
+
+bool startDefragmentation(uint32_t maxFiles)
+{
+  return startJob(true, maxFiles);
+}
+
+void cancelDefragJob()
+{
+  defragJob.cancel();
+}
+
+void defragStatusJson(JsonObject obj)
+{
+  defragJob.statusJson(obj["job"].to<JsonObject>());
+  if (defragJob.running() || !report.valid)
+  {
+    return;
+  }
+
+  JsonObject volume = obj["volume"].to<JsonObject>();
+  volume["clusterSize"] = report.clusterSize;
+  volume["totalClusters"] = report.totalClusters;
+  volume["freeClusters"] = report.freeClusters;
+  volume["files"] = report.files;
+  volume["dirs"] = report.dirs;
+  volume["clusters"] = report.clusters;
+  volume["fragments"] = report.fragments;
+  volume["fragmentedFiles"] = report.fragmentedFiles;
+  // 0 = every file in one run, 100 = every cluster in its own run
+  volume["fragmentation"] = report.extraPossible ? 100.0f * report.extraFragments / report.extraPossible : 0;
+
+  JsonArray worst = obj["worst"].to<JsonArray>();
+  for (uint32_t i = 0; i < report.worstCount; i++)
+  {
+    JsonObject file = worst.add<JsonObject>();
+    file["path"] = report.worst[i].path;
+    file["size"] = report.worst[i].size;
+    file["clusters"] = report.worst[i].clusters;
+    file["fragments"] = report.worst[i].fragments;
+  }
+
+  if (report.defragRun)
+  {
+    JsonArray results = obj["defragmented"].to<JsonArray>();
+    for (uint32_t i = 0; i < report.resultCount; i++)
+    {
+      const DefragResult &r = report.results[i];
+      JsonObject file = results.add<JsonObject>();
+      file["path"] = r.path;
+      file["fragmentsBefore"] = r.fragmentsBefore;
+      file["fragmentsAfter"] = r.fragmentsAfter;
+      file["readKBpsBefore"] = r.readKBpsBefore;
+      file["readKBpsAfter"] = r.readKBpsAfter;
+      if (r.error)
+      {
+        file["error"] = r.error;
+      }
+    }
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef __SD_DEFRAG_H
+#define __SD_DEFRAG_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+
+// Most fragmented files kept in the analysis report
+#define DEFRAG_REPORT_FILES 32
+// Files rewritten by one defragmentation run unless the caller asks otherwise
+#define DEFRAG_DEFAULT_FILES 8
+// Staging buffer used to copy file data (internal DMA memory if available)
+#define DEFRAG_STAGING_SIZE (32 * 1024)
+// Bytes read from a file to measure its read throughput
+#define DEFRAG_MEASURE_BYTES (1024 * 1024)
+
+// Cluster chain statistics of one file. `fragments` is the number of
+// contiguous runs; a file stored in one piece has exactly one.
+bool fatFileExtents(const char *path, uint32_t &clusters, uint32_t &fragments);
+
+// Walk the whole card and score how fragmented it is. Runs as a background
+// job; returns false if a defrag job is already running.
+bool startFragmentationAnalysis();
+
+// Analyze, then rewrite up to `maxFiles` of the most fragmented files into
+// contiguous clusters and swap them into place.
+bool startDefragmentation(uint32_t maxFiles = DEFRAG_DEFAULT_FILES);
+
+void cancelDefragJob();
+void defragStatusJson(JsonObject obj);
+
+#endif
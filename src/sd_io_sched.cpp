@@ -0,0 +1,362 @@
+#include "sd_io_sched.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define WAIT_BUCKETS 16 // bucket b counts waits below 128 us << b
+
+static const char *const className[SD_IO_CLASSES] = {"interactive", "small", "bulk", "background"};
+static const uint32_t deadlineMs[SD_IO_CLASSES] = SD_IO_DEADLINES_MS;
+
+struct Waiter
+{
+  bool used;
+  bool granted;
+  uint8_t cls;
+  TaskHandle_t task;
+  SemaphoreHandle_t wake;
+  uint32_t seq;      // FIFO order within a class
+  uint32_t deadline; // micros()
+};
+
+struct ClassStats
+{
+  uint32_t depth;
+  uint32_t maxDepth;
+  uint32_t grants;
+  uint32_t deadlineGrants; // granted ahead of a more urgent class
+  uint32_t timeouts;
+  uint32_t overflows; // no waiter slot free
+  uint32_t networkRuns; // network task went ahead without queuing
+  uint64_t waitUs;
+  uint32_t maxWaitUs;
+  uint64_t busyUs;
+  uint32_t buckets[WAIT_BUCKETS];
+};
+
+static SemaphoreHandle_t stateLock = nullptr;
+static Waiter waiters[SD_IO_MAX_WAITERS];
+static ClassStats stats[SD_IO_CLASSES];
+static TaskHandle_t owner = nullptr;
+static uint32_t depth = 0;
+static uint8_t ownerClass = 0;
+static uint32_t ownerSince = 0;
+static uint32_t waiting = 0;
+static uint32_t nextSeq = 0;
+
+void sdIoBegin()
+{
+  if (stateLock != nullptr)
+  {
+    return;
+  }
+  for (Waiter &w : waiters)
+  {
+    w.wake = xSemaphoreCreateBinary();
+    w.used = false;
+  }
+  stateLock = xSemaphoreCreateMutex();
+}
+
+static void recordWait(ClassStats &s, uint32_t us)
+{
+  s.grants++;
+  s.waitUs += us;
+  s.maxWaitUs = max(s.maxWaitUs, us);
+  uint8_t b = 0;
+  while (b < WAIT_BUCKETS - 1 && (us >> (b + 7)) != 0)
+  {
+    b++;
+  }
+  s.buckets[b]++;
+}
+
+static void grantLocked(TaskHandle_t task, uint8_t cls)
+{
+  owner = task;
+  depth = 1;
+  ownerClass = cls;
+  ownerSince = micros();
+}
+
+// Hands the card to the next waiter; called with stateLock held and no owner
+static void dispatchLocked()
+{
+  uint32_t now = micros();
+  Waiter *best = nullptr;
+  bool bestLate = false;
+  for (Waiter &w : waiters)
+  {
+    if (!w.used || w.granted)
+    {
+      continue;
+    }
+    bool late = (int32_t)(now - w.deadline) >= 0;
+    bool better;
+    if (best == nullptr)
+    {
+      better = true;
+    }
+    else if (late != bestLate)
+    {
+      better = late;
+    }
+    else if (late)
+    {
+      better = (int32_t)(w.deadline - best->deadline) < 0;
+    }
+    else
+    {
+      better = w.cls < best->cls || (w.cls == best->cls && (int32_t)(w.seq - best->seq) < 0);
+    }
+    if (better)
+    {
+      best = &w;
+      bestLate = late;
+    }
+  }
+  if (best == nullptr)
+  {
+    return;
+  }
+
+  // A late waiter that jumped a more urgent one shows up as a deadline grant
+  for (Waiter &w : waiters)
+  {
+    if (bestLate && w.used && !w.granted && w.cls < best->cls)
+    {
+      stats[best->cls].deadlineGrants++;
+      break;
+    }
+  }
+  best->granted = true;
+  waiting--;
+  stats[best->cls].depth--;
+  grantLocked(best->task, best->cls);
+  xSemaphoreGive(best->wake);
+}
+
+bool sdIoAcquire(SdIoClass cls)
+{
+  if (stateLock == nullptr)
+  {
+    return false;
+  }
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  uint32_t start = micros();
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+  if (strcmp(pcTaskGetName(self), SD_IO_NETWORK_TASK) == 0)
+  {
+    // Never park the network task: it waits at most for the FatFs call in
+    // progress, and the web paths that move data do their card work on the
+    // async I/O workers anyway
+    stats[cls].networkRuns++;
+    xSemaphoreGive(stateLock);
+    return false;
+  }
+  if (owner == self)
+  {
+    depth++;
+    xSemaphoreGive(stateLock);
+    return true;
+  }
+
+  ClassStats &s = stats[cls];
+  if (owner == nullptr && waiting == 0)
+  {
+    grantLocked(self, cls);
+    recordWait(s, 0);
+    xSemaphoreGive(stateLock);
+    return true;
+  }
+
+  Waiter *w = nullptr;
+  for (Waiter &candidate : waiters)
+  {
+    if (!candidate.used)
+    {
+      w = &candidate;
+      break;
+    }
+  }
+  if (w == nullptr)
+  {
+    s.overflows++;
+    xSemaphoreGive(stateLock);
+    return false;
+  }
+  w->used = true;
+  w->granted = false;
+  w->cls = cls;
+  w->task = self;
+  w->seq = nextSeq++;
+  w->deadline = start + deadlineMs[cls] * 1000;
+  waiting++;
+  s.depth++;
+  s.maxDepth = max(s.maxDepth, s.depth);
+  xSemaphoreGive(stateLock);
+
+  bool woken = xSemaphoreTake(w->wake, pdMS_TO_TICKS(SD_IO_MAX_WAIT_MS)) == pdTRUE;
+
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+  if (!woken && w->granted)
+  {
+    // Granted just as the wait timed out
+    xSemaphoreTake(w->wake, 0);
+    woken = true;
+  }
+  if (!woken)
+  {
+    waiting--;
+    s.depth--;
+    s.timeouts++;
+  }
+  else
+  {
+    recordWait(s, micros() - start);
+  }
+  w->used = false;
+  xSemaphoreGive(stateLock);
+  return woken;
+}
+
+void sdIoRelease(bool granted)
+{
+  if (!granted)
+  {
+    return;
+  }
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+  if (--depth == 0)
+  {
+    stats[ownerClass].busyUs += micros() - ownerSince;
+    owner = nullptr;
+    dispatchLocked();
+  }
+  xSemaphoreGive(stateLock);
+}
+
+void sdIoYield(SdIoClass cls)
+{
+  // Unlocked peek: a stale answer only skips or adds one yield
+  if (stateLock == nullptr || (owner == nullptr && waiting == 0) || owner == xTaskGetCurrentTaskHandle())
+  {
+    return;
+  }
+  sdIoRelease(sdIoAcquire(cls));
+}
+
+size_t sdIoRead(File &file, uint8_t *buffer, size_t len, SdIoClass cls)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    size_t want = min(len - total, (size_t)SD_IO_MAX_CHUNK);
+    size_t n;
+    {
+      SdIoScope io(cls);
+      n = file.read(buffer + total, want);
+    }
+    total += n;
+    if (n < want)
+    {
+      break;
+    }
+  }
+  return total;
+}
+
+size_t sdIoWrite(File &file, const uint8_t *buffer, size_t len, SdIoClass cls)
+{
+  size_t total = 0;
+  while (total < len)
+  {
+    size_t want = min(len - total, (size_t)SD_IO_MAX_CHUNK);
+    size_t n;
+    {
+      SdIoScope io(cls);
+      n = file.write(buffer + total, want);
+    }
+    total += n;
+    if (n < want)
+    {
+      break;
+    }
+  }
+  return total;
+}
+
+// Upper bound of the bucket holding the pct-th percentile, in ms
+static float percentileMs(const ClassStats &s, uint32_t pct)
+{
+  if (s.grants == 0)
+  {
+    return 0;
+  }
+  uint64_t target = ((uint64_t)s.grants * pct + 99) / 100;
+  uint64_t seen = 0;
+  for (uint8_t b = 0; b < WAIT_BUCKETS; b++)
+  {
+    seen += s.buckets[b];
+    if (seen >= target)
+    {
+      return b == WAIT_BUCKETS - 1 ? s.maxWaitUs / 1000.0f : min((128u << b) / 1000.0f, s.maxWaitUs / 1000.0f);
+    }
+  }
+  return s.maxWaitUs / 1000.0f;
+}
+
+void sdIoStatsJson(JsonObject obj)
+{
+  obj["enabled"] = stateLock != nullptr;
+  obj["maxChunk"] = SD_IO_MAX_CHUNK;
+  if (stateLock == nullptr)
+  {
+    return;
+  }
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+  ClassStats copy[SD_IO_CLASSES];
+  memcpy(copy, stats, sizeof(copy));
+  bool held = owner != nullptr;
+  uint8_t heldBy = ownerClass;
+  uint32_t queued = waiting;
+  xSemaphoreGive(stateLock);
+
+  obj["holder"] = held ? className[heldBy] : "";
+  obj["waiting"] = queued;
+  JsonObject classes = obj["classes"].to<JsonObject>();
+  for (uint8_t c = 0; c < SD_IO_CLASSES; c++)
+  {
+    const ClassStats &s = copy[c];
+    JsonObject o = classes[className[c]].to<JsonObject>();
+    o["deadlineMs"] = deadlineMs[c];
+    o["depth"] = s.depth;
+    o["maxDepth"] = s.maxDepth;
+    o["grants"] = s.grants;
+    o["deadlineGrants"] = s.deadlineGrants;
+    o["timeouts"] = s.timeouts;
+    o["overflows"] = s.overflows;
+    o["networkRuns"] = s.networkRuns;
+    o["avgWaitMs"] = s.grants ? s.waitUs / 1000.0f / s.grants : 0;
+    o["p99WaitMs"] = percentileMs(s, 99);
+    o["maxWaitMs"] = s.maxWaitUs / 1000.0f;
+    o["busyMs"] = (uint32_t)(s.busyUs / 1000);
+  }
+}
+
+void sdIoResetStats()
+{
+  if (stateLock == nullptr)
+  {
+    return;
+  }
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+  for (ClassStats &s : stats)
+  {
+    uint32_t depthNow = s.depth;
+    memset(&s, 0, sizeof(s));
+    s.depth = depthNow;
+    s.maxDepth = depthNow;
+  }
+  xSemaphoreGive(stateLock);
+}
@@ -0,0 +1,73 @@
+#ifndef __SD_IO_SCHED_H
+#define __SD_IO_SCHED_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+
+// Priority classes for card access, most urgent first
+enum SdIoClass
+{
+    SD_IO_INTERACTIVE, // listings and metadata changes the UI is waiting on
+    SD_IO_SMALL,       // reads of small files: previews, thumbnails, short downloads
+    SD_IO_BULK,        // large downloads and uploads, WebDAV, the bulk port
+    SD_IO_BACKGROUND,  // jobs: indexing, scrubbing, grep, defrag, append logs
+    SD_IO_CLASSES
+};
+
+#define SD_IO_MAX_CHUNK (32 * 1024)   // Largest read/write issued under one grant
+#define SD_IO_SMALL_FILE (256 * 1024) // Downloads up to this size are SD_IO_SMALL
+#define SD_IO_MAX_WAITERS 16
+// A waiter still queued after this long goes ahead without a grant, so a
+// missed release can only slow the card down, never hang it
+#define SD_IO_MAX_WAIT_MS 5000
+// Per class: once a waiter has queued this long it is served before any
+// waiter whose deadline has not passed, so lower classes are never starved
+#define SD_IO_DEADLINES_MS {20, 50, 500, 2000}
+// Task that serves every web request (AsyncTCP). It never queues for a grant:
+// one wait there stalls all connections, so its card access goes ahead and
+// only contends with the FatFs volume lock
+#define SD_IO_NETWORK_TASK "async_tcp"
+
+// Arbitration of SD card access between tasks.
+// FatFs serializes calls on the volume but lets whichever task asks first
+// have the card, so a /list issued during a large transfer queues behind all
+// of its reads. Instead, each bounded piece of card work is wrapped in an
+// SdIoScope of its class. While the card is held, other scopes queue per
+// class, and releasing the card hands it straight to the next waiter: the
+// one with the earliest passed deadline, otherwise the oldest waiter of the
+// most urgent class. Scopes nest within a task.
+//
+// Keep scopes tight around file system calls: never open one while holding
+// a lock a grant holder may also need (caches, indexes, du), and never wait
+// on another task inside one.
+void sdIoBegin();
+bool sdIoAcquire(SdIoClass cls); // false: proceed without a grant
+void sdIoRelease(bool granted);
+
+class SdIoScope
+{
+private:
+    bool granted;
+
+public:
+    SdIoScope(SdIoClass cls) : granted(sdIoAcquire(cls)) {}
+    ~SdIoScope() { sdIoRelease(granted); }
+};
+
+// Waits for a turn and gives it back at once; checkpoint for loops whose
+// card access is not wrapped (BackgroundJob::setProgress calls it)
+void sdIoYield(SdIoClass cls);
+
+// Read/write split into SD_IO_MAX_CHUNK pieces, each under its own grant
+size_t sdIoRead(File &file, uint8_t *buffer, size_t len, SdIoClass cls);
+size_t sdIoWrite(File &file, const uint8_t *buffer, size_t len, SdIoClass cls);
+
+// Class for reading a whole file of this size
+inline SdIoClass sdIoReadClass(size_t fileSize) { return fileSize <= SD_IO_SMALL_FILE ? SD_IO_SMALL : SD_IO_BULK; }
+
+// Per class: queue depth, grants, wait times (avg/max/p99) and card time
+void sdIoStatsJson(JsonObject obj);
+void sdIoResetStats();
+
+#endif
@@ -1,5 +1,19 @@
 #include "sd_read_write.h"
 #include "esp_task_wdt.h"
+#include "meta_cache.h"
+#include "checksum.h"
+#include "bg_job.h"
+#include "block_cache.h"
+#include "du_tree.h"
+#include "fs_events.h"
+#include "sd_io_sched.h"
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <unistd.h>
+#include <mutex>
+#include <vector>
 
 // Global PSRAM buffer for file operations
 PSRAMBuffer g_psramBuffer;
@@ -43,13 +57,57 @@ void listDir(fs::FS &fs, const char *dirname, uint8_t levels)
   }
 }
 
+// Cache entries are dropped before a change (cached handles must not be
+// open across it) and again after it: a stat or lease taken while the change
+// was in progress may have cached the old state.
 bool removeDir(fs::FS &fs, const char *path)
 {
-  return fs.rmdir(path); // rmdir 返回 bool
+  fsCacheInvalidate(path, true);
+  bool ok = fs.rmdir(path); // rmdir 返回 bool
+  fsCacheInvalidate(path, true);
+  return ok;
 }
+
+bool removeTree(fs::FS &fs, const char *path)
+{
+  fsCacheInvalidate(path, true);
+  std::vector<String> dirs;
+  dirs.push_back(path);
+  bool ok = true;
+  for (size_t i = 0; i < dirs.size(); i++)
+  {
+    std::vector<String> files;
+    File dir = fs.open(dirs[i]);
+    File entry;
+    while (dir && (entry = dir.openNextFile()))
+    {
+      if (entry.isDirectory())
+        dirs.push_back(entry.path());
+      else
+        files.push_back(entry.path());
+      entry.close();
+    }
+    dir.close();
+    for (const String &file : files)
+    {
+      ok = fs.remove(file) && ok;
+    }
+  }
+  // Deepest directories last in the list, so they go first
+  for (size_t i = dirs.size(); i-- > 0;)
+  {
+    ok = fs.rmdir(dirs[i]) && ok;
+  }
+  fsCacheInvalidate(path, true);
+  return ok;
+}
+
 bool createDir(fs::FS &fs, const char *path)
 {
-  return fs.mkdir(path); // mkdir 返回 bool
+  fsCacheInvalidate(path);
+  bool ok = fs.mkdir(path); // mkdir 返回 bool
+  fsCacheInvalidate(path);
+  return ok;
 }
 
 void readFile(fs::FS &fs, const char *path)
@@ -73,6 +131,7 @@ void readFile(fs::FS &fs, const char *path)
 void writeFile(fs::FS &fs, const char *path, const char *message)
 {
   Serial.printf("Writing file: %s\n", path);
+  fsCacheInvalidate(path);
 
   File file = fs.open(path, FILE_WRITE);
   if (!file)
@@ -88,11 +147,14 @@ void writeFile(fs::FS &fs, const char *path, const char *message)
   {
     Serial.println("Write failed");
   }
+  file.close();
+  fsCacheInvalidate(path);
 }
 
 void appendFile(fs::FS &fs, const char *path, const char *message)
 {
   Serial.printf("Appending to file: %s\n", path);
+  fsCacheInvalidate(path);
 
   File file = fs.open(path, FILE_APPEND);
   if (!file)
@@ -108,11 +170,15 @@ void appendFile(fs::FS &fs, const char *path, const char *message)
   {
     Serial.println("Append failed");
   }
+  file.close();
+  fsCacheInvalidate(path);
 }
 
 void renameFile(fs::FS &fs, const char *path1, const char *path2)
 {
   Serial.printf("Renaming file %s to %s\n", path1, path2);
+  fsCacheInvalidate(path1);
+  fsCacheInvalidate(path2);
   if (fs.rename(path1, path2))
   {
     Serial.println("File renamed");
@@ -121,11 +187,14 @@ void renameFile(fs::FS &fs, const char *path1, const char *path2)
   {
     Serial.println("Rename failed");
   }
+  fsCacheInvalidate(path1);
+  fsCacheInvalidate(path2);
 }
 
 void deleteFile(fs::FS &fs, const char *path)
 {
   Serial.printf("Deleting file: %s\n", path);
+  fsCacheInvalidate(path);
   if (fs.remove(path))
   {
     Serial.println("File deleted");
@@ -134,6 +203,246 @@ void deleteFile(fs::FS &fs, const char *path)
   {
     Serial.println("Delete failed");
   }
+  fsCacheInvalidate(path);
+}
+
+// Reserve `size` bytes for a file that is open for writing. Seeking past the
+// end in write mode makes FatFs allocate the whole cluster chain at once,
+// contiguously when the free space allows, instead of extending it one
+// cluster per write. The position is back at 0 on return; the caller must
+// truncateFile() if it ends up writing less.
+bool preallocateFile(File &file, size_t size)
+{
+  if (!file || size == 0)
+  {
+    return false;
+  }
+
+  // Back to where the caller was, so what is already written (a crypt
+  // header, say) is kept and the next write follows it
+  size_t position = file.position();
+  bool ok = file.seek(size) && file.position() == size;
+  file.seek(position);
+  if (!ok)
+  {
+    Serial.println("Preallocation failed, file will grow on demand");
+  }
+  return ok;
+}
+
+// Shrink (or extend) a closed file on the SD card
+bool truncateFile(const char *path, size_t size)
+{
+  String fullPath = String(SD_MOUNT_POINT) + path;
+  if (truncate(fullPath.c_str(), size) != 0)
+  {
+    Serial.printf("Failed to truncate %s to %u bytes\n", path, size);
+    return false;
+  }
+  return true;
+}
+
+String sdFatPath(const String &path)
+{
+  return String(SD_FATFS_PDRV) + ":" + path;
+}
+
+struct OpenWriter
+{
+  String path;
+  uint32_t count;
+};
+
+static std::vector<OpenWriter> openWriters;
+static std::recursive_mutex openWritersMutex;
+
+void openWriterAdd(const String &path)
+{
+  std::lock_guard<std::recursive_mutex> guard(openWritersMutex);
+  for (OpenWriter &w : openWriters)
+  {
+    if (w.path == path)
+    {
+      w.count++;
+      return;
+    }
+  }
+  openWriters.push_back({path, 1});
+}
+
+void openWriterRemove(const String &path)
+{
+  std::lock_guard<std::recursive_mutex> guard(openWritersMutex);
+  for (size_t i = 0; i < openWriters.size(); i++)
+  {
+    if (openWriters[i].path == path)
+    {
+      if (--openWriters[i].count == 0)
+      {
+        openWriters.erase(openWriters.begin() + i);
+      }
+      return;
+    }
+  }
+}
+
+bool openWriterActive(const String &path)
+{
+  std::lock_guard<std::recursive_mutex> guard(openWritersMutex);
+  for (const OpenWriter &w : openWriters)
+  {
+    if (path == w.path || (path.startsWith(w.path) && path.charAt(w.path.length()) == '/'))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+OpenWriterLock::OpenWriterLock()
+{
+  openWritersMutex.lock();
+}
+
+OpenWriterLock::~OpenWriterLock()
+{
+  openWritersMutex.unlock();
+}
+
+bool copyFile(fs::FS &fs, const char *from, const char *to, BackgroundJob *job)
+{
+  Serial.printf("Copying file %s to %s\n", from, to);
+  fsCacheInvalidate(to);
+
+  if (!g_psramBuffer.isInitialized() && !g_psramBuffer.init())
+  {
+    Serial.println("Failed to initialize PSRAM buffer");
+    return false;
+  }
+
+  File src = fs.open(from);
+  if (!src || src.isDirectory())
+  {
+    Serial.println("Failed to open source file");
+    return false;
+  }
+  // Preallocation sets the final size up front: build the copy under a
+  // staging name so a crash never leaves `to` with garbage past the data
+  String stagingPath = String(to) + COPY_STAGING_SUFFIX;
+  fsCacheInvalidate(stagingPath);
+  File dst = fs.open(stagingPath, FILE_WRITE);
+  if (!dst)
+  {
+    Serial.println("Failed to open target file");
+    return false;
+  }
+
+  size_t size = src.size();
+  preallocateFile(dst, size);
+
+  uint8_t *buffer = g_psramBuffer.getBuffer();
+  size_t chunkSize = min(g_psramBuffer.getSize(), (size_t)(256 * 1024));
+  size_t copied = 0;
+  uint32_t start = millis();
+  uint32_t lastWdtReset = start;
+  bool ok = true;
+
+  while (copied < size)
+  {
+    uint32_t now = millis();
+    if (now - lastWdtReset > 1000)
+    {
+      esp_task_wdt_reset();
+      lastWdtReset = now;
+    }
+    if (job && job->cancelled())
+    {
+      ok = false;
+      break;
+    }
+
+    size_t n = src.read(buffer, min(chunkSize, size - copied));
+    if (n == 0 || dst.write(buffer, n) != n)
+    {
+      ok = false;
+      break;
+    }
+    copied += n;
+    if (job)
+    {
+      job->setProgress(copied, size);
+    }
+    yield();
+  }
+
+  src.close();
+  dst.close();
+  ok = ok && fs.rename(stagingPath.c_str(), to);
+  if (!ok)
+  {
+    Serial.println("Copy failed");
+    fs.remove(stagingPath.c_str());
+  }
+  fsCacheInvalidate(stagingPath);
+  fsCacheInvalidate(to);
+  if (!ok)
+  {
+    return false;
+  }
+
+  uint32_t elapsed = max((uint32_t)1, (uint32_t)(millis() - start));
+  Serial.printf("Copied %u bytes in %u ms (%.2f KB/s)\n", copied, elapsed, copied / (float)elapsed);
+  return true;
+}
+
+bool readBackCrc32(fs::FS &fs, const char *path, uint32_t &crc)
+{
+  if (!g_psramBuffer.isInitialized() && !g_psramBuffer.init())
+  {
+    Serial.println("Failed to initialize PSRAM buffer");
+    return false;
+  }
+
+  // From the card itself, not from copies the block cache kept of the writes
+  BlockCacheBypassScope bypass;
+  File file = fs.open(path);
+  if (!file || file.isDirectory())
+  {
+    Serial.println("Failed to open file for read-back");
+    return false;
+  }
+
+  uint8_t *buffer = g_psramBuffer.getBuffer();
+  size_t chunkSize = min(g_psramBuffer.getSize(), (size_t)(256 * 1024));
+  size_t remaining = file.size();
+  uint32_t lastWdtReset = millis();
+  Hasher hasher(HASH_CRC32);
+
+  while (remaining > 0)
+  {
+    uint32_t now = millis();
+    if (now - lastWdtReset > 1000)
+    {
+      esp_task_wdt_reset();
+      lastWdtReset = now;
+    }
+
+    size_t n = file.read(buffer, min(chunkSize, remaining));
+    if (n == 0)
+    {
+      file.close();
+      return false;
+    }
+    hasher.update(buffer, n);
+    remaining -= n;
+    yield();
+  }
+  file.close();
+
+  uint8_t digest[4];
+  hasher.finish(digest);
+  crc = ((uint32_t)digest[0] << 24) | ((uint32_t)digest[1] << 16) | (digest[2] << 8) | digest[3];
+  return true;
 }
 
 void testFileIO(fs::FS &fs, const char *path)
@@ -194,6 +503,7 @@ void testFileIO(fs::FS &fs, const char *path)
   size_t writeCount = testSize / 512;
 
   Serial.printf("Starting standard write test with size: %u bytes\n", testSize);
+  fsCacheInvalidate(path);
 
   file = fs.open(path, FILE_WRITE);
   if (!file)
@@ -292,6 +602,7 @@ void readFile_PSRAM(fs::FS &fs, const char *path)
 void writeFile_PSRAM(fs::FS &fs, const char *path, const char *message)
 {
   Serial.printf("Writing file with PSRAM buffer: %s\n", path);
+  fsCacheInvalidate(path);
 
   // Initialize PSRAM buffer if not already done
   if (!g_psramBuffer.isInitialized())
@@ -338,11 +649,13 @@ void writeFile_PSRAM(fs::FS &fs, const char *path, const char *message)
   }
 
   file.close();
+  fsCacheInvalidate(path);
 }
 
 void appendFile_PSRAM(fs::FS &fs, const char *path, const char *message)
 {
   Serial.printf("Appending to file with PSRAM buffer: %s\n", path);
+  fsCacheInvalidate(path);
 
   // Initialize PSRAM buffer if not already done
   if (!g_psramBuffer.isInitialized())
@@ -389,6 +702,7 @@ void appendFile_PSRAM(fs::FS &fs, const char *path, const char *message)
   }
 
   file.close();
+  fsCacheInvalidate(path);
 }
 
 void testFileIO_PSRAM(fs::FS &fs, const char *path)
@@ -475,6 +789,7 @@ void testFileIO_PSRAM(fs::FS &fs, const char *path)
   size_t testSize = 1 * 1024 * 1024; // 使用1MB而不是2MB
   Serial.printf("Starting write test with size: %u bytes (%.2f MB)\n",
                 testSize, testSize / (1024.0 * 1024.0));
+  fsCacheInvalidate(path);
 
   file = fs.open(path, FILE_WRITE);
   if (!file)
@@ -529,4 +844,543 @@ void testFileIO_PSRAM(fs::FS &fs, const char *path)
 
   // 最后再次重置看门狗计时器
   esp_task_wdt_reset();
-}
\ No newline at end of file
+}
+// ---- AppendStream ----------------------------------------------------------
+
+// A ring record: header word (length | APPEND_COMMITTED, written last),
+// enqueue time, payload padded to 8 bytes so headers never wrap. The writer zeroes consumed space
+// so an unwritten header always reads as 0.
+#define APPEND_COMMITTED 0x80000000u
+#define APPEND_HEADER 8
+
+static uint32_t recordSpan(uint32_t len)
+{
+  return APPEND_HEADER + ((len + 7) & ~7u);
+}
+
+AppendStream::AppendStream()
+    : fs(nullptr), fileSize(0), ring(nullptr), reserveHead(0), tail(0), batch(nullptr), batchUsed(0),
+      marks(nullptr), markCount(0), markCapacity(0), task(nullptr), stopping(false), flushRequested(false),
+      running(false), registered(false), records(0), bytes(0), droppedRecords(0), droppedBytes(0), writes(0), written(0),
+      syncs(0), rotations(0), writeErrors(0), maxLatencyUs(0), latencySumUs(0), latencySamples(0),
+      ringHighWater(0)
+{
+}
+
+AppendStream::~AppendStream()
+{
+  end();
+}
+
+static void *appendAlloc(size_t size)
+{
+  void *p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  return p ? p : malloc(size);
+}
+
+bool AppendStream::begin(fs::FS &fs, const char *path, const AppendStreamConfig &cfg)
+{
+  if (running)
+  {
+    return false;
+  }
+
+  this->fs = &fs;
+  this->path = path;
+  config = cfg;
+  // The ring indexes with a mask
+  size_t ringSize = 1024;
+  while (ringSize < config.ringSize)
+    ringSize <<= 1;
+  config.ringSize = ringSize;
+  config.batchSize = max(config.batchSize & ~(size_t)(APPEND_ALIGN - 1), (size_t)APPEND_ALIGN);
+  config.keepFiles = max(config.keepFiles, (uint8_t)1);
+
+  ring = (uint8_t *)appendAlloc(config.ringSize);
+  batch = (uint8_t *)appendAlloc(config.batchSize);
+  markCapacity = config.batchSize / APPEND_HEADER + 1;
+  marks = (Mark *)appendAlloc(markCapacity * sizeof(Mark));
+  bool existed = g_metaCache.exists(this->path);
+  openWriterAdd(this->path);
+  registered = true;
+  fsCacheInvalidate(this->path);
+  file = fs.open(path, FILE_APPEND);
+  if (file && !existed)
+  {
+    duFileAdded(this->path, 0);
+  }
+  if (ring == nullptr || batch == nullptr || marks == nullptr || !file)
+  {
+    Serial.printf("AppendStream: cannot start on %s\n", path);
+    end();
+    return false;
+  }
+  memset(ring, 0, config.ringSize);
+  fileSize = file.size();
+  reserveHead = 0;
+  tail = 0;
+  batchUsed = 0;
+  markCount = 0;
+  stopping = false;
+  flushRequested = false;
+  running = true;
+
+  TaskHandle_t handle;
+  if (xTaskCreatePinnedToCore(writerEntry, "append", 4096, this, BG_JOB_PRIORITY + 1, &handle, tskNO_AFFINITY) != pdPASS)
+  {
+    running = false;
+    end();
+    return false;
+  }
+  task = handle;
+  return true;
+}
+
+void AppendStream::end()
+{
+  if (running)
+  {
+    stopping = true;
+    xTaskNotifyGive((TaskHandle_t)task);
+    while (running)
+    {
+      vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    task = nullptr;
+  }
+  if (file)
+  {
+    file.close();
+  }
+  if (registered)
+  {
+    openWriterRemove(path);
+    registered = false;
+  }
+  free(ring);
+  free(batch);
+  free(marks);
+  ring = nullptr;
+  batch = nullptr;
+  marks = nullptr;
+}
+
+bool AppendStream::append(const void *data, size_t len)
+{
+  if (!running || stopping || len == 0 || len > min(config.ringSize / 4, config.batchSize))
+  {
+    droppedRecords.fetch_add(1, std::memory_order_relaxed);
+    droppedBytes.fetch_add(len, std::memory_order_relaxed);
+    return false;
+  }
+
+  // Reserve space with a CAS on the head; the tail only moves forward
+  uint32_t span = recordSpan(len);
+  uint32_t head = reserveHead.load(std::memory_order_relaxed);
+  do
+  {
+    if (head + span - tail.load(std::memory_order_acquire) > config.ringSize)
+    {
+      droppedRecords.fetch_add(1, std::memory_order_relaxed);
+      droppedBytes.fetch_add(len, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!reserveHead.compare_exchange_weak(head, head + span, std::memory_order_acq_rel,
+                                              std::memory_order_relaxed));
+
+  uint32_t mask = config.ringSize - 1;
+  uint32_t at = head & mask;
+  ((uint32_t *)(ring + at))[1] = (uint32_t)esp_timer_get_time();
+  uint32_t payload = (at + APPEND_HEADER) & mask;
+  size_t first = min(len, (size_t)(config.ringSize - payload));
+  memcpy(ring + payload, data, first);
+  memcpy(ring, (const uint8_t *)data + first, len - first);
+
+  // Publish: the writer stops at the first header that is still zero
+  __atomic_store_n((uint32_t *)(ring + at), (uint32_t)len | APPEND_COMMITTED, __ATOMIC_RELEASE);
+  records.fetch_add(1, std::memory_order_relaxed);
+  bytes.fetch_add(len, std::memory_order_relaxed);
+
+  // Wake the writer early when the ring passes half full
+  uint32_t used = head + span - tail.load(std::memory_order_relaxed);
+  if (used >= config.ringSize / 2 && used - span < config.ringSize / 2)
+  {
+    xTaskNotifyGive((TaskHandle_t)task);
+  }
+  return true;
+}
+
+void AppendStream::writerEntry(void *arg)
+{
+  AppendStream *stream = (AppendStream *)arg;
+  stream->writerLoop();
+  stream->running = false;
+  vTaskDelete(NULL);
+}
+
+// Move committed records from the ring into the batch buffer
+size_t AppendStream::drain()
+{
+  uint32_t mask = config.ringSize - 1;
+  uint32_t t = tail.load(std::memory_order_relaxed);
+  uint32_t used = reserveHead.load(std::memory_order_relaxed) - t;
+  ringHighWater = max(ringHighWater, used);
+  size_t moved = 0;
+
+  while (markCount < markCapacity)
+  {
+    uint32_t at = t & mask;
+    uint32_t header = __atomic_load_n((uint32_t *)(ring + at), __ATOMIC_ACQUIRE);
+    if (!(header & APPEND_COMMITTED))
+    {
+      break;
+    }
+    uint32_t len = header & ~APPEND_COMMITTED;
+    if (batchUsed + len > config.batchSize && batchUsed > 0)
+    {
+      break;
+    }
+
+    uint32_t payload = (at + APPEND_HEADER) & mask;
+    size_t first = min((size_t)len, (size_t)(config.ringSize - payload));
+    memcpy(batch + batchUsed, ring + payload, first);
+    memcpy(batch + batchUsed + first, ring, len - first);
+
+    marks[markCount].end = batchUsed + len;
+    marks[markCount].enqueueUs = ((uint32_t *)(ring + at))[1];
+    markCount++;
+    batchUsed += len;
+    moved += len;
+
+    uint32_t span = recordSpan(len);
+    for (uint32_t cleared = 0; cleared < span;)
+    {
+      uint32_t pos = (at + cleared) & mask;
+      uint32_t n = min(span - cleared, (uint32_t)(config.ringSize - pos));
+      memset(ring + pos, 0, n);
+      cleared += n;
+    }
+    t += span;
+    tail.store(t, std::memory_order_release);
+  }
+  return moved;
+}
+
+bool AppendStream::writeBatch(size_t len)
+{
+  if (config.rotateBytes && fileSize > 0 && fileSize + len > config.rotateBytes)
+  {
+    rotate();
+  }
+
+  size_t n = file ? sdIoWrite(file, batch, len, SD_IO_BACKGROUND) : 0;
+  uint32_t now = esp_timer_get_time();
+  if (n != len)
+  {
+    writeErrors++;
+  }
+  writes++;
+  written += n;
+  fileSize += n;
+  fsCacheInvalidate(path);
+  duFileGrown(path, n);
+
+  // Latency of every record that is now completely handed to the file
+  size_t done = 0;
+  while (done < markCount && marks[done].end <= len)
+  {
+    uint32_t latency = now - marks[done].enqueueUs;
+    maxLatencyUs = max(maxLatencyUs, latency);
+    latencySumUs += latency;
+    latencySamples++;
+    done++;
+  }
+  for (size_t i = done; i < markCount; i++)
+  {
+    marks[i - done].end = marks[i].end - len;
+    marks[i - done].enqueueUs = marks[i].enqueueUs;
+  }
+  markCount -= done;
+  memmove(batch, batch + len, batchUsed - len);
+  batchUsed -= len;
+  return n == len;
+}
+
+void AppendStream::rotate()
+{
+  file.close();
+  duFileRemoved(path, fileSize);
+
+  // path.N is dropped, path.i becomes path.i+1, path becomes path.1
+  String oldest = path + "." + String(config.keepFiles);
+  FsMeta meta;
+  if (g_metaCache.stat(oldest, meta))
+  {
+    fsCacheInvalidate(oldest);
+    fs->remove(oldest);
+    duFileRemoved(oldest, meta.size);
+    fsEventRemoved(oldest, false);
+  }
+  for (int i = config.keepFiles - 1; i >= 0; i--)
+  {
+    String from = i == 0 ? path : path + "." + String(i);
+    String to = path + "." + String(i + 1);
+    if (g_metaCache.stat(from, meta))
+    {
+      fsCacheInvalidate(from);
+      fsCacheInvalidate(to);
+      if (fs->rename(from, to))
+      {
+        duFileAdded(to, meta.size);
+        if (i > 0)
+          duFileRemoved(from, meta.size);
+        fsEventRenamed(from, to, false);
+      }
+    }
+  }
+
+  fsCacheInvalidate(path);
+  file = fs->open(path, FILE_APPEND);
+  fileSize = 0;
+  duFileAdded(path, 0);
+  fsEventAdded(path, 0, false);
+  rotations++;
+}
+
+void AppendStream::writerLoop()
+{
+  uint32_t lastSync = millis();
+  uint32_t oldest = 0; // when the batch got its first unwritten byte
+  bool dirty = false;
+  TickType_t wait = max(pdMS_TO_TICKS(config.flushMs / 4), (TickType_t)1);
+
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, wait);
+    bool finishing = stopping || flushRequested;
+
+    // Keep the batch full and write it out in sector-aligned pieces
+    uint64_t writtenBefore = written;
+    while (true)
+    {
+      bool hadData = batchUsed > 0;
+      size_t moved = drain();
+      if (!hadData && batchUsed > 0)
+      {
+        oldest = millis();
+      }
+
+      // Bytes that end the file on an APPEND_ALIGN boundary
+      size_t aligned = 0;
+      if (fileSize % APPEND_ALIGN + batchUsed >= APPEND_ALIGN)
+      {
+        aligned = (fileSize + batchUsed) / APPEND_ALIGN * APPEND_ALIGN - fileSize;
+      }
+      bool full = batchUsed == config.batchSize || markCount == markCapacity;
+      bool due = batchUsed > 0 && (finishing || millis() - oldest >= config.flushMs);
+
+      if (due)
+      {
+        writeBatch(batchUsed);
+      }
+      else if (full && aligned > 0)
+      {
+        // The rest is older data: its deadline stays
+        writeBatch(aligned);
+      }
+      else if (moved == 0)
+      {
+        break;
+      }
+    }
+    // Only a write that reached the file needs a sync
+    if (written != writtenBefore)
+    {
+      dirty = true;
+    }
+
+    uint32_t now = millis();
+    if (dirty && (finishing || now - lastSync >= config.syncMs))
+    {
+      file.flush();
+      syncs++;
+      lastSync = now;
+      dirty = false;
+    }
+
+    if (flushRequested && batchUsed == 0 && reserveHead.load() == tail.load())
+    {
+      flushRequested = false;
+    }
+    if (stopping && batchUsed == 0 && reserveHead.load() == tail.load())
+    {
+      break;
+    }
+  }
+}
+
+bool AppendStream::flush(uint32_t timeoutMs)
+{
+  if (!running)
+  {
+    return false;
+  }
+  flushRequested = true;
+  xTaskNotifyGive((TaskHandle_t)task);
+  uint32_t start = millis();
+  while (flushRequested && millis() - start < timeoutMs)
+  {
+    vTaskDelay(pdMS_TO_TICKS(2));
+  }
+  return !flushRequested;
+}
+
+void AppendStream::statsJson(JsonObject obj)
+{
+  obj["path"] = path;
+  obj["records"] = records.load();
+  obj["bytes"] = bytes.load();
+  obj["droppedRecords"] = droppedRecords.load();
+  obj["droppedBytes"] = droppedBytes.load();
+  obj["writes"] = writes;
+  obj["written"] = written;
+  obj["syncs"] = syncs;
+  obj["rotations"] = rotations;
+  obj["writeErrors"] = writeErrors;
+  obj["maxLatencyUs"] = maxLatencyUs;
+  obj["avgLatencyUs"] = latencySamples ? (uint32_t)(latencySumUs / latencySamples) : 0;
+  obj["ringHighWater"] = ringHighWater;
+  obj["ringSize"] = config.ringSize;
+}
+
+struct AppendTestProducer
+{
+  AppendStream *stream;
+  uint32_t index;
+  uint32_t records;
+  uint32_t rate;
+  size_t recordSize;
+  uint32_t startUs;
+  uint32_t endUs;
+  uint32_t accepted;
+  SemaphoreHandle_t done;
+};
+
+// Appends the records due by now at the producer's rate, then sleeps a tick:
+// a short burst every millisecond, the way a sampling loop logs
+static void appendTestProducer(void *arg)
+{
+  AppendTestProducer *p = (AppendTestProducer *)arg;
+  char record[256];
+  memset(record, 'x', p->recordSize);
+  record[p->recordSize - 1] = '\n';
+
+  uint32_t produced = 0;
+  while (produced < p->records)
+  {
+    uint32_t due = min((uint64_t)p->records, (uint64_t)(micros() - p->startUs) * p->rate / 1000000 + 1);
+    if (produced >= due)
+    {
+      vTaskDelay(1);
+      continue;
+    }
+    for (; produced < due; produced++)
+    {
+      int n = snprintf(record, p->recordSize, "%u,%u,%u", p->index, produced, micros());
+      if (n < (int)p->recordSize - 1)
+      {
+        record[n] = ',';
+      }
+      if (p->stream->append(record, p->recordSize))
+      {
+        p->accepted++;
+      }
+    }
+  }
+  p->endUs = micros();
+  xSemaphoreGive(p->done);
+  vTaskDelete(NULL);
+}
+
+float testAppendStream(fs::FS &fs, const char *path, uint32_t rate, uint32_t durationMs, size_t recordSize,
+                       JsonObject result)
+{
+  uint32_t perProducer = (uint64_t)rate * durationMs / 1000 / APPEND_TEST_PRODUCERS;
+  uint32_t records = perProducer * APPEND_TEST_PRODUCERS;
+  Serial.printf("AppendStream test: %u records/s of %u bytes for %u ms to %s\n", rate, recordSize, durationMs, path);
+  FsMeta meta;
+  if (g_metaCache.stat(path, meta))
+  {
+    fsCacheInvalidate(path);
+    fs.remove(path);
+    duFileRemoved(path, meta.size);
+  }
+
+  AppendStream stream;
+  SemaphoreHandle_t done = xSemaphoreCreateCounting(APPEND_TEST_PRODUCERS, 0);
+  if (done == nullptr || !stream.begin(fs, path))
+  {
+    if (done != nullptr)
+    {
+      vSemaphoreDelete(done);
+    }
+    return 0;
+  }
+
+  AppendTestProducer producers[APPEND_TEST_PRODUCERS];
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < APPEND_TEST_PRODUCERS; i++)
+  {
+    AppendTestProducer &p = producers[i];
+    p.stream = &stream;
+    p.index = i;
+    p.records = perProducer;
+    p.rate = rate / APPEND_TEST_PRODUCERS;
+    p.recordSize = min(recordSize, (size_t)256);
+    p.startUs = start;
+    p.endUs = start;
+    p.accepted = 0;
+    p.done = done;
+    // Alternate between the two cores: producers on both append at once
+    if (xTaskCreatePinnedToCore(appendTestProducer, "append_test", 3072, &p, BG_JOB_PRIORITY, NULL,
+                                (BaseType_t)(i & 1)) != pdPASS)
+    {
+      xSemaphoreGive(done); // counted as a producer that appended nothing
+    }
+  }
+
+  uint32_t accepted = 0;
+  uint32_t producedUs = 1;
+  for (uint32_t i = 0; i < APPEND_TEST_PRODUCERS; i++)
+  {
+    xSemaphoreTake(done, portMAX_DELAY);
+  }
+  for (uint32_t i = 0; i < APPEND_TEST_PRODUCERS; i++)
+  {
+    accepted += producers[i].accepted;
+    producedUs = max(producedUs, producers[i].endUs - start);
+  }
+  vSemaphoreDelete(done);
+
+  // The records only count once they are in the file
+  bool flushed = stream.flush(5000);
+  uint32_t elapsed = max((uint32_t)(micros() - start), (uint32_t)1);
+  stream.statsJson(result);
+  stream.end();
+
+  uint32_t dropped = result["droppedRecords"];
+  float achieved = accepted * 1e6f / producedUs;
+  bool passed = flushed && dropped == 0 && accepted == records && achieved >= rate * 0.95f;
+  result["targetRate"] = rate;
+  result["durationMs"] = durationMs;
+  result["producers"] = APPEND_TEST_PRODUCERS;
+  result["appendUs"] = producedUs;
+  result["elapsedUs"] = elapsed;
+  result["recordsPerSec"] = achieved;
+  result["toFileRecordsPerSec"] = accepted * 1e6f / elapsed;
+  result["flushed"] = flushed;
+  result["passed"] = passed;
+  Serial.printf("AppendStream test: %u/%u records accepted, %u dropped, %.0f records/s sustained%s\n", accepted,
+                records, dropped, achieved, passed ? "" : " - FAILED");
+  return achieved;
+}
@@ -4,16 +4,174 @@
 #include "Arduino.h"
 #include "FS.h"
 #include "psram_buffer.h"
+#include <ArduinoJson.h>
+#include <atomic>
+
+// VFS mount point of the SD card
+#define SD_MOUNT_POINT "/sdcard"
+// FatFs physical drive of the SD card. SD_MMC takes the first free drive,
+// which is 0 unless another FAT volume was mounted before it.
+#define SD_FATFS_PDRV 0
+// Copies are built under this name and renamed when complete
+#define COPY_STAGING_SUFFIX ".part"
+
+class BackgroundJob;
 
 void listDir(fs::FS &fs, const char *dirname, uint8_t levels);
 bool createDir(fs::FS &fs, const char *path);
 bool removeDir(fs::FS &fs, const char *path);
+// Removes `path` and everything below it; false if anything is left
+bool removeTree(fs::FS &fs, const char *path);
 void readFile(fs::FS &fs, const char *path);
 void writeFile(fs::FS &fs, const char *path, const char *message);
 void appendFile(fs::FS &fs, const char *path, const char *message);
 void renameFile(fs::FS &fs, const char *path1, const char *path2);
 void deleteFile(fs::FS &fs, const char *path);
 void testFileIO(fs::FS &fs, const char *path);
+// Copies through `to` + COPY_STAGING_SUFFIX and renames on success. With a
+// job, reports progress and stops when it is cancelled
+bool copyFile(fs::FS &fs, const char *from, const char *to, BackgroundJob *job = nullptr);
+// Read a file back from the card in large chunks, past the block cache,
+// and return its CRC32
+bool readBackCrc32(fs::FS &fs, const char *path, uint32_t &crc);
+
+// Cluster preallocation helpers. preallocateFile extends the file to `size`
+// bytes and restores the file position; truncate to the final size after
+// writing
+bool preallocateFile(File &file, size_t size);
+bool truncateFile(const char *path, size_t size);
+
+// Path of an SD card file for direct FatFs calls ("0:/dir/file")
+String sdFatPath(const String &path);
+
+// Files kept open for writing by long-lived writers (AppendStream,
+// TimeSeriesWriter, the KV store directory). Tools that copy a file and
+// swap the copy into place (defrag) skip everything registered here. An
+// entry for a directory covers everything below it; entries are counted.
+void openWriterAdd(const String &path);
+void openWriterRemove(const String &path);
+bool openWriterActive(const String &path);
+
+// Holds the registry: writers cannot register while one is alive, so a
+// check followed by a swap is not raced by a writer opening the file
+class OpenWriterLock
+{
+public:
+    OpenWriterLock();
+    ~OpenWriterLock();
+
+    OpenWriterLock(const OpenWriterLock &) = delete;
+    OpenWriterLock &operator=(const OpenWriterLock &) = delete;
+};
+
+// AppendStream defaults
+#define APPEND_RING_SIZE (256 * 1024) // power of two, in PSRAM
+#define APPEND_BATCH_SIZE (32 * 1024) // largest single write to the card
+#define APPEND_ALIGN 512              // writes end on sector boundaries when possible
+#define APPEND_FLUSH_MS 100           // longest a record waits before it is written
+#define APPEND_SYNC_MS 1000           // fsync interval
+#define APPEND_KEEP_FILES 4           // rotated files kept as path.1 .. path.N
+
+// AppendStream self-test: sustained rate over a fixed duration
+#define APPEND_TEST_RATE 10000 // records per second, all producers together
+#define APPEND_TEST_MS 3000
+#define APPEND_TEST_PRODUCERS 2 // one task per core
+
+struct AppendStreamConfig
+{
+    size_t ringSize = APPEND_RING_SIZE;
+    size_t batchSize = APPEND_BATCH_SIZE;
+    uint32_t flushMs = APPEND_FLUSH_MS;
+    uint32_t syncMs = APPEND_SYNC_MS;
+    uint32_t rotateBytes = 0; // 0 = never rotate
+    uint8_t keepFiles = APPEND_KEEP_FILES;
+};
+
+// Persistent high-rate append target for logging. append() only copies the
+// record into a lock-free multi-producer ring, so any task on either core
+// can log without touching the card; a writer task keeps the file open and
+// commits the records in sector-aligned batches (group commit), syncs every
+// syncMs and rotates by size. When the ring is full the record is dropped
+// and counted instead of blocking the producer, as is a record larger than
+// batchSize or a quarter of the ring.
+class AppendStream
+{
+private:
+    fs::FS *fs;
+    String path;
+    AppendStreamConfig config;
+    File file;
+    uint32_t fileSize;
+
+    uint8_t *ring;
+    std::atomic<uint32_t> reserveHead; // producers reserve here
+    std::atomic<uint32_t> tail;        // writer releases here
+
+    uint8_t *batch;
+    size_t batchUsed;
+    struct Mark
+    {
+        uint32_t end; // batch offset just past the record
+        uint32_t enqueueUs;
+    };
+    Mark *marks;
+    size_t markCount;
+    size_t markCapacity;
+
+    void *task;
+    volatile bool stopping;
+    volatile bool flushRequested;
+    volatile bool running;
+    bool registered; // in the open-writer registry
+
+    std::atomic<uint32_t> records;
+    std::atomic<uint32_t> bytes;
+    std::atomic<uint32_t> droppedRecords;
+    std::atomic<uint32_t> droppedBytes;
+    uint32_t writes;
+    uint64_t written;
+    uint32_t syncs;
+    uint32_t rotations;
+    uint32_t writeErrors;
+    uint32_t maxLatencyUs;
+    uint64_t latencySumUs;
+    uint32_t latencySamples;
+    uint32_t ringHighWater;
+
+    static void writerEntry(void *arg);
+    void writerLoop();
+    size_t drain();
+    bool writeBatch(size_t len);
+    void rotate();
+
+public:
+    AppendStream();
+    ~AppendStream();
+
+    AppendStream(const AppendStream &) = delete;
+    AppendStream &operator=(const AppendStream &) = delete;
+
+    bool begin(fs::FS &fs, const char *path, const AppendStreamConfig &config = AppendStreamConfig());
+    // Write everything still queued, stop the writer and close the file
+    void end();
+
+    // Never blocks; false if the record was dropped
+    bool append(const void *data, size_t len);
+    bool append(const char *message) { return append(message, strlen(message)); }
+
+    // Wait until everything appended so far is written and synced
+    bool flush(uint32_t timeoutMs = 2000);
+
+    void statsJson(JsonObject obj);
+};
+
+// Log records of `recordSize` bytes through an AppendStream from
+// APPEND_TEST_PRODUCERS tasks, paced to `rate` records per second in total
+// for `durationMs`; returns the achieved records per second.
+// result["passed"] is false if any record was dropped, the producers fell
+// more than 5% short of the rate or the final flush timed out
+float testAppendStream(fs::FS &fs, const char *path, uint32_t rate, uint32_t durationMs, size_t recordSize,
+                       JsonObject result);
 
 // Enhanced file I/O functions using PSRAM buffer
 void testFileIO_PSRAM(fs::FS &fs, const char *path);
@@ -0,0 +1,162 @@
+#include "tail_follow.h"
+#include "meta_cache.h"
+#include "block_cache.h"
+#include "sd_io_sched.h"
+#include "sd_read_write.h"
+
+// Only touched from the web server task
+static uint32_t followers = 0;
+
+size_t readFileRange(const String &path, uint32_t offset, uint8_t *buffer, size_t len)
+{
+  FileLease lease = g_handleCache.acquire(path);
+  if (!lease.file)
+  {
+    return 0;
+  }
+
+  // One response piece at a time: short reads a client is waiting on
+  bool positioned;
+  {
+    SdIoScope io(SD_IO_SMALL);
+    positioned = lease.file.seek(offset);
+  }
+  size_t n = positioned ? sdIoRead(lease.file, buffer, len, SD_IO_SMALL) : 0;
+  g_handleCache.release(lease);
+  return n;
+}
+
+TailFollower::TailFollower(const String &path, uint32_t offset)
+    : path(path), offset(offset), pollMs(TAIL_POLL_MIN_MS), nextPoll(0), counted(false)
+{
+}
+
+TailFollower::~TailFollower()
+{
+  if (counted)
+  {
+    followers--;
+  }
+}
+
+bool TailFollower::admit()
+{
+  if (followers >= TAIL_MAX_FOLLOWERS)
+  {
+    return false;
+  }
+  followers++;
+  counted = true;
+  return true;
+}
+
+size_t TailFollower::fill(uint8_t *buffer, size_t maxLen)
+{
+  if ((int32_t)(millis() - nextPoll) < 0)
+  {
+    return RESPONSE_TRY_AGAIN;
+  }
+
+  FsMeta meta;
+  if (!g_metaCache.stat(path, meta) || meta.isDirectory)
+  {
+    // Deleted: keep waiting, it may be recreated (log rotation)
+    meta.size = 0;
+  }
+  if (meta.size < offset)
+  {
+    offset = 0;
+  }
+
+  size_t n = 0;
+  if (meta.size > offset)
+  {
+    BlockCacheRouteScope route("/tail");
+    n = readFileRange(path, offset, buffer, min((size_t)(meta.size - offset), maxLen));
+  }
+  if (n == 0)
+  {
+    nextPoll = millis() + pollMs;
+    pollMs = min(pollMs * 2, (uint32_t)TAIL_POLL_MAX_MS);
+    return RESPONSE_TRY_AGAIN;
+  }
+
+  offset += n;
+  pollMs = TAIL_POLL_MIN_MS;
+  nextPoll = 0;
+  return n;
+}
+
+// ---- Self test -------------------------------------------------------------
+
+// Feeds the follower until `want` bytes were seen in total or the poll
+// backoff would have run out twice; returns the ms it took
+static uint32_t drain(TailFollower &follower, String &seen, size_t want)
+{
+  uint8_t buffer[256];
+  uint32_t start = millis();
+  while (seen.length() < want && millis() - start < 2 * TAIL_POLL_MAX_MS)
+  {
+    size_t n = follower.fill(buffer, sizeof(buffer));
+    if (n == RESPONSE_TRY_AGAIN)
+    {
+      delay(5);
+      continue;
+    }
+    seen.concat((const char *)buffer, n);
+  }
+  return millis() - start;
+}
+
+float testTailFollow(fs::FS &fs, const char *path, uint32_t appends, JsonObject result)
+{
+  Serial.printf("Tail follow test: %u appends to %s\n", appends, path);
+  writeFile(fs, path, "");
+
+  TailFollower follower(path, 0);
+  String expected;
+  String seen;
+  uint32_t missed = 0;
+  uint32_t totalMs = 0;
+  uint32_t maxMs = 0;
+  for (uint32_t i = 0; i < appends; i++)
+  {
+    char line[48];
+    snprintf(line, sizeof(line), "tail test line %u\n", i);
+    appendFile(fs, path, line);
+    expected += line;
+
+    uint32_t ms = drain(follower, seen, expected.length());
+    if (seen.length() < expected.length())
+    {
+      missed++;
+      seen = expected; // resync, so one miss is not counted for every later line
+    }
+    totalMs += ms;
+    maxMs = max(maxMs, ms);
+  }
+  bool contentOk = seen == expected;
+
+  // Replaced by a shorter file (log rotation): followed from the start
+  fs.remove(path);
+  fsCacheInvalidate(path);
+  writeFile(fs, path, "rotated\n");
+  String rotated;
+  drain(follower, rotated, 8);
+  bool rotationOk = rotated == "rotated\n";
+
+  fs.remove(path);
+  fsCacheInvalidate(path);
+
+  float avgMs = appends ? (float)totalMs / appends : 0;
+  result["appends"] = appends;
+  result["missedAppends"] = missed;
+  result["avgLatencyMs"] = avgMs;
+  result["maxLatencyMs"] = maxMs;
+  result["contentOk"] = contentOk;
+  result["rotationOk"] = rotationOk;
+  result["passed"] = missed == 0 && contentOk && rotationOk;
+  Serial.printf("Tail follow: %u missed, avg %.1f ms, max %u ms, rotation %s\n", missed, avgMs, maxMs,
+                rotationOk ? "ok" : "FAILED");
+  return avgMs;
+}
@@ -0,0 +1,50 @@
+#ifndef __TAIL_FOLLOW_H
+#define __TAIL_FOLLOW_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+
+// Bytes /tail sends before following when no `bytes` parameter is given
+#define TAIL_DEFAULT_BYTES 4096
+// Concurrent /tail?follow=1 streams; each one keeps a connection open
+#define TAIL_MAX_FOLLOWERS 4
+// Size polling interval of an idle follower, doubled up to the maximum
+#define TAIL_POLL_MIN_MS 100
+#define TAIL_POLL_MAX_MS 2000
+
+// Follows a growing file for a chunked response. The filler returns
+// RESPONSE_TRY_AGAIN while nothing was appended; the size is taken from
+// the metadata cache, which every write path invalidates, so an idle poll
+// does not touch the card. A file that shrinks (rotated or replaced) is
+// followed again from the start.
+class TailFollower
+{
+private:
+    String path;
+    uint32_t offset;
+    uint32_t pollMs;
+    uint32_t nextPoll;
+    bool counted;
+
+public:
+    TailFollower(const String &path, uint32_t offset);
+    ~TailFollower();
+
+    // False if TAIL_MAX_FOLLOWERS streams are already open
+    bool admit();
+
+    size_t fill(uint8_t *buffer, size_t maxLen);
+};
+
+// Read `len` bytes at `offset` through the handle cache; returns the bytes read
+size_t readFileRange(const String &path, uint32_t offset, uint8_t *buffer, size_t len);
+
+// Appends `appends` lines to `path` with appendFile() and checks that a
+// follower sees each one, then that it starts over after the file is
+// replaced by a shorter one. Returns the average append-to-visible latency
+// in ms; result["passed"] is false if anything was missed or garbled
+float testTailFollow(fs::FS &fs, const char *path, uint32_t appends, JsonObject result);
+
+#endif
@@ -0,0 +1,364 @@
+#include "thumb_cache.h"
+#include "bg_job.h"
+#include "du_tree.h"
+#include "file_crypt.h"
+#include "jpeg_codec.h"
+#include "lz4_store.h"
+#include "sd_io_sched.h"
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static fs::FS *thumbFs = nullptr;
+static QueueHandle_t thumbTasks = nullptr;
+static uint8_t *readBuffer = nullptr;
+
+static struct
+{
+  volatile uint32_t hits;
+  volatile uint32_t misses;
+  volatile uint32_t generated;
+  volatile uint32_t fromExif;
+  volatile uint32_t failed;
+  volatile uint32_t cancelled;
+  volatile uint32_t uncached; // encrypted sources
+  volatile uint32_t cleared;
+  volatile uint64_t bytesRead;
+  volatile uint32_t decodeMs;
+  volatile uint32_t encodeMs;
+  volatile uint32_t lastMs;
+} stats;
+
+static uint8_t *allocBuffer()
+{
+  uint8_t *buffer = (uint8_t *)heap_caps_malloc(THUMB_READ_CHUNK, MALLOC_CAP_SPIRAM);
+  return buffer ? buffer : (uint8_t *)malloc(THUMB_READ_CHUNK);
+}
+
+static String cacheName(const String &path, int size, time_t mtime)
+{
+  char name[64];
+  snprintf(name, sizeof(name), THUMB_DIR "/%016llx-%d-%lx.jpg", (unsigned long long)fsPathKey(path), size,
+           (unsigned long)mtime);
+  return String(name);
+}
+
+bool thumbIsImage(const String &path)
+{
+  String lower = lzbLogicalPath(path);
+  lower.toLowerCase();
+  return lower.endsWith(".jpg") || lower.endsWith(".jpeg");
+}
+
+bool thumbLookup(const String &path, int size, const FsMeta &meta, String &cachePath)
+{
+  cachePath = cacheName(lzbLogicalPath(path), size, meta.mtime);
+  if (g_metaCache.exists(cachePath))
+  {
+    stats.hits++;
+    return true;
+  }
+  stats.misses++;
+  return false;
+}
+
+static bool readCached(const String &cachePath, std::vector<uint8_t> &jpeg)
+{
+  File file = thumbFs->open(cachePath);
+  if (!file)
+  {
+    return false;
+  }
+  jpeg.resize(file.size());
+  bool ok = file.read(jpeg.data(), jpeg.size()) == jpeg.size();
+  file.close();
+  return ok;
+}
+
+static void storeCached(const String &cachePath, const std::vector<uint8_t> &jpeg)
+{
+  FsMeta dir;
+  if (!g_metaCache.stat(THUMB_DIR, dir))
+  {
+    if (!thumbFs->mkdir(THUMB_DIR))
+    {
+      return;
+    }
+    fsCacheInvalidate(THUMB_DIR, true);
+    duDirAdded(THUMB_DIR);
+  }
+
+  // Written under a temporary name so a power cut never leaves a
+  // truncated thumbnail behind the real one
+  String tmpPath = cachePath + ".part";
+  File file = thumbFs->open(tmpPath, FILE_WRITE);
+  if (!file)
+  {
+    return;
+  }
+  bool ok = file.write(jpeg.data(), jpeg.size()) == jpeg.size();
+  file.close();
+  if (ok && thumbFs->rename(tmpPath, cachePath))
+  {
+    duFileAdded(cachePath, jpeg.size());
+  }
+  else
+  {
+    thumbFs->remove(tmpPath);
+  }
+  fsCacheInvalidate(tmpPath);
+  fsCacheInvalidate(cachePath);
+}
+
+static uint32_t nowMs()
+{
+  return millis();
+}
+
+static void runThumbTask(ThumbTask &task)
+{
+  uint32_t start = millis();
+  String source = task.path;
+  FsMeta meta;
+  bool compressed = false;
+  if (!g_metaCache.stat(source, meta) || meta.isDirectory)
+  {
+    source = task.path + LZB_SUFFIX;
+    compressed = g_metaCache.stat(source, meta) && !meta.isDirectory;
+    if (!compressed)
+    {
+      task.error = "File not found";
+      return;
+    }
+  }
+  else
+  {
+    compressed = lzbIsCompressed(source);
+  }
+
+  // A gallery can ask for the same thumbnail twice before the first is done
+  String cachePath = cacheName(lzbLogicalPath(task.path), task.size, meta.mtime);
+  if (g_metaCache.exists(cachePath) && readCached(cachePath, task.jpeg))
+  {
+    return;
+  }
+
+  LzbReader lzb;
+  File file;
+  FileCipher cipher;
+  CryptState crypt = CRYPT_PLAIN;
+  if (compressed)
+  {
+    if (!lzb.open(*thumbFs, source))
+    {
+      task.error = "Corrupt compressed file";
+      return;
+    }
+  }
+  else
+  {
+    file = thumbFs->open(source);
+    if (!file)
+    {
+      task.error = "Open failed";
+      return;
+    }
+    crypt = cryptProbe(file, cipher);
+    if (crypt == CRYPT_LOCKED)
+    {
+      file.close();
+      task.error = "File is encrypted with a key this device does not have";
+      return;
+    }
+  }
+
+  // The decoder asks for 4 KB at a time; the card is read in larger chunks
+  uint64_t offset = 0;
+  size_t bufPos = 0;
+  size_t bufLen = 0;
+  JpegReader reader = [&](uint8_t *out, size_t len) -> size_t {
+    if (task.cancelled)
+    {
+      return 0;
+    }
+    if (bufPos == bufLen)
+    {
+      SdIoScope io(SD_IO_SMALL);
+      if (compressed)
+      {
+        bufLen = lzb.read(offset, readBuffer, THUMB_READ_CHUNK);
+      }
+      else
+      {
+        bufLen = file.read(readBuffer, THUMB_READ_CHUNK);
+        if (crypt == CRYPT_ENCRYPTED)
+        {
+          cipher.apply(offset, readBuffer, readBuffer, bufLen);
+        }
+      }
+      offset += bufLen;
+      bufPos = 0;
+    }
+    size_t n = bufLen - bufPos < len ? bufLen - bufPos : len;
+    memcpy(out, readBuffer + bufPos, n);
+    bufPos += n;
+    return n;
+  };
+
+  JpegThumbStats thumbStats;
+  const char *error = "";
+  bool ok = jpegThumbnail(reader, task.size, THUMB_QUALITY, "sdthumb " + std::string(task.path.c_str()), task.jpeg,
+                          thumbStats, &error, nowMs);
+  if (!compressed)
+  {
+    file.close();
+  }
+  stats.bytesRead += thumbStats.bytesRead;
+  if (!ok)
+  {
+    task.jpeg.clear();
+    task.error = task.cancelled ? "Cancelled" : error;
+    if (task.cancelled)
+    {
+      stats.cancelled++;
+    }
+    else
+    {
+      stats.failed++;
+    }
+    return;
+  }
+  stats.generated++;
+  stats.fromExif += thumbStats.fromExif ? 1 : 0;
+  stats.decodeMs += thumbStats.decodeMs;
+  stats.encodeMs += thumbStats.encodeMs;
+  stats.lastMs = millis() - start;
+
+  // Thumbnails of encrypted photos would leak them in plain text; and only
+  // cache if nobody wrote to the photo meanwhile
+  FsMeta after;
+  if (crypt == CRYPT_ENCRYPTED)
+  {
+    stats.uncached++;
+  }
+  else if (g_metaCache.stat(source, after) && after.size == meta.size && after.mtime == meta.mtime)
+  {
+    storeCached(cachePath, task.jpeg);
+  }
+}
+
+static void clearCache()
+{
+  File dir = thumbFs->open(THUMB_DIR);
+  if (!dir || !dir.isDirectory())
+  {
+    return;
+  }
+  uint32_t count = 0;
+  File entry;
+  while ((entry = dir.openNextFile()))
+  {
+    String name = String(THUMB_DIR) + "/" + String(entry.name()).substring(String(entry.name()).lastIndexOf('/') + 1);
+    size_t size = entry.size();
+    bool isDir = entry.isDirectory();
+    entry.close();
+    if (!isDir && thumbFs->remove(name))
+    {
+      fsCacheInvalidate(name);
+      duFileRemoved(name, size);
+      count++;
+    }
+  }
+  dir.close();
+  stats.cleared += count;
+  Serial.printf("Removed %u thumbnails\n", count);
+}
+
+static void thumbWorker(void *arg)
+{
+  for (;;)
+  {
+    // nullptr asks for the cache to be cleared
+    std::shared_ptr<ThumbTask> *item;
+    if (xQueueReceive(thumbTasks, &item, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+    if (item == nullptr)
+    {
+      clearCache();
+      continue;
+    }
+    ThumbTask &task = **item;
+    if (task.cancelled)
+    {
+      stats.cancelled++;
+    }
+    else
+    {
+      runThumbTask(task);
+    }
+    task.done = true;
+    delete item;
+  }
+}
+
+bool thumbBegin(fs::FS &fs)
+{
+  if (thumbTasks != nullptr)
+  {
+    return true;
+  }
+  thumbFs = &fs;
+  readBuffer = allocBuffer();
+  thumbTasks = xQueueCreate(THUMB_QUEUE_DEPTH, sizeof(std::shared_ptr<ThumbTask> *));
+  if (readBuffer == nullptr || thumbTasks == nullptr ||
+      xTaskCreatePinnedToCore(thumbWorker, "thumb", THUMB_WORKER_STACK, NULL, BG_JOB_PRIORITY, NULL,
+                              tskNO_AFFINITY) != pdPASS)
+  {
+    Serial.println("Failed to start thumbnail worker");
+    return false;
+  }
+  return true;
+}
+
+bool thumbQueue(const std::shared_ptr<ThumbTask> &task)
+{
+  if (thumbTasks == nullptr)
+  {
+    return false;
+  }
+  std::shared_ptr<ThumbTask> *item = new std::shared_ptr<ThumbTask>(task);
+  if (xQueueSend(thumbTasks, &item, 0) != pdTRUE)
+  {
+    delete item;
+    return false;
+  }
+  return true;
+}
+
+bool thumbClear()
+{
+  std::shared_ptr<ThumbTask> *item = nullptr;
+  return thumbTasks != nullptr && xQueueSend(thumbTasks, &item, 0) == pdTRUE;
+}
+
+void thumbStatsJson(JsonObject obj)
+{
+  uint32_t lookups = stats.hits + stats.misses;
+  obj["hits"] = stats.hits;
+  obj["misses"] = stats.misses;
+  obj["hitRate"] = lookups ? (float)stats.hits / lookups : 0;
+  obj["generated"] = stats.generated;
+  obj["fromExif"] = stats.fromExif;
+  obj["failed"] = stats.failed;
+  obj["cancelled"] = stats.cancelled;
+  obj["uncached"] = stats.uncached;
+  obj["cleared"] = stats.cleared;
+  obj["bytesRead"] = stats.bytesRead;
+  obj["avgDecodeMs"] = stats.generated ? stats.decodeMs / stats.generated : 0;
+  obj["avgEncodeMs"] = stats.generated ? stats.encodeMs / stats.generated : 0;
+  obj["lastMs"] = stats.lastMs;
+  obj["pending"] = thumbTasks ? uxQueueMessagesWaiting(thumbTasks) : 0;
+}
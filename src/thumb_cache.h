@@ -0,0 +1,53 @@
+#ifndef __THUMB_CACHE_H
+#define __THUMB_CACHE_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+#include <memory>
+#include <vector>
+#include "meta_cache.h"
+
+// Generated thumbnails, one file per (photo, size, mtime):
+//   /.thumbs/<path key>-<size>-<mtime>.jpg
+// A photo changed on the card gets a new name, so stale entries are never
+// served; they are left behind until POST /thumb/clear.
+#define THUMB_DIR "/.thumbs"
+#define THUMB_DEFAULT_SIZE 160
+#define THUMB_MIN_SIZE 32
+#define THUMB_MAX_SIZE 512
+#define THUMB_QUALITY 80
+// Pending /thumb requests; a gallery page asks for many at once
+#define THUMB_QUEUE_DEPTH 16
+#define THUMB_WORKER_STACK 8192
+#define THUMB_READ_CHUNK (16 * 1024)
+
+// One /thumb request handed to the thumbnail worker task
+struct ThumbTask
+{
+    String path;
+    int size;
+    volatile bool cancelled;
+    volatile bool done;
+    std::vector<uint8_t> jpeg; // valid once done, empty on error
+    String error;
+};
+
+bool thumbBegin(fs::FS &fs);
+
+// .jpg / .jpeg, also when stored compressed
+bool thumbIsImage(const String &path);
+
+// Path of the cached thumbnail if it exists and is current. Thumbnails of
+// encrypted photos are never cached.
+bool thumbLookup(const String &path, int size, const FsMeta &meta, String &cachePath);
+
+// Queue a task; false if the worker is busy with too many requests
+bool thumbQueue(const std::shared_ptr<ThumbTask> &task);
+
+// Has the worker remove every cached thumbnail; false if it is busy
+bool thumbClear();
+
+void thumbStatsJson(JsonObject obj);
+
+#endif
@@ -0,0 +1,846 @@
+#include "time_series.h"
+#include "checksum.h"
+#include "du_tree.h"
+#include "meta_cache.h"
+#include "sd_read_write.h"
+#include "sd_io_sched.h"
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "bg_job.h"
+#include <algorithm>
+
+struct TsTrailer
+{
+  char magic[4]; // "TSEG"
+  uint32_t blockCount;
+  uint32_t firstBlock;
+  uint32_t prevFooterBlock;
+  int64_t minTs;
+  int64_t maxTs;
+  uint32_t footerBlocks;
+  uint32_t points;
+  uint8_t reserved[20];
+  uint32_t crc;
+};
+static_assert(sizeof(TsTrailer) == TS_TRAILER_SIZE, "trailer layout");
+static_assert(sizeof(TsBlockEntry) == 24, "block entry layout");
+
+static uint32_t crc32Of(const void *data, size_t len)
+{
+  Hasher crc(HASH_CRC32);
+  crc.update((const uint8_t *)data, len);
+  return crc.crc32();
+}
+
+static void lockTake(void *lock)
+{
+  xSemaphoreTake((SemaphoreHandle_t)lock, portMAX_DELAY);
+}
+
+static bool lockTry(void *lock, uint32_t waitMs)
+{
+  return xSemaphoreTake((SemaphoreHandle_t)lock, pdMS_TO_TICKS(waitMs)) == pdTRUE;
+}
+
+static void lockGive(void *lock)
+{
+  xSemaphoreGive((SemaphoreHandle_t)lock);
+}
+
+static void wakeFlushTask();
+
+// ---- Block codec -----------------------------------------------------------
+
+static size_t putVarint(uint8_t *out, uint64_t v)
+{
+  size_t n = 0;
+  while (v >= 0x80)
+  {
+    out[n++] = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v)
+{
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7)
+  {
+    uint8_t b = *p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static uint64_t doubleBits(double v)
+{
+  uint64_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  return bits;
+}
+
+// Fill one block from sorted points; returns the points it holds
+static size_t encodeBlock(const TsPoint *pts, size_t n, bool delta, uint8_t *block)
+{
+  uint8_t *payload = block + TS_BLOCK_HEADER;
+  size_t cap = TS_BLOCK_SIZE - TS_BLOCK_HEADER;
+  size_t used = 0;
+  size_t count = 0;
+  int64_t prevTs = 0;
+  uint64_t prevBits = 0;
+
+  for (; count < n && count < 0xffff; count++)
+  {
+    uint8_t tmp[20];
+    size_t len;
+    if (delta)
+    {
+      int64_t d = pts[count].ts - prevTs;
+      len = putVarint(tmp, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+      uint64_t bits = doubleBits(pts[count].value);
+      len += putVarint(tmp + len, bits ^ prevBits);
+      prevTs = pts[count].ts;
+      prevBits = bits;
+    }
+    else
+    {
+      memcpy(tmp, &pts[count].ts, 8);
+      memcpy(tmp + 8, &pts[count].value, 8);
+      len = 16;
+    }
+    if (used + len > cap)
+    {
+      break;
+    }
+    memcpy(payload + used, tmp, len);
+    used += len;
+  }
+
+  memset(payload + used, 0, cap - used);
+  uint16_t count16 = count;
+  uint16_t used16 = used;
+  uint32_t crc = crc32Of(payload, used);
+  memset(block, 0, TS_BLOCK_HEADER);
+  memcpy(block, &count16, 2);
+  memcpy(block + 2, &used16, 2);
+  memcpy(block + 4, &crc, 4);
+  memcpy(block + 8, &pts[0].ts, 8);
+  memcpy(block + 16, &pts[count - 1].ts, 8);
+  return count;
+}
+
+static bool decodeBlock(const uint8_t *block, bool delta, std::vector<TsPoint> &out)
+{
+  uint16_t count, used;
+  uint32_t crc;
+  memcpy(&count, block, 2);
+  memcpy(&used, block + 2, 2);
+  memcpy(&crc, block + 4, 4);
+  const uint8_t *p = block + TS_BLOCK_HEADER;
+  if (used > TS_BLOCK_SIZE - TS_BLOCK_HEADER || crc32Of(p, used) != crc)
+  {
+    return false;
+  }
+
+  const uint8_t *end = p + used;
+  int64_t ts = 0;
+  uint64_t bits = 0;
+  out.clear();
+  out.reserve(count);
+  for (uint16_t i = 0; i < count; i++)
+  {
+    TsPoint pt;
+    if (delta)
+    {
+      uint64_t zz, x;
+      if (!getVarint(p, end, zz) || !getVarint(p, end, x))
+        return false;
+      ts += (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+      bits ^= x;
+      pt.ts = ts;
+      memcpy(&pt.value, &bits, 8);
+    }
+    else
+    {
+      if (end - p < 16)
+        return false;
+      memcpy(&pt.ts, p, 8);
+      memcpy(&pt.value, p + 8, 8);
+      p += 16;
+    }
+    out.push_back(pt);
+  }
+  return true;
+}
+
+// ---- File structure --------------------------------------------------------
+
+// Headers, trailers and blocks are read for a request that is waiting on them
+static bool readAt(File &file, uint64_t offset, void *buf, size_t len)
+{
+  {
+    SdIoScope io(SD_IO_SMALL);
+    if (!file.seek(offset))
+    {
+      return false;
+    }
+  }
+  return sdIoRead(file, (uint8_t *)buf, len, SD_IO_SMALL) == len;
+}
+
+static bool readHeader(File &file, uint32_t &flags)
+{
+  uint8_t header[12];
+  if (!readAt(file, 0, header, sizeof(header)) || memcmp(header, "TSD1", 4) != 0)
+  {
+    return false;
+  }
+  uint32_t blockSize;
+  memcpy(&blockSize, header + 4, 4);
+  memcpy(&flags, header + 8, 4);
+  return blockSize == TS_BLOCK_SIZE;
+}
+
+// Trailer of the footer that ends just before block `endBlock`
+static bool readTrailer(File &file, uint32_t endBlock, TsTrailer &t)
+{
+  if (endBlock < 2 ||
+      !readAt(file, (uint64_t)endBlock * TS_BLOCK_SIZE - TS_TRAILER_SIZE, &t, sizeof(t)))
+  {
+    return false;
+  }
+  return memcmp(t.magic, "TSEG", 4) == 0 && t.crc == crc32Of(&t, offsetof(TsTrailer, crc)) &&
+         t.firstBlock + t.blockCount + t.footerBlocks == endBlock;
+}
+
+static TsSegment segmentOf(const TsTrailer &t)
+{
+  TsSegment s;
+  s.firstBlock = t.firstBlock;
+  s.blockCount = t.blockCount;
+  s.footerBlock = t.firstBlock + t.blockCount;
+  s.footerBlocks = t.footerBlocks;
+  s.minTs = t.minTs;
+  s.maxTs = t.maxTs;
+  return s;
+}
+
+// Cached segment tables, extended incrementally when the file grows
+static struct TsTable
+{
+  String path;
+  uint32_t fileBlocks;
+  uint32_t flags;
+  uint32_t lastUse;
+  std::vector<TsSegment> segments; // file order
+} tables[TS_MAX_CACHED];
+static uint32_t tableTick = 0;
+static void *tsLock = nullptr;
+
+static void ensureLock()
+{
+  if (tsLock == nullptr)
+  {
+    tsLock = xSemaphoreCreateMutex();
+  }
+}
+
+// Copy the segment table of `path`; caller holds tsLock
+static bool loadTable(File &file, const String &path, uint32_t &flags, std::vector<TsSegment> &out)
+{
+  uint32_t fileBlocks = file.size() / TS_BLOCK_SIZE;
+  TsTable *table = nullptr;
+  for (TsTable &t : tables)
+  {
+    if (t.path == path)
+      table = &t;
+  }
+  if (table == nullptr)
+  {
+    table = &tables[0];
+    for (TsTable &t : tables)
+    {
+      if (t.lastUse < table->lastUse)
+        table = &t;
+    }
+    table->path = path;
+    table->fileBlocks = 0;
+    table->segments.clear();
+  }
+  table->lastUse = ++tableTick;
+
+  // A file that shrank or was replaced is read again from the start
+  TsTrailer last;
+  if (table->fileBlocks > 1 && (fileBlocks < table->fileBlocks || !readTrailer(file, table->fileBlocks, last)))
+  {
+    table->fileBlocks = 0;
+  }
+  if (table->fileBlocks == 0)
+  {
+    if (!readHeader(file, table->flags))
+    {
+      table->path = "";
+      return false;
+    }
+    table->fileBlocks = 1;
+    table->segments.clear();
+  }
+
+  // Walk back from the newest trailer to the last segment already known
+  if (fileBlocks > table->fileBlocks)
+  {
+    // Segments are contiguous: the previous trailer ends where this
+    // segment's data starts
+    std::vector<TsSegment> added;
+    uint32_t end = fileBlocks;
+    TsTrailer t;
+    while (end > table->fileBlocks && readTrailer(file, end, t))
+    {
+      added.push_back(segmentOf(t));
+      end = t.firstBlock;
+    }
+    // A segment still being written leaves the table as it was
+    if (!added.empty() && end == table->fileBlocks)
+    {
+      table->segments.insert(table->segments.end(), added.rbegin(), added.rend());
+      table->fileBlocks = added.front().footerBlock + added.front().footerBlocks;
+    }
+  }
+
+  flags = table->flags;
+  out = table->segments;
+  return true;
+}
+
+// ---- Writer ----------------------------------------------------------------
+
+TimeSeriesWriter::TimeSeriesWriter()
+    : fs(nullptr), flags(0), memtable(nullptr), count(0), capacity(0), prevFooterBlock(0), fileBlocks(0),
+      firstPointMs(0), lastUseMs(0), lock(nullptr)
+{
+}
+
+TimeSeriesWriter::~TimeSeriesWriter()
+{
+  end();
+}
+
+bool TimeSeriesWriter::begin(fs::FS &fs, const String &path, bool delta, size_t memtablePoints)
+{
+  this->fs = &fs;
+  this->path = path;
+  capacity = memtablePoints;
+  count = 0;
+  lastUseMs = millis();
+  memtable = (TsPoint *)heap_caps_malloc(capacity * sizeof(TsPoint), MALLOC_CAP_SPIRAM);
+  if (memtable == nullptr)
+  {
+    capacity = 1024;
+    memtable = (TsPoint *)malloc(capacity * sizeof(TsPoint));
+  }
+  if (memtable == nullptr)
+  {
+    return false;
+  }
+  // Registered for as long as the memtable exists, so defrag leaves the
+  // file alone between segment writes
+  openWriterAdd(path);
+  if (lock == nullptr)
+  {
+    lock = xSemaphoreCreateMutex();
+  }
+
+  FsMeta meta;
+  if (!g_metaCache.stat(path, meta) || meta.size == 0)
+  {
+    // New series: the header takes the first block
+    uint8_t *header = (uint8_t *)calloc(1, TS_BLOCK_SIZE);
+    if (header == nullptr)
+    {
+      return false;
+    }
+    flags = delta ? TS_FLAG_DELTA : 0;
+    uint32_t blockSize = TS_BLOCK_SIZE;
+    memcpy(header, "TSD1", 4);
+    memcpy(header + 4, &blockSize, 4);
+    memcpy(header + 8, &flags, 4);
+    fsCacheInvalidate(path);
+    File file = fs.open(path, FILE_WRITE);
+    bool ok = file && sdIoWrite(file, header, TS_BLOCK_SIZE, SD_IO_SMALL) == TS_BLOCK_SIZE;
+    file.close();
+    free(header);
+    if (!ok)
+    {
+      return false;
+    }
+    fsCacheInvalidate(path);
+    duFileAdded(path, TS_BLOCK_SIZE);
+    prevFooterBlock = 0;
+    fileBlocks = 1;
+    return true;
+  }
+
+  File file = fs.open(path, FILE_READ);
+  if (!file || !readHeader(file, flags))
+  {
+    Serial.printf("Time series %s: bad header\n", path.c_str());
+    return false;
+  }
+
+  // Find the newest complete segment; a torn one at the end is cut off
+  uint32_t blocks = file.size() / TS_BLOCK_SIZE;
+  TsTrailer t;
+  while (blocks > 1 && !readTrailer(file, blocks, t))
+  {
+    blocks--;
+  }
+  file.close();
+  prevFooterBlock = blocks > 1 ? t.firstBlock + t.blockCount : 0;
+  fileBlocks = max(blocks, (uint32_t)1);
+  if ((uint64_t)fileBlocks * TS_BLOCK_SIZE != meta.size)
+  {
+    Serial.printf("Time series %s: dropping %u bytes of an incomplete segment\n", path.c_str(),
+                  meta.size - fileBlocks * TS_BLOCK_SIZE);
+    fsCacheInvalidate(path);
+    if (truncateFile(path.c_str(), (size_t)fileBlocks * TS_BLOCK_SIZE))
+    {
+      duFileRemoved(path, meta.size);
+      duFileAdded(path, (uint64_t)fileBlocks * TS_BLOCK_SIZE);
+    }
+  }
+  return true;
+}
+
+void TimeSeriesWriter::end()
+{
+  if (memtable)
+  {
+    flush();
+    free(memtable);
+    memtable = nullptr;
+    openWriterRemove(path);
+  }
+}
+
+TsAddResult TimeSeriesWriter::add(int64_t ts, double value, uint32_t waitMs)
+{
+  if (memtable == nullptr)
+  {
+    return TS_ADD_FAILED;
+  }
+  // Held by the flush task while it writes a segment
+  if (!lockTry(lock, waitMs))
+  {
+    return TS_ADD_BUSY;
+  }
+  lastUseMs = millis();
+  if (count == capacity)
+  {
+    // A failed segment write keeps the points; the flush task retries
+    lockGive(lock);
+    wakeFlushTask();
+    return TS_ADD_BUSY;
+  }
+  if (count == 0)
+  {
+    firstPointMs = lastUseMs;
+  }
+  memtable[count].ts = ts;
+  memtable[count].value = value;
+  count++;
+  bool full = count == capacity;
+  lockGive(lock);
+  if (full)
+  {
+    wakeFlushTask();
+  }
+  return TS_ADD_OK;
+}
+
+bool TimeSeriesWriter::flushDue(uint32_t now) const
+{
+  return count > 0 && (count == capacity || now - firstPointMs >= TS_FLUSH_INTERVAL_MS);
+}
+
+bool TimeSeriesWriter::flush()
+{
+  if (memtable == nullptr)
+  {
+    return false;
+  }
+  lockTake(lock);
+  bool ok = count == 0 || writeSegment();
+  lockGive(lock);
+  return ok;
+}
+
+void TimeSeriesWriter::collect(int64_t from, int64_t to, std::vector<TsPoint> &out)
+{
+  if (memtable == nullptr)
+  {
+    return;
+  }
+  lockTake(lock);
+  for (size_t i = 0; i < count; i++)
+  {
+    if (memtable[i].ts >= from && memtable[i].ts <= to)
+      out.push_back(memtable[i]);
+  }
+  lockGive(lock);
+}
+
+// Caller holds the writer lock
+bool TimeSeriesWriter::writeSegment()
+{
+  std::sort(memtable, memtable + count, [](const TsPoint &a, const TsPoint &b) { return a.ts < b.ts; });
+
+  uint8_t *block = (uint8_t *)heap_caps_malloc(TS_BLOCK_SIZE, MALLOC_CAP_SPIRAM);
+  if (block == nullptr)
+  {
+    return false;
+  }
+  fsCacheInvalidate(path);
+  File file = fs->open(path, FILE_APPEND);
+  if (!file)
+  {
+    free(block);
+    return false;
+  }
+
+  std::vector<TsBlockEntry> entries;
+  bool ok = true;
+  for (size_t done = 0; done < count && ok;)
+  {
+    size_t n = encodeBlock(memtable + done, count - done, flags & TS_FLAG_DELTA, block);
+    TsBlockEntry e = {memtable[done].ts, memtable[done + n - 1].ts, (uint32_t)n, 0};
+    entries.push_back(e);
+    ok = sdIoWrite(file, block, TS_BLOCK_SIZE, SD_IO_BACKGROUND) == TS_BLOCK_SIZE;
+    done += n;
+  }
+
+  // Footer: block entries, then the trailer at the end of its last block
+  size_t footerBytes = entries.size() * sizeof(TsBlockEntry) + TS_TRAILER_SIZE;
+  uint32_t footerBlocks = (footerBytes + TS_BLOCK_SIZE - 1) / TS_BLOCK_SIZE;
+  TsTrailer t;
+  memset(&t, 0, sizeof(t));
+  memcpy(t.magic, "TSEG", 4);
+  t.blockCount = entries.size();
+  t.firstBlock = fileBlocks;
+  t.prevFooterBlock = prevFooterBlock;
+  t.minTs = memtable[0].ts;
+  t.maxTs = memtable[count - 1].ts;
+  t.footerBlocks = footerBlocks;
+  t.points = count;
+  t.crc = crc32Of(&t, offsetof(TsTrailer, crc));
+
+  const uint8_t *entryBytes = (const uint8_t *)entries.data();
+  size_t entryLen = entries.size() * sizeof(TsBlockEntry);
+  for (uint32_t b = 0; b < footerBlocks && ok; b++)
+  {
+    memset(block, 0, TS_BLOCK_SIZE);
+    size_t start = (size_t)b * TS_BLOCK_SIZE;
+    if (start < entryLen)
+    {
+      memcpy(block, entryBytes + start, min((size_t)TS_BLOCK_SIZE, entryLen - start));
+    }
+    if (b == footerBlocks - 1)
+    {
+      memcpy(block + TS_BLOCK_SIZE - TS_TRAILER_SIZE, &t, sizeof(t));
+    }
+    ok = sdIoWrite(file, block, TS_BLOCK_SIZE, SD_IO_BACKGROUND) == TS_BLOCK_SIZE;
+  }
+  file.close();
+  free(block);
+  fsCacheInvalidate(path);
+
+  if (!ok)
+  {
+    // Cut the torn segment off so the next one starts at fileBlocks
+    Serial.printf("Time series %s: segment write failed\n", path.c_str());
+    truncateFile(path.c_str(), (size_t)fileBlocks * TS_BLOCK_SIZE);
+    fsCacheInvalidate(path);
+    return false;
+  }
+  uint32_t blocks = entries.size() + footerBlocks;
+  duFileGrown(path, (uint64_t)blocks * TS_BLOCK_SIZE);
+  prevFooterBlock = fileBlocks + entries.size();
+  fileBlocks += blocks;
+  Serial.printf("Time series %s: %u points in %u blocks\n", path.c_str(), count, blocks);
+  count = 0;
+  return true;
+}
+
+// ---- Registry --------------------------------------------------------------
+
+// Writers are only deleted by the flush task, after leaving the table
+// under tsLock; everyone else uses them with tsLock held
+static TimeSeriesWriter *writers[TS_MAX_WRITERS];
+static bool evicting[TS_MAX_WRITERS]; // handed to the flush task to close
+static volatile bool flushAllRequested = false;
+static TaskHandle_t flushTask = nullptr;
+
+static void wakeFlushTask()
+{
+  if (flushTask)
+  {
+    xTaskNotifyGive(flushTask);
+  }
+}
+
+static void flushTaskEntry(void *)
+{
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+    bool all = flushAllRequested;
+    flushAllRequested = false;
+
+    for (int i = 0; i < TS_MAX_WRITERS; i++)
+    {
+      lockTake(tsLock);
+      TimeSeriesWriter *w = writers[i];
+      bool close = w && (evicting[i] || w->idleMs(millis()) >= TS_WRITER_IDLE_MS);
+      lockGive(tsLock);
+      if (w == nullptr)
+      {
+        continue;
+      }
+      // Written while still registered, so cursors see the points either
+      // in the memtable or in the file
+      bool flushed = true;
+      if (close || all || w->flushDue(millis()))
+      {
+        flushed = w->flush();
+      }
+      // A writer whose points cannot be written stays open and is retried
+      if (!close || !flushed)
+      {
+        continue;
+      }
+
+      lockTake(tsLock);
+      writers[i] = nullptr;
+      evicting[i] = false;
+      lockGive(tsLock);
+      // Writes what was added since the flush above
+      w->end();
+      delete w;
+    }
+  }
+}
+
+static bool ensureFlushTask()
+{
+  if (flushTask == nullptr &&
+      xTaskCreatePinnedToCore(flushTaskEntry, "ts_flush", TS_FLUSH_TASK_STACK, NULL, BG_JOB_PRIORITY, &flushTask,
+                              tskNO_AFFINITY) != pdPASS)
+  {
+    flushTask = nullptr;
+    return false;
+  }
+  return true;
+}
+
+TsAddResult tsAdd(fs::FS &fs, const String &path, int64_t ts, double value)
+{
+  ensureLock();
+  if (!ensureFlushTask())
+  {
+    return TS_ADD_FAILED;
+  }
+  if (!lockTry(tsLock, TS_ADD_WAIT_MS))
+  {
+    return TS_ADD_BUSY;
+  }
+
+  uint32_t now = millis();
+  TimeSeriesWriter *found = nullptr;
+  int freeSlot = -1;
+  int lru = -1;
+  for (int i = 0; i < TS_MAX_WRITERS; i++)
+  {
+    if (writers[i] && writers[i]->getPath() == path)
+      found = writers[i];
+    else if (!writers[i] && freeSlot < 0)
+      freeSlot = i;
+    else if (writers[i] && !evicting[i] && (lru < 0 || writers[i]->idleMs(now) > writers[lru]->idleMs(now)))
+      lru = i;
+  }
+
+  TsAddResult result = TS_ADD_BUSY;
+  if (found)
+  {
+    result = found->add(ts, value);
+  }
+  else if (freeSlot >= 0)
+  {
+    TimeSeriesWriter *w = new TimeSeriesWriter();
+    if (w->begin(fs, path))
+    {
+      writers[freeSlot] = w;
+      result = w->add(ts, value);
+    }
+    else
+    {
+      delete w;
+      result = TS_ADD_FAILED;
+    }
+  }
+  else
+  {
+    // Make room: the least recently used writer is flushed and closed
+    if (lru >= 0)
+    {
+      evicting[lru] = true;
+    }
+    wakeFlushTask();
+  }
+  lockGive(tsLock);
+  return result;
+}
+
+void tsFlushAll()
+{
+  flushAllRequested = true;
+  wakeFlushTask();
+}
+
+// ---- Cursor ----------------------------------------------------------------
+
+bool TsCursor::open(fs::FS &fs, const String &path, int64_t from, int64_t to)
+{
+  this->fs = &fs;
+  this->path = path;
+  this->from = from;
+  this->to = to;
+  file = fs.open(path, FILE_READ);
+  if (!file)
+  {
+    return false;
+  }
+
+  ensureLock();
+  std::vector<TsSegment> all;
+  lockTake(tsLock);
+  bool ok = loadTable(file, path, flags, all);
+  // Points not written yet come last; collected under tsLock so the
+  // writer cannot be closed meanwhile
+  pending.clear();
+  for (TimeSeriesWriter *w : writers)
+  {
+    if (ok && w && w->getPath() == path)
+      w->collect(from, to, pending);
+  }
+  lockGive(tsLock);
+  if (!ok)
+  {
+    return false;
+  }
+
+  for (const TsSegment &s : all)
+  {
+    if (s.maxTs >= from && s.minTs <= to)
+      segments.push_back(s);
+  }
+  std::sort(segments.begin(), segments.end(), [](const TsSegment &a, const TsSegment &b) { return a.minTs < b.minTs; });
+  segment = 0;
+  entries.clear();
+  block = 0;
+
+  points.clear();
+  point = 0;
+  std::sort(pending.begin(), pending.end(), [](const TsPoint &a, const TsPoint &b) { return a.ts < b.ts; });
+  return true;
+}
+
+bool TsCursor::loadSegment()
+{
+  const TsSegment &s = segments[segment];
+  entries.resize(s.blockCount);
+  if (!readAt(file, (uint64_t)s.footerBlock * TS_BLOCK_SIZE, entries.data(), s.blockCount * sizeof(TsBlockEntry)))
+  {
+    return false;
+  }
+  blocksRead++;
+
+  // Blocks of a segment are sorted: binary search the first one that can
+  // hold `from`
+  size_t lo = 0, hi = entries.size();
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (entries[mid].maxTs < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  block = lo;
+  return true;
+}
+
+bool TsCursor::loadBlock(uint32_t fileBlock)
+{
+  std::vector<uint8_t> buf(TS_BLOCK_SIZE);
+  blocksRead++;
+  return readAt(file, (uint64_t)fileBlock * TS_BLOCK_SIZE, buf.data(), TS_BLOCK_SIZE) &&
+         decodeBlock(buf.data(), flags & TS_FLAG_DELTA, points);
+}
+
+bool TsCursor::next(TsPoint &out)
+{
+  for (;;)
+  {
+    while (point < points.size())
+    {
+      const TsPoint &p = points[point++];
+      if (p.ts >= from && p.ts <= to)
+      {
+        out = p;
+        return true;
+      }
+    }
+    points.clear();
+    point = 0;
+
+    if (segment >= segments.size())
+    {
+      if (pending.empty())
+      {
+        return false;
+      }
+      points.swap(pending);
+      continue;
+    }
+    if (entries.empty() && !loadSegment())
+    {
+      segment++;
+      continue;
+    }
+    if (block >= entries.size() || entries[block].minTs > to)
+    {
+      segment++;
+      entries.clear();
+      continue;
+    }
+    const TsSegment &s = segments[segment];
+    if (!loadBlock(s.firstBlock + block))
+    {
+      Serial.printf("Time series %s: bad block %u\n", path.c_str(), s.firstBlock + block);
+    }
+    block++;
+  }
+}
+
+void TsCursor::close()
+{
+  if (file)
+  {
+    file.close();
+  }
+}
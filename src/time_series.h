@@ -0,0 +1,158 @@
+#ifndef __TIME_SERIES_H
+#define __TIME_SERIES_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include <ArduinoJson.h>
+#include <vector>
+
+// Segment-based time-series file (.tsd). All offsets are multiples of
+// TS_BLOCK_SIZE so every card write is block aligned.
+//
+//   header block   "TSD1", u32 block size, u32 flags (TS_FLAG_DELTA)
+//   segment        data blocks, then the footer: one TsBlockEntry per
+//                  block and a TsTrailer in the last 64 bytes of the
+//                  footer's final block
+//
+// A data block starts with a 32-byte header (count, payload bytes, CRC32,
+// min/max timestamp) and decodes on its own: points are 16 bytes raw, or
+// with TS_FLAG_DELTA a zigzag varint timestamp delta plus a varint of the
+// value XORed with the previous one. Each trailer points to the previous
+// footer, so readers walk the chain once and cache the segment table;
+// afterwards a range query reads one footer per overlapping segment and
+// only the blocks whose [min, max] intersects the range.
+#define TS_BLOCK_SIZE 4096
+#define TS_BLOCK_HEADER 32
+#define TS_TRAILER_SIZE 64
+#define TS_FLAG_DELTA 1
+// Points buffered in PSRAM before a segment is written (16 bytes each)
+#define TS_MEMTABLE_POINTS 32768
+// Series with an open writer / a cached segment table
+#define TS_MAX_WRITERS 4
+#define TS_MAX_CACHED 4
+#define TS_DEFAULT_LIMIT 10000
+// The flush task writes a memtable whose oldest point is this old, and
+// closes writers that have not been used for TS_WRITER_IDLE_MS
+#define TS_FLUSH_INTERVAL_MS 10000
+#define TS_WRITER_IDLE_MS 60000
+#define TS_FLUSH_TASK_STACK 4096
+// Longest tsAdd() waits for a writer before answering TS_ADD_BUSY
+#define TS_ADD_WAIT_MS 20
+
+enum TsAddResult
+{
+    TS_ADD_OK,
+    TS_ADD_BUSY,  // memtable being written or all writers in use: retry later
+    TS_ADD_FAILED // the series cannot be opened
+};
+
+struct TsPoint
+{
+    int64_t ts;
+    double value;
+};
+
+struct TsBlockEntry
+{
+    int64_t minTs;
+    int64_t maxTs;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct TsSegment
+{
+    uint32_t firstBlock; // file offset / TS_BLOCK_SIZE
+    uint32_t blockCount;
+    uint32_t footerBlock;
+    uint32_t footerBlocks;
+    int64_t minTs;
+    int64_t maxTs;
+};
+
+// Buffers points in a PSRAM memtable and writes them as one sorted segment
+// on flush(). Points may arrive out of order; each segment is sorted,
+// segments may overlap. add() never touches the card: a full memtable
+// refuses points until it has been flushed.
+class TimeSeriesWriter
+{
+private:
+    fs::FS *fs;
+    String path;
+    uint32_t flags;
+    TsPoint *memtable;
+    size_t count;
+    size_t capacity;
+    uint32_t prevFooterBlock; // 0 = no segment yet
+    uint32_t fileBlocks;
+    uint32_t firstPointMs; // when the memtable got its oldest point
+    uint32_t lastUseMs;
+    void *lock;
+
+    bool writeSegment();
+
+public:
+    TimeSeriesWriter();
+    ~TimeSeriesWriter();
+
+    // Creates the file if needed; `delta` only applies to a new file
+    bool begin(fs::FS &fs, const String &path, bool delta = true, size_t memtablePoints = TS_MEMTABLE_POINTS);
+    void end();
+
+    // Waits at most waitMs for a flush in progress
+    TsAddResult add(int64_t ts, double value, uint32_t waitMs = TS_ADD_WAIT_MS);
+    bool flush();
+
+    const String &getPath() const { return path; }
+    // Memtable full, or its oldest point older than TS_FLUSH_INTERVAL_MS
+    bool flushDue(uint32_t now) const;
+    uint32_t idleMs(uint32_t now) const { return now - lastUseMs; }
+
+    // Buffered points within [from, to]
+    void collect(int64_t from, int64_t to, std::vector<TsPoint> &out);
+};
+
+// Streams the points of [from, to] in segment order, reading blocks on demand
+class TsCursor
+{
+private:
+    fs::FS *fs;
+    String path;
+    int64_t from;
+    int64_t to;
+    uint32_t flags;
+    File file;
+    std::vector<TsSegment> segments;
+    size_t segment;
+    std::vector<TsBlockEntry> entries;
+    size_t block;
+    std::vector<TsPoint> points;
+    size_t point;
+    std::vector<TsPoint> pending; // from the writer's memtable
+    uint32_t blocksRead;
+
+    bool loadSegment();
+    bool loadBlock(uint32_t fileBlock);
+
+public:
+    TsCursor() : fs(nullptr), from(0), to(0), flags(0), segment(0), block(0), point(0), blocksRead(0) {}
+
+    // Also returns the points still in an open writer's memtable
+    bool open(fs::FS &fs, const String &path, int64_t from, int64_t to);
+    bool next(TsPoint &out);
+    void close();
+
+    uint32_t getBlocksRead() const { return blocksRead; }
+    size_t getSegmentCount() const { return segments.size(); }
+};
+
+// Adds a point to the shared writer of `path`, opened on first use. At most
+// TS_MAX_WRITERS are open; when all are in use the least recently used one
+// is handed to the flush task to be closed and TS_ADD_BUSY is returned. The
+// flush task writes due memtables and closes idle writers, so callers on
+// the network task never wait for a segment write.
+TsAddResult tsAdd(fs::FS &fs, const String &path, int64_t ts, double value);
+// Asks the flush task to write every memtable now
+void tsFlushAll();
+
+#endif
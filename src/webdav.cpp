@@ -0,0 +1,1236 @@
+#include "webdav.h"
+#include "SD_MMC.h"
+#include "bg_job.h"
+#include "checksum.h"
+#include "checksum_index.h"
+#include "deferred_response.h"
+#include "du_tree.h"
+#include "file_crypt.h"
+#include "egress_shaper.h"
+#include "async_io_service.h"
+#include "fs_events.h"
+#include "lz4_store.h"
+#include "sd_io_sched.h"
+#include "meta_cache.h"
+#include "sd_read_write.h"
+#include <esp_random.h>
+#include <time.h>
+#include <memory>
+#include <vector>
+
+// Same staging and preallocation rules as /upload
+#define STAGING_SUFFIX ".part"
+#define PREALLOCATE_MIN (256 * 1024)
+
+static const char *xmlHeader = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+static const char *supportedLock = "<D:supportedlock><D:lockentry><D:lockscope><D:exclusive/></D:lockscope>"
+                                   "<D:locktype><D:write/></D:locktype></D:lockentry></D:supportedlock>";
+
+static DirPager *dirPager = nullptr;
+
+static struct
+{
+  uint32_t requests;
+  uint32_t propfinds;
+  uint32_t gets;
+  uint32_t puts;
+  uint32_t errors;
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+  uint32_t putMs;
+  uint32_t getMs;
+} stats;
+
+// ---- Paths -----------------------------------------------------------------
+
+// "/dav/a b/" -> "/a b" (the server has already decoded the URL)
+static String localPath(const String &url)
+{
+  String path = url.substring(strlen(WEBDAV_PREFIX));
+  while (path.length() > 1 && path.endsWith("/"))
+  {
+    path.remove(path.length() - 1);
+  }
+  return path.length() ? path : "/";
+}
+
+static String parentPath(const String &path)
+{
+  int slash = path.lastIndexOf('/');
+  return slash <= 0 ? "/" : path.substring(0, slash);
+}
+
+static String baseName(const String &path)
+{
+  return path.substring(path.lastIndexOf('/') + 1);
+}
+
+static int hexValue(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static String urlDecode(const String &text)
+{
+  String out;
+  out.reserve(text.length());
+  for (unsigned i = 0; i < text.length(); i++)
+  {
+    int hi, lo;
+    if (text[i] == '%' && i + 2 < text.length() && (hi = hexValue(text[i + 1])) >= 0 &&
+        (lo = hexValue(text[i + 2])) >= 0)
+    {
+      out += (char)(hi * 16 + lo);
+      i += 2;
+    }
+    else
+    {
+      out += text[i];
+    }
+  }
+  return out;
+}
+
+// Percent-encodes everything but unreserved characters and '/'
+static void appendHref(String &out, const String &path, bool isDirectory)
+{
+  static const char *hex = "0123456789ABCDEF";
+  out += WEBDAV_PREFIX;
+  for (unsigned i = 0; i < path.length(); i++)
+  {
+    uint8_t c = path[i];
+    if (isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' || c == '~')
+    {
+      out += (char)c;
+    }
+    else
+    {
+      out += '%';
+      out += hex[c >> 4];
+      out += hex[c & 15];
+    }
+  }
+  if (isDirectory && !out.endsWith("/"))
+  {
+    out += '/';
+  }
+}
+
+static void appendXmlText(String &out, const String &text)
+{
+  for (unsigned i = 0; i < text.length(); i++)
+  {
+    char c = text[i];
+    if (c == '&')
+      out += "&amp;";
+    else if (c == '<')
+      out += "&lt;";
+    else if (c == '>')
+      out += "&gt;";
+    else
+      out += c;
+  }
+}
+
+static String formatTime(time_t t, const char *format)
+{
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char text[40];
+  strftime(text, sizeof(text), format, &tm);
+  return text;
+}
+
+static String httpDate(time_t t)
+{
+  return formatTime(t, "%a, %d %b %Y %H:%M:%S GMT");
+}
+
+static String etagFor(uint32_t size, time_t mtime)
+{
+  char etag[32];
+  snprintf(etag, sizeof(etag), "\"%lx-%lx\"", (unsigned long)size, (unsigned long)mtime);
+  return etag;
+}
+
+// Full URL or absolute path of the Destination header, inside the share
+static bool destinationPath(AsyncWebServerRequest *request, String &path)
+{
+  if (!request->hasHeader("Destination"))
+  {
+    return false;
+  }
+  String dest = request->header("Destination");
+  int scheme = dest.indexOf("://");
+  if (scheme >= 0)
+  {
+    int slash = dest.indexOf('/', scheme + 3);
+    dest = slash >= 0 ? dest.substring(slash) : "/";
+  }
+  dest = urlDecode(dest);
+  if (dest != WEBDAV_PREFIX && !dest.startsWith(WEBDAV_PREFIX "/"))
+  {
+    return false;
+  }
+  path = localPath(dest);
+  return true;
+}
+
+// Stored size minus the header of encrypted files
+static uint32_t contentSize(File &file, const String &path, uint32_t size)
+{
+  if (size < CRYPT_HEADER_SIZE || !cryptIsEncryptedPath(path))
+  {
+    return size;
+  }
+  FileCipher cipher;
+  return cryptProbe(file, cipher) == CRYPT_ENCRYPTED ? size - CRYPT_HEADER_SIZE : size;
+}
+
+// ---- PROPFIND --------------------------------------------------------------
+
+static void appendResponse(String &out, const String &path, bool isDirectory, uint32_t size, time_t mtime)
+{
+  out += "<D:response><D:href>";
+  appendHref(out, path, isDirectory);
+  out += "</D:href><D:propstat><D:prop><D:displayname>";
+  appendXmlText(out, baseName(path));
+  out += "</D:displayname>";
+  if (isDirectory)
+  {
+    out += "<D:resourcetype><D:collection/></D:resourcetype>";
+  }
+  else
+  {
+    out += "<D:resourcetype/><D:getcontentlength>";
+    out += size;
+    out += "</D:getcontentlength><D:getetag>";
+    appendXmlText(out, etagFor(size, mtime));
+    out += "</D:getetag>";
+  }
+  out += "<D:getlastmodified>";
+  out += httpDate(mtime);
+  out += "</D:getlastmodified><D:creationdate>";
+  out += formatTime(mtime, "%Y-%m-%dT%H:%M:%SZ");
+  out += "</D:creationdate>";
+  out += supportedLock;
+  out += "</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>\n";
+}
+
+// Produces the multistatus body one <response> at a time
+class PropfindStream
+{
+private:
+  enum Stage
+  {
+    SELF,
+    CHILDREN,
+    FOOTER,
+    DONE
+  };
+
+  String path;
+  bool isDirectory;
+  uint32_t size;
+  time_t mtime;
+  bool depthOne;
+  File dir;
+  Stage stage;
+  String chunk;
+  size_t chunkPos;
+
+  bool next()
+  {
+    chunk = "";
+    chunkPos = 0;
+    // Listings are what a mounted share's file manager waits on
+    SdIoScope io(SD_IO_INTERACTIVE);
+    switch (stage)
+    {
+    case SELF:
+      chunk += xmlHeader;
+      chunk += "<D:multistatus xmlns:D=\"DAV:\">\n";
+      appendResponse(chunk, path, isDirectory, size, mtime);
+      stage = isDirectory && depthOne ? CHILDREN : FOOTER;
+      if (stage == CHILDREN)
+      {
+        dir = SD_MMC.open(path);
+      }
+      return true;
+    case CHILDREN:
+    {
+      File entry = dir ? dir.openNextFile() : File();
+      if (!entry)
+      {
+        dir.close();
+        stage = FOOTER;
+        return next();
+      }
+      String entryPath = entry.path();
+      bool entryIsDir = entry.isDirectory();
+      uint32_t entrySize = entryIsDir ? 0 : contentSize(entry, entryPath, entry.size());
+      appendResponse(chunk, entryPath, entryIsDir, entrySize, entry.getLastWrite());
+      entry.close();
+      return true;
+    }
+    case FOOTER:
+      chunk = "</D:multistatus>\n";
+      stage = DONE;
+      return true;
+    default:
+      return false;
+    }
+  }
+
+public:
+  PropfindStream(const String &path, bool isDirectory, uint32_t size, time_t mtime, bool depthOne)
+      : path(path), isDirectory(isDirectory), size(size), mtime(mtime), depthOne(depthOne), stage(SELF),
+        chunkPos(0)
+  {
+  }
+
+  ~PropfindStream()
+  {
+    if (dir)
+    {
+      dir.close();
+    }
+  }
+
+  size_t fill(uint8_t *buffer, size_t maxLen)
+  {
+    size_t written = 0;
+    while (written < maxLen)
+    {
+      if (chunkPos >= chunk.length() && !next())
+      {
+        break;
+      }
+      size_t n = min(maxLen - written, (size_t)(chunk.length() - chunkPos));
+      memcpy(buffer + written, chunk.c_str() + chunkPos, n);
+      written += n;
+      chunkPos += n;
+    }
+    return written;
+  }
+};
+
+static void handlePropfind(AsyncWebServerRequest *request, const String &path)
+{
+  FsMeta meta;
+  if (!g_metaCache.stat(path, meta))
+  {
+    request->send(404);
+    return;
+  }
+  uint32_t size = meta.size;
+  if (!meta.isDirectory)
+  {
+    File file = SD_MMC.open(path);
+    size = contentSize(file, path, meta.size);
+    file.close();
+  }
+  stats.propfinds++;
+
+  // No Depth header means infinity, which is served as 1
+  bool depthOne = !(request->hasHeader("Depth") && request->header("Depth") == "0");
+  std::shared_ptr<PropfindStream> stream =
+      std::make_shared<PropfindStream>(path, meta.isDirectory, size, meta.mtime, depthOne);
+  AsyncWebServerResponse *response = request->beginChunkedResponse(
+      "application/xml; charset=utf-8",
+      [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t { return stream->fill(buffer, maxLen); });
+  response->setCode(207);
+  request->send(response);
+}
+
+// ---- GET -------------------------------------------------------------------
+
+// Single "bytes=a-b", "bytes=a-" or "bytes=-n" range. Returns 0 without a
+// Range header, 1 for a valid range, a status code otherwise.
+static int parseRange(AsyncWebServerRequest *request, uint64_t total, uint64_t &first, uint64_t &last)
+{
+  first = 0;
+  last = total ? total - 1 : 0;
+  if (!request->hasHeader("Range"))
+  {
+    return 0;
+  }
+  String range = request->header("Range");
+  int dash = range.indexOf('-');
+  if (!range.startsWith("bytes=") || dash < 0 || range.indexOf(',') >= 0)
+  {
+    return 416;
+  }
+  String from = range.substring(6, dash);
+  String to = range.substring(dash + 1);
+  if (from.length() == 0)
+  {
+    first = total - min((uint64_t)strtoull(to.c_str(), nullptr, 10), total);
+  }
+  else
+  {
+    first = strtoull(from.c_str(), nullptr, 10);
+    if (to.length() > 0)
+    {
+      last = min((uint64_t)strtoull(to.c_str(), nullptr, 10), last);
+    }
+  }
+  return total == 0 || first > last ? 416 : 1;
+}
+
+static void handleGet(AsyncWebServerRequest *request, const String &path)
+{
+  FsMeta meta;
+  if (!g_metaCache.stat(path, meta))
+  {
+    request->send(404);
+    return;
+  }
+  if (meta.isDirectory)
+  {
+    request->send(405, "text/plain", "Use PROPFIND to list a collection");
+    return;
+  }
+
+  FileLease *lease = new FileLease(g_handleCache.acquire(path));
+  if (!lease->file)
+  {
+    delete lease;
+    request->send(500, "text/plain", "Failed to open file for reading");
+    return;
+  }
+  std::shared_ptr<FileCipher> cipher = std::make_shared<FileCipher>();
+  CryptState crypt = cryptProbe(lease->file, *cipher);
+  if (crypt == CRYPT_LOCKED)
+  {
+    g_handleCache.release(*lease);
+    delete lease;
+    request->send(403, "text/plain", "File is encrypted with a key this device does not have");
+    return;
+  }
+  if (crypt == CRYPT_PLAIN)
+  {
+    cipher.reset();
+  }
+  size_t skip = cipher ? CRYPT_HEADER_SIZE : 0;
+  uint64_t total = meta.size - skip;
+
+  uint64_t first, last;
+  int range = parseRange(request, total, first, last);
+  if (range > 1)
+  {
+    g_handleCache.release(*lease);
+    delete lease;
+    AsyncWebServerResponse *response = request->beginResponse(range, "text/plain", "Range not satisfiable");
+    response->addHeader("Content-Range", "bytes */" + String((unsigned long)total));
+    request->send(response);
+    return;
+  }
+
+  size_t length = total ? last - first + 1 : 0;
+  // Read ahead by the async I/O workers; the lease goes back after the last read
+  std::shared_ptr<AsyncReadStream> stream = std::make_shared<AsyncReadStream>();
+  if (!stream->begin(lease->file, skip + first, length, sdIoReadClass(length), [lease]() {
+        g_handleCache.release(*lease);
+        delete lease;
+      }))
+  {
+    g_handleCache.release(*lease);
+    delete lease;
+    request->send(503, "text/plain", "Too many open transfers");
+    return;
+  }
+
+  std::shared_ptr<EgressFlow> egress = std::make_shared<EgressFlow>(request, path, egressWeight(request));
+  if (!egress->admitted())
+  {
+    // The stream gives the lease back as it goes out of scope
+    AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Too many downloads");
+    response->addHeader("Retry-After", "1");
+    request->send(response);
+    return;
+  }
+  stats.gets++;
+  std::shared_ptr<size_t> sent = std::make_shared<size_t>(0);
+  uint32_t startTime = millis();
+  AsyncWebServerResponse *response = request->beginResponse(
+      "application/octet-stream", length,
+      [stream, cipher, first, sent, egress](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        size_t allowed = egress->allow(min(maxLen, (size_t)ASYNC_IO_CHUNK_SIZE));
+        if (allowed == 0)
+        {
+          return RESPONSE_TRY_AGAIN;
+        }
+        size_t n = stream->fill(buffer, allowed, index);
+        if (n == 0)
+        {
+          return stream->failed() ? 0 : RESPONSE_TRY_AGAIN;
+        }
+        egress->sent(n);
+        if (cipher)
+        {
+          cipher->apply(first + index, buffer, buffer, n);
+        }
+        *sent += n;
+        return n;
+      });
+  request->onDisconnect([sent, startTime]() {
+    stats.bytesOut += *sent;
+    stats.getMs += millis() - startTime;
+  });
+  if (range == 1)
+  {
+    response->setCode(206);
+    response->addHeader("Content-Range", "bytes " + String((unsigned long)first) + "-" + String((unsigned long)last) +
+                                             "/" + String((unsigned long)total));
+  }
+  response->addHeader("Accept-Ranges", "bytes");
+  response->addHeader("ETag", etagFor(total, meta.mtime));
+  response->addHeader("Last-Modified", httpDate(meta.mtime));
+  request->send(response);
+}
+
+// ---- PUT -------------------------------------------------------------------
+
+// One PUT in flight. Bodies are written straight from the receive buffers
+// into a staging file that replaces the target once complete.
+struct PutState
+{
+  AsyncWebServerRequest *request;
+  String path;
+  String stagingPath;
+  File file;
+  AsyncWriteStream *writer; // written by the async I/O workers when set
+  FileCipher cipher;
+  bool encrypt;
+  bool existed;
+  Hasher crc;
+  size_t received;
+  size_t reserved;
+  uint32_t startTime;
+  // Set when the PUT was refused before its body was written
+  int status;
+  String error;
+};
+
+static std::vector<PutState *> activePuts;
+
+static PutState *findPut(AsyncWebServerRequest *request)
+{
+  for (PutState *put : activePuts)
+  {
+    if (put->request == request)
+    {
+      return put;
+    }
+  }
+  return nullptr;
+}
+
+static void dropPut(PutState *put)
+{
+  delete put->writer;
+  for (size_t i = 0; i < activePuts.size(); i++)
+  {
+    if (activePuts[i] == put)
+    {
+      activePuts.erase(activePuts.begin() + i);
+      break;
+    }
+  }
+  delete put;
+}
+
+static void abortPut(AsyncWebServerRequest *request)
+{
+  PutState *put = findPut(request);
+  if (put == nullptr)
+  {
+    return;
+  }
+  if (put->file)
+  {
+    // Closed and removed once the writes in flight are done, possibly on a worker
+    File file = put->file;
+    String staging = put->stagingPath;
+    std::function<void()> discard = [file, staging]() mutable {
+      {
+        SdIoScope io(SD_IO_BULK);
+        file.close();
+        SD_MMC.remove(staging);
+      }
+      fsCacheInvalidate(staging);
+    };
+    if (put->writer)
+    {
+      put->writer->abandon(discard);
+    }
+    else
+    {
+      discard();
+    }
+    fsEventProgress(put->path, put->received, put->received, true);
+    Serial.printf("WebDAV PUT aborted: %s after %u bytes\n", put->path.c_str(), put->received);
+  }
+  dropPut(put);
+}
+
+static PutState *beginPut(AsyncWebServerRequest *request, const String &path)
+{
+  PutState *put = new PutState();
+  put->request = request;
+  put->path = path;
+  put->writer = nullptr;
+  put->received = 0;
+  put->reserved = 0;
+  put->status = 0;
+  put->startTime = millis();
+  activePuts.push_back(put);
+  request->onDisconnect([request]() { abortPut(request); });
+
+  FsMeta meta;
+  put->existed = g_metaCache.stat(path, meta);
+  if (path == "/" || (put->existed && meta.isDirectory))
+  {
+    put->status = 405;
+    put->error = "Cannot PUT to a collection";
+    return put;
+  }
+  if (!g_metaCache.stat(parentPath(path), meta) || !meta.isDirectory)
+  {
+    put->status = 409;
+    put->error = "Parent collection does not exist";
+    return put;
+  }
+  if (activePuts.size() > WEBDAV_MAX_PUTS)
+  {
+    put->status = 503;
+    put->error = "Too many uploads";
+    return put;
+  }
+
+  put->encrypt = cryptIsEncryptedPath(path);
+  put->stagingPath = path + STAGING_SUFFIX;
+  fsCacheInvalidate(put->stagingPath);
+  put->file = SD_MMC.open(put->stagingPath, FILE_WRITE);
+  if (put->file && put->encrypt)
+  {
+    uint8_t header[CRYPT_HEADER_SIZE];
+    if (!put->cipher.create(path, header) || put->file.write(header, sizeof(header)) != sizeof(header))
+    {
+      put->file.close();
+      SD_MMC.remove(put->stagingPath);
+      fsCacheInvalidate(put->stagingPath);
+    }
+  }
+  if (!put->file)
+  {
+    put->status = 500;
+    put->error = "Could not create file on SD card";
+    return put;
+  }
+
+  size_t expected = request->contentLength() + (put->encrypt ? CRYPT_HEADER_SIZE : 0);
+  if (expected >= PREALLOCATE_MIN && preallocateFile(put->file, expected))
+  {
+    put->reserved = expected;
+  }
+  put->writer = new AsyncWriteStream();
+  if (!put->writer->begin(put->file, SD_IO_BULK))
+  {
+    delete put->writer;
+    put->writer = nullptr;
+  }
+  return put;
+}
+
+static void writePut(PutState *put, uint8_t *data, size_t len)
+{
+  if (put->status != 0)
+  {
+    return;
+  }
+  put->crc.update(data, len);
+  if (put->encrypt)
+  {
+    put->cipher.apply(put->received, data, data, len);
+  }
+  bool ok = put->writer ? put->writer->write(data, len) : sdIoWrite(put->file, data, len, SD_IO_BULK) == len;
+  if (!ok && put->writer && put->writer->busy())
+  {
+    put->status = 503;
+    put->error = "SD card busy, try again";
+  }
+  else if (!ok)
+  {
+    put->status = 507;
+    put->error = "Short write on SD card";
+    Serial.printf("Short write on %s at offset %u\n", put->stagingPath.c_str(), put->received);
+  }
+  put->received += len;
+  fsEventProgress(put->path, put->received, put->request->contentLength(), false);
+}
+
+// Runs once the queued writes are done
+static AsyncWebServerResponse *completePut(AsyncWebServerRequest *request)
+{
+  PutState *put = findPut(request);
+  if (put == nullptr)
+  {
+    return request->beginResponse(500, "text/plain", "Upload state lost");
+  }
+  if (put->file)
+  {
+    size_t storedBytes = put->received + (put->encrypt ? CRYPT_HEADER_SIZE : 0);
+    if (put->writer && !put->writer->ok() && put->status == 0)
+    {
+      put->status = put->writer->busy() ? 503 : 507;
+      put->error = put->writer->busy() ? "SD card busy, try again" : "Short write on SD card";
+    }
+    put->file.close();
+    if (put->reserved > storedBytes)
+    {
+      truncateFile(put->stagingPath.c_str(), storedBytes);
+    }
+    fsCacheInvalidate(put->stagingPath);
+    fsEventProgress(put->path, put->received, put->received, true);
+
+    if (put->status == 0)
+    {
+      FsMeta old;
+      if (g_metaCache.stat(put->path, old) && !old.isDirectory)
+      {
+        duFileRemoved(put->path, old.size);
+      }
+      fsCacheInvalidate(put->path);
+      if (SD_MMC.exists(put->path))
+      {
+        SD_MMC.remove(put->path);
+      }
+      if (!SD_MMC.rename(put->stagingPath, put->path))
+      {
+        put->status = 500;
+        put->error = "Failed to move upload into place";
+      }
+    }
+    if (put->status != 0)
+    {
+      SD_MMC.remove(put->stagingPath);
+      fsCacheInvalidate(put->stagingPath);
+    }
+    else
+    {
+      fsCacheInvalidate(put->path);
+      dirPager->reset();
+      FsMeta meta;
+      if (!put->encrypt && g_metaCache.stat(put->path, meta))
+      {
+        uint8_t digest[4];
+        put->crc.finish(digest);
+        g_checksumIndex.store(put->path, meta, HASH_CRC32, digest);
+      }
+      fsEventAdded(put->path, storedBytes, false);
+      duFileAdded(put->path, storedBytes);
+      lzbRemoveTwin(SD_MMC, put->path);
+      stats.puts++;
+      stats.bytesIn += put->received;
+      stats.putMs += millis() - put->startTime;
+    }
+  }
+
+  AsyncWebServerResponse *response;
+  if (put->status != 0)
+  {
+    stats.errors++;
+    Serial.printf("WebDAV PUT rejected: %s - %s\n", put->path.c_str(), put->error.c_str());
+    response = request->beginResponse(put->status, "text/plain", put->error);
+  }
+  else
+  {
+    response = request->beginResponse(put->existed ? 204 : 201);
+  }
+  dropPut(put);
+  return response;
+}
+
+// The response waits for the writes still queued without blocking the
+// network task; a disconnect meanwhile aborts the PUT as usual
+static void finishPut(AsyncWebServerRequest *request, PutState *put)
+{
+  if (put->writer)
+  {
+    put->writer->finish();
+  }
+  request->send(new DeferredResponse(
+      [request]() {
+        PutState *put = findPut(request);
+        return put == nullptr || put->writer == nullptr || put->writer->done();
+      },
+      completePut));
+}
+
+// ---- Collections and namespace ---------------------------------------------
+
+// Removes a file or tree and keeps the caches and the du tree current;
+// callable off the network task
+static bool removeStored(const String &path, const FsMeta &meta)
+{
+  fsCacheInvalidate(path, meta.isDirectory);
+  bool ok = meta.isDirectory ? removeTree(SD_MMC, path.c_str()) : SD_MMC.remove(path);
+  fsCacheInvalidate(path, meta.isDirectory);
+  if (meta.isDirectory)
+  {
+    // Partly removed trees are recounted from scratch
+    if (ok)
+      duDirRemoved(path);
+    else
+      duRebuild();
+  }
+  else if (ok)
+  {
+    duFileRemoved(path, meta.size);
+  }
+  return ok;
+}
+
+// Removes a file or collection, updates the caches and announces it
+static bool removePath(const String &path, const FsMeta &meta)
+{
+  bool ok = removeStored(path, meta);
+  dirPager->reset();
+  fsEventRemoved(path, meta.isDirectory);
+  return ok;
+}
+
+static void handleDelete(AsyncWebServerRequest *request, const String &path)
+{
+  FsMeta meta;
+  if (path == "/")
+  {
+    request->send(403, "text/plain", "Cannot delete the root collection");
+    return;
+  }
+  if (!g_metaCache.stat(path, meta))
+  {
+    request->send(404);
+    return;
+  }
+  if (removePath(path, meta))
+  {
+    request->send(204);
+  }
+  else
+  {
+    stats.errors++;
+    request->send(500, "text/plain", "Failed to delete");
+  }
+}
+
+static void handleMkcol(AsyncWebServerRequest *request, const String &path)
+{
+  FsMeta meta;
+  if (request->contentLength() > 0)
+  {
+    request->send(415, "text/plain", "MKCOL with a body is not supported");
+    return;
+  }
+  if (g_metaCache.exists(path))
+  {
+    request->send(405, "text/plain", "Already exists");
+    return;
+  }
+  if (!g_metaCache.stat(parentPath(path), meta) || !meta.isDirectory)
+  {
+    request->send(409, "text/plain", "Parent collection does not exist");
+    return;
+  }
+  if (!createDir(SD_MMC, path.c_str()))
+  {
+    stats.errors++;
+    request->send(500, "text/plain", "Failed to create directory");
+    return;
+  }
+  dirPager->reset();
+  fsEventAdded(path, 0, true);
+  duDirAdded(path);
+  request->send(201);
+}
+
+// Copies a collection with its contents (Depth infinity) or alone (Depth 0)
+static bool copyTree(const String &from, const String &to, bool recursive, BackgroundJob &job)
+{
+  std::vector<std::pair<String, String>> dirs;
+  dirs.push_back({from, to});
+  bool ok = true;
+  uint32_t copied = 0;
+  for (size_t i = 0; i < dirs.size() && ok; i++)
+  {
+    String target = dirs[i].second;
+    ok = createDir(SD_MMC, target.c_str());
+    if (ok)
+    {
+      duDirAdded(target);
+    }
+    File dir = recursive && ok ? SD_MMC.open(dirs[i].first) : File();
+    File entry;
+    while (dir && ok && !job.cancelled() && (entry = dir.openNextFile()))
+    {
+      String source = entry.path();
+      String copy = target + "/" + baseName(source);
+      bool isDirectory = entry.isDirectory();
+      entry.close();
+      if (isDirectory)
+      {
+        dirs.push_back({source, copy});
+        continue;
+      }
+      size_t storedBytes = 0;
+      ok = cryptCopyFile(SD_MMC, source, copy, storedBytes);
+      if (ok)
+      {
+        duFileAdded(copy, storedBytes);
+      }
+      job.setProgress(++copied, 0);
+    }
+    dir.close();
+  }
+  return ok && !job.cancelled();
+}
+
+// MOVE and COPY run here, off the network task: a tree copy can take
+// minutes. The old destination is moved aside under a unique name and only
+// removed once the new one is complete, so a failure leaves it in place.
+struct MoveCopy
+{
+  String from;
+  String to;
+  bool move;
+  bool recursive;
+  bool existed;
+  FsMeta meta;
+  FsMeta existing;
+  bool ok;
+};
+
+static BackgroundJob moveCopyJob("webdav-copy");
+
+static String asideName(const String &path)
+{
+  char suffix[16];
+  String aside;
+  do
+  {
+    snprintf(suffix, sizeof(suffix), ".%08lx.old", (unsigned long)esp_random());
+    aside = path + suffix;
+  } while (g_metaCache.exists(aside));
+  return aside;
+}
+
+static bool renameStored(const String &from, const String &to, const FsMeta &meta)
+{
+  fsCacheInvalidate(from, meta.isDirectory);
+  fsCacheInvalidate(to, meta.isDirectory);
+  bool ok = SD_MMC.rename(from, to);
+  fsCacheInvalidate(from, meta.isDirectory);
+  fsCacheInvalidate(to, meta.isDirectory);
+  if (ok)
+  {
+    duMoved(from, to, meta.isDirectory, meta.size);
+  }
+  return ok;
+}
+
+static bool runMoveCopy(MoveCopy &m, BackgroundJob &job)
+{
+  String aside;
+  if (m.existed)
+  {
+    aside = asideName(m.to);
+    if (!renameStored(m.to, aside, m.existing))
+    {
+      job.setMessage("Failed to move the destination aside");
+      return false;
+    }
+  }
+
+  size_t storedBytes = 0;
+  bool ok;
+  if (m.move)
+  {
+    ok = renameStored(m.from, m.to, m.meta);
+  }
+  else if (m.meta.isDirectory)
+  {
+    ok = copyTree(m.from, m.to, m.recursive, job);
+  }
+  else
+  {
+    ok = cryptCopyFile(SD_MMC, m.from, m.to, storedBytes, &job);
+    if (ok)
+    {
+      duFileAdded(m.to, storedBytes);
+    }
+  }
+
+  if (!ok)
+  {
+    // Drop what was built and put the old destination back
+    FsMeta partial;
+    if (!m.move && g_metaCache.stat(m.to, partial))
+    {
+      removeStored(m.to, partial);
+    }
+    if (m.existed)
+    {
+      renameStored(aside, m.to, m.existing);
+    }
+    job.setMessage(job.cancelled() ? "Cancelled" : m.move ? "Failed to move" : "Failed to copy");
+    return false;
+  }
+
+  if (m.existed)
+  {
+    fsEventRemoved(m.to, m.existing.isDirectory);
+    removeStored(aside, m.existing);
+  }
+  if (m.move)
+  {
+    fsEventRenamed(m.from, m.to, m.meta.isDirectory);
+  }
+  else
+  {
+    fsEventAdded(m.to, m.meta.isDirectory ? 0 : storedBytes, m.meta.isDirectory);
+  }
+  if (!m.meta.isDirectory)
+  {
+    lzbRemoveTwin(SD_MMC, m.to);
+  }
+  m.ok = true;
+  return true;
+}
+
+static void handleMoveCopy(AsyncWebServerRequest *request, const String &path, bool move)
+{
+  String to;
+  if (!destinationPath(request, to))
+  {
+    request->send(502, "text/plain", "Destination must be inside " WEBDAV_PREFIX);
+    return;
+  }
+  // Neither may contain the other: the destination would be copied into
+  // itself, or replacing it would delete the source
+  if (path == "/" || to == "/" || to == path || to.startsWith(path + "/") || path.startsWith(to + "/"))
+  {
+    request->send(403, "text/plain", "Source and destination overlap");
+    return;
+  }
+  std::shared_ptr<MoveCopy> m = std::make_shared<MoveCopy>();
+  if (!g_metaCache.stat(path, m->meta))
+  {
+    request->send(404);
+    return;
+  }
+  FsMeta parent;
+  if (!g_metaCache.stat(parentPath(to), parent) || !parent.isDirectory)
+  {
+    request->send(409, "text/plain", "Parent collection does not exist");
+    return;
+  }
+
+  m->from = path;
+  m->to = to;
+  m->move = move;
+  m->recursive = !(request->hasHeader("Depth") && request->header("Depth") == "0");
+  m->existed = g_metaCache.stat(to, m->existing);
+  m->ok = false;
+  if (m->existed && request->hasHeader("Overwrite") && request->header("Overwrite") == "F")
+  {
+    request->send(412, "text/plain", "Destination exists");
+    return;
+  }
+
+  if (!moveCopyJob.start([m](BackgroundJob &job) { return runMoveCopy(*m, job); }))
+  {
+    AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Another MOVE or COPY is running");
+    response->addHeader("Retry-After", "5");
+    request->send(response);
+    return;
+  }
+  // Answered once the job is done
+  request->send(new DeferredResponse([]() { return !moveCopyJob.running(); },
+                                     [m](AsyncWebServerRequest *request) -> AsyncWebServerResponse *
+                                     {
+                                       dirPager->reset();
+                                       if (!m->ok)
+                                       {
+                                         stats.errors++;
+                                         return request->beginResponse(500, "text/plain",
+                                                                       m->move ? "Failed to move" : "Failed to copy");
+                                       }
+                                       return request->beginResponse(m->existed ? 204 : 201);
+                                     }));
+}
+
+// ---- Locks (stubs) ---------------------------------------------------------
+
+// Grants every lock: enough for clients that insist on locking before they
+// write. Nothing else on the device honours the lock.
+static void handleLock(AsyncWebServerRequest *request, const String &path)
+{
+  char token[64];
+  snprintf(token, sizeof(token), "opaquelocktoken:%08lx-%04lx-4%03lx-a%03lx-%08lx", (unsigned long)esp_random(),
+           (unsigned long)(esp_random() & 0xFFFF), (unsigned long)(esp_random() & 0xFFF),
+           (unsigned long)(esp_random() & 0xFFF), (unsigned long)esp_random());
+
+  String body = xmlHeader;
+  body += "<D:prop xmlns:D=\"DAV:\"><D:lockdiscovery><D:activelock>"
+          "<D:locktype><D:write/></D:locktype><D:lockscope><D:exclusive/></D:lockscope>"
+          "<D:depth>infinity</D:depth><D:timeout>Second-" +
+          String(WEBDAV_LOCK_TIMEOUT) + "</D:timeout><D:locktoken><D:href>";
+  body += token;
+  body += "</D:href></D:locktoken><D:lockroot><D:href>";
+  appendHref(body, path, false);
+  body += "</D:href></D:lockroot></D:activelock></D:lockdiscovery></D:prop>\n";
+
+  AsyncWebServerResponse *response = request->beginResponse(200, "application/xml; charset=utf-8", body);
+  response->addHeader("Lock-Token", String("<") + token + ">");
+  request->send(response);
+}
+
+// Explorer sets Win32 timestamps after every copy and gives up if that
+// fails; report them as set
+static void handleProppatch(AsyncWebServerRequest *request, const String &path)
+{
+  if (!g_metaCache.exists(path))
+  {
+    request->send(404);
+    return;
+  }
+  String body = xmlHeader;
+  body += "<D:multistatus xmlns:D=\"DAV:\" xmlns:Z=\"urn:schemas-microsoft-com:\"><D:response><D:href>";
+  appendHref(body, path, false);
+  body += "</D:href><D:propstat><D:prop><Z:Win32CreationTime/><Z:Win32LastAccessTime/>"
+          "<Z:Win32LastModifiedTime/><Z:Win32FileAttributes/></D:prop>"
+          "<D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response></D:multistatus>\n";
+  AsyncWebServerResponse *response = request->beginResponse(207, "application/xml; charset=utf-8", body);
+  request->send(response);
+}
+
+// ---- Handler ---------------------------------------------------------------
+
+class WebDavHandler : public AsyncWebHandler
+{
+public:
+  bool canHandle(AsyncWebServerRequest *request) const override
+  {
+    const String &url = request->url();
+    return url == WEBDAV_PREFIX || url.startsWith(WEBDAV_PREFIX "/");
+  }
+
+  // PUT bodies are streamed through handleBody()
+  bool isRequestHandlerTrivial() const override { return false; }
+
+  void handleBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index,
+          size_t total) override
+  {
+    if (request->method() != HTTP_PUT)
+    {
+      return;
+    }
+    PutState *put = index == 0 ? beginPut(request, localPath(request->url())) : findPut(request);
+    if (put != nullptr)
+    {
+      writePut(put, data, len);
+    }
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override
+  {
+    String path = localPath(request->url());
+    stats.requests++;
+    switch (request->method())
+    {
+    case HTTP_OPTIONS:
+    {
+      AsyncWebServerResponse *response = request->beginResponse(200);
+      response->addHeader("DAV", "1, 2");
+      response->addHeader("MS-Author-Via", "DAV");
+      response->addHeader("Allow", "OPTIONS, GET, HEAD, PUT, DELETE, PROPFIND, PROPPATCH, MKCOL, "
+                    "MOVE, COPY, LOCK, UNLOCK");
+      request->send(response);
+      break;
+    }
+    case HTTP_PROPFIND:
+      handlePropfind(request, path);
+      break;
+    case HTTP_GET:
+    case HTTP_HEAD:
+      handleGet(request, path);
+      break;
+    case HTTP_PUT:
+    {
+      // An empty body never reaches handleBody()
+      PutState *put = findPut(request);
+      if (put == nullptr)
+      {
+        put = beginPut(request, path);
+      }
+      finishPut(request, put);
+      break;
+    }
+    case HTTP_DELETE:
+      handleDelete(request, path);
+      break;
+    case HTTP_MKCOL:
+      handleMkcol(request, path);
+      break;
+    case HTTP_MOVE:
+      handleMoveCopy(request, path, true);
+      break;
+    case HTTP_COPY:
+      handleMoveCopy(request, path, false);
+      break;
+    case HTTP_LOCK:
+      handleLock(request, path);
+      break;
+    case HTTP_UNLOCK:
+      request->send(204);
+      break;
+    case HTTP_PROPPATCH:
+      handleProppatch(request, path);
+      break;
+    default:
+      request->send(405);
+      break;
+    }
+  }
+};
+
+static WebDavHandler g_webDav;
+
+void initWebDav(AsyncWebServer &server, DirPager &pager)
+{
+  dirPager = &pager;
+  server.addHandler(&g_webDav);
+  Serial.println("WebDAV share available at " WEBDAV_PREFIX "/");
+}
+
+void webdavStatsJson(JsonObject obj)
+{
+  obj["requests"] = stats.requests;
+  obj["propfinds"] = stats.propfinds;
+  obj["gets"] = stats.gets;
+  obj["puts"] = stats.puts;
+  obj["errors"] = stats.errors;
+  obj["bytesIn"] = stats.bytesIn;
+  obj["bytesOut"] = stats.bytesOut;
+  // Averaged over whole requests, including the client's think time
+  obj["putMBps"] = stats.putMs ? stats.bytesIn / 1000.0f / stats.putMs : 0;
+  obj["getMBps"] = stats.getMs ? stats.bytesOut / 1000.0f / stats.getMs : 0;
+}
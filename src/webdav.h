@@ -0,0 +1,31 @@
+#ifndef __WEBDAV_H
+#define __WEBDAV_H
+
+#include "Arduino.h"
+#include <ESPAsyncWebServer.h>
+#include <ArduinoJson.h>
+#include "dir_pager.h"
+
+// The card is served as a WebDAV share below this prefix, e.g.
+// http://esp32.local/dav/ in Explorer, Finder or davfs2
+#define WEBDAV_PREFIX "/dav"
+// PUTs written at the same time; more are refused with 503
+#define WEBDAV_MAX_PUTS 2
+// Timeout announced for the (advisory, never enforced) locks
+#define WEBDAV_LOCK_TIMEOUT 3600
+
+// WebDAV class 1 plus LOCK/UNLOCK stubs (class 2, which Finder and
+// Explorer need for write access). PROPFIND returns the fixed set of live
+// properties whatever the body asks for, streamed one <response> at a
+// time, so a Depth 1 listing of a large directory never sits in RAM.
+// Depth infinity is answered as Depth 1.
+//
+// Files are shown as stored: .lz4b files keep their name and compressed
+// size, encrypted files are decrypted on GET and written encrypted on PUT
+// like /download and /upload.
+void initWebDav(AsyncWebServer &server, DirPager &pager);
+
+// Request counts and PUT/GET throughput
+void webdavStatsJson(JsonObject obj);
+
+#endif
@@ -0,0 +1,554 @@
+// Host tests and benchmark of the asynchronous file I/O engine (src/async_io.*).
+//
+//   g++ -O2 -std=c++20 -pthread -Isrc tools/async_io_bench.cpp src/async_io.cpp -o async_io_bench
+//   ./async_io_bench [file MB] [directory]
+//
+// Runs the engine over a POSIX backend with two worker threads like the
+// device's tasks. Checks that operations on one handle complete in
+// submission order under mixed priorities and that the written file reads
+// back intact, that mkdir/rename/remove work, that errors (bad handle,
+// missing file, full queue, stop) arrive through both callbacks and
+// futures, and, when built as C++20, a coroutine file copy. Then reports
+// sequential read throughput at queue depth 1 and 4 against plain pread,
+// and stat operations per second. Exits non-zero if a check fails. With
+// -std=c++17 the coroutine test is skipped.
+
+#include "async_io.h"
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <dirent.h>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do                                                             \
+  {                                                              \
+    if (!(cond))                                                 \
+    {                                                            \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+      failures++;                                                \
+    }                                                            \
+  } while (0)
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int64_t errnoResult()
+{
+  return errno == ENOENT ? ASYNC_IO_ENOENT : errno == EBADF ? ASYNC_IO_EBADF : ASYNC_IO_EIO;
+}
+
+// Handles are file descriptors; each keeps a position for ASYNC_IO_APPEND
+class PosixBackend : public AsyncIoBackend
+{
+private:
+  std::mutex lock;
+  std::map<int64_t, uint64_t> positions;
+
+  bool known(int64_t handle)
+  {
+    std::lock_guard<std::mutex> l(lock);
+    return positions.count(handle) > 0;
+  }
+
+public:
+  int64_t open(const std::string &path, bool write, uint8_t) override
+  {
+    int fd = ::open(path.c_str(), write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if (fd < 0)
+    {
+      return errnoResult();
+    }
+    std::lock_guard<std::mutex> l(lock);
+    positions[fd] = 0;
+    return fd;
+  }
+
+  int64_t read(int64_t handle, uint64_t offset, uint8_t *buffer, size_t len, uint8_t) override
+  {
+    if (!known(handle))
+    {
+      return ASYNC_IO_EBADF;
+    }
+    ssize_t n = pread((int)handle, buffer, len, offset);
+    return n < 0 ? errnoResult() : n;
+  }
+
+  int64_t write(int64_t handle, uint64_t offset, const uint8_t *data, size_t len, uint8_t) override
+  {
+    if (!known(handle))
+    {
+      return ASYNC_IO_EBADF;
+    }
+    // Only this handle's operation is running, so the position is stable
+    uint64_t at = offset;
+    if (offset == ASYNC_IO_APPEND)
+    {
+      std::lock_guard<std::mutex> l(lock);
+      at = positions[handle];
+    }
+    ssize_t n = pwrite((int)handle, data, len, at);
+    if (n < 0)
+    {
+      return errnoResult();
+    }
+    std::lock_guard<std::mutex> l(lock);
+    positions[handle] = at + n;
+    return n;
+  }
+
+  int64_t stat(const std::string &path, AsyncIoStat &out, uint8_t) override
+  {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+    {
+      return errnoResult();
+    }
+    out.isDirectory = S_ISDIR(st.st_mode);
+    out.size = st.st_size;
+    out.mtime = st.st_mtime;
+    return 0;
+  }
+
+  int64_t readdir(const std::string &path, uint32_t start, uint32_t max, std::vector<AsyncIoDirEntry> &entries,
+                  uint8_t) override
+  {
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+    {
+      return errnoResult();
+    }
+    uint32_t index = 0;
+    for (struct dirent *e = ::readdir(dir); e && entries.size() < max; e = ::readdir(dir))
+    {
+      if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..") || index++ < start)
+      {
+        continue;
+      }
+      AsyncIoDirEntry entry = {e->d_name, false, 0, 0};
+      AsyncIoStat st;
+      if (stat(path + "/" + e->d_name, st, 0) == 0)
+      {
+        entry.isDirectory = st.isDirectory;
+        entry.size = st.size;
+        entry.mtime = st.mtime;
+      }
+      entries.push_back(entry);
+    }
+    closedir(dir);
+    return entries.size();
+  }
+
+  int64_t close(int64_t handle, uint8_t) override
+  {
+    {
+      std::lock_guard<std::mutex> l(lock);
+      if (!positions.erase(handle))
+      {
+        return ASYNC_IO_EBADF;
+      }
+    }
+    return ::close((int)handle) == 0 ? 0 : ASYNC_IO_EIO;
+  }
+
+  int64_t remove(const std::string &path, bool directory, uint8_t) override
+  {
+    return (directory ? ::rmdir(path.c_str()) : ::unlink(path.c_str())) == 0 ? 0 : errnoResult();
+  }
+
+  int64_t rename(const std::string &from, const std::string &to, uint8_t) override
+  {
+    return ::rename(from.c_str(), to.c_str()) == 0 ? 0 : errnoResult();
+  }
+
+  int64_t mkdir(const std::string &path, uint8_t) override
+  {
+    return ::mkdir(path.c_str(), 0755) == 0 ? 0 : errnoResult();
+  }
+};
+
+struct Workers
+{
+  AsyncIoEngine &engine;
+  std::vector<std::thread> threads;
+
+  Workers(AsyncIoEngine &engine, int count) : engine(engine)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      threads.emplace_back([&engine] { engine.runWorker(); });
+    }
+  }
+  ~Workers()
+  {
+    engine.stop();
+    for (std::thread &t : threads)
+    {
+      t.join();
+    }
+  }
+};
+
+static std::string readAll(const std::string &path)
+{
+  std::string data;
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f)
+  {
+    char buf[65536];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+    {
+      data.append(buf, n);
+    }
+    fclose(f);
+  }
+  return data;
+}
+
+// Appends with random priorities to one handle while unrelated urgent
+// operations overtake them; completions and file contents must follow the
+// submission order
+static void testOrdering(const std::string &dir)
+{
+  PosixBackend backend;
+  AsyncIoEngine engine(backend, 1024);
+  Workers workers(engine, 2);
+
+  std::string path = dir + "/ordered.bin";
+  AsyncIoFuture opened = engine.open(path, true);
+  CHECK(opened.wait(5000) && opened.result().ok());
+  int64_t handle = opened.result().value;
+
+  const int writes = 500;
+  std::vector<std::string> chunks;
+  std::string expected;
+  unsigned seed = 11;
+  for (int i = 0; i < writes; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    chunks.push_back(std::string(1 + (seed >> 8) % 3000, (char)('a' + i % 26)));
+    expected += chunks.back();
+  }
+
+  std::atomic<int> nextCompletion(0);
+  std::atomic<int> outOfOrder(0);
+  std::vector<AsyncIoFuture> pending;
+  for (int i = 0; i < writes; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    const std::string &chunk = chunks[i];
+    pending.push_back(engine.write(
+        handle, ASYNC_IO_APPEND, (const uint8_t *)chunk.data(), chunk.size(),
+        [i, &nextCompletion, &outOfOrder](const AsyncIoResult &) {
+          if (nextCompletion.fetch_add(1) != i)
+          {
+            outOfOrder++;
+          }
+        },
+        (seed >> 16) % ASYNC_IO_PRIORITIES));
+    if (i % 10 == 0)
+    {
+      pending.push_back(engine.stat(dir, nullptr, 0));
+    }
+  }
+  AsyncIoFuture closed = engine.close(handle, nullptr, 0);
+  CHECK(closed.wait(10000) && closed.result().ok());
+  // The close was submitted last and at top priority, yet ran after every write
+  CHECK(nextCompletion.load() == writes);
+  CHECK(outOfOrder.load() == 0);
+  for (AsyncIoFuture &f : pending)
+  {
+    CHECK(f.ready() && f.result().ok());
+  }
+  CHECK(readAll(path) == expected);
+
+  // Positioned reads of the same handle complete in order as well
+  opened = engine.open(path, false);
+  CHECK(opened.wait(5000) && opened.result().ok());
+  handle = opened.result().value;
+  std::vector<std::vector<uint8_t>> buffers(64, std::vector<uint8_t>(1024));
+  std::vector<int> order;
+  std::mutex orderLock;
+  for (int i = 0; i < 64; i++)
+  {
+    engine.read(
+        handle, (uint64_t)i * 1024, buffers[i].data(), 1024,
+        [i, &order, &orderLock](const AsyncIoResult &) {
+          std::lock_guard<std::mutex> l(orderLock);
+          order.push_back(i);
+        },
+        i % 2 ? 3 : 0);
+  }
+  closed = engine.close(handle);
+  CHECK(closed.wait(5000) && closed.result().ok());
+  bool sorted = order.size() == 64;
+  for (size_t i = 0; sorted && i < order.size(); i++)
+  {
+    sorted = order[i] == (int)i;
+  }
+  CHECK(sorted);
+  CHECK(memcmp(buffers[5].data(), expected.data() + 5 * 1024, 1024) == 0);
+
+  AsyncIoFuture listed = engine.readdir(dir, 0, 100);
+  CHECK(listed.wait(5000) && listed.result().value >= 1);
+  bool found = false;
+  for (const AsyncIoDirEntry &e : listed.result().entries)
+  {
+    found = found || (e.name == "ordered.bin" && e.size == expected.size());
+  }
+  CHECK(found);
+  printf("ordering     %d writes, %d reads in order, contents verified\n", writes, 64);
+}
+
+static void testErrors(const std::string &dir)
+{
+  PosixBackend backend;
+  {
+    AsyncIoEngine engine(backend, 1024);
+    Workers workers(engine, 2);
+    int64_t fromCallback = 0;
+    uint8_t buf[16];
+    AsyncIoFuture bad = engine.read(12345, 0, buf, sizeof(buf), [&fromCallback](const AsyncIoResult &r) {
+      fromCallback = r.value;
+    });
+    CHECK(bad.wait(5000) && bad.result().value == ASYNC_IO_EBADF && fromCallback == ASYNC_IO_EBADF);
+    AsyncIoFuture missing = engine.open(dir + "/does/not/exist", false);
+    CHECK(missing.wait(5000) && missing.result().value == ASYNC_IO_ENOENT);
+    AsyncIoFuture missingStat = engine.stat(dir + "/missing");
+    CHECK(missingStat.wait(5000) && missingStat.result().value == ASYNC_IO_ENOENT);
+
+    // Path operations: mkdir, rename, remove, and their failures
+    std::string made = dir + "/made";
+    CHECK(engine.mkdir(made).wait(5000) && engine.stat(made).wait(5000));
+    AsyncIoFuture moved = engine.rename(made, made + "2");
+    CHECK(moved.wait(5000) && moved.result().value == 0);
+    AsyncIoFuture stale = engine.stat(made);
+    CHECK(stale.wait(5000) && stale.result().value == ASYNC_IO_ENOENT);
+    AsyncIoFuture removed = engine.remove(made + "2", true);
+    CHECK(removed.wait(5000) && removed.result().value == 0);
+    AsyncIoFuture again = engine.remove(made + "2", true);
+    CHECK(again.wait(5000) && again.result().value == ASYNC_IO_ENOENT);
+  }
+
+  // No workers: the queue fills, the overflow fails at once, and stop()
+  // cancels what was queued
+  AsyncIoEngine engine(backend, 4);
+  std::vector<AsyncIoFuture> queued;
+  for (int i = 0; i < 4; i++)
+  {
+    queued.push_back(engine.stat(dir));
+  }
+  bool called = false;
+  AsyncIoFuture overflow = engine.stat(dir, [&called](const AsyncIoResult &) { called = true; });
+  CHECK(overflow.ready() && overflow.result().value == ASYNC_IO_EBUSY && called);
+  CHECK(!overflow.then([] {}));
+  CHECK(!queued[0].ready() && !queued[0].wait(10));
+  engine.stop();
+  for (AsyncIoFuture &f : queued)
+  {
+    CHECK(f.ready() && f.result().value == ASYNC_IO_ECANCELED);
+  }
+  AsyncIoStats stats = engine.getStats();
+  CHECK(stats.rejected == 1 && stats.submitted == 4 && stats.maxDepth == 4);
+  CHECK(engine.stat(dir).result().value == ASYNC_IO_ECANCELED);
+  printf("errors       bad handle, missing file, path operations, full queue, stop\n");
+}
+
+#if defined(__cpp_impl_coroutine)
+struct Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { abort(); }
+  };
+};
+
+// Copies `from` to `to` one block at a time, each step awaiting the engine
+static Detached copyFile(AsyncIoEngine &engine, std::string from, std::string to, std::promise<int64_t> *done)
+{
+  AsyncIoResult in = co_await engine.open(from, false);
+  AsyncIoResult out = co_await engine.open(to, true);
+  if (!in.ok() || !out.ok())
+  {
+    done->set_value(ASYNC_IO_EIO);
+    co_return;
+  }
+  std::vector<uint8_t> block(8192);
+  int64_t total = 0;
+  for (;;)
+  {
+    AsyncIoResult r = co_await engine.read(in.value, total, block.data(), block.size());
+    if (r.value <= 0)
+    {
+      break;
+    }
+    AsyncIoResult w = co_await engine.write(out.value, ASYNC_IO_APPEND, block.data(), r.value);
+    if (w.value != r.value)
+    {
+      total = ASYNC_IO_EIO;
+      break;
+    }
+    total += r.value;
+  }
+  co_await engine.close(in.value);
+  co_await engine.close(out.value);
+  done->set_value(total);
+}
+
+static void testCoroutine(const std::string &dir)
+{
+  PosixBackend backend;
+  AsyncIoEngine engine(backend);
+  Workers workers(engine, 2);
+  std::string from = dir + "/ordered.bin";
+  std::promise<int64_t> done;
+  std::future<int64_t> copied = done.get_future();
+  copyFile(engine, from, dir + "/copy.bin", &done);
+  CHECK(copied.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+  std::string original = readAll(from);
+  CHECK(copied.get() == (int64_t)original.size());
+  CHECK(readAll(dir + "/copy.bin") == original);
+  printf("coroutine    copied %zu bytes with co_await\n", original.size());
+}
+#endif
+
+// Sequential read of the whole file with `depth` reads outstanding
+static double readThroughput(AsyncIoEngine &engine, const std::string &path, uint64_t size, int depth)
+{
+  const size_t block = 65536;
+  AsyncIoFuture opened = engine.open(path, false);
+  opened.wait();
+  int64_t handle = opened.result().value;
+  std::vector<std::vector<uint8_t>> buffers(depth, std::vector<uint8_t>(block));
+  std::vector<AsyncIoFuture> inFlight(depth);
+  auto start = std::chrono::steady_clock::now();
+  uint64_t offset = 0;
+  uint64_t read = 0;
+  for (uint64_t n = 0; read < size; n++)
+  {
+    AsyncIoFuture &slot = inFlight[n % depth];
+    if (slot.valid())
+    {
+      slot.wait();
+      read += slot.result().value > 0 ? slot.result().value : size;
+    }
+    if (offset < size)
+    {
+      slot = engine.read(handle, offset, buffers[n % depth].data(), block);
+      offset += block;
+    }
+    else
+    {
+      slot = AsyncIoFuture();
+    }
+  }
+  double elapsed = seconds(start);
+  engine.close(handle).wait();
+  return size / elapsed / 1e6;
+}
+
+static void bench(const std::string &dir, uint64_t megabytes)
+{
+  std::string path = dir + "/bench.bin";
+  {
+    std::vector<uint8_t> data(1 << 20, 0x5a);
+    FILE *f = fopen(path.c_str(), "wb");
+    for (uint64_t i = 0; i < megabytes; i++)
+    {
+      fwrite(data.data(), 1, data.size(), f);
+    }
+    fclose(f);
+  }
+  uint64_t size = megabytes << 20;
+
+  // Direct pread for reference
+  {
+    std::vector<uint8_t> buf(65536);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t offset = 0; offset < size; offset += buf.size())
+    {
+      if (pread(fd, buf.data(), buf.size(), offset) <= 0)
+      {
+        break;
+      }
+    }
+    printf("pread        %8.1f MB/s\n", size / seconds(start) / 1e6);
+    ::close(fd);
+  }
+
+  PosixBackend backend;
+  AsyncIoEngine engine(backend);
+  Workers workers(engine, 2);
+  printf("depth 1      %8.1f MB/s\n", readThroughput(engine, path, size, 1));
+  printf("depth 4      %8.1f MB/s\n", readThroughput(engine, path, size, 4));
+
+  const int stats = 20000;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<AsyncIoFuture> batch;
+  for (int i = 0; i < stats; i++)
+  {
+    batch.push_back(engine.stat(path));
+    if (batch.size() == 32)
+    {
+      for (AsyncIoFuture &f : batch)
+      {
+        f.wait();
+        CHECK(f.result().ok());
+      }
+      batch.clear();
+    }
+  }
+  for (AsyncIoFuture &f : batch)
+  {
+    f.wait();
+  }
+  printf("stat         %8.0f ops/s\n", stats / seconds(start));
+
+  AsyncIoStats s = engine.getStats();
+  printf("engine       %llu ops, max depth %u, read avg queued %.1f us service %.1f us\n",
+         (unsigned long long)s.completed, s.maxDepth,
+         s.ops[ASYNC_IO_READ] ? (double)s.queuedUs[ASYNC_IO_READ] / s.ops[ASYNC_IO_READ] : 0.0,
+         s.ops[ASYNC_IO_READ] ? (double)s.serviceUs[ASYNC_IO_READ] / s.ops[ASYNC_IO_READ] : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t megabytes = argc > 1 ? atoi(argv[1]) : 64;
+  std::string dir = argc > 2 ? argv[2] : "async_io_bench.dir";
+  system(("rm -rf " + dir + " && mkdir -p " + dir).c_str());
+
+  testOrdering(dir);
+  testErrors(dir);
+#if defined(__cpp_impl_coroutine)
+  testCoroutine(dir);
+#endif
+  bench(dir, megabytes);
+
+  system(("rm -rf " + dir).c_str());
+  if (failures)
+  {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+"""Client for the raw-TCP bulk transfer service of the ESP32 SD card explorer.
+
+Usage:
+  bulk_client.py <device> get <remote> [local] [--offset N] [--length N]
+  bulk_client.py <device> put <local> <remote>
+  bulk_client.py <device> list <remote dir>
+  bulk_client.py <device> bench [--size MB] [--dir /remote/dir]
+
+bench moves the same random file through the bulk port (PUT, GET) and
+through HTTP /upload and /download, and prints MB/s for all four in one
+table. --sndbuf/--rcvbuf set this side's socket buffers; the device side is
+tuned with POST /bulk (see src/bulk_transfer.h for the protocol).
+"""
+
+import argparse
+import http.client
+import os
+import socket
+import struct
+import sys
+import time
+import urllib.parse
+import uuid
+import zlib
+
+PORT = 9000
+REQUEST = struct.Struct("<IBBHQQ")
+RESPONSE = struct.Struct("<IIQII")
+ENTRY = struct.Struct("<BBHIQ")
+MAGIC = 0x314B4C42
+RESPONSE_MAGIC = 0x524B4C42
+CHUNK = 256 * 1024
+
+
+class BulkError(Exception):
+    pass
+
+
+class BulkClient:
+    def __init__(self, host, port=PORT, sndbuf=0, rcvbuf=0):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        if sndbuf:
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, sndbuf)
+        if rcvbuf:
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.sock.connect((host, port))
+
+    def close(self):
+        self.sock.close()
+
+    def _recv(self, n):
+        data = bytearray()
+        while len(data) < n:
+            chunk = self.sock.recv(min(n - len(data), CHUNK))
+            if not chunk:
+                raise BulkError("connection closed by device")
+            data += chunk
+        return bytes(data)
+
+    def _request(self, op, path, offset=0, length=0):
+        encoded = path.encode()
+        self.sock.sendall(REQUEST.pack(MAGIC, ord(op), 0, len(encoded), offset, length) + encoded)
+
+    def _response(self):
+        magic, status, length, crc, ms = RESPONSE.unpack(self._recv(RESPONSE.size))
+        if magic != RESPONSE_MAGIC:
+            raise BulkError("bad response magic")
+        if status:
+            raise BulkError(f"device returned status {status}")
+        return length, crc, ms
+
+    def get(self, path, out, offset=0, length=0):
+        self._request("G", path, offset, length)
+        length, _, _ = self._response()
+        remaining = length
+        while remaining:
+            chunk = self.sock.recv(min(remaining, CHUNK))
+            if not chunk:
+                raise BulkError("connection closed by device")
+            out.write(chunk)
+            remaining -= len(chunk)
+        return length
+
+    def put(self, path, data):
+        self._request("P", path, 0, len(data))
+        view = memoryview(data)
+        for start in range(0, len(data), CHUNK):
+            self.sock.sendall(view[start:start + CHUNK])
+        _, crc, ms = self._response()
+        if crc != zlib.crc32(data) & 0xFFFFFFFF:
+            raise BulkError(f"CRC32 mismatch: device {crc:08x}, local {zlib.crc32(data) & 0xFFFFFFFF:08x}")
+        return ms
+
+    def list(self, path):
+        self._request("L", path)
+        self._response()
+        entries = []
+        while True:
+            is_dir, _, name_len, mtime, size = ENTRY.unpack(self._recv(ENTRY.size))
+            if name_len == 0:
+                return entries
+            entries.append((self._recv(name_len).decode(errors="replace"), bool(is_dir), size, mtime))
+
+
+def row(name, size, seconds, device_ms=None):
+    rate = size / seconds / 1e6 if seconds > 0 else 0
+    extra = f"  (device {device_ms} ms)" if device_ms is not None else ""
+    print(f"{name:<14} {size / 1e6:8.2f} MB  {seconds:7.2f} s  {rate:7.2f} MB/s{extra}")
+
+
+class Sink:
+    def __init__(self):
+        self.data = bytearray()
+
+    def write(self, chunk):
+        self.data += chunk
+
+
+def bench(args, host):
+    directory = args.dir if args.dir.endswith("/") else args.dir + "/"
+    name = "bulk_bench.bin"
+    data = os.urandom(int(args.size * 1e6))
+
+    client = BulkClient(host, args.port, args.sndbuf, args.rcvbuf)
+    start = time.monotonic()
+    ms = client.put(directory + name, data)
+    row("bulk PUT", len(data), time.monotonic() - start, ms)
+    sink = Sink()
+    start = time.monotonic()
+    client.get(directory + name, sink)
+    row("bulk GET", len(sink.data), time.monotonic() - start)
+    client.close()
+    ok = bytes(sink.data) == data
+    if not ok:
+        print("bulk GET returned different bytes")
+
+    boundary = uuid.uuid4().hex
+    body = (f"--{boundary}\r\nContent-Disposition: form-data; name=\"path\"\r\n\r\n{directory}\r\n"
+            f"--{boundary}\r\nContent-Disposition: form-data; name=\"file\"; filename=\"{name}\"\r\n"
+            f"Content-Type: application/octet-stream\r\n\r\n").encode() + data + f"\r\n--{boundary}--\r\n".encode()
+    conn = http.client.HTTPConnection(host, timeout=60)
+    start = time.monotonic()
+    # The CRC header makes the device check what it stored; a mismatch is a 422
+    conn.request("POST", "/upload", body, {"Content-Type": f"multipart/form-data; boundary={boundary}",
+                                           "X-Content-CRC32": f"{zlib.crc32(data):08x}"})
+    response = conn.getresponse()
+    message = response.read()
+    row("HTTP /upload", len(data), time.monotonic() - start)
+    if response.status != 200:
+        print(f"HTTP /upload returned {response.status}: {message.decode(errors='replace')}")
+    ok = ok and response.status == 200
+    conn.close()
+
+    conn = http.client.HTTPConnection(host, timeout=60)
+    start = time.monotonic()
+    conn.request("GET", "/download?" + urllib.parse.urlencode({"path": directory + name}))
+    response = conn.getresponse()
+    received = response.read()
+    row("HTTP /download", len(received), time.monotonic() - start)
+    ok = ok and received == data
+    conn.close()
+
+    conn = http.client.HTTPConnection(host, timeout=60)
+    conn.request("POST", "/delete", urllib.parse.urlencode({"path": directory + name}),
+                 {"Content-Type": "application/x-www-form-urlencoded"})
+    conn.getresponse().read()
+    conn.close()
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device", help="device address, e.g. esp32.local")
+    parser.add_argument("command", choices=["get", "put", "list", "bench"])
+    parser.add_argument("paths", nargs="*")
+    parser.add_argument("--port", type=int, default=PORT)
+    parser.add_argument("--offset", type=int, default=0)
+    parser.add_argument("--length", type=int, default=0)
+    parser.add_argument("--size", type=float, default=16, help="bench file size in MB")
+    parser.add_argument("--dir", default="/", help="bench directory on the card")
+    parser.add_argument("--sndbuf", type=int, default=0)
+    parser.add_argument("--rcvbuf", type=int, default=0)
+    args = parser.parse_args()
+    host = args.device.split("://")[-1].rstrip("/")
+
+    try:
+        if args.command == "bench":
+            return bench(args, host)
+
+        client = BulkClient(host, args.port, args.sndbuf, args.rcvbuf)
+        if args.command == "get" and args.paths:
+            local = args.paths[1] if len(args.paths) > 1 else os.path.basename(args.paths[0])
+            start = time.monotonic()
+            with open(local, "wb") as f:
+                size = client.get(args.paths[0], f, args.offset, args.length)
+            row("GET", size, time.monotonic() - start)
+        elif args.command == "put" and len(args.paths) == 2:
+            with open(args.paths[0], "rb") as f:
+                data = f.read()
+            start = time.monotonic()
+            ms = client.put(args.paths[1], data)
+            row("PUT", len(data), time.monotonic() - start, ms)
+        elif args.command == "list":
+            for name, is_dir, size, mtime in client.list(args.paths[0] if args.paths else "/"):
+                stamp = time.strftime("%Y-%m-%d %H:%M", time.gmtime(mtime))
+                print(f"{'d' if is_dir else '-'} {size:>12} {stamp}  {name}")
+        else:
+            parser.print_usage()
+            return 2
+        client.close()
+    except (OSError, BulkError) as e:
+        print(f"error: {e}", file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
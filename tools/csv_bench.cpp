@@ -0,0 +1,93 @@
+// Host benchmark of the /query CSV engine (src/csv_query.*).
+//
+//   g++ -O2 -Isrc tools/csv_bench.cpp src/csv_query.cpp -o csv_bench
+//   ./csv_bench [megabytes]
+//
+// Generates a sensor log in memory, then reports the throughput of the bare
+// tokenizer and of a few typical queries in MB/s. The device reports the
+// same figures for real files in the "parseMBps" field of /query.
+
+#include "csv_query.h"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static std::string makeCsv(size_t bytes)
+{
+  static const char *sites[] = {"north", "south", "east", "west"};
+  std::string csv = "ts,site,temp,humidity,pressure\n";
+  csv.reserve(bytes + 128);
+  char line[128];
+  unsigned seed = 1;
+  for (uint32_t ts = 1700000000; csv.size() < bytes; ts++)
+  {
+    seed = seed * 1103515245 + 12345;
+    int n = snprintf(line, sizeof(line), "%u,%s,%.2f,%.1f,%u\n", ts, sites[(seed >> 16) & 3],
+                     15.0 + (seed >> 8) % 2000 / 100.0, 30.0 + (seed >> 4) % 600 / 10.0,
+                     98000 + (seed >> 12) % 4000);
+    csv.append(line, n);
+  }
+  return csv;
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void runQuery(const std::string &csv, const char *filter, const char *group, const char *aggs)
+{
+  CsvQuery query;
+  if (!query.parse(filter, group, aggs, ',', true))
+  {
+    printf("bad query: %s\n", query.lastError().c_str());
+    return;
+  }
+
+  // Feed in 256 KB blocks like the device does
+  const size_t block = 256 * 1024;
+  auto start = std::chrono::steady_clock::now();
+  size_t pos = 0;
+  while (pos < csv.size())
+  {
+    size_t len = std::min(block, csv.size() - pos);
+    bool eof = pos + len == csv.size();
+    size_t used = query.consume(csv.data() + pos, len, eof);
+    pos += used ? used : len;
+  }
+  double s = seconds(start);
+  printf("%-60s %8.1f MB/s\n", (std::string(filter) + " | " + group + " | " + aggs).c_str(),
+         csv.size() / s / 1e6);
+  printf("  %s\n", query.resultJson().substr(0, 200).c_str());
+}
+
+int main(int argc, char **argv)
+{
+  size_t mb = argc > 1 ? atoi(argv[1]) : 64;
+  std::string csv = makeCsv(mb * 1000000);
+  printf("%zu bytes of CSV\n", csv.size());
+
+  // Tokenizer alone: split every line into all of its fields
+  auto start = std::chrono::steady_clock::now();
+  CsvField fields[CSV_MAX_COLUMNS];
+  size_t total = 0;
+  const char *p = csv.data();
+  const char *end = p + csv.size();
+  while (p < end)
+  {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    const char *lineEnd = nl ? nl : end;
+    total += csvSplit(p, lineEnd, ',', fields, CSV_MAX_COLUMNS);
+    p = lineEnd + 1;
+  }
+  printf("%-60s %8.1f MB/s (%zu fields)\n", "tokenizer", csv.size() / seconds(start) / 1e6, total);
+
+  runQuery(csv, "", "", "count");
+  runQuery(csv, "", "", "min(temp),max(temp),mean(temp)");
+  runQuery(csv, "temp>25", "site", "count,mean(humidity)");
+  runQuery(csv, "ts>=1700001000,ts<1700500000", "site", "max(pressure),hist(temp:15:35:10)");
+  return 0;
+}
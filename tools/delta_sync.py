@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""Upload only the changed parts of a file to the ESP32 SD card explorer.
+
+Usage: delta_sync.py <device> <local file> <remote path> [--block N]
+
+Fetches the block signature of the device's copy (/sync/signature), finds
+matching blocks in the local file with the rsync rolling checksum and posts
+a patch of copy/literal ops (/sync/patch). See src/delta_sync.h for the
+formats.
+"""
+
+import argparse
+import hashlib
+import json
+import struct
+import sys
+import time
+import urllib.error
+import urllib.parse
+import urllib.request
+import zlib
+
+STRONG_BYTES = 16
+
+
+def weak_checksum(data):
+    a = b = 0
+    n = len(data)
+    for i, x in enumerate(data):
+        a += x
+        b += (n - i) * x
+    return (a & 0xFFFF) | ((b & 0xFFFF) << 16)
+
+
+def strong_checksum(data):
+    return hashlib.sha256(data).digest()[:STRONG_BYTES]
+
+
+def fetch_signature(base, path, block):
+    query = urllib.parse.urlencode({"path": path, "block": block})
+    try:
+        with urllib.request.urlopen(f"{base}/sync/signature?{query}") as r:
+            data = r.read()
+    except urllib.error.HTTPError as e:
+        if e.code == 404:
+            return block, 0, []
+        raise
+    magic, block_size, size, count = struct.unpack_from("<4sIQI", data, 0)
+    if magic != b"DSG1":
+        raise ValueError("bad signature header")
+    blocks = []
+    for i in range(count):
+        weak, strong = struct.unpack_from(f"<I{STRONG_BYTES}s", data, 20 + i * (4 + STRONG_BYTES))
+        length = min(block_size, size - i * block_size)
+        blocks.append((weak, strong, length))
+    return block_size, size, blocks
+
+
+def build_patch(data, block_size, blocks):
+    """Yield patch ops as ('C', first, count) or ('L', bytes)."""
+    table = {}
+    for index, (weak, strong, length) in enumerate(blocks):
+        if length == block_size:
+            table.setdefault(weak, []).append((strong, index))
+    tail = blocks[-1] if blocks and blocks[-1][2] < block_size else None
+
+    ops = []
+    literal = bytearray()
+
+    def copy(index):
+        if literal:
+            ops.append(("L", bytes(literal)))
+            literal.clear()
+        if ops and ops[-1][0] == "C" and ops[-1][1] + ops[-1][2] == index:
+            ops[-1] = ("C", ops[-1][1], ops[-1][2] + 1)
+        else:
+            ops.append(("C", index, 1))
+
+    n = len(data)
+    pos = 0
+    a = b = None
+    while pos + block_size <= n:
+        if a is None:
+            w = weak_checksum(data[pos:pos + block_size])
+            a, b = w & 0xFFFF, w >> 16
+        weak = a | (b << 16)
+        match = None
+        for strong, index in table.get(weak, ()):
+            if strong_checksum(data[pos:pos + block_size]) == strong:
+                match = index
+                break
+        if match is not None:
+            copy(match)
+            pos += block_size
+            a = None
+            continue
+        # Roll the window one byte forward
+        out = data[pos]
+        literal.append(out)
+        pos += 1
+        if pos + block_size <= n:
+            a = (a - out + data[pos + block_size - 1]) & 0xFFFF
+            b = (b - block_size * out + a) & 0xFFFF
+
+    rest = data[pos:]
+    if tail and len(rest) == tail[2] and weak_checksum(rest) == tail[0] and strong_checksum(rest) == tail[1]:
+        copy(len(blocks) - 1)
+    else:
+        literal.extend(rest)
+    if literal:
+        ops.append(("L", bytes(literal)))
+    return ops
+
+
+def encode_patch(data, block_size, ops):
+    out = bytearray(struct.pack("<4sIQI", b"DPT1", block_size, len(data), zlib.crc32(data) & 0xFFFFFFFF))
+    for op in ops:
+        if op[0] == "C":
+            out += struct.pack("<cII", b"C", op[1], op[2])
+        else:
+            out += struct.pack("<cI", b"L", len(op[1])) + op[1]
+    out += b"E"
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device", help="device address, e.g. esp32.local")
+    parser.add_argument("local")
+    parser.add_argument("remote")
+    parser.add_argument("--block", type=int, default=16384)
+    args = parser.parse_args()
+
+    base = args.device if args.device.startswith("http") else f"http://{args.device}"
+    with open(args.local, "rb") as f:
+        data = f.read()
+
+    block_size, remote_size, blocks = fetch_signature(base, args.remote, args.block)
+    ops = build_patch(data, block_size, blocks)
+    patch = encode_patch(data, block_size, ops)
+    literal = sum(len(op[1]) for op in ops if op[0] == "L")
+    print(f"{len(data)} bytes local, {remote_size} bytes on device, "
+          f"sending {len(patch)} bytes ({literal} literal)")
+
+    query = urllib.parse.urlencode({"path": args.remote})
+    request = urllib.request.Request(f"{base}/sync/patch?{query}", data=patch, method="POST",
+                                     headers={"Content-Type": "application/octet-stream"})
+    with urllib.request.urlopen(request) as r:
+        r.read()
+
+    while True:
+        with urllib.request.urlopen(f"{base}/sync/status") as r:
+            status = json.load(r)
+        state = status["job"]["state"]
+        if state != "running":
+            break
+        time.sleep(0.5)
+    print(json.dumps(status, indent=2))
+    return 0 if state == "done" else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
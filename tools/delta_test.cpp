@@ -0,0 +1,310 @@
+// Host round-trip test of the delta sync formats (src/delta_core.*).
+//
+//   g++ -O2 -std=c++17 -Isrc tools/delta_test.cpp src/delta_core.cpp src/hash_kernels.cpp -o delta_test
+//   ./delta_test
+//
+// Builds the signature of an "old" file with the device's code, derives a
+// patch for an edited "new" file the way tools/delta_sync.py does (rolling
+// weak checksum, then the strong hash), rebuilds the new file with the
+// device's deltaRebuild() and compares. Also checks that damaged patches
+// are refused. Exits non-zero on the first failure.
+
+#include "delta_core.h"
+#include "hash_kernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::vector<uint8_t> Bytes;
+
+static void putU32(Bytes &out, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    out.push_back(v >> (i * 8));
+  }
+}
+
+static uint32_t getU32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static Bytes signature(const Bytes &file, uint32_t blockSize)
+{
+  uint32_t blocks = (file.size() + blockSize - 1) / blockSize;
+  Bytes sig(DELTA_SIGNATURE_HEADER + (size_t)blocks * DELTA_SIGNATURE_ENTRY);
+  deltaSignatureHeader(sig.data(), blockSize, file.size());
+  // In uneven pieces of whole blocks, like the device's read buffer
+  size_t out = DELTA_SIGNATURE_HEADER;
+  for (size_t pos = 0; pos < file.size();)
+  {
+    size_t n = std::min(file.size() - pos, (size_t)blockSize * (1 + pos % 3));
+    out += deltaSignatureBlocks(file.data() + pos, n, blockSize, sig.data() + out);
+    pos += n;
+  }
+  return sig;
+}
+
+static std::string strongOf(const uint8_t *data, size_t len)
+{
+  uint8_t digest[HASH_MAX_DIGEST];
+  Hasher h(HASH_SHA256);
+  h.update(data, len);
+  h.finish(digest);
+  return std::string((const char *)digest, DELTA_STRONG_BYTES);
+}
+
+static uint32_t crcOf(const Bytes &data)
+{
+  Hasher h(HASH_CRC32);
+  h.update(data.data(), data.size());
+  return h.crc32();
+}
+
+static void flushLiteral(Bytes &patch, Bytes &literal)
+{
+  if (literal.empty())
+  {
+    return;
+  }
+  patch.push_back('L');
+  putU32(patch, literal.size());
+  patch.insert(patch.end(), literal.begin(), literal.end());
+  literal.clear();
+}
+
+// Client side, as in tools/delta_sync.py: whole-block matches only
+static Bytes makePatch(const Bytes &sig, const Bytes &data, uint32_t *copiedBlocks)
+{
+  uint32_t blockSize = getU32(sig.data() + 4);
+  uint64_t oldSize = getU32(sig.data() + 8) | ((uint64_t)getU32(sig.data() + 12) << 32);
+  uint32_t count = getU32(sig.data() + 16);
+  std::multimap<uint32_t, std::pair<uint32_t, std::string>> blocks;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if ((uint64_t)(i + 1) * blockSize > oldSize)
+    {
+      break; // short last block
+    }
+    const uint8_t *e = sig.data() + DELTA_SIGNATURE_HEADER + (size_t)i * DELTA_SIGNATURE_ENTRY;
+    blocks.insert({getU32(e), {i, std::string((const char *)e + 4, DELTA_STRONG_BYTES)}});
+  }
+
+  Bytes patch = {'D', 'P', 'T', '1'};
+  putU32(patch, blockSize);
+  putU32(patch, (uint32_t)data.size());
+  putU32(patch, (uint32_t)((uint64_t)data.size() >> 32));
+  putU32(patch, crcOf(data));
+
+  Bytes literal;
+  *copiedBlocks = 0;
+  size_t pos = 0;
+  uint32_t a = 0, b = 0;
+  bool rolling = false;
+  while (pos + blockSize <= data.size())
+  {
+    if (!rolling)
+    {
+      uint32_t weak = deltaWeakChecksum(data.data() + pos, blockSize);
+      a = weak & 0xFFFF;
+      b = weak >> 16;
+      rolling = true;
+    }
+    uint32_t weak = (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+    int64_t match = -1;
+    auto range = blocks.equal_range(weak);
+    if (range.first != range.second)
+    {
+      std::string strong = strongOf(data.data() + pos, blockSize);
+      for (auto it = range.first; it != range.second; ++it)
+      {
+        if (it->second.second == strong)
+        {
+          match = it->second.first;
+          break;
+        }
+      }
+    }
+    if (match >= 0)
+    {
+      flushLiteral(patch, literal);
+      patch.push_back('C');
+      putU32(patch, (uint32_t)match);
+      putU32(patch, 1);
+      (*copiedBlocks)++;
+      pos += blockSize;
+      rolling = false;
+      continue;
+    }
+    // Roll one byte on
+    uint8_t out = data[pos];
+    literal.push_back(out);
+    pos++;
+    if (pos + blockSize <= data.size())
+    {
+      uint8_t in = data[pos + blockSize - 1];
+      a = a - out + in;
+      b = b - blockSize * out + a;
+    }
+  }
+  literal.insert(literal.end(), data.begin() + pos, data.end());
+  flushLiteral(patch, literal);
+  patch.push_back('E');
+  return patch;
+}
+
+static const char *rebuild(const Bytes &oldFile, const Bytes &patch, Bytes &out, DeltaPatchResult &result)
+{
+  size_t patchPos = 0;
+  DeltaPatchIo io;
+  io.readPatch = [&](uint8_t *buffer, size_t len)
+  {
+    if (patchPos + len > patch.size())
+    {
+      return false;
+    }
+    memcpy(buffer, patch.data() + patchPos, len);
+    patchPos += len;
+    return true;
+  };
+  io.readOld = [&](uint64_t offset, uint8_t *buffer, size_t len)
+  {
+    if (offset + len > oldFile.size())
+    {
+      return false;
+    }
+    memcpy(buffer, oldFile.data() + offset, len);
+    return true;
+  };
+  io.write = [&](const uint8_t *data, size_t len)
+  {
+    out.insert(out.end(), data, data + len);
+    return true;
+  };
+  out.clear();
+  // Smaller than a block, so copies take several reads
+  Bytes buffer(3000);
+  return deltaRebuild(io, oldFile.size(), buffer.data(), buffer.size(), result);
+}
+
+static uint32_t seed = 12345;
+
+static uint8_t nextByte()
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+static Bytes randomBytes(size_t len)
+{
+  Bytes data(len);
+  for (uint8_t &x : data)
+  {
+    x = nextByte();
+  }
+  return data;
+}
+
+static int failures = 0;
+static int checks = 0;
+
+static void expect(bool ok, const char *what)
+{
+  checks++;
+  if (!ok)
+  {
+    printf("FAIL %s\n", what);
+    failures++;
+  }
+}
+
+static void roundTrip(const char *name, const Bytes &oldFile, const Bytes &newFile, uint32_t blockSize,
+                      bool expectReuse)
+{
+  uint32_t copied;
+  Bytes patch = makePatch(signature(oldFile, blockSize), newFile, &copied);
+  Bytes out;
+  DeltaPatchResult result;
+  const char *error = rebuild(oldFile, patch, out, result);
+  bool ok = error == nullptr && out == newFile && result.newSize == newFile.size() &&
+            result.copiedBytes + result.literalBytes == newFile.size() && (!expectReuse || copied > 0);
+  printf("%-28s %7zu -> %7zu bytes, patch %7zu bytes, %u blocks reused%s%s\n", name, oldFile.size(),
+         newFile.size(), patch.size(), copied, error ? ", error: " : "", error ? error : "");
+  expect(ok, name);
+}
+
+int main()
+{
+  const uint32_t block = 1024;
+  Bytes base = randomBytes(200 * 1024 + 123);
+
+  roundTrip("identical", base, base, block, true);
+
+  Bytes edited = base;
+  for (size_t i = 5000; i < 5100; i++)
+  {
+    edited[i] ^= 0x5A;
+  }
+  roundTrip("bytes changed", base, edited, block, true);
+
+  Bytes inserted = base;
+  Bytes extra = randomBytes(777);
+  inserted.insert(inserted.begin() + 70000, extra.begin(), extra.end());
+  roundTrip("bytes inserted (unaligned)", base, inserted, block, true);
+
+  Bytes removed = base;
+  removed.erase(removed.begin() + 1000, removed.begin() + 4321);
+  roundTrip("bytes removed", base, removed, block, true);
+
+  Bytes appended = base;
+  Bytes tail = randomBytes(50000);
+  appended.insert(appended.end(), tail.begin(), tail.end());
+  roundTrip("appended", base, appended, block, true);
+
+  roundTrip("truncated", base, Bytes(base.begin(), base.begin() + 9999), block, true);
+  roundTrip("no old file", Bytes(), base, block, false);
+  roundTrip("new file empty", base, Bytes(), block, false);
+  roundTrip("largest block size", base, edited, DELTA_MAX_BLOCK, true);
+  roundTrip("smallest block size", base, inserted, DELTA_MIN_BLOCK, true);
+
+  // Damaged patches must be refused
+  uint32_t copied;
+  Bytes good = makePatch(signature(base, block), edited, &copied);
+  Bytes out;
+  DeltaPatchResult result;
+
+  Bytes badCrc = good;
+  badCrc[16] ^= 1;
+  const char *error = rebuild(base, badCrc, out, result);
+  expect(error && strcmp(error, "result CRC32 mismatch") == 0, "wrong CRC32 refused");
+
+  Bytes shortPatch(good.begin(), good.end() - 1); // no 'E'
+  error = rebuild(base, shortPatch, out, result);
+  expect(error && strcmp(error, "truncated patch") == 0, "truncated patch refused");
+
+  Bytes badMagic = good;
+  badMagic[0] = 'X';
+  error = rebuild(base, badMagic, out, result);
+  expect(error && strcmp(error, "bad patch header") == 0, "bad header refused");
+
+  Bytes outside(good.begin(), good.begin() + DELTA_PATCH_HEADER);
+  outside.push_back('C');
+  putU32(outside, 100000);
+  putU32(outside, 1);
+  outside.push_back('E');
+  error = rebuild(base, outside, out, result);
+  expect(error && strcmp(error, "copy outside the device's file") == 0, "copy outside the file refused");
+
+  Bytes smallBlock = good;
+  smallBlock[4] = 1;
+  smallBlock[5] = 0;
+  error = rebuild(base, smallBlock, out, result);
+  expect(error && strcmp(error, "bad block size") == 0, "bad block size refused");
+
+  printf("%d of %d checks passed\n", checks - failures, checks);
+  return failures ? 1 : 0;
+}
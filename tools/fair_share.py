@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Check how concurrent downloads share the device's bandwidth.
+
+Usage: fair_share.py <device> --file /big.bin [--weights 1,1,2] [--seconds 15]
+                     [--global-rate B/s] [--client-rate B/s]
+
+Starts one /download stream per entry of --weights (each with that weight)
+and reports every stream's MB/s next to its expected share, Jain's fairness
+index over the weight-normalised rates, and the per-flow rates the device
+itself reports in GET /egress. --global-rate/--client-rate are applied with
+POST /egress before the run; 0 removes a limit.
+"""
+
+import argparse
+import http.client
+import json
+import sys
+import threading
+import time
+import urllib.parse
+
+
+class Stream(threading.Thread):
+    def __init__(self, host, path, weight, stop):
+        super().__init__(daemon=True)
+        self.host, self.path, self.weight, self.stop = host, path, weight, stop
+        self.bytes = 0
+
+    def run(self):
+        while not self.stop.is_set():
+            conn = http.client.HTTPConnection(self.host, timeout=60)
+            query = urllib.parse.urlencode({"path": self.path, "weight": self.weight})
+            conn.request("GET", f"/download?{query}")
+            response = conn.getresponse()
+            while not self.stop.is_set():
+                chunk = response.read(16384)
+                if not chunk:
+                    break
+                self.bytes += len(chunk)
+            conn.close()
+
+
+def post(host, path, fields):
+    conn = http.client.HTTPConnection(host, timeout=30)
+    conn.request("POST", path, urllib.parse.urlencode(fields), {"Content-Type": "application/x-www-form-urlencoded"})
+    response = conn.getresponse()
+    body = response.read().decode(errors="replace")
+    conn.close()
+    if response.status != 200:
+        raise RuntimeError(f"{path}: {response.status} {body}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device", help="device address, e.g. esp32.local")
+    parser.add_argument("--file", required=True, help="large file on the card")
+    parser.add_argument("--weights", default="1,1", help="comma separated weight per stream")
+    parser.add_argument("--seconds", type=float, default=15)
+    parser.add_argument("--global-rate", type=int)
+    parser.add_argument("--client-rate", type=int)
+    args = parser.parse_args()
+    host = args.device.split("://")[-1].rstrip("/")
+    weights = [int(w) for w in args.weights.split(",")]
+
+    limits = {}
+    if args.global_rate is not None:
+        limits["globalRate"] = args.global_rate
+    if args.client_rate is not None:
+        limits["clientRate"] = args.client_rate
+    if limits:
+        post(host, "/egress", limits)
+
+    stop = threading.Event()
+    streams = [Stream(host, args.file, w, stop) for w in weights]
+    for stream in streams:
+        stream.start()
+    time.sleep(2)  # past slow start
+    before = [s.bytes for s in streams]
+    start = time.monotonic()
+    time.sleep(args.seconds)
+    elapsed = time.monotonic() - start
+    rates = [(s.bytes - b) / elapsed / 1e6 for s, b in zip(streams, before)]
+
+    conn = http.client.HTTPConnection(host, timeout=30)
+    conn.request("GET", "/egress")
+    egress = json.loads(conn.getresponse().read())
+    conn.close()
+    stop.set()
+
+    total = sum(rates)
+    for i, (w, r) in enumerate(zip(weights, rates)):
+        expected = total * w / sum(weights)
+        print(f"stream {i}  weight {w:2d}  {r:6.2f} MB/s  expected {expected:6.2f} MB/s")
+    normalised = [r / w for w, r in zip(weights, rates)]
+    jain = sum(normalised) ** 2 / (len(normalised) * sum(x * x for x in normalised)) if total else 0
+    print(f"total {total:.2f} MB/s, Jain fairness {jain:.3f}")
+    for flow in egress.get("active", []):
+        print(f"device flow {flow['id']:4d}  {flow['client']:<15} weight {flow['weight']:2d}"
+              f"  {flow['rate'] / 1e6:6.2f} MB/s  throttled {flow['throttled']}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""Measure /list latency while the SD card is saturated by a download.
+
+Usage: io_latency.py <device> --file /big.bin [--dir /] [--seconds 20]
+                     [--streams 1] [--bulk]
+
+Keeps --streams downloads of --file running (HTTP /download, or the bulk
+port with --bulk), first measures /list on an idle card for comparison, then
+requests /list of --dir back to back under load and prints p50/p99/max.
+Finally prints the per-class queue statistics from GET /io, which are reset
+before the loaded run.
+"""
+
+import argparse
+import http.client
+import json
+import os
+import sys
+import threading
+import time
+import urllib.parse
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from bulk_client import BulkClient  # noqa: E402
+
+
+def list_once(host, directory):
+    conn = http.client.HTTPConnection(host, timeout=30)
+    start = time.monotonic()
+    conn.request("GET", "/list?" + urllib.parse.urlencode({"dir": directory, "cursor": 0, "limit": 100}))
+    response = conn.getresponse()
+    response.read()
+    conn.close()
+    if response.status != 200:
+        raise RuntimeError(f"/list returned {response.status}")
+    return (time.monotonic() - start) * 1000
+
+
+def measure(host, directory, seconds):
+    samples = []
+    end = time.monotonic() + seconds
+    while time.monotonic() < end:
+        samples.append(list_once(host, directory))
+        time.sleep(0.05)
+    return samples
+
+
+def summary(name, samples):
+    samples = sorted(samples)
+    if not samples:
+        print(f"{name:<10} no samples")
+        return 0
+    pick = lambda pct: samples[min(len(samples) - 1, (len(samples) * pct + 99) // 100 - 1)]
+    print(f"{name:<10} {len(samples):5d} requests  p50 {pick(50):7.1f} ms  p99 {pick(99):7.1f} ms"
+          f"  max {samples[-1]:7.1f} ms")
+    return pick(99)
+
+
+class Loader(threading.Thread):
+    """Downloads the file over and over until stopped."""
+
+    def __init__(self, host, path, bulk):
+        super().__init__(daemon=True)
+        self.host, self.path, self.bulk = host, path, bulk
+        self.stop = threading.Event()
+        self.bytes = 0
+
+    def run(self):
+        while not self.stop.is_set():
+            try:
+                if self.bulk:
+                    self.run_bulk()
+                else:
+                    self.run_http()
+            except OSError as e:
+                print(f"download failed: {e}", file=sys.stderr)
+                time.sleep(1)
+
+    def run_http(self):
+        conn = http.client.HTTPConnection(self.host, timeout=60)
+        conn.request("GET", "/download?" + urllib.parse.urlencode({"path": self.path}))
+        response = conn.getresponse()
+        while not self.stop.is_set():
+            chunk = response.read(65536)
+            if not chunk:
+                break
+            self.bytes += len(chunk)
+        conn.close()
+
+    def write(self, chunk):
+        self.bytes += len(chunk)
+
+    def run_bulk(self):
+        client = BulkClient(self.host)
+        client.get(self.path, self)
+        client.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device", help="device address, e.g. esp32.local")
+    parser.add_argument("--file", required=True, help="large file on the card to download")
+    parser.add_argument("--dir", default="/", help="directory to list")
+    parser.add_argument("--seconds", type=float, default=20)
+    parser.add_argument("--streams", type=int, default=1)
+    parser.add_argument("--bulk", action="store_true", help="load the card through the bulk port")
+    args = parser.parse_args()
+    host = args.device.split("://")[-1].rstrip("/")
+
+    summary("idle", measure(host, args.dir, min(args.seconds, 5)))
+
+    loaders = [Loader(host, args.file, args.bulk) for _ in range(args.streams)]
+    for loader in loaders:
+        loader.start()
+    time.sleep(2)
+    conn = http.client.HTTPConnection(host, timeout=30)
+    conn.request("POST", "/io", "action=reset", {"Content-Type": "application/x-www-form-urlencoded"})
+    conn.getresponse().read()
+    conn.close()
+
+    start = time.monotonic()
+    before = sum(loader.bytes for loader in loaders)
+    p99 = summary("loaded", measure(host, args.dir, args.seconds))
+    rate = (sum(loader.bytes for loader in loaders) - before) / (time.monotonic() - start) / 1e6
+    print(f"download   {rate:.2f} MB/s over {args.streams} stream(s)")
+    for loader in loaders:
+        loader.stop.set()
+
+    conn = http.client.HTTPConnection(host, timeout=30)
+    conn.request("GET", "/io")
+    io = json.loads(conn.getresponse().read())
+    conn.close()
+    for name, c in io.get("classes", {}).items():
+        print(f"{name:<12} grants {c['grants']:7d}  wait avg {c['avgWaitMs']:6.2f} p99 {c['p99WaitMs']:6.2f}"
+              f" max {c['maxWaitMs']:7.2f} ms  max depth {c['maxDepth']}  busy {c['busyMs']} ms")
+    return 0 if p99 < 100 else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
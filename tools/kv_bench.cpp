@@ -0,0 +1,239 @@
+// Host benchmark of the key/value store (src/kv_store.*).
+//
+//   g++ -O2 -std=c++17 -pthread -Isrc tools/kv_bench.cpp src/kv_store.cpp -o kv_bench
+//   ./kv_bench [records] [value bytes] [directory]
+//
+// Writes random keys with a background maintenance thread like the device's
+// worker task, then reports put/get/scan throughput and latency percentiles,
+// and checks every key against an in-memory map before and after reopening
+// the store. The device runs a smaller version of the same workload from
+// /test-performance.
+
+#include "kv_store.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *label, size_t ops, double total, std::vector<double> &latency)
+{
+  std::sort(latency.begin(), latency.end());
+  double p50 = latency.empty() ? 0 : latency[latency.size() / 2];
+  double p99 = latency.empty() ? 0 : latency[latency.size() * 99 / 100];
+  double max = latency.empty() ? 0 : latency.back();
+  printf("%-12s %9zu ops  %10.0f ops/s  p50 %7.1f us  p99 %7.1f us  max %8.1f us\n", label, ops,
+         ops / total, p50 * 1e6, p99 * 1e6, max * 1e6);
+}
+
+static std::string makeKey(uint32_t n)
+{
+  char key[32];
+  snprintf(key, sizeof(key), "asset/%08x", n * 2654435761u);
+  return key;
+}
+
+// Background maintenance thread, woken through KvOptions::wake
+struct Worker
+{
+  std::mutex m;
+  std::condition_variable cv;
+  bool pending = false;
+  bool stop = false;
+  std::thread thread;
+
+  void start(KvStore &store)
+  {
+    thread = std::thread([this, &store] {
+      std::unique_lock<std::mutex> held(m);
+      while (!stop)
+      {
+        cv.wait(held, [this] { return pending || stop; });
+        pending = false;
+        held.unlock();
+        while (store.maintenance())
+        {
+        }
+        held.lock();
+      }
+    });
+  }
+
+  void wake()
+  {
+    std::lock_guard<std::mutex> held(m);
+    pending = true;
+    cv.notify_one();
+  }
+
+  void join()
+  {
+    {
+      std::lock_guard<std::mutex> held(m);
+      stop = true;
+      cv.notify_one();
+    }
+    thread.join();
+  }
+};
+
+static bool verify(KvStore &store, const std::map<std::string, std::string> &model, uint32_t records)
+{
+  std::string value;
+  for (uint32_t i = 0; i < records; i++)
+  {
+    std::string key = makeKey(i);
+    auto it = model.find(key);
+    bool found = store.get(key, value);
+    if (found != (it != model.end()) || (found && value != it->second))
+    {
+      printf("mismatch at %s\n", key.c_str());
+      return false;
+    }
+  }
+  size_t scanned = 0;
+  auto it = model.begin();
+  bool ordered = true;
+  store.scan("", "", SIZE_MAX, [&](const std::string &key, const std::string &v) {
+    ordered = ordered && it != model.end() && it->first == key && it->second == v;
+    ++it;
+    scanned++;
+    return true;
+  });
+  if (!ordered || scanned != model.size())
+  {
+    printf("scan mismatch: %zu of %zu keys\n", scanned, model.size());
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t records = argc > 1 ? atoi(argv[1]) : 200000;
+  size_t valueBytes = argc > 2 ? atoi(argv[2]) : 100;
+  std::string dir = argc > 3 ? argv[3] : "kv_bench.db";
+  system(("rm -rf " + dir).c_str());
+
+  Worker worker;
+  KvOptions options;
+  options.wake = [&worker] { worker.wake(); };
+  KvStore store;
+  if (!store.open(dir, options))
+  {
+    printf("open failed: %s\n", store.lastError().c_str());
+    return 1;
+  }
+  worker.start(store);
+
+  std::map<std::string, std::string> model;
+  std::vector<double> latency;
+  latency.reserve(records);
+  std::string value(valueBytes, 'v');
+  unsigned seed = 7;
+
+  // Random inserts, a fifth of them overwriting earlier keys
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < records; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    uint32_t n = i % 5 == 4 ? (seed >> 8) % (i + 1) : i;
+    std::string key = makeKey(n);
+    snprintf(&value[0], valueBytes, "%u:%u", n, i);
+    auto t = std::chrono::steady_clock::now();
+    if (!store.put(key, value))
+    {
+      printf("put failed: %s\n", store.lastError().c_str());
+      return 1;
+    }
+    latency.push_back(seconds(t));
+    model[key] = value;
+  }
+  report("put", records, seconds(start), latency);
+
+  // Deletes
+  latency.clear();
+  start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < records; i += 10)
+  {
+    std::string key = makeKey(i);
+    auto t = std::chrono::steady_clock::now();
+    store.remove(key);
+    latency.push_back(seconds(t));
+    model.erase(key);
+  }
+  report("delete", latency.size(), seconds(start), latency);
+
+  // Point lookups: existing, deleted and never written keys
+  latency.clear();
+  start = std::chrono::steady_clock::now();
+  std::string out;
+  size_t hits = 0;
+  for (uint32_t i = 0; i < records; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    uint32_t n = (seed >> 4) % (records + records / 4);
+    auto t = std::chrono::steady_clock::now();
+    hits += store.get(makeKey(n), out);
+    latency.push_back(seconds(t));
+  }
+  report("get", records, seconds(start), latency);
+
+  // Range scans of 100 keys
+  latency.clear();
+  start = std::chrono::steady_clock::now();
+  size_t scanned = 0;
+  for (int i = 0; i < 1000; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    char from[16];
+    snprintf(from, sizeof(from), "asset/%02x", (seed >> 8) & 0xFF);
+    auto t = std::chrono::steady_clock::now();
+    scanned += store.scan(from, "", 100, [](const std::string &, const std::string &) { return true; });
+    latency.push_back(seconds(t));
+  }
+  report("scan x100", 1000, seconds(start), latency);
+
+  store.flush();
+  worker.wake();
+  while (store.maintenance())
+  {
+  }
+  KvStats stats = store.getStats();
+  printf("segments %u (%llu bytes, %llu entries), flushes %llu, compactions %llu, written %.1f MB, "
+         "stall %.1f ms, bloom skips %llu, block reads %llu, cache hits %llu, get hits %zu\n",
+         stats.segments, (unsigned long long)stats.segmentBytes, (unsigned long long)stats.segmentEntries,
+         (unsigned long long)stats.flushes, (unsigned long long)stats.compactions,
+         (stats.bytesFlushed + stats.bytesCompacted) / 1e6, stats.stallUs / 1e3,
+         (unsigned long long)stats.bloomSkips, (unsigned long long)stats.blockReads,
+         (unsigned long long)stats.cacheHits, hits);
+
+  // Left in the memtable for the reopen below
+  for (uint32_t i = 0; i < records; i += 97)
+  {
+    std::string key = makeKey(i);
+    store.put(key, "after flush");
+    model[key] = "after flush";
+  }
+
+  bool ok = verify(store, model, records + records / 4);
+  worker.join();
+  store.close();
+
+  // Reopen: the last memtable comes back from its log
+  KvStore again;
+  ok = ok && again.open(dir) && verify(again, model, records + records / 4);
+  printf("verify %s\n", ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+// Host benchmark of the LZ4 block codec behind the compressed storage tier
+// (src/lz4_block.*).
+//
+//   g++ -O2 -Isrc tools/lz4_bench.cpp src/lz4_block.cpp -o lz4_bench
+//   ./lz4_bench [file ...]
+//
+// Compresses generated CSV, log and random data (or the given files) in
+// 64 KB blocks like the .lz4b format, checks the round trip and reports the
+// ratio and MB/s in both directions. With a card that sustains `card` MB/s,
+// a compressed transfer runs at about min(card * ratio, codec MB/s).
+
+#include "lz4_block.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const size_t BLOCK = 64 * 1024;
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string makeCsv(size_t bytes)
+{
+  static const char *sites[] = {"north", "south", "east", "west"};
+  std::string out = "ts,site,temp,humidity,pressure\n";
+  char line[128];
+  unsigned seed = 1;
+  for (uint32_t ts = 1700000000; out.size() < bytes; ts++)
+  {
+    seed = seed * 1103515245 + 12345;
+    int n = snprintf(line, sizeof(line), "%u,%s,%.2f,%.1f,%u\n", ts, sites[(seed >> 16) & 3],
+                     15.0 + (seed >> 8) % 2000 / 100.0, 30.0 + (seed >> 4) % 600 / 10.0,
+                     98000 + (seed >> 12) % 4000);
+    out.append(line, n);
+  }
+  return out;
+}
+
+static std::string makeLog(size_t bytes)
+{
+  static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "ERROR"};
+  static const char *messages[] = {"Upload Complete: /logs/sensor.csv", "WiFi reconnected",
+                                   "Block cache flush", "Heap low watermark", "SD write retry"};
+  std::string out;
+  char line[160];
+  unsigned seed = 3;
+  for (uint32_t ms = 0; out.size() < bytes; ms += 17)
+  {
+    seed = seed * 1103515245 + 12345;
+    int n = snprintf(line, sizeof(line), "[%10u] %-5s %s (%u bytes, %u ms)\n", ms, levels[(seed >> 8) % 5],
+                     messages[(seed >> 12) % 5], (seed >> 4) % 65536, (seed >> 20) % 1000);
+    out.append(line, n);
+  }
+  return out;
+}
+
+static std::string makeRandom(size_t bytes)
+{
+  std::string out(bytes, '\0');
+  unsigned seed = 5;
+  for (size_t i = 0; i < bytes; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    out[i] = (char)(seed >> 16);
+  }
+  return out;
+}
+
+static bool run(const char *label, const std::string &data)
+{
+  std::vector<uint8_t> table(LZ4_TABLE_BYTES);
+  std::vector<uint8_t> packed(lz4CompressBound(BLOCK));
+  std::vector<uint8_t> unpacked(BLOCK);
+  std::vector<std::vector<uint8_t>> blocks;
+
+  auto start = std::chrono::steady_clock::now();
+  size_t stored = 0;
+  for (size_t pos = 0; pos < data.size(); pos += BLOCK)
+  {
+    size_t len = std::min(BLOCK, data.size() - pos);
+    size_t n = lz4Compress((const uint8_t *)data.data() + pos, len, packed.data(), packed.size(), table.data());
+    if (n == 0 || n >= len)
+    {
+      // Stored raw, as the file format does
+      blocks.emplace_back(data.begin() + pos, data.begin() + pos + len);
+      blocks.back().push_back(0);
+    }
+    else
+    {
+      blocks.emplace_back(packed.begin(), packed.begin() + n);
+      blocks.back().push_back(1);
+    }
+    stored += blocks.back().size() - 1 + 4;
+  }
+  double compressS = seconds(start);
+
+  start = std::chrono::steady_clock::now();
+  bool ok = true;
+  size_t pos = 0;
+  for (auto &b : blocks)
+  {
+    size_t len = std::min(BLOCK, data.size() - pos);
+    if (b.back())
+    {
+      int n = lz4Decompress(b.data(), b.size() - 1, unpacked.data(), unpacked.size());
+      ok = ok && n == (int)len && memcmp(unpacked.data(), data.data() + pos, len) == 0;
+    }
+    else
+    {
+      ok = ok && memcmp(b.data(), data.data() + pos, len) == 0;
+    }
+    pos += len;
+  }
+  double decompressS = seconds(start);
+
+  printf("%-14s %8.1f MB  ratio %5.2fx  compress %7.1f MB/s  decompress %7.1f MB/s  %s\n", label,
+         data.size() / 1e6, data.size() / (double)stored, data.size() / 1e6 / compressS,
+         data.size() / 1e6 / decompressS, ok ? "ok" : "ROUND TRIP FAILED");
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  bool ok = true;
+  if (argc > 1)
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      FILE *f = fopen(argv[i], "rb");
+      if (!f)
+      {
+        printf("cannot open %s\n", argv[i]);
+        continue;
+      }
+      std::string data;
+      char buf[65536];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      {
+        data.append(buf, n);
+      }
+      fclose(f);
+      ok = run(argv[i], data) && ok;
+    }
+    return ok ? 0 : 1;
+  }
+
+  const size_t size = 16 * 1024 * 1024;
+  ok = run("csv", makeCsv(size)) && ok;
+  ok = run("log", makeLog(size)) && ok;
+  ok = run("random", makeRandom(size)) && ok;
+  ok = run("zeros", std::string(size, '\0')) && ok;
+  ok = run("tiny", "abcabcabcabcabcabc") && ok;
+  return ok ? 0 : 1;
+}
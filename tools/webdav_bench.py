@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Measure WebDAV throughput of the ESP32 SD card explorer.
+
+Usage: webdav_bench.py <device> [--size MB] [--dir /remote/dir]
+
+PUTs a file of random bytes to /dav, GETs it back, lists the directory with
+PROPFIND Depth 1 and deletes the file, then moves the same bytes through
+/upload and /download so both paths are measured in the same run. Any
+WebDAV client gives comparable numbers, e.g.
+
+    curl -T big.bin http://esp32.local/dav/big.bin
+    curl -o /dev/null http://esp32.local/dav/big.bin
+"""
+
+import argparse
+import http.client
+import os
+import sys
+import time
+import urllib.parse
+import uuid
+
+
+def connect(host):
+    return http.client.HTTPConnection(host, timeout=60)
+
+
+def timed(host, method, path, body=None, headers=None):
+    """Run one request; returns (status, response bytes, seconds)."""
+    conn = connect(host)
+    start = time.monotonic()
+    conn.request(method, urllib.parse.quote(path), body=body, headers=headers or {})
+    response = conn.getresponse()
+    data = response.read()
+    seconds = time.monotonic() - start
+    conn.close()
+    return response.status, data, seconds
+
+
+def report(name, status, size, seconds, expect):
+    ok = status in expect
+    rate = size / seconds / 1e6 if seconds > 0 else 0
+    print(f"{name:<18} {status:>4}  {size / 1e6:8.2f} MB  {seconds:7.2f} s  {rate:6.2f} MB/s"
+          f"{'' if ok else '  FAILED'}")
+    return ok
+
+
+def multipart(directory, name, data):
+    boundary = uuid.uuid4().hex
+    head = (f"--{boundary}\r\nContent-Disposition: form-data; name=\"path\"\r\n\r\n{directory}\r\n"
+            f"--{boundary}\r\nContent-Disposition: form-data; name=\"file\"; filename=\"{name}\"\r\n"
+            f"Content-Type: application/octet-stream\r\n\r\n").encode()
+    tail = f"\r\n--{boundary}--\r\n".encode()
+    return head + data + tail, f"multipart/form-data; boundary={boundary}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device", help="device address, e.g. esp32.local")
+    parser.add_argument("--size", type=float, default=8, help="test file size in MB")
+    parser.add_argument("--dir", default="/", help="directory on the card")
+    args = parser.parse_args()
+
+    host = args.device.split("://")[-1].rstrip("/")
+    directory = args.dir if args.dir.endswith("/") else args.dir + "/"
+    data = os.urandom(int(args.size * 1e6))
+    name = "webdav_bench.bin"
+    dav = "/dav" + directory + name
+    ok = True
+
+    status, _, seconds = timed(host, "PUT", dav, data, {"Content-Type": "application/octet-stream"})
+    ok = report("WebDAV PUT", status, len(data), seconds, (200, 201, 204)) and ok
+    status, body, seconds = timed(host, "GET", dav)
+    ok = report("WebDAV GET", status, len(body), seconds, (200,)) and ok
+    if body != data:
+        print("WebDAV GET returned different bytes")
+        ok = False
+    status, body, seconds = timed(host, "PROPFIND", "/dav" + directory, headers={"Depth": "1"})
+    entries = body.count(b"<D:response>")
+    print(f"{'PROPFIND Depth 1':<18} {status:>4}  {entries} entries, {len(body)} bytes in {seconds:.2f} s")
+    ok = status == 207 and ok
+    status, _, _ = timed(host, "DELETE", dav)
+    ok = status == 204 and ok
+
+    body, content_type = multipart(directory, name, data)
+    status, _, seconds = timed(host, "POST", "/upload", body, {"Content-Type": content_type})
+    ok = report("/upload", status, len(data), seconds, (200,)) and ok
+    query = urllib.parse.urlencode({"path": directory + name})
+    conn = connect(host)
+    start = time.monotonic()
+    conn.request("GET", f"/download?{query}")
+    response = conn.getresponse()
+    body = response.read()
+    ok = report("/download", response.status, len(body), time.monotonic() - start, (200,)) and ok
+    conn.close()
+    timed(host, "DELETE", dav)
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())